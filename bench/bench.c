@@ -0,0 +1,542 @@
+/*
+Copyright: Boaz Segev, 2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+
+/**
+ * Micro benchmarks for iodine's hot paths (the C layer, without Ruby).
+ *
+ * Build using `bench/extconf.rb` (or `rake bench`), then run:
+ *
+ *      ./iodine_bench [-t seconds] [-o results.json] [filter...]
+ *
+ * Each benchmark runs for (about) the requested time (0.5 seconds by default).
+ * Results are printed in a human readable form to `stderr` and in JSON to
+ * `stdout` (or the `-o` file), so results can be compared between releases.
+ *
+ * `http1.c` is included (rather than linked) so the static `headers2str` can
+ * be measured.
+ */
+#include "http1.c"
+
+#include "defer.h"
+#include "fio_hashmap.h"
+#include "fio_mem.h"
+#include "fiobj.h"
+#include "pubsub.h"
+#include "websocket_parser.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+void http_lib_init(void);
+
+/* *****************************************************************************
+Benchmark runner
+***************************************************************************** */
+
+typedef struct {
+  /** the benchmark's name (used in the results). */
+  const char *name;
+  /** performs `count` operations. */
+  void (*run)(size_t count);
+  /** called once before the benchmark runs (optional). */
+  void (*setup)(void);
+  /** called once after the benchmark ran (optional). */
+  void (*cleanup)(void);
+  /** the number of bytes processed by each operation (0 if irrelevant). */
+  size_t bytes;
+} bench_s;
+
+static double bench_seconds = 0.5;
+static FILE *bench_results;
+static size_t bench_count;
+
+/*
+ * Results are added to the (volatile) sink and buffers are passed to
+ * `bench_escape`, so the compiler can't discard work whose result is unused
+ * (or hoist work that repeats with the same input out of the loop).
+ */
+static volatile uintptr_t bench_sink;
+
+/* tells the compiler that `ptr`'s memory is read (and edited) by unknown code */
+static inline void bench_escape(void *ptr) {
+  __asm__ volatile("" : : "r"(ptr) : "memory");
+}
+
+static inline double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + (t.tv_nsec / 1000000000.0);
+}
+
+static void bench_perform(bench_s *b) {
+  if (b->setup)
+    b->setup();
+  /* calibrate the number of operations, so the clock isn't tested too often */
+  size_t count = 1;
+  double elapsed = 0;
+  for (;;) {
+    double start = bench_now();
+    b->run(count);
+    elapsed = bench_now() - start;
+    if (elapsed >= 0.01 || count >= ((size_t)1 << 40))
+      break;
+    count <<= 1;
+  }
+  size_t total = 0;
+  double spent = 0;
+  while (spent < bench_seconds) {
+    size_t round = count;
+    if (elapsed > 0 && (bench_seconds - spent) < elapsed)
+      round = (size_t)(count * ((bench_seconds - spent) / elapsed)) + 1;
+    double start = bench_now();
+    b->run(round);
+    spent += bench_now() - start;
+    total += round;
+  }
+  if (b->cleanup)
+    b->cleanup();
+
+  double ops = total / spent;
+  fprintf(stderr, "%-28s %14.0f ops/sec %10.1f ns/op", b->name, ops,
+          (spent * 1000000000.0) / total);
+  if (b->bytes)
+    fprintf(stderr, " %10.1f MB/sec", (ops * b->bytes) / (1024.0 * 1024.0));
+  fprintf(stderr, "\n");
+  fprintf(bench_results,
+          "%s\n    {\"name\": \"%s\", \"operations\": %zu, \"seconds\": %.6f, "
+          "\"ops_per_sec\": %.2f, \"ns_per_op\": %.3f, \"bytes_per_sec\": %.0f}",
+          (bench_count++ ? "," : ""), b->name, total, spent, ops,
+          (spent * 1000000000.0) / total, ops * b->bytes);
+}
+
+/* *****************************************************************************
+HTTP/1.x parsing
+***************************************************************************** */
+
+static char bench_http_request[] =
+    "GET /api/users/42/profile?fields=name,email&format=json HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static size_t bench_parsed;
+
+static int bench_on_request(http1_parser_s *parser) {
+  ++bench_parsed;
+  return 0;
+  (void)parser;
+}
+static int bench_on_method(http1_parser_s *parser, char *method, size_t len) {
+  return 0;
+  (void)parser, (void)method, (void)len;
+}
+static int bench_on_path(http1_parser_s *parser, char *path, size_t len) {
+  return 0;
+  (void)parser, (void)path, (void)len;
+}
+static int bench_on_query(http1_parser_s *parser, char *query, size_t len) {
+  return 0;
+  (void)parser, (void)query, (void)len;
+}
+static int bench_on_version(http1_parser_s *parser, char *version,
+                            size_t len) {
+  return 0;
+  (void)parser, (void)version, (void)len;
+}
+static int bench_on_header(http1_parser_s *parser, char *name, size_t name_len,
+                           char *data, size_t data_len) {
+  return 0;
+  (void)parser, (void)name, (void)name_len, (void)data, (void)data_len;
+}
+static int bench_on_error(http1_parser_s *parser) {
+  fprintf(stderr, "FATAL ERROR: benchmark request couldn't be parsed.\n");
+  exit(-1);
+  (void)parser;
+}
+
+static void bench_http1_parse(size_t count) {
+  http1_parser_s parser;
+  /* the parser edits the buffer in place, so each round uses a fresh copy */
+  char buf[sizeof(bench_http_request)];
+  for (size_t i = 0; i < count; ++i) {
+    memcpy(buf, bench_http_request, sizeof(bench_http_request) - 1);
+    bench_escape(buf);
+    parser = (http1_parser_s){.udata = NULL};
+    bench_sink += http1_fio_parser(
+        .parser = &parser, .buffer = buf,
+        .length = sizeof(bench_http_request) - 1,
+        .on_request = bench_on_request, .on_method = bench_on_method,
+        .on_path = bench_on_path, .on_query = bench_on_query,
+        .on_http_version = bench_on_version, .on_header = bench_on_header,
+        .on_error = bench_on_error);
+  }
+  bench_sink += bench_parsed;
+}
+
+/* *****************************************************************************
+HTTP/1.x response headers (`headers2str`)
+***************************************************************************** */
+
+static http1pr_s *bench_http1_protocol;
+
+static void bench_headers2str_setup(void) {
+  bench_http1_protocol = calloc(1, sizeof(*bench_http1_protocol));
+  http_s *h = &bench_http1_protocol->request;
+  http_s_new(h, &bench_http1_protocol->p, &HTTP1_VTABLE);
+  h->version = fiobj_str_new("HTTP/1.1", 8);
+  h->method = fiobj_str_new("GET", 3);
+  h->path = fiobj_str_new("/", 1);
+  http_set_header2(h, (fio_cstr_s){.data = "content-type", .len = 12},
+                   (fio_cstr_s){.data = "text/html; charset=utf-8", .len = 24});
+  http_set_header2(h, (fio_cstr_s){.data = "content-length", .len = 14},
+                   (fio_cstr_s){.data = "1024", .len = 4});
+  http_set_header2(h, (fio_cstr_s){.data = "date", .len = 4},
+                   (fio_cstr_s){.data = "Mon, 01 Jan 2018 00:00:00 GMT",
+                                .len = 29});
+  http_set_header2(h, (fio_cstr_s){.data = "cache-control", .len = 13},
+                   (fio_cstr_s){.data = "max-age=3600", .len = 12});
+  http_set_header2(h, (fio_cstr_s){.data = "etag", .len = 4},
+                   (fio_cstr_s){.data = "\"33a64df551425fcc55e4\"", .len = 22});
+  http_set_header2(h, (fio_cstr_s){.data = "x-request-id", .len = 12},
+                   (fio_cstr_s){.data = "f058ebd6-02f7-4d3f", .len = 18});
+  http_set_cookie(h, .name = "session", .name_len = 7, .value = "8f14e45fce",
+                  .value_len = 10, .http_only = 1);
+}
+
+static void bench_headers2str_cleanup(void) {
+  http_s_destroy(&bench_http1_protocol->request, 0);
+  free(bench_http1_protocol);
+}
+
+static void bench_headers2str(size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    bench_http1_protocol->close = 0;
+    FIOBJ str = headers2str(&bench_http1_protocol->request, 0);
+    bench_sink += fiobj_obj2cstr(str).len;
+    fiobj_free(str);
+  }
+}
+
+/* *****************************************************************************
+WebSocket framing
+***************************************************************************** */
+
+/* the parser's callbacks (required by the header, unused by the benchmarks) */
+static void websocket_on_unwrapped(void *udata, void *msg, uint64_t len,
+                                   char first, char last, char text,
+                                   unsigned char rsv) {
+  (void)udata, (void)msg, (void)len, (void)first, (void)last, (void)text,
+      (void)rsv;
+}
+static void websocket_on_protocol_ping(void *udata, void *msg, uint64_t len) {
+  (void)udata, (void)msg, (void)len;
+}
+static void websocket_on_protocol_pong(void *udata, void *msg, uint64_t len) {
+  (void)udata, (void)msg, (void)len;
+}
+static void websocket_on_protocol_close(void *udata) { (void)udata; }
+static void websocket_on_protocol_error(void *udata) { (void)udata; }
+
+static char bench_ws_message[4096];
+static char bench_ws_frame[4096 + 16];
+
+static void bench_ws_wrap_small(size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    bench_escape(bench_ws_message);
+    bench_sink += websocket_server_wrap(bench_ws_frame, bench_ws_message, 125,
+                                        1, 1, 1, 0);
+    bench_escape(bench_ws_frame);
+  }
+}
+
+static void bench_ws_wrap_large(size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    bench_escape(bench_ws_message);
+    bench_sink += websocket_server_wrap(bench_ws_frame, bench_ws_message,
+                                        sizeof(bench_ws_message), 1, 1, 1, 0);
+    bench_escape(bench_ws_frame);
+  }
+}
+
+static void bench_ws_xmask(size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    websocket_xmask(bench_ws_message, sizeof(bench_ws_message), 0x5A3C9F21);
+    bench_escape(bench_ws_message);
+  }
+}
+
+/* *****************************************************************************
+JSON parsing
+***************************************************************************** */
+
+static char bench_json[] =
+    "{\"id\":42,\"name\":\"Benchmark User\",\"email\":\"user@example.com\","
+    "\"active\":true,\"score\":98.6,\"tags\":[\"ruby\",\"c\",\"http\","
+    "\"websockets\"],\"address\":{\"street\":\"1 Main St.\",\"city\":"
+    "\"Springfield\",\"zip\":\"12345\",\"geo\":{\"lat\":39.78,\"lng\":-89.64}},"
+    "\"history\":[{\"at\":1514764800,\"event\":\"login\"},{\"at\":1514768400,"
+    "\"event\":\"purchase\",\"amount\":19.99},{\"at\":1514772000,\"event\":"
+    "\"logout\"}],\"bio\":\"Escaped \\\"quotes\\\" and unicode \\u00e9\","
+    "\"empty\":null}";
+
+static void bench_json_parse(size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    FIOBJ obj = FIOBJ_INVALID;
+    bench_sink += fiobj_json2obj(&obj, bench_json, sizeof(bench_json) - 1);
+    bench_sink += obj;
+    fiobj_free(obj);
+  }
+}
+
+/* *****************************************************************************
+Hash maps
+***************************************************************************** */
+
+#define BENCH_HASH_KEYS 4096
+static fio_hash_s bench_hash;
+
+static inline uint64_t bench_hash_key(size_t i) {
+  /* keys look like hash values (the map expects hashed keys) */
+  return ((uint64_t)(i + 1) * 0x9E3779B97F4A7C15ULL) | 1;
+}
+
+static void bench_hash_insert(size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    fio_hash_s map;
+    fio_hash_new(&map);
+    for (size_t k = 0; k < BENCH_HASH_KEYS; ++k)
+      fio_hash_insert(&map, bench_hash_key(k), (void *)(k + 1));
+    bench_sink += fio_hash_count(&map);
+    bench_escape(&map);
+    fio_hash_free(&map);
+  }
+}
+
+static void bench_hash_find_setup(void) {
+  fio_hash_new(&bench_hash);
+  for (size_t k = 0; k < BENCH_HASH_KEYS; ++k)
+    fio_hash_insert(&bench_hash, bench_hash_key(k), (void *)(k + 1));
+}
+
+static void bench_hash_find_cleanup(void) { fio_hash_free(&bench_hash); }
+
+static void bench_hash_find(size_t count) {
+  uintptr_t found = 0;
+  for (size_t i = 0; i < count; ++i)
+    for (size_t k = 0; k < BENCH_HASH_KEYS; ++k)
+      found += (uintptr_t)fio_hash_find(&bench_hash, bench_hash_key(k));
+  if (!found)
+    fprintf(stderr, "WARNING: hash map benchmark keys not found.\n");
+  bench_sink += found;
+}
+
+/* *****************************************************************************
+Memory allocation
+***************************************************************************** */
+
+#define BENCH_ALLOC_BATCH 256
+#define BENCH_ALLOC_THREADS 4
+
+/* allocates a batch of (mostly small) objects, then frees them */
+#define BENCH_ALLOC_LOOP(alloc_fn, free_fn)                                    \
+  do {                                                                         \
+    void *ptrs[BENCH_ALLOC_BATCH];                                             \
+    for (size_t i = 0; i < count; ++i) {                                       \
+      for (size_t j = 0; j < BENCH_ALLOC_BATCH; ++j)                           \
+        ptrs[j] = alloc_fn(16 + ((j * 37) & 511));                             \
+      bench_escape(ptrs); /* or malloc / free pairs might be elided */         \
+      for (size_t j = 0; j < BENCH_ALLOC_BATCH; ++j)                           \
+        free_fn(ptrs[j]);                                                      \
+    }                                                                          \
+  } while (0)
+
+static void bench_fio_malloc(size_t count) {
+  BENCH_ALLOC_LOOP(fio_malloc, fio_free);
+}
+
+static void bench_sys_malloc(size_t count) { BENCH_ALLOC_LOOP(malloc, free); }
+
+static void *bench_fio_malloc_thread(void *count) {
+  bench_fio_malloc((size_t)count);
+  return NULL;
+}
+static void *bench_sys_malloc_thread(void *count) {
+  bench_sys_malloc((size_t)count);
+  return NULL;
+}
+
+static void bench_threaded(void *(*task)(void *), size_t count) {
+  pthread_t threads[BENCH_ALLOC_THREADS];
+  size_t per_thread = (count / BENCH_ALLOC_THREADS) + 1;
+  for (size_t i = 0; i < BENCH_ALLOC_THREADS; ++i)
+    pthread_create(threads + i, NULL, task, (void *)per_thread);
+  for (size_t i = 0; i < BENCH_ALLOC_THREADS; ++i)
+    pthread_join(threads[i], NULL);
+}
+
+static void bench_fio_malloc_mt(size_t count) {
+  bench_threaded(bench_fio_malloc_thread, count);
+}
+
+static void bench_sys_malloc_mt(size_t count) {
+  bench_threaded(bench_sys_malloc_thread, count);
+}
+
+/* *****************************************************************************
+Task queue (`defer`)
+***************************************************************************** */
+
+#define BENCH_DEFER_BATCH 1024
+
+static void bench_defer_task(void *counter, void *ignr) {
+  ++*(size_t *)counter;
+  (void)ignr;
+}
+
+static void bench_defer(size_t count) {
+  size_t performed = 0;
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = 0; j < BENCH_DEFER_BATCH; ++j)
+      defer(bench_defer_task, &performed, NULL);
+    defer_perform();
+  }
+  if (performed != count * BENCH_DEFER_BATCH)
+    fprintf(stderr, "WARNING: defer benchmark lost tasks.\n");
+}
+
+/* *****************************************************************************
+Pub/Sub broadcast fan-out
+***************************************************************************** */
+
+#define BENCH_SUBSCRIBERS 1024
+
+static FIOBJ bench_channel;
+static FIOBJ bench_message;
+static pubsub_sub_pt bench_subscriptions[BENCH_SUBSCRIBERS];
+static size_t bench_delivered;
+
+static void bench_on_message(pubsub_message_s *msg) {
+  ++bench_delivered;
+  (void)msg;
+}
+
+static void bench_pubsub_setup(void) {
+  bench_channel = fiobj_str_new("benchmark", 9);
+  bench_message = fiobj_str_new(bench_ws_message, 125);
+  for (size_t i = 0; i < BENCH_SUBSCRIBERS; ++i)
+    bench_subscriptions[i] =
+        pubsub_subscribe(.channel = bench_channel,
+                         .on_message = bench_on_message, .udata1 = (void *)i);
+  defer_perform();
+}
+
+static void bench_pubsub_cleanup(void) {
+  for (size_t i = 0; i < BENCH_SUBSCRIBERS; ++i)
+    pubsub_unsubscribe(bench_subscriptions[i]);
+  defer_perform();
+  fiobj_free(bench_channel);
+  fiobj_free(bench_message);
+}
+
+/* each operation is a published message, delivered to all subscribers */
+static void bench_pubsub_fanout(size_t count) {
+  bench_delivered = 0;
+  for (size_t i = 0; i < count; ++i) {
+    pubsub_publish(.engine = PUBSUB_PROCESS_ENGINE, .channel = bench_channel,
+                   .message = bench_message);
+    defer_perform();
+  }
+  if (bench_delivered != count * BENCH_SUBSCRIBERS)
+    fprintf(stderr, "WARNING: pub/sub benchmark lost messages (%zu/%zu).\n",
+            bench_delivered, count * BENCH_SUBSCRIBERS);
+}
+
+/* *****************************************************************************
+Main
+***************************************************************************** */
+
+static bench_s bench_list[] = {
+    {.name = "http1_parse",
+     .run = bench_http1_parse,
+     .bytes = sizeof(bench_http_request) - 1},
+    {.name = "http1_headers2str",
+     .run = bench_headers2str,
+     .setup = bench_headers2str_setup,
+     .cleanup = bench_headers2str_cleanup},
+    {.name = "websocket_wrap_125b", .run = bench_ws_wrap_small, .bytes = 125},
+    {.name = "websocket_wrap_4kb",
+     .run = bench_ws_wrap_large,
+     .bytes = sizeof(bench_ws_message)},
+    {.name = "websocket_xmask_4kb",
+     .run = bench_ws_xmask,
+     .bytes = sizeof(bench_ws_message)},
+    {.name = "json_parse", .run = bench_json_parse, .bytes = sizeof(bench_json)},
+    {.name = "hash_insert_4096", .run = bench_hash_insert},
+    {.name = "hash_find_4096",
+     .run = bench_hash_find,
+     .setup = bench_hash_find_setup,
+     .cleanup = bench_hash_find_cleanup},
+    {.name = "fio_malloc_256", .run = bench_fio_malloc},
+    {.name = "system_malloc_256", .run = bench_sys_malloc},
+    {.name = "fio_malloc_256_4threads", .run = bench_fio_malloc_mt},
+    {.name = "system_malloc_256_4threads", .run = bench_sys_malloc_mt},
+    {.name = "defer_1024", .run = bench_defer},
+    {.name = "pubsub_fanout_1024",
+     .run = bench_pubsub_fanout,
+     .setup = bench_pubsub_setup,
+     .cleanup = bench_pubsub_cleanup},
+};
+
+int main(int argc, char const *argv[]) {
+  const char *filters[argc];
+  size_t filter_count = 0;
+  const char *output = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      bench_seconds = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      output = argv[++i];
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "Usage: %s [-t seconds] [-o results.json] [filter...]\n",
+              argv[0]);
+      return 1;
+    } else
+      filters[filter_count++] = argv[i];
+  }
+  if (bench_seconds <= 0)
+    bench_seconds = 0.5;
+  bench_results = output ? fopen(output, "w") : stdout;
+  if (!bench_results) {
+    perror("ERROR: couldn't open the results file");
+    return 1;
+  }
+
+  http_lib_init();
+  memset(bench_ws_message, 'x', sizeof(bench_ws_message));
+
+  fprintf(bench_results, "{\n  \"time\": %lu,\n  \"results\": [",
+          (unsigned long)time(NULL));
+  for (size_t i = 0; i < sizeof(bench_list) / sizeof(bench_list[0]); ++i) {
+    uint8_t selected = !filter_count;
+    for (size_t f = 0; f < filter_count && !selected; ++f)
+      selected = strstr(bench_list[i].name, filters[f]) != NULL;
+    if (selected)
+      bench_perform(bench_list + i);
+  }
+  fprintf(bench_results, "\n  ]\n}\n");
+  if (output)
+    fclose(bench_results);
+  return 0;
+}
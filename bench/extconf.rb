@@ -0,0 +1,57 @@
+# Writes a Makefile for the `iodine_bench` executable (see `bench.c`).
+#
+# This isn't a Ruby extension - the benchmarks link iodine's C sources (without
+# the Ruby bindings). Run from the build directory, i.e.:
+#
+#      mkdir -p tmp/bench && cd tmp/bench && ruby ../../bench/extconf.rb && make
+#
+# Or simply use `rake bench`.
+require 'mkmf'
+
+src_dir = File.expand_path('../ext/iodine', __dir__)
+bench_src = File.expand_path('bench.c', __dir__)
+
+abort 'Missing a Linux/Unix OS evented API (epoll/kqueue).' unless have_func('kevent') || have_func('epoll_ctl')
+
+cc = ENV['CC'] || RbConfig::CONFIG['CC']
+cflags = "-std=c11 -O2 -Wall -I#{src_dir} #{ENV['CFLAGS']}"
+libs = '-lpthread -lm'
+
+if have_header('zlib.h') && have_library('z', 'deflateInit2_')
+  cflags << ' -DWS_DEFLATE=1'
+  libs << ' -lz'
+end
+
+if have_header('openssl/ssl.h') && have_library('crypto', 'ERR_get_error') &&
+   have_library('ssl', 'SSL_CTX_set_alpn_select_cb')
+  cflags << ' -DHAVE_OPENSSL=1'
+  libs << ' -lssl -lcrypto'
+end
+
+if ENV['IODINE_NATIVE'] && try_cflags('-march=native')
+  cflags << ' -march=native'
+end
+
+# the Ruby bindings aren't linked and `http1.c` is included by `bench.c`
+sources = Dir[File.join(src_dir, '*.c')].sort.reject do |f|
+  File.basename(f) =~ /\A(iodine.*|http1)\.c\z/
+end
+
+File.write 'Makefile', <<MAKEFILE
+CC = #{cc}
+CFLAGS = #{cflags}
+LIBS = #{libs}
+SRCS = #{sources.join(" \\\n\t")}
+
+iodine_bench: #{bench_src} $(SRCS)
+\t$(CC) $(CFLAGS) -o $@ #{bench_src} $(SRCS) $(LIBS)
+
+run: iodine_bench
+\t./iodine_bench -o results.json
+
+clean:
+\trm -f iodine_bench results.json
+
+.PHONY: run clean
+MAKEFILE
+puts 'created Makefile (run `make` to build `iodine_bench`).'
@@ -7,6 +7,7 @@ Feel free to copy, use and enjoy according to the license provided.
 #include "spnlock.inc"
 
 #include "defer.h"
+#include "fio_trace.h"
 
 #include <errno.h>
 #include <signal.h>
@@ -14,6 +15,7 @@ Feel free to copy, use and enjoy according to the license provided.
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 /* *****************************************************************************
@@ -49,6 +51,86 @@ Compile time settings
 #endif
 #endif
 
+/**
+ * When true, the shared task queue is a lock-free MPMC ring buffer (with a
+ * locked overflow queue used when the ring is full) instead of the spinlock
+ * protected block list.
+ *
+ * Tasks are still performed in the order they were scheduled, except when the
+ * ring overflows.
+ */
+#ifndef DEFER_QUEUE_LOCKFREE
+#define DEFER_QUEUE_LOCKFREE 0
+#endif
+
+/** The number of tasks in the lock-free ring (MUST be a power of 2). */
+#ifndef DEFER_QUEUE_LOCKFREE_CAPA
+#define DEFER_QUEUE_LOCKFREE_CAPA 4096
+#endif
+
+#if DEFER_QUEUE_LOCKFREE &&                                                    \
+    (DEFER_QUEUE_LOCKFREE_CAPA & (DEFER_QUEUE_LOCKFREE_CAPA - 1))
+#error DEFER_QUEUE_LOCKFREE_CAPA must be a power of 2.
+#endif
+
+/**
+ * When true, idle worker threads park (sleep on a futex) instead of polling the
+ * queue using `throttle_thread`, and `defer_thread_signal` wakes up a single
+ * parked worker.
+ *
+ * Parking is currently only supported on Linux. Elsewhere this is ignored.
+ */
+#ifndef DEFER_THREAD_PARKING
+#define DEFER_THREAD_PARKING 0
+#endif
+
+#if DEFER_THREAD_PARKING && !defined(__linux__)
+#undef DEFER_THREAD_PARKING
+#define DEFER_THREAD_PARKING 0
+#endif
+
+/** The longest a parked worker sleeps before testing the queue (in ms). */
+#ifndef DEFER_THREAD_PARKING_TIMEOUT
+#define DEFER_THREAD_PARKING_TIMEOUT 1000
+#endif
+
+/** Adaptive pools: the minimal interval between size reviews (in ms). */
+#ifndef DEFER_ADAPTIVE_INTERVAL
+#define DEFER_ADAPTIVE_INTERVAL 100
+#endif
+
+/**
+ * Adaptive pools: the estimated time a new task waits in the queue (in ms)
+ * above which the pool grows, unless some of the threads are idle.
+ */
+#ifndef DEFER_ADAPTIVE_LATENCY
+#define DEFER_ADAPTIVE_LATENCY 10
+#endif
+
+/** Adaptive pools: the consecutive busy reviews required to add a thread. */
+#ifndef DEFER_ADAPTIVE_GROW
+#define DEFER_ADAPTIVE_GROW 2
+#endif
+
+/**
+ * Adaptive pools: the consecutive idle reviews required to retire a thread.
+ *
+ * This is much longer than DEFER_ADAPTIVE_GROW, so the pool doesn't flap
+ * between sizes during bursts.
+ */
+#ifndef DEFER_ADAPTIVE_SHRINK
+#define DEFER_ADAPTIVE_SHRINK 50
+#endif
+
+/**
+ * Priority classes: every DEFER_PRIORITY_AGING tasks (per thread), the next
+ * task is selected starting with a different class (in rotation), so lower
+ * priority classes are never starved by higher priority tasks.
+ */
+#ifndef DEFER_PRIORITY_AGING
+#define DEFER_PRIORITY_AGING 16
+#endif
+
 /* *****************************************************************************
 Data Structures
 ***************************************************************************** */
@@ -69,17 +151,47 @@ typedef struct queue_block_s {
   unsigned char state;
 } queue_block_s;
 
-static queue_block_s static_queue;
-
-/* the state machine - this holds all the data about the task queue and pool */
-static struct {
+/* a task queue - a linked list of task blocks and a static (first) block */
+typedef struct {
   /* a lock for the state machine, used for multi-threading support */
   spn_lock_i lock;
   /* current active block to pop tasks */
   queue_block_s *reader;
   /* current active block to push tasks */
   queue_block_s *writer;
-} deferred = {.reader = &static_queue, .writer = &static_queue};
+  /* the first block is never freed (it's left "on call" for new events) */
+  queue_block_s static_queue;
+  /* the number of tasks in the queue (for statistics) */
+  volatile size_t count;
+  /* the futex word a parked worker thread waits on */
+  volatile uint32_t wake;
+  /* set while the queue's worker thread is parked */
+  volatile uint8_t parked;
+} queue_s;
+
+#define QUEUE_INIT(q)                                                          \
+  { .reader = &(q).static_queue, .writer = &(q).static_queue }
+
+/* the state machine - this holds all the data about the task queue and pool */
+static queue_s deferred = QUEUE_INIT(deferred);
+
+/* per-thread queues, used for tasks pinned to a worker thread */
+static struct {
+  /* an array of per-thread queues (never freed until `defer_clear_queue`) */
+  queue_s **queues;
+  /* the number of active worker threads (0 == no pinning) */
+  volatile size_t count;
+  /* the length of the `queues` array */
+  size_t capa;
+} pinned;
+
+/* the calling worker thread's pinned queue (if any) */
+static __thread queue_s *pinned_local;
+
+#if DEFER_THREAD_PARKING
+/* the number of parked workers, so busy workers aren't searched for */
+static volatile size_t parked_count;
+#endif
 
 /* *****************************************************************************
 Internal Data API
@@ -99,111 +211,335 @@ static size_t count_alloc, count_dealloc;
 #define COUNT_RESET
 #endif
 
-static inline void push_task(task_s task) {
-  spn_lock(&deferred.lock);
+static inline void push_task(queue_s *q, task_s task) {
+  spn_lock(&q->lock);
 
   /* test if full */
-  if (deferred.writer->state &&
-      deferred.writer->write == deferred.writer->read) {
+  if (q->writer->state && q->writer->write == q->writer->read) {
     /* return to static buffer or allocate new buffer */
-    if (static_queue.state == 2) {
-      deferred.writer->next = &static_queue;
+    if (q->static_queue.state == 2) {
+      q->writer->next = &q->static_queue;
     } else {
-      deferred.writer->next = malloc(sizeof(*deferred.writer->next));
+      q->writer->next = malloc(sizeof(*q->writer->next));
       COUNT_ALLOC;
-      if (!deferred.writer->next)
+      if (!q->writer->next)
         goto critical_error;
     }
-    deferred.writer = deferred.writer->next;
-    deferred.writer->write = 0;
-    deferred.writer->read = 0;
-    deferred.writer->state = 0;
-    deferred.writer->next = NULL;
+    q->writer = q->writer->next;
+    q->writer->write = 0;
+    q->writer->read = 0;
+    q->writer->state = 0;
+    q->writer->next = NULL;
   }
 
   /* place task and finish */
-  deferred.writer->tasks[deferred.writer->write++] = task;
+  q->writer->tasks[q->writer->write++] = task;
+  ++q->count;
   /* cycle buffer */
-  if (deferred.writer->write == DEFER_QUEUE_BLOCK_COUNT) {
-    deferred.writer->write = 0;
-    deferred.writer->state = 1;
+  if (q->writer->write == DEFER_QUEUE_BLOCK_COUNT) {
+    q->writer->write = 0;
+    q->writer->state = 1;
   }
-  spn_unlock(&deferred.lock);
+  spn_unlock(&q->lock);
   return;
 
 critical_error:
-  spn_unlock(&deferred.lock);
+  spn_unlock(&q->lock);
   perror("ERROR CRITICAL: defer can't allocate task");
   kill(0, SIGINT);
   exit(errno);
 }
 
-static inline task_s pop_task(void) {
+static inline task_s pop_task(queue_s *q) {
   task_s ret = (task_s){.func = NULL};
   queue_block_s *to_free = NULL;
   /* lock the state machine, grab/create a task and place it at the tail */
-  spn_lock(&deferred.lock);
+  spn_lock(&q->lock);
 
   /* empty? */
-  if (deferred.reader->write == deferred.reader->read &&
-      !deferred.reader->state)
+  if (q->reader->write == q->reader->read && !q->reader->state)
     goto finish;
   /* collect task */
-  ret = deferred.reader->tasks[deferred.reader->read++];
+  ret = q->reader->tasks[q->reader->read++];
+  --q->count;
   /* cycle */
-  if (deferred.reader->read == DEFER_QUEUE_BLOCK_COUNT) {
-    deferred.reader->read = 0;
-    deferred.reader->state = 0;
+  if (q->reader->read == DEFER_QUEUE_BLOCK_COUNT) {
+    q->reader->read = 0;
+    q->reader->state = 0;
   }
   /* did we finish the queue in the buffer? */
-  if (deferred.reader->write == deferred.reader->read) {
-    if (deferred.reader->next) {
-      to_free = deferred.reader;
-      deferred.reader = deferred.reader->next;
+  if (q->reader->write == q->reader->read) {
+    if (q->reader->next) {
+      to_free = q->reader;
+      q->reader = q->reader->next;
     } else {
-      if (deferred.reader != &static_queue && static_queue.state == 2) {
-        to_free = deferred.reader;
-        deferred.writer = &static_queue;
-        deferred.reader = &static_queue;
+      if (q->reader != &q->static_queue && q->static_queue.state == 2) {
+        to_free = q->reader;
+        q->writer = &q->static_queue;
+        q->reader = &q->static_queue;
       }
-      deferred.reader->write = deferred.reader->read = deferred.reader->state =
-          0;
+      q->reader->write = q->reader->read = q->reader->state = 0;
     }
     goto finish;
   }
 
 finish:
-  if (to_free == &static_queue) {
-    static_queue.state = 2;
-    static_queue.next = NULL;
+  if (to_free == &q->static_queue) {
+    q->static_queue.state = 2;
+    q->static_queue.next = NULL;
   }
-  spn_unlock(&deferred.lock);
+  spn_unlock(&q->lock);
 
-  if (to_free && to_free != &static_queue) {
+  if (to_free && to_free != &q->static_queue) {
     free(to_free);
     COUNT_DEALLOC;
   }
   return ret;
 }
 
-static inline void clear_tasks(void) {
-  spn_lock(&deferred.lock);
-  while (deferred.reader) {
-    queue_block_s *tmp = deferred.reader;
-    deferred.reader = deferred.reader->next;
-    if (tmp != &static_queue) {
+static inline void clear_tasks(queue_s *q) {
+  spn_lock(&q->lock);
+  while (q->reader) {
+    queue_block_s *tmp = q->reader;
+    q->reader = q->reader->next;
+    if (tmp != &q->static_queue) {
       COUNT_DEALLOC;
       free(tmp);
     }
   }
-  static_queue = (queue_block_s){.next = NULL};
-  deferred.reader = deferred.writer = &static_queue;
-  spn_unlock(&deferred.lock);
+  q->static_queue = (queue_block_s){.next = NULL};
+  q->reader = q->writer = &q->static_queue;
+  q->count = 0;
+  spn_unlock(&q->lock);
+}
+
+/* *****************************************************************************
+The shared queue (optionally lock-free)
+***************************************************************************** */
+
+#if DEFER_QUEUE_LOCKFREE
+
+/*
+ * A bounded MPMC ring. Each cell has a sequence number, marking if it's ready
+ * to be written (`seq == pos`) or read (`seq == pos + 1`) at position `pos`.
+ */
+typedef struct {
+  volatile size_t seq;
+  task_s task;
+} ring_cell_s;
+
+static struct {
+  ring_cell_s cells[DEFER_QUEUE_LOCKFREE_CAPA];
+  /* readers and writers are kept on separate cache lines */
+  uint8_t pad0[64];
+  volatile size_t head;
+  uint8_t pad1[64 - sizeof(size_t)];
+  volatile size_t tail;
+  uint8_t pad2[64 - sizeof(size_t)];
+  /* set once, when the ring is initialized */
+  volatile uint8_t ready;
+} ring;
+
+static inline void ring_init(void) {
+  static spn_lock_i lock = SPN_LOCK_INIT;
+  spn_lock(&lock);
+  if (!ring.ready) {
+    for (size_t i = 0; i < DEFER_QUEUE_LOCKFREE_CAPA; ++i)
+      ring.cells[i].seq = i;
+    ring.head = ring.tail = 0;
+    __atomic_store_n(&ring.ready, 1, __ATOMIC_RELEASE);
+  }
+  spn_unlock(&lock);
+}
+
+static inline void push_shared(task_s task) {
+  if (!__atomic_load_n(&ring.ready, __ATOMIC_ACQUIRE))
+    ring_init();
+  size_t pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+  for (;;) {
+    ring_cell_s *cell = ring.cells + (pos & (DEFER_QUEUE_LOCKFREE_CAPA - 1));
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring.tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->task = task;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return;
+      }
+    } else if (diff < 0) {
+      /* the ring is full, use the overflow queue */
+      push_task(&deferred, task);
+      return;
+    } else {
+      pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static inline task_s pop_shared(void) {
+  if (!__atomic_load_n(&ring.ready, __ATOMIC_ACQUIRE))
+    return pop_task(&deferred);
+  size_t pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+  for (;;) {
+    ring_cell_s *cell = ring.cells + (pos & (DEFER_QUEUE_LOCKFREE_CAPA - 1));
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring.head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        task_s ret = cell->task;
+        __atomic_store_n(&cell->seq, pos + DEFER_QUEUE_LOCKFREE_CAPA,
+                         __ATOMIC_RELEASE);
+        return ret;
+      }
+    } else if (diff < 0) {
+      /* the ring is empty, test the overflow queue */
+      return pop_task(&deferred);
+    } else {
+      pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static inline int shared_has_tasks(void) {
+  return ring.head != ring.tail ||
+         deferred.reader->read != deferred.reader->write;
+}
+
+static inline size_t shared_count(void) {
+  return (ring.tail - ring.head) + deferred.count;
+}
+
+static inline void clear_shared(void) {
+  while (pop_shared().func)
+    ;
+  clear_tasks(&deferred);
+}
+
+#else
+
+#define push_shared(task) (push_task)(&deferred, (task))
+#define pop_shared() pop_task(&deferred)
+#define shared_has_tasks() (deferred.reader->read != deferred.reader->write)
+#define shared_count() (deferred.count)
+#define clear_shared() clear_tasks(&deferred)
+
+#endif
+
+/* *****************************************************************************
+Priority classes (the shared queue is used for DEFER_PRIORITY_NORMAL)
+***************************************************************************** */
+
+static queue_s prioritized[DEFER_PRIORITY_COUNT - 1] = {
+    QUEUE_INIT(prioritized[0]), QUEUE_INIT(prioritized[1]),
+    QUEUE_INIT(prioritized[2])};
+
+/* the queue of a priority class other than DEFER_PRIORITY_NORMAL */
+#define PRIORITY_QUEUE(p) (prioritized + (p) - ((p) > DEFER_PRIORITY_NORMAL))
+
+/* counts the tasks each thread popped, for aging (see DEFER_PRIORITY_AGING) */
+static __thread size_t priority_ticket;
+
+static inline void push_prioritized(int priority, task_s task) {
+  if (priority == DEFER_PRIORITY_NORMAL)
+    push_shared(task);
+  else
+    push_task(PRIORITY_QUEUE(priority), task);
+}
+
+/* pops a task from the most urgent class that isn't empty */
+static inline task_s pop_prioritized(void) {
+  size_t start = 0;
+  if (!(++priority_ticket % DEFER_PRIORITY_AGING))
+    start = (priority_ticket / DEFER_PRIORITY_AGING) % DEFER_PRIORITY_COUNT;
+  for (size_t i = 0; i < DEFER_PRIORITY_COUNT; ++i) {
+    const size_t priority = (start + i) % DEFER_PRIORITY_COUNT;
+    task_s task;
+    if (priority == DEFER_PRIORITY_NORMAL) {
+      task = pop_shared();
+    } else {
+      queue_s *q = PRIORITY_QUEUE(priority);
+      if (!q->count)
+        continue;
+      task = pop_task(q);
+    }
+    if (task.func)
+      return task;
+  }
+  return (task_s){.func = NULL};
 }
 
-void defer_on_fork(void) { deferred.lock = SPN_LOCK_INIT; }
+static inline int prioritized_has_tasks(void) {
+  for (size_t i = 0; i < DEFER_PRIORITY_COUNT - 1; ++i) {
+    if (prioritized[i].count)
+      return 1;
+  }
+  return shared_has_tasks();
+}
 
-#define push_task(...) push_task((task_s){__VA_ARGS__})
+static inline size_t prioritized_count(void) {
+  size_t count = shared_count();
+  for (size_t i = 0; i < DEFER_PRIORITY_COUNT - 1; ++i)
+    count += prioritized[i].count;
+  return count;
+}
+
+static inline void clear_prioritized(void) {
+  for (size_t i = 0; i < DEFER_PRIORITY_COUNT - 1; ++i)
+    clear_tasks(prioritized + i);
+  clear_shared();
+}
+
+/*
+ * performs the tasks pinned to a worker thread as well as the main queue's
+ * tasks. Pinned tasks are performed first, between each of the main queue's
+ * tasks, so they aren't starved by tasks that reschedule themselves.
+ *
+ * Returns the number of tasks performed.
+ */
+static inline size_t perform_worker_tasks(queue_s *local) {
+  size_t count = 0;
+  for (;;) {
+    task_s task = pop_task(local);
+    if (!task.func)
+      task = pop_prioritized();
+    if (!task.func)
+      return count;
+    FIO_TRACE_PROBE2(defer__pop, task.func, task.arg1);
+    task.func(task.arg1, task.arg2);
+    ++count;
+  }
+}
+
+/* moves any tasks left in a queue to the main queue */
+static inline void reroute_tasks(queue_s *q) {
+  task_s task = pop_task(q);
+  while (task.func) {
+    push_shared(task);
+    task = pop_task(q);
+  }
+}
+
+void defer_on_fork(void) {
+  deferred.lock = SPN_LOCK_INIT;
+  for (size_t i = 0; i < DEFER_PRIORITY_COUNT - 1; ++i)
+    prioritized[i].lock = SPN_LOCK_INIT;
+  for (size_t i = 0; i < pinned.capa; ++i) {
+    if (pinned.queues[i]) {
+      pinned.queues[i]->lock = SPN_LOCK_INIT;
+      pinned.queues[i]->parked = 0;
+    }
+  }
+#if DEFER_THREAD_PARKING
+  parked_count = 0;
+#endif
+}
+
+/* wakes up the worker thread a pinned queue belongs to (if it's waiting). */
+static inline void signal_pinned(queue_s *q);
+
+#define push_task(q, ...) push_task((q), (task_s){__VA_ARGS__})
 
 /* *****************************************************************************
 API
@@ -214,7 +550,8 @@ int defer(void (*func)(void *, void *), void *arg1, void *arg2) {
   /* must have a task to defer */
   if (!func)
     goto call_error;
-  push_task(.func = func, .arg1 = arg1, .arg2 = arg2);
+  FIO_TRACE_PROBE2(defer__push, func, arg1);
+  push_shared(((task_s){.func = func, .arg1 = arg1, .arg2 = arg2}));
   defer_thread_signal();
   return 0;
 
@@ -222,22 +559,116 @@ call_error:
   return -1;
 }
 
+/** Defer an execution of a function using a specific priority class. */
+int defer_priority(int priority, void (*func)(void *, void *), void *arg1,
+                   void *arg2) {
+  if (!func || priority < 0 || priority >= DEFER_PRIORITY_COUNT)
+    return -1;
+  FIO_TRACE_PROBE2(defer__push, func, arg1);
+  push_prioritized(priority,
+                   ((task_s){.func = func, .arg1 = arg1, .arg2 = arg2}));
+  defer_thread_signal();
+  return 0;
+}
+
+/**
+ * Defers an execution of a function to a specific worker thread, selected
+ * using `key % thread_count`.
+ */
+int defer_pinned(size_t key, void (*func)(void *, void *), void *arg1,
+                 void *arg2) {
+  /* must have a task to defer */
+  if (!func)
+    return -1;
+  size_t count = pinned.count;
+  if (!count)
+    return defer(func, arg1, arg2);
+  queue_s *q = pinned.queues[key % count];
+  FIO_TRACE_PROBE2(defer__push, func, arg1);
+  push_task(q, .func = func, .arg1 = arg1, .arg2 = arg2);
+  signal_pinned(q);
+  return 0;
+}
+
+/** Returns the calling worker thread's `defer_pinned` key (or -1). */
+intptr_t defer_pinned_self(void) {
+  if (!pinned_local)
+    return -1;
+  const size_t count = pinned.count;
+  for (size_t i = 0; i < count; ++i) {
+    if (pinned.queues[i] == pinned_local)
+      return (intptr_t)i;
+  }
+  return -1;
+}
+
 /** Performs all deferred functions until the queue had been depleted. */
 void defer_perform(void) {
-  task_s task = pop_task();
+  task_s task = pop_prioritized();
   while (task.func) {
+    FIO_TRACE_PROBE2(defer__pop, task.func, task.arg1);
+    task.func(task.arg1, task.arg2);
+    task = pop_prioritized();
+  }
+}
+
+/* set while `defer_perform_batch` performs tasks on the calling thread */
+static __thread uint8_t performing_batch;
+
+/**
+ * Performs up to `limit` deferred functions (or until the queue is empty),
+ * returning the number of functions performed.
+ */
+size_t defer_perform_batch(size_t limit) {
+  if (performing_batch)
+    return 0;
+  size_t count = 0;
+  performing_batch = 1;
+  while (count < limit) {
+    task_s task = {.func = NULL};
+    if (pinned_local)
+      task = pop_task(pinned_local);
+    if (!task.func)
+      task = pop_prioritized();
+    if (!task.func)
+      break;
+    FIO_TRACE_PROBE2(defer__pop, task.func, task.arg1);
     task.func(task.arg1, task.arg2);
-    task = pop_task();
+    ++count;
   }
+  performing_batch = 0;
+  return count;
 }
 
 /** Returns true if there are deferred functions waiting for execution. */
 int defer_has_queue(void) {
-  return deferred.reader->read != deferred.reader->write;
+  return performing_batch || prioritized_has_tasks() ||
+         (pinned_local &&
+          pinned_local->reader->read != pinned_local->reader->write);
+}
+
+/** returns the (approximate) number of deferred functions waiting. */
+size_t defer_queue_len(void) {
+  size_t count = prioritized_count();
+  for (size_t i = 0; i < pinned.count; ++i) {
+    count += pinned.queues[i]->count;
+  }
+  return count;
 }
 
 /** Clears the queue. */
-void defer_clear_queue(void) { clear_tasks(); }
+void defer_clear_queue(void) {
+  clear_prioritized();
+  for (size_t i = 0; i < pinned.capa; ++i) {
+    if (pinned.queues[i]) {
+      clear_tasks(pinned.queues[i]);
+      free(pinned.queues[i]);
+    }
+  }
+  free(pinned.queues);
+  pinned.queues = NULL;
+  pinned.capa = pinned.count = 0;
+}
 
 /* *****************************************************************************
 Thread Pool Support
@@ -246,10 +677,29 @@ Thread Pool Support
 /* thread pool data container */
 struct defer_pool {
   volatile unsigned int flag;
+  /* the number of threads started (including retired threads) */
   unsigned int count;
+  /* threads with an index equal or above `active` retire (adaptive pools) */
+  volatile unsigned int active;
+  unsigned int min;
+  unsigned int max;
+  /* the number of threads waiting for tasks */
+  volatile size_t idle;
+  /* held while the pool is resized (and once the pool is joined) */
+  spn_lock_i review_lock;
+  /* adaptive pools: the last review's state */
+  struct timespec reviewed;
+  size_t performed;
+  size_t busy_reviews;
+  size_t idle_reviews;
   struct thread_msg_s {
     pool_pt pool;
     void *thrd;
+    queue_s *queue;
+    /* the number of tasks performed by the thread */
+    volatile size_t performed;
+    /* set while the thread is running (adaptive pools) */
+    volatile uint8_t running;
   } threads[];
 };
 
@@ -322,16 +772,85 @@ void defer_thread_throttle(unsigned long microsec) { return; }
 
 #endif /* DEBUG || pthread default */
 
+#if DEFER_THREAD_PARKING
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* clears a worker's `parked` flag, returns -1 if the worker wasn't parked. */
+static inline int clear_parked(queue_s *q) {
+  uint8_t expected = 1;
+  if (!q->parked ||
+      !__atomic_compare_exchange_n(&q->parked, &expected, 0, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    return -1;
+  __atomic_sub_fetch(&parked_count, 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+/* wakes a parked worker, returns -1 if the worker wasn't parked. */
+static inline int unpark_worker(queue_s *q) {
+  if (clear_parked(q))
+    return -1;
+  __atomic_add_fetch(&q->wake, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &q->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  return 0;
+}
+
+/*
+ * parks the calling worker until it's signaled (or the timeout expires).
+ *
+ * The `parked` flag is set before testing the queue, while `defer` pushes the
+ * task before testing the flag, so a wakeup can't be lost.
+ */
+static inline void park_worker(pool_pt pool, queue_s *q) {
+  static const struct timespec timeout = {
+      .tv_sec = DEFER_THREAD_PARKING_TIMEOUT / 1000,
+      .tv_nsec = (DEFER_THREAD_PARKING_TIMEOUT % 1000) * 1000000,
+  };
+  uint32_t wake = __atomic_load_n(&q->wake, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&parked_count, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&q->parked, 1, __ATOMIC_SEQ_CST);
+  if (pool->flag && !defer_has_queue())
+    syscall(SYS_futex, &q->wake, FUTEX_WAIT_PRIVATE, wake, &timeout, NULL, 0);
+  clear_parked(q);
+}
+
+static inline void signal_pinned(queue_s *q) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  unpark_worker(q);
+}
+
+#else
+
+static inline void signal_pinned(queue_s *q) {
+  defer_thread_signal();
+  (void)q;
+}
+
+#endif /* DEFER_THREAD_PARKING */
+
 /**
  * A thread entering this function should wait for new evennts.
  */
 #pragma weak defer_thread_wait
 void defer_thread_wait(pool_pt pool, void *p_thr) {
+#if DEFER_THREAD_PARKING
+  if (pinned_local) {
+    park_worker(pool, pinned_local);
+    (void)p_thr;
+    return;
+  }
+#endif
   if (DEFER_THROTTLE_PROGRESSIVE) {
     /* keeps threads active (concurrent), but reduces performance */
     static __thread size_t static_throttle = 1;
-    if (static_throttle < DEFER_THROTTLE_LIMIT)
-      static_throttle = (static_throttle << 1);
+    /* pinned tasks can't be performed by other threads, so wake up sooner */
+    const size_t limit =
+        (pinned_local && pinned.count) ? DEFER_THROTTLE : DEFER_THROTTLE_LIMIT;
+    static_throttle = (static_throttle << 1);
+    if (static_throttle > limit)
+      static_throttle = limit;
     throttle_thread(static_throttle);
     if (defer_has_queue())
       static_throttle = 1;
@@ -355,18 +874,60 @@ void defer_thread_wait(pool_pt pool, void *p_thr) {
  * queue).
  */
 #pragma weak defer_thread_signal
-void defer_thread_signal(void) { (void)0; }
+void defer_thread_signal(void) {
+#if DEFER_THREAD_PARKING
+  /* rotate the starting point, so wakeups are spread between the workers */
+  static volatile size_t next;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!parked_count)
+    return;
+  const size_t capa = pinned.capa;
+  const size_t start = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < capa; ++i) {
+    if (!unpark_worker(pinned.queues[(start + i) % capa]))
+      return;
+  }
+#endif
+}
+
+/**
+ * Called by each worker thread before any tasks are performed.
+ */
+#pragma weak defer_thread_on_start
+void defer_thread_on_start(size_t index) { (void)index; }
+
+/* returns true if the thread should retire (the pool was shrunk). */
+static inline int defer_worker_retire(struct thread_msg_s volatile *data) {
+  pool_pt pool = data->pool;
+  const size_t index = (size_t)(data - pool->threads);
+  if (index < pool->active)
+    return 0;
+  int ret = 0;
+  spn_lock(&pool->review_lock);
+  if (index >= pool->active) {
+    data->running = 0;
+    ret = 1;
+  }
+  spn_unlock(&pool->review_lock);
+  return ret;
+}
 
 /* a thread's cycle. This is what a worker thread does... repeatedly. */
 static void *defer_worker_thread(void *pool_) {
   struct thread_msg_s volatile *data = pool_;
   signal(SIGPIPE, SIG_IGN);
+  pinned_local = data->queue;
+  defer_thread_on_start((size_t)(data - data->pool->threads));
   /* perform any available tasks */
-  defer_perform();
+  data->performed += perform_worker_tasks(data->queue);
   /* as long as the flag is true, wait for and perform tasks. */
   do {
+    if (defer_worker_retire(data))
+      break;
+    spn_add(&data->pool->idle, 1);
     defer_thread_wait(data->pool, data->thrd);
-    defer_perform();
+    spn_sub(&data->pool->idle, 1);
+    data->performed += perform_worker_tasks(data->queue);
   } while (data->pool->flag);
   return NULL;
 }
@@ -376,6 +937,8 @@ void defer_pool_stop(pool_pt pool) {
   if (!pool)
     return;
   pool->flag = 0;
+  /* new pinned tasks are routed to the main queue */
+  pinned.count = 0;
   for (size_t i = 0; i < pool->count; ++i) {
     defer_thread_signal();
   }
@@ -384,6 +947,88 @@ void defer_pool_stop(pool_pt pool) {
 /** Returns TRUE (1) if the pool is hadn't been signaled to finish up. */
 int defer_pool_is_active(pool_pt pool) { return (int)pool->flag; }
 
+/* starts (or restarts) the pool's thread at `index`, returns -1 on error. */
+static int defer_pool_spawn(pool_pt pool, unsigned int index) {
+  struct thread_msg_s *data = pool->threads + index;
+  data->pool = pool;
+  data->queue = pinned.queues[index];
+  data->running = 1;
+  data->thrd = defer_new_thread(defer_worker_thread, (void *)data);
+  if (!data->thrd) {
+    data->running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/* adds a thread to an adaptive pool (call while holding the review lock). */
+static void defer_pool_grow(pool_pt pool) {
+  const unsigned int index = pool->active;
+  if (index < pool->count) {
+    /* the thread wasn't retired yet, it will keep running */
+    if (pool->threads[index].running) {
+      ++pool->active;
+      return;
+    }
+    /* the thread retired (it's leaving without the lock), replace it */
+    defer_join_thread(pool->threads[index].thrd);
+    pool->threads[index].thrd = NULL;
+    if (defer_pool_spawn(pool, index))
+      return;
+    ++pool->active;
+    return;
+  }
+  if (defer_pool_spawn(pool, index))
+    return;
+  ++pool->count;
+  ++pool->active;
+}
+
+/* reviews an adaptive pool's size, adding or retiring a thread if required. */
+static void defer_pool_review(pool_pt pool) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  size_t elapsed = ((now.tv_sec - pool->reviewed.tv_sec) * 1000) +
+                   ((now.tv_nsec - pool->reviewed.tv_nsec) / 1000000);
+  if (!elapsed)
+    return;
+  spn_lock(&pool->review_lock);
+  if (!pool->flag)
+    goto finish;
+  pool->reviewed = now;
+  size_t performed = 0;
+  for (size_t i = 0; i < pool->count; ++i)
+    performed += pool->threads[i].performed;
+  const size_t delta = performed - pool->performed;
+  pool->performed = performed;
+  /* Little's law: a new task waits (about) as long as it takes to perform the
+   * tasks ahead of it, at the rate measured since the last review */
+  const size_t depth = defer_queue_len();
+  const size_t latency =
+      depth ? (delta ? (depth * elapsed) / delta : (size_t)-1) : 0;
+  if (latency > DEFER_ADAPTIVE_LATENCY && !pool->idle) {
+    pool->idle_reviews = 0;
+    if (++pool->busy_reviews < DEFER_ADAPTIVE_GROW ||
+        pool->active >= pool->max)
+      goto finish;
+    pool->busy_reviews = 0;
+    defer_pool_grow(pool);
+  } else if (!depth && pool->idle) {
+    pool->busy_reviews = 0;
+    if (++pool->idle_reviews < DEFER_ADAPTIVE_SHRINK ||
+        pool->active <= pool->min)
+      goto finish;
+    pool->idle_reviews = 0;
+    /* the last active thread retires once it's done */
+    --pool->active;
+    defer_thread_signal();
+  } else {
+    pool->busy_reviews = pool->idle_reviews = 0;
+  }
+finish:
+  spn_unlock(&pool->review_lock);
+}
+
 /**
  * Waits for a running thread pool, joining threads and finishing all tasks.
  *
@@ -391,25 +1036,64 @@ int defer_pool_is_active(pool_pt pool) { return (int)pool->flag; }
  * `pool_pt`).
  */
 void defer_pool_wait(pool_pt pool) {
+  /* adaptive pools are reviewed by the waiting thread, since worker threads
+   * might all be busy (or blocked) when the pool should grow */
+  if (pool->min != pool->max) {
+    const struct timespec interval = {
+        .tv_sec = DEFER_ADAPTIVE_INTERVAL / 1000,
+        .tv_nsec = (DEFER_ADAPTIVE_INTERVAL % 1000) * 1000000,
+    };
+    while (pool->flag) {
+      nanosleep(&interval, NULL);
+      defer_pool_review(pool);
+    }
+  }
+  /* the first thread never retires, so it exits once the pool is stopped */
+  if (pool->count)
+    defer_join_thread(pool->threads[0].thrd);
+  /* prevents any further resizing */
+  spn_lock(&pool->review_lock);
   while (pool->count) {
     pool->count--;
-    defer_join_thread(pool->threads[pool->count].thrd);
+    if (pool->count)
+      defer_join_thread(pool->threads[pool->count].thrd);
+    /* tasks pinned to the thread are performed by whoever is left */
+    reroute_tasks(pool->threads[pool->count].queue);
   }
   free(pool);
 }
 
+/** Returns the number of active threads in the pool. */
+size_t defer_pool_count(pool_pt pool) { return pool ? pool->active : 0; }
+
 /** The logic behind `defer_pool_start`. */
 static inline pool_pt defer_pool_initialize(unsigned int thread_count,
-                                            pool_pt pool) {
-  pool->flag = 1;
-  pool->count = 0;
-  while (pool->count < thread_count &&
-         (pool->threads[pool->count].pool = pool) &&
-         (pool->threads[pool->count].thrd = defer_new_thread(
-              defer_worker_thread, (void *)(pool->threads + pool->count))))
-
+                                            unsigned int max, pool_pt pool) {
+  *pool = (struct defer_pool){
+      .flag = 1, .min = thread_count, .max = max,
+  };
+  clock_gettime(CLOCK_MONOTONIC, &pool->reviewed);
+  if (pinned.capa < max) {
+    void *tmp = realloc(pinned.queues, max * sizeof(*pinned.queues));
+    if (!tmp)
+      return NULL;
+    pinned.queues = tmp;
+    while (pinned.capa < max) {
+      pinned.queues[pinned.capa] = malloc(sizeof(queue_s));
+      if (!pinned.queues[pinned.capa])
+        return NULL;
+      *pinned.queues[pinned.capa] =
+          (queue_s)QUEUE_INIT(*pinned.queues[pinned.capa]);
+      ++pinned.capa;
+    }
+  }
+  /* the thread count is set first, as threads retire if `index >= active` */
+  pool->active = thread_count;
+  while (pool->count < thread_count && !defer_pool_spawn(pool, pool->count))
     pool->count++;
   if (pool->count == thread_count) {
+    /* tasks can't be pinned to threads that might retire */
+    pinned.count = (thread_count == max ? thread_count : 0);
     return pool;
   }
   defer_pool_stop(pool);
@@ -418,14 +1102,22 @@ static inline pool_pt defer_pool_initialize(unsigned int thread_count,
 
 /** Starts a thread pool that will run deferred tasks in the background. */
 pool_pt defer_pool_start(unsigned int thread_count) {
-  if (thread_count == 0)
+  return defer_pool_start_adaptive(thread_count, thread_count);
+}
+
+/**
+ * Starts an adaptive thread pool, with `min` to `max` threads.
+ */
+pool_pt defer_pool_start_adaptive(unsigned int min, unsigned int max) {
+  if (min == 0)
     return NULL;
-  pool_pt pool =
-      malloc(sizeof(*pool) + (thread_count * sizeof(*pool->threads)));
+  if (max < min)
+    max = min;
+  pool_pt pool = calloc(1, sizeof(*pool) + (max * sizeof(*pool->threads)));
   if (!pool)
     return NULL;
 
-  return defer_pool_initialize(thread_count, pool);
+  return defer_pool_initialize(min, max, pool);
 }
 
 /* *****************************************************************************
@@ -466,6 +1158,13 @@ static void text_task(void *a1, void *a2) {
   defer(text_task_text, a1, a2);
 }
 
+static size_t priority_log[128];
+static size_t priority_log_len;
+static void priority_task(void *priority, void *unused2) {
+  priority_log[priority_log_len++] = (size_t)priority;
+  (void)unused2;
+}
+
 void defer_test(void) {
 #define TEST_ASSERT(cond, ...)                                                 \
   if (!(cond)) {                                                               \
@@ -542,6 +1241,30 @@ void defer_test(void) {
     TEST_ASSERT(i_count == i_count_should_be, "ERROR: defer count invalid\n");
   }
 
+  fprintf(stderr, "\nDefer throughput (%s queue):\n",
+          DEFER_QUEUE_LOCKFREE ? "lock-free" : "locked");
+  for (size_t threads = 1; threads <= 64; threads <<= 2) {
+    COUNT_RESET;
+    i_count = 0;
+    const size_t per_task = TOTAL_COUNT >> 6;
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    pool_pt pool = defer_pool_start(threads);
+    for (size_t j = 0; j < 64; ++j) {
+      defer(sched_sample_task, (void *)per_task, NULL);
+    }
+    defer_pool_stop(pool);
+    defer_pool_wait(pool);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    double elapsed = (double)(t_end.tv_sec - t_start.tv_sec) +
+                     ((double)(t_end.tv_nsec - t_start.tv_nsec) / 1000000000.0);
+    fprintf(stderr, "- %2zu threads: %.0f tasks/sec (%lu tasks, %.3f sec)\n",
+            threads, (double)(i_count + 64) / elapsed, (unsigned long)i_count,
+            elapsed);
+    TEST_ASSERT(i_count == i_count_should_be, "ERROR: defer count invalid\n");
+  }
+  fprintf(stderr, "\n");
+
   COUNT_RESET;
   i_count = 0;
   for (size_t i = 0; i < 1024; i++) {
@@ -556,6 +1279,37 @@ void defer_test(void) {
           (unsigned long)i_count, (unsigned long)count_dealloc,
           (unsigned long)count_alloc);
 
+  priority_ticket = 0;
+  priority_log_len = 0;
+  for (size_t i = 0; i < 3; ++i) {
+    defer_priority(DEFER_PRIORITY_BACKGROUND, priority_task,
+                   (void *)DEFER_PRIORITY_BACKGROUND, NULL);
+    defer(priority_task, (void *)DEFER_PRIORITY_NORMAL, NULL);
+    defer_priority(DEFER_PRIORITY_IO, priority_task, (void *)DEFER_PRIORITY_IO,
+                   NULL);
+    defer_priority(DEFER_PRIORITY_URGENT, priority_task,
+                   (void *)DEFER_PRIORITY_URGENT, NULL);
+  }
+  defer_perform();
+  TEST_ASSERT(priority_log_len == 12, "ERROR: priority task count invalid\n");
+  for (size_t i = 1; i < priority_log_len; ++i) {
+    TEST_ASSERT(priority_log[i - 1] <= priority_log[i],
+                "ERROR: priority order invalid\n");
+  }
+  priority_ticket = 0;
+  priority_log_len = 0;
+  defer_priority(DEFER_PRIORITY_BACKGROUND, priority_task,
+                 (void *)DEFER_PRIORITY_BACKGROUND, NULL);
+  for (size_t i = 0; i < 64; ++i)
+    defer_priority(DEFER_PRIORITY_URGENT, priority_task,
+                   (void *)DEFER_PRIORITY_URGENT, NULL);
+  defer_perform();
+  TEST_ASSERT(priority_log_len == 65, "ERROR: priority task count invalid\n");
+  TEST_ASSERT(priority_log[DEFER_PRIORITY_AGING - 1] ==
+                  DEFER_PRIORITY_BACKGROUND,
+              "ERROR: background task starved\n");
+  fprintf(stderr, "* Defer priority classes (and aging) tested.\n");
+
   COUNT_RESET;
   i_count = 0;
   defer_clear_queue();
@@ -19,6 +19,8 @@ buffer is nenver freed (it's left "on call" for new events). To avoid this leak
 call `defer_clear_queue` before exiting the program.
 */
 #define H_DEFER_H
+#include <stdint.h>
+#include <stdlib.h>
 #define LIB_DEFER_VERSION_MAJOR 0
 #define LIB_DEFER_VERSION_MINOR 1
 #define LIB_DEFER_VERSION_PATCH 2
@@ -38,12 +40,70 @@ Core API
 /** Defer an execution of a function for later. Returns -1 on error.*/
 int defer(void (*func)(void *, void *), void *arg1, void *arg2);
 
+/**
+ * Task priority classes, from the most to the least urgent.
+ *
+ * `defer` schedules tasks using `DEFER_PRIORITY_NORMAL`.
+ */
+enum {
+  /** Flushing and closing connections (frees resources). */
+  DEFER_PRIORITY_URGENT = 0,
+  /** IO events and timers. */
+  DEFER_PRIORITY_IO = 1,
+  /** The default priority (internal tasks, pub/sub delivery, etc'). */
+  DEFER_PRIORITY_NORMAL = 2,
+  /** Background tasks that shouldn't delay IO (i.e., user scheduled tasks). */
+  DEFER_PRIORITY_BACKGROUND = 3,
+  DEFER_PRIORITY_COUNT
+};
+
+/**
+ * Defers an execution of a function using a specific priority class. Returns
+ * -1 on error.
+ *
+ * Tasks are performed by priority, but some tasks from lower priority classes
+ * are always performed (see `DEFER_PRIORITY_AGING`), so a busy class can't
+ * starve the rest. Tasks of the same class are performed in order.
+ */
+int defer_priority(int priority, void (*func)(void *, void *), void *arg1,
+                   void *arg2);
+
+/**
+ * Defers an execution of a function to a specific worker thread (the thread is
+ * selected using `key % thread_count`), so tasks sharing the same `key` are
+ * always performed by the same thread. Returns -1 on error.
+ *
+ * When no thread pool is running, this behaves the same as `defer`.
+ */
+int defer_pinned(size_t key, void (*func)(void *, void *), void *arg1,
+                 void *arg2);
+
+/**
+ * Returns the `defer_pinned` key of the calling worker thread, or -1 if the
+ * calling thread isn't one of the thread pool's worker threads.
+ */
+intptr_t defer_pinned_self(void);
+
 /** Performs all deferred functions until the queue had been depleted. */
 void defer_perform(void);
 
+/**
+ * Performs up to `limit` deferred functions (or until the queue is empty),
+ * returning the number of functions performed.
+ *
+ * This allows a thread to perform ready tasks while it holds an expensive
+ * resource (i.e., a language's global lock). While the batch is performed,
+ * `defer_has_queue` is always true on the calling thread, so the reactor won't
+ * block while waiting for events. Nested calls perform nothing and return 0.
+ */
+size_t defer_perform_batch(size_t limit);
+
 /** returns true if there are deferred functions waiting for execution. */
 int defer_has_queue(void);
 
+/** returns the (approximate) number of deferred functions waiting. */
+size_t defer_queue_len(void);
+
 /** Clears the queue without performing any of the tasks. */
 void defer_clear_queue(void);
 
@@ -79,6 +139,23 @@ void defer_pool_wait(pool_pt pool);
 /** Returns TRUE (1) if the pool is hadn't been signaled to finish up. */
 int defer_pool_is_active(pool_pt pool);
 
+/**
+ * Starts an adaptive thread pool, running between `min` and `max` threads.
+ *
+ * The pool's size is reviewed by the thread calling `defer_pool_wait` (every
+ * `DEFER_ADAPTIVE_INTERVAL` milliseconds). Threads are added while the queue
+ * grows faster than it's performed (the estimated queue wait exceeds
+ * `DEFER_ADAPTIVE_LATENCY` milliseconds and no thread is idle). Threads are
+ * retired after the pool was idle for a longer while.
+ *
+ * Tasks can't be pinned to the threads of an adaptive pool (`defer_pinned`
+ * behaves the same as `defer`) unless `min == max`.
+ */
+pool_pt defer_pool_start_adaptive(unsigned int min, unsigned int max);
+
+/** Returns the number of active threads in the pool. */
+size_t defer_pool_count(pool_pt pool);
+
 /**
  * OVERRIDE THIS to replace the default pthread implementation.
  *
@@ -126,13 +203,25 @@ void defer_thread_throttle(unsigned long microsec);
 void defer_thread_wait(pool_pt pool, void *p_thr);
 
 /**
- * OVERRIDE THIS to replace the default implementation (which does nothing).
+ * OVERRIDE THIS to replace the default implementation (which does nothing,
+ * unless `DEFER_THREAD_PARKING` is enabled, in which case a single parked
+ * worker thread is woken up).
  *
  * This should signal a single waiting thread to wake up (a new task entered the
  * queue).
  */
 void defer_thread_signal(void);
 
+/**
+ * OVERRIDE THIS to initialize worker threads (the default implementation does
+ * nothing).
+ *
+ * Called by each of the thread pool's worker threads before any tasks are
+ * performed. `index` is the thread's position in the pool (and it's
+ * `defer_pinned` key).
+ */
+void defer_thread_on_start(size_t index);
+
 /** Call this function after forking, to make sure no locks are engaged. */
 void defer_on_fork(void);
 
@@ -9,7 +9,7 @@ Feel free to copy, use and enjoy according to the license provided.
 #include <stdlib.h>
 
 /**
-This is an `epoll` / `kqueue` ONE-SHOT polling wrapper, allowing for portability
+This is an `epoll` / `kqueue` / `io_uring` ONE-SHOT polling wrapper, allowing for portability
 between BSD and Linux polling machanisms and routing events to hard-coded
 callbacks (weak function symbols).
 
@@ -26,7 +26,10 @@ The callbacks supported by thils library:
 #define LIB_EVIO_VERSION_MINOR 2
 #define LIB_EVIO_VERSION_PATCH 0
 
-#if defined(__linux__)
+#if defined(__linux__) && defined(EVIO_ENGINE_URING) && EVIO_ENGINE_URING
+/* the `io_uring` engine must be requested explicitly (Linux 5.1 or later). */
+#elif defined(__linux__)
+#undef EVIO_ENGINE_URING
 #define EVIO_ENGINE_EPOLL 1
 #elif defined(__APPLE__) || defined(__unix__)
 #define EVIO_ENGINE_KQUEUE 1
@@ -45,6 +48,33 @@ extern "C" {
 #define EVIO_TICK 512 /** in milliseconsd */
 #endif
 
+/**
+ * When true, the `epoll` engine uses a single `epoll` instance (rather than
+ * nesting separate read and write instances in a master instance).
+ *
+ * Each fd is registered once (edge triggered) with it's read and write
+ * interests combined and ONE SHOT events are emulated, so re-arming an
+ * interest that was already reported doesn't call `epoll_ctl`. Listening
+ * sockets use `EPOLLEXCLUSIVE`, so a new connection wakes up a single worker
+ * process.
+ *
+ * Ignored by the `kqueue` and `io_uring` engines.
+ */
+#ifndef EVIO_EPOLL_SINGLE
+#define EVIO_EPOLL_SINGLE 0
+#endif
+
+/**
+ * True when `evio_add_listener` registers edge triggered events. In which case,
+ * a listener's `evio_on_data` event fires once per edge, so a listener that
+ * didn't drain it's backlog must review it again without waiting for an event.
+ */
+#if defined(EVIO_ENGINE_EPOLL) && EVIO_EPOLL_SINGLE
+#define EVIO_LISTENER_EDGE 1
+#else
+#define EVIO_LISTENER_EDGE 0
+#endif
+
 #if (EVIO_MAX_EVENTS & 1)
 #error EVIO_MAX_EVENTS must be an EVEN number.
 #endif
@@ -121,11 +151,35 @@ safely ignored.
 */
 int evio_add_write(int fd, void *callback_arg);
 
+/**
+Adds a listening socket to the polling object, to be polled for incoming
+connections (`evio_on_data` wil be called). Re-arm it using `evio_add_read`.
+
+Listening sockets might be shared by a number of processes, each with it's own
+polling object. Where supported, only a single process is woken up per event
+(see `EVIO_EPOLL_SINGLE` and `EVIO_LISTENER_EDGE`).
+
+Returns -1 on error, otherwise return value is system dependent and can be
+safely ignored.
+*/
+int evio_add_listener(int fd, void *callback_arg);
+
 /**
 Removes a file descriptor from the polling object.
 */
 void evio_remove(int fd);
 
+/**
+Removes a file descriptor from the polling object, but only if it's still
+being polled for `callback_arg` (the fd might have been reused).
+
+This should be called after a file descriptor was closed. The `epoll` and
+`kqueue` engines ignore this call (closing an fd removes it from the polling
+object), but the `io_uring` engine will keep the file open until pending
+events are canceled.
+*/
+void evio_forget(int fd, void *callback_arg);
+
 /* *****************************************************************************
 Timers.
 */
@@ -146,6 +200,16 @@ Returns -1 on error, otherwise return value is system dependent.
 */
 int evio_set_timer(int fd, void *callback_arg, unsigned long milliseconds);
 
+/**
+Arms a timer file descriptor for a single event, `microseconds` from now.
+
+Systems that don't support microsecond timers round up to the nearest
+millisecond.
+
+Returns -1 on error, otherwise return value is system dependent.
+*/
+int evio_set_timer_us(int fd, void *callback_arg, unsigned long microseconds);
+
 /* *****************************************************************************
 Callbacks - override these.
 */
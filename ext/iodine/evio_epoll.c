@@ -12,6 +12,8 @@ Feel free to copy, use and enjoy according to the license provided.
 
 #ifdef EVIO_ENGINE_EPOLL
 
+#include "spnlock.inc"
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -20,6 +22,7 @@ Feel free to copy, use and enjoy according to the license provided.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -30,9 +33,33 @@ Feel free to copy, use and enjoy according to the license provided.
 Global data and system independant code
 ***************************************************************************** */
 
-/* epoll tester, in and out */
+/* epoll tester, in and out (only the first is used by EVIO_EPOLL_SINGLE) */
 static int evio_fd[3] = {-1, -1, -1};
 
+#if EVIO_EPOLL_SINGLE
+/* the polling state of each fd (EVIO_EPOLL_SINGLE) */
+typedef struct {
+  /* the callback argument */
+  void *arg;
+  /* the interests (EPOLLIN / EPOLLOUT) waiting for an event */
+  uint32_t armed;
+  /* the interests reported while they weren't armed */
+  uint32_t pending;
+  /* the interests registered with `epoll` */
+  uint32_t mask;
+  spn_lock_i lock;
+  /* set once the fd was added to the `epoll` instance */
+  uint8_t registered;
+  /* set for `EPOLLEXCLUSIVE` registrations (listening sockets) */
+  uint8_t exclusive;
+} evio_fd_s;
+
+static struct {
+  evio_fd_s *fds;
+  size_t capacity;
+} evio_state;
+#endif
+
 /** Closes the `epoll` / `kqueue` object, releasing it's resources. */
 void evio_close() {
   for (int i = 0; i < 3; ++i) {
@@ -41,6 +68,11 @@ void evio_close() {
       evio_fd[i] = -1;
     }
   }
+#if EVIO_EPOLL_SINGLE
+  free(evio_state.fds);
+  evio_state.fds = NULL;
+  evio_state.capacity = 0;
+#endif
 }
 
 /**
@@ -54,6 +86,218 @@ Linux `epoll` implementation
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 
+#if EVIO_EPOLL_SINGLE
+
+/* *****************************************************************************
+A single `epoll` instance (EVIO_EPOLL_SINGLE)
+
+Each fd is registered once (edge triggered) and ONE SHOT events are emulated:
+an event is only reported for the interests that were armed, while edges
+reported for interests that weren't armed are kept pending and reported as soon
+as the interest is armed (without calling `epoll_ctl`).
+
+Otherwise, arming an interest calls `EPOLL_CTL_MOD`, so the fd's readiness is
+tested again (the previous event's data might not have been fully read).
+
+`EPOLLONESHOT` isn't used, since it would disable all the fd's interests once
+any of them fired, requiring the rest to be re-armed (i.e., after every write).
+
+Listening sockets are registered using `EPOLLEXCLUSIVE`, so a new connection
+wakes up a single worker process. Exclusive registrations can't be modified.
+***************************************************************************** */
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1U << 28)
+#endif
+
+/**
+Creates the `epoll` or `kqueue` object.
+*/
+intptr_t evio_create() {
+  evio_close();
+  struct rlimit rlim = {.rlim_cur = 0};
+  getrlimit(RLIMIT_NOFILE, &rlim);
+  if (rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > (1UL << 24))
+    rlim.rlim_cur = (1UL << 24);
+  if (rlim.rlim_cur < 1024)
+    rlim.rlim_cur = 1024;
+  evio_state.fds = calloc(rlim.rlim_cur, sizeof(*evio_state.fds));
+  if (!evio_state.fds)
+    goto error;
+  evio_state.capacity = rlim.rlim_cur;
+  evio_fd[0] = epoll_create1(EPOLL_CLOEXEC);
+  if (evio_fd[0] == -1)
+    goto error;
+  return 0;
+error:
+#if DEBUB
+  perror("ERROR: (evoid) failed to initialize");
+#endif
+  evio_close();
+  return -1;
+}
+
+static inline evio_fd_s *evio_fd_get(int fd) {
+  if (fd < 0 || (size_t)fd >= evio_state.capacity)
+    return NULL;
+  return evio_state.fds + fd;
+}
+
+/* (re)registers the fd, testing it's readiness. Call only while locked. */
+static inline int evio_register_unsafe(int fd, evio_fd_s *ev) {
+  struct epoll_event chevent = {
+      .events = (ev->mask | EPOLLRDHUP | EPOLLET), .data.fd = fd,
+  };
+  int ret;
+  if (ev->registered) {
+    ret = epoll_ctl(evio_fd[0], EPOLL_CTL_MOD, fd, &chevent);
+    if (ret == -1 && errno == ENOENT)
+      ret = epoll_ctl(evio_fd[0], EPOLL_CTL_ADD, fd, &chevent);
+  } else {
+    ret = epoll_ctl(evio_fd[0], EPOLL_CTL_ADD, fd, &chevent);
+    if (ret == -1 && errno == EEXIST)
+      ret = epoll_ctl(evio_fd[0], EPOLL_CTL_MOD, fd, &chevent);
+  }
+  ev->registered = (ret == 0);
+  return ret;
+}
+
+/* clears an fd's state. Call only while holding the fd's lock. */
+static inline void evio_clear_unsafe(int fd, evio_fd_s *ev) {
+  if (ev->exclusive) {
+    struct epoll_event chevent = {.events = 0};
+    epoll_ctl(evio_fd[0], EPOLL_CTL_DEL, fd, &chevent);
+  }
+  *ev = (evio_fd_s){.lock = ev->lock, .arg = ev->arg};
+}
+
+static int evio_add_events(int fd, void *callback_arg, uint32_t events) {
+  evio_fd_s *ev = evio_fd_get(fd);
+  if (evio_fd[0] < 0 || !ev)
+    return -1;
+  int ret = 0;
+  spn_lock(&ev->lock);
+  if (ev->arg != callback_arg) {
+    /* the fd was reused */
+    evio_clear_unsafe(fd, ev);
+    ev->arg = callback_arg;
+  }
+  const uint32_t fire = ev->pending & events;
+  ev->pending &= ~fire;
+  if (events & ~fire) {
+    ev->armed |= events & ~fire;
+    ev->mask |= ev->armed;
+    if (!ev->exclusive)
+      ret = evio_register_unsafe(fd, ev);
+  }
+  spn_unlock(&ev->lock);
+  if (fire & EPOLLOUT)
+    evio_on_ready(callback_arg);
+  if (fire & EPOLLIN)
+    evio_on_data(callback_arg);
+  return ret;
+}
+
+/**
+Removes a file descriptor from the polling object.
+*/
+void evio_remove(int fd) {
+  evio_fd_s *ev = evio_fd_get(fd);
+  if (evio_fd[0] < 0 || !ev)
+    return;
+  struct epoll_event chevent = {.events = (EPOLLOUT | EPOLLIN), .data.fd = fd};
+  spn_lock(&ev->lock);
+  epoll_ctl(evio_fd[0], EPOLL_CTL_DEL, fd, &chevent);
+  *ev = (evio_fd_s){.lock = ev->lock};
+  spn_unlock(&ev->lock);
+}
+
+/**
+Closed file descriptors are automatically removed from the polling object, but
+their state is cleared, so a reused fd doesn't inherit it.
+*/
+void evio_forget(int fd, void *callback_arg) {
+  evio_fd_s *ev = evio_fd_get(fd);
+  if (!ev)
+    return;
+  spn_lock(&ev->lock);
+  if (ev->arg == callback_arg)
+    *ev = (evio_fd_s){.lock = ev->lock};
+  spn_unlock(&ev->lock);
+}
+
+/**
+Adds a file descriptor to the polling object.
+*/
+int evio_add(int fd, void *callback_arg) {
+  return evio_add_events(fd, callback_arg, (EPOLLIN | EPOLLOUT));
+}
+
+/**
+Adds a file descriptor to the polling object (ONE SHOT), to be polled for
+incoming data (`evio_on_data` wil be called).
+*/
+int evio_add_read(int fd, void *callback_arg) {
+  return evio_add_events(fd, callback_arg, EPOLLIN);
+}
+
+/**
+Adds a file descriptor to the polling object (ONE SHOT), to be polled for
+outgoing buffer readiness data (`evio_on_ready` wil be called).
+*/
+int evio_add_write(int fd, void *callback_arg) {
+  return evio_add_events(fd, callback_arg, EPOLLOUT);
+}
+
+/**
+Adds a listening socket to the polling object (edge triggered, exclusive).
+*/
+int evio_add_listener(int fd, void *callback_arg) {
+  evio_fd_s *ev = evio_fd_get(fd);
+  if (evio_fd[0] < 0 || !ev)
+    return -1;
+  struct epoll_event chevent = {
+      .events = (EPOLLIN | EPOLLET | EPOLLEXCLUSIVE), .data.fd = fd,
+  };
+  spn_lock(&ev->lock);
+  epoll_ctl(evio_fd[0], EPOLL_CTL_DEL, fd, &chevent);
+  int ret = epoll_ctl(evio_fd[0], EPOLL_CTL_ADD, fd, &chevent);
+  if (ret == -1 && errno == EINVAL) {
+    /* `EPOLLEXCLUSIVE` requires Linux 4.5 or later */
+    chevent.events = (EPOLLIN | EPOLLET);
+    ret = epoll_ctl(evio_fd[0], EPOLL_CTL_ADD, fd, &chevent);
+  }
+  *ev = (evio_fd_s){
+      .lock = ev->lock,
+      .arg = callback_arg,
+      .armed = EPOLLIN,
+      .mask = EPOLLIN,
+      .registered = (ret == 0),
+      .exclusive = 1,
+  };
+  spn_unlock(&ev->lock);
+  return ret;
+}
+
+/* arms a timer's ONE SHOT event (expirations before the timer was set are
+ * ignored) */
+static inline int evio_arm_timer(int fd, void *callback_arg) {
+  evio_fd_s *ev = evio_fd_get(fd);
+  if (!ev)
+    return -1;
+  spn_lock(&ev->lock);
+  if (ev->arg == callback_arg)
+    ev->pending = 0;
+  spn_unlock(&ev->lock);
+  return evio_add_events(fd, callback_arg, EPOLLIN);
+}
+
+#else
+
+/* *****************************************************************************
+Nested `epoll` instances (a master instance polling a read and a write instance)
+***************************************************************************** */
+
 /**
 Creates the `epoll` or `kqueue` object.
 */
@@ -91,6 +335,14 @@ void evio_remove(int fd) {
   epoll_ctl(evio_fd[2], EPOLL_CTL_DEL, fd, &chevent);
 }
 
+/**
+Closed file descriptors are automatically removed from the polling object.
+*/
+void evio_forget(int fd, void *callback_arg) {
+  (void)fd;
+  (void)callback_arg;
+}
+
 static inline int evio_add2(int fd, void *callback_arg, uint32_t events,
                             int ep_fd) {
   struct epoll_event chevent;
@@ -144,6 +396,20 @@ int evio_add_write(int fd, void *callback_arg) {
                    evio_fd[2]);
 }
 
+/**
+Adds a listening socket to the polling object (same as `evio_add`).
+*/
+int evio_add_listener(int fd, void *callback_arg) {
+  return evio_add(fd, callback_arg);
+}
+
+/* arms a timer's ONE SHOT event */
+static inline int evio_arm_timer(int fd, void *callback_arg) {
+  return evio_add2(fd, callback_arg, (EPOLLIN | EPOLLONESHOT), evio_fd[1]);
+}
+
+#endif /* EVIO_EPOLL_SINGLE */
+
 /**
 Creates a timer file descriptor, system dependent.
 */
@@ -194,9 +460,89 @@ int evio_set_timer(int fd, void *callback_arg, unsigned long milliseconds) {
   if (timerfd_settime(fd, 0, &new_t_data, NULL) == -1)
     return -1;
   /* add to epoll */
-  return evio_add2(fd, callback_arg, (EPOLLIN | EPOLLONESHOT), evio_fd[1]);
+  return evio_arm_timer(fd, callback_arg);
 }
 
+/**
+Arms a timer file descriptor for a single event, `microseconds` from now.
+*/
+int evio_set_timer_us(int fd, void *callback_arg, unsigned long microseconds) {
+  if (evio_fd[0] < 0)
+    return -1;
+  /* clear out existing timer marker, if exists. */
+  char data[8]; // void * is 8 byte long
+  if (read(fd, &data, 8) < 0)
+    data[0] = 0;
+  /* set file's time value (a zero value disarms the timer) */
+  if (!microseconds)
+    microseconds = 1;
+  struct itimerspec new_t_data = {
+      .it_value.tv_sec = microseconds / 1000000,
+      .it_value.tv_nsec = (microseconds % 1000000) * 1000,
+  };
+  if (timerfd_settime(fd, 0, &new_t_data, NULL) == -1)
+    return -1;
+  /* add to epoll */
+  return evio_arm_timer(fd, callback_arg);
+}
+
+/* routes an event to the callbacks */
+static inline void evio_dispatch(uint32_t events, void *arg) {
+  if ((events & (EPOLLIN | EPOLLERR)) == EPOLLIN &&
+      (events & (EPOLLRDHUP | EPOLLHUP))) {
+    // the peer hung up, but there's data left in the buffer (i.e., a
+    // response followed by `connection: close`). `read` reports the EOF.
+    evio_on_data(arg);
+  } else if (events & (~(EPOLLIN | EPOLLOUT))) {
+    // errors are hendled as disconnections (on_close)
+    evio_on_error(arg);
+  } else {
+    // no error, then it's an active event(s)
+    if (events & EPOLLOUT) {
+      evio_on_ready(arg);
+    }
+    if (events & EPOLLIN)
+      evio_on_data(arg);
+  }
+}
+
+#if EVIO_EPOLL_SINGLE
+
+/**
+Reviews any pending events (up to EVIO_MAX_EVENTS) and calls any callbacks.
+ */
+int evio_review(const int timeout_millisec) {
+  if (evio_fd[0] < 0)
+    return -1;
+  struct epoll_event events[EVIO_MAX_EVENTS];
+  int active_count =
+      epoll_wait(evio_fd[0], events, EVIO_MAX_EVENTS, timeout_millisec);
+  if (active_count <= 0)
+    return active_count;
+  for (int i = 0; i < active_count; i++) {
+    evio_fd_s *ev = evio_fd_get(events[i].data.fd);
+    if (!ev)
+      continue;
+    uint32_t ready = 0;
+    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      ready |= EPOLLIN;
+    if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+      ready |= EPOLLOUT;
+    spn_lock(&ev->lock);
+    void *arg = ev->arg;
+    const uint32_t fire = ready & ev->armed;
+    ev->armed &= ~fire;
+    ev->pending |= ready & ~fire;
+    spn_unlock(&ev->lock);
+    /* report only the interests that were armed (and any errors) */
+    if (fire)
+      evio_dispatch(events[i].events & (fire | ~(EPOLLIN | EPOLLOUT)), arg);
+  }
+  return active_count;
+}
+
+#else
+
 /**
 Reviews any pending events (up to EVIO_MAX_EVENTS) and calls any callbacks.
  */
@@ -217,17 +563,7 @@ int evio_review(const int timeout_millisec) {
         epoll_wait(internal[j].data.fd, events, EVIO_MAX_EVENTS, 0);
     if (active_count > 0) {
       for (int i = 0; i < active_count; i++) {
-        if (events[i].events & (~(EPOLLIN | EPOLLOUT))) {
-          // errors are hendled as disconnections (on_close)
-          evio_on_error(events[i].data.ptr);
-        } else {
-          // no error, then it's an active event(s)
-          if (events[i].events & EPOLLOUT) {
-            evio_on_ready(events[i].data.ptr);
-          }
-          if (events[i].events & EPOLLIN)
-            evio_on_data(events[i].data.ptr);
-        }
+        evio_dispatch(events[i].events, events[i].data.ptr);
       } // end for loop
       total += active_count;
     }
@@ -236,6 +572,8 @@ int evio_review(const int timeout_millisec) {
   return total;
 }
 
+#endif /* EVIO_EPOLL_SINGLE */
+
 #include <poll.h>
 
 /** Waits up to `timeout_millisec` for events. No events are signaled. */
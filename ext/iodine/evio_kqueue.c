@@ -75,6 +75,14 @@ void evio_remove(int fd) {
   kevent(evio_fd, chevent, 3, NULL, 0, NULL);
 }
 
+/**
+Closed file descriptors are automatically removed from the polling object.
+*/
+void evio_forget(int fd, void *callback_arg) {
+  (void)fd;
+  (void)callback_arg;
+}
+
 /**
 Adds a file descriptor to the polling object.
 */
@@ -109,6 +117,13 @@ int evio_add_write(int fd, void *callback_arg) {
   return kevent(evio_fd, chevent, 1, NULL, 0, NULL);
 }
 
+/**
+Adds a listening socket to the polling object (same as `evio_add`).
+*/
+int evio_add_listener(int fd, void *callback_arg) {
+  return evio_add(fd, callback_arg);
+}
+
 /**
 Creates a timer file descriptor, system dependent.
 */
@@ -136,6 +151,21 @@ int evio_set_timer(int fd, void *callback_arg, unsigned long milliseconds) {
   return kevent(evio_fd, &chevent, 1, NULL, 0, NULL);
 }
 
+/**
+Arms a timer file descriptor for a single event, `microseconds` from now.
+*/
+int evio_set_timer_us(int fd, void *callback_arg, unsigned long microseconds) {
+  struct kevent chevent;
+#ifdef NOTE_USECONDS
+  EV_SET(&chevent, fd, EVFILT_TIMER, EV_ADD | EV_ENABLE | EV_ONESHOT,
+         NOTE_USECONDS, microseconds, callback_arg);
+#else
+  EV_SET(&chevent, fd, EVFILT_TIMER, EV_ADD | EV_ENABLE | EV_ONESHOT, 0,
+         (microseconds + 999) / 1000, callback_arg);
+#endif
+  return kevent(evio_fd, &chevent, 1, NULL, 0, NULL);
+}
+
 /**
 Reviews any pending events (up to EVIO_MAX_EVENTS) and calls any callbacks.
  */
@@ -0,0 +1,514 @@
+/*
+Copyright: Boaz Segev, 2016-2017
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "evio.h"
+
+#ifdef EVIO_ENGINE_URING
+
+#include "spnlock.inc"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+/* *****************************************************************************
+The `io_uring` engine
+
+Each ONE SHOT event is an `IORING_OP_POLL_ADD` request. The request's
+`user_data` encodes the fd, the event type and a generation counter, while the
+callback argument is stored in a per-fd table. Completions for requests that
+were replaced (i.e., the fd was re-armed for a new connection) are ignored.
+
+Requests are submitted as soon as they are added, so the reactor doesn't miss
+events while it's waiting. Completions are reviewed in batches of up to
+`EVIO_MAX_EVENTS`.
+
+Closing a file descriptor does NOT cancel pending `io_uring` requests (the
+kernel holds on to the file), so `evio_forget` MUST be called when closing a
+connection.
+***************************************************************************** */
+
+#ifndef EVIO_URING_ENTRIES
+/** The number of submission queue entries (rounded up by the kernel). */
+#define EVIO_URING_ENTRIES 1024
+#endif
+
+#define EVIO_URING_READ ((uint64_t)1 << 62)
+#define EVIO_URING_WRITE ((uint64_t)2 << 62)
+#define EVIO_URING_CANCEL ((uint64_t)3 << 62)
+#define EVIO_URING_TAG_MASK ((uint64_t)3 << 62)
+#define EVIO_URING_GEN_MASK ((((uint64_t)1 << 30) - 1) << 32)
+#define EVIO_URING_FD_MASK ((uint64_t)0xFFFFFFFF)
+
+typedef struct {
+  /* the armed request's `user_data` (0 == not armed) */
+  uint64_t user_data;
+  /* the callback argument */
+  void *arg;
+} evio_uring_event_s;
+
+static struct {
+  /* submission queue */
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t *sq_mask;
+  uint32_t *sq_array;
+  struct io_uring_sqe *sqes;
+  uint32_t sq_entries;
+  /* completion queue */
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* mapped memory */
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  /* the armed events for each fd (read, write) */
+  evio_uring_event_s (*armed)[2];
+  size_t capacity;
+  /* a request generation counter */
+  uint64_t generation;
+  /* the number of SQEs waiting to be submitted */
+  uint32_t pending;
+  int fd;
+  spn_lock_i sq_lock;
+  spn_lock_i cq_lock;
+} evio_uring = {.fd = -1, .sq_lock = SPN_LOCK_INIT, .cq_lock = SPN_LOCK_INIT};
+
+static inline int evio_uring_setup(unsigned entries,
+                                   struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int evio_uring_enter(unsigned to_submit, unsigned min_complete,
+                                   unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, evio_uring.fd, to_submit,
+                      min_complete, flags, NULL, 0);
+}
+
+/* *****************************************************************************
+Global data and system independant code
+***************************************************************************** */
+
+/** Closes the `epoll` / `kqueue` object, releasing it's resources. */
+void evio_close() {
+  if (evio_uring.sqes)
+    munmap(evio_uring.sqes, evio_uring.sqes_size);
+  if (evio_uring.cq_ring && evio_uring.cq_ring != evio_uring.sq_ring)
+    munmap(evio_uring.cq_ring, evio_uring.cq_ring_size);
+  if (evio_uring.sq_ring)
+    munmap(evio_uring.sq_ring, evio_uring.sq_ring_size);
+  if (evio_uring.fd != -1)
+    close(evio_uring.fd);
+  free(evio_uring.armed);
+  evio_uring = (__typeof__(evio_uring)){
+      .fd = -1, .sq_lock = SPN_LOCK_INIT, .cq_lock = SPN_LOCK_INIT};
+}
+
+/**
+returns true if the evio is available for adding or removing file descriptors.
+*/
+int evio_isactive(void) { return evio_uring.fd >= 0; }
+
+/* *****************************************************************************
+Linux `io_uring` implementation
+***************************************************************************** */
+
+/**
+Creates the `epoll` or `kqueue` object.
+*/
+intptr_t evio_create() {
+  evio_close();
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  evio_uring.fd = evio_uring_setup(EVIO_URING_ENTRIES, &params);
+  if (evio_uring.fd == -1)
+    goto error;
+  fcntl(evio_uring.fd, F_SETFD, FD_CLOEXEC);
+
+  evio_uring.sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  evio_uring.cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) &&
+      evio_uring.cq_ring_size > evio_uring.sq_ring_size)
+    evio_uring.sq_ring_size = evio_uring.cq_ring_size;
+
+  evio_uring.sq_ring =
+      mmap(NULL, evio_uring.sq_ring_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, evio_uring.fd, IORING_OFF_SQ_RING);
+  if (evio_uring.sq_ring == MAP_FAILED) {
+    evio_uring.sq_ring = NULL;
+    goto error;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    evio_uring.cq_ring = evio_uring.sq_ring;
+  } else {
+    evio_uring.cq_ring =
+        mmap(NULL, evio_uring.cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, evio_uring.fd, IORING_OFF_CQ_RING);
+    if (evio_uring.cq_ring == MAP_FAILED) {
+      evio_uring.cq_ring = NULL;
+      goto error;
+    }
+  }
+  evio_uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  evio_uring.sqes =
+      mmap(NULL, evio_uring.sqes_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, evio_uring.fd, IORING_OFF_SQES);
+  if (evio_uring.sqes == MAP_FAILED) {
+    evio_uring.sqes = NULL;
+    goto error;
+  }
+
+  uint8_t *sq = evio_uring.sq_ring;
+  uint8_t *cq = evio_uring.cq_ring;
+  evio_uring.sq_head = (uint32_t *)(sq + params.sq_off.head);
+  evio_uring.sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+  evio_uring.sq_mask = (uint32_t *)(sq + params.sq_off.ring_mask);
+  evio_uring.sq_array = (uint32_t *)(sq + params.sq_off.array);
+  evio_uring.sq_entries = params.sq_entries;
+  evio_uring.cq_head = (uint32_t *)(cq + params.cq_off.head);
+  evio_uring.cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+  evio_uring.cq_mask = (uint32_t *)(cq + params.cq_off.ring_mask);
+  evio_uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  return 0;
+error:
+#if DEBUG
+  perror("ERROR: (evio) failed to initialize io_uring");
+#endif
+  evio_close();
+  return -1;
+}
+
+/** Submits any pending SQEs. Call only while holding `sq_lock`. */
+static inline int evio_uring_submit_unsafe(void) {
+  while (evio_uring.pending) {
+    int ret = evio_uring_enter(evio_uring.pending, 0, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (ret == 0)
+      return -1;
+    evio_uring.pending -= ret;
+  }
+  return 0;
+}
+
+/** Reserves a SQE. Call only while holding `sq_lock`. */
+static inline struct io_uring_sqe *evio_uring_sqe_unsafe(void) {
+  uint32_t head = __atomic_load_n(evio_uring.sq_head, __ATOMIC_ACQUIRE);
+  uint32_t tail = *evio_uring.sq_tail;
+  if (tail - head >= evio_uring.sq_entries) {
+    /* the queue is full, make room */
+    if (evio_uring_submit_unsafe())
+      return NULL;
+    head = __atomic_load_n(evio_uring.sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= evio_uring.sq_entries)
+      return NULL;
+  }
+  uint32_t index = tail & *evio_uring.sq_mask;
+  struct io_uring_sqe *sqe = evio_uring.sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  evio_uring.sq_array[index] = index;
+  return sqe;
+}
+
+/** Publishes a reserved SQE. Call only while holding `sq_lock`. */
+static inline void evio_uring_sqe_commit_unsafe(void) {
+  __atomic_store_n(evio_uring.sq_tail, *evio_uring.sq_tail + 1,
+                   __ATOMIC_RELEASE);
+  ++evio_uring.pending;
+}
+
+/** Queues a poll removal request. Call only while holding `sq_lock`. */
+static inline int evio_uring_cancel_unsafe(uint64_t user_data) {
+  struct io_uring_sqe *sqe = evio_uring_sqe_unsafe();
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = user_data;
+  sqe->user_data = EVIO_URING_CANCEL;
+  evio_uring_sqe_commit_unsafe();
+  return 0;
+}
+
+/** Makes sure `fd` has an entry. Call only while holding `sq_lock`. */
+static inline int evio_uring_reserve_unsafe(int fd) {
+  if ((size_t)fd < evio_uring.capacity)
+    return 0;
+  size_t capa = evio_uring.capacity ? evio_uring.capacity : 1024;
+  while (capa <= (size_t)fd)
+    capa <<= 1;
+  void *tmp = realloc(evio_uring.armed, capa * sizeof(*evio_uring.armed));
+  if (!tmp)
+    return -1;
+  evio_uring.armed = tmp;
+  memset(evio_uring.armed + evio_uring.capacity, 0,
+         (capa - evio_uring.capacity) * sizeof(*evio_uring.armed));
+  evio_uring.capacity = capa;
+  return 0;
+}
+
+static int evio_uring_add(int fd, void *callback_arg, uint32_t events,
+                          uint64_t tag) {
+  if (evio_uring.fd < 0 || fd < 0)
+    return -1;
+  uint8_t slot = (tag == EVIO_URING_WRITE);
+  int ret = -1;
+  spn_lock(&evio_uring.sq_lock);
+  if (evio_uring_reserve_unsafe(fd))
+    goto finish;
+  evio_uring_event_s *ev = &evio_uring.armed[fd][slot];
+  if (ev->user_data) {
+    if (ev->arg == callback_arg) {
+      /* already armed, behaves like `EPOLL_CTL_MOD` */
+      ret = 0;
+      goto finish;
+    }
+    if (evio_uring_cancel_unsafe(ev->user_data))
+      goto finish;
+    ev->user_data = 0;
+  }
+  struct io_uring_sqe *sqe = evio_uring_sqe_unsafe();
+  if (!sqe)
+    goto finish;
+  evio_uring.generation = (evio_uring.generation + ((uint64_t)1 << 32)) &
+                          EVIO_URING_GEN_MASK;
+  ev->user_data = tag | evio_uring.generation | (uint64_t)(uint32_t)fd;
+  ev->arg = callback_arg;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = ev->user_data;
+  evio_uring_sqe_commit_unsafe();
+  ret = evio_uring_submit_unsafe();
+finish:
+  spn_unlock(&evio_uring.sq_lock);
+  return ret;
+}
+
+/** Cancels both event types for `fd`, optionally only if `arg` matches. */
+static void evio_uring_remove(int fd, void *arg, uint8_t test_arg) {
+  if (evio_uring.fd < 0 || fd < 0)
+    return;
+  spn_lock(&evio_uring.sq_lock);
+  if ((size_t)fd >= evio_uring.capacity)
+    goto finish;
+  for (int i = 0; i < 2; ++i) {
+    evio_uring_event_s *ev = &evio_uring.armed[fd][i];
+    if (!ev->user_data || (test_arg && ev->arg != arg))
+      continue;
+    if (evio_uring_cancel_unsafe(ev->user_data))
+      continue;
+    ev->user_data = 0;
+  }
+  evio_uring_submit_unsafe();
+finish:
+  spn_unlock(&evio_uring.sq_lock);
+}
+
+/**
+Removes a file descriptor from the polling object.
+*/
+void evio_remove(int fd) { evio_uring_remove(fd, 0, 0); }
+
+/**
+Removes a file descriptor from the polling object, if it's still polling for
+`callback_arg`.
+*/
+void evio_forget(int fd, void *callback_arg) {
+  evio_uring_remove(fd, callback_arg, 1);
+}
+
+/**
+Adds a file descriptor to the polling object.
+*/
+int evio_add(int fd, void *callback_arg) {
+  if (evio_add_read(fd, callback_arg) == -1)
+    return -1;
+  return evio_add_write(fd, callback_arg);
+}
+
+/**
+Adds a file descriptor to the polling object (ONE SHOT), to be polled for
+incoming data (`evio_on_data` wil be called).
+*/
+int evio_add_read(int fd, void *callback_arg) {
+  return evio_uring_add(fd, callback_arg, (POLLIN | POLLRDHUP | POLLHUP),
+                        EVIO_URING_READ);
+}
+
+/**
+Adds a file descriptor to the polling object (ONE SHOT), to be polled for
+outgoing buffer readiness data (`evio_on_ready` wil be called).
+*/
+int evio_add_write(int fd, void *callback_arg) {
+  return evio_uring_add(fd, callback_arg, (POLLOUT | POLLRDHUP | POLLHUP),
+                        EVIO_URING_WRITE);
+}
+
+/**
+Adds a listening socket to the polling object (same as `evio_add`).
+*/
+int evio_add_listener(int fd, void *callback_arg) {
+  return evio_add(fd, callback_arg);
+}
+
+/**
+Creates a timer file descriptor, system dependent.
+*/
+int evio_open_timer(void) {
+  return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+}
+
+/**
+Adds a timer file descriptor, so that callbacks will be called for it's events.
+*/
+int evio_set_timer(int fd, void *callback_arg, unsigned long milliseconds) {
+  if (evio_uring.fd < 0)
+    return -1;
+  /* clear out existing timer marker, if exists. */
+  char data[8]; // void * is 8 byte long
+  if (read(fd, &data, 8) < 0)
+    data[0] = 0;
+  /* set file's time value */
+  struct itimerspec new_t_data;
+  new_t_data.it_value.tv_sec = new_t_data.it_interval.tv_sec =
+      milliseconds / 1000;
+  new_t_data.it_value.tv_nsec = new_t_data.it_interval.tv_nsec =
+      (milliseconds % 1000) * 1000000;
+  if (timerfd_settime(fd, 0, &new_t_data, NULL) == -1)
+    return -1;
+  return evio_uring_add(fd, callback_arg, POLLIN, EVIO_URING_READ);
+}
+
+/**
+Arms a timer file descriptor for a single event, `microseconds` from now.
+*/
+int evio_set_timer_us(int fd, void *callback_arg, unsigned long microseconds) {
+  if (evio_uring.fd < 0)
+    return -1;
+  /* clear out existing timer marker, if exists. */
+  char data[8]; // void * is 8 byte long
+  if (read(fd, &data, 8) < 0)
+    data[0] = 0;
+  /* set file's time value (a zero value disarms the timer) */
+  if (!microseconds)
+    microseconds = 1;
+  struct itimerspec new_t_data = {
+      .it_value.tv_sec = microseconds / 1000000,
+      .it_value.tv_nsec = (microseconds % 1000000) * 1000,
+  };
+  if (timerfd_settime(fd, 0, &new_t_data, NULL) == -1)
+    return -1;
+  return evio_uring_add(fd, callback_arg, POLLIN, EVIO_URING_READ);
+}
+
+/**
+Reviews any pending events (up to EVIO_MAX_EVENTS) and calls any callbacks.
+ */
+int evio_review(const int timeout_millisec) {
+  if (evio_uring.fd < 0)
+    return -1;
+  if (spn_trylock(&evio_uring.cq_lock))
+    return 0;
+  struct io_uring_cqe events[EVIO_MAX_EVENTS];
+  int total = 0;
+  uint32_t head = *evio_uring.cq_head;
+  uint32_t tail = __atomic_load_n(evio_uring.cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail && timeout_millisec) {
+    /* the ring's fd is readable when completions are available */
+    struct pollfd pollfd = {.fd = evio_uring.fd, .events = POLLIN};
+    if (poll(&pollfd, 1, timeout_millisec) == -1 && errno != EINTR) {
+      spn_unlock(&evio_uring.cq_lock);
+      return -1;
+    }
+    tail = __atomic_load_n(evio_uring.cq_tail, __ATOMIC_ACQUIRE);
+  }
+  /* copy the completions, so callbacks can safely add new events */
+  while (head != tail && total < EVIO_MAX_EVENTS) {
+    events[total++] = evio_uring.cqes[head & *evio_uring.cq_mask];
+    ++head;
+  }
+  __atomic_store_n(evio_uring.cq_head, head, __ATOMIC_RELEASE);
+  spn_unlock(&evio_uring.cq_lock);
+
+  int count = 0;
+  for (int i = 0; i < total; ++i) {
+    uint64_t tag = events[i].user_data & EVIO_URING_TAG_MASK;
+    if (tag == EVIO_URING_CANCEL)
+      continue;
+    size_t fd = (size_t)(events[i].user_data & EVIO_URING_FD_MASK);
+    void *arg;
+    /* test that the request wasn't replaced and mark it as consumed */
+    spn_lock(&evio_uring.sq_lock);
+    if (fd >= evio_uring.capacity) {
+      spn_unlock(&evio_uring.sq_lock);
+      continue;
+    }
+    evio_uring_event_s *ev = evio_uring.armed[fd] + (tag == EVIO_URING_WRITE);
+    if (ev->user_data != events[i].user_data) {
+      spn_unlock(&evio_uring.sq_lock);
+      continue;
+    }
+    arg = ev->arg;
+    ev->user_data = 0;
+    spn_unlock(&evio_uring.sq_lock);
+    if (events[i].res == -ECANCELED)
+      continue;
+    ++count;
+    if (events[i].res >= 0 && (events[i].res & (POLLIN | POLLERR)) == POLLIN &&
+        (events[i].res & (POLLRDHUP | POLLHUP))) {
+      // the peer hung up, but there's data left in the buffer (`read` reports
+      // the EOF).
+      evio_on_data(arg);
+    } else if (events[i].res < 0 || (events[i].res & (~(POLLIN | POLLOUT)))) {
+      // errors are hendled as disconnections (on_close)
+      evio_on_error(arg);
+    } else if (tag == EVIO_URING_WRITE) {
+      evio_on_ready(arg);
+    } else {
+      evio_on_data(arg);
+    }
+  }
+  return count;
+}
+
+/** Waits up to `timeout_millisec` for events. No events are signaled. */
+int evio_wait(const int timeout_millisec) {
+  if (evio_uring.fd < 0)
+    return -1;
+  struct pollfd pollfd = {
+      .fd = evio_uring.fd, .events = POLLIN,
+  };
+  return poll(&pollfd, 1, timeout_millisec);
+}
+
+#endif /* system dependent code */
@@ -31,6 +31,46 @@ else
 end
 
 $CFLAGS = "-std=c11 -O2 -Wall #{ENV['CFLAGS']}"
+
+# the io_uring polling engine is opt-in (requires Linux 5.1 or later).
+if ENV['IODINE_URING'] && have_header('linux/io_uring.h')
+  puts 'using the io_uring polling engine.'
+  $CFLAGS << ' -DEVIO_ENGINE_URING=1'
+end
+
+# idle worker threads park on a futex rather than polling (Linux only).
+if ENV['IODINE_PARKING'] && have_header('linux/futex.h')
+  puts 'parking idle worker threads.'
+  $CFLAGS << ' -DDEFER_THREAD_PARKING=1'
+end
+# Ractor worker threads (the experimental `ractor` option) require Ruby 3.0.
+have_func('rb_ext_ractor_safe', 'ruby.h')
+# the `fiber` option (Iodine::Scheduler) requires Ruby 3.0's Fiber scheduler.
+have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+
+# the permessage-deflate websocket extension (and gzip responses) require zlib.
+if have_header('zlib.h') && have_library('z', 'deflateInit2_')
+  $CFLAGS << ' -DWS_DEFLATE=1 -DHTTP_GZIP=1'
+end
+
+# brotli response compression requires the brotli encoder library.
+if have_header('brotli/encode.h') && have_library('brotlienc', 'BrotliEncoderCreateInstance')
+  $CFLAGS << ' -DHTTP_BROTLI=1'
+end
+
+# TLS (HTTPS) requires OpenSSL (1.1.0 or later).
+if have_header('openssl/ssl.h') && have_library('crypto', 'ERR_get_error') &&
+   have_library('ssl', 'SSL_CTX_set_alpn_select_cb')
+  $CFLAGS << ' -DHAVE_OPENSSL=1'
+end
+
+# websocket masking and UTF-8 validation use SSE2/AVX2/NEON (and the websocket
+# handshake's SHA1 uses SHA-NI / ARMv8 crypto) when the compiler targets them,
+# so tuning for the build machine enables the wider paths.
+if ENV['IODINE_NATIVE'] && try_cflags('-march=native')
+  puts 'tuning for the native CPU (-march=native).'
+  $CFLAGS << ' -march=native'
+end
 RbConfig::MAKEFILE_CONFIG['CC'] = $CC = ENV['CC'] if ENV['CC']
 RbConfig::MAKEFILE_CONFIG['CPP'] = $CPP = ENV['CPP'] if ENV['CPP']
 
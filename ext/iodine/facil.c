@@ -4,16 +4,22 @@ License: MIT
 
 Feel free to copy, use and enjoy according to the license provided.
 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "spnlock.inc"
 
 #include "evio.h"
 #include "facil.h"
 #include "fio_hashmap.h"
+#include "fio_stats.h"
+#include "fio_trace.h"
 #include "fiobj4sock.h"
 
 #include "fio_mem.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -23,6 +29,9 @@ Feel free to copy, use and enjoy according to the license provided.
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #if !defined(__GNUC__) && !defined(__clang__)
 #define __attribute__(...)
 #endif
@@ -62,20 +71,51 @@ union protocol_metadata_union_u {
 };
 #define prt_meta(prt) (((union protocol_metadata_union_u *)(&(prt)->rsv))->meta)
 
+/* per connection state (protocol access) */
 struct connection_data_s {
   protocol_s *protocol;
-  time_t active;
-  uint8_t timeout;
+  /* a sampled timeline, waiting for the outgoing data to be flushed */
+  fio_trace_timeline_s *trace;
+  /* the time the last `on_data` event was scheduled (only while sampling) */
+  uint64_t trace_scheduled;
   spn_lock_i scheduled;
   spn_lock_i lock;
 };
 
+/*
+ * per connection timeout data - a separate (dense) array, so reviewing the
+ * timeouts doesn't touch any other data.
+ *
+ * Connections with an attached protocol are linked into a timer wheel (see
+ * `TIMEOUT_WHEEL_SIZE`) using the `next` / `prev` fd indexes.
+ */
+struct connection_timing_s {
+  time_t active;
+  int32_t next;
+  int32_t prev;
+  /* the wheel slot + 1 (0 == not in the wheel) */
+  uint16_t slot;
+  uint8_t timeout;
+};
+
+/*
+ * The number of (1 second) slots in the timeout wheel - MUST be a power of 2
+ * greater than the longest timeout (300 seconds, see `facil_review_timeout`).
+ *
+ * `sock_touch` only updates the `active` timestamp. When a slot expires,
+ * connections that were active since are moved to the slot of their new
+ * deadline, so each connection is reviewed about once per timeout.
+ */
+#define TIMEOUT_WHEEL_SIZE 512
+
 static struct facil_data_s {
   spn_lock_i global_lock;
   uint8_t need_review;
   uint8_t spindown;
   uint16_t active;
   uint16_t threads;
+  uint16_t threads_max;
+  uint8_t pin_connections;
   pid_t parent;
   pool_pt thread_pool;
   ssize_t capacity;
@@ -83,13 +123,73 @@ static struct facil_data_s {
   void (*on_idle)(void);
   void (*on_finish)(void);
   struct timespec last_cycle;
+  struct connection_timing_s *timing; /* placed after the `conn` array */
+  spn_lock_i wheel_lock;
+  time_t wheel_tick; /* the last slot (second) reviewed */
+  int32_t wheel[TIMEOUT_WHEEL_SIZE];
   struct connection_data_s conn[];
 } * facil_data;
 
 #define fd_data(fd) (facil_data->conn[(fd)])
 #define uuid_data(uuid) fd_data(sock_uuid2fd((uuid)))
+#define fd_timing(fd) (facil_data->timing[(fd)])
+#define uuid_timing(uuid) fd_timing(sock_uuid2fd((uuid)))
 // #define uuid_prt_meta(uuid) prt_meta(uuid_data((uuid)).protocol)
 
+/* *****************************************************************************
+The timeout wheel
+***************************************************************************** */
+
+/* removes a connection from the wheel - call while holding the wheel lock. */
+static inline void timeout_wheel_unlink(intptr_t fd) {
+  struct connection_timing_s *t = &fd_timing(fd);
+  if (!t->slot)
+    return;
+  if (t->prev >= 0)
+    fd_timing(t->prev).next = t->next;
+  else
+    facil_data->wheel[t->slot - 1] = t->next;
+  if (t->next >= 0)
+    fd_timing(t->next).prev = t->prev;
+  t->slot = 0;
+}
+
+/* adds a connection to the wheel - call while holding the wheel lock. */
+static inline void timeout_wheel_link(intptr_t fd, time_t deadline) {
+  struct connection_timing_s *t = &fd_timing(fd);
+  if (deadline <= facil_data->wheel_tick)
+    deadline = facil_data->wheel_tick + 1;
+  uint16_t slot = (uint16_t)(deadline & (TIMEOUT_WHEEL_SIZE - 1));
+  t->prev = -1;
+  t->next = facil_data->wheel[slot];
+  if (t->next >= 0)
+    fd_timing(t->next).prev = (int32_t)fd;
+  facil_data->wheel[slot] = (int32_t)fd;
+  t->slot = slot + 1;
+}
+
+/* the first second in which a connection's timeout has expired. */
+static inline time_t timeout_deadline(intptr_t fd) {
+  /* enforced timout settings */
+  return fd_timing(fd).active +
+         (fd_timing(fd).timeout ? fd_timing(fd).timeout : 300) + 1;
+}
+
+/* (re)places a connection in the wheel, after the deadline might be sooner. */
+static void timeout_wheel_update(intptr_t fd) {
+  spn_lock(&facil_data->wheel_lock);
+  timeout_wheel_unlink(fd);
+  timeout_wheel_link(fd, timeout_deadline(fd));
+  spn_unlock(&facil_data->wheel_lock);
+}
+
+/* removes a connection from the wheel. */
+static void timeout_wheel_remove(intptr_t fd) {
+  spn_lock(&facil_data->wheel_lock);
+  timeout_wheel_unlink(fd);
+  spn_unlock(&facil_data->wheel_lock);
+}
+
 /** locks a connection's protocol returns a pointer that need to be unlocked. */
 inline static protocol_s *protocol_try_lock(intptr_t fd,
                                             enum facil_protocol_lock_e type) {
@@ -134,10 +234,13 @@ static const char *CLUSTER_LISTEN_PROTOCOL_NAME =
 static const char *CLUSTER_CONNECTION_PROTOCOL_NAME =
     "cluster connection __facil_internal__";
 
+static const char *RELOAD_PROTOCOL_NAME = "reload protocol __facil_internal__";
+
 static inline int is_counted_protocol(protocol_s *p) {
   return p && p->service != TIMER_PROTOCOL_NAME &&
          p->service != CLUSTER_LISTEN_PROTOCOL_NAME &&
-         p->service != CLUSTER_CONNECTION_PROTOCOL_NAME;
+         p->service != CLUSTER_CONNECTION_PROTOCOL_NAME &&
+         p->service != RELOAD_PROTOCOL_NAME;
 }
 
 /* *****************************************************************************
@@ -166,6 +269,49 @@ void defer_thread_wait(pool_pt pool, void *p_thr) {
 /* *****************************************************************************
 Event Handlers (evio)
 ***************************************************************************** */
+
+/**
+ * Defers a connection's IO event, pinning it to a thread if required.
+ *
+ * When pinning, the first thread is reserved for the reactor (`facil_cycle`),
+ * since it might block while waiting for IO events. Otherwise, the event is
+ * scheduled using the requested `priority` class.
+ */
+static inline void defer_io(int priority, void (*func)(void *, void *),
+                            void *uuid, void *arg2) {
+  if (facil_data->pin_connections) {
+    size_t key = (size_t)sock_uuid2fd((intptr_t)uuid);
+    if (facil_data->threads > 1)
+      key = 1 + (key % (facil_data->threads - 1));
+    defer_pinned(key, func, uuid, arg2);
+  } else
+    defer_priority(priority, func, uuid, arg2);
+}
+
+/* completes a sampled timeline once the connection's data was flushed */
+static inline void facil_trace_flushed(intptr_t uuid) {
+  FIO_TRACE_PROBE1(sock__flushed, uuid);
+  if (uuid_data(uuid).trace)
+    fio_trace_finish(
+        __atomic_exchange_n(&uuid_data(uuid).trace, NULL, __ATOMIC_ACQ_REL),
+        1);
+}
+
+/* keeps a sampled timeline until the connection's data was flushed */
+static void facil_trace_store(intptr_t uuid, fio_trace_timeline_s *tl) {
+  if (!tl)
+    return;
+  if (!sock_pending(uuid)) {
+    fio_trace_finish(tl, 1);
+    return;
+  }
+  fio_trace_finish(
+      __atomic_exchange_n(&uuid_data(uuid).trace, tl, __ATOMIC_ACQ_REL), 0);
+  /* the data might have been flushed before the timeline was stored */
+  if (!sock_pending(uuid))
+    facil_trace_flushed(uuid);
+}
+
 void sock_flush_defer(void *arg, void *ignored) {
   (void)ignored;
   switch (sock_flush((intptr_t)arg)) {
@@ -173,15 +319,23 @@ void sock_flush_defer(void *arg, void *ignored) {
     evio_add_write(sock_uuid2fd((intptr_t)arg), (void *)arg);
     break;
   case 0:
-    defer(deferred_on_ready, arg, NULL);
+    facil_trace_flushed((intptr_t)arg);
+    defer_io(DEFER_PRIORITY_IO, deferred_on_ready, arg, NULL);
     break;
   }
 }
 
-void evio_on_ready(void *arg) { defer(sock_flush_defer, arg, NULL); }
+void evio_on_ready(void *arg) {
+  defer_io(DEFER_PRIORITY_URGENT, sock_flush_defer, arg, NULL);
+}
 void evio_on_close(void *arg) { sock_force_close((intptr_t)arg); }
 void evio_on_error(void *arg) { sock_force_close((intptr_t)arg); }
-void evio_on_data(void *arg) { defer(deferred_on_data, arg, NULL); }
+void evio_on_data(void *arg) {
+  uint64_t scheduled = fio_trace_scheduled();
+  if (scheduled)
+    uuid_data(arg).trace_scheduled = scheduled;
+  defer_io(DEFER_PRIORITY_IO, deferred_on_data, arg, NULL);
+}
 
 /* *****************************************************************************
 Mock Protocol Callbacks and Service Funcions
@@ -232,6 +386,7 @@ static void facil_external_init(void) {
   sock_on_fork();
   pubsub_cluster_on_fork_start();
   fio_malloc_after_fork();
+  fio_stats_on_fork();
   defer_on_fork();
 }
 
@@ -281,8 +436,9 @@ static void deferred_on_shutdown(void *arg, void *arg2) {
       return;
     goto postpone;
   }
-  uuid_data(arg).active = facil_data->last_cycle.tv_sec;
-  uuid_data(arg).timeout = 8;
+  uuid_timing(arg).active = facil_data->last_cycle.tv_sec;
+  uuid_timing(arg).timeout = 8;
+  timeout_wheel_update(sock_uuid2fd(arg));
   /* TODO: 0.7.0 catch the return valuse to set timeout and maybe keep open */
   pr->on_shutdown((intptr_t)arg, pr);
   pr->ping = mock_ping;
@@ -308,7 +464,7 @@ static void deferred_on_ready(void *arg, void *arg2) {
   protocol_unlock(pr, FIO_PR_LOCK_WRITE);
   return;
 postpone:
-  defer(deferred_on_ready, arg, NULL);
+  defer_io(DEFER_PRIORITY_IO, deferred_on_ready, arg, NULL);
   (void)arg2;
 }
 
@@ -323,7 +479,11 @@ static void deferred_on_data(void *uuid, void *arg2) {
     goto postpone;
   }
   spn_unlock(&uuid_data(uuid).scheduled);
+  fio_trace_begin((intptr_t)uuid, uuid_data(uuid).trace_scheduled);
+  FIO_TRACE_PROBE1(on_data__start, (intptr_t)uuid);
   pr->on_data((intptr_t)uuid, pr);
+  FIO_TRACE_PROBE1(on_data__end, (intptr_t)uuid);
+  facil_trace_store((intptr_t)uuid, fio_trace_end());
   protocol_unlock(pr, FIO_PR_LOCK_TASK);
   if (!spn_trylock(&uuid_data(uuid).scheduled)) {
     evio_add_read(sock_uuid2fd((intptr_t)uuid), uuid);
@@ -332,7 +492,7 @@ static void deferred_on_data(void *uuid, void *arg2) {
 postpone:
   if (arg2) {
     /* the event is being forced, so force rescheduling */
-    defer(deferred_on_data, (void *)uuid, (void *)1);
+    defer_io(DEFER_PRIORITY_IO, deferred_on_data, (void *)uuid, (void *)1);
   } else {
     /* the protocol was locked, so there might not be any need for the event */
     evio_add_read(sock_uuid2fd((intptr_t)uuid), uuid);
@@ -342,9 +502,9 @@ postpone:
 
 static void deferred_ping(void *arg, void *arg2) {
   if (!uuid_data(arg).protocol ||
-      (uuid_data(arg).timeout &&
-       (uuid_data(arg).timeout >
-        (facil_data->last_cycle.tv_sec - uuid_data(arg).active)))) {
+      (uuid_timing(arg).timeout &&
+       (uuid_timing(arg).timeout >
+        (facil_data->last_cycle.tv_sec - uuid_timing(arg).active)))) {
     return;
   }
   protocol_s *pr = protocol_try_lock(sock_uuid2fd(arg), FIO_PR_LOCK_WRITE);
@@ -366,7 +526,7 @@ void facil_force_event(intptr_t uuid, enum facil_io_event ev) {
   switch (ev) {
   case FIO_EVENT_ON_DATA:
     spn_trylock(&uuid_data(uuid).scheduled);
-    defer(deferred_on_data, (void *)uuid, (void *)1);
+    defer_io(DEFER_PRIORITY_IO, deferred_on_data, (void *)uuid, (void *)1);
     break;
   case FIO_EVENT_ON_TIMEOUT:
     defer(deferred_ping, (void *)uuid, NULL);
@@ -397,21 +557,29 @@ void sock_on_close(intptr_t uuid) {
   // fprintf(stderr, "INFO: facil.io, on-close called for %u (set to %p)\n",
   //         (unsigned int)sock_uuid2fd(uuid), (void
   //         *)uuid_data(uuid).protocol);
+  evio_forget(sock_uuid2fd(uuid), (void *)uuid);
   spn_lock(&uuid_data(uuid).lock);
   protocol_s *old_protocol = uuid_data(uuid).protocol;
+  fio_trace_timeline_s *trace =
+      __atomic_exchange_n(&uuid_data(uuid).trace, NULL, __ATOMIC_ACQ_REL);
   uuid_data(uuid) = (struct connection_data_s){.lock = uuid_data(uuid).lock};
   spn_unlock(&uuid_data(uuid).lock);
+  fio_trace_finish(trace, 0);
+  timeout_wheel_remove(sock_uuid2fd(uuid));
+  uuid_timing(uuid).active = 0;
+  uuid_timing(uuid).timeout = 0;
   if (old_protocol) {
     if (is_counted_protocol(old_protocol)) {
       spn_sub(&facil_data->connection_count, 1);
     }
-    defer(deferred_on_close, (void *)uuid, old_protocol);
+    defer_priority(DEFER_PRIORITY_URGENT, deferred_on_close, (void *)uuid,
+                   old_protocol);
   }
 }
 
 void sock_touch(intptr_t uuid) {
   if (facil_data && facil_data->active)
-    uuid_data(uuid).active = facil_data->last_cycle.tv_sec;
+    uuid_timing(uuid).active = facil_data->last_cycle.tv_sec;
 }
 
 /* *****************************************************************************
@@ -424,6 +592,12 @@ static spn_lock_i facil_libinit_lock = SPN_LOCK_INIT;
 #define round_size(size) (((size) & (~4095)) + (4096 * (!!((size)&4095))))
 
 static void facil_cluster_cleanup(void); /* cluster data cleanup */
+/* hands a new connection to a less busy worker (0 on success) */
+static int facil_cluster_migrate(intptr_t client, int listener_fd,
+                                 uint16_t margin);
+#if !FACIL_DISABLE_GRACEFUL_RELOAD
+static void facil_reload_inherit(void); /* inherits listening sockets */
+#endif
 
 static void facil_libcleanup(void) {
   /* free memory */
@@ -432,8 +606,10 @@ static void facil_libcleanup(void) {
     facil_external_root_cleanup();
     facil_cluster_cleanup();
     // defer_perform(); /* perform any lingering cleanup tasks? */
-    size_t mem_size = sizeof(*facil_data) + ((size_t)facil_data->capacity *
-                                             sizeof(struct connection_data_s));
+    size_t mem_size = sizeof(*facil_data) +
+                      ((size_t)facil_data->capacity *
+                       (sizeof(struct connection_data_s) +
+                        sizeof(struct connection_timing_s)));
     munmap(facil_data, round_size(mem_size));
     facil_data = NULL;
   }
@@ -447,7 +623,8 @@ static void facil_lib_init(void) {
     exit(ENOMEM);
   }
   size_t mem_size =
-      sizeof(*facil_data) + ((size_t)capa * sizeof(struct connection_data_s));
+      sizeof(*facil_data) + ((size_t)capa * (sizeof(struct connection_data_s) +
+                                             sizeof(struct connection_timing_s)));
   spn_lock(&facil_libinit_lock);
   if (facil_data)
     goto finish;
@@ -459,17 +636,25 @@ static void facil_lib_init(void) {
   }
   memset(facil_data, 0, mem_size);
   *facil_data = (struct facil_data_s){
-      .capacity = capa, .parent = getpid(),
+      .capacity = capa,
+      .parent = getpid(),
+      .timing = (struct connection_timing_s *)(facil_data->conn + capa),
   };
+  for (size_t i = 0; i < TIMEOUT_WHEEL_SIZE; ++i)
+    facil_data->wheel[i] = -1;
   facil_external_root_init();
   atexit(facil_libcleanup);
+#if !FACIL_DISABLE_GRACEFUL_RELOAD
+  facil_reload_inherit();
+#endif
 #ifdef DEBUG
   if (FACIL_PRINT_STATE)
     fprintf(stderr,
             "Initialized the facil.io library.\n"
             "facil.io's memory footprint per connection == %lu Bytes X %lu\n"
             "=== facil.io's memory footprint: %lu ===\n\n",
-            (unsigned long)sizeof(struct connection_data_s),
+            (unsigned long)(sizeof(struct connection_data_s) +
+                            sizeof(struct connection_timing_s)),
             (unsigned long)facil_data->capacity, (unsigned long)mem_size);
 #endif
 finish:
@@ -503,18 +688,43 @@ struct ListenerProtocol {
   void (*on_finish)(intptr_t uuid, void *udata);
   char *port;
   char *address;
+  /* the process that opened the listening socket (when using `reuse_port`) */
+  pid_t owner;
   uint8_t quite;
+  uint8_t reuse_port;
+  uint8_t reuse_port_cpu;
+  uint8_t defer_accept;
+  int16_t fastopen;
+  /* the connection count difference that triggers migration (cluster mode) */
+  uint16_t balance;
+  /* set while the socket is handed off to a new generation (graceful reload) */
+  uint8_t handed_off;
+  /* UDP sockets: the datagram handler and the (per process) receive buffer */
+  void (*on_datagram)(intptr_t uuid, sock_datagram_s *datagrams, size_t count,
+                      void *udata);
+  char *datagram_buffer;
 };
 
 static void listener_ping(intptr_t uuid, protocol_s *plistener) {
   // fprintf(stderr, "*** Listener Ping Called for %ld\n", sock_uuid2fd(uuid));
-  uuid_data(uuid).active = facil_data->last_cycle.tv_sec;
+  uuid_timing(uuid).active = facil_data->last_cycle.tv_sec;
   return;
   (void)plistener;
 }
 
+/*
+ * Accepts up to FACIL_ACCEPT_BATCH connections.
+ *
+ * Any remaining connections are accepted once the listener's event fires again
+ * (during the next reactor cycle), so the tasks of existing connections are
+ * performed between batches.
+ */
 static void listener_on_data(intptr_t uuid, protocol_s *plistener) {
-  for (int i = 0; i < 4; ++i) {
+  struct ListenerProtocol *listener = (struct ListenerProtocol *)plistener;
+  /* the listening socket is shared by all the workers (same fd everywhere) */
+  uint8_t balance = (listener->balance && !listener->reuse_port &&
+                     facil_data->active > 1 && facil_parent_pid() != getpid());
+  for (size_t i = 0; i < FACIL_ACCEPT_BATCH; ++i) {
     intptr_t new_client = sock_accept(uuid);
     if (new_client == -1) {
       if (errno == EWOULDBLOCK || errno == EAGAIN || errno == ECONNABORTED ||
@@ -523,11 +733,89 @@ static void listener_on_data(intptr_t uuid, protocol_s *plistener) {
       perror("ERROR: socket accept error");
       return;
     }
-    // to defer or not to defer...? TODO: answer the question
-    struct ListenerProtocol *listener = (struct ListenerProtocol *)plistener;
-    defer(listener->on_open, (void *)new_client, listener->udata);
+    if (balance && !facil_cluster_migrate(new_client, sock_uuid2fd(uuid),
+                                          listener->balance))
+      continue;
+    /* the new connection's queue (when pinned) performs the `on_open` event */
+    defer_io(DEFER_PRIORITY_IO, listener->on_open, (void *)new_client,
+             listener->udata);
   }
+#if EVIO_LISTENER_EDGE
+  /* the backlog might not be empty, but no new event would be reported */
   facil_force_event(uuid, FIO_EVENT_ON_DATA);
+#endif
+}
+
+/*
+ * Receives up to FACIL_DATAGRAM_BATCH datagrams (UDP sockets).
+ *
+ * Any remaining datagrams are received once the socket's event fires again
+ * (during the next reactor cycle, or immediately when `EVIO_LISTENER_EDGE`),
+ * same as `listener_on_data`.
+ */
+static void listener_on_datagrams(intptr_t uuid, protocol_s *plistener) {
+  struct ListenerProtocol *listener = (struct ListenerProtocol *)plistener;
+  sock_datagram_s datagrams[FACIL_DATAGRAM_BATCH];
+  if (!listener->datagram_buffer) {
+    listener->datagram_buffer =
+        malloc(FACIL_DATAGRAM_BATCH * FACIL_DATAGRAM_SIZE);
+    if (!listener->datagram_buffer) {
+      perror("ERROR: (facil) couldn't allocate a datagram buffer");
+      return;
+    }
+  }
+  for (size_t i = 0; i < FACIL_DATAGRAM_BATCH; ++i) {
+    datagrams[i].data = listener->datagram_buffer + (i * FACIL_DATAGRAM_SIZE);
+    datagrams[i].len = FACIL_DATAGRAM_SIZE;
+  }
+  ssize_t received =
+      sock_recv_datagrams(uuid, datagrams, FACIL_DATAGRAM_BATCH);
+  if (received < 0) {
+    perror("ERROR: datagram socket receive error");
+    return;
+  }
+  /* truncated datagrams are discarded, the handler never sees partial data */
+  size_t count = 0;
+  for (ssize_t i = 0; i < received; ++i) {
+    if (datagrams[i].truncated)
+      continue;
+    if ((ssize_t)count != i)
+      datagrams[count] = datagrams[i];
+    ++count;
+  }
+  if (count != (size_t)received)
+    fio_stats_add(FIO_STATS_TRUNCATED, (size_t)received - count);
+  if (count)
+    listener->on_datagram(uuid, datagrams, count, listener->udata);
+#if EVIO_LISTENER_EDGE
+  if (received == FACIL_DATAGRAM_BATCH)
+    facil_force_event(uuid, FIO_EVENT_ON_DATA);
+#endif
+}
+
+/* sets the listening socket's TCP options (see `facil_listen_args`) */
+static void listener_set_options(intptr_t uuid,
+                                 struct ListenerProtocol *listener) {
+  if (!listener->port || listener->on_datagram)
+    return;
+  int fd = sock_uuid2fd(uuid);
+#ifdef TCP_DEFER_ACCEPT
+  if (listener->defer_accept) {
+    int optval = listener->defer_accept;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &optval,
+                   sizeof(optval)) == -1)
+      perror("WARNING: (facil) couldn't set TCP_DEFER_ACCEPT");
+  }
+#endif
+#ifdef TCP_FASTOPEN
+  if (listener->fastopen) {
+    int optval = (listener->fastopen < 0 ? 0 : listener->fastopen);
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &optval, sizeof(optval)) ==
+        -1)
+      perror("WARNING: (facil) couldn't set TCP_FASTOPEN");
+  }
+#endif
+  (void)fd;
 }
 
 static void free_listenner(void *li) { free(li); }
@@ -536,16 +824,21 @@ static void listener_on_close(intptr_t uuid, protocol_s *plistener) {
   struct ListenerProtocol *listener = (void *)plistener;
   listener->on_finish(uuid, listener->udata);
   if (FACIL_PRINT_STATE && facil_data->parent == getpid()) {
-    if (listener->port) {
+    if (listener->on_datagram) {
+      fprintf(stderr, "* Stopped listening on UDP port %s\n", listener->port);
+    } else if (listener->port) {
       fprintf(stderr, "* Stopped listening on port %s\n", listener->port);
     } else {
       fprintf(stderr, "* Stopped listening on Unix Socket %s\n",
               listener->address);
     }
   }
-  if (!listener->port) {
+  /* workers and handed off sockets leave the Unix socket's path in place */
+  if (!listener->port && !listener->handed_off &&
+      facil_data->parent == getpid()) {
     unlink(listener->address);
   }
+  free(listener->datagram_buffer);
   free_listenner(listener);
 }
 
@@ -569,13 +862,21 @@ listener_alloc(struct facil_listen_args settings) {
   if (listener) {
     *listener = (struct ListenerProtocol){
         .protocol.service = LISTENER_PROTOCOL_NAME,
-        .protocol.on_data = listener_on_data,
+        .protocol.on_data =
+            (settings.on_datagram ? listener_on_datagrams : listener_on_data),
         .protocol.on_close = listener_on_close,
         .protocol.ping = listener_ping,
         .on_open = (void (*)(void *, void *))settings.on_open,
         .udata = settings.udata,
         .on_start = settings.on_start,
         .on_finish = settings.on_finish,
+        .reuse_port =
+            (settings.reuse_port && settings.port && !settings.on_datagram),
+        .reuse_port_cpu = settings.reuse_port_cpu,
+        .defer_accept = settings.defer_accept,
+        .fastopen = settings.fastopen,
+        .balance = settings.balance,
+        .on_datagram = settings.on_datagram,
     };
     if (settings.port) {
       listener->port = (char *)(listener + 1);
@@ -591,6 +892,36 @@ listener_alloc(struct facil_listen_args settings) {
   return NULL;
 }
 
+/**
+ * Replaces the (non-listening) `SO_REUSEPORT` socket inherited by a worker
+ * process with a listening socket owned by the worker.
+ *
+ * Returns the new UUID.
+ */
+static intptr_t listener_reuse_port(intptr_t uuid,
+                                    struct ListenerProtocol *listener) {
+  intptr_t new_uuid =
+      sock_listen_reuseport(listener->address, listener->port, 1);
+  if (new_uuid == -1) {
+    perror("Couldn't open a worker's listening socket (SO_REUSEPORT)");
+    kill(0, SIGINT);
+    exit(4);
+  }
+  if (listener->reuse_port_cpu && sock_reuseport_cpu_affinity(new_uuid))
+    perror("WARNING: (facil) couldn't attach SO_REUSEPORT CPU affinity");
+  listener_set_options(new_uuid, listener);
+  listener->owner = getpid();
+  /* move the listener protocol to the new socket */
+  spn_lock(&uuid_data(uuid).lock);
+  uuid_data(uuid).protocol = NULL;
+  spn_unlock(&uuid_data(uuid).lock);
+  timeout_wheel_remove(sock_uuid2fd(uuid));
+  spn_sub(&facil_data->connection_count, 1);
+  sock_force_close(uuid);
+  facil_attach(new_uuid, &listener->protocol);
+  return new_uuid;
+}
+
 inline static void listener_on_start(int fd) {
   intptr_t uuid = sock_fd2uuid((int)fd);
   if (uuid < 0) {
@@ -598,18 +929,54 @@ inline static void listener_on_start(int fd) {
     kill(0, SIGINT);
     exit(4);
   }
-  if (evio_add(fd, (void *)uuid) < 0) {
+  {
+    struct ListenerProtocol *listener =
+        (struct ListenerProtocol *)uuid_data(uuid).protocol;
+    if (listener->reuse_port) {
+      if (listener->owner == getpid())
+        return; /* already started (the socket was replaced) */
+      uuid = listener_reuse_port(uuid, listener);
+      fd = sock_uuid2fd(uuid);
+    }
+  }
+  if (evio_add_listener(fd, (void *)uuid) < 0) {
     perror("Couldn't register listening socket");
     kill(0, SIGINT);
     exit(4);
   }
-  fd_data(fd).active = facil_data->last_cycle.tv_sec;
+  fd_timing(fd).active = facil_data->last_cycle.tv_sec;
   // call the on_init callback
   struct ListenerProtocol *listener =
       (struct ListenerProtocol *)uuid_data(uuid).protocol;
   listener->on_start(uuid, listener->udata);
 }
 
+#if !FACIL_DISABLE_GRACEFUL_RELOAD
+static intptr_t facil_reload_adopt(const char *address, const char *port);
+#else
+#define facil_reload_adopt(address, port) ((intptr_t)-1)
+#endif
+
+/* opens a UDP socket (see `facil_listen_args.on_datagram`) */
+static int facil_listen_udp(struct facil_listen_args settings) {
+  if (!settings.port) {
+    errno = EINVAL;
+    return -1;
+  }
+  intptr_t uuid = sock_listen_udp(settings.address, settings.port);
+  if (uuid == -1)
+    return -1;
+  protocol_s *protocol = (void *)listener_alloc(settings);
+  facil_attach(uuid, protocol);
+  if (!protocol) {
+    sock_close(uuid);
+    return -1;
+  }
+  if (FACIL_PRINT_STATE && facil_data->parent == getpid())
+    fprintf(stderr, "* Listening on UDP port %s\n", settings.port);
+  return 0;
+}
+
 /**
 Listens to a server with the following server settings (which MUST include
 a default protocol).
@@ -620,15 +987,27 @@ though a `srv_stop` function or when a SIGINT/SIGTERM is received).
 int facil_listen(struct facil_listen_args settings) {
   if (!facil_data)
     facil_lib_init();
+  if (!settings.port || settings.port[0] == 0 ||
+      (settings.port[0] == '0' && settings.port[1] == 0)) {
+    settings.port = NULL;
+  }
+  if (settings.on_datagram)
+    return facil_listen_udp(settings);
   if (settings.on_open == NULL) {
     errno = EINVAL;
     return -1;
   }
-  if (!settings.port || settings.port[0] == 0 ||
-      (settings.port[0] == '0' && settings.port[1] == 0)) {
-    settings.port = NULL;
+  intptr_t uuid = -1;
+  /* adopt a listening socket handed off by the previous generation */
+  if (!settings.reuse_port || !settings.port)
+    uuid = facil_reload_adopt(settings.address, settings.port);
+  if (uuid == -1) {
+    if (settings.reuse_port && settings.port)
+      /* reserve the address, each worker will have it's own listening socket */
+      uuid = sock_listen_reuseport(settings.address, settings.port, 0);
+    else
+      uuid = sock_listen(settings.address, settings.port);
   }
-  intptr_t uuid = sock_listen(settings.address, settings.port);
   if (uuid == -1) {
     return -1;
   }
@@ -638,6 +1017,8 @@ int facil_listen(struct facil_listen_args settings) {
     sock_close(uuid);
     return -1;
   }
+  if (!settings.reuse_port)
+    listener_set_options(uuid, (struct ListenerProtocol *)protocol);
   if (FACIL_PRINT_STATE && facil_data->parent == getpid()) {
     if (settings.port)
       fprintf(stderr, "* Listening on port %s\n", settings.port);
@@ -647,6 +1028,364 @@ int facil_listen(struct facil_listen_args settings) {
   return 0;
 }
 
+/* *****************************************************************************
+Graceful reload (listening socket handoff)
+***************************************************************************** */
+#if !FACIL_DISABLE_GRACEFUL_RELOAD
+
+extern char **environ;
+
+/* the environment variable naming the new generation's handoff socket */
+#define FACIL_RELOAD_ENV "FACIL_RELOAD_FD"
+
+/*
+ * A handoff record, sent with the listening socket's fd (an empty record, with
+ * no fd, marks the end of the handoff).
+ */
+typedef struct {
+  char port[16];
+  char address[256];
+} facil_handoff_s;
+
+static struct {
+  /* the handoff socket (new generation), until the generation is running */
+  int fd;
+  /* listening sockets inherited from the previous generation */
+  size_t count;
+  struct {
+    int fd;
+    facil_handoff_s addr;
+  } * sockets;
+  /* the original command line (old generation) */
+  char **argv;
+  /* the handoff socket's uuid (old generation), while reloading */
+  intptr_t uuid;
+  uint8_t ready;
+} facil_reload_data = {.fd = -1, .uuid = -1};
+
+static void facil_handoff_fill(facil_handoff_s *rec, const char *address,
+                               const char *port) {
+  *rec = (facil_handoff_s){.port[0] = 0};
+  if (port)
+    strncpy(rec->port, port, sizeof(rec->port) - 1);
+  if (address)
+    strncpy(rec->address, address, sizeof(rec->address) - 1);
+}
+
+/* sends a handoff record, with the `sock` fd attached (unless -1) */
+static int facil_handoff_send(int fd, facil_handoff_s *rec, int sock) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctrl;
+  struct iovec iov = {.iov_base = rec, .iov_len = sizeof(*rec)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  if (sock != -1) {
+    memset(&ctrl, 0, sizeof(ctrl));
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+  }
+  return (sendmsg(fd, &msg, 0) == (ssize_t)sizeof(*rec)) ? 0 : -1;
+}
+
+/* receives a handoff record, returning the attached fd (or -1) */
+static int facil_handoff_recv(int fd, facil_handoff_s *rec) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctrl;
+  struct iovec iov = {.iov_base = rec, .iov_len = sizeof(*rec)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctrl.buf,
+                       .msg_controllen = sizeof(ctrl.buf)};
+  int sock = -1;
+  if (recvmsg(fd, &msg, MSG_WAITALL) != (ssize_t)sizeof(*rec)) {
+    rec->port[0] = rec->address[0] = 0;
+    return -1;
+  }
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+  }
+  rec->port[sizeof(rec->port) - 1] = 0;
+  rec->address[sizeof(rec->address) - 1] = 0;
+  return sock;
+}
+
+/* New generation: receives the listening sockets (called once, on init). */
+static void facil_reload_inherit(void) {
+  char *env = getenv(FACIL_RELOAD_ENV);
+  if (!env)
+    return;
+  int fd = atoi(env);
+  unsetenv(FACIL_RELOAD_ENV);
+  if (fd <= 2 || fcntl(fd, F_GETFD) == -1)
+    return;
+  facil_reload_data.fd = fd;
+  for (;;) {
+    facil_handoff_s rec;
+    int sock = facil_handoff_recv(fd, &rec);
+    if (sock == -1) {
+      if (rec.port[0] || rec.address[0])
+        continue;
+      break;
+    }
+    void *tmp = realloc(facil_reload_data.sockets,
+                        sizeof(*facil_reload_data.sockets) *
+                            (facil_reload_data.count + 1));
+    if (!tmp) {
+      close(sock);
+      continue;
+    }
+    facil_reload_data.sockets = tmp;
+    facil_reload_data.sockets[facil_reload_data.count].fd = sock;
+    facil_reload_data.sockets[facil_reload_data.count].addr = rec;
+    ++facil_reload_data.count;
+  }
+  if (FACIL_PRINT_STATE)
+    fprintf(stderr, "* Graceful reload: inherited %zu listening socket(s).\n",
+            facil_reload_data.count);
+}
+
+/* New generation: returns the uuid of a matching inherited socket (or -1). */
+static intptr_t facil_reload_adopt(const char *address, const char *port) {
+  facil_handoff_s rec;
+  facil_handoff_fill(&rec, address, port);
+  for (size_t i = 0; i < facil_reload_data.count; ++i) {
+    if (facil_reload_data.sockets[i].fd == -1 ||
+        strcmp(rec.port, facil_reload_data.sockets[i].addr.port) ||
+        strcmp(rec.address, facil_reload_data.sockets[i].addr.address))
+      continue;
+    int fd = facil_reload_data.sockets[i].fd;
+    facil_reload_data.sockets[i].fd = -1;
+    if (sock_set_non_block(fd) == -1) {
+      close(fd);
+      return -1;
+    }
+    return sock_open(fd);
+  }
+  return -1;
+}
+
+/* New generation: closes any unused inherited sockets (before forking). */
+static void facil_reload_release(void) {
+  for (size_t i = 0; i < facil_reload_data.count; ++i) {
+    if (facil_reload_data.sockets[i].fd != -1)
+      close(facil_reload_data.sockets[i].fd);
+  }
+  free(facil_reload_data.sockets);
+  facil_reload_data.sockets = NULL;
+  facil_reload_data.count = 0;
+}
+
+/*
+ * New generation: notifies the previous generation that the new one is running
+ * (root process) or closes the handoff socket (worker processes).
+ */
+static void facil_reload_ready(uint8_t notify) {
+  if (facil_reload_data.fd == -1)
+    return;
+  if (notify && write(facil_reload_data.fd, "R", 1) != 1)
+    perror("WARNING: (facil) couldn't notify the previous generation");
+  close(facil_reload_data.fd);
+  facil_reload_data.fd = -1;
+}
+
+/* Old generation: stores the original command line (Linux only). */
+static void facil_reload_store_command(void) {
+  if (facil_reload_data.argv)
+    return;
+  int fd = open("/proc/self/cmdline", O_RDONLY);
+  if (fd == -1)
+    return;
+  size_t len = 0, capa = 4096;
+  char *buf = malloc(capa);
+  ssize_t r;
+  while (buf && (r = read(fd, buf + len, capa - len - 1)) > 0) {
+    len += r;
+    if (len + 1 == capa) {
+      char *tmp = realloc(buf, capa << 1);
+      if (!tmp)
+        free(buf);
+      buf = tmp;
+      capa <<= 1;
+    }
+  }
+  close(fd);
+  if (!buf || !len) {
+    free(buf);
+    return;
+  }
+  buf[len] = 0;
+  size_t argc = 0;
+  for (size_t i = 0; i < len; ++i)
+    argc += (buf[i] == 0);
+  char **argv = malloc(sizeof(*argv) * (argc + 2));
+  if (!argv) {
+    free(buf);
+    return;
+  }
+  argc = 0;
+  for (size_t i = 0; i < len; i += strlen(buf + i) + 1)
+    argv[argc++] = buf + i;
+  argv[argc] = NULL;
+  facil_reload_data.argv = argv;
+}
+
+static void facil_reload_handed_off(uint8_t flag) {
+  for (int i = 0; i < facil_data->capacity; ++i) {
+    if (fd_data(i).protocol &&
+        fd_data(i).protocol->service == LISTENER_PROTOCOL_NAME)
+      ((struct ListenerProtocol *)fd_data(i).protocol)->handed_off = flag;
+  }
+}
+
+static void facil_reload_on_data(intptr_t uuid, protocol_s *pr) {
+  char buf[8];
+  ssize_t r = sock_read(uuid, buf, sizeof(buf));
+  if (r > 0 && !facil_reload_data.ready) {
+    facil_reload_data.ready = 1;
+    if (FACIL_PRINT_STATE)
+      fprintf(stderr, "* Graceful reload: the new generation is running, "
+                      "shutting down.\n");
+    facil_stop();
+  }
+  (void)pr;
+}
+
+/* the new generation might take a while to start */
+static void facil_reload_ping(intptr_t uuid, protocol_s *pr) {
+  sock_touch(uuid);
+  (void)pr;
+}
+
+static void facil_reload_on_close(intptr_t uuid, protocol_s *pr) {
+  free(pr);
+  if (facil_data->parent != getpid())
+    return;
+  facil_reload_data.uuid = -1;
+  if (!facil_reload_data.ready) {
+    facil_reload_handed_off(0);
+    fprintf(stderr, "ERROR: Graceful reload failed (the new generation "
+                    "exited), still running.\n");
+  }
+  (void)uuid;
+}
+
+/* Old generation: starts a new generation and hands off the listeners. */
+static void facil_reload_task(void *arg1, void *arg2) {
+  (void)arg1;
+  (void)arg2;
+  if (!facil_data->active || facil_reload_data.uuid != -1 ||
+      facil_reload_data.ready)
+    return;
+  if (!facil_reload_data.argv) {
+    fprintf(stderr, "WARNING: Graceful reload unavailable (the original "
+                    "command line is unknown).\n");
+    return;
+  }
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    perror("ERROR: Graceful reload failed (socketpair)");
+    return;
+  }
+  /* prepare the new environment before forking */
+  char env_str[64];
+  snprintf(env_str, sizeof(env_str), FACIL_RELOAD_ENV "=%d", sv[1]);
+  size_t env_count = 0;
+  while (environ[env_count])
+    ++env_count;
+  char **env = malloc(sizeof(*env) * (env_count + 2));
+  if (!env) {
+    close(sv[0]);
+    close(sv[1]);
+    return;
+  }
+  size_t pos = 0;
+  for (size_t i = 0; i < env_count; ++i) {
+    if (strncmp(environ[i], FACIL_RELOAD_ENV "=", sizeof(FACIL_RELOAD_ENV)))
+      env[pos++] = environ[i];
+  }
+  env[pos++] = env_str;
+  env[pos] = NULL;
+
+  pid_t child = fork();
+  if (child == 0) {
+    /* a new session, so the generations don't share signals */
+    setsid();
+    /* the new generation is orphaned, so the old one doesn't wait for it */
+    if (fork())
+      _exit(0);
+    for (int i = 3; i < facil_data->capacity; ++i) {
+      if (i != sv[1])
+        close(i);
+    }
+    environ = env;
+    execvp(facil_reload_data.argv[0], facil_reload_data.argv);
+    _exit(127);
+  }
+  free(env);
+  close(sv[1]);
+  if (child == -1) {
+    perror("ERROR: Graceful reload failed (fork)");
+    close(sv[0]);
+    return;
+  }
+  waitpid(child, NULL, 0);
+  /* hand off the listening sockets (`reuse_port` and UDP sockets aren't
+   * shared) */
+  size_t count = 0;
+  for (int i = 0; i < facil_data->capacity; ++i) {
+    struct ListenerProtocol *listener =
+        (struct ListenerProtocol *)fd_data(i).protocol;
+    if (!listener || listener->protocol.service != LISTENER_PROTOCOL_NAME ||
+        (listener->reuse_port && listener->port) || listener->on_datagram)
+      continue;
+    facil_handoff_s rec;
+    facil_handoff_fill(&rec, listener->address, listener->port);
+    if (facil_handoff_send(sv[0], &rec, i))
+      perror("WARNING: (facil) couldn't hand off a listening socket");
+    else
+      ++count;
+  }
+  {
+    facil_handoff_s rec;
+    facil_handoff_fill(&rec, NULL, NULL);
+    facil_handoff_send(sv[0], &rec, -1);
+  }
+  facil_reload_handed_off(1);
+  if (FACIL_PRINT_STATE)
+    fprintf(stderr, "* Graceful reload: handed off %zu listening socket(s).\n",
+            count);
+  /* wait for the new generation to run (or exit) */
+  protocol_s *pr = malloc(sizeof(*pr));
+  intptr_t uuid;
+  if (!pr || sock_set_non_block(sv[0]) == -1 ||
+      (uuid = sock_open(sv[0])) == -1) {
+    free(pr);
+    close(sv[0]);
+    facil_reload_handed_off(0);
+    return;
+  }
+  *pr = (protocol_s){
+      .service = RELOAD_PROTOCOL_NAME,
+      .on_data = facil_reload_on_data,
+      .on_close = facil_reload_on_close,
+      .ping = facil_reload_ping,
+  };
+  facil_reload_data.uuid = uuid;
+  facil_attach(uuid, pr);
+}
+
+#endif /* FACIL_DISABLE_GRACEFUL_RELOAD */
+
 /* *****************************************************************************
 Connect (as client)
 ***************************************************************************** */
@@ -734,38 +1473,139 @@ Timers
 ***************************************************************************** */
 
 /* *******
-Timer Protocol
+Timer Scheduler
 ******* */
+
+/*
+ * All the timers are kept in a (per process) binary heap, ordered by their due
+ * time. A single timer file descriptor is armed for the earliest due time.
+ */
 typedef struct {
-  protocol_s protocol;
+  uint64_t due; /* CLOCK_MONOTONIC, in nanoseconds */
   size_t milliseconds;
   size_t repetitions;
   void (*task)(void *);
   void (*on_finish)(void *);
   void *arg;
-} timer_protocol_s;
+} facil_timer_s;
+
+static struct {
+  spn_lock_i lock;
+  size_t count;
+  size_t capa;
+  facil_timer_s **heap;
+  /* the scheduler's timer connection (-1 while the server isn't running) */
+  intptr_t uuid;
+} facil_timers = {.lock = SPN_LOCK_INIT, .uuid = -1};
 
-#define prot2timer(protocol) (*((timer_protocol_s *)(protocol)))
+static inline uint64_t timer_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000000) + (uint64_t)t.tv_nsec;
+}
+
+/* arms the timer fd for the earliest timer - call while holding the lock. */
+static void timer_scheduler_arm(void) {
+  if (facil_timers.uuid == -1 || !facil_timers.count)
+    return;
+  uint64_t now = timer_now();
+  uint64_t due = facil_timers.heap[0]->due;
+  unsigned long delay = (due > now) ? (unsigned long)((due - now) / 1000) : 0;
+  if (evio_set_timer_us(sock_uuid2fd(facil_timers.uuid),
+                        (void *)facil_timers.uuid, delay) == -1)
+    perror("ERROR: couldn't arm the timer scheduler");
+}
+
+/* adds a timer to the heap (and rearms the timer fd, if required). */
+static int timer_push(facil_timer_s *t) {
+  spn_lock(&facil_timers.lock);
+  if (facil_timers.count == facil_timers.capa) {
+    size_t capa = facil_timers.capa ? (facil_timers.capa << 1) : 64;
+    facil_timer_s **tmp =
+        realloc(facil_timers.heap, capa * sizeof(*facil_timers.heap));
+    if (!tmp) {
+      spn_unlock(&facil_timers.lock);
+      return -1;
+    }
+    facil_timers.heap = tmp;
+    facil_timers.capa = capa;
+  }
+  size_t pos = facil_timers.count++;
+  while (pos) {
+    size_t parent = (pos - 1) >> 1;
+    if (facil_timers.heap[parent]->due <= t->due)
+      break;
+    facil_timers.heap[pos] = facil_timers.heap[parent];
+    pos = parent;
+  }
+  facil_timers.heap[pos] = t;
+  if (!pos)
+    timer_scheduler_arm();
+  spn_unlock(&facil_timers.lock);
+  return 0;
+}
+
+/* removes the earliest timer if it's due - call while holding the lock. */
+static facil_timer_s *timer_pop(uint64_t now) {
+  if (!facil_timers.count || facil_timers.heap[0]->due > now)
+    return NULL;
+  facil_timer_s *ret = facil_timers.heap[0];
+  facil_timer_s *last = facil_timers.heap[--facil_timers.count];
+  size_t pos = 0;
+  for (;;) {
+    size_t child = (pos << 1) + 1;
+    if (child >= facil_timers.count)
+      break;
+    if (child + 1 < facil_timers.count &&
+        facil_timers.heap[child + 1]->due < facil_timers.heap[child]->due)
+      ++child;
+    if (last->due <= facil_timers.heap[child]->due)
+      break;
+    facil_timers.heap[pos] = facil_timers.heap[child];
+    pos = child;
+  }
+  facil_timers.heap[pos] = last;
+  return ret;
+}
 
-static void timer_on_data(intptr_t uuid, protocol_s *protocol) {
-  prot2timer(protocol).task(prot2timer(protocol).arg);
-  if (prot2timer(protocol).repetitions == 0)
+/* performs a timer's task and reschedules it (or finishes it). */
+static void timer_perform(void *t_, void *ignr) {
+  facil_timer_s *t = t_;
+  t->task(t->arg);
+  if (t->repetitions == 0)
     goto reschedule;
-  prot2timer(protocol).repetitions -= 1;
-  if (prot2timer(protocol).repetitions)
+  t->repetitions -= 1;
+  if (t->repetitions)
     goto reschedule;
-  sock_force_close(uuid);
-  return;
+  goto finish;
 reschedule:
+  t->due = timer_now() + ((uint64_t)t->milliseconds * 1000000);
+  if (!timer_push(t))
+    return;
+finish:
+  t->on_finish(t->arg);
+  free(t);
+  (void)ignr;
+}
+
+static void timer_scheduler_on_data(intptr_t uuid, protocol_s *protocol) {
+  facil_timer_s *t;
+  uint64_t now = timer_now();
   spn_trylock(&uuid_data(uuid).scheduled);
-  evio_set_timer(sock_uuid2fd(uuid), (void *)uuid,
-                 prot2timer(protocol).milliseconds);
+  spn_lock(&facil_timers.lock);
+  while ((t = timer_pop(now)))
+    defer_priority(DEFER_PRIORITY_IO, timer_perform, t, NULL);
+  timer_scheduler_arm();
+  spn_unlock(&facil_timers.lock);
+  (void)protocol;
 }
 
-static void timer_on_close(intptr_t uuid, protocol_s *protocol) {
-  prot2timer(protocol).on_finish(prot2timer(protocol).arg);
+static void timer_scheduler_on_close(intptr_t uuid, protocol_s *protocol) {
+  spn_lock(&facil_timers.lock);
+  if (facil_timers.uuid == uuid)
+    facil_timers.uuid = -1;
+  spn_unlock(&facil_timers.lock);
   free(protocol);
-  (void)uuid;
 }
 
 static void timer_ping(intptr_t uuid, protocol_s *protocol) {
@@ -773,44 +1613,61 @@ static void timer_ping(intptr_t uuid, protocol_s *protocol) {
   (void)protocol;
 }
 
-static inline timer_protocol_s *timer_alloc(void (*task)(void *), void *arg,
-                                            size_t milliseconds,
-                                            size_t repetitions,
-                                            void (*on_finish)(void *)) {
-  if (!on_finish)
-    on_finish = (void (*)(void *))mock_on_close;
-  timer_protocol_s *t = malloc(sizeof(*t));
-  if (t)
-    *t = (timer_protocol_s){
-        .protocol.service = TIMER_PROTOCOL_NAME,
-        .protocol.on_data = timer_on_data,
-        .protocol.on_close = timer_on_close,
-        .protocol.ping = timer_ping,
-        .arg = arg,
-        .task = task,
-        .on_finish = on_finish,
-        .milliseconds = milliseconds,
-        .repetitions = repetitions,
-    };
-  return t;
+/* opens the (per process) timer fd - called by every process on startup. */
+static void timer_scheduler_start(void) {
+  protocol_s *protocol = NULL;
+  intptr_t uuid = -1;
+  int fd = evio_open_timer();
+  if (fd == -1)
+    goto error;
+  uuid = sock_open(fd);
+  if (uuid == -1)
+    goto error;
+  protocol = malloc(sizeof(*protocol));
+  if (!protocol)
+    goto error;
+  *protocol = (protocol_s){
+      .service = TIMER_PROTOCOL_NAME,
+      .on_data = timer_scheduler_on_data,
+      .on_close = timer_scheduler_on_close,
+      .ping = timer_ping,
+  };
+  if (facil_attach(uuid, protocol))
+    goto error;
+  spn_lock(&facil_timers.lock);
+  facil_timers.uuid = uuid;
+  timer_scheduler_arm();
+  spn_unlock(&facil_timers.lock);
+  return;
+error:
+  perror("Couldn't register a required timed event.");
+  kill(0, SIGINT);
+  exit(4);
 }
 
-inline static void timer_on_server_start(int fd) {
-  if (evio_set_timer(fd, (void *)sock_fd2uuid(fd),
-                     prot2timer(fd_data(fd).protocol).milliseconds)) {
-    perror("Couldn't register a required timed event.");
-    kill(0, SIGINT);
-    exit(4);
+/* calls `on_finish` for any timers left once the server stops. */
+static void timer_scheduler_clear(void) {
+  facil_timer_s *t;
+  spn_lock(&facil_timers.lock);
+  while ((t = timer_pop((uint64_t)-1))) {
+    spn_unlock(&facil_timers.lock);
+    t->on_finish(t->arg);
+    free(t);
+    spn_lock(&facil_timers.lock);
   }
+  free(facil_timers.heap);
+  facil_timers.heap = NULL;
+  facil_timers.capa = 0;
+  spn_unlock(&facil_timers.lock);
 }
 
 /**
- * Creates a system timer (at the cost of 1 file descriptor).
+ * Creates a timer (all the timers share a single file descriptor).
  *
  * The task will repeat `repetitions` times. If `repetitions` is set to 0, task
  * will repeat forever.
  *
- * Returns -1 on error or the new file descriptor on succeess.
+ * Returns -1 on error or 0 on succeess.
  *
  * The `on_finish` handler is always called (even on error).
  */
@@ -819,38 +1676,24 @@ int facil_run_every(size_t milliseconds, size_t repetitions,
                     void (*on_finish)(void *)) {
   if (task == NULL)
     goto error_fin;
-  timer_protocol_s *protocol = NULL;
-  intptr_t uuid = -1;
-  int fd = evio_open_timer();
-  if (fd == -1) {
-    perror("ERROR: couldn't create a timer fd");
-    goto error;
-  }
-  uuid = sock_open(fd);
-  if (uuid == -1)
-    goto error;
-  protocol = timer_alloc(task, arg, milliseconds, repetitions, on_finish);
-  if (protocol == NULL)
-    goto error;
-  facil_attach(uuid, (protocol_s *)protocol);
-  if (evio_isactive() && evio_set_timer(fd, (void *)uuid, milliseconds) == -1) {
-    /* don't goto error because the protocol is attached. */
-    const int old = errno;
-    sock_force_close(uuid);
-    errno = old;
-    return -1;
+  if (!on_finish)
+    on_finish = (void (*)(void *))mock_on_close;
+  facil_timer_s *t = malloc(sizeof(*t));
+  if (!t)
+    goto error_fin;
+  *t = (facil_timer_s){
+      .due = timer_now() + ((uint64_t)milliseconds * 1000000),
+      .milliseconds = milliseconds,
+      .repetitions = repetitions,
+      .task = task,
+      .on_finish = on_finish,
+      .arg = arg,
+  };
+  if (timer_push(t)) {
+    free(t);
+    goto error_fin;
   }
   return 0;
-error:
-  if (uuid != -1) {
-    const int old = errno;
-    sock_close(uuid);
-    errno = old;
-  } else if (fd != -1) {
-    const int old = errno;
-    close(fd);
-    errno = old;
-  }
 error_fin:
   if (on_finish) {
     const int old = errno;
@@ -891,6 +1734,35 @@ inline static void cluster_uint2str(uint8_t *dest, uint32_t i) {
 #endif
 
 #define CLUSTER_READ_BUFFER 16384
+/*
+ * Message header: channel length, message length, type, filter and the
+ * process ID of the process where the message originated (4 bytes each).
+ */
+#define CLUSTER_HEADER_LENGTH 20
+/* the maximal number of file descriptors attached to a single write */
+#define CLUSTER_FDS_LIMIT 32
+
+/* a FIFO queue of file descriptors (migrated connections) */
+typedef struct {
+  int *fds;
+  size_t start;
+  size_t end;
+  size_t capa;
+} cluster_fd_queue_s;
+
+/*
+ * File descriptors passed over a cluster connection (`SCM_RIGHTS`).
+ *
+ * File descriptors are sent with (or before) the first byte written after they
+ * were queued, so they are always received before the message that refers to
+ * them.
+ */
+typedef struct {
+  cluster_fd_queue_s out;
+  cluster_fd_queue_s in;
+  spn_lock_i lock;
+} cluster_fds_s;
+
 typedef struct {
   protocol_s pr;
   FIOBJ channel;
@@ -899,7 +1771,11 @@ typedef struct {
   uint32_t exp_msg;
   uint32_t type;
   int32_t filter;
+  uint32_t origin;
   uint32_t length;
+  /* the worker's process ID (root process), as reported by it's messages */
+  uint32_t peer;
+  cluster_fds_s fds;
   uint8_t buffer[];
 } cluster_pr_s;
 
@@ -921,9 +1797,15 @@ static struct {
   fio_hash_s handlers;
   spn_lock_i lock;
   uint8_t client_mode;
+  /* the connection to the root process (worker), protected by `lock` */
+  cluster_pr_s *root_pr;
+  /* messages waiting to be sent (a String with the framed messages) */
+  FIOBJ batch;
+  spn_lock_i batch_lock;
   char cluster_name[128];
 } facil_cluster_data = {
     .lock = SPN_LOCK_INIT,
+    .batch_lock = SPN_LOCK_INIT,
     .root = -1,
     .listening =
         {
@@ -935,10 +1817,12 @@ static struct {
 
 enum cluster_message_type_e {
   CLUSTER_MESSAGE_FORWARD,
-  CLUSTER_MESSAGE_JSON,
+  CLUSTER_MESSAGE_BINARY,
   CLUSTER_MESSAGE_SHUTDOWN,
   CLUSTER_MESSAGE_ERROR,
   CLUSTER_MESSAGE_PING,
+  CLUSTER_MESSAGE_MIGRATE,
+  CLUSTER_MESSAGE_SHARED,
 };
 
 static void cluster_deferred_handler(void *msg_data_, void *ignr) {
@@ -950,76 +1834,625 @@ static void cluster_deferred_handler(void *msg_data_, void *ignr) {
   (void)ignr;
 }
 
-static void cluster_forward_msg2handlers(cluster_pr_s *c) {
+static void cluster_forward_msg2handlers(cluster_pr_s *c) {
+  spn_lock(&facil_cluster_data.lock);
+  void *target_ =
+      fio_hash_find(&facil_cluster_data.handlers, (FIO_HASH_KEY_TYPE)c->filter);
+  spn_unlock(&facil_cluster_data.lock);
+  // fprintf(stderr, "handler for %d: %p\n", c->filter, target_);
+  if (target_) {
+    cluster_msg_data_s *data = fio_malloc(sizeof(*data));
+    if (!data) {
+      perror("FATAL ERROR: (facil.io cluster) couldn't allocate memory");
+      exit(errno);
+    }
+    *data = (cluster_msg_data_s){
+        .on_message = ((cluster_msg_data_s *)(&target_))->on_message,
+        .channel = fiobj_dup(c->channel),
+        .msg = fiobj_dup(c->msg),
+        .filter = c->filter,
+    };
+    defer(cluster_deferred_handler, data, NULL);
+  }
+}
+
+/* decodes the binary (MessagePack) channel and message of structured data. */
+static void cluster_decode_msg(cluster_pr_s *c) {
+  fio_cstr_s s = fiobj_obj2cstr(c->channel);
+  FIOBJ tmp = FIOBJ_INVALID;
+  if (fiobj_bin2obj(&tmp, s.bytes, s.len)) {
+    fiobj_free(c->channel);
+    c->channel = tmp;
+    tmp = FIOBJ_INVALID;
+  } else {
+    fprintf(stderr, "WARNING: (facil.io cluster) binary channel is invalid.\n");
+  }
+  s = fiobj_obj2cstr(c->msg);
+  if (fiobj_bin2obj(&tmp, s.bytes, s.len)) {
+    fiobj_free(c->msg);
+    c->msg = tmp;
+  } else {
+    fprintf(stderr, "WARNING: (facil.io cluster) binary message is invalid.\n");
+  }
+}
+
+static inline void cluster_write_header(uint8_t *dest, uint32_t ch_len,
+                                        uint32_t msg_len, uint32_t type,
+                                        int32_t id, uint32_t origin) {
+  cluster_uint2str(dest, ch_len);
+  cluster_uint2str(dest + 4, msg_len);
+  cluster_uint2str(dest + 8, type);
+  cluster_uint2str(dest + 12, (uint32_t)id);
+  cluster_uint2str(dest + 16, origin);
+}
+
+static FIOBJ cluster_wrap_message(uint32_t ch_len, uint32_t msg_len,
+                                  uint32_t type, int32_t id, uint32_t origin,
+                                  uint8_t *ch_data, uint8_t *msg_data) {
+  FIOBJ buf = fiobj_str_buf(ch_len + msg_len + CLUSTER_HEADER_LENGTH);
+  fio_cstr_s f = fiobj_obj2cstr(buf);
+  cluster_write_header(f.bytes, ch_len, msg_len, type, id, origin);
+  if (ch_len && ch_data) {
+    memcpy(f.bytes + CLUSTER_HEADER_LENGTH, ch_data, ch_len);
+  }
+  if (msg_len && msg_data) {
+    memcpy(f.bytes + CLUSTER_HEADER_LENGTH + ch_len, msg_data, msg_len);
+  }
+  fiobj_str_resize(buf, ch_len + msg_len + CLUSTER_HEADER_LENGTH);
+  return buf;
+}
+
+/* sends a String to the root process or to all the worker processes */
+static void cluster_send_fiobj(FIOBJ forward) {
+  if (facil_cluster_data.client_mode) {
+    fiobj_send_free(facil_cluster_data.root, forward);
+    return;
+  }
+  spn_lock(&facil_cluster_data.lock);
+  FIO_HASH_FOR_LOOP(&facil_cluster_data.clients, i) {
+    if (i->obj) {
+      fiobj_send_free((intptr_t)i->key, fiobj_dup(forward));
+    }
+  }
+  spn_unlock(&facil_cluster_data.lock);
+  fiobj_free(forward);
+}
+
+/* sends the pending message batch (if any) */
+static void cluster_batch_flush(void *ignr1, void *ignr2) {
+  spn_lock(&facil_cluster_data.batch_lock);
+  FIOBJ batch = facil_cluster_data.batch;
+  facil_cluster_data.batch = FIOBJ_INVALID;
+  spn_unlock(&facil_cluster_data.batch_lock);
+  if (batch)
+    cluster_send_fiobj(batch);
+  (void)ignr1;
+  (void)ignr2;
+}
+
+/*
+ * Appends a message to the pending batch (call within `batch_lock`).
+ *
+ * Sets `schedule` if a new batch was started. Returns the batch if it's full
+ * (the batch is detached and should be sent by the caller).
+ */
+static inline FIOBJ cluster_batch_append(uint32_t ch_len, uint32_t msg_len,
+                                         uint32_t type, int32_t id,
+                                         uint32_t origin, uint8_t *ch_data,
+                                         uint8_t *msg_data, uint8_t *schedule) {
+  uint8_t header[CLUSTER_HEADER_LENGTH];
+  FIOBJ full = FIOBJ_INVALID;
+  cluster_write_header(header, ch_len, msg_len, type, id, origin);
+  if (!facil_cluster_data.batch) {
+    *schedule = 1;
+    facil_cluster_data.batch =
+        fiobj_str_buf(CLUSTER_HEADER_LENGTH + ch_len + msg_len);
+  }
+  fiobj_str_write(facil_cluster_data.batch, (char *)header,
+                  CLUSTER_HEADER_LENGTH);
+  if (ch_len && ch_data)
+    fiobj_str_write(facil_cluster_data.batch, (char *)ch_data, ch_len);
+  if (msg_len && msg_data)
+    fiobj_str_write(facil_cluster_data.batch, (char *)msg_data, msg_len);
+  if (fiobj_obj2cstr(facil_cluster_data.batch).len >=
+      FACIL_CLUSTER_BATCH_LIMIT) {
+    full = facil_cluster_data.batch;
+    facil_cluster_data.batch = FIOBJ_INVALID;
+  }
+  return full;
+}
+
+/*
+ * Adds a message to the pending batch.
+ *
+ * The batch is sent by a deferred task, so messages sent during the same
+ * reactor cycle share the same write (per process), and the root forwards a
+ * shared batch buffer to all the workers without copying it for each worker.
+ */
+static void cluster_batch_write(uint32_t ch_len, uint32_t msg_len,
+                                uint32_t type, int32_t id, uint32_t origin,
+                                uint8_t *ch_data, uint8_t *msg_data) {
+  uint8_t schedule = 0;
+  spn_lock(&facil_cluster_data.batch_lock);
+  FIOBJ full = cluster_batch_append(ch_len, msg_len, type, id, origin, ch_data,
+                                    msg_data, &schedule);
+  spn_unlock(&facil_cluster_data.batch_lock);
+  if (full)
+    cluster_send_fiobj(full);
+  else if (schedule)
+    defer(cluster_batch_flush, NULL, NULL);
+}
+
+#if FACIL_CLUSTER_SHARED_LIMIT && defined(MFD_CLOEXEC)
+#define CLUSTER_SHARED 1
+static int cluster_shared_write(uint32_t ch_len, uint32_t msg_len,
+                                uint32_t type, int32_t id, uint8_t *ch_data,
+                                uint8_t *msg_data);
+#else
+#define CLUSTER_SHARED 0
+#endif
+
+static inline void cluster_send2traget(uint32_t ch_len, uint32_t msg_len,
+                                       uint32_t type, int32_t id,
+                                       uint8_t *ch_data, uint8_t *msg_data) {
+  if (!facil_cluster_data.client_mode &&
+      facil_cluster_data.clients.count == 0)
+    return;
+  if (type == CLUSTER_MESSAGE_FORWARD || type == CLUSTER_MESSAGE_BINARY) {
+#if CLUSTER_SHARED
+    if (msg_len >= FACIL_CLUSTER_SHARED_LIMIT &&
+        !cluster_shared_write(ch_len, msg_len, type, id, ch_data, msg_data))
+      return;
+#endif
+    cluster_batch_write(ch_len, msg_len, type, id, (uint32_t)getpid(),
+                        ch_data, msg_data);
+    return;
+  }
+  /* control messages are sent immediately, after any pending messages */
+  cluster_batch_flush(NULL, NULL);
+  cluster_send_fiobj(cluster_wrap_message(ch_len, msg_len, type, id,
+                                          (uint32_t)getpid(), ch_data,
+                                          msg_data));
+}
+
+/* *****************************************************************************
+Passing file descriptors (connection migration)
+***************************************************************************** */
+
+static void cluster_fd_push(cluster_fd_queue_s *q, int fd) {
+  if (q->end == q->capa) {
+    if (q->start) {
+      memmove(q->fds, q->fds + q->start, (q->end - q->start) * sizeof(int));
+      q->end -= q->start;
+      q->start = 0;
+    } else {
+      size_t capa = (q->capa ? q->capa << 1 : 16);
+      int *tmp = realloc(q->fds, capa * sizeof(int));
+      if (!tmp) {
+        perror("ERROR: (facil.io cluster) couldn't queue file descriptor");
+        close(fd);
+        return;
+      }
+      q->fds = tmp;
+      q->capa = capa;
+    }
+  }
+  q->fds[q->end++] = fd;
+}
+
+static int cluster_fd_pop(cluster_fd_queue_s *q) {
+  if (q->start == q->end)
+    return -1;
+  int fd = q->fds[q->start++];
+  if (q->start == q->end)
+    q->start = q->end = 0;
+  return fd;
+}
+
+static void cluster_fd_queue_clear(cluster_fd_queue_s *q) {
+  int fd;
+  while ((fd = cluster_fd_pop(q)) != -1)
+    close(fd);
+  free(q->fds);
+  *q = (cluster_fd_queue_s){.fds = NULL};
+}
+
+/* closes any file descriptors that weren't sent / handled */
+static void cluster_fds_clear(cluster_fds_s *f) {
+  spn_lock(&f->lock);
+  cluster_fd_queue_clear(&f->out);
+  cluster_fd_queue_clear(&f->in);
+  spn_unlock(&f->lock);
+}
+
+static ssize_t cluster_fds_read(intptr_t uuid, void *udata, void *buf,
+                                size_t count) {
+  cluster_fds_s *f = udata;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * CLUSTER_FDS_LIMIT)];
+  } ctrl;
+  struct iovec iov = {.iov_base = buf, .iov_len = count};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctrl.buf,
+                       .msg_controllen = sizeof(ctrl.buf)};
+  ssize_t ret = recvmsg(sock_uuid2fd(uuid), &msg, MSG_CMSG_CLOEXEC);
+  if (ret <= 0 || !msg.msg_controllen)
+    return ret;
+  if ((msg.msg_flags & MSG_CTRUNC))
+    fprintf(stderr, "WARNING: (facil.io cluster) migrated connection lost.\n");
+  spn_lock(&f->lock);
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + (i * sizeof(int)), sizeof(int));
+      cluster_fd_push(&f->in, fd);
+    }
+  }
+  spn_unlock(&f->lock);
+  return ret;
+}
+
+static ssize_t cluster_fds_write(intptr_t uuid, void *udata, const void *buf,
+                                 size_t count) {
+  cluster_fds_s *f = udata;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * CLUSTER_FDS_LIMIT)];
+  } ctrl;
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = count};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  spn_lock(&f->lock);
+  size_t fd_count = f->out.end - f->out.start;
+  if (fd_count > CLUSTER_FDS_LIMIT) {
+    fd_count = CLUSTER_FDS_LIMIT;
+    /* keep the file descriptors ahead of the messages referring to them */
+    iov.iov_len = 1;
+  }
+  if (fd_count) {
+    memset(&ctrl, 0, sizeof(ctrl));
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), f->out.fds + f->out.start, sizeof(int) * fd_count);
+  }
+  ssize_t ret = sendmsg(sock_uuid2fd(uuid), &msg, MSG_NOSIGNAL);
+  if (ret > 0) {
+    /* the file descriptors were duplicated into the peer process */
+    while (fd_count--)
+      close(cluster_fd_pop(&f->out));
+  }
+  spn_unlock(&f->lock);
+  return ret;
+}
+
+static void cluster_fds_on_close(intptr_t uuid, sock_rw_hook_s *rw_hook,
+                                 void *udata) {
+  cluster_fds_clear(udata);
+  (void)uuid;
+  (void)rw_hook;
+}
+
+static sock_rw_hook_s CLUSTER_FDS_HOOKS = {
+    .read = cluster_fds_read,
+    .write = cluster_fds_write,
+    .on_close = cluster_fds_on_close,
+};
+
+/* *****************************************************************************
+Shared Messages - large payloads are passed using a shared memory file
+
+The payload is written once to a sealed `memfd` and a duplicate of the file
+descriptor is passed to each peer (see `CLUSTER_FDS_HOOKS`). The message itself
+only holds the channel, the original message type and the payload's length.
+
+The receiving process maps the payload as a static String. Strings don't
+support custom deallocation, so the mapped Strings are tracked and unmapped
+once the tracking reference is the last reference.
+***************************************************************************** */
+#if CLUSTER_SHARED
+
+/* the interval (in milliseconds) between reviews of the mapped payloads */
+#define CLUSTER_SHARED_REVIEW 250
+
+typedef struct {
+  FIOBJ str;
+  void *map;
+  size_t len;
+} cluster_shared_s;
+
+static struct {
+  cluster_shared_s *ary;
+  size_t count;
+  size_t capa;
+  spn_lock_i lock;
+  uint8_t scheduled;
+} cluster_shared = {.lock = SPN_LOCK_INIT};
+
+/* unmaps payloads that are no longer in use. */
+static size_t cluster_shared_release(void) {
+  spn_lock(&cluster_shared.lock);
+  size_t i = 0;
+  while (i < cluster_shared.count) {
+    cluster_shared_s *s = cluster_shared.ary + i;
+    if ((FIOBJECT2HEAD(s->str)->ref & ~FIOBJ_REF_LOCAL) != 1) {
+      ++i;
+      continue;
+    }
+    fiobj_free(s->str);
+    munmap(s->map, s->len);
+    *s = cluster_shared.ary[--cluster_shared.count];
+  }
+  size_t count = cluster_shared.count;
+  spn_unlock(&cluster_shared.lock);
+  return count;
+}
+
+static void cluster_shared_review(void *ignr) {
+  spn_lock(&cluster_shared.lock);
+  cluster_shared.scheduled = 0;
+  spn_unlock(&cluster_shared.lock);
+  if (!cluster_shared_release())
+    return;
+  spn_lock(&cluster_shared.lock);
+  uint8_t schedule = !cluster_shared.scheduled;
+  cluster_shared.scheduled = 1;
+  spn_unlock(&cluster_shared.lock);
+  if (schedule)
+    facil_run_every(CLUSTER_SHARED_REVIEW, 1, cluster_shared_review, NULL,
+                    NULL);
+  (void)ignr;
+}
+
+/* tracks a mapped String, so the payload is unmapped once it isn't used. */
+static void cluster_shared_track(FIOBJ str, void *map, size_t len) {
+  spn_lock(&cluster_shared.lock);
+  if (cluster_shared.count == cluster_shared.capa) {
+    size_t capa = cluster_shared.capa ? cluster_shared.capa << 1 : 16;
+    cluster_shared_s *tmp =
+        realloc(cluster_shared.ary, capa * sizeof(*cluster_shared.ary));
+    if (!tmp) {
+      spn_unlock(&cluster_shared.lock);
+      perror("ERROR: (facil.io cluster) couldn't track shared message");
+      return;
+    }
+    cluster_shared.ary = tmp;
+    cluster_shared.capa = capa;
+  }
+  cluster_shared.ary[cluster_shared.count++] =
+      (cluster_shared_s){.str = fiobj_dup(str), .map = map, .len = len};
+  uint8_t schedule = !cluster_shared.scheduled;
+  cluster_shared.scheduled = 1;
+  spn_unlock(&cluster_shared.lock);
+  if (schedule)
+    facil_run_every(CLUSTER_SHARED_REVIEW, 1, cluster_shared_review, NULL,
+                    NULL);
+}
+
+/* releases the unused payloads (any payload still in use remains mapped). */
+static void cluster_shared_cleanup(void) {
+  if (!cluster_shared_release()) {
+    free(cluster_shared.ary);
+    cluster_shared.ary = NULL;
+    cluster_shared.capa = 0;
+  }
+  cluster_shared.scheduled = 0;
+}
+
+/* sends a shared message to a single peer (call within the cluster lock). */
+static void cluster_shared_send2peer(cluster_pr_s *peer, intptr_t uuid, int fd,
+                                     uint32_t ch_len, uint32_t msg_len,
+                                     uint32_t type, int32_t id, uint32_t origin,
+                                     uint8_t *ch_data, uint8_t *msg_data) {
+  int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (dup_fd == -1) {
+    /* out of file descriptors, send the payload */
+    fiobj_send_free(uuid, cluster_wrap_message(ch_len, msg_len, type, id,
+                                               origin, ch_data, msg_data));
+    return;
+  }
+  uint8_t info[8];
+  cluster_uint2str(info, type);
+  cluster_uint2str(info + 4, msg_len);
+  spn_lock(&peer->fds.lock);
+  cluster_fd_push(&peer->fds.out, dup_fd);
+  spn_unlock(&peer->fds.lock);
+  fiobj_send_free(uuid, cluster_wrap_message(ch_len, 8, CLUSTER_MESSAGE_SHARED,
+                                             id, origin, ch_data, info));
+}
+
+/*
+ * Sends a shared message (`fd` holds the payload) to the root process or to
+ * all the workers, except the worker where the message originated.
+ */
+static void cluster_shared_send(int fd, uint32_t ch_len, uint32_t msg_len,
+                                uint32_t type, int32_t id, uint32_t origin,
+                                uint8_t *ch_data, uint8_t *msg_data) {
+  /* pending messages are sent first, preserving the message order */
+  cluster_batch_flush(NULL, NULL);
+  /* the lock keeps the file descriptors in the same order as the messages */
   spn_lock(&facil_cluster_data.lock);
-  void *target_ =
-      fio_hash_find(&facil_cluster_data.handlers, (FIO_HASH_KEY_TYPE)c->filter);
+  if (facil_cluster_data.client_mode) {
+    if (facil_cluster_data.root_pr)
+      cluster_shared_send2peer(facil_cluster_data.root_pr,
+                               facil_cluster_data.root, fd, ch_len, msg_len,
+                               type, id, origin, ch_data, msg_data);
+  } else {
+    FIO_HASH_FOR_LOOP(&facil_cluster_data.clients, i) {
+      cluster_pr_s *peer = i->obj;
+      if (peer && peer->peer != origin)
+        cluster_shared_send2peer(peer, (intptr_t)i->key, fd, ch_len, msg_len,
+                                 type, id, origin, ch_data, msg_data);
+    }
+  }
   spn_unlock(&facil_cluster_data.lock);
-  // fprintf(stderr, "handler for %d: %p\n", c->filter, target_);
-  if (target_) {
-    cluster_msg_data_s *data = fio_malloc(sizeof(*data));
-    if (!data) {
-      perror("FATAL ERROR: (facil.io cluster) couldn't allocate memory");
-      exit(errno);
+}
+
+/*
+ * Writes the payload to a shared memory file and sends the message. Returns -1
+ * if the message wasn't sent.
+ */
+static int cluster_shared_write(uint32_t ch_len, uint32_t msg_len,
+                                uint32_t type, int32_t id, uint8_t *ch_data,
+                                uint8_t *msg_data) {
+  int fd = memfd_create("facil-cluster", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return -1;
+  /* the trailing NUL byte is mapped, so the String is NUL terminated */
+  if (ftruncate(fd, (off_t)msg_len + 1))
+    goto error;
+  for (size_t pos = 0; pos < msg_len;) {
+    ssize_t w = pwrite(fd, msg_data + pos, msg_len - pos, (off_t)pos);
+    if (w <= 0) {
+      if (w == -1 && errno == EINTR)
+        continue;
+      goto error;
     }
-    *data = (cluster_msg_data_s){
-        .on_message = ((cluster_msg_data_s *)(&target_))->on_message,
-        .channel = fiobj_dup(c->channel),
-        .msg = fiobj_dup(c->msg),
-        .filter = c->filter,
-    };
-    defer(cluster_deferred_handler, data, NULL);
+    pos += w;
+  }
+#ifdef F_ADD_SEALS
+  fcntl(fd, F_ADD_SEALS,
+        F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+  cluster_shared_send(fd, ch_len, msg_len, type, id, (uint32_t)getpid(),
+                      ch_data, msg_data);
+  close(fd);
+  return 0;
+error:
+  close(fd);
+  return -1;
+}
+
+/*
+ * Maps a shared message's payload, replacing `c->msg` with the payload and
+ * `c->type` with the original message type.
+ *
+ * Returns the payload's file descriptor (the caller should close it) or -1.
+ */
+static int cluster_shared_open(cluster_pr_s *c) {
+  fio_cstr_s s = fiobj_obj2cstr(c->msg);
+  spn_lock(&c->fds.lock);
+  int fd = cluster_fd_pop(&c->fds.in);
+  spn_unlock(&c->fds.lock);
+  if (fd == -1 || s.len != 8) {
+    fprintf(stderr, "WARNING: (facil.io cluster) shared message missing.\n");
+    if (fd != -1)
+      close(fd);
+    return -1;
   }
+  const uint32_t type = cluster_str2uint32(s.bytes);
+  const size_t len = cluster_str2uint32(s.bytes + 4);
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (!fstat(fd, &st) && (size_t)st.st_size > len)
+    map = mmap(NULL, len + 1, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("WARNING: (facil.io cluster) couldn't map shared message");
+    close(fd);
+    return -1;
+  }
+  fiobj_free(c->msg);
+  c->msg = fiobj_str_static(map, len);
+  /* the payload is unmapped once the String isn't used (no need to copy it) */
+  fiobj_str_pin(c->msg);
+  cluster_shared_track(c->msg, map, len + 1);
+  c->type = type;
+  return fd;
 }
 
-static inline FIOBJ cluster_wrap_message(uint32_t ch_len, uint32_t msg_len,
-                                         uint32_t type, int32_t id,
-                                         uint8_t *ch_data, uint8_t *msg_data) {
-  FIOBJ buf = fiobj_str_buf(ch_len + msg_len + 16);
-  fio_cstr_s f = fiobj_obj2cstr(buf);
-  cluster_uint2str(f.bytes, ch_len);
-  cluster_uint2str(f.bytes + 4, msg_len);
-  cluster_uint2str(f.bytes + 8, type);
-  cluster_uint2str(f.bytes + 12, (uint32_t)id);
-  if (ch_len && ch_data) {
-    memcpy(f.bytes + 16, ch_data, ch_len);
+#endif /* CLUSTER_SHARED */
+
+/*
+ * Worker: opens a connection migrated from another worker, as if it was
+ * accepted by the listening socket (the `on_open` callback wasn't called yet).
+ */
+static void cluster_migrate_open(int fd, int32_t listener_fd) {
+  struct ListenerProtocol *listener = NULL;
+  if (listener_fd >= 0 && listener_fd < facil_data->capacity)
+    listener = (struct ListenerProtocol *)fd_data(listener_fd).protocol;
+  if (!listener || listener->protocol.service != LISTENER_PROTOCOL_NAME) {
+    close(fd);
+    return;
   }
-  if (msg_len && msg_data) {
-    memcpy(f.bytes + 16 + ch_len, msg_data, msg_len);
+  intptr_t uuid = sock_open(fd);
+  if (uuid == -1) {
+    close(fd);
+    return;
   }
-  fiobj_str_resize(buf, ch_len + msg_len + 16);
-  return buf;
+  defer_io(DEFER_PRIORITY_IO, listener->on_open, (void *)uuid,
+           listener->udata);
 }
 
-static inline void cluster_send2clients(uint32_t ch_len, uint32_t msg_len,
-                                        uint32_t type, int32_t id,
-                                        uint8_t *ch_data, uint8_t *msg_data,
-                                        intptr_t uuid) {
-  if (facil_cluster_data.clients.count == 0)
+/*
+ * Root: relays a migrated connection to the target worker (or back to the
+ * sending worker, if the target is gone).
+ */
+static void cluster_migrate_relay(cluster_pr_s *c, intptr_t uuid) {
+  spn_lock(&c->fds.lock);
+  int fd = cluster_fd_pop(&c->fds.in);
+  spn_unlock(&c->fds.lock);
+  if (fd == -1) {
+    fprintf(stderr,
+            "WARNING: (facil.io cluster) migrated connection missing.\n");
     return;
-  FIOBJ forward =
-      cluster_wrap_message(ch_len, msg_len, type, id, ch_data, msg_data);
+  }
+  fio_cstr_s s = fiobj_obj2cstr(c->msg);
+  uint32_t target = (s.len == 4 ? cluster_str2uint32(s.bytes) : 0);
+  /* the lock keeps the file descriptors in the same order as the messages */
   spn_lock(&facil_cluster_data.lock);
+  cluster_pr_s *dest = c;
   FIO_HASH_FOR_LOOP(&facil_cluster_data.clients, i) {
-    if (i->obj) {
-      if ((intptr_t)i->key != uuid)
-        fiobj_send_free((intptr_t)i->key, fiobj_dup(forward));
+    cluster_pr_s *peer = i->obj;
+    if (peer && peer->peer == target) {
+      dest = peer;
+      uuid = (intptr_t)i->key;
+      break;
     }
   }
+  spn_lock(&dest->fds.lock);
+  cluster_fd_push(&dest->fds.out, fd);
+  spn_unlock(&dest->fds.lock);
+  fiobj_send_free(uuid, cluster_wrap_message(0, 4, CLUSTER_MESSAGE_MIGRATE,
+                                             c->filter, (uint32_t)getpid(),
+                                             NULL, s.bytes));
   spn_unlock(&facil_cluster_data.lock);
-  fiobj_free(forward);
 }
 
-static inline void cluster_send2traget(uint32_t ch_len, uint32_t msg_len,
-                                       uint32_t type, int32_t id,
-                                       uint8_t *ch_data, uint8_t *msg_data) {
-  if (facil_cluster_data.client_mode) {
-    FIOBJ forward =
-        cluster_wrap_message(ch_len, msg_len, type, id, ch_data, msg_data);
-    fiobj_send_free(facil_cluster_data.root, forward);
-  } else {
-    cluster_send2clients(ch_len, msg_len, type, id, ch_data, msg_data, 0);
+/* Worker: hands a new connection to a less busy worker (0 on success). */
+static int facil_cluster_migrate(intptr_t client, int listener_fd,
+                                 uint16_t margin) {
+  if (!facil_cluster_data.client_mode || !facil_cluster_data.root_pr)
+    return -1;
+  uint32_t target = (uint32_t)fio_stats_least_loaded(
+      facil_data->connection_count, margin);
+  if (!target)
+    return -1;
+  int ret = -1;
+  spn_lock(&facil_cluster_data.lock);
+  cluster_pr_s *root = facil_cluster_data.root_pr;
+  int fd;
+  if (root && (fd = sock_hijack(client)) != -1) {
+    uint8_t pid[4];
+    cluster_uint2str(pid, target);
+    spn_lock(&root->fds.lock);
+    cluster_fd_push(&root->fds.out, fd);
+    spn_unlock(&root->fds.lock);
+    fiobj_send_free(facil_cluster_data.root,
+                    cluster_wrap_message(0, 4, CLUSTER_MESSAGE_MIGRATE,
+                                         listener_fd, (uint32_t)getpid(), NULL,
+                                         pid));
+    ret = 0;
   }
+  spn_unlock(&facil_cluster_data.lock);
+  return ret;
 }
 
 /* NOT signal safe. */
@@ -1034,29 +2467,15 @@ static inline void facil_cluster_signal_children(void) {
 
 static void cluster_on_client_message(cluster_pr_s *c, intptr_t uuid) {
   switch ((enum cluster_message_type_e)c->type) {
-  case CLUSTER_MESSAGE_JSON: {
-    fio_cstr_s s = fiobj_obj2cstr(c->channel);
-    FIOBJ tmp = FIOBJ_INVALID;
-    if (fiobj_json2obj(&tmp, s.bytes, s.len)) {
-      fiobj_free(c->channel);
-      c->channel = tmp;
-      tmp = FIOBJ_INVALID;
-    } else {
-      fprintf(stderr,
-              "WARNING: (facil.io cluster) JSON channel isn't valid JSON.\n");
-    }
-    s = fiobj_obj2cstr(c->msg);
-    if (fiobj_json2obj(&tmp, s.bytes, s.len)) {
-      fiobj_free(c->msg);
-      c->msg = tmp;
-    } else {
-      fprintf(stderr,
-              "WARNING: (facil.io cluster) JSON message isn't valid JSON.\n");
-    }
-  }
+  case CLUSTER_MESSAGE_BINARY:
+    if (c->origin == (uint32_t)getpid())
+      break;
+    cluster_decode_msg(c);
   /* fallthrough */
   case CLUSTER_MESSAGE_FORWARD:
-    cluster_forward_msg2handlers(c);
+    /* the root forwards messages to all the workers, including the sender */
+    if (c->origin != (uint32_t)getpid())
+      cluster_forward_msg2handlers(c);
     break;
 
   case CLUSTER_MESSAGE_ERROR:
@@ -1069,40 +2488,72 @@ static void cluster_on_client_message(cluster_pr_s *c, intptr_t uuid) {
   case CLUSTER_MESSAGE_PING:
     /* do nothing, really. */
     break;
+
+  case CLUSTER_MESSAGE_MIGRATE: {
+    spn_lock(&c->fds.lock);
+    int fd = cluster_fd_pop(&c->fds.in);
+    spn_unlock(&c->fds.lock);
+    if (fd == -1)
+      fprintf(stderr,
+              "WARNING: (facil.io cluster) migrated connection missing.\n");
+    else
+      cluster_migrate_open(fd, c->filter);
+    break;
+  }
+
+  case CLUSTER_MESSAGE_SHARED: {
+#if CLUSTER_SHARED
+    int fd = cluster_shared_open(c);
+    if (fd == -1)
+      break;
+    close(fd);
+    if (c->type == CLUSTER_MESSAGE_FORWARD || c->type == CLUSTER_MESSAGE_BINARY)
+      cluster_on_client_message(c, uuid);
+#endif
+    break;
+  }
   }
 }
 
 static void cluster_on_server_message(cluster_pr_s *c, intptr_t uuid) {
+  c->peer = c->origin;
   switch ((enum cluster_message_type_e)c->type) {
-  case CLUSTER_MESSAGE_JSON:
+  case CLUSTER_MESSAGE_BINARY:
   case CLUSTER_MESSAGE_FORWARD: {
     if (fio_hash_count(&facil_cluster_data.clients)) {
       fio_cstr_s cs = fiobj_obj2cstr(c->channel);
       fio_cstr_s ms = fiobj_obj2cstr(c->msg);
-      cluster_send2clients((uint32_t)cs.len, (uint32_t)ms.len, c->type,
-                           c->filter, cs.bytes, ms.bytes, uuid);
+      cluster_batch_write((uint32_t)cs.len, (uint32_t)ms.len, c->type,
+                          c->filter, c->origin, cs.bytes, ms.bytes);
     }
-    if (c->type == CLUSTER_MESSAGE_JSON) {
-      fio_cstr_s s = fiobj_obj2cstr(c->channel);
-      FIOBJ tmp = FIOBJ_INVALID;
-      if (fiobj_json2obj(&tmp, s.bytes, s.len)) {
-        fiobj_free(c->channel);
-        c->channel = tmp;
-        tmp = FIOBJ_INVALID;
-      } else {
-        fprintf(stderr,
-                "WARNING: (facil.io cluster) JSON message isn't valid JSON.\n");
-      }
-      s = fiobj_obj2cstr(c->msg);
-      if (fiobj_json2obj(&tmp, s.bytes, s.len)) {
-        fiobj_free(c->msg);
-        c->msg = tmp;
-      } else {
-        fprintf(stderr,
-                "WARNING: (facil.io cluster) JSON message isn't valid JSON.\n");
-      }
+    if (c->type == CLUSTER_MESSAGE_BINARY)
+      cluster_decode_msg(c);
+    cluster_forward_msg2handlers(c);
+    break;
+  }
+  case CLUSTER_MESSAGE_MIGRATE:
+    cluster_migrate_relay(c, uuid);
+    break;
+  case CLUSTER_MESSAGE_SHARED: {
+#if CLUSTER_SHARED
+    /* the file descriptor is passed along, the payload isn't copied */
+    int fd = cluster_shared_open(c);
+    if (fd == -1)
+      break;
+    if (c->type != CLUSTER_MESSAGE_FORWARD &&
+        c->type != CLUSTER_MESSAGE_BINARY) {
+      close(fd);
+      break;
     }
+    fio_cstr_s cs = fiobj_obj2cstr(c->channel);
+    fio_cstr_s ms = fiobj_obj2cstr(c->msg);
+    cluster_shared_send(fd, (uint32_t)cs.len, (uint32_t)ms.len, c->type,
+                        c->filter, c->origin, cs.bytes, ms.bytes);
+    close(fd);
+    if (c->type == CLUSTER_MESSAGE_BINARY)
+      cluster_decode_msg(c);
     cluster_forward_msg2handlers(c);
+#endif
     break;
   }
   case CLUSTER_MESSAGE_SHUTDOWN:
@@ -1122,6 +2573,11 @@ static void cluster_on_client_close(intptr_t uuid, protocol_s *pr_) {
       fprintf(stderr, "* (%d) Parent Process crash detected!\n", getpid());
     unlink(facil_cluster_data.cluster_name);
   }
+  spn_lock(&facil_cluster_data.lock);
+  if (facil_cluster_data.root_pr == c)
+    facil_cluster_data.root_pr = NULL;
+  spn_unlock(&facil_cluster_data.lock);
+  cluster_fds_clear(&c->fds);
   fiobj_free(c->msg);
   fiobj_free(c->channel);
   free(c);
@@ -1134,6 +2590,7 @@ static void cluster_on_server_close(intptr_t uuid, protocol_s *pr_) {
   cluster_pr_s *c = (cluster_pr_s *)pr_;
   if (facil_cluster_data.client_mode || facil_parent_pid() != getpid()) {
     /* we respawned - clean up resources, but don't stop server */
+    cluster_fds_clear(&c->fds);
     fiobj_free(c->msg);
     fiobj_free(c->channel);
     free(c);
@@ -1145,6 +2602,7 @@ static void cluster_on_server_close(intptr_t uuid, protocol_s *pr_) {
   fio_hash_insert(&facil_cluster_data.clients, (FIO_HASH_KEY_TYPE)uuid, NULL);
   // fio_hash_compact(&facil_cluster_data.clients);
   spn_unlock(&facil_cluster_data.lock);
+  cluster_fds_clear(&c->fds);
   fiobj_free(c->msg);
   fiobj_free(c->channel);
   free(c);
@@ -1167,12 +2625,13 @@ static void cluster_on_data(intptr_t uuid, protocol_s *pr_) {
   i = 0;
   do {
     if (!c->exp_channel && !c->exp_msg) {
-      if (c->length - i < 16)
+      if (c->length - i < CLUSTER_HEADER_LENGTH)
         break;
       c->exp_channel = cluster_str2uint32(c->buffer + i);
       c->exp_msg = cluster_str2uint32(c->buffer + i + 4);
       c->type = cluster_str2uint32(c->buffer + i + 8);
       c->filter = (int32_t)cluster_str2uint32(c->buffer + i + 12);
+      c->origin = cluster_str2uint32(c->buffer + i + 16);
       if (c->exp_channel) {
         if (c->exp_channel >= (1024 * 1024 * 16)) {
           fprintf(
@@ -1195,7 +2654,7 @@ static void cluster_on_data(intptr_t uuid, protocol_s *pr_) {
         }
         c->msg = fiobj_str_buf(c->exp_msg);
       }
-      i += 16;
+      i += CLUSTER_HEADER_LENGTH;
     }
     if (c->exp_channel) {
       if (c->exp_channel + i > c->length) {
@@ -1239,7 +2698,8 @@ static void cluster_on_data(intptr_t uuid, protocol_s *pr_) {
   (void)pr_;
 }
 static void cluster_ping(intptr_t uuid, protocol_s *pr_) {
-  FIOBJ ping = cluster_wrap_message(0, 0, CLUSTER_MESSAGE_PING, 0, NULL, NULL);
+  FIOBJ ping = cluster_wrap_message(0, 0, CLUSTER_MESSAGE_PING, 0,
+                                    (uint32_t)getpid(), NULL, NULL);
   fiobj_send_free(uuid, ping);
   (void)pr_;
 }
@@ -1257,6 +2717,7 @@ static void cluster_on_open(intptr_t fd, void *udata) {
                                                   : cluster_on_server_close),
               .ping = cluster_ping,
           },
+      .fds.lock = SPN_LOCK_INIT,
   };
   if (facil_cluster_data.root >= 0 && facil_cluster_data.root != fd) {
     // if (facil_parent_pid() != getpid()) {
@@ -1270,11 +2731,15 @@ static void cluster_on_open(intptr_t fd, void *udata) {
     // }
     spn_lock(&facil_cluster_data.lock);
     fio_hash_insert(&facil_cluster_data.clients, (FIO_HASH_KEY_TYPE)fd,
-                    (void *)fd);
+                    (void *)pr);
     spn_unlock(&facil_cluster_data.lock);
   } else if (facil_parent_pid() != getpid()) {
     // fprintf(stderr, "INFO: child process registering...%p \n", (void *)fd);
+    spn_lock(&facil_cluster_data.lock);
+    facil_cluster_data.root_pr = pr;
+    spn_unlock(&facil_cluster_data.lock);
   }
+  sock_rw_hook_set(fd, &CLUSTER_FDS_HOOKS, &pr->fds);
   if (facil_attach(fd, &pr->pr) == -1) {
     fprintf(stderr, "(%d) ", getpid());
     perror("ERROR: (facil.io cluster) couldn't attach connection");
@@ -1322,6 +2787,9 @@ static int cluster_on_start(void) {
     facil_cluster_data.client_mode = 1;
     fio_hash_free(&facil_cluster_data.clients);
     facil_cluster_data.clients = (fio_hash_s)FIO_HASH_INIT;
+    /* messages batched by the parent process belong to the parent */
+    fiobj_free(facil_cluster_data.batch);
+    facil_cluster_data.batch = FIOBJ_INVALID;
     if (facil_cluster_data.root != -1) {
       sock_force_close(facil_cluster_data.root);
     }
@@ -1391,22 +2859,29 @@ void facil_cluster_set_handler(int32_t filter,
   spn_unlock(&facil_cluster_data.lock);
 }
 
+/*
+ * Returns the message type for the channel and message, replacing them with
+ * new references (String objects are shared, structured data is serialized).
+ */
+static inline uint32_t cluster_prepare_msg(FIOBJ *ch, FIOBJ *msg) {
+  if ((!*ch || FIOBJ_TYPE_IS(*ch, FIOBJ_T_STRING)) &&
+      (!*msg || FIOBJ_TYPE_IS(*msg, FIOBJ_T_STRING))) {
+    fiobj_dup(*ch);
+    fiobj_dup(*msg);
+    return CLUSTER_MESSAGE_FORWARD;
+  }
+  /* structured data is serialized, skipping JSON formatting and parsing */
+  *ch = fiobj_obj2bin(*ch);
+  *msg = fiobj_obj2bin(*msg);
+  return CLUSTER_MESSAGE_BINARY;
+}
+
 int facil_cluster_send(int32_t filter, FIOBJ ch, FIOBJ msg) {
   if (!facil_data) {
     fprintf(stderr, "ERROR: cluster inactive, can't send message.\n");
     return -1;
   }
-  uint32_t type = CLUSTER_MESSAGE_FORWARD;
-
-  if ((!ch || FIOBJ_TYPE_IS(ch, FIOBJ_T_STRING)) &&
-      (!msg || FIOBJ_TYPE_IS(msg, FIOBJ_T_STRING))) {
-    fiobj_dup(ch);
-    fiobj_dup(msg);
-  } else {
-    type = CLUSTER_MESSAGE_JSON;
-    ch = fiobj_obj2json(ch, 0);
-    msg = fiobj_obj2json(msg, 0);
-  }
+  uint32_t type = cluster_prepare_msg(&ch, &msg);
   fio_cstr_s cs = fiobj_obj2cstr(ch);
   fio_cstr_s ms = fiobj_obj2cstr(msg);
   cluster_send2traget((uint32_t)cs.len, (uint32_t)ms.len, type, filter,
@@ -1416,25 +2891,87 @@ int facil_cluster_send(int32_t filter, FIOBJ ch, FIOBJ msg) {
   return 0;
 }
 
+int facil_cluster_send_batch(int32_t filter, FIOBJ *ch, FIOBJ *msg,
+                             size_t count) {
+  if (!facil_data) {
+    fprintf(stderr, "ERROR: cluster inactive, can't send message.\n");
+    return -1;
+  }
+  if (!facil_cluster_data.client_mode &&
+      facil_cluster_data.clients.count == 0)
+    return 0;
+  const uint32_t origin = (uint32_t)getpid();
+  uint8_t schedule = 0;
+  spn_lock(&facil_cluster_data.batch_lock);
+  for (size_t i = 0; i < count; ++i) {
+    FIOBJ c = ch[i];
+    FIOBJ m = msg ? msg[i] : FIOBJ_INVALID;
+    uint32_t type = cluster_prepare_msg(&c, &m);
+    fio_cstr_s cs = fiobj_obj2cstr(c);
+    fio_cstr_s ms = fiobj_obj2cstr(m);
+#if CLUSTER_SHARED
+    if (ms.len >= FACIL_CLUSTER_SHARED_LIMIT) {
+      spn_unlock(&facil_cluster_data.batch_lock);
+      int err = cluster_shared_write((uint32_t)cs.len, (uint32_t)ms.len, type,
+                                     filter, cs.bytes, ms.bytes);
+      spn_lock(&facil_cluster_data.batch_lock);
+      if (!err) {
+        fiobj_free(c);
+        fiobj_free(m);
+        continue;
+      }
+    }
+#endif
+    FIOBJ full =
+        cluster_batch_append((uint32_t)cs.len, (uint32_t)ms.len, type, filter,
+                             origin, cs.bytes, ms.bytes, &schedule);
+    fiobj_free(c);
+    fiobj_free(m);
+    if (full) {
+      spn_unlock(&facil_cluster_data.batch_lock);
+      cluster_send_fiobj(full);
+      spn_lock(&facil_cluster_data.batch_lock);
+    }
+  }
+  spn_unlock(&facil_cluster_data.batch_lock);
+  if (schedule)
+    defer(cluster_batch_flush, NULL, NULL);
+  return 0;
+}
+
 static void facil_cluster_cleanup(void) {
+#if CLUSTER_SHARED
+  cluster_shared_cleanup();
+#endif
   fio_hash_free(&facil_cluster_data.handlers);
   fio_hash_free(&facil_cluster_data.clients);
+  fiobj_free(facil_cluster_data.batch);
+  facil_cluster_data.batch = FIOBJ_INVALID;
 }
 /* *****************************************************************************
 Running the server
 ***************************************************************************** */
 
 volatile uint8_t facil_signal_children_flag = 0;
+volatile uint8_t facil_reload_flag = 0;
 
 static inline void facil_internal_poll(void) {
   if (facil_signal_children_flag) {
     facil_signal_children_flag = 0;
     facil_cluster_signal_children();
   }
+#if !FACIL_DISABLE_GRACEFUL_RELOAD
+  if (facil_reload_flag) {
+    facil_reload_flag = 0;
+    if (facil_data->parent == getpid())
+      defer(facil_reload_task, NULL, NULL);
+  }
+#endif
 }
 
 static inline void facil_internal_poll_reset(void) {
   facil_signal_children_flag = 0;
+  facil_reload_flag = 0;
 }
 
 static void print_pid(void *arg, void *ignr) {
@@ -1443,38 +2980,57 @@ static void print_pid(void *arg, void *ignr) {
   fprintf(stderr, "* %d is running.\n", getpid());
 }
 
+#if FACIL_MEM_TRIM_INTERVAL && !FIO_FORCE_MALLOC
+/* returns idle memory to the system (see FACIL_MEM_TRIM_INTERVAL). */
+static void facil_mem_trim_task(void *arg) {
+  fio_mem_trim();
+  (void)arg;
+}
+#endif
+
+/*
+ * reviews the timeout wheel's slots up to the current second, so only the
+ * connections due for review are visited.
+ */
 static void facil_review_timeout(void *arg, void *ignr) {
+  (void)arg;
   (void)ignr;
   protocol_s *tmp;
   time_t review = facil_data->last_cycle.tv_sec;
-  intptr_t fd = (intptr_t)arg;
-
-  uint16_t timeout = fd_data(fd).timeout;
-  if (!timeout)
-    timeout = 300; /* enforced timout settings */
-
-  if (!fd_data(fd).protocol || (fd_data(fd).active + timeout >= review))
-    goto finish;
-  tmp = protocol_try_lock(fd, FIO_PR_LOCK_STATE);
-  if (!tmp)
-    goto reschedule;
-  if (prt_meta(tmp).locks[FIO_PR_LOCK_TASK] ||
-      prt_meta(tmp).locks[FIO_PR_LOCK_WRITE])
-    goto unlock;
-  defer(deferred_ping, (void *)sock_fd2uuid((int)fd), NULL);
-unlock:
-  protocol_unlock(tmp, FIO_PR_LOCK_STATE);
-finish:
-  do {
-    fd++;
-  } while (!fd_data(fd).protocol && (fd < facil_data->capacity));
 
-  if (facil_data->capacity <= fd) {
-    facil_data->need_review = 1;
-    return;
+  spn_lock(&facil_data->wheel_lock);
+  if (!facil_data->wheel_tick ||
+      review - facil_data->wheel_tick > TIMEOUT_WHEEL_SIZE)
+    facil_data->wheel_tick = review - TIMEOUT_WHEEL_SIZE;
+  while (facil_data->wheel_tick < review) {
+    ++facil_data->wheel_tick;
+    size_t slot = facil_data->wheel_tick & (TIMEOUT_WHEEL_SIZE - 1);
+    intptr_t fd = facil_data->wheel[slot];
+    facil_data->wheel[slot] = -1;
+    while (fd >= 0) {
+      intptr_t next = fd_timing(fd).next;
+      fd_timing(fd).slot = 0;
+      time_t deadline = timeout_deadline(fd);
+      if (deadline > review) {
+        /* the connection was active since it was placed in the wheel */
+        timeout_wheel_link(fd, deadline);
+      } else {
+        tmp = protocol_try_lock(fd, FIO_PR_LOCK_STATE);
+        if (tmp) {
+          if (!prt_meta(tmp).locks[FIO_PR_LOCK_TASK] &&
+              !prt_meta(tmp).locks[FIO_PR_LOCK_WRITE])
+            defer(deferred_ping, (void *)sock_fd2uuid((int)fd), NULL);
+          protocol_unlock(tmp, FIO_PR_LOCK_STATE);
+        }
+        /* review again (until the connection is active or closed) */
+        if (tmp || errno != EBADF)
+          timeout_wheel_link(fd, review + 1);
+      }
+      fd = next;
+    }
   }
-reschedule:
-  defer(facil_review_timeout, (void *)fd, NULL);
+  spn_unlock(&facil_data->wheel_lock);
+  facil_data->need_review = 1;
 }
 
 static void perform_idle(void *arg, void *ignr) {
@@ -1536,7 +3092,10 @@ static void facil_cycle_unwind(void *ignr, void *ignr2) {
 static void facil_cycle(void *ignr, void *ignr2) {
   facil_cycle_schedule_events();
   if (facil_data->active) {
-    defer(facil_cycle, ignr, ignr2);
+    if (facil_data->pin_connections)
+      defer_pinned(0, facil_cycle, ignr, ignr2);
+    else
+      defer_priority(DEFER_PRIORITY_IO, facil_cycle, ignr, ignr2);
     return;
   }
   /* switch to winding down */
@@ -1555,6 +3114,137 @@ static void facil_cycle(void *ignr, void *ignr2) {
   (void)ignr2;
 }
 
+/* *****************************************************************************
+CPU affinity (see `facil_run_args.affinity` and `facil_run_args.numa`)
+***************************************************************************** */
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+
+/* the highest NUMA node number reviewed */
+#define FACIL_NUMA_NODES_LIMIT 64
+/* the `set_mempolicy` mode (`numaif.h` might not be available) */
+#define FACIL_MPOL_PREFERRED 1
+
+static struct {
+  /* the CPUs available to the root process */
+  cpu_set_t allowed;
+  /* the CPUs of each NUMA node (limited to `allowed`) */
+  cpu_set_t node[FACIL_NUMA_NODES_LIMIT];
+  int node_id[FACIL_NUMA_NODES_LIMIT];
+  size_t nodes;
+  /* the worker's CPU cores and the first core used by the worker's threads */
+  int cores[CPU_SETSIZE];
+  size_t core_count;
+  size_t first;
+  uint8_t pin_threads;
+} facil_affinity;
+
+/* reads a sysfs CPU list (i.e., "0-3,8-11"). Returns -1 on error. */
+static int facil_affinity_read_cpulist(const char *path, cpu_set_t *set) {
+  char buf[1024];
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return -1;
+  buf[len] = 0;
+  CPU_ZERO(set);
+  char *pos = buf;
+  while (*pos >= '0' && *pos <= '9') {
+    long first = strtol(pos, &pos, 10);
+    long last = first;
+    if (*pos == '-')
+      last = strtol(pos + 1, &pos, 10);
+    for (long i = first; i <= last && i < CPU_SETSIZE; ++i)
+      CPU_SET(i, set);
+    if (*pos == ',')
+      ++pos;
+  }
+  return 0;
+}
+
+/* called by the root process, before any workers are spawned. */
+static void facil_affinity_init(uint8_t affinity, uint8_t numa) {
+  facil_affinity.nodes = facil_affinity.core_count = 0;
+  facil_affinity.pin_threads = 0;
+  if (!affinity && !numa)
+    return;
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &facil_affinity.allowed)) {
+    perror("WARNING: (facil) couldn't read the CPU affinity");
+    return;
+  }
+  facil_affinity.pin_threads = affinity;
+  for (int i = 0; numa && i < FACIL_NUMA_NODES_LIMIT; ++i) {
+    char path[64];
+    cpu_set_t *set = facil_affinity.node + facil_affinity.nodes;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             i);
+    if (facil_affinity_read_cpulist(path, set))
+      continue;
+    CPU_AND(set, set, &facil_affinity.allowed);
+    if (!CPU_COUNT(set))
+      continue;
+    facil_affinity.node_id[facil_affinity.nodes++] = i;
+  }
+  if (facil_affinity.nodes == 1)
+    facil_affinity.nodes = 0;
+  if (FACIL_PRINT_STATE && facil_affinity.nodes)
+    fprintf(stderr, "* Spreading workers across %zu NUMA nodes.\n",
+            facil_affinity.nodes);
+}
+
+/* called by each worker process (`index` is the worker's number). */
+static void facil_affinity_worker(size_t index) {
+  cpu_set_t set = facil_affinity.allowed;
+  if (facil_affinity.nodes) {
+    const size_t n = index % facil_affinity.nodes;
+    const int id = facil_affinity.node_id[n];
+    unsigned long mask[FACIL_NUMA_NODES_LIMIT / (8 * sizeof(long))] = {0};
+    mask[id / (8 * sizeof(long))] = 1UL << (id % (8 * sizeof(long)));
+    set = facil_affinity.node[n];
+    index /= facil_affinity.nodes;
+    /* the calling thread's mask is inherited by the worker's threads */
+    if (sched_setaffinity(0, sizeof(set), &set))
+      perror("WARNING: (facil) couldn't bind the worker to a NUMA node");
+    /* memory is allocated when first touched, so new arenas stay local */
+    if (syscall(SYS_set_mempolicy, FACIL_MPOL_PREFERRED, mask,
+                sizeof(mask) * 8 + 1))
+      perror("WARNING: (facil) couldn't set the worker's NUMA memory policy");
+  }
+  if (!facil_affinity.pin_threads)
+    return;
+  facil_affinity.core_count = 0;
+  for (int i = 0; i < CPU_SETSIZE; ++i) {
+    if (CPU_ISSET(i, &set))
+      facil_affinity.cores[facil_affinity.core_count++] = i;
+  }
+  facil_affinity.first = index * facil_data->threads;
+}
+
+/* binds each of the worker's threads to a single CPU core. */
+void defer_thread_on_start(size_t index) {
+  if (!facil_affinity.core_count)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(facil_affinity.cores[(facil_affinity.first + index) %
+                               facil_affinity.core_count],
+          &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    perror("WARNING: (facil) couldn't bind a thread to a CPU core");
+}
+
+#else
+static void facil_affinity_init(uint8_t affinity, uint8_t numa) {
+  if (affinity || numa)
+    fprintf(stderr, "WARNING: (facil) CPU affinity requires Linux, ignored.\n");
+}
+#define facil_affinity_worker(index) ((void)(index))
+#endif
+
 /**
 OVERRIDE THIS to replace the default `fork` implementation or to inject hooks
 into the forking function.
@@ -1562,7 +3252,10 @@ into the forking function.
 Behaves like the system's `fork`.
 */
 #pragma weak facil_fork
-int facil_fork(void) { return (int)fork(); }
+int facil_fork(void) {
+  fio_malloc_before_fork();
+  return (int)fork();
+}
 
 /** This will be called by child processes, make sure to unlock any existing
  * locks.
@@ -1575,11 +3268,14 @@ int facil_fork(void) { return (int)fork(); }
  * * `facil` pub/sub lock.
  * * `facil` connection data lock (per connection data).
  * * `facil` protocol lock (per protocol object, placed in `rsv`).
+ * * `facil` timer scheduler lock.
  * * `pubsub` pubsub global lock (should be initialized in facil_external_init.
  * * `pubsub` pubsub client lock (should be initialized in facil_external_init.
  */
 static void facil_worker_startup(uint8_t sentinel) {
   facil_cluster_data.lock = facil_data->global_lock = SPN_LOCK_INIT;
+  facil_cluster_data.batch_lock = SPN_LOCK_INIT;
+  facil_timers.lock = SPN_LOCK_INIT;
   facil_internal_poll_reset();
   evio_create();
   clock_gettime(CLOCK_REALTIME, &facil_data->last_cycle);
@@ -1594,7 +3290,7 @@ static void facil_worker_startup(uint8_t sentinel) {
         if (fd_data(i).protocol->service == LISTENER_PROTOCOL_NAME)
           listener_on_start(i);
         else if (fd_data(i).protocol->service == TIMER_PROTOCOL_NAME)
-          timer_on_server_start(i);
+          sock_force_close(sock_fd2uuid(i)); /* replaced after the loop */
         else {
           evio_add(i, (void *)sock_fd2uuid(i));
         }
@@ -1609,8 +3305,6 @@ static void facil_worker_startup(uint8_t sentinel) {
         fd_data(i).protocol->rsv = 0;
         if (fd_data(i).protocol->service == LISTENER_PROTOCOL_NAME)
           listener_on_start(i);
-        else if (fd_data(i).protocol->service == TIMER_PROTOCOL_NAME)
-          timer_on_server_start(i);
         else {
           /* prevent normal connections from being shared across workers */
           intptr_t uuid = sock_fd2uuid(i);
@@ -1629,7 +3323,7 @@ static void facil_worker_startup(uint8_t sentinel) {
       if (fd_data(i).protocol) {
         fd_data(i).protocol->rsv = 0;
         if (fd_data(i).protocol->service == TIMER_PROTOCOL_NAME)
-          timer_on_server_start(i);
+          sock_force_close(sock_fd2uuid(i)); /* replaced after the loop */
         else if (fd_data(i).protocol->service != LISTENER_PROTOCOL_NAME) {
           evio_add(i, (void *)sock_fd2uuid(i));
         }
@@ -1645,6 +3339,8 @@ static void facil_worker_startup(uint8_t sentinel) {
     facil_data->active = old_active;
     facil_data->spindown = 0;
   }
+  /* each process runs the timers it inherited, using its own timer fd */
+  timer_scheduler_start();
   /* called after connection cleanup, as it should open connections. */
   if (cluster_on_start()) {
     facil_data->thread_pool = NULL;
@@ -1652,9 +3348,22 @@ static void facil_worker_startup(uint8_t sentinel) {
   }
   /* call any external startup callbacks. */
   facil_external_init2();
+#if FACIL_MEM_TRIM_INTERVAL && !FIO_FORCE_MALLOC
+  /* workers only, so respawned workers don't inherit the sentinel's timer */
+  if (!sentinel)
+    facil_run_every(FACIL_MEM_TRIM_INTERVAL, 0, facil_mem_trim_task, NULL,
+                    NULL);
+#endif
+  /* workers share their statistics, so each process can report the total */
+  if (facil_data->active > 1)
+    fio_stats_on_start();
   /* add cycling to the defer queue to setup the reactor pattern. */
   facil_data->need_review = 1;
-  defer(facil_cycle, NULL, NULL);
+  defer_priority(DEFER_PRIORITY_IO, facil_cycle, NULL, NULL);
+#if !FACIL_DISABLE_GRACEFUL_RELOAD
+  /* the previous generation (if any) can stop once the root is running */
+  facil_reload_ready(facil_data->parent == getpid());
+#endif
 
   if (FACIL_PRINT_STATE) {
     if (sentinel || facil_data->parent == getpid()) {
@@ -1666,19 +3375,37 @@ static void facil_worker_startup(uint8_t sentinel) {
               facil_data->threads,
               facil_data->threads > 1 ? "threads" : "thread",
               facil_data->capacity, facil_data->parent);
+      if (facil_data->threads_max > facil_data->threads)
+        fprintf(stderr, "* Adaptive thread pool: up to %u threads.\n",
+                facil_data->threads_max);
     } else {
       defer(print_pid, NULL, NULL);
     }
   }
-  facil_data->thread_pool =
-      defer_pool_start((sentinel ? 1 : facil_data->threads));
-  if (facil_data->thread_pool)
-    defer_pool_wait(facil_data->thread_pool);
+  /* the pool might be stopped (and `thread_pool` reset) by a worker thread */
+  pool_pt pool = facil_data->thread_pool =
+      (sentinel ? defer_pool_start(1)
+                : defer_pool_start_adaptive(facil_data->threads,
+                                            facil_data->threads_max));
+  if (pool)
+    defer_pool_wait(pool);
 }
 
 static void facil_worker_cleanup(void) {
   facil_data->active = 0;
   facil_cluster_signal_children();
+  /* stop accepting, but handle data that was already received (so connections
+   * accepted right before shutting down, i.e., during a reload, are served).
+   * The listeners are closed with the leftovers, since closing a listener
+   * (`on_finish`) might release settings that its connections still use. */
+  for (int i = 0; i <= facil_data->capacity; ++i) {
+    if (fd_data(i).protocol &&
+        fd_data(i).protocol->service == LISTENER_PROTOCOL_NAME) {
+      evio_remove(i);
+    }
+  }
+  facil_cycle_schedule_events();
+  defer_perform();
   for (int i = 0; i <= facil_data->capacity; ++i) {
     intptr_t uuid;
     if (is_counted_protocol(fd_data(i).protocol) &&
@@ -1686,10 +3413,11 @@ static void facil_worker_cleanup(void) {
       defer(deferred_on_shutdown, (void *)uuid, NULL);
     }
   }
-  facil_data->thread_pool = defer_pool_start(facil_data->threads);
-  if (facil_data->thread_pool) {
+  pool_pt pool = facil_data->thread_pool =
+      defer_pool_start(facil_data->threads);
+  if (pool) {
     defer(facil_cycle_unwind, NULL, NULL);
-    defer_pool_wait(facil_data->thread_pool);
+    defer_pool_wait(pool);
     facil_data->thread_pool = NULL;
   }
   fprintf(stderr, "* %d cleanning up.\n", getpid());
@@ -1701,6 +3429,7 @@ static void facil_worker_cleanup(void) {
     }
   }
   defer_perform();
+  timer_scheduler_clear();
   if (facil_data->on_finish) {
     facil_data->on_finish();
   }
@@ -1718,12 +3447,20 @@ static void facil_worker_cleanup(void) {
   }
 }
 
+/* the sentinel thread's argument (`index` is the worker's number) */
+typedef struct {
+  spn_lock_i lock;
+  size_t index;
+} facil_sentinel_args_s;
+
 static void facil_sentinel_task(void *arg1, void *arg2);
 static void *facil_sentinel_worker_thread(void *arg) {
+  facil_sentinel_args_s *args = arg;
+  const size_t index = args->index;
   errno = 0;
   pid_t child = facil_fork();
-  if (arg && child) {
-    spn_unlock((spn_lock_i *)arg);
+  if (child) {
+    spn_unlock(&args->lock);
   }
   if (child == -1) {
     perror("FATAL ERROR: couldn't spawn worker.");
@@ -1760,10 +3497,11 @@ static void *facil_sentinel_worker_thread(void *arg) {
                 "INFO: Child worker (%d) shutdown. Respawning worker.\n",
                 child);
       }
-      defer(facil_sentinel_task, NULL, NULL);
+      defer(facil_sentinel_task, (void *)index, NULL);
     }
 #endif
   } else {
+    facil_affinity_worker(index);
     facil_worker_startup(0);
     facil_worker_cleanup();
     exit(0);
@@ -1775,16 +3513,16 @@ static void *facil_sentinel_worker_thread(void *arg) {
 static void facil_sentinel_task(void *arg1, void *arg2) {
   if (!facil_data->active)
     return;
-  spn_lock_i pre_fork_lock = SPN_LOCK_INIT;
-  spn_lock(&pre_fork_lock);
+  facil_sentinel_args_s args = {.lock = SPN_LOCK_INIT, .index = (size_t)arg1};
+  spn_lock(&args.lock);
   pthread_t sentinel;
   if (pthread_create(&sentinel, NULL, facil_sentinel_worker_thread,
-                     (void *)&pre_fork_lock)) {
+                     (void *)&args)) {
     perror("FATAL ERROR: couldn't start sentinel thread");
     exit(errno);
   }
   pthread_detach(sentinel);
-  spn_lock(&pre_fork_lock); /* will wait for worker thread to release lock. */
+  spn_lock(&args.lock); /* will wait for worker thread to release lock. */
   facil_cluster_data.listening.on_data(facil_cluster_data.root,
                                        &facil_cluster_data.listening);
   (void)arg1;
@@ -1794,12 +3532,11 @@ static void facil_sentinel_task(void *arg1, void *arg2) {
 static void facil_sentinel_task(void *arg1, void *arg2) {
   if (!facil_data->active)
     return;
-  spn_lock_i pre_fork_lock = SPN_LOCK_INIT;
-  spn_lock(&pre_fork_lock);
-  void *thrd =
-      defer_new_thread(facil_sentinel_worker_thread, (void *)&pre_fork_lock);
+  facil_sentinel_args_s args = {.lock = SPN_LOCK_INIT, .index = (size_t)arg1};
+  spn_lock(&args.lock);
+  void *thrd = defer_new_thread(facil_sentinel_worker_thread, (void *)&args);
   defer_free_thread(thrd);
-  spn_lock(&pre_fork_lock); /* will wait for worker thread to release lock. */
+  spn_lock(&args.lock); /* will wait for worker thread to release lock. */
   facil_cluster_data.listening.on_data(facil_cluster_data.root,
                                        &facil_cluster_data.listening);
   (void)arg1;
@@ -1807,13 +3544,18 @@ static void facil_sentinel_task(void *arg1, void *arg2) {
 }
 #endif
 
-/* handles the SIGUSR1, SIGINT and SIGTERM signals. */
+/* handles the SIGUSR1, SIGUSR2, SIGINT and SIGTERM signals. */
 static void sig_int_handler(int sig) {
   switch (sig) {
 #if !FACIL_DISABLE_HOT_RESTART
   case SIGUSR1:
     facil_signal_children_flag = 1;
     break;
+#endif
+#if !FACIL_DISABLE_GRACEFUL_RELOAD
+  case SIGUSR2:
+    facil_reload_flag = 1;
+    break;
 #endif
   case SIGINT:  /* fallthrough */
   case SIGTERM: /* fallthrough */
@@ -1824,7 +3566,8 @@ static void sig_int_handler(int sig) {
   }
 }
 
-/* setup handling for the SIGUSR1, SIGPIPE, SIGINT and SIGTERM signals. */
+/* setup handling for the SIGUSR1, SIGUSR2, SIGPIPE, SIGINT and SIGTERM
+ * signals. */
 static void facil_setup_signal_handler(void) {
   /* setup signal handling */
   struct sigaction act, old;
@@ -1848,6 +3591,12 @@ static void facil_setup_signal_handler(void) {
     return;
   };
 #endif
+#if !FACIL_DISABLE_GRACEFUL_RELOAD
+  if (sigaction(SIGUSR2, &act, &old)) {
+    perror("couldn't set signal handler");
+    return;
+  };
+#endif
 
   act.sa_handler = SIG_IGN;
   if (sigaction(SIGPIPE, &act, &old)) {
@@ -1987,6 +3736,16 @@ void facil_run(struct facil_run_args args) {
   facil_data->threads = (uint16_t)args.threads;
   facil_data->on_finish = args.on_finish;
   facil_data->on_idle = args.on_idle;
+  facil_data->pin_connections = args.pin_connections;
+  facil_data->threads_max = facil_data->threads;
+  if (args.threads_max > args.threads && !args.pin_connections)
+    facil_data->threads_max = (uint16_t)args.threads_max;
+  facil_affinity_init(args.affinity, args.numa);
+#if !FACIL_DISABLE_GRACEFUL_RELOAD
+  /* inherited sockets that weren't adopted aren't shared with the workers */
+  facil_reload_release();
+  facil_reload_store_command();
+#endif
   /* initialize cluster */
   if (args.processes > 1) {
     if (facil_cluster_init()) {
@@ -1998,10 +3757,11 @@ void facil_run(struct facil_run_args args) {
       exit(-1);
     }
     for (int i = 0; i < args.processes && facil_data->active; ++i) {
-      facil_sentinel_task(NULL, NULL);
+      facil_sentinel_task((void *)(uintptr_t)i, NULL);
     }
     facil_worker_startup(1);
   } else {
+    facil_affinity_worker(0);
     facil_worker_startup(0);
   }
   facil_worker_cleanup();
@@ -2043,7 +3803,8 @@ static int facil_attach_state(intptr_t uuid, protocol_s *protocol,
   if (!sock_isvalid(uuid)) {
     spn_unlock(&uuid_data(uuid).lock);
     if (protocol)
-      defer(deferred_on_close, (void *)uuid, protocol);
+      defer_priority(DEFER_PRIORITY_URGENT, deferred_on_close, (void *)uuid,
+                     protocol);
     if (uuid == -1)
       errno = EBADF;
     else
@@ -2056,13 +3817,18 @@ static int facil_attach_state(intptr_t uuid, protocol_s *protocol,
   }
   protocol_s *old_protocol = uuid_data(uuid).protocol;
   uuid_data(uuid).protocol = protocol;
-  uuid_data(uuid).active = facil_data->last_cycle.tv_sec;
+  uuid_timing(uuid).active = facil_data->last_cycle.tv_sec;
   spn_unlock(&uuid_data(uuid).lock);
+  if (protocol)
+    timeout_wheel_update(sock_uuid2fd(uuid));
+  else
+    timeout_wheel_remove(sock_uuid2fd(uuid));
   if (old_protocol) {
     if (is_counted_protocol(old_protocol)) {
       spn_sub(&facil_data->connection_count, 1);
     }
-    defer(deferred_on_close, (void *)uuid, old_protocol);
+    defer_priority(DEFER_PRIORITY_URGENT, deferred_on_close, (void *)uuid,
+                   old_protocol);
   } else if (evio_isactive() && protocol) {
     return evio_add(sock_uuid2fd(uuid), (void *)uuid);
   }
@@ -2090,13 +3856,15 @@ int facil_attach_locked(intptr_t uuid, protocol_s *protocol) {
 /** Sets a timeout for a specific connection (if active). */
 void facil_set_timeout(intptr_t uuid, uint8_t timeout) {
   if (sock_isvalid(uuid)) {
-    uuid_data(uuid).active = facil_data->last_cycle.tv_sec;
-    uuid_data(uuid).timeout = timeout;
+    uuid_timing(uuid).active = facil_data->last_cycle.tv_sec;
+    uuid_timing(uuid).timeout = timeout;
+    if (uuid_data(uuid).protocol)
+      timeout_wheel_update(sock_uuid2fd(uuid));
   }
 }
 /** Gets a timeout for a specific connection. Returns 0 if there's no set
  * timeout or the connection is inactive. */
-uint8_t facil_get_timeout(intptr_t uuid) { return uuid_data(uuid).timeout; }
+uint8_t facil_get_timeout(intptr_t uuid) { return uuid_timing(uuid).timeout; }
 
 /* *****************************************************************************
 Misc helpers
@@ -2136,11 +3904,14 @@ size_t facil_count(void *service) {
   size_t count = 0;
   for (intptr_t i = 0; i < facil_data->capacity; i++) {
     void *tmp = NULL;
+    uint8_t counted;
     spn_lock(&fd_data(i).lock);
-    if (fd_data(i).protocol && fd_data(i).protocol->service)
+    /* empty slots and internal connections aren't counted */
+    counted = is_counted_protocol(fd_data(i).protocol);
+    if (counted)
       tmp = (void *)fd_data(i).protocol->service;
     spn_unlock(&fd_data(i).lock);
-    if (tmp != LISTENER_PROTOCOL_NAME && tmp != TIMER_PROTOCOL_NAME &&
+    if (counted && tmp != LISTENER_PROTOCOL_NAME &&
         (!service || (tmp == service)))
       count++;
   }
@@ -2323,3 +4094,356 @@ error:
         args.arg);
   return -1;
 }
+
+/* *****************************************************************************
+Testing
+***************************************************************************** */
+
+#ifdef DEBUG
+#include <dirent.h>
+#include <poll.h>
+
+#define TEST_ASSERT(cond, ...)                                                 \
+  if (!(cond)) {                                                               \
+    fprintf(stderr, "* " __VA_ARGS__);                                         \
+    fprintf(stderr, "Testing failed.\n");                                      \
+    exit(-1);                                                                  \
+  }
+
+/* the number of datagrams sent by `facil_datagram_test` (more than a batch) */
+#define DATAGRAM_TEST_COUNT (FACIL_DATAGRAM_BATCH + 8)
+
+/* opens a UDP socket bound to a loopback address (the port is set by the OS) */
+static intptr_t facil_datagram_test_socket(struct sockaddr_in *addr) {
+  socklen_t len = sizeof(*addr);
+  *addr = (struct sockaddr_in){.sin_family = AF_INET,
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  TEST_ASSERT(fd != -1 && !sock_set_non_block(fd) &&
+                  !bind(fd, (struct sockaddr *)addr, len) &&
+                  !getsockname(fd, (struct sockaddr *)addr, &len),
+              "datagrams: couldn't open a UDP socket\n");
+  intptr_t uuid = sock_open(fd);
+  TEST_ASSERT(uuid != -1, "datagrams: sock_open failed\n");
+  facil_attach(uuid, NULL); /* the connection's state is reset on close */
+  return uuid;
+}
+
+/* sends the test datagrams, datagram `i` starts with the byte `i` */
+static void facil_datagram_test_send(intptr_t uuid, struct sockaddr_in *to,
+                                     uint8_t *data, size_t *lengths) {
+  sock_datagram_s out[DATAGRAM_TEST_COUNT];
+  for (size_t i = 0; i < DATAGRAM_TEST_COUNT; ++i) {
+    out[i] = (sock_datagram_s){
+        .data = data + i, .len = lengths[i], .addrlen = sizeof(*to)};
+    memcpy(&out[i].addr, to, sizeof(*to));
+  }
+  TEST_ASSERT(sock_send_datagrams(uuid, out, DATAGRAM_TEST_COUNT) ==
+                  DATAGRAM_TEST_COUNT,
+              "datagrams: not all the datagrams were sent\n");
+}
+
+/* waits for datagrams (returns 0 on timeout) */
+static int facil_datagram_test_wait(intptr_t uuid) {
+  struct pollfd p = {.fd = sock_uuid2fd(uuid), .events = POLLIN};
+  return poll(&p, 1, 2000) == 1;
+}
+
+/* records the lengths of the datagrams passed to the listener's handler */
+static void facil_datagram_test_on_datagram(intptr_t uuid,
+                                            sock_datagram_s *datagrams,
+                                            size_t count, void *udata) {
+  size_t *received = udata;
+  /* datagram `i` starts with the byte `i`, one (truncated) datagram is missing */
+  for (size_t i = 0; i < count; ++i) {
+    TEST_ASSERT(*(uint8_t *)datagrams[i].data == received[0] + 1 ||
+                    *(uint8_t *)datagrams[i].data == received[0],
+                "datagrams: handler received the wrong data\n");
+    received[++received[0]] = datagrams[i].len;
+  }
+  (void)uuid;
+}
+
+void facil_datagram_test(void) {
+  fprintf(stderr, "=== Testing datagrams\n");
+  struct sockaddr_in server_addr, client_addr;
+  intptr_t server = facil_datagram_test_socket(&server_addr);
+  intptr_t client = facil_datagram_test_socket(&client_addr);
+  uint8_t *data = malloc(FACIL_DATAGRAM_SIZE + DATAGRAM_TEST_COUNT + 1);
+  uint8_t *buffer = malloc(FACIL_DATAGRAM_SIZE * DATAGRAM_TEST_COUNT);
+  TEST_ASSERT(data && buffer, "datagrams: allocation failed\n");
+  for (size_t i = 0; i < FACIL_DATAGRAM_SIZE + DATAGRAM_TEST_COUNT + 1; ++i)
+    data[i] = (uint8_t)i;
+  /* one datagram is too long, another fills the whole buffer */
+  const size_t longer = 5;
+  size_t lengths[DATAGRAM_TEST_COUNT];
+  for (size_t i = 0; i < DATAGRAM_TEST_COUNT; ++i)
+    lengths[i] = i + 1;
+  lengths[longer] = FACIL_DATAGRAM_SIZE + 1;
+  lengths[DATAGRAM_TEST_COUNT - 1] = FACIL_DATAGRAM_SIZE;
+
+  /* batched receiving reports the truncated datagram */
+  facil_datagram_test_send(client, &server_addr, data, lengths);
+  sock_datagram_s in[DATAGRAM_TEST_COUNT];
+  for (size_t i = 0; i < DATAGRAM_TEST_COUNT; ++i)
+    in[i] = (sock_datagram_s){.data = buffer + (i * FACIL_DATAGRAM_SIZE),
+                              .len = FACIL_DATAGRAM_SIZE};
+  size_t received = 0;
+  while (received < DATAGRAM_TEST_COUNT) {
+    ssize_t r = sock_recv_datagrams(server, in + received,
+                                    DATAGRAM_TEST_COUNT - received);
+    TEST_ASSERT(r >= 0, "datagrams: receive error\n");
+    TEST_ASSERT(r || facil_datagram_test_wait(server),
+                "datagrams: only %zu datagrams received\n", received);
+    received += r;
+  }
+  for (size_t i = 0; i < DATAGRAM_TEST_COUNT; ++i) {
+    const size_t expected =
+        (lengths[i] > FACIL_DATAGRAM_SIZE ? FACIL_DATAGRAM_SIZE : lengths[i]);
+    TEST_ASSERT(in[i].len == expected && in[i].truncated == (i == longer),
+                "datagrams: datagram %zu length error (%zu, truncated: %d)\n",
+                i, in[i].len, (int)in[i].truncated);
+    TEST_ASSERT(((uint8_t *)in[i].data)[0] == (uint8_t)i &&
+                    ((uint8_t *)in[i].data)[expected - 1] ==
+                        (uint8_t)(i + expected - 1),
+                "datagrams: datagram %zu data error\n", i);
+    TEST_ASSERT(in[i].addrlen == sizeof(client_addr) &&
+                    ((struct sockaddr_in *)&in[i].addr)->sin_port ==
+                        client_addr.sin_port,
+                "datagrams: datagram %zu peer address error\n", i);
+  }
+
+  /* the listener discards (and counts) the truncated datagram */
+#if FIO_STATS
+  fio_stats_s *stats = malloc(sizeof(*stats));
+  TEST_ASSERT(stats, "datagrams: allocation failed\n");
+  fio_stats_collect(stats);
+  const uint64_t truncated = stats->counters[FIO_STATS_TRUNCATED];
+#endif
+  facil_datagram_test_send(client, &server_addr, data, lengths);
+  size_t handled[DATAGRAM_TEST_COUNT + 1] = {0};
+  struct ListenerProtocol listener = {
+      .on_datagram = facil_datagram_test_on_datagram, .udata = handled};
+  while (handled[0] < DATAGRAM_TEST_COUNT - 1) {
+    TEST_ASSERT(facil_datagram_test_wait(server),
+                "datagrams: the listener handled %zu datagrams\n",
+                handled[0]);
+    listener_on_datagrams(server, &listener.protocol);
+  }
+  for (size_t i = 0, j = 1; i < DATAGRAM_TEST_COUNT; ++i) {
+    if (i == longer)
+      continue;
+    TEST_ASSERT(handled[j++] == lengths[i],
+                "datagrams: the listener's datagram %zu length error\n", i);
+  }
+#if FIO_STATS
+  fio_stats_collect(stats);
+  TEST_ASSERT(stats->counters[FIO_STATS_TRUNCATED] == truncated + 1,
+              "datagrams: the truncated datagram wasn't counted\n");
+  free(stats);
+#endif
+  free(listener.datagram_buffer);
+  sock_force_close(server);
+  sock_force_close(client);
+  free(buffer);
+  free(data);
+  fprintf(stderr, "* Datagrams test passed.\n");
+}
+
+#if CLUSTER_SHARED
+#define CLUSTER_SHARED_TEST_LENGTH (FACIL_CLUSTER_SHARED_LIMIT + 4099)
+
+/* counts the shared message file descriptors and mappings of this process */
+static void cluster_shared_test_count(size_t *fds, size_t *maps) {
+  static const char name[] = "/memfd:facil-cluster";
+  char link[128];
+  *fds = 0;
+  *maps = 0;
+  DIR *dir = opendir("/proc/self/fd");
+  TEST_ASSERT(dir, "cluster: couldn't read /proc/self/fd\n");
+  for (struct dirent *d = readdir(dir); d; d = readdir(dir)) {
+    ssize_t len = readlinkat(dirfd(dir), d->d_name, link, sizeof(link) - 1);
+    if (len >= (ssize_t)(sizeof(name) - 1) &&
+        !memcmp(link, name, sizeof(name) - 1))
+      ++*fds;
+  }
+  closedir(dir);
+  FILE *f = fopen("/proc/self/maps", "r");
+  TEST_ASSERT(f, "cluster: couldn't read /proc/self/maps\n");
+  char line[512];
+  while (fgets(line, sizeof(line), f))
+    if (strstr(line, name + 1))
+      ++*maps;
+  fclose(f);
+}
+
+/* reads a shared message from `uuid`, maps it and validates the payload */
+static void cluster_shared_test_receive(intptr_t uuid, cluster_pr_s *c,
+                                        size_t base_fds, size_t base_maps) {
+  size_t fds, maps;
+  uint8_t buf[CLUSTER_HEADER_LENGTH + 64];
+  size_t len = 0;
+  while (len < CLUSTER_HEADER_LENGTH ||
+         len < CLUSTER_HEADER_LENGTH + cluster_str2uint32(buf) +
+                   cluster_str2uint32(buf + 4)) {
+    ssize_t i = sock_read(uuid, buf + len, sizeof(buf) - len);
+    if (i > 0) {
+      len += i;
+      continue;
+    }
+    TEST_ASSERT(i == 0 || errno == EAGAIN || errno == EWOULDBLOCK,
+                "cluster: (%d) read error\n", getpid());
+    struct pollfd p = {.fd = sock_uuid2fd(uuid), .events = POLLIN};
+    TEST_ASSERT(poll(&p, 1, 2000) == 1, "cluster: (%d) message timed out\n",
+                getpid());
+  }
+  uint32_t ch_len = cluster_str2uint32(buf);
+  TEST_ASSERT(cluster_str2uint32(buf + 4) == 8 &&
+                  cluster_str2uint32(buf + 8) == CLUSTER_MESSAGE_SHARED &&
+                  ch_len == 6 &&
+                  !memcmp(buf + CLUSTER_HEADER_LENGTH, "shared", 6),
+              "cluster: (%d) shared message header error\n", getpid());
+  c->msg = fiobj_str_new((char *)buf + CLUSTER_HEADER_LENGTH + ch_len, 8);
+  int fd = cluster_shared_open(c);
+  TEST_ASSERT(fd != -1, "cluster: (%d) couldn't open shared message\n",
+              getpid());
+  TEST_ASSERT(c->type == CLUSTER_MESSAGE_BINARY,
+              "cluster: (%d) message type error\n", getpid());
+  fio_cstr_s s = fiobj_obj2cstr(c->msg);
+  TEST_ASSERT(s.len == CLUSTER_SHARED_TEST_LENGTH && !s.data[s.len],
+              "cluster: (%d) payload length error\n", getpid());
+  for (size_t i = 0; i < s.len; ++i) {
+    TEST_ASSERT(s.bytes[i] == (uint8_t)(i * 7),
+                "cluster: (%d) payload error at %zu\n", getpid(), i);
+  }
+  close(fd);
+  cluster_shared_test_count(&fds, &maps);
+  TEST_ASSERT(fds == base_fds && maps == base_maps + 1,
+              "cluster: (%d) payload mapping error (%zu fds, %zu maps)\n",
+              getpid(), fds, maps);
+  /* the payload remains mapped while the String is in use */
+  FIOBJ keep = fiobj_dup(c->msg);
+  fiobj_free(c->msg);
+  c->msg = FIOBJ_INVALID;
+  TEST_ASSERT(cluster_shared_release() == 1,
+              "cluster: (%d) payload released while in use\n", getpid());
+  fiobj_free(keep);
+  TEST_ASSERT(cluster_shared_release() == 0,
+              "cluster: (%d) payload wasn't released\n", getpid());
+  cluster_shared_cleanup();
+  cluster_shared_test_count(&fds, &maps);
+  TEST_ASSERT(fds == base_fds && maps == base_maps,
+              "cluster: (%d) payload wasn't unmapped (%zu fds, %zu maps)\n",
+              getpid(), fds, maps);
+}
+
+/* opens a cluster peer connection using the shared message hooks */
+static intptr_t cluster_shared_test_peer(int fd, cluster_pr_s *pr) {
+  *pr = (cluster_pr_s){.fds.lock = SPN_LOCK_INIT};
+  intptr_t uuid = sock_open(fd);
+  TEST_ASSERT(uuid != -1, "cluster: sock_open failed\n");
+  facil_attach(uuid, NULL); /* the connection's state is reset on close */
+  sock_rw_hook_set(uuid, &CLUSTER_FDS_HOOKS, &pr->fds);
+  return uuid;
+}
+#endif
+
+void facil_cluster_shared_test(void) {
+  fprintf(stderr, "=== Testing shared cluster messages\n");
+#if CLUSTER_SHARED
+  size_t base_fds, base_maps, fds, maps;
+  int sv[3][2];
+  cluster_pr_s peers[5];
+  intptr_t senders[3];
+  uint8_t *data = malloc(CLUSTER_SHARED_TEST_LENGTH);
+  TEST_ASSERT(data, "cluster: allocation failed\n");
+  for (size_t i = 0; i < CLUSTER_SHARED_TEST_LENGTH; ++i)
+    data[i] = (uint8_t)(i * 7);
+  for (size_t i = 0; i < 3; ++i)
+    TEST_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]),
+                "cluster: socketpair failed\n");
+  /* the third peer exits before the message is sent */
+  close(sv[2][1]);
+  cluster_shared_test_count(&base_fds, &base_maps);
+  /* the second peer is a different process (a worker) */
+  pid_t child = fork();
+  TEST_ASSERT(child != -1, "cluster: fork failed\n");
+  if (!child) {
+    close(sv[1][0]);
+    intptr_t uuid = cluster_shared_test_peer(sv[1][1], peers + 4);
+    cluster_shared_test_receive(uuid, peers + 4, base_fds, base_maps);
+    _exit(0);
+  }
+  close(sv[1][1]);
+  for (size_t i = 0; i < 3; ++i)
+    senders[i] = cluster_shared_test_peer(sv[i][0], peers + i);
+  spn_lock(&facil_cluster_data.lock);
+  for (size_t i = 0; i < 3; ++i)
+    fio_hash_insert(&facil_cluster_data.clients, (FIO_HASH_KEY_TYPE)senders[i],
+                    peers + i);
+  spn_unlock(&facil_cluster_data.lock);
+  intptr_t receiver = cluster_shared_test_peer(sv[0][1], peers + 3);
+
+  TEST_ASSERT(!cluster_shared_write(6, CLUSTER_SHARED_TEST_LENGTH,
+                                    CLUSTER_MESSAGE_BINARY, 0,
+                                    (uint8_t *)"shared", data),
+              "cluster: shared message wasn't sent\n");
+  cluster_shared_test_count(&fds, &maps);
+  TEST_ASSERT(fds == base_fds + 3 && maps == base_maps,
+              "cluster: file descriptors weren't queued (%zu fds)\n", fds);
+  for (size_t i = 0; i < 3; ++i)
+    sock_flush_strong(senders[i]);
+  TEST_ASSERT(!sock_isvalid(senders[2]),
+              "cluster: connection to an exited peer wasn't closed\n");
+  cluster_shared_test_count(&fds, &maps);
+  TEST_ASSERT(fds == base_fds && maps == base_maps,
+              "cluster: sender didn't release the file descriptors "
+              "(%zu fds, %zu maps)\n",
+              fds, maps);
+
+  cluster_shared_test_receive(receiver, peers + 3, base_fds, base_maps);
+  int status = 0;
+  TEST_ASSERT(waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+                  !WEXITSTATUS(status),
+              "cluster: worker process failed\n");
+
+  /* a message that isn't handled is released when the receiver exits */
+  spn_lock(&facil_cluster_data.lock);
+  for (size_t i = 1; i < 3; ++i)
+    fio_hash_insert(&facil_cluster_data.clients, (FIO_HASH_KEY_TYPE)senders[i],
+                    NULL);
+  spn_unlock(&facil_cluster_data.lock);
+  TEST_ASSERT(!cluster_shared_write(6, CLUSTER_SHARED_TEST_LENGTH,
+                                    CLUSTER_MESSAGE_BINARY, 0,
+                                    (uint8_t *)"shared", data),
+              "cluster: shared message wasn't sent\n");
+  sock_flush_strong(senders[0]);
+  uint8_t buf[CLUSTER_HEADER_LENGTH + 64];
+  struct pollfd p = {.fd = sv[0][1], .events = POLLIN};
+  TEST_ASSERT(poll(&p, 1, 2000) == 1, "cluster: message timed out\n");
+  TEST_ASSERT(sock_read(receiver, buf, sizeof(buf)) ==
+                  CLUSTER_HEADER_LENGTH + 6 + 8,
+              "cluster: shared message wasn't received\n");
+  cluster_shared_test_count(&fds, &maps);
+  TEST_ASSERT(fds == base_fds + 1,
+              "cluster: file descriptor wasn't received (%zu fds)\n", fds);
+  sock_force_close(receiver);
+  cluster_shared_test_count(&fds, &maps);
+  TEST_ASSERT(fds == base_fds && maps == base_maps,
+              "cluster: unhandled message wasn't released (%zu fds)\n", fds);
+
+  spn_lock(&facil_cluster_data.lock);
+  fio_hash_insert(&facil_cluster_data.clients, (FIO_HASH_KEY_TYPE)senders[0],
+                  NULL);
+  spn_unlock(&facil_cluster_data.lock);
+  sock_force_close(senders[0]);
+  sock_force_close(senders[1]);
+  free(data);
+  fprintf(stderr, "* Shared cluster messages test passed.\n");
+#else
+  fprintf(stderr, "* Shared cluster messages are disabled, skipped.\n");
+#endif
+}
+
+#undef TEST_ASSERT
+#endif
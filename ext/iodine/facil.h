@@ -72,6 +72,77 @@ Feel free to copy, use and enjoy according to the license provided.
 #define FACIL_DISABLE_HOT_RESTART 0
 #endif
 
+#ifndef FACIL_DISABLE_GRACEFUL_RELOAD
+/**
+ * Disables the graceful reload reaction to the SIGUSR2 signal.
+ *
+ * The graceful reload starts a new process generation (re-running the original
+ * command line) and passes it the listening sockets (over `SCM_RIGHTS`), so
+ * connections are never refused. Once the new generation is running, the old
+ * generation stops accepting connections and shuts down, calling `on_shutdown`
+ * for any open connections.
+ *
+ * The original command line is read from `/proc/self/cmdline` (Linux).
+ */
+#define FACIL_DISABLE_GRACEFUL_RELOAD 0
+#endif
+
+#ifndef FACIL_CLUSTER_BATCH_LIMIT
+/**
+ * Cluster messages are batched and sent once per reactor cycle. When a batch
+ * grows beyond FACIL_CLUSTER_BATCH_LIMIT bytes, it's sent immediately.
+ */
+#define FACIL_CLUSTER_BATCH_LIMIT 65536
+#endif
+
+#ifndef FACIL_CLUSTER_SHARED_LIMIT
+/**
+ * Cluster messages with a payload of (at least) FACIL_CLUSTER_SHARED_LIMIT
+ * bytes are written once to a shared memory file (`memfd`). Only the file
+ * descriptor is passed to the other processes, which map the payload
+ * (read-only) rather than copying it. Set to 0 to disable (Linux only).
+ */
+#define FACIL_CLUSTER_SHARED_LIMIT (1024 * 256)
+#endif
+
+#ifndef FACIL_ACCEPT_BATCH
+/**
+ * The maximum number of connections a listening socket accepts per reactor
+ * cycle. Any remaining connections are accepted during the next cycle, so
+ * existing connections aren't starved during connection storms (i.e., when
+ * clients reconnect after a restart).
+ */
+#define FACIL_ACCEPT_BATCH 32
+#endif
+
+#ifndef FACIL_DATAGRAM_BATCH
+/**
+ * The maximum number of datagrams a UDP listening socket receives per reactor
+ * cycle (see `facil_listen_args.on_datagram`). These are received using a
+ * single system call (where available) and handled by a single `on_datagram`
+ * call.
+ */
+#define FACIL_DATAGRAM_BATCH 32
+#endif
+
+#ifndef FACIL_DATAGRAM_SIZE
+/**
+ * The maximum size of a datagram received by a UDP listening socket. Longer
+ * datagrams are discarded (see the `FIO_STATS_TRUNCATED` counter).
+ */
+#define FACIL_DATAGRAM_SIZE 8192
+#endif
+
+#ifndef FACIL_MEM_TRIM_INTERVAL
+/**
+ * The interval (in milliseconds) at which each process returns the memory of
+ * idle pooled memory blocks to the system (see `fio_mem_trim`).
+ *
+ * Set to 0 to disable the trimming.
+ */
+#define FACIL_MEM_TRIM_INTERVAL 10000
+#endif
+
 /* *****************************************************************************
 Required facil libraries
 ***************************************************************************** */
@@ -239,6 +310,61 @@ struct facil_listen_args {
    *
    * This will be called seperately for every process. */
   void (*on_finish)(intptr_t uuid, void *udata);
+  /**
+   * Opens a separate `SO_REUSEPORT` listening socket in every worker process
+   * (TCP/IP only), so the kernel balances new connections between workers
+   * instead of waking them all up for every connection.
+   *
+   * The root process keeps the address reserved (bound, but not listening).
+   */
+  uint8_t reuse_port;
+  /**
+   * When set (together with `reuse_port`), attaches a CPU affinity program to
+   * the socket group (`SO_ATTACH_REUSEPORT_CBPF`, Linux only), so connections
+   * are routed to the worker matching the CPU that received them.
+   *
+   * This requires each worker process to be bound to a single CPU.
+   */
+  uint8_t reuse_port_cpu;
+  /**
+   * When set, the kernel waits (up to this number of seconds) for the client's
+   * first data before the connection is reported (`TCP_DEFER_ACCEPT`, Linux
+   * only), so the first request is available once the connection is accepted.
+   *
+   * Defaults to 0 (disabled).
+   */
+  uint8_t defer_accept;
+  /**
+   * The TCP Fast Open queue length (when supported), allowing clients to send
+   * the first request with the connection's SYN packet.
+   *
+   * Defaults to 0 (a 128 connection queue). -1 disables TCP Fast Open.
+   */
+  int16_t fastopen;
+  /**
+   * Balances connections between the worker processes (cluster mode only).
+   *
+   * When a worker has `balance` (or more) connections more than the least
+   * loaded worker, newly accepted connections are handed to that worker (the
+   * socket is passed over the cluster's Unix socket, before `on_open` is
+   * called). Ignored when using `reuse_port`.
+   *
+   * Defaults to 0 (disabled).
+   */
+  uint16_t balance;
+  /**
+   * When set, a UDP socket is bound to `port` (required) instead of a listening
+   * TCP/IP socket, and `on_open` isn't used.
+   *
+   * Incoming datagrams are received in batches (see `FACIL_DATAGRAM_BATCH`)
+   * and passed to `on_datagram`. The datagrams' data is only valid during the
+   * callback. Replies can be sent using `sock_send_datagrams` with the `uuid`.
+   *
+   * The `reuse_port`, `defer_accept`, `fastopen` and `balance` options are
+   * ignored and the socket isn't handed off during a graceful reload.
+   */
+  void (*on_datagram)(intptr_t uuid, sock_datagram_s *datagrams, size_t count,
+                      void *udata);
 };
 
 /** Schedule a network service on a listening socket. */
@@ -331,10 +457,42 @@ struct facil_run_args {
   int16_t threads;
   /** The number of processes to run (including this one). See `threads`. */
   int16_t processes;
+  /**
+   * When greater than `threads`, each worker process runs an adaptive thread
+   * pool (see `defer_pool_start_adaptive`), starting with `threads` threads and
+   * growing up to `threads_max` threads while tasks are waiting for too long.
+   *
+   * Ignored when using `pin_connections`.
+   */
+  int16_t threads_max;
   /** called if the event loop in cycled with no pending events. */
   void (*on_idle)(void);
   /** called when the server is done, to clean up any leftovers. */
   void (*on_finish)(void);
+  /**
+   * Pins each connection's IO events to a single worker thread.
+   *
+   * Each worker thread will have it's own task queue, so connection events
+   * don't compete over the shared queue and connection data stays warm in the
+   * same CPU core's cache.
+   */
+  uint8_t pin_connections;
+  /**
+   * Binds each worker thread to a single CPU core (Linux only).
+   *
+   * Cores are assigned in order, so the threads of different worker processes
+   * use different cores (as long as there are enough cores). When using
+   * `pin_connections`, the reactor runs on the first thread's core.
+   */
+  uint8_t affinity;
+  /**
+   * Spreads the worker processes across the NUMA nodes (Linux only). Each
+   * worker is bound to it's node's CPU cores and the node's memory is preferred
+   * for the worker's allocations (so the `fio_mem` arenas stay local).
+   *
+   * Ignored on systems with a single NUMA node.
+   */
+  uint8_t numa;
 };
 
 /**
@@ -443,12 +601,15 @@ struct timespec facil_last_tick(void);
 size_t facil_count(void *service);
 
 /**
- * Creates a system timer (at the cost of 1 file descriptor).
+ * Creates a timer.
+ *
+ * All the timers are managed by a single (per process) timer file descriptor,
+ * so timers are cheap and their resolution is better than a millisecond.
  *
  * The task will repeat `repetitions` times. If `repetitions` is set to 0, task
  * will repeat forever.
  *
- * Returns -1 on error or the new file descriptor on succeess.
+ * Returns -1 on error or 0 on succeess.
  *
  * The `on_finish` handler is always called (even on error).
  */
@@ -572,6 +733,17 @@ registered callbacks.
 */
 int facil_cluster_send(int32_t filter, FIOBJ ch, FIOBJ msg);
 
+/** Sends `count` messages of type `msg_type` to the **other** cluster processes.
+
+This is the same as calling `facil_cluster_send` for each message (`ch[i]` and
+`msg[i]`), except that the batch is written while holding the cluster's lock
+only once.
+
+`msg` may be NULL (no message data).
+*/
+int facil_cluster_send_batch(int32_t filter, FIOBJ *ch, FIOBJ *msg,
+                             size_t count);
+
 /* *****************************************************************************
 Lower Level API - for special circumstances, use with care under .
 ***************************************************************************** */
@@ -609,6 +781,13 @@ protocol_s *facil_protocol_try_lock(intptr_t uuid, enum facil_protocol_lock_e);
  * details. */
 void facil_protocol_unlock(protocol_s *pr, enum facil_protocol_lock_e);
 
+#ifdef DEBUG
+/** Tests UDP datagrams (batched I/O and truncation) over the loopback. */
+void facil_datagram_test(void);
+/** Tests the shared memory cluster messages (large payloads). */
+void facil_cluster_shared_test(void);
+#endif
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
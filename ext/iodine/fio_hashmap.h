@@ -78,6 +78,17 @@ License: MIT
 #define FIO_HASH_MAX_MAP_SEEK (256)
 #endif
 
+#ifndef FIO_HASH_SWISS
+/**
+ * When set, the map is a Swiss table style map, using groups of 16 control
+ * bytes (tag matching is performed using SSE2 when available) and 32 bit
+ * indexes into the ordered array, instead of linear probing over key copies.
+ *
+ * The API (and the ordered array) remain the same.
+ */
+#define FIO_HASH_SWISS 1
+#endif
+
 #ifndef FIO_HASH_REALLOC /* NULL ptr indicates new allocation */
 #define FIO_HASH_REALLOC(ptr, original_size, new_size, valid_data_length)      \
   realloc((ptr), (new_size))
@@ -233,6 +244,50 @@ typedef struct fio_hash_data_ordered_s {
   void *obj;
 } fio_hash_data_ordered_s;
 
+#if FIO_HASH_SWISS
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* the information in the Hash Map structure should be considered READ ONLY. */
+struct fio_hash_s {
+  uintptr_t count;
+  uintptr_t capa;
+  uintptr_t pos;
+  uintptr_t mask;
+  fio_hash_data_ordered_s *ordered;
+  /* `mask + 1` control bytes, followed by `mask + 1` indexes (uint32_t) */
+  uint8_t *map;
+  /* removed map entries (tombstones) */
+  uintptr_t deleted;
+};
+
+#undef FIO_HASH_FOR_LOOP
+#define FIO_HASH_FOR_LOOP(hash, container)                                     \
+  for (fio_hash_data_ordered_s *container = (hash)->ordered;                   \
+       container && (container < (hash)->ordered + (hash)->pos); ++container)
+
+#undef FIO_HASH_FOR_FREE
+#define FIO_HASH_FOR_FREE(hash, container)                                     \
+  for (fio_hash_data_ordered_s *container = (hash)->ordered;                   \
+       (container && container >= (hash)->ordered &&                           \
+        (container < (hash)->ordered + (hash)->pos)) ||                        \
+       ((fio_hash_free(hash), (hash)->ordered) != NULL);                       \
+       FIO_HASH_KEY_DESTROY(container->key), (++container))
+
+#undef FIO_HASH_FOR_EMPTY
+#define FIO_HASH_FOR_EMPTY(hash, container)                                    \
+  for (fio_hash_data_ordered_s *container = (hash)->ordered;                   \
+       (container && (container < (hash)->ordered + (hash)->pos)) ||           \
+       ((void)((hash)->map && memset((hash)->map, 0, (hash)->mask + 1)),       \
+        ((hash)->pos = (hash)->count = (hash)->deleted = 0));                  \
+       (FIO_HASH_KEY_DESTROY(container->key),                                  \
+        container->key = FIO_HASH_KEY_INVALID, container->obj = NULL),         \
+                               (++container))
+
+#else /* FIO_HASH_SWISS */
+
 typedef struct fio_hash_data_s {
   FIO_HASH_KEY_TYPE key; /* another copy for memory cache locality */
   struct fio_hash_data_ordered_s *obj;
@@ -270,9 +325,396 @@ struct fio_hash_s {
        (FIO_HASH_KEY_DESTROY(container->key),                                  \
         container->key = FIO_HASH_KEY_INVALID, container->obj = NULL),         \
                                (++container))
+#endif /* FIO_HASH_SWISS */
+
 #define FIO_HASH_INIT                                                          \
   { .capa = 0 }
 
+#if FIO_HASH_SWISS
+
+/* *****************************************************************************
+Hash allocation / deallocation.
+***************************************************************************** */
+
+/* the number of control bytes in a group (the minimal map capacity). */
+#define FIO_HASH_GROUP 16
+/* control bytes: `0` is an empty slot, `1` a removed slot, `0x80 | tag` used */
+#define FIO_HASH_CTRL_EMPTY 0
+#define FIO_HASH_CTRL_DELETED 1
+/* the maximal number of used map slots (including tombstones), 7/8 */
+#define FIO_HASH_MAX_LOAD(capa) ((capa) - ((capa) >> 3))
+/* the map's index array (following the control bytes) */
+#define FIO_HASH_INDEX(hash) ((uint32_t *)((hash)->map + ((hash)->mask + 1)))
+
+/* (re)allocates the ordered array. */
+FIO_FUNC void fio_hash__ordered_capa(fio_hash_s *h, size_t ocapa) {
+  h->ordered = (fio_hash_data_ordered_s *)(FIO_HASH_REALLOC(
+      h->ordered, (h->capa * sizeof(*h->ordered)),
+      (ocapa * sizeof(*h->ordered)), (h->pos * sizeof(*h->ordered))));
+  if (!h->ordered) {
+    perror("HashMap Reallocation Failed");
+    exit(errno);
+  }
+  h->capa = ocapa;
+}
+
+/** Allocates and initializes internal data and resources with the requested
+ * capacity. */
+FIO_FUNC void fio_hash__new__internal__safe_capa(fio_hash_s *h, size_t capa) {
+  size_t map_capa = FIO_HASH_GROUP;
+  while (FIO_HASH_MAX_LOAD(map_capa) < capa)
+    map_capa <<= 1;
+  *h = (fio_hash_s){
+      .mask = (map_capa - 1),
+      .map = (uint8_t *)FIO_HASH_CALLOC(1, map_capa * (1 + sizeof(uint32_t))),
+      .ordered =
+          (fio_hash_data_ordered_s *)FIO_HASH_CALLOC(sizeof(*h->ordered), capa),
+      .capa = capa,
+  };
+  if (!h->map || !h->ordered) {
+    perror("ERROR: Hash Table couldn't allocate memory");
+    exit(errno);
+  }
+}
+
+/** Allocates and initializes internal data and resources with the requested
+ * capacity. */
+FIO_FUNC void fio_hash_new2(fio_hash_s *h, size_t capa) {
+  size_t act_capa = 1;
+  while (act_capa < capa)
+    act_capa = act_capa << 1;
+  fio_hash__new__internal__safe_capa(h, act_capa);
+}
+
+FIO_FUNC void fio_hash_new(fio_hash_s *h) {
+  fio_hash__new__internal__safe_capa(h, FIO_HASH_INITIAL_CAPACITY);
+}
+
+FIO_FUNC void fio_hash_free(fio_hash_s *h) {
+  FIO_HASH_FREE(h->map, (h->mask + 1) * (1 + sizeof(uint32_t)));
+  FIO_HASH_FREE(h->ordered, h->capa * sizeof(*h->ordered));
+  *h = (fio_hash_s){.map = NULL};
+}
+
+/* *****************************************************************************
+Internal HashMap Functions
+***************************************************************************** */
+
+/* mixes the key's hash, so the tag and the group are (mostly) unrelated */
+FIO_FUNC inline uint64_t fio_hash_map_mix(uint64_t h) {
+  h *= 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 32);
+}
+
+/* the control byte for a used slot: the top 7 bits of the hash */
+FIO_FUNC inline uint8_t fio_hash_map_tag(uint64_t mixed) {
+  return (uint8_t)(0x80 | (mixed >> 57));
+}
+
+/* returns a bitmap of the control bytes in the group that equal `ctrl` */
+FIO_FUNC inline uint32_t fio_hash_group_match(const uint8_t *group,
+                                              uint8_t ctrl) {
+#if defined(__SSE2__)
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)group),
+                     _mm_set1_epi8((char)ctrl)));
+#else
+  uint32_t ret = 0;
+  for (size_t i = 0; i < FIO_HASH_GROUP; ++i)
+    ret |= (uint32_t)(group[i] == ctrl) << i;
+  return ret;
+#endif
+}
+
+/* returns a bitmap of the unused (empty or removed) slots in the group */
+FIO_FUNC inline uint32_t fio_hash_group_free(const uint8_t *group) {
+#if defined(__SSE2__)
+  return (~(uint32_t)_mm_movemask_epi8(
+             _mm_loadu_si128((const __m128i *)group))) &
+         0xFFFF;
+#else
+  uint32_t ret = 0;
+  for (size_t i = 0; i < FIO_HASH_GROUP; ++i)
+    ret |= (uint32_t)(group[i] < 0x80) << i;
+  return ret;
+#endif
+}
+
+/*
+ * Seeks the key's slot in the map. If the key is missing, the slot to be used
+ * for the key is returned (or `(uintptr_t)-1` if the map is full) and `found`
+ * is set to zero.
+ */
+FIO_FUNC uintptr_t fio_hash_seek_pos_(fio_hash_s *hash, FIO_HASH_KEY_TYPE key,
+                                      int *found) {
+  const uint64_t mixed = fio_hash_map_mix(FIO_HASH_KEY2UINT(key));
+  const uint8_t tag = fio_hash_map_tag(mixed);
+  const uintptr_t gmask = hash->mask / FIO_HASH_GROUP;
+  const uint32_t *index = FIO_HASH_INDEX(hash);
+  uintptr_t group = mixed & gmask;
+  uintptr_t slot = (uintptr_t)-1;
+  /* triangular probing visits every group (the group count is a power of 2) */
+  for (uintptr_t step = 1; step <= gmask + 1; ++step) {
+    const uint8_t *ctrl = hash->map + (group * FIO_HASH_GROUP);
+    uint32_t match = fio_hash_group_match(ctrl, tag);
+    while (match) {
+      const uintptr_t pos = (group * FIO_HASH_GROUP) + __builtin_ctz(match);
+      const fio_hash_data_ordered_s *o = hash->ordered + index[pos];
+      if (FIO_HASH_KEY2UINT(o->key) == FIO_HASH_KEY2UINT(key) &&
+          FIO_HASH_COMPARE_KEYS(o->key, key)) {
+        *found = 1;
+        return pos;
+      }
+      match &= match - 1;
+    }
+    if (slot == (uintptr_t)-1) {
+      uint32_t unused = fio_hash_group_free(ctrl);
+      if (unused)
+        slot = (group * FIO_HASH_GROUP) + __builtin_ctz(unused);
+    }
+    if (fio_hash_group_match(ctrl, FIO_HASH_CTRL_EMPTY))
+      break; /* the key would have been placed in this group */
+    group = (group + step) & gmask;
+  }
+  *found = 0;
+  return slot;
+}
+
+/* marks a slot as unused (an empty slot, unless probing might pass through) */
+FIO_FUNC inline void fio_hash_map_remove_(fio_hash_s *hash, uintptr_t pos) {
+  uint8_t *group = hash->map + (pos & (~(uintptr_t)(FIO_HASH_GROUP - 1)));
+  if (fio_hash_group_match(group, FIO_HASH_CTRL_EMPTY)) {
+    /* the group was never full, so no probing sequence passed through it */
+    hash->map[pos] = FIO_HASH_CTRL_EMPTY;
+  } else {
+    hash->map[pos] = FIO_HASH_CTRL_DELETED;
+    ++hash->deleted;
+  }
+}
+
+/* rebuilds the map using the requested capacity, removing any holes */
+FIO_FUNC void fio_hash_map_rebuild_(fio_hash_s *h, size_t capa) {
+  /* compact the ordered list */
+  if (h->pos != h->count) {
+    size_t reader = 0;
+    size_t writer = 0;
+    while (reader < h->pos) {
+      if (h->ordered[reader].obj) {
+        h->ordered[writer] = h->ordered[reader];
+        ++writer;
+      } else {
+        FIO_HASH_KEY_DESTROY(h->ordered[reader].key);
+      }
+      ++reader;
+    }
+    h->pos = writer;
+  }
+  /* It's better to reallocate using calloc than manually zero out memory */
+  FIO_HASH_FREE(h->map, (h->mask + 1) * (1 + sizeof(uint32_t)));
+  h->mask = capa - 1;
+  h->deleted = 0;
+  h->map = (uint8_t *)FIO_HASH_CALLOC(1, capa * (1 + sizeof(uint32_t)));
+  if (!h->map) {
+    perror("HashMap Allocation Failed");
+    exit(errno);
+  }
+  /* keys are unique, so only an unused slot is required */
+  const uintptr_t gmask = h->mask / FIO_HASH_GROUP;
+  uint32_t *index = FIO_HASH_INDEX(h);
+  for (size_t i = 0; i < h->pos; ++i) {
+    const uint64_t mixed =
+        fio_hash_map_mix(FIO_HASH_KEY2UINT(h->ordered[i].key));
+    uintptr_t group = mixed & gmask;
+    uintptr_t step = 1;
+    uint32_t unused;
+    while (!(unused = fio_hash_group_free(h->map + (group * FIO_HASH_GROUP)))) {
+      group = (group + step) & gmask;
+      ++step;
+    }
+    const uintptr_t pos = (group * FIO_HASH_GROUP) + __builtin_ctz(unused);
+    h->map[pos] = fio_hash_map_tag(mixed);
+    index[pos] = (uint32_t)i;
+  }
+}
+
+/* finds an object in the map */
+FIO_FUNC inline void *fio_hash_find(fio_hash_s *hash, FIO_HASH_KEY_TYPE key) {
+  if (!hash->map)
+    return NULL;
+  int found;
+  uintptr_t pos = fio_hash_seek_pos_(hash, key, &found);
+  if (!found)
+    return NULL;
+  return (void *)hash->ordered[FIO_HASH_INDEX(hash)[pos]].obj;
+}
+
+/* inserts an object to the map, rehashing if required, returning old object.
+ * set obj to NULL to remove existing data.
+ */
+FIO_FUNC void *fio_hash_insert(fio_hash_s *hash, FIO_HASH_KEY_TYPE key,
+                               void *obj) {
+  if (!hash->map) {
+    if (!obj)
+      return NULL;
+    fio_hash_new(hash);
+  }
+  int found;
+  uintptr_t pos = fio_hash_seek_pos_(hash, key, &found);
+
+  if (!found) {
+    /* a fresh object */
+    if (obj == NULL) {
+      /* nothing to delete */
+      return NULL;
+    }
+    /* ensure some space */
+    if (pos == (uintptr_t)-1 ||
+        hash->pos + hash->deleted >= FIO_HASH_MAX_LOAD(hash->mask + 1)) {
+      if ((hash->count << 1) >= FIO_HASH_MAX_LOAD(hash->mask + 1))
+        fio_hash_map_rebuild_(hash, (hash->mask + 1) << 1);
+      else
+        fio_hash_map_rebuild_(hash, (hash->mask + 1)); /* remove tombstones */
+      pos = fio_hash_seek_pos_(hash, key, &found);
+    }
+    if (hash->pos >= hash->capa)
+      fio_hash__ordered_capa(hash, hash->capa ? (hash->capa << 1)
+                                              : FIO_HASH_INITIAL_CAPACITY);
+    if (hash->map[pos] == FIO_HASH_CTRL_DELETED)
+      --hash->deleted;
+
+    /* add object to ordered hash */
+    hash->ordered[hash->pos] =
+        (fio_hash_data_ordered_s){.key = FIO_HASH_KEY_COPY(key), .obj = obj};
+
+    /* add object to map */
+    hash->map[pos] = fio_hash_map_tag(fio_hash_map_mix(FIO_HASH_KEY2UINT(key)));
+    FIO_HASH_INDEX(hash)[pos] = (uint32_t)hash->pos;
+
+    /* manage counters and mark end position */
+    hash->count++;
+    hash->pos++;
+    return NULL;
+  }
+
+  fio_hash_data_ordered_s *info = hash->ordered + FIO_HASH_INDEX(hash)[pos];
+  if (!obj && !info->obj) {
+    /* a delete operation for an empty element */
+    return NULL;
+  }
+
+  /* an object exists, this is a "replace/delete" operation */
+  const void *old = (void *)info->obj;
+
+  if (!obj) {
+    /* it was a delete operation */
+    if (info == hash->ordered + hash->pos - 1) {
+      /* we removed the last ordered element, no need to keep any holes. */
+      --hash->pos;
+      FIO_HASH_KEY_DESTROY(hash->ordered[hash->pos].key);
+      hash->ordered[hash->pos] =
+          (fio_hash_data_ordered_s){.obj = NULL, .key = FIO_HASH_KEY_INVALID};
+      fio_hash_map_remove_(hash, pos);
+      if (hash->pos && !hash->ordered[hash->pos - 1].obj) {
+        fio_hash_pop(hash, NULL);
+      } else {
+        --hash->count;
+      }
+
+      return (void *)old;
+    }
+    --hash->count;
+  } else if (!old) {
+    /* inserted an item after a previous one was removed. */
+    ++hash->count;
+  }
+  info->obj = obj;
+
+  return (void *)old;
+}
+
+/**
+ * Allows the Hash to be momenterally used as a stack, poping the last element
+ * entered.
+ * Remember that keys might have to be freed as well (`FIO_HASH_KEY_DESTROY`).
+ */
+FIO_FUNC void *fio_hash_pop(fio_hash_s *hash, FIO_HASH_KEY_TYPE *key) {
+  if (!hash->pos)
+    return NULL;
+  --(hash->pos);
+  --(hash->count);
+  void *old = hash->ordered[hash->pos].obj;
+  /* removing hole from hashtable is possible because it's the last element */
+  int found;
+  uintptr_t pos =
+      fio_hash_seek_pos_(hash, hash->ordered[hash->pos].key, &found);
+  if (!found) {
+    /* no info is a data corruption error. */
+    fprintf(stderr, "FATAL ERROR: (fio_hash) unexpected missing container.\n");
+    exit(-1);
+  }
+  fio_hash_map_remove_(hash, pos);
+  /* cleanup key (or copy to target) and reset the ordered position. */
+  if (key)
+    *key = hash->ordered[hash->pos].key;
+  else
+    FIO_HASH_KEY_DESTROY(hash->ordered[hash->pos].key);
+  hash->ordered[hash->pos] =
+      (fio_hash_data_ordered_s){.obj = NULL, .key = FIO_HASH_KEY_INVALID};
+  /* remove any holes from the top (top is kept tight) */
+  while (hash->pos && hash->ordered[hash->pos - 1].obj == NULL) {
+    --(hash->pos);
+    pos = fio_hash_seek_pos_(hash, hash->ordered[hash->pos].key, &found);
+    if (!found) {
+      /* no info is a data corruption error. */
+      fprintf(stderr,
+              "FATAL ERROR: (fio_hash) unexpected missing container (2).\n");
+      exit(-1);
+    }
+    fio_hash_map_remove_(hash, pos);
+    FIO_HASH_KEY_DESTROY(hash->ordered[hash->pos].key);
+    hash->ordered[hash->pos] =
+        (fio_hash_data_ordered_s){.obj = NULL, .key = FIO_HASH_KEY_INVALID};
+  }
+  return old;
+}
+
+/* attempts to rehash the hashmap. */
+FIO_FUNC void fio_hash_rehash(fio_hash_s *h) {
+  if (!h->map) { /* lazy initialization */
+    fio_hash_new(h);
+    return;
+  }
+  fio_hash_map_rebuild_(h, (h->mask + 1) << 1);
+}
+
+/**
+ * Attempts to minimize memory usage by removing empty spaces caused by deleted
+ * items and rehashing the Hash Map.
+ *
+ * Returns the updated hash map capacity.
+ */
+FIO_FUNC inline size_t fio_hash_compact(fio_hash_s *hash) {
+  if (!hash || !hash->map)
+    return 0;
+  if (hash->count == hash->pos && !hash->deleted &&
+      (hash->count << 1) >= FIO_HASH_MAX_LOAD(hash->mask + 1))
+    return hash->capa;
+  /* recalculate minimal length and rehash */
+  size_t capa = FIO_HASH_GROUP;
+  while ((hash->count << 1) >= FIO_HASH_MAX_LOAD(capa))
+    capa <<= 1;
+  fio_hash_map_rebuild_(hash, capa);
+  /* the ordered array can shrink as well */
+  size_t ocapa = FIO_HASH_INITIAL_CAPACITY;
+  while (ocapa < hash->pos)
+    ocapa <<= 1;
+  if (ocapa < hash->capa)
+    fio_hash__ordered_capa(hash, ocapa);
+  return hash->capa;
+}
+
+#else /* FIO_HASH_SWISS */
+
 /* *****************************************************************************
 Hash allocation / deallocation.
 ***************************************************************************** */
@@ -472,21 +914,6 @@ FIO_FUNC void *fio_hash_pop(fio_hash_s *hash, FIO_HASH_KEY_TYPE *key) {
   return old;
 }
 
-/**
- * Allows a peak at the Hash's last element.
- *
- * If a pointer to `key` is provided, the element's key will be placed in it's
- * place.
- *
- * Remember that keys might be destroyed if the Hash is altered
- * (`FIO_HASH_KEY_DESTROY`).
- */
-FIO_FUNC void *fio_hash_last(fio_hash_s *hash, FIO_HASH_KEY_TYPE *key) {
-  if (key)
-    *key = hash->ordered[hash->pos - 1].key;
-  return hash->ordered[hash->pos - 1].obj;
-}
-
 /* attempts to rehash the hashmap. */
 FIO_FUNC void fio_hash_rehash(fio_hash_s *h) {
   if (!h->capa) /* lazy initialization */
@@ -557,6 +984,23 @@ retry_rehashing:
   }
 }
 
+#endif /* FIO_HASH_SWISS */
+
+/**
+ * Allows a peak at the Hash's last element.
+ *
+ * If a pointer to `key` is provided, the element's key will be placed in it's
+ * place.
+ *
+ * Remember that keys might be destroyed if the Hash is altered
+ * (`FIO_HASH_KEY_DESTROY`).
+ */
+FIO_FUNC void *fio_hash_last(fio_hash_s *hash, FIO_HASH_KEY_TYPE *key) {
+  if (key)
+    *key = hash->ordered[hash->pos - 1].key;
+  return hash->ordered[hash->pos - 1].obj;
+}
+
 FIO_FUNC inline size_t fio_hash_each(fio_hash_s *hash, size_t start_at,
                                      int (*task)(FIO_HASH_KEY_TYPE key,
                                                  void *obj, void *arg),
@@ -611,6 +1055,7 @@ FIO_FUNC inline size_t fio_hash_capa(const fio_hash_s *hash) {
   return hash->capa;
 }
 
+#if !FIO_HASH_SWISS
 /**
  * Attempts to minimize memory usage by removing empty spaces caused by deleted
  * items and rehashing the Hash Map.
@@ -648,6 +1093,7 @@ FIO_FUNC inline size_t fio_hash_compact(fio_hash_s *hash) {
 
   return hash->capa;
 }
+#endif /* !FIO_HASH_SWISS */
 
 #if DEBUG && !FIO_HASH_NO_TEST
 #define FIO_HASHMAP_TEXT_COUNT 524288UL
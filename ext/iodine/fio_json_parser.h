@@ -26,6 +26,19 @@
 #include <stdio.h>
 #endif
 
+#ifndef FIO_JSON_SSE2
+/** When set, SSE2 is used to seek the end of strings (16 bytes at a time). */
+#if defined(__SSE2__)
+#define FIO_JSON_SSE2 1
+#else
+#define FIO_JSON_SSE2 0
+#endif
+#endif
+
+#if FIO_JSON_SSE2
+#include <emmintrin.h>
+#endif
+
 /* *****************************************************************************
 JSON API
 ***************************************************************************** */
@@ -188,6 +201,23 @@ static inline int seek2marker(uint8_t **buffer,
   if (string_seek_stop[**buffer])
     return 1;
 
+#if FIO_JSON_SSE2
+  {
+    /* test 16 bytes at a time (unaligned loads) */
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i escape = _mm_set1_epi8('\\');
+    for (; *buffer + 16 <= limit; *buffer += 16) {
+      const __m128i data = _mm_loadu_si128((const __m128i *)*buffer);
+      const int found =
+          _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(data, quote),
+                                         _mm_cmpeq_epi8(data, escape)));
+      if (found) {
+        *buffer += __builtin_ctz((unsigned int)found);
+        return 1;
+      }
+    }
+  }
+#else
 #if !ALLOW_UNALIGNED_MEMORY_ACCESS || (!__x86_64__ && !__aarch64__)
   /* too short for this mess */
   if ((uintptr_t)limit <= 8 + ((uintptr_t)*buffer & (~(uintptr_t)7)))
@@ -227,6 +257,7 @@ static inline int seek2marker(uint8_t **buffer,
 #if !ALLOW_UNALIGNED_MEMORY_ACCESS || (!__x86_64__ && !__aarch64__)
 finish:
 #endif
+#endif /* FIO_JSON_SSE2 */
   if (*buffer + 4 <= limit) {
     if (string_seek_stop[(*buffer)[0]]) {
       // *buffer += 0;
@@ -418,11 +449,12 @@ fio_json_parse(json_parser_s *parser, const char *buffer, size_t length) {
       long long i = strtoll((char *)pos, (char **)&tmp, 0);
       if (tmp > limit)
         goto stop;
-      if (!tmp || JSON_NUMERAL[*tmp]) {
+      /* `tmp == pos` when nothing was converted (i.e., "inf") */
+      if (!tmp || tmp == pos || JSON_NUMERAL[*tmp]) {
         double f = strtod((char *)pos, (char **)&tmp);
         if (tmp > limit)
           goto stop;
-        if (!tmp || JSON_NUMERAL[*tmp])
+        if (!tmp || tmp == pos || JSON_NUMERAL[*tmp])
           goto error;
         fio_json_on_float(parser, f);
         pos = tmp;
@@ -446,9 +478,12 @@ fio_json_parse(json_parser_s *parser, const char *buffer, size_t length) {
         if (pos + 4 > limit)
           goto stop;
         uint8_t *tmp = pos + 3; /* avoid this: /*/
-        do {
+        for (;;) {
           tmp = memchr(tmp, '/', (uintptr_t)(limit - tmp));
-        } while (tmp && tmp[-1] != '*');
+          if (!tmp || tmp[-1] == '*')
+            break;
+          ++tmp;
+        }
         if (!tmp)
           goto stop;
         pos = tmp + 1;
@@ -617,6 +652,19 @@ fio_json_unescape_str(void *dest, const char *source, size_t length) {
     writer += (size_t)(tmp - reader);
     reader = tmp;
 #else
+#if FIO_JSON_SSE2
+    {
+      const __m128i escape = _mm_set1_epi8('\\');
+      while (reader + 16 <= stop) {
+        const __m128i data = _mm_loadu_si128((const __m128i *)reader);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(data, escape)))
+          break;
+        _mm_storeu_si128((__m128i *)writer, data);
+        reader += 16;
+        writer += 16;
+      }
+    }
+#endif
     const uint8_t *limit64 = (uint8_t *)stop - 7;
     uint64_t wanted1 = 0x0101010101010101ULL * '\\';
     while (reader < limit64) {
@@ -7,6 +7,7 @@ Feel free to copy, use and enjoy according to the license provided.
 
 #include "spnlock.inc"
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -30,7 +31,11 @@ void *fio_realloc2(void *ptr, size_t new_size, size_t valid_len) {
   (void)valid_len;
 }
 
+void fio_free_batch_begin(void) {}
+void fio_free_batch_end(void) {}
+
 void fio_malloc_after_fork(void) {}
+void fio_malloc_before_fork(void) {}
 
 /* *****************************************************************************
 facil.io malloc implementation
@@ -39,6 +44,10 @@ facil.io malloc implementation
 
 #include "fio_mem.h"
 
+#if FIO_MEM_HUGE_PAGES && defined(__linux__)
+#include <sys/prctl.h>
+#endif
+
 #if !defined(__clang__) && !defined(__GNUC__)
 #define __thread _Thread_value
 #endif
@@ -167,6 +176,9 @@ static inline void *sys_alloc(size_t len, uint8_t is_indi) {
   next_alloc =
       (void *)((uintptr_t)result + FIO_MEMORY_BLOCK_SIZE +
                (is_indi * ((uintptr_t)1 << 30))); /* add 1TB for realloc */
+#if FIO_MEM_HUGE_PAGES && defined(MADV_HUGEPAGE)
+  madvise(result, len, MADV_HUGEPAGE); /* a hint, errors are ignored */
+#endif
   return result;
 }
 
@@ -215,15 +227,18 @@ Data Types
 
 /* The basic block header. Starts a 64Kib memory block */
 typedef struct block_s {
-  uint16_t ref; /* reference count (per memory page) */
-  uint16_t pos; /* position into the block */
-  uint16_t max; /* available memory count */
-  uint16_t pad; /* memory padding */
+  uint32_t ref; /* reference count (per memory page) */
+  uint32_t pos; /* position into the block */
+  uint32_t max; /* available memory count */
+  uint32_t size_class; /* slice units, if the block is thread cached (or 0) */
 } block_s;
 
 /* a per-CPU core "arena" for memory allocations  */
 typedef struct {
   block_s *block;
+#if FIO_MEM_CACHE_UNITS
+  block_s *cached[FIO_MEM_CACHE_UNITS]; /* per size class (thread caches) */
+#endif
   spn_lock_i lock;
 } arena_s;
 
@@ -233,6 +248,11 @@ static struct {
   block_s *available; /* free list for memory blocks */
   intptr_t count;     /* free list counter */
   size_t cores;       /* the number of detected CPU cores*/
+  intptr_t blocks;    /* blocks allocated from the system (statistics) */
+  intptr_t pooled;    /* free list length (statistics, protected by lock) */
+  intptr_t trimmed;   /* trimmed blocks in the free list (protected by lock) */
+  intptr_t big_count; /* direct system allocations (statistics) */
+  intptr_t big_bytes; /* direct system allocations' size (statistics) */
   spn_lock_i lock;    /* a global lock */
 } memory = {
     .cores = 1, .lock = SPN_LOCK_INIT,
@@ -292,6 +312,14 @@ Block management
 //   block_s *blk = memory.active;
 // }
 
+/*
+ * Pooled blocks are marked (using the second word of the block) by
+ * `fio_mem_trim`, first as idle and then as trimmed. `block_new` clears the
+ * mark.
+ */
+#define BLOCK_IDLE ((uintptr_t)1)
+#define BLOCK_TRIMMED ((uintptr_t)2)
+
 /* intializes the block header for an available block of memory. */
 static inline block_s *block_init(void *blk_) {
   block_s *blk = blk_;
@@ -304,15 +332,15 @@ static inline block_s *block_init(void *blk_) {
   return blk;
 }
 
-/* intializes the block header for an available block of memory. */
-static inline void block_free(block_s *blk) {
-  if (spn_sub(&blk->ref, 1))
+/* releases `count` references to a block, recycling the block if unused. */
+static inline void block_release(block_s *blk, intptr_t count) {
+  if (spn_sub(&blk->ref, count))
     return;
 
   if (spn_add(&memory.count, 1) >
       (intptr_t)(FIO_MEM_MAX_BLOCKS_PER_CORE * memory.cores)) {
-    /* TODO: return memory to the system */
     spn_sub(&memory.count, 1);
+    spn_sub(&memory.blocks, 1);
     sys_free(blk, FIO_MEMORY_BLOCK_SIZE);
     return;
   }
@@ -320,9 +348,13 @@ static inline void block_free(block_s *blk) {
   spn_lock(&memory.lock);
   *(block_s **)blk = memory.available;
   memory.available = (block_s *)blk;
+  ++memory.pooled;
   spn_unlock(&memory.lock);
 }
 
+/* releases a block reference, recycling the block if unused. */
+static inline void block_free(block_s *blk) { block_release(blk, 1); }
+
 /* intializes the block header for an available block of memory. */
 static inline block_s *block_new(void) {
   block_s *blk = NULL;
@@ -332,6 +364,9 @@ static inline block_s *block_new(void) {
     blk = (block_s *)memory.available;
     if (blk) {
       memory.available = ((block_s **)blk)[0];
+      --memory.pooled;
+      if (((uintptr_t *)blk)[1] == BLOCK_TRIMMED)
+        --memory.trimmed;
     }
     spn_unlock(&memory.lock);
   }
@@ -341,29 +376,31 @@ static inline block_s *block_new(void) {
     ((block_s **)blk)[1] = NULL;
     return block_init(blk);
   }
-  /* TODO: collect memory from the system */
   blk = sys_alloc(FIO_MEMORY_BLOCK_SIZE, 0);
   if (!blk)
     return NULL;
+  spn_add(&memory.blocks, 1);
   return block_init(blk);
-  ;
 }
 
-static inline void *block_slice(uint16_t units) {
-  block_s *blk = arena_last_used->block;
-  if (!blk) {
-    /* arena is empty */
-    blk = block_new();
-    arena_last_used->block = blk;
-  } else if (blk->pos + units > blk->max) {
-    /* not enough memory in the block - rotate */
-    block_free(blk);
+/*
+ * slices a block (`slot` is an arena's block pointer). New blocks are marked
+ * with `size_class` (0 unless the block is used by the thread caches).
+ */
+static inline void *block_slice(block_s **slot, uint32_t units,
+                                uint32_t size_class) {
+  block_s *blk = *slot;
+  if (!blk || blk->pos + units > blk->max) {
+    /* arena is empty or not enough memory in the block - rotate */
+    if (blk)
+      block_free(blk);
     blk = block_new();
-    arena_last_used->block = blk;
-  }
-  if (!blk) {
-    /* no system memory available? */
-    return NULL;
+    *slot = blk;
+    if (!blk) {
+      /* no system memory available? */
+      return NULL;
+    }
+    blk->size_class = size_class;
   }
   /* slice block starting at blk->pos and increase reference count */
   const void *mem = (void *)((uintptr_t)blk + ((uintptr_t)blk->pos << 4));
@@ -373,14 +410,192 @@ static inline void *block_slice(uint16_t units) {
     /* it's true that a 16 bytes slice remains, but statistically... */
     /* ... the block was fully utilized, clear arena */
     block_free(blk);
-    arena_last_used->block = NULL;
+    *slot = NULL;
   }
   return (void *)mem;
 }
 
+/* *****************************************************************************
+Per-thread caches (lock-free free lists for small size classes)
+***************************************************************************** */
+
+#if FIO_MEM_CACHE_UNITS
+
+/*
+ * Slices in a thread's cache keep their block's reference, so the blocks are
+ * only recycled once the slices were returned (`cache_release`).
+ *
+ * The free lists are singly linked, using the first bytes of each slice.
+ */
+static __thread struct {
+  void *list[FIO_MEM_CACHE_UNITS];
+  uint16_t count[FIO_MEM_CACHE_UNITS];
+  uint8_t registered;
+} cache;
+
+/* returns a thread's cached slices to their blocks when the thread exits. */
+static pthread_key_t cache_key;
+
+/* returns (up to) `count` slices of the size class to their blocks. */
+static void cache_release(uint16_t units, size_t count) {
+  void **mem = cache.list[units - 1];
+  /* slices from the same block are usually adjacent in the list */
+  block_s *blk = NULL;
+  intptr_t run = 0;
+  while (mem && count) {
+    void **next = *mem;
+    block_s *tmp = (block_s *)((uintptr_t)mem & (~FIO_MEMORY_BLOCK_MASK));
+    if (tmp != blk) {
+      if (run)
+        block_release(blk, run);
+      blk = tmp;
+      run = 0;
+    }
+    ++run;
+    mem = next;
+    --count;
+    --cache.count[units - 1];
+  }
+  if (run)
+    block_release(blk, run);
+  cache.list[units - 1] = mem;
+}
+
+/* called by `pthread_key_create` when a thread exits. */
+static void cache_on_thread_exit(void *ignr) {
+  for (uint16_t i = 1; i <= FIO_MEM_CACHE_UNITS; ++i)
+    cache_release(i, (size_t)-1);
+  (void)ignr;
+}
+
+static inline void cache_register(void) {
+  if (cache.registered)
+    return;
+  cache.registered = 1;
+  pthread_setspecific(cache_key, &cache);
+}
+
+/* slices a batch of allocations from the arena's size class block. */
+static void cache_refill(uint16_t units) {
+  cache_register();
+  arena_enter();
+  for (size_t i = 0; i < FIO_MEM_CACHE_BATCH; ++i) {
+    void **mem = block_slice(arena_last_used->cached + (units - 1), units,
+                             units);
+    if (!mem)
+      break;
+    *mem = cache.list[units - 1];
+    cache.list[units - 1] = mem;
+    ++cache.count[units - 1];
+  }
+  arena_exit();
+}
+
+static inline void *cache_pop(uint16_t units) {
+  void **mem = cache.list[units - 1];
+  if (!mem) {
+    cache_refill(units);
+    mem = cache.list[units - 1];
+    if (!mem)
+      return NULL;
+  }
+  cache.list[units - 1] = *mem;
+  --cache.count[units - 1];
+  /* recycled memory isn't zeroed (and the first bytes were used by the list) */
+  memset(mem, 0, (size_t)units << 4);
+  return mem;
+}
+
+static inline void cache_push(void *mem, uint16_t units) {
+  cache_register();
+  *(void **)mem = cache.list[units - 1];
+  cache.list[units - 1] = mem;
+  if (++cache.count[units - 1] >= (FIO_MEM_CACHE_BATCH << 1))
+    cache_release(units, FIO_MEM_CACHE_BATCH);
+}
+
+#endif /* FIO_MEM_CACHE_UNITS */
+
+/* *****************************************************************************
+Forking (see `fio_malloc_before_fork`)
+***************************************************************************** */
+
+void fio_malloc_before_fork(void) {
+  if (!arenas)
+    return;
+#if FIO_MEM_CACHE_UNITS
+  for (uint16_t i = 1; i <= FIO_MEM_CACHE_UNITS; ++i)
+    cache_release(i, (size_t)-1);
+#endif
+  for (size_t i = 0; i < memory.cores; ++i) {
+    spn_lock(&arenas[i].lock);
+    if (arenas[i].block)
+      block_free(arenas[i].block);
+    arenas[i].block = NULL;
+#if FIO_MEM_CACHE_UNITS
+    for (size_t j = 0; j < FIO_MEM_CACHE_UNITS; ++j) {
+      if (arenas[i].cached[j])
+        block_free(arenas[i].cached[j]);
+      arenas[i].cached[j] = NULL;
+    }
+#endif
+    spn_unlock(&arenas[i].lock);
+  }
+}
+
+/* *****************************************************************************
+Batched deallocation (see `fio_free_batch_begin`)
+***************************************************************************** */
+
+static __thread struct {
+  block_s *blk[FIO_MEM_FREE_BATCH_BLOCKS];
+  intptr_t count[FIO_MEM_FREE_BATCH_BLOCKS];
+  uint16_t used;
+  uint16_t depth;
+} free_batch;
+
+/* returns the collected references to their blocks. */
+static void free_batch_flush(void) {
+  for (uint16_t i = 0; i < free_batch.used; ++i)
+    block_release(free_batch.blk[i], free_batch.count[i]);
+  free_batch.used = 0;
+}
+
+static inline void free_batch_push(block_s *blk) {
+  for (uint16_t i = 0; i < free_batch.used; ++i) {
+    if (free_batch.blk[i] == blk) {
+      ++free_batch.count[i];
+      return;
+    }
+  }
+  if (free_batch.used == FIO_MEM_FREE_BATCH_BLOCKS)
+    free_batch_flush();
+  free_batch.blk[free_batch.used] = blk;
+  free_batch.count[free_batch.used] = 1;
+  ++free_batch.used;
+}
+
+void fio_free_batch_begin(void) { ++free_batch.depth; }
+
+void fio_free_batch_end(void) {
+  if (!free_batch.depth || --free_batch.depth)
+    return;
+  free_batch_flush();
+}
+
 static inline void block_slice_free(void *mem) {
   /* locate block boundary */
   block_s *blk = (block_s *)((uintptr_t)mem & (~FIO_MEMORY_BLOCK_MASK));
+#if FIO_MEM_CACHE_UNITS
+  if (blk->size_class) {
+    cache_push(mem, blk->size_class);
+    return;
+  }
+#endif
+  if (free_batch.depth) {
+    free_batch_push(blk);
+    return;
+  }
   block_free(blk);
 }
 
@@ -393,6 +608,8 @@ static inline void *big_alloc(size_t size) {
   size_t *mem = sys_alloc(size, 1);
   if (mem) { /* likely */
     *mem = size;
+    spn_add(&memory.big_count, 1);
+    spn_add(&memory.big_bytes, (intptr_t)size);
     return (void *)(((uintptr_t)mem) + 16);
   }
   return NULL;
@@ -400,15 +617,19 @@ static inline void *big_alloc(size_t size) {
 
 static inline void big_free(void *ptr) {
   size_t *mem = (void *)(((uintptr_t)ptr) - 16);
+  spn_sub(&memory.big_count, 1);
+  spn_sub(&memory.big_bytes, (intptr_t)*mem);
   sys_free(mem, *mem);
 }
 
 static inline void *big_realloc(void *ptr, size_t new_size) {
   size_t *mem = (void *)(((uintptr_t)ptr) - 16);
+  const size_t old_size = *mem;
   new_size = sys_round_size(new_size + 16);
   mem = sys_realloc(mem, *mem, new_size);
   if (!mem)
     return NULL;
+  spn_add(&memory.big_bytes, (intptr_t)new_size - (intptr_t)old_size);
   *mem = new_size;
   return (void *)(((uintptr_t)mem) + 16);
 }
@@ -426,6 +647,10 @@ static void __attribute__((constructor)) fio_mem_init(void) {
 #else
 #warning Dynamic CPU core count is unavailable - assuming 8 cores for memory allocation pools.
   ssize_t cpu_count = 8; /* fallback */
+#endif
+#if FIO_MEM_HUGE_PAGES && defined(PR_SET_THP_DISABLE)
+  /* huge pages might be disabled for the process (i.e., by Ruby) */
+  prctl(PR_SET_THP_DISABLE, 0, 0, 0, 0);
 #endif
   memory.cores = cpu_count;
   memory.count = 0 - (intptr_t)cpu_count;
@@ -434,10 +659,14 @@ static void __attribute__((constructor)) fio_mem_init(void) {
     perror("FATAL ERROR: Couldn't initialize memory allocator");
     exit(errno);
   }
+#if FIO_MEM_CACHE_UNITS
+  pthread_key_create(&cache_key, cache_on_thread_exit);
+#endif
   size_t pre_pool = cpu_count > 32 ? 32 : cpu_count;
   for (size_t i = 0; i < pre_pool; ++i) {
     void *block = sys_alloc(FIO_MEMORY_BLOCK_SIZE, 0);
     if (block) {
+      spn_add(&memory.blocks, 1);
       block_init(block);
       block_free(block);
     }
@@ -453,6 +682,13 @@ static void __attribute__((destructor)) fio_mem_destroy(void) {
     if (arena->block)
       block_free(arena->block);
     arena->block = NULL;
+#if FIO_MEM_CACHE_UNITS
+    for (size_t j = 0; j < FIO_MEM_CACHE_UNITS; ++j) {
+      if (arena->cached[j])
+        block_free(arena->cached[j]);
+      arena->cached[j] = NULL;
+    }
+#endif
     ++arena;
   }
   while (memory.available) {
@@ -477,8 +713,12 @@ void *fio_malloc(size_t size) {
   }
   /* ceiling for 16 byte alignement, translated to 16 byte units */
   size = (size >> 4) + (!!(size & 15));
+#if FIO_MEM_CACHE_UNITS
+  if (size <= FIO_MEM_CACHE_UNITS)
+    return cache_pop(size);
+#endif
   arena_enter();
-  void *mem = block_slice(size);
+  void *mem = block_slice(&arena_last_used->block, size, 0);
   arena_exit();
   return mem;
 }
@@ -532,6 +772,59 @@ void *fio_realloc(void *ptr, size_t new_size) {
   return fio_realloc2(ptr, new_size, max_old);
 }
 
+/* *****************************************************************************
+Memory statistics and trimming
+***************************************************************************** */
+
+fio_mem_stats_s fio_mem_stats(void) {
+  fio_mem_stats_s stats = {
+      .arenas = memory.cores,
+      .block_size = FIO_MEMORY_BLOCK_SIZE,
+      .big_allocations = (size_t)memory.big_count,
+      .big_bytes = (size_t)memory.big_bytes,
+  };
+  spn_lock(&memory.lock);
+  stats.blocks = (size_t)memory.blocks;
+  stats.blocks_pooled = (size_t)memory.pooled;
+  stats.blocks_trimmed = (size_t)memory.trimmed;
+  spn_unlock(&memory.lock);
+  return stats;
+}
+
+size_t fio_mem_trim(void) {
+  size_t count = 0;
+  spn_lock(&memory.lock);
+  block_s **pos = &memory.available;
+  while (*pos) {
+    block_s *blk = *pos;
+    uintptr_t *mark = (uintptr_t *)blk + 1;
+    if (*mark == 0) {
+      /* the block was pooled since the last call, it's idle if it remains */
+      *mark = BLOCK_IDLE;
+    } else if (*mark == BLOCK_IDLE) {
+      ++count;
+#if defined(__linux__) && defined(MADV_DONTNEED)
+      /* pages read as zero once they're accessed again (the header is kept) */
+      madvise((void *)((uintptr_t)blk + 4096), FIO_MEMORY_BLOCK_SIZE - 4096,
+              MADV_DONTNEED);
+      *mark = BLOCK_TRIMMED;
+      ++memory.trimmed;
+#else
+      /* released memory isn't promised to be zeroed, unmap the block */
+      *pos = *(block_s **)blk;
+      --memory.pooled;
+      spn_sub(&memory.count, 1);
+      spn_sub(&memory.blocks, 1);
+      sys_free(blk, FIO_MEMORY_BLOCK_SIZE);
+      continue;
+#endif
+    }
+    pos = (block_s **)blk;
+  }
+  spn_unlock(&memory.lock);
+  return count;
+}
+
 /* *****************************************************************************
 FIO_OVERRIDE_MALLOC - override glibc / library malloc
 ***************************************************************************** */
@@ -587,6 +880,20 @@ void fio_malloc_test(void) {
   mem = fio_realloc(mem, 1);
   TEST_ASSERT(mem[0] == 'a', "fio_realloc memory wasn't copied!\n");
   TEST_ASSERT(arena_last_used, "arena_last_used wasn't initialized!\n");
+#if FIO_MEM_CACHE_UNITS
+  fio_free(mem);
+  mem2 = fio_malloc(1);
+  TEST_ASSERT(mem2 == mem, "thread cache didn't recycle the allocation!\n");
+  TEST_ASSERT(!((size_t *)mem2)[0] && !((size_t *)mem2)[1],
+              "recycled memory wasn't zeroed!\n");
+  fio_free(mem2);
+  cache_release(1, (size_t)-1);
+  TEST_ASSERT(!cache.list[0] && !cache.count[0],
+              "thread cache wasn't released!\n");
+#endif
+  /* allocations that bypass the thread caches, so blocks rotate */
+  const size_t slice = (FIO_MEM_CACHE_UNITS + 1) << 4;
+  mem = fio_malloc(slice);
   block_s *b = arena_last_used->block;
   size_t count = 2;
   intptr_t old_memory_pool_count = memory.count;
@@ -601,8 +908,9 @@ void fio_malloc_test(void) {
 #else
     mem[0] = 'a';
 #endif
-    fio_free(mem); /* make sure we hold on to the block, so it rotates */
-    mem = fio_malloc(1);
+    mem2 = mem;
+    mem = fio_malloc(slice);
+    fio_free(mem2); /* make sure we hold on to the block, so it rotates */
     ++count;
   } while (arena_last_used->block == b);
   {
@@ -611,7 +919,8 @@ void fio_malloc_test(void) {
         "* Performed %zu allocations out of expected %zu allocations per "
         "block.\n",
         count,
-        (size_t)((FIO_MEMORY_BLOCK_SLICES - 2) - (sizeof(block_s) >> 4) - 1));
+        (size_t)(((FIO_MEMORY_BLOCK_SLICES - 2) - (sizeof(block_s) >> 4) - 1) /
+                 (slice >> 4)));
     TEST_ASSERT(memory.available,
                 "memory pool empty (memory block wasn't freed)!\n");
     TEST_ASSERT(old_memory_pool_count == memory.count,
@@ -619,12 +928,12 @@ void fio_malloc_test(void) {
                 (long)old_memory_pool_count);
     fio_free(mem);
   }
-  /* rotate block again */
+  /* rotate block again (`mem` was freed, so it can't be reallocated) */
   b = arena_last_used->block;
-  mem = fio_realloc(mem, 1);
+  mem = fio_malloc(slice);
   do {
     mem2 = mem;
-    mem = fio_malloc(1);
+    mem = fio_malloc(slice);
     fio_free(mem2); /* make sure we hold on to the block, so it rotates */
     TEST_ASSERT(mem, "fio_malloc failed to allocate memory!\n");
     TEST_ASSERT(!((uintptr_t)mem & 15),
@@ -24,13 +24,18 @@ Feel free to copy, use and enjoy according to the license provided.
  * fragmentation within a memory "block" and waiting for the whole "block" to be
  * freed before it's memory is recycled (no "free list").
  *
+ * The exceptions are small allocations (up to FIO_MEM_CACHE_UNITS 16 byte
+ * units), which are served from lock-free per-thread free lists, one per size
+ * class. These lists are refilled from the arenas (using blocks reserved for
+ * the size class) and return memory to the blocks in batches.
+ *
  * This allocator should NOT be used for objects with a long life-span, because
  * even a single persistent object will prevent the re-use of the whole memory
  * block (128Kb by default) from which it was allocated.
  *
  * A memory "block" can include any number of memory pages that are a multiple
- * of 2 (up to 1Mb of memory). However, the default value, set by
- * MEMORY_BLOCK_SIZE, is either 128Kb (set at th end of this header).
+ * of 2. However, the default value, set by MEMORY_BLOCK_SIZE, is either 128Kb
+ * or 2Mb when using huge pages (set at th end of this header).
  *
  * Each block includes a header that uses reference counters and position
  * markers.
@@ -88,12 +93,68 @@ void *fio_realloc(void *ptr, size_t new_size);
  */
 void *fio_realloc2(void *ptr, size_t new_size, size_t copy_length);
 
+/**
+ * Starts collecting `fio_free` calls, so memory is returned to its blocks using
+ * a single reference update per block once the (outermost) batch ends.
+ *
+ * Batches can be nested. Memory freed during a batch is never reused before
+ * the batch ends, so keep batches short (i.e., the release of a large object).
+ */
+void fio_free_batch_begin(void);
+
+/** Ends a `fio_free_batch_begin` batch, see `fio_free_batch_begin`. */
+void fio_free_batch_end(void);
+
 /** Clears any memory locks, in case of a system call to `fork`. */
 void fio_malloc_after_fork(void);
 
+/**
+ * Retires the partially used memory blocks (and the calling thread's cache), so
+ * allocations made after a call to `fork` use new blocks instead of writing to
+ * (and copying) the memory pages shared with the parent process.
+ */
+void fio_malloc_before_fork(void);
+
 /** Tests the facil.io memory allocator. */
 void fio_malloc_test(void);
 
+/** Memory allocator statistics, see `fio_mem_stats`. */
+typedef struct {
+  /** the number of per-CPU arenas. */
+  size_t arenas;
+  /** the size of a memory block (see FIO_MEMORY_BLOCK_SIZE). */
+  size_t block_size;
+  /** the number of memory blocks held by the allocator (used or pooled). */
+  size_t blocks;
+  /** the number of unused memory blocks, pooled for future allocations. */
+  size_t blocks_pooled;
+  /** pooled memory blocks who's memory was returned to the system. */
+  size_t blocks_trimmed;
+  /** the number of allocations made directly from the system (big ones). */
+  size_t big_allocations;
+  /** the memory used by allocations made directly from the system. */
+  size_t big_bytes;
+} fio_mem_stats_s;
+
+/**
+ * Returns the memory allocator's statistics.
+ *
+ * Memory in used blocks (`blocks - blocks_pooled`) might be fragmented, as a
+ * block is only recycled once all of its allocations were freed.
+ */
+fio_mem_stats_s fio_mem_stats(void);
+
+/**
+ * Returns the memory of idle pooled blocks to the system (the blocks remain
+ * pooled and their memory is reacquired on demand).
+ *
+ * A pooled block is considered idle if it remained in the pool since the
+ * previous call to `fio_mem_trim`.
+ *
+ * Returns the number of blocks trimmed.
+ */
+size_t fio_mem_trim(void);
+
 /** If defined, `malloc` will be used instead of the fio_malloc functions */
 #if FIO_FORCE_MALLOC
 #define fio_malloc malloc
@@ -103,6 +164,11 @@ void fio_malloc_test(void);
 #define fio_realloc2(ptr, new_size, old_data_len) realloc((ptr), (new_size))
 #define fio_malloc_test()
 #define fio_malloc_after_fork
+#define fio_malloc_before_fork()
+#define fio_free_batch_begin()
+#define fio_free_batch_end()
+#define fio_mem_stats() ((fio_mem_stats_s){.arenas = 0})
+#define fio_mem_trim() ((size_t)0)
 
 /* allows local override as well as global override */
 #elif FIO_OVERRIDE_MALLOC
@@ -121,10 +187,53 @@ void fio_malloc_test(void);
 #define FIO_MEM_MAX_BLOCKS_PER_CORE 32 /* approx. 2Mb per CPU core */
 #endif
 
+#ifndef FIO_MEM_CACHE_UNITS
+/**
+ * Allocations of up to this many 16 byte units (128 bytes by default, i.e.,
+ * FIOBJ objects, `sock` packets and short strings) are served from per-thread
+ * caches. Set to 0 to disable the per-thread caches.
+ */
+#define FIO_MEM_CACHE_UNITS 8
+#endif
+
+#ifndef FIO_MEM_CACHE_BATCH
+/**
+ * The number of allocations moved between a thread's cache and the arenas at a
+ * time. A thread caches up to twice this number of allocations per size class.
+ */
+#define FIO_MEM_CACHE_BATCH 32
+#endif
+
+#ifndef FIO_MEM_FREE_BATCH_BLOCKS
+/**
+ * The number of different memory blocks tracked during a `fio_free` batch
+ * before the collected memory is returned to its blocks.
+ */
+#define FIO_MEM_FREE_BATCH_BLOCKS 8
+#endif
+
+#ifndef FIO_MEM_HUGE_PAGES
+/**
+ * When set to 1, memory allocated from the system (memory blocks, big
+ * allocations and the `sock` library's file descriptor table) is advised to
+ * use transparent huge pages (`MADV_HUGEPAGE`) and memory blocks default to
+ * the size of a huge page (2Mb).
+ *
+ * This reduces TLB misses when using a lot of memory, but increases the memory
+ * footprint. Transparent huge pages must be enabled (at least in "madvise"
+ * mode) for this to have any effect.
+ */
+#define FIO_MEM_HUGE_PAGES 0
+#endif
+
 /** Allocator default settings. */
 #ifndef FIO_MEMORY_BLOCK_SIZE_LOG
+#if FIO_MEM_HUGE_PAGES
+#define FIO_MEMORY_BLOCK_SIZE_LOG (21) /* 21 == 2Mb (a huge page) */
+#else
 #define FIO_MEMORY_BLOCK_SIZE_LOG (17) /* 17 == 128Kb */
 #endif
+#endif
 #ifndef FIO_MEMORY_BLOCK_SIZE
 #define FIO_MEMORY_BLOCK_SIZE ((uintptr_t)1 << FIO_MEMORY_BLOCK_SIZE_LOG)
 #endif
@@ -12,6 +12,16 @@ Feel free to copy, use and enjoy in accordance with to the license(s).
 
 #include <string.h>
 
+/* the SHA extensions are used when the compiler targets them (-march=native) */
+#if defined(__SHA__) && defined(__SSE4_1__)
+#include <immintrin.h>
+#define FIO_SHA1_X86 1
+#elif defined(__aarch64__) &&                                                  \
+    (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#include <arm_neon.h>
+#define FIO_SHA1_ARM 1
+#endif
+
 /*****************************************************************************
 Useful Macros - Not all of them are used here, but it's a copy-paste convenience
 */
@@ -69,6 +79,120 @@ Converts a 4 byte string to a Big Endian uint32_t word. (ignores alignment!)
       (((*((uint32_t *)(c))) & 0xFF0000UL) >> 8) |                             \
       (((*((uint32_t *)(c))) & 0xFF000000UL) >> 24)
 #endif
+#if FIO_SHA1_X86
+/**
+Process the buffer once full (using the x86 SHA extensions, SHA-NI).
+*/
+static inline void perform_all_rounds(sha1_s *s, const uint8_t *buffer) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_loadu_si128((const __m128i *)s->digest.i);
+  __m128i abcd_save, e0, e0_save, e1, msg[4];
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  e0 = _mm_set_epi32(s->digest.i[4], 0, 0, 0);
+  abcd_save = abcd;
+  e0_save = e0;
+  msg[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buffer), mask);
+  msg[1] =
+      _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buffer + 16)), mask);
+  msg[2] =
+      _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buffer + 32)), mask);
+  msg[3] =
+      _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buffer + 48)), mask);
+
+  /* rounds 0-11, while the message schedule is loaded */
+  e0 = _mm_add_epi32(e0, msg[0]);
+  e1 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+  e1 = _mm_sha1nexte_epu32(e1, msg[1]);
+  e0 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+  msg[0] = _mm_sha1msg1_epu32(msg[0], msg[1]);
+
+  e0 = _mm_sha1nexte_epu32(e0, msg[2]);
+  e1 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+  msg[1] = _mm_sha1msg1_epu32(msg[1], msg[2]);
+  msg[0] = _mm_xor_si128(msg[0], msg[2]);
+
+/* four rounds, computing the message schedule for the following rounds */
+#define perform_four_rounds(i, e_in, e_out, f)                                 \
+  e_in = _mm_sha1nexte_epu32(e_in, msg[(i)&3]);                                \
+  e_out = abcd;                                                                \
+  msg[((i) + 1) & 3] = _mm_sha1msg2_epu32(msg[((i) + 1) & 3], msg[(i)&3]);     \
+  abcd = _mm_sha1rnds4_epu32(abcd, e_in, (f));                                 \
+  msg[((i) + 3) & 3] = _mm_sha1msg1_epu32(msg[((i) + 3) & 3], msg[(i)&3]);     \
+  msg[((i) + 2) & 3] = _mm_xor_si128(msg[((i) + 2) & 3], msg[(i)&3]);
+
+  perform_four_rounds(3, e1, e0, 0);
+  perform_four_rounds(4, e0, e1, 0);
+  perform_four_rounds(5, e1, e0, 1);
+  perform_four_rounds(6, e0, e1, 1);
+  perform_four_rounds(7, e1, e0, 1);
+  perform_four_rounds(8, e0, e1, 1);
+  perform_four_rounds(9, e1, e0, 1);
+  perform_four_rounds(10, e0, e1, 2);
+  perform_four_rounds(11, e1, e0, 2);
+  perform_four_rounds(12, e0, e1, 2);
+  perform_four_rounds(13, e1, e0, 2);
+  perform_four_rounds(14, e0, e1, 2);
+  perform_four_rounds(15, e1, e0, 3);
+  perform_four_rounds(16, e0, e1, 3);
+  perform_four_rounds(17, e1, e0, 3);
+  perform_four_rounds(18, e0, e1, 3);
+  perform_four_rounds(19, e1, e0, 3);
+#undef perform_four_rounds
+
+  /* store data */
+  e0 = _mm_sha1nexte_epu32(e0, e0_save);
+  abcd = _mm_add_epi32(abcd, abcd_save);
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  _mm_storeu_si128((__m128i *)s->digest.i, abcd);
+  s->digest.i[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#elif FIO_SHA1_ARM
+/**
+Process the buffer once full (using the ARMv8 cryptography extensions).
+*/
+static inline void perform_all_rounds(sha1_s *s, const uint8_t *buffer) {
+  static const uint32_t k[4] = {0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC,
+                                0xCA62C1D6};
+  uint32x4_t abcd = vld1q_u32(s->digest.i);
+  uint32x4_t abcd_save = abcd;
+  uint32_t e = s->digest.i[4];
+  uint32_t e_next;
+  uint32x4_t msg[4], tmp;
+  for (int i = 0; i < 4; ++i)
+    msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buffer + (i << 4))));
+  for (int i = 0; i < 20; ++i) {
+    tmp = vaddq_u32(msg[i & 3], vdupq_n_u32(k[i / 5]));
+    e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    switch (i / 5) {
+    case 0:
+      abcd = vsha1cq_u32(abcd, e, tmp);
+      break;
+    case 2:
+      abcd = vsha1mq_u32(abcd, e, tmp);
+      break;
+    default:
+      abcd = vsha1pq_u32(abcd, e, tmp);
+      break;
+    }
+    e = e_next;
+    /* the message schedule for the rounds following the next three */
+    if (i < 16)
+      msg[i & 3] = vsha1su1q_u32(
+          vsha1su0q_u32(msg[i & 3], msg[(i + 1) & 3], msg[(i + 2) & 3]),
+          msg[(i + 3) & 3]);
+  }
+  /* store data */
+  vst1q_u32(s->digest.i, vaddq_u32(abcd, abcd_save));
+  s->digest.i[4] += e;
+}
+
+#else
 /**
 Process the buffer once full.
 */
@@ -192,6 +316,7 @@ static inline void perform_all_rounds(sha1_s *s, const uint8_t *buffer) {
   s->digest.i[1] += b;
   s->digest.i[0] += a;
 }
+#endif
 
 /* ***************************************************************************
 SHA-1 hashing
@@ -232,7 +357,7 @@ void fio_sha1_write(sha1_s *s, const void *data, size_t len) {
     len -= 64;
   }
   if (len) {
-    memcpy(s->buffer + in_buffer, data, len);
+    memcpy(s->buffer, data, len);
   }
   return;
 }
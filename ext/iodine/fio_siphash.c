@@ -3,6 +3,16 @@ Copyright: Boaz Segev, 2017
 License: MIT
 */
 #include "fio_siphash.h"
+#include "fio_random.h"
+
+#include <string.h>
+
+#ifndef __has_include
+#define __has_include(x) 0
+#endif
+#if __has_include(<sys/random.h>)
+#include <sys/random.h>
+#endif
 
 /* *****************************************************************************
 Hashing (SipHash implementation)
@@ -106,3 +116,92 @@ uint64_t fio_siphash(const void *data, size_t len) {
 #undef hash_map_SipRound
   return v0;
 }
+
+/* *****************************************************************************
+Hashing (Risky Hash, a wyhash style hash)
+***************************************************************************** */
+
+#define RISKY_P0 0xa0761d6478bd642fULL
+#define RISKY_P1 0xe7037ed1a0b428dbULL
+#define RISKY_P2 0x8ebc6af09c88c6e3ULL
+#define RISKY_P3 0x589965cc75374cc3ULL
+
+/* the per process seed, set at startup (before any worker is forked) */
+static uint64_t fio_risky_seed;
+
+/* multiplies two 64 bit numbers, folding the 128 bit result to 64 bits */
+static inline uint64_t risky_mum(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+/* reads unaligned words (the byte order is irrelevant for hashing) */
+static inline uint64_t risky_r64(const uint8_t *p) {
+  uint64_t i;
+  memcpy(&i, p, 8);
+  return i;
+}
+static inline uint64_t risky_r32(const uint8_t *p) {
+  uint32_t i;
+  memcpy(&i, p, 4);
+  return i;
+}
+
+static void __attribute__((constructor)) fio_risky_seed_init(void) {
+  uint64_t seed;
+#if __has_include(<sys/random.h>)
+  /* avoids opening (and keeping) `/dev/urandom` while the library loads */
+  if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed))
+#endif
+    seed = fio_rand64();
+  fio_risky_seed = seed ^ risky_mum(seed ^ RISKY_P0, RISKY_P1);
+}
+
+uint64_t fio_risky_hash(const void *data, size_t len) {
+  const uint8_t *p = data;
+  uint64_t seed = fio_risky_seed;
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (risky_r32(p) << 32) | risky_r32(p + ((len >> 3) << 2));
+      b = (risky_r32(p + len - 4) << 32) |
+          risky_r32(p + len - 4 - ((len >> 3) << 2));
+    } else if (len) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t s1 = seed, s2 = seed;
+      do {
+        seed = risky_mum(risky_r64(p) ^ RISKY_P1, risky_r64(p + 8) ^ seed);
+        s1 = risky_mum(risky_r64(p + 16) ^ RISKY_P2, risky_r64(p + 24) ^ s1);
+        s2 = risky_mum(risky_r64(p + 32) ^ RISKY_P3, risky_r64(p + 40) ^ s2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= s1 ^ s2;
+    }
+    while (i > 16) {
+      seed = risky_mum(risky_r64(p) ^ RISKY_P1, risky_r64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = risky_r64(p + i - 16);
+    b = risky_r64(p + i - 8);
+  }
+  return risky_mum(RISKY_P1 ^ len, risky_mum(a ^ RISKY_P1, b ^ seed));
+}
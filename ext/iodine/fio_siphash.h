@@ -15,4 +15,14 @@
  */
 uint64_t fio_siphash(const void *data, size_t len);
 
+/**
+ * A fast (non-cryptographic) hashing function, seeded once per process (at
+ * startup), so the hash values can't be predicted by clients.
+ *
+ * Used by internal tables where speed matters more than SipHash's stronger
+ * guarantees. Values differ between executions (never store them) and differ
+ * from `fio_siphash`, so a table must use a single hashing function.
+ */
+uint64_t fio_risky_hash(const void *data, size_t len);
+
 #endif
@@ -0,0 +1,335 @@
+/*
+Copyright: Boaz Segev, 2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#include "spnlock.inc"
+
+#include "fio_stats.h"
+
+#include "defer.h"
+#include "facil.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* the cluster message filter used for sharing statistics */
+#define FIO_STATS_CLUSTER_FILTER ((int32_t)-32)
+
+/* *****************************************************************************
+Per-thread statistics slots
+***************************************************************************** */
+
+typedef struct fio_stats_slot_s {
+  struct fio_stats_slot_s *next;
+  /* set while a thread owns the slot */
+  volatile uint8_t active;
+  fio_stats_s data;
+} fio_stats_slot_s;
+
+static struct {
+  /* slots are never freed, they are reused once their thread exits */
+  fio_stats_slot_s *slots;
+  spn_lock_i lock;
+  pthread_key_t key;
+} fio_stats_data = {.lock = SPN_LOCK_INIT};
+
+static __thread fio_stats_slot_s *fio_stats_local;
+
+#if FIO_STATS
+
+static pthread_once_t fio_stats_once = PTHREAD_ONCE_INIT;
+
+static void fio_stats_on_thread_exit(void *slot) {
+  ((fio_stats_slot_s *)slot)->active = 0;
+}
+
+static void fio_stats_key_init(void) {
+  pthread_key_create(&fio_stats_data.key, fio_stats_on_thread_exit);
+}
+
+/* returns the calling thread's slot (the slow path is once per thread). */
+static fio_stats_s *fio_stats_local_get(void) {
+  if (fio_stats_local)
+    return &fio_stats_local->data;
+  pthread_once(&fio_stats_once, fio_stats_key_init);
+  fio_stats_slot_s *slot;
+  spn_lock(&fio_stats_data.lock);
+  for (slot = fio_stats_data.slots; slot && slot->active; slot = slot->next)
+    ;
+  if (!slot) {
+    /* the system's allocator is used, since slots are never freed */
+    slot = calloc(1, sizeof(*slot));
+    if (!slot) {
+      spn_unlock(&fio_stats_data.lock);
+      perror("FATAL ERROR: (fio_stats) couldn't allocate memory");
+      exit(errno);
+    }
+    slot->next = fio_stats_data.slots;
+    fio_stats_data.slots = slot;
+  }
+  slot->active = 1;
+  spn_unlock(&fio_stats_data.lock);
+  pthread_setspecific(fio_stats_data.key, slot);
+  fio_stats_local = slot;
+  return &slot->data;
+}
+
+#endif
+
+/* *****************************************************************************
+Recording
+***************************************************************************** */
+
+#if FIO_STATS
+
+/* returns the histogram's bucket for the value. */
+static inline size_t fio_stats_bucket(uint64_t value) {
+  if (value < 8)
+    return (size_t)value;
+  size_t exp = 63 - __builtin_clzll(value);
+  if (exp > FIO_STATS_MAX_EXP)
+    return FIO_STATS_BUCKETS - 1;
+  return ((exp - 2) << 3) | ((value >> (exp - 3)) & 7);
+}
+
+/** Adds `value` to the counter. */
+void fio_stats_add(fio_stats_counter_e counter, size_t value) {
+  fio_stats_local_get()->counters[counter] += value;
+}
+
+/** Records a latency value (in nanoseconds) in the histogram. */
+void fio_stats_record(fio_stats_histogram_e histogram, uint64_t nanoseconds) {
+  fio_stats_s *s = fio_stats_local_get();
+  ++s->histograms[histogram][fio_stats_bucket(nanoseconds)];
+  s->sums[histogram] += nanoseconds;
+}
+
+#endif
+
+/* *****************************************************************************
+Collecting
+***************************************************************************** */
+
+/* adds the statistics in `src` to `dest` */
+static void fio_stats_sum(fio_stats_s *dest, const fio_stats_s *src) {
+  dest->processes += src->processes;
+  dest->connections += src->connections;
+  dest->defer_queue += src->defer_queue;
+  for (size_t i = 0; i < FIO_STATS_COUNTERS; ++i)
+    dest->counters[i] += src->counters[i];
+  for (size_t i = 0; i < FIO_STATS_HISTOGRAMS; ++i) {
+    dest->sums[i] += src->sums[i];
+    for (size_t j = 0; j < FIO_STATS_BUCKETS; ++j)
+      dest->histograms[i][j] += src->histograms[i][j];
+  }
+}
+
+/** Collects the calling process' statistics into `dest`. */
+void fio_stats_collect(fio_stats_s *dest) {
+  *dest = (fio_stats_s){.processes = 1};
+  spn_lock(&fio_stats_data.lock);
+  /* values might be updated while they're read, but they're never torn */
+  for (fio_stats_slot_s *slot = fio_stats_data.slots; slot; slot = slot->next)
+    fio_stats_sum(dest, &slot->data);
+  spn_unlock(&fio_stats_data.lock);
+  dest->connections = facil_count(NULL);
+  dest->defer_queue = defer_queue_len();
+}
+
+/* returns the highest value in the histogram's bucket. */
+static inline uint64_t fio_stats_bucket_value(size_t bucket) {
+  if (bucket < 8)
+    return bucket;
+  size_t exp = (bucket >> 3) + 2;
+  return ((uint64_t)((bucket & 7) | 8) << (exp - 3)) +
+         (((uint64_t)1 << (exp - 3)) - 1);
+}
+
+/** Returns the number of values recorded by a histogram. */
+uint64_t fio_stats_count(const uint64_t *histogram) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < FIO_STATS_BUCKETS; ++i)
+    count += histogram[i];
+  return count;
+}
+
+/**
+ * Returns the latency (in nanoseconds) under which `percentile` (0.0-1.0) of
+ * the values recorded by the histogram fall.
+ */
+uint64_t fio_stats_percentile(const uint64_t *histogram, double percentile) {
+  uint64_t count = fio_stats_count(histogram);
+  if (!count)
+    return 0;
+  uint64_t target = (uint64_t)(percentile * count);
+  if (target < count && (double)target < percentile * count)
+    ++target;
+  if (!target)
+    target = 1;
+  for (size_t i = 0; i < FIO_STATS_BUCKETS; ++i) {
+    if (histogram[i] >= target)
+      return fio_stats_bucket_value(i);
+    target -= histogram[i];
+  }
+  return fio_stats_bucket_value(FIO_STATS_BUCKETS - 1);
+}
+
+/* *****************************************************************************
+Cluster statistics
+***************************************************************************** */
+
+/* the last statistics shared by another process */
+typedef struct {
+  pid_t pid;
+  time_t updated;
+  /* connections handed to the process since it's last update */
+  uint64_t handed;
+  fio_stats_s stats;
+} fio_stats_peer_s;
+
+static struct {
+  fio_stats_peer_s *peers;
+  size_t count;
+  size_t capa;
+  spn_lock_i lock;
+} fio_stats_cluster_data = {.lock = SPN_LOCK_INIT};
+
+/* statistics older than this (in seconds) belong to processes that exited */
+#define FIO_STATS_STALE ((time_t)(((FIO_STATS_INTERVAL * 3) / 1000) + 1))
+
+static void fio_stats_on_cluster_message(int32_t filter, FIOBJ ch, FIOBJ msg) {
+  pid_t pid = (pid_t)fiobj_obj2num(ch);
+  fio_cstr_s s = fiobj_obj2cstr(msg);
+  if (pid == getpid() || s.len != sizeof(fio_stats_s))
+    return;
+  time_t now = facil_last_tick().tv_sec;
+  spn_lock(&fio_stats_cluster_data.lock);
+  fio_stats_peer_s *peer = NULL;
+  for (size_t i = 0; i < fio_stats_cluster_data.count; ++i) {
+    fio_stats_peer_s *tmp = fio_stats_cluster_data.peers + i;
+    if (tmp->pid == pid || now - tmp->updated > FIO_STATS_STALE) {
+      /* a process that exited is replaced */
+      peer = tmp;
+      if (tmp->pid == pid)
+        break;
+    }
+  }
+  if (!peer) {
+    if (fio_stats_cluster_data.count == fio_stats_cluster_data.capa) {
+      size_t capa = fio_stats_cluster_data.capa << 1;
+      if (!capa)
+        capa = 8;
+      void *tmp = realloc(fio_stats_cluster_data.peers,
+                          capa * sizeof(fio_stats_peer_s));
+      if (!tmp) {
+        spn_unlock(&fio_stats_cluster_data.lock);
+        return;
+      }
+      fio_stats_cluster_data.peers = tmp;
+      fio_stats_cluster_data.capa = capa;
+    }
+    peer = fio_stats_cluster_data.peers + (fio_stats_cluster_data.count++);
+  }
+  peer->pid = pid;
+  peer->updated = now;
+  peer->handed = 0;
+  memcpy(&peer->stats, s.data, sizeof(fio_stats_s));
+  spn_unlock(&fio_stats_cluster_data.lock);
+  (void)filter;
+}
+
+/* shares the worker's statistics with the rest of the cluster */
+static void fio_stats_share_task(void *arg) {
+  fio_stats_s *stats = malloc(sizeof(*stats));
+  if (!stats)
+    return;
+  fio_stats_collect(stats);
+  FIOBJ ch = fiobj_num_new(getpid());
+  FIOBJ msg = fiobj_str_new((char *)stats, sizeof(*stats));
+  facil_cluster_send(FIO_STATS_CLUSTER_FILTER, ch, msg);
+  fiobj_free(ch);
+  fiobj_free(msg);
+  free(stats);
+  (void)arg;
+}
+
+/**
+ * Collects the statistics of the whole cluster into `dest`, using the last
+ * statistics shared by the other processes.
+ *
+ * Returns the number of processes included (same as `dest->processes`).
+ */
+size_t fio_stats_cluster(fio_stats_s *dest) {
+  fio_stats_collect(dest);
+  time_t now = facil_last_tick().tv_sec;
+  pid_t pid = getpid();
+  spn_lock(&fio_stats_cluster_data.lock);
+  for (size_t i = 0; i < fio_stats_cluster_data.count; ++i) {
+    fio_stats_peer_s *peer = fio_stats_cluster_data.peers + i;
+    if (peer->pid != pid && now - peer->updated <= FIO_STATS_STALE)
+      fio_stats_sum(dest, &peer->stats);
+  }
+  spn_unlock(&fio_stats_cluster_data.lock);
+  return (size_t)dest->processes;
+}
+
+/**
+ * Returns the pid of the (other) worker process with the fewest open
+ * connections, if it has at least `margin` connections less than `connections`
+ * (or 0 if there's no such worker).
+ */
+pid_t fio_stats_least_loaded(uint64_t connections, uint64_t margin) {
+  time_t now = facil_last_tick().tv_sec;
+  pid_t self = getpid();
+  fio_stats_peer_s *found = NULL;
+  uint64_t least = 0;
+  spn_lock(&fio_stats_cluster_data.lock);
+  for (size_t i = 0; i < fio_stats_cluster_data.count; ++i) {
+    fio_stats_peer_s *peer = fio_stats_cluster_data.peers + i;
+    if (peer->pid == self || now - peer->updated > FIO_STATS_STALE)
+      continue;
+    uint64_t count = peer->stats.connections + peer->handed;
+    if (!found || count < least) {
+      found = peer;
+      least = count;
+    }
+  }
+  pid_t ret = 0;
+  if (found && least + margin <= connections) {
+    ++found->handed;
+    ret = found->pid;
+  }
+  spn_unlock(&fio_stats_cluster_data.lock);
+  return ret;
+}
+
+/* *****************************************************************************
+Lifetime
+***************************************************************************** */
+
+/** Starts sharing statistics between the cluster's processes. */
+void fio_stats_on_start(void) {
+  facil_cluster_set_handler(FIO_STATS_CLUSTER_FILTER,
+                            fio_stats_on_cluster_message);
+  /* only workers share statistics (the root process isn't serving clients) */
+  if (facil_parent_pid() != getpid())
+    facil_run_every(FIO_STATS_INTERVAL, 0, fio_stats_share_task, NULL, NULL);
+}
+
+/** Resets the statistics (and locks) after a call to `fork`. */
+void fio_stats_on_fork(void) {
+  fio_stats_data.lock = SPN_LOCK_INIT;
+  fio_stats_cluster_data.lock = SPN_LOCK_INIT;
+  fio_stats_cluster_data.count = 0;
+  for (fio_stats_slot_s *slot = fio_stats_data.slots; slot; slot = slot->next) {
+    /* other threads don't exist in the new process */
+    slot->active = (slot == fio_stats_local);
+    memset(&slot->data, 0, sizeof(slot->data));
+  }
+}
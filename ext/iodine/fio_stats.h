@@ -0,0 +1,173 @@
+/*
+Copyright: Boaz Segev, 2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#ifndef H_FIO_STATS_H
+#define H_FIO_STATS_H
+
+/**
+ * Runtime statistics (counters and latency histograms).
+ *
+ * Each thread records into it's own statistics slot, so recording requires no
+ * locks or atomic operations. The slots are summed when the statistics are
+ * collected (slots are reused, never freed, so totals survive thread exits).
+ *
+ * Latency histograms are log-linear (8 sub-buckets per power of 2), so a
+ * reported latency is accurate up to ~12.5% (values are in nanoseconds).
+ *
+ * When running in cluster mode (more than a single worker process), workers
+ * share their statistics every FIO_STATS_INTERVAL milliseconds, so each process
+ * can report the statistics of the whole cluster (`fio_stats_cluster`).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef FIO_STATS
+/** When set to 0, the recording functions are replaced by empty macros. */
+#define FIO_STATS 1
+#endif
+
+#ifndef FIO_STATS_INTERVAL
+/** The interval (in milliseconds) in which workers share their statistics. */
+#define FIO_STATS_INTERVAL 1000
+#endif
+
+/** The highest power of 2 recorded by a histogram (values are capped). */
+#define FIO_STATS_MAX_EXP 40
+/** The number of buckets in a histogram. */
+#define FIO_STATS_BUCKETS ((FIO_STATS_MAX_EXP - 1) * 8)
+
+/** Counters, see `fio_stats_add`. */
+typedef enum {
+  /** bytes read from sockets (`sock_read`). */
+  FIO_STATS_BYTES_IN,
+  /** bytes written to sockets. */
+  FIO_STATS_BYTES_OUT,
+  /** Pub/Sub messages published by this process. */
+  FIO_STATS_PUBLISHED,
+  /** Pub/Sub messages delivered to this process' subscribers. */
+  FIO_STATS_DELIVERED,
+  /** Pub/Sub messages discarded by a subscription's delivery policy. */
+  FIO_STATS_DROPPED,
+  /** UDP datagrams discarded for being longer than `FACIL_DATAGRAM_SIZE`. */
+  FIO_STATS_TRUNCATED,
+  /** (the number of counters) */
+  FIO_STATS_COUNTERS,
+} fio_stats_counter_e;
+
+/** Latency histograms, see `fio_stats_record`. */
+typedef enum {
+  /** HTTP request parsing. */
+  FIO_STATS_HTTP_PARSE,
+  /** from parsing until the request handler starts (i.e., waiting for a lock).
+   */
+  FIO_STATS_HTTP_QUEUE,
+  /** the request handler (the application). */
+  FIO_STATS_HTTP_HANDLER,
+  /** from the handler's return until the response was handed to the socket. */
+  FIO_STATS_HTTP_FLUSH,
+  /** (the number of histograms) */
+  FIO_STATS_HISTOGRAMS,
+} fio_stats_histogram_e;
+
+/** Collected statistics. */
+typedef struct {
+  /** the number of processes included in the statistics. */
+  uint64_t processes;
+  /** open connections (`facil_count`). */
+  uint64_t connections;
+  /** tasks waiting in the `defer` queue. */
+  uint64_t defer_queue;
+  /** counters, see `fio_stats_counter_e`. */
+  uint64_t counters[FIO_STATS_COUNTERS];
+  /** the sum of the values recorded by each histogram (nanoseconds). */
+  uint64_t sums[FIO_STATS_HISTOGRAMS];
+  /** histograms, see `fio_stats_histogram_e`. */
+  uint64_t histograms[FIO_STATS_HISTOGRAMS][FIO_STATS_BUCKETS];
+} fio_stats_s;
+
+/* *****************************************************************************
+Recording
+***************************************************************************** */
+
+#if FIO_STATS
+
+/** Adds `value` to the counter. */
+void fio_stats_add(fio_stats_counter_e counter, size_t value);
+
+/** Records a latency value (in nanoseconds) in the histogram. */
+void fio_stats_record(fio_stats_histogram_e histogram, uint64_t nanoseconds);
+
+/** Returns a monotonic clock reading, in nanoseconds. */
+static inline uint64_t fio_stats_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+}
+
+#else
+
+#define fio_stats_add(counter, value) ((void)0)
+#define fio_stats_record(histogram, nanoseconds) ((void)0)
+#define fio_stats_now() ((uint64_t)0)
+
+#endif
+
+/* *****************************************************************************
+Collecting
+***************************************************************************** */
+
+/** Collects the calling process' statistics into `dest`. */
+void fio_stats_collect(fio_stats_s *dest);
+
+/**
+ * Collects the statistics of the whole cluster into `dest`, using the last
+ * statistics shared by the other processes.
+ *
+ * Returns the number of processes included (same as `dest->processes`).
+ */
+size_t fio_stats_cluster(fio_stats_s *dest);
+
+/**
+ * Returns the pid of the (other) worker process with the fewest open
+ * connections, if it has at least `margin` connections less than `connections`
+ * (or 0 if there's no such worker).
+ *
+ * The selected worker's connection count is incremented until it shares its
+ * statistics again, so a burst of connections isn't handed to a single worker.
+ */
+pid_t fio_stats_least_loaded(uint64_t connections, uint64_t margin);
+
+/** Returns the number of values recorded by a histogram. */
+uint64_t fio_stats_count(const uint64_t *histogram);
+
+/**
+ * Returns the latency (in nanoseconds) under which `percentile` (0.0-1.0) of
+ * the values recorded by the histogram fall.
+ */
+uint64_t fio_stats_percentile(const uint64_t *histogram, double percentile);
+
+/* *****************************************************************************
+Lifetime (called by facil.io)
+***************************************************************************** */
+
+/** Starts sharing statistics between the cluster's processes. */
+void fio_stats_on_start(void);
+
+/** Resets the statistics (and locks) after a call to `fork`. */
+void fio_stats_on_fork(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
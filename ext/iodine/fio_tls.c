@@ -0,0 +1,396 @@
+/*
+Copyright: Boaz Segev, 2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#include "spnlock.inc"
+
+#include "fio_tls.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef HAVE_OPENSSL
+#define HAVE_OPENSSL 0
+#endif
+
+#if HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/* *****************************************************************************
+The TLS Context
+***************************************************************************** */
+
+#ifndef FIO_TLS_ALPN_LIMIT
+/** The maximum number of protocols negotiated using ALPN. */
+#define FIO_TLS_ALPN_LIMIT 8
+#endif
+
+typedef struct {
+  void (*on_selected)(intptr_t uuid, void *udata);
+  uint8_t len;
+  char name[255];
+} fio_tls_alpn_s;
+
+struct fio_tls_s {
+  SSL_CTX *ctx;
+  volatile uintptr_t ref;
+  size_t alpn_count;
+  fio_tls_alpn_s alpn[FIO_TLS_ALPN_LIMIT];
+  /** the ALPN protocols list, in wire format (length prefixed) */
+  size_t wire_len;
+  uint8_t wire[FIO_TLS_ALPN_LIMIT * 256];
+};
+
+static inline fio_tls_s *fio_tls_dup(fio_tls_s *tls) {
+  spn_add(&tls->ref, 1);
+  return tls;
+}
+
+static void fio_tls_release(fio_tls_s *tls) {
+  if (spn_sub(&tls->ref, 1))
+    return;
+  SSL_CTX_free(tls->ctx);
+  free(tls);
+}
+
+/* selects the first protocol (in order of preference) offered by the client */
+static int fio_tls_alpn_select(SSL *ssl, const unsigned char **out,
+                               unsigned char *outlen, const unsigned char *in,
+                               unsigned int inlen, void *tls_) {
+  fio_tls_s *tls = tls_;
+  if (!tls->wire_len ||
+      SSL_select_next_proto((unsigned char **)out, outlen, tls->wire,
+                            (unsigned int)tls->wire_len, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  return SSL_TLSEXT_ERR_OK;
+  (void)ssl;
+}
+
+/* logs (and clears) the OpenSSL error queue */
+static void fio_tls_log_errors(const char *msg) {
+  unsigned long err;
+  fprintf(stderr, "ERROR: (TLS) %s\n", msg);
+  while ((err = ERR_get_error())) {
+    char buf[256];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    fprintf(stderr, "       %s\n", buf);
+  }
+}
+
+/**
+ * Creates a server TLS context using PEM encoded certificate (chain) and
+ * private key files. The `password` (used for encrypted keys) can be NULL.
+ *
+ * Returns NULL on error.
+ */
+fio_tls_s *fio_tls_new(const char *cert_file, const char *key_file,
+                       const char *password) {
+  if (!cert_file || !key_file)
+    return NULL;
+  fio_tls_s *tls = malloc(sizeof(*tls));
+  if (!tls)
+    return NULL;
+  *tls = (fio_tls_s){.ref = 1};
+  tls->ctx = SSL_CTX_new(TLS_server_method());
+  if (!tls->ctx)
+    goto error;
+  SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(tls->ctx,
+                      SSL_OP_NO_COMPRESSION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_ENABLE_KTLS
+  /* OpenSSL 3.0 configures the kernel's TLS offload when available */
+  SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  /* `sock` retries partial writes with the rest of the data (moved). */
+  SSL_CTX_set_mode(tls->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                 SSL_MODE_RELEASE_BUFFERS);
+  /* session resumption (session IDs and tickets) */
+  SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(tls->ctx, FIO_TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_session_id_context(tls->ctx, (const unsigned char *)"facil.io",
+                                 8);
+  /* load the certificate and the key */
+  SSL_CTX_set_default_passwd_cb_userdata(tls->ctx, (void *)password);
+  if (SSL_CTX_use_certificate_chain_file(tls->ctx, cert_file) != 1 ||
+      SSL_CTX_use_PrivateKey_file(tls->ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(tls->ctx) != 1) {
+    SSL_CTX_set_default_passwd_cb_userdata(tls->ctx, NULL);
+    fio_tls_log_errors("couldn't load the certificate / private key.");
+    goto error;
+  }
+  SSL_CTX_set_default_passwd_cb_userdata(tls->ctx, NULL);
+  SSL_CTX_set_alpn_select_cb(tls->ctx, fio_tls_alpn_select, tls);
+  return tls;
+error:
+  if (tls->ctx)
+    SSL_CTX_free(tls->ctx);
+  free(tls);
+  return NULL;
+}
+
+/**
+ * Adds a protocol to the list of protocols negotiated using ALPN (in order of
+ * preference).
+ */
+void fio_tls_alpn_add(fio_tls_s *tls, const char *protocol_name,
+                      void (*on_selected)(intptr_t uuid, void *udata)) {
+  size_t len = strlen(protocol_name);
+  if (!len || len > 255 || tls->alpn_count == FIO_TLS_ALPN_LIMIT) {
+    fprintf(stderr, "ERROR: (TLS) ALPN protocol ignored (%s).\n",
+            protocol_name);
+    return;
+  }
+  fio_tls_alpn_s *alpn = tls->alpn + (tls->alpn_count++);
+  alpn->on_selected = on_selected;
+  alpn->len = (uint8_t)len;
+  memcpy(alpn->name, protocol_name, len);
+  tls->wire[tls->wire_len++] = (uint8_t)len;
+  memcpy(tls->wire + tls->wire_len, protocol_name, len);
+  tls->wire_len += len;
+}
+
+/** Frees the TLS context. */
+void fio_tls_free(fio_tls_s *tls) {
+  if (tls)
+    fio_tls_release(tls);
+}
+
+/* *****************************************************************************
+The Connection's Read / Write Hooks
+***************************************************************************** */
+
+typedef struct {
+  SSL *ssl;
+  fio_tls_s *tls;
+  void (*on_open)(intptr_t uuid, void *udata);
+  void *udata;
+} fio_tls_connection_s;
+
+static ssize_t fio_tls_read(intptr_t uuid, void *udata, void *buf,
+                            size_t count) {
+  fio_tls_connection_s *c = udata;
+  if (!count)
+    return 0;
+  if (!SSL_is_init_finished(c->ssl)) {
+    /* the handshake protocol reads the data */
+    errno = EWOULDBLOCK;
+    return -1;
+  }
+  ERR_clear_error();
+  int ret = SSL_read(c->ssl, buf, (int)(count > INT_MAX ? INT_MAX : count));
+  if (ret > 0) {
+    /* decrypted data might remain buffered when the socket has no more data */
+    if (SSL_pending(c->ssl))
+      facil_force_event(uuid, FIO_EVENT_ON_DATA);
+    return ret;
+  }
+  switch (SSL_get_error(c->ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EWOULDBLOCK;
+    return -1;
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  }
+  ERR_clear_error();
+  errno = ECONNRESET;
+  return -1;
+}
+
+static ssize_t fio_tls_write(intptr_t uuid, void *udata, const void *buf,
+                             size_t count) {
+  fio_tls_connection_s *c = udata;
+  ERR_clear_error();
+  int ret = SSL_write(c->ssl, buf, (int)(count > INT_MAX ? INT_MAX : count));
+  if (ret > 0)
+    return ret;
+  switch (SSL_get_error(c->ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EWOULDBLOCK;
+    return -1;
+  }
+  ERR_clear_error();
+  errno = ECONNRESET;
+  return -1;
+  (void)uuid;
+}
+
+static void fio_tls_on_close(intptr_t uuid, struct sock_rw_hook_s *rw_hook,
+                             void *udata) {
+  fio_tls_connection_s *c = udata;
+  if (SSL_is_init_finished(c->ssl)) {
+    /* a best effort close_notify alert (the socket isn't blocking) */
+    ERR_clear_error();
+    SSL_shutdown(c->ssl);
+  }
+  ERR_clear_error();
+  SSL_free(c->ssl);
+  fio_tls_release(c->tls);
+  free(c);
+  (void)uuid;
+  (void)rw_hook;
+}
+
+/** the read / write hooks for TLS connections */
+static sock_rw_hook_s FIO_TLS_HOOKS = {
+    .read = fio_tls_read,
+    .write = fio_tls_write,
+    .on_close = fio_tls_on_close,
+};
+
+/**
+ * The hooks for connections using the kernel's TLS offload for outgoing data.
+ * The kernel encrypts anything written to the socket, so files are sent using
+ * `sendfile` (zero-copy).
+ */
+static sock_rw_hook_s FIO_TLS_KTLS_HOOKS = {
+    .read = fio_tls_read,
+    .write = fio_tls_write,
+    .on_close = fio_tls_on_close,
+    .sendfile = 1,
+};
+
+/** Returns 1 if the connection uses TLS (see `fio_tls_accept`), else 0. */
+int fio_tls_is_tls(intptr_t uuid) {
+  sock_rw_hook_s *hooks = sock_rw_hook_get(uuid);
+  return (hooks == &FIO_TLS_HOOKS || hooks == &FIO_TLS_KTLS_HOOKS);
+}
+
+/* *****************************************************************************
+The Handshake Protocol
+***************************************************************************** */
+
+static const char *FIO_TLS_HANDSHAKE_SERVICE_STR = "tls_handshake_facil_io";
+
+/* attaches the protocol selected using ALPN once the handshake is complete */
+static void fio_tls_on_handshake(intptr_t uuid, fio_tls_connection_s *c) {
+#ifdef SSL_OP_ENABLE_KTLS
+  if (BIO_get_ktls_send(SSL_get_wbio(c->ssl)))
+    sock_rw_hook_set(uuid, &FIO_TLS_KTLS_HOOKS, c);
+#endif
+  void (*on_open)(intptr_t uuid, void *udata) = c->on_open;
+  const unsigned char *name = NULL;
+  unsigned int len = 0;
+  SSL_get0_alpn_selected(c->ssl, &name, &len);
+  for (size_t i = 0; name && i < c->tls->alpn_count; ++i) {
+    if (c->tls->alpn[i].len == len &&
+        !memcmp(c->tls->alpn[i].name, name, len)) {
+      on_open = c->tls->alpn[i].on_selected;
+      break;
+    }
+  }
+  on_open(uuid, c->udata);
+  /* application data might have been read (and buffered) with the handshake */
+  facil_force_event(uuid, FIO_EVENT_ON_DATA);
+}
+
+static void fio_tls_handshake_on_data(intptr_t uuid, protocol_s *protocol) {
+  fio_tls_connection_s *c = sock_rw_udata(uuid);
+  if (!c)
+    return;
+  ERR_clear_error();
+  int ret = SSL_do_handshake(c->ssl);
+  if (ret == 1) {
+    fio_tls_on_handshake(uuid, c);
+    return;
+  }
+  switch (SSL_get_error(c->ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+    return;
+  case SSL_ERROR_WANT_WRITE:
+    /* the socket's buffer is full, retry later */
+    facil_force_event(uuid, FIO_EVENT_ON_DATA);
+    return;
+  }
+  ERR_clear_error();
+  sock_close(uuid);
+  (void)protocol;
+}
+
+static void fio_tls_handshake_on_close(intptr_t uuid, protocol_s *protocol) {
+  free(protocol);
+  (void)uuid;
+}
+
+/**
+ * Starts a TLS handshake on an accepted connection.
+ *
+ * Returns -1 on error (the connection should be closed) and 0 on success.
+ */
+int fio_tls_accept(intptr_t uuid, fio_tls_s *tls,
+                   void (*on_open)(intptr_t uuid, void *udata), void *udata) {
+  fio_tls_connection_s *c = malloc(sizeof(*c));
+  protocol_s *handshake = malloc(sizeof(*handshake));
+  if (!c || !handshake)
+    goto error;
+  *c = (fio_tls_connection_s){
+      .ssl = SSL_new(tls->ctx), .on_open = on_open, .udata = udata,
+  };
+  if (!c->ssl || SSL_set_fd(c->ssl, sock_uuid2fd(uuid)) != 1)
+    goto error;
+  SSL_set_accept_state(c->ssl);
+  c->tls = fio_tls_dup(tls);
+  if (sock_rw_hook_set(uuid, &FIO_TLS_HOOKS, c)) {
+    /* the connection was closed */
+    fio_tls_release(c->tls);
+    goto error;
+  }
+  *handshake = (protocol_s){
+      .service = FIO_TLS_HANDSHAKE_SERVICE_STR,
+      .on_data = fio_tls_handshake_on_data,
+      .on_close = fio_tls_handshake_on_close,
+  };
+  facil_attach(uuid, handshake);
+  return 0;
+error:
+  if (c && c->ssl)
+    SSL_free(c->ssl);
+  free(c);
+  free(handshake);
+  return -1;
+}
+
+#else /* HAVE_OPENSSL */
+
+fio_tls_s *fio_tls_new(const char *cert_file, const char *key_file,
+                       const char *password) {
+  fprintf(stderr, "ERROR: (TLS) iodine was compiled without OpenSSL.\n");
+  return NULL;
+  (void)cert_file;
+  (void)key_file;
+  (void)password;
+}
+
+void fio_tls_alpn_add(fio_tls_s *tls, const char *protocol_name,
+                      void (*on_selected)(intptr_t uuid, void *udata)) {
+  (void)tls;
+  (void)protocol_name;
+  (void)on_selected;
+}
+
+int fio_tls_accept(intptr_t uuid, fio_tls_s *tls,
+                   void (*on_open)(intptr_t uuid, void *udata), void *udata) {
+  return -1;
+  (void)uuid;
+  (void)tls;
+  (void)on_open;
+  (void)udata;
+}
+
+int fio_tls_is_tls(intptr_t uuid) {
+  return 0;
+  (void)uuid;
+}
+
+void fio_tls_free(fio_tls_s *tls) { (void)tls; }
+
+#endif /* HAVE_OPENSSL */
@@ -0,0 +1,83 @@
+/*
+Copyright: Boaz Segev, 2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#ifndef H_FIO_TLS_H
+#define H_FIO_TLS_H
+
+/**
+ * A TLS (server) layer, implemented using the `sock` library's read/write hooks
+ * (see `sock_rw_hook_s`) and OpenSSL.
+ *
+ * Once the handshake is complete, the kernel's TLS offload (kTLS) is used for
+ * outgoing data when available, so files are still sent using `sendfile`.
+ *
+ * When compiled without OpenSSL, `fio_tls_new` always fails (returns NULL).
+ */
+#include "facil.h"
+
+/* support C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef FIO_TLS_SESSION_CACHE_SIZE
+/**
+ * The number of sessions cached (per process) for session ID resumption.
+ *
+ * Session tickets are also supported. Ticket keys are created with the TLS
+ * context, so tickets are shared by worker processes forked afterwards.
+ */
+#define FIO_TLS_SESSION_CACHE_SIZE 4096
+#endif
+
+/** An opaque TLS context (certificate, key and protocols). */
+typedef struct fio_tls_s fio_tls_s;
+
+/**
+ * Creates a server TLS context using PEM encoded certificate (chain) and
+ * private key files. The `password` (used for encrypted keys) can be NULL.
+ *
+ * Returns NULL on error.
+ */
+fio_tls_s *fio_tls_new(const char *cert_file, const char *key_file,
+                       const char *password);
+
+/**
+ * Adds a protocol to the list of protocols negotiated using ALPN (in order of
+ * preference).
+ *
+ * `on_selected` is called once the handshake is complete, with the `udata`
+ * passed to `fio_tls_accept`, and should attach the protocol to `uuid`.
+ */
+void fio_tls_alpn_add(fio_tls_s *tls, const char *protocol_name,
+                      void (*on_selected)(intptr_t uuid, void *udata));
+
+/**
+ * Starts a TLS handshake on an accepted connection.
+ *
+ * Once the handshake is complete, the protocol selected using ALPN is attached
+ * (see `fio_tls_alpn_add`). When the client doesn't use ALPN, `on_open` is
+ * called instead.
+ *
+ * Returns -1 on error (the connection should be closed) and 0 on success.
+ */
+int fio_tls_accept(intptr_t uuid, fio_tls_s *tls,
+                   void (*on_open)(intptr_t uuid, void *udata), void *udata);
+
+/** Returns 1 if the connection uses TLS (see `fio_tls_accept`), else 0. */
+int fio_tls_is_tls(intptr_t uuid);
+
+/**
+ * Frees the TLS context. Connections that are already using the context are
+ * unaffected.
+ */
+void fio_tls_free(fio_tls_s *tls);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* H_FIO_TLS_H */
@@ -0,0 +1,106 @@
+/*
+Copyright: Boaz Segev, 2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#include "fio_trace.h"
+
+#if FIO_TRACE
+
+/* *****************************************************************************
+Sampling state
+***************************************************************************** */
+
+__thread fio_trace_timeline_s *fio_trace_current;
+
+volatile size_t fio_trace_every;
+
+static void (*volatile fio_trace_on_timeline)(fio_trace_timeline_s *);
+
+static __thread size_t fio_trace_counter;
+
+/**
+ * Samples every `every` `on_data` event (per thread), calling `on_timeline`
+ * once the timeline is complete (the connection's data was flushed or the
+ * connection was closed).
+ *
+ * `on_timeline` is called by a worker thread and the timeline is freed once it
+ * returns (copy any required data).
+ *
+ * Set `every` to 0 to stop sampling.
+ */
+void fio_trace_sample(size_t every,
+                      void (*on_timeline)(fio_trace_timeline_s *)) {
+  if (!on_timeline)
+    every = 0;
+  fio_trace_every = 0;
+  fio_trace_on_timeline = on_timeline;
+  fio_trace_every = every;
+}
+
+/* *****************************************************************************
+Timeline lifetime
+***************************************************************************** */
+
+/**
+ * Starts a sampled timeline for the `on_data` event, if it's sampled (called by
+ * facil.io).
+ *
+ * `scheduled` is the value returned by `fio_trace_scheduled` when the event was
+ * scheduled (0 if unknown).
+ */
+void fio_trace_begin(intptr_t uuid, uint64_t scheduled) {
+  size_t every = fio_trace_every;
+  if (!every || fio_trace_current || ++fio_trace_counter < every)
+    return;
+  fio_trace_counter = 0;
+  fio_trace_timeline_s *tl = malloc(sizeof(*tl));
+  if (!tl)
+    return;
+  tl->uuid = uuid;
+  tl->count = 0;
+  if (scheduled) {
+    tl->events[0].event = FIO_TRACE_SCHEDULED;
+    tl->events[0].time = scheduled;
+    tl->count = 1;
+  }
+  fio_trace_current = tl;
+  fio_trace_mark(FIO_TRACE_ON_DATA_START);
+}
+
+/**
+ * Ends the calling thread's part of the timeline, returning the timeline (if
+ * any) so it can be completed once the connection's data was flushed (called
+ * by facil.io).
+ */
+fio_trace_timeline_s *fio_trace_end(void) {
+  fio_trace_timeline_s *tl = fio_trace_current;
+  if (!tl)
+    return NULL;
+  fio_trace_mark(FIO_TRACE_ON_DATA_END);
+  fio_trace_current = NULL;
+  return tl;
+}
+
+/**
+ * Completes a timeline, calling the `on_timeline` callback and freeing the
+ * timeline (called by facil.io).
+ */
+void fio_trace_finish(fio_trace_timeline_s *tl, uint8_t flushed) {
+  if (!tl)
+    return;
+  if (flushed) {
+    /* marks the event in the (completed) timeline */
+    fio_trace_timeline_s *old = fio_trace_current;
+    fio_trace_current = tl;
+    fio_trace_mark(FIO_TRACE_FLUSHED);
+    fio_trace_current = old;
+  }
+  void (*on_timeline)(fio_trace_timeline_s *) = fio_trace_on_timeline;
+  if (on_timeline)
+    on_timeline(tl);
+  free(tl);
+}
+
+#endif
@@ -0,0 +1,211 @@
+/*
+Copyright: Boaz Segev, 2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#ifndef H_FIO_TRACE_H
+#define H_FIO_TRACE_H
+
+/**
+ * Low overhead trace points, attributing latency to the `defer` queue, the
+ * protocol's `on_data` event, a global lock (i.e., Ruby's GVL) or the socket's
+ * flushing.
+ *
+ * Trace points are available as:
+ *
+ * * USDT (DTrace / SystemTap) probes, under the `iodine` provider, when
+ *   `sys/sdt.h` is available (see FIO_TRACE_USDT). Disabled probes cost a
+ *   single `nop` instruction.
+ *
+ * * Sampled timelines (see `fio_trace_sample`) - every Nth `on_data` event (per
+ *   thread) records the time of the trace points reached while it's handled,
+ *   until the connection's outgoing data was flushed.
+ *
+ * When not sampling, a trace point costs a single thread local test.
+ */
+
+#if defined(__unix__) || defined(__APPLE__) || defined(__linux__)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef FIO_TRACE
+/** When set to 0, trace points are replaced by empty macros. */
+#define FIO_TRACE 1
+#endif
+
+#ifndef FIO_TRACE_USDT
+#if FIO_TRACE && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+/** When set to 1, trace points are available as USDT probes. */
+#define FIO_TRACE_USDT 1
+#endif
+#endif
+#endif
+
+#ifndef FIO_TRACE_MAX_EVENTS
+/** The maximum number of events recorded by a sampled timeline. */
+#define FIO_TRACE_MAX_EVENTS 32
+#endif
+
+/** Timeline events, see `fio_trace_mark`. */
+typedef enum {
+  /**
+   * the `on_data` event was scheduled (the time until `FIO_TRACE_ON_DATA_START`
+   * is the time spent waiting in the `defer` queue).
+   */
+  FIO_TRACE_SCHEDULED,
+  /** the protocol's `on_data` callback started. */
+  FIO_TRACE_ON_DATA_START,
+  /** the protocol's `on_data` callback returned. */
+  FIO_TRACE_ON_DATA_END,
+  /** a thread started waiting for the global lock (the GVL). */
+  FIO_TRACE_GVL_WAIT,
+  /** a thread acquired the global lock (the GVL). */
+  FIO_TRACE_GVL_ENTER,
+  /** a thread released the global lock (the GVL). */
+  FIO_TRACE_GVL_EXIT,
+  /** the application started handling a request. */
+  FIO_TRACE_HANDLER_START,
+  /** the application finished handling a request. */
+  FIO_TRACE_HANDLER_END,
+  /** all of the connection's outgoing data was flushed. */
+  FIO_TRACE_FLUSHED,
+  /** (the number of events) */
+  FIO_TRACE_EVENTS,
+} fio_trace_event_e;
+
+/** A sampled timeline. */
+typedef struct {
+  /** the connection's uuid. */
+  intptr_t uuid;
+  /** the number of recorded events. */
+  size_t count;
+  /** the events, in the order they were recorded. */
+  struct {
+    fio_trace_event_e event;
+    /** CLOCK_MONOTONIC, in nanoseconds */
+    uint64_t time;
+  } events[FIO_TRACE_MAX_EVENTS];
+} fio_trace_timeline_s;
+
+/* *****************************************************************************
+USDT probes
+***************************************************************************** */
+
+#if FIO_TRACE_USDT
+#include <sys/sdt.h>
+/** Fires a USDT probe (`iodine:name`) with up to 2 arguments. */
+#define FIO_TRACE_PROBE(name) DTRACE_PROBE(iodine, name)
+#define FIO_TRACE_PROBE1(name, a) DTRACE_PROBE1(iodine, name, a)
+#define FIO_TRACE_PROBE2(name, a, b) DTRACE_PROBE2(iodine, name, a, b)
+#else
+#define FIO_TRACE_PROBE(name) ((void)0)
+#define FIO_TRACE_PROBE1(name, a) ((void)0)
+#define FIO_TRACE_PROBE2(name, a, b) ((void)0)
+#endif
+
+/* *****************************************************************************
+Sampled timelines
+***************************************************************************** */
+
+#if FIO_TRACE
+
+/**
+ * Samples every `every` `on_data` event (per thread), calling `on_timeline`
+ * once the timeline is complete (the connection's data was flushed or the
+ * connection was closed).
+ *
+ * `on_timeline` is called by a worker thread and the timeline is freed once it
+ * returns (copy any required data).
+ *
+ * Set `every` to 0 to stop sampling.
+ */
+void fio_trace_sample(size_t every,
+                      void (*on_timeline)(fio_trace_timeline_s *));
+
+/** the calling thread's sampled timeline (if any). */
+extern __thread fio_trace_timeline_s *fio_trace_current;
+
+/** set while sampling (see `fio_trace_sample`). */
+extern volatile size_t fio_trace_every;
+
+/** Returns a monotonic clock reading, in nanoseconds. */
+static inline uint64_t fio_trace_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+}
+
+/** Records an event in the calling thread's sampled timeline (if any). */
+static inline void fio_trace_mark(fio_trace_event_e event) {
+  fio_trace_timeline_s *tl = fio_trace_current;
+  if (!tl || tl->count == FIO_TRACE_MAX_EVENTS)
+    return;
+  tl->events[tl->count].event = event;
+  tl->events[tl->count].time = fio_trace_now();
+  ++tl->count;
+}
+
+/**
+ * Returns the time an `on_data` event is scheduled, if sampling (0 otherwise).
+ */
+static inline uint64_t fio_trace_scheduled(void) {
+  return fio_trace_every ? fio_trace_now() : 0;
+}
+
+/**
+ * Starts a sampled timeline for the `on_data` event, if it's sampled (called by
+ * facil.io).
+ *
+ * `scheduled` is the value returned by `fio_trace_scheduled` when the event was
+ * scheduled (0 if unknown).
+ */
+void fio_trace_begin(intptr_t uuid, uint64_t scheduled);
+
+/**
+ * Ends the calling thread's part of the timeline, returning the timeline (if
+ * any) so it can be completed once the connection's data was flushed (called
+ * by facil.io).
+ */
+fio_trace_timeline_s *fio_trace_end(void);
+
+/**
+ * Completes a timeline, calling the `on_timeline` callback and freeing the
+ * timeline (called by facil.io).
+ */
+void fio_trace_finish(fio_trace_timeline_s *tl, uint8_t flushed);
+
+#else
+
+#define fio_trace_sample(every, on_timeline) ((void)0)
+#define fio_trace_mark(event) ((void)0)
+#define fio_trace_scheduled() ((uint64_t)0)
+#define fio_trace_begin(uuid, scheduled) ((void)0)
+#define fio_trace_end() ((fio_trace_timeline_s *)NULL)
+#define fio_trace_finish(tl, flushed) ((void)0)
+
+#endif
+
+/** Marks an event, both as a USDT probe and in the sampled timeline. */
+#define FIO_TRACE_MARK(probe, event)                                           \
+  do {                                                                         \
+    FIO_TRACE_PROBE(probe);                                                    \
+    fio_trace_mark((event));                                                   \
+  } while (0)
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
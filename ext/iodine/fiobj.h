@@ -6,9 +6,11 @@ License: MIT
 #define H_FIOBJ_H
 
 #include "fiobj_ary.h"
+#include "fiobj_bin.h"
 #include "fiobj_data.h"
 #include "fiobj_hash.h"
 #include "fiobj_json.h"
+#include "fiobj_json_doc.h"
 #include "fiobj_numbers.h"
 #include "fiobj_str.h"
 #include "fiobject.h"
@@ -24,6 +26,8 @@ FIO_INLINE void fiobj_test(void) {
   fiobj_test_core();
   fiobj_data_test();
   fiobj_test_json();
+  fiobj_test_json_doc();
+  fiobj_test_bin();
 }
 #else
 FIO_INLINE void fiobj_test(void) {
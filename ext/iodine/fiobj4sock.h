@@ -20,4 +20,48 @@ static inline __attribute__((unused)) ssize_t fiobj_send_free(intptr_t uuid,
                          fiobj4sock_dealloc); // (void (*)(void *))fiobj_free
 }
 
+/**
+ * Sends a FIOBJ object through a socket, without copying String data.
+ *
+ * A String is referenced (`fiobj_dup`) and released (`fiobj_free`) once it was
+ * sent, so the caller keeps (and should free) it's own reference. The String
+ * MUST NOT be edited until it was sent. Other types are converted to a String
+ * and copied, as are static Strings (i.e., request data placed in an arena),
+ * since their data might be reused before it was sent.
+ */
+static inline __attribute__((unused)) ssize_t sock_write_fiobj(intptr_t uuid,
+                                                               FIOBJ o) {
+  fio_cstr_s s = fiobj_obj2cstr(o);
+  if (!FIOBJ_TYPE_IS(o, FIOBJ_T_STRING) || !s.length ||
+      fiobj_str_is_static(o))
+    return sock_write(uuid, s.data, s.length);
+  return sock_write2(.uuid = uuid, .buffer = (void *)fiobj_dup(o),
+                     .offset = (((intptr_t)s.data) - ((intptr_t)(o))),
+                     .length = s.length, .dealloc = fiobj4sock_dealloc);
+}
+
+/**
+ * Same as `sock_write_fiobj`, except `head_len` bytes are copied from `head`
+ * and sent before the object's data (see `sock_write2_head`).
+ */
+static inline __attribute__((unused)) ssize_t
+sock_write_fiobj_head(intptr_t uuid, const void *head, size_t head_len,
+                      FIOBJ o) {
+  fio_cstr_s s = fiobj_obj2cstr(o);
+  if (!s.length)
+    return sock_write(uuid, head, head_len);
+  if (!FIOBJ_TYPE_IS(o, FIOBJ_T_STRING) || fiobj_str_is_static(o)) {
+    void *cpy = malloc(s.length);
+    if (!cpy)
+      return -1;
+    memcpy(cpy, s.data, s.length);
+    return sock_write2_head(head, head_len, .uuid = uuid, .buffer = cpy,
+                            .length = s.length);
+  }
+  return sock_write2_head(head, head_len, .uuid = uuid,
+                          .buffer = (void *)fiobj_dup(o),
+                          .offset = (((intptr_t)s.data) - ((intptr_t)(o))),
+                          .length = s.length, .dealloc = fiobj4sock_dealloc);
+}
+
 #endif
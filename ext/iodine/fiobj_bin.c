@@ -0,0 +1,445 @@
+/*
+Copyright: Boaz Segev, 2017-2018
+License: MIT
+*/
+#include "fiobj_bin.h"
+#include "fiobj_json_doc.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* *****************************************************************************
+Encoding
+***************************************************************************** */
+
+/* writes the `type` byte followed by the `bytes` lower bytes (big endian). */
+static inline void fiobj_bin_write_int(FIOBJ dest, uint8_t type, uint64_t value,
+                                       uint8_t bytes) {
+  uint8_t buf[9];
+  buf[0] = type;
+  for (uint8_t i = bytes; i; --i) {
+    buf[i] = (uint8_t)(value & 0xFF);
+    value >>= 8;
+  }
+  fiobj_str_write(dest, (char *)buf, bytes + 1);
+}
+
+/* writes a String / Array / Hash header, `type` is the 16 bit length type. */
+static void fiobj_bin_write_head(FIOBJ dest, uint8_t fix, uint8_t fix_limit,
+                                 uint8_t type, size_t len) {
+  if (len < fix_limit) {
+    uint8_t c = fix | (uint8_t)len;
+    fiobj_str_write(dest, (char *)&c, 1);
+  } else if (type == 0xda && len <= 0xFF) {
+    fiobj_bin_write_int(dest, 0xd9, len, 1); /* str 8 */
+  } else if (len <= 0xFFFF) {
+    fiobj_bin_write_int(dest, type, len, 2);
+  } else {
+    fiobj_bin_write_int(dest, type + 1, len, 4);
+  }
+}
+
+static void fiobj_bin_write_num(FIOBJ dest, intptr_t i) {
+  if (i >= -32 && i <= 127) {
+    int8_t c = (int8_t)i;
+    fiobj_str_write(dest, (char *)&c, 1);
+  } else if (i > 0) {
+    if (i <= 0xFF)
+      fiobj_bin_write_int(dest, 0xcc, i, 1);
+    else if (i <= 0xFFFF)
+      fiobj_bin_write_int(dest, 0xcd, i, 2);
+    else if ((uint64_t)i <= 0xFFFFFFFFULL)
+      fiobj_bin_write_int(dest, 0xce, i, 4);
+    else
+      fiobj_bin_write_int(dest, 0xcf, i, 8);
+  } else {
+    if (i >= INT8_MIN)
+      fiobj_bin_write_int(dest, 0xd0, (uint64_t)i, 1);
+    else if (i >= INT16_MIN)
+      fiobj_bin_write_int(dest, 0xd1, (uint64_t)i, 2);
+    else if ((int64_t)i >= INT32_MIN)
+      fiobj_bin_write_int(dest, 0xd2, (uint64_t)i, 4);
+    else
+      fiobj_bin_write_int(dest, 0xd3, (uint64_t)i, 8);
+  }
+}
+
+static void fiobj_bin_write_str(FIOBJ dest, FIOBJ o) {
+  fio_cstr_s s = fiobj_obj2cstr(o);
+  fiobj_bin_write_head(dest, 0xa0, 32, 0xda, s.len);
+  fiobj_str_write(dest, s.data, s.len);
+}
+
+static int fiobj_obj2bin_task(FIOBJ o, void *dest_) {
+  FIOBJ dest = (FIOBJ)dest_;
+  uint8_t c;
+  if (fiobj_hash_key_in_loop())
+    fiobj_bin_write_str(dest, fiobj_hash_key_in_loop());
+  switch (FIOBJ_TYPE(o)) {
+  case FIOBJ_T_NULL:
+    c = 0xc0;
+    fiobj_str_write(dest, (char *)&c, 1);
+    break;
+  case FIOBJ_T_FALSE:
+    c = 0xc2;
+    fiobj_str_write(dest, (char *)&c, 1);
+    break;
+  case FIOBJ_T_TRUE:
+    c = 0xc3;
+    fiobj_str_write(dest, (char *)&c, 1);
+    break;
+  case FIOBJ_T_NUMBER:
+    fiobj_bin_write_num(dest, fiobj_obj2num(o));
+    break;
+  case FIOBJ_T_FLOAT: {
+    double f = fiobj_obj2float(o);
+    uint64_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    fiobj_bin_write_int(dest, 0xcb, bits, 8);
+    break;
+  }
+  case FIOBJ_T_ARRAY:
+    /* the members are serialized by the following `fiobj_each2` calls */
+    fiobj_bin_write_head(dest, 0x90, 16, 0xdc, fiobj_ary_count(o));
+    break;
+  case FIOBJ_T_HASH:
+    fiobj_bin_write_head(dest, 0x80, 16, 0xde, fiobj_hash_count(o));
+    break;
+  case FIOBJ_T_JSON: {
+    /* lazy JSON documents are decoded only when serialized */
+    FIOBJ tmp = fiobj_json_doc_value(o, FIOBJ_JSON_DOC_ROOT);
+    fiobj_obj2bin2(dest, tmp);
+    fiobj_free(tmp);
+    break;
+  }
+  case FIOBJ_T_STRING:
+  case FIOBJ_T_DATA:
+  case FIOBJ_T_UNKNOWN:
+    fiobj_bin_write_str(dest, o);
+    break;
+  }
+  return 0;
+}
+
+/**
+ * Serializes an object into binary (MessagePack) data, appending the data to an
+ * existing String. Remember to `fiobj_free`.
+ */
+FIOBJ fiobj_obj2bin2(FIOBJ dest, FIOBJ o) {
+  assert(dest && FIOBJ_TYPE_IS(dest, FIOBJ_T_STRING));
+  if (!o || !FIOBJ_IS_ALLOCATED(o) || !FIOBJECT2VTBL(o)->each) {
+    fiobj_obj2bin_task(o, (void *)dest);
+    return dest;
+  }
+  fiobj_each2(o, fiobj_obj2bin_task, (void *)dest);
+  return dest;
+}
+
+/**
+ * Serializes an object into a binary (MessagePack) String. Remember to
+ * `fiobj_free`.
+ */
+FIOBJ fiobj_obj2bin(FIOBJ obj) { return fiobj_obj2bin2(fiobj_str_buf(0), obj); }
+
+/* *****************************************************************************
+Decoding
+***************************************************************************** */
+
+/* reads `bytes` big endian bytes. */
+static inline uint64_t fiobj_bin_read(const uint8_t *pos, uint8_t bytes) {
+  uint64_t r = 0;
+  for (uint8_t i = 0; i < bytes; ++i)
+    r = (r << 8) | pos[i];
+  return r;
+}
+
+/* an open container, `left` counts Hash keys and values separately. */
+typedef struct {
+  FIOBJ obj;
+  FIOBJ key;
+  size_t left;
+  uint8_t is_hash;
+} fiobj_bin_frame_s;
+
+/**
+ * Decodes binary (MessagePack) data, setting `pobj` to point to the new Object.
+ *
+ * Returns the number of bytes consumed (a single object is decoded). On Error,
+ * 0 is returned and no data is consumed.
+ */
+size_t fiobj_bin2obj(FIOBJ *pobj, const void *data, size_t len) {
+  fiobj_bin_frame_s stack[FIOBJ_BIN_MAX_DEPTH];
+  size_t depth = 0;
+  const uint8_t *pos = data;
+  const uint8_t *end = pos + len;
+  FIOBJ top = FIOBJ_INVALID;
+  FIOBJ o;
+  do {
+    if (pos >= end)
+      goto error;
+    fiobj_bin_frame_s *parent = depth ? stack + depth - 1 : NULL;
+    uint8_t is_key = parent && parent->is_hash && !(parent->left & 1);
+    uint8_t c = *(pos++);
+    uint8_t bytes = 0;
+    size_t count = 0;
+    /* find the length of Strings and containers */
+    if (c <= 0x7f || c >= 0xe0) {
+      o = fiobj_num_new((int8_t)c);
+      goto found;
+    } else if ((c & 0xe0) == 0xa0) {
+      count = c & 0x1f;
+      goto string;
+    } else if ((c & 0xf0) == 0x90) {
+      count = c & 0x0f;
+      goto array;
+    } else if ((c & 0xf0) == 0x80) {
+      count = c & 0x0f;
+      goto hash;
+    }
+    switch (c) {
+    case 0xc0:
+      o = fiobj_null();
+      goto found;
+    case 0xc2:
+      o = fiobj_false();
+      goto found;
+    case 0xc3:
+      o = fiobj_true();
+      goto found;
+    case 0xc4: /* bin 8 / 16 / 32 */
+    case 0xc5:
+    case 0xc6:
+      bytes = 1 << (c - 0xc4);
+      break;
+    case 0xd9: /* str 8 / 16 / 32 */
+    case 0xda:
+    case 0xdb:
+      bytes = 1 << (c - 0xd9);
+      break;
+    case 0xca: /* float 32 / 64 */
+    case 0xcb:
+    case 0xcc: /* uint 8 / 16 / 32 / 64 */
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+    case 0xd0: /* int 8 / 16 / 32 / 64 */
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+    case 0xdc: /* array 16 / 32 */
+    case 0xdd:
+    case 0xde: /* map 16 / 32 */
+    case 0xdf:
+      bytes = (c == 0xca ? 4
+                         : c == 0xcb ? 8
+                                     : c >= 0xdc ? 2 << ((c - 0xdc) & 1)
+                                                 : 1 << ((c - 0xcc) & 3));
+      break;
+    default: /* extension types and unused codes */
+      goto error;
+    }
+    if ((size_t)(end - pos) < bytes)
+      goto error;
+    uint64_t value = fiobj_bin_read(pos, bytes);
+    pos += bytes;
+    switch (c) {
+    case 0xca: {
+      uint32_t bits = (uint32_t)value;
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      o = fiobj_float_new(f);
+      goto found;
+    }
+    case 0xcb: {
+      double f;
+      memcpy(&f, &value, sizeof(f));
+      o = fiobj_float_new(f);
+      goto found;
+    }
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+      o = (value > INTPTR_MAX ? fiobj_float_new((double)value)
+                              : fiobj_num_new((intptr_t)value));
+      goto found;
+    case 0xd0:
+      o = fiobj_num_new((int8_t)value);
+      goto found;
+    case 0xd1:
+      o = fiobj_num_new((int16_t)value);
+      goto found;
+    case 0xd2:
+      o = fiobj_num_new((int32_t)value);
+      goto found;
+    case 0xd3:
+      o = fiobj_num_new((intptr_t)(int64_t)value);
+      goto found;
+    case 0xdc:
+    case 0xdd:
+      count = value;
+      goto array;
+    case 0xde:
+    case 0xdf:
+      count = value;
+      goto hash;
+    }
+    /* Strings and binary data */
+    count = value;
+  string:
+    if ((size_t)(end - pos) < count)
+      goto error;
+    o = (is_key ? fiobj_str_intern((char *)pos, count)
+                : fiobj_str_new((char *)pos, count));
+    pos += count;
+    goto found;
+  array:
+    /* every member requires at least a byte, don't trust the length */
+    if ((size_t)(end - pos) < count || is_key)
+      goto error;
+    o = fiobj_ary_new2(count);
+    goto found;
+  hash:
+    if ((size_t)(end - pos) < (count << 1) || is_key)
+      goto error;
+    o = fiobj_hash_new2(count);
+    count <<= 1;
+
+  found:
+    if (!parent) {
+      top = o;
+    } else {
+      --parent->left;
+      if (is_key) {
+        parent->key = o;
+      } else if (parent->is_hash) {
+        fiobj_hash_set(parent->obj, parent->key, o);
+        fiobj_free(parent->key);
+        parent->key = FIOBJ_INVALID;
+      } else {
+        fiobj_ary_push(parent->obj, o);
+      }
+    }
+    if (count && !FIOBJ_TYPE_IS(o, FIOBJ_T_STRING)) {
+      if (depth == FIOBJ_BIN_MAX_DEPTH)
+        goto error;
+      stack[depth++] = (fiobj_bin_frame_s){
+          .obj = o,
+          .left = count,
+          .is_hash = FIOBJ_TYPE_IS(o, FIOBJ_T_HASH),
+      };
+    }
+    while (depth && !stack[depth - 1].left)
+      --depth;
+  } while (depth);
+  *pobj = top;
+  return (size_t)(pos - (uint8_t *)data);
+
+error:
+  while (depth) {
+    --depth;
+    fiobj_free(stack[depth].key);
+  }
+  fiobj_free(top);
+  *pobj = FIOBJ_INVALID;
+  return 0;
+}
+
+/* *****************************************************************************
+Test
+***************************************************************************** */
+
+#if DEBUG
+void fiobj_test_bin(void) {
+  fprintf(stderr, "=== Testing binary (MessagePack) serialization\n");
+#define TEST_ASSERT(cond, ...)                                                 \
+  if (!(cond)) {                                                               \
+    fprintf(stderr, "* " __VA_ARGS__);                                         \
+    fprintf(stderr, "Testing failed.\n");                                      \
+    exit(-1);                                                                  \
+  }
+  FIOBJ o = fiobj_hash_new();
+  FIOBJ key = fiobj_str_new("array", 5);
+  FIOBJ ary = fiobj_ary_new();
+  fiobj_hash_set(o, key, ary);
+  fiobj_free(key);
+  fiobj_ary_push(ary, fiobj_num_new(1));
+  fiobj_ary_push(ary, fiobj_num_new(-33));
+  fiobj_ary_push(ary, fiobj_num_new(300));
+  fiobj_ary_push(ary, fiobj_num_new(-70000));
+  fiobj_ary_push(ary, fiobj_num_new((intptr_t)1 << 40));
+  fiobj_ary_push(ary, fiobj_float_new(-2.5));
+  fiobj_ary_push(ary, fiobj_null());
+  fiobj_ary_push(ary, fiobj_true());
+  fiobj_ary_push(ary, fiobj_false());
+  fiobj_ary_push(ary, fiobj_hash_new());
+  key = fiobj_str_new("long string", 11);
+  FIOBJ tmp = fiobj_str_buf(300);
+  for (int i = 0; i < 30; ++i)
+    fiobj_str_write(tmp, "0123456789", 10);
+  fiobj_hash_set(o, key, tmp);
+  fiobj_free(key);
+  for (int i = 0; i < 20; ++i) {
+    /* force a map 16 header */
+    key = fiobj_str_buf(8);
+    fiobj_str_join(key, fiobj_num_tmp(i));
+    fiobj_hash_set(o, key, fiobj_num_new(i));
+    fiobj_free(key);
+  }
+
+  FIOBJ bin = fiobj_obj2bin(o);
+  fio_cstr_s s = fiobj_obj2cstr(bin);
+  TEST_ASSERT((uint8_t)s.data[0] == 0xde, "map 16 header error (%x)\n",
+              (unsigned int)(uint8_t)s.data[0]);
+  FIOBJ decoded = FIOBJ_INVALID;
+  TEST_ASSERT(fiobj_bin2obj(&decoded, s.data, s.len) == s.len,
+              "fiobj_bin2obj didn't consume all the data\n");
+  TEST_ASSERT(fiobj_iseq(o, decoded), "binary round trip error\n");
+  FIOBJ json1 = fiobj_obj2json(o, 0);
+  FIOBJ json2 = fiobj_obj2json(decoded, 0);
+  TEST_ASSERT(fiobj_iseq(json1, json2),
+              "binary round trip JSON error\n%s\n%s\n",
+              fiobj_obj2cstr(json1).data, fiobj_obj2cstr(json2).data);
+  fiobj_free(json1);
+  fiobj_free(json2);
+  fiobj_free(decoded);
+  for (size_t i = 0; i < s.len; ++i) {
+    TEST_ASSERT(!fiobj_bin2obj(&decoded, s.data, i) && !decoded,
+                "truncated data should fail (%zu)\n", i);
+  }
+  fiobj_free(bin);
+  fiobj_free(o);
+
+  /* known MessagePack data: {"compact":true,"schema":0} */
+  const char known[] = "\x82\xa7"
+                       "compact\xc3\xa6"
+                       "schema\x00";
+  TEST_ASSERT(fiobj_bin2obj(&o, known, sizeof(known) - 1) ==
+                  sizeof(known) - 1,
+              "fiobj_bin2obj failed on known data\n");
+  json1 = fiobj_obj2json(o, 0);
+  TEST_ASSERT(!strcmp(fiobj_obj2cstr(json1).data,
+                      "{\"compact\":true,\"schema\":0}"),
+              "known data decoding error (%s)\n", fiobj_obj2cstr(json1).data);
+  fiobj_free(json1);
+  bin = fiobj_obj2bin(o);
+  TEST_ASSERT(fiobj_obj2cstr(bin).len == sizeof(known) - 1 &&
+                  !memcmp(fiobj_obj2cstr(bin).data, known, sizeof(known) - 1),
+              "known data encoding error\n");
+  fiobj_free(bin);
+  fiobj_free(o);
+
+  /* nesting is limited and a Hash key can't be a container */
+  char deep[FIOBJ_BIN_MAX_DEPTH + 2];
+  memset(deep, 0x91, sizeof(deep) - 1);
+  deep[sizeof(deep) - 1] = 0;
+  TEST_ASSERT(!fiobj_bin2obj(&o, deep, sizeof(deep)) && !o,
+              "nesting limit error\n");
+  TEST_ASSERT(!fiobj_bin2obj(&o, "\x81\x90\xc0", 3) && !o,
+              "container key should fail\n");
+  TEST_ASSERT(!fiobj_bin2obj(&o, "\xdd\xff\xff\xff\xff", 5) && !o,
+              "invalid length should fail\n");
+  fprintf(stderr, "* passed.\n");
+}
+#endif
@@ -0,0 +1,69 @@
+#ifndef H_FIOBJ_BIN_H
+#define H_FIOBJ_BIN_H
+
+/*
+Copyright: Boaz Segev, 2017-2018
+License: MIT
+*/
+
+/**
+ * A compact binary serialization for FIOBJ objects, compatible with
+ * MessagePack.
+ *
+ * This is useful for passing structured data between processes (i.e., the
+ * cluster messages or a Redis server shared by facil.io processes), skipping
+ * the JSON formatting and parsing costs.
+ *
+ * Primitives, Numbers, Floats, Strings, Arrays and Hashes are supported. Other
+ * types are serialized using their String representation. Binary data (bin 8,
+ * 16 and 32) is deserialized as a String and extension types are unsupported.
+ */
+
+#include "fiobj_ary.h"
+#include "fiobj_hash.h"
+#include "fiobj_numbers.h"
+#include "fiobj_str.h"
+#include "fiobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Limits the binary data's nesting (the decoder uses a fixed stack). */
+#ifndef FIOBJ_BIN_MAX_DEPTH
+#define FIOBJ_BIN_MAX_DEPTH 32
+#endif
+
+/* *****************************************************************************
+Binary (MessagePack) API
+***************************************************************************** */
+
+/**
+ * Decodes binary (MessagePack) data, setting `pobj` to point to the new Object.
+ *
+ * Returns the number of bytes consumed (a single object is decoded). On Error,
+ * 0 is returned and no data is consumed.
+ */
+size_t fiobj_bin2obj(FIOBJ *pobj, const void *data, size_t len);
+
+/**
+ * Serializes an object into a binary (MessagePack) String. Remember to
+ * `fiobj_free`.
+ */
+FIOBJ fiobj_obj2bin(FIOBJ obj);
+
+/**
+ * Serializes an object into binary (MessagePack) data, appending the data to an
+ * existing String. Remember to `fiobj_free`.
+ */
+FIOBJ fiobj_obj2bin2(FIOBJ dest, FIOBJ obj);
+
+#if DEBUG
+void fiobj_test_bin(void);
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -599,6 +599,39 @@ fio_cstr_s fiobj_data_read(FIOBJ io, intptr_t length) {
   }
 }
 
+/**
+ * Reads up to `length` bytes directly into the `dest` buffer.
+ *
+ * File streams are read without using the IO object's internal buffer.
+ */
+intptr_t fiobj_data_read2buf(FIOBJ io, void *dest, uintptr_t length) {
+  if (!io || !FIOBJ_TYPE_IS(io, FIOBJ_T_DATA) || !dest) {
+    errno = EFAULT;
+    return -1;
+  }
+  errno = 0;
+  if (!length)
+    return 0;
+  if (obj2io(io)->fd < 0) {
+    fio_cstr_s data = fiobj_data_read(io, length);
+    if (data.len)
+      memcpy(dest, data.data, data.len);
+    return data.len;
+  }
+  /* the internal buffer is invalidated, `fpos` is the reading position */
+  obj2io(io)->pos = 0;
+  obj2io(io)->len = 0;
+  ssize_t l;
+retry_int:
+  l = pread(obj2io(io)->fd, dest, length, obj2io(io)->fpos);
+  if (l == -1 && errno == EINTR)
+    goto retry_int;
+  if (l <= 0)
+    return l;
+  obj2io(io)->fpos += l;
+  return l;
+}
+
 /* *****************************************************************************
 Tokenize (read2ch)
 ***************************************************************************** */
@@ -899,6 +932,28 @@ fio_cstr_s fiobj_data_pread(FIOBJ io, intptr_t start_at, uintptr_t length) {
   }
 }
 
+/**
+ * Discards the data that was already read, so the memory can be reused.
+ *
+ * Only String (memory) streams are supported. Returns -1 on error.
+ */
+int fiobj_data_discard(FIOBJ io) {
+  if (!io || !FIOBJ_TYPE_IS(io, FIOBJ_T_DATA) || obj2io(io)->fd != -1) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (!obj2io(io)->pos)
+    return 0;
+  if (obj2io(io)->dealloc != free)
+    fiobj_data_copy_buffer(io);
+  obj2io(io)->len -= obj2io(io)->pos;
+  if (obj2io(io)->len)
+    memmove(obj2io(io)->buffer, obj2io(io)->buffer + obj2io(io)->pos,
+            obj2io(io)->len);
+  obj2io(io)->pos = 0;
+  return 0;
+}
+
 /* *****************************************************************************
 Writing API
 ***************************************************************************** */
@@ -69,6 +69,15 @@ Reading API
  */
 fio_cstr_s fiobj_data_read(FIOBJ io, intptr_t length);
 
+/**
+ * Reads up to `length` bytes into the `dest` buffer (not NUL terminated),
+ * returning the number of bytes read (0 == EOF, -1 == error).
+ *
+ * Unlike `fiobj_data_read`, file streams are read directly into `dest`, so
+ * large temporary files aren't copied twice.
+ */
+intptr_t fiobj_data_read2buf(FIOBJ io, void *dest, uintptr_t length);
+
 /**
  * Reads until the `token` byte is encountered or until the end of the stream.
  *
@@ -122,6 +131,13 @@ void fiobj_data_seek(FIOBJ io, intptr_t position);
  */
 fio_cstr_s fiobj_data_pread(FIOBJ io, intptr_t start_at, uintptr_t length);
 
+/**
+ * Discards the data that was already read, so the memory can be reused.
+ *
+ * Only String (memory) streams are supported. Returns -1 on error.
+ */
+int fiobj_data_discard(FIOBJ io);
+
 /* *****************************************************************************
 Writing API
 ***************************************************************************** */
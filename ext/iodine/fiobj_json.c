@@ -38,6 +38,7 @@ typedef struct {
   FIOBJ target;
   fio_ary_s stack;
   uint8_t is_hash;
+  uint8_t error;
 } fiobj_json_parser_s;
 
 /* *****************************************************************************
@@ -84,6 +85,12 @@ static void fio_json_on_float(json_parser_s *p, double f) {
 }
 /** a String was detected (int / float). update `pos` to point at ending */
 static void fio_json_on_string(json_parser_s *p, void *start, size_t length) {
+  fiobj_json_parser_s *pr = (fiobj_json_parser_s *)p;
+  if (pr->top && pr->is_hash && !pr->key && !memchr(start, '\\', length)) {
+    /* Hash keys repeat, share them (unless they require unescaping) */
+    fiobj_json_add2parser(pr, fiobj_str_intern(start, length));
+    return;
+  }
   FIOBJ str = fiobj_str_buf(length);
   fiobj_str_resize(
       str, fio_json_unescape_str(fiobj_obj2cstr(str).data, start, length));
@@ -153,7 +160,159 @@ static void fio_json_on_error(json_parser_s *p) {
   fiobj_free(pr->key);
   fio_ary_free(&pr->stack);
   pr->stack = FIO_ARY_INIT;
-  *pr = (fiobj_json_parser_s){.top = FIOBJ_INVALID};
+  *pr = (fiobj_json_parser_s){.top = FIOBJ_INVALID, .error = 1};
+}
+
+/* *****************************************************************************
+Streaming (incremental) JSON parsing
+***************************************************************************** */
+
+#ifndef FIOBJ_JSON_STREAM_RESCAN
+/**
+ * Unconsumed data longer than this (i.e., a long String) is only rescanned
+ * once it doubled in size, or once the new data contains a quote (`"`).
+ */
+#define FIOBJ_JSON_STREAM_RESCAN 4096
+#endif
+
+struct fiobj_json_stream_s {
+  fiobj_json_parser_s p;
+  void (*on_json)(FIOBJ obj, void *udata);
+  void *udata;
+  char *buf;
+  size_t len;
+  size_t capa;
+  /* the unconsumed data length after the last parsing attempt. */
+  size_t pending;
+};
+
+/**
+ * Creates a streaming JSON parser. Remember to `fiobj_json_stream_free`.
+ *
+ * The `on_json` callback is called for every top-level JSON value as soon as
+ * the value is complete, so NDJSON (or concatenated JSON) streams are
+ * supported. The callback owns the object (remember to `fiobj_free`).
+ */
+fiobj_json_stream_s *fiobj_json_stream_new(void (*on_json)(FIOBJ obj,
+                                                           void *udata),
+                                           void *udata) {
+  fiobj_json_stream_s *s = malloc(sizeof(*s));
+  if (!s)
+    return NULL;
+  *s = (fiobj_json_stream_s){
+      .p = {.top = FIOBJ_INVALID}, .on_json = on_json, .udata = udata,
+  };
+  return s;
+}
+
+/** Frees the stream, including any partially parsed object. */
+void fiobj_json_stream_free(fiobj_json_stream_s *s) {
+  if (!s)
+    return;
+  if (fio_ary_count(&s->p.stack))
+    fiobj_free((FIOBJ)fio_ary_index(&s->p.stack, 0));
+  else
+    fiobj_free(s->p.top);
+  fiobj_free(s->p.key);
+  fio_ary_free(&s->p.stack);
+  free(s->buf);
+  free(s);
+}
+
+/*
+ * Trailing bytes that might belong to an incomplete token (a number, `true`,
+ * a `//` comment...) are held back, so "12" + "34" isn't parsed as two values.
+ */
+static inline size_t fiobj_json_stream_held(const char *buf, size_t len) {
+  size_t held = 0;
+  while (held < len) {
+    const uint8_t c = (uint8_t)buf[len - held - 1];
+    if (!JSON_NUMERAL[c] && !isalnum(c) && c != '/')
+      break;
+    ++held;
+  }
+  return held;
+}
+
+/* Parses the buffered data, returns -1 on error. */
+static int fiobj_json_stream_parse(fiobj_json_stream_s *s, size_t held) {
+  size_t pos = 0;
+  while (pos + held < s->len) {
+    size_t consumed = fio_json_parse(&s->p.p, s->buf + pos, s->len - held - pos);
+    if (s->p.error)
+      return -1;
+    pos += consumed;
+    if (!s->p.p.depth && s->p.top) {
+      /* a top-level value is complete */
+      FIOBJ obj = s->p.top;
+      s->p.top = FIOBJ_INVALID;
+      s->p.is_hash = 0;
+      s->p.p = (json_parser_s){.depth = 0};
+      if (s->on_json)
+        s->on_json(obj, s->udata);
+      else
+        fiobj_free(obj);
+    } else if (!consumed) {
+      break;
+    }
+  }
+  if (pos) {
+    s->len -= pos;
+    memmove(s->buf, s->buf + pos, s->len + 1);
+  }
+  s->pending = s->len;
+  return 0;
+}
+
+/**
+ * Feeds data to the streaming parser. The data is parsed immediately and only
+ * the data belonging to an incomplete token is buffered.
+ *
+ * Returns -1 on a parsing error (the stream can't be used any more, except for
+ * `fiobj_json_stream_free`), otherwise returns 0.
+ */
+int fiobj_json_stream_write(fiobj_json_stream_s *s, const void *data,
+                            size_t len) {
+  if (!s || s->p.error)
+    return -1;
+  if (!len)
+    return 0;
+  if (s->len + len + 1 > s->capa) {
+    size_t capa = s->capa ? s->capa : 4096;
+    while (capa < s->len + len + 1)
+      capa <<= 1;
+    void *tmp = realloc(s->buf, capa);
+    if (!tmp)
+      return -1;
+    s->buf = tmp;
+    s->capa = capa;
+  }
+  memcpy(s->buf + s->len, data, len);
+  s->len += len;
+  s->buf[s->len] = 0; /* the parser requires a NUL byte after the data */
+  if (s->pending >= FIOBJ_JSON_STREAM_RESCAN && s->len < (s->pending << 1) &&
+      !memchr(data, '"', len))
+    return 0;
+  return fiobj_json_stream_parse(s, fiobj_json_stream_held(s->buf, s->len));
+}
+
+/**
+ * Parses any data that was held back (i.e., a trailing top-level number) once
+ * no more data is expected.
+ *
+ * Returns -1 if incomplete JSON data remains (or on a parsing error),
+ * otherwise returns 0.
+ */
+int fiobj_json_stream_finish(fiobj_json_stream_s *s) {
+  if (!s || s->p.error)
+    return -1;
+  if (fiobj_json_stream_parse(s, 0))
+    return -1;
+  for (size_t i = 0; i < s->len; ++i) {
+    if (!JSON_SEPERATOR[(uint8_t)s->buf[i]])
+      return -1;
+  }
+  return (s->p.p.depth || s->p.top) ? -1 : 0;
 }
 
 /* *****************************************************************************
@@ -277,6 +436,7 @@ static int fiobj_fiobj_obj2json_task(FIOBJ o, void *data_) {
   case FIOBJ_T_TRUE:
   case FIOBJ_T_FALSE:
   case FIOBJ_T_FLOAT:
+  case FIOBJ_T_JSON: /* the raw JSON text is embedded as is */
     fiobj_str_join(data->dest, o);
     --data->count;
     break;
@@ -437,6 +597,10 @@ Test
 ***************************************************************************** */
 
 #if DEBUG
+static void fiobj_test_json_stream_collect(FIOBJ obj, void *ary) {
+  fiobj_ary_push((FIOBJ)ary, obj);
+}
+
 void fiobj_test_json(void) {
   fprintf(stderr, "=== Testing JSON parser (simple test)\n");
 #define TEST_ASSERT(cond, ...)                                                 \
@@ -602,8 +766,38 @@ void fiobj_test_json(void) {
   TEST_ASSERT(FIOBJ_TYPE_IS(tmp, FIOBJ_T_STRING),
               "JSON messy string isn't a string\n");
   fprintf(stderr, "Messy JSON:\n%s\n", fiobj_obj2cstr(tmp).data);
-  fiobj_free(o);
   fiobj_free(tmp);
+  {
+    /* streaming, one byte at a time, followed by NDJSON values */
+    FIOBJ results = fiobj_ary_new();
+    fiobj_json_stream_s *s =
+        fiobj_json_stream_new(fiobj_test_json_stream_collect, (void *)results);
+    for (size_t i = 0; i < sizeof(json_str2) - 1; ++i)
+      TEST_ASSERT(!fiobj_json_stream_write(s, json_str2 + i, 1),
+                  "JSON stream error at %zu\n", i);
+    TEST_ASSERT(fiobj_ary_count(results) == 1,
+                "JSON stream didn't emit the messy object\n");
+    TEST_ASSERT(fiobj_iseq(fiobj_ary_index(results, 0), o),
+                "JSON stream result differs from parser\n");
+    char ndjson[] = "\n{\"a\":1}\n[1,2]\n\"str\"\n12";
+    for (size_t i = 0; i < sizeof(ndjson) - 1; i += 3)
+      TEST_ASSERT(!fiobj_json_stream_write(
+                      s, ndjson + i,
+                      (i + 3 < sizeof(ndjson) - 1) ? 3 : sizeof(ndjson) - 1 - i),
+                  "JSON NDJSON stream error at %zu\n", i);
+    TEST_ASSERT(fiobj_ary_count(results) == 4,
+                "JSON NDJSON stream count error (%zu)\n",
+                fiobj_ary_count(results));
+    TEST_ASSERT(!fiobj_json_stream_finish(s), "JSON stream finish error\n");
+    TEST_ASSERT(fiobj_ary_count(results) == 5 &&
+                    fiobj_obj2num(fiobj_ary_index(results, -1)) == 12,
+                "JSON stream held back number error\n");
+    TEST_ASSERT(fiobj_json_stream_write(s, "[1}", 3) == -1,
+                "JSON stream should fail on malformed data\n");
+    fiobj_json_stream_free(s);
+    fiobj_free(results);
+  }
+  fiobj_free(o);
   fprintf(stderr, "* passed.\n");
 }
 
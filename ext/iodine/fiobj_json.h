@@ -57,6 +57,48 @@ FIOBJ fiobj_obj2json(FIOBJ, uint8_t pretty);
  */
 FIOBJ fiobj_obj2json2(FIOBJ dest, FIOBJ object, uint8_t pretty);
 
+/* *****************************************************************************
+Streaming JSON API
+***************************************************************************** */
+
+/** An opaque type used for incremental (streaming) JSON parsing. */
+typedef struct fiobj_json_stream_s fiobj_json_stream_s;
+
+/**
+ * Creates a streaming JSON parser. Remember to `fiobj_json_stream_free`.
+ *
+ * The `on_json` callback is called for every top-level JSON value as soon as
+ * the value is complete, so NDJSON (or concatenated JSON) streams are
+ * supported. The callback owns the object (remember to `fiobj_free`).
+ *
+ * Data can be fed in chunks of any size (i.e., as it arrives from the
+ * network). Only the data belonging to an incomplete token is buffered.
+ */
+fiobj_json_stream_s *fiobj_json_stream_new(void (*on_json)(FIOBJ obj,
+                                                           void *udata),
+                                           void *udata);
+
+/**
+ * Feeds data to the streaming parser.
+ *
+ * Returns -1 on a parsing error (the stream can't be used any more, except for
+ * `fiobj_json_stream_free`), otherwise returns 0.
+ */
+int fiobj_json_stream_write(fiobj_json_stream_s *s, const void *data,
+                            size_t len);
+
+/**
+ * Parses any data that was held back (i.e., a trailing top-level number) once
+ * no more data is expected.
+ *
+ * Returns -1 if incomplete JSON data remains (or on a parsing error),
+ * otherwise returns 0.
+ */
+int fiobj_json_stream_finish(fiobj_json_stream_s *s);
+
+/** Frees the stream, including any partially parsed object. */
+void fiobj_json_stream_free(fiobj_json_stream_s *s);
+
 #if DEBUG
 void fiobj_test_json(void);
 #endif
@@ -0,0 +1,472 @@
+/*
+Copyright: Boaz Segev, 2017-2018
+License: MIT
+*/
+#include "fiobj_json_doc.h"
+#include "fio_json_parser.h"
+
+#include "fio_ary.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FIO_OVERRIDE_MALLOC 1
+#include "fio_mem.h"
+
+/* *****************************************************************************
+Lazy JSON document type
+***************************************************************************** */
+
+/* an indexed JSON value */
+typedef struct {
+  /** The node's type (FIOBJ_T_NUMBER, FIOBJ_T_STRING, FIOBJ_T_HASH...). */
+  uint8_t type;
+  /** The node following this node and it's nested nodes. */
+  uint32_t next;
+  union {
+    /** Number of nested nodes (Arrays / Hashes). */
+    uint32_t count;
+    /** The raw String data (offset within the document). */
+    struct {
+      uint32_t start;
+      uint32_t len;
+    } str;
+    int64_t i;
+    double f;
+  } data;
+} fiobj_json_node_s;
+
+typedef struct {
+  fiobj_object_header_s head;
+  fiobj_json_node_s *nodes;
+  size_t count;
+  size_t len;
+  char *json;
+} fiobj_json_doc_s;
+
+#define obj2doc(o) ((fiobj_json_doc_s *)(FIOBJ2PTR(o)))
+
+#define REQUIRE_MEM(mem)                                                       \
+  do {                                                                         \
+    if ((mem) == NULL) {                                                       \
+      perror("FATAL ERROR: fiobj JSON couldn't allocate memory");              \
+      exit(errno);                                                             \
+    }                                                                          \
+  } while (0)
+
+/* *****************************************************************************
+Indexing (JSON parser callbacks)
+***************************************************************************** */
+
+typedef struct {
+  json_parser_s p;
+  fiobj_json_node_s *nodes;
+  size_t count;
+  size_t capa;
+  const char *json;
+  fio_ary_s stack;
+} fiobj_json_doc_parser_s;
+
+static inline fiobj_json_node_s *fiobj_json_doc_push(json_parser_s *p,
+                                                     uint8_t type) {
+  fiobj_json_doc_parser_s *pr = (fiobj_json_doc_parser_s *)p;
+  if (pr->count == pr->capa) {
+    pr->capa = pr->capa ? (pr->capa << 1) : 64;
+    pr->nodes = realloc(pr->nodes, pr->capa * sizeof(*pr->nodes));
+    REQUIRE_MEM(pr->nodes);
+  }
+  if (fio_ary_count(&pr->stack))
+    ++pr->nodes[(uintptr_t)fio_ary_index(&pr->stack, -1)].data.count;
+  fiobj_json_node_s *n = pr->nodes + pr->count;
+  ++pr->count;
+  *n = (fiobj_json_node_s){.type = type, .next = pr->count};
+  return n;
+}
+
+/** a NULL object was detected */
+static void fio_json_on_null(json_parser_s *p) {
+  fiobj_json_doc_push(p, FIOBJ_T_NULL);
+}
+/** a TRUE object was detected */
+static void fio_json_on_true(json_parser_s *p) {
+  fiobj_json_doc_push(p, FIOBJ_T_TRUE);
+}
+/** a FALSE object was detected */
+static void fio_json_on_false(json_parser_s *p) {
+  fiobj_json_doc_push(p, FIOBJ_T_FALSE);
+}
+/** a Numberl was detected (long long). */
+static void fio_json_on_number(json_parser_s *p, long long i) {
+  fiobj_json_doc_push(p, FIOBJ_T_NUMBER)->data.i = i;
+}
+/** a Float was detected (double). */
+static void fio_json_on_float(json_parser_s *p, double f) {
+  fiobj_json_doc_push(p, FIOBJ_T_FLOAT)->data.f = f;
+}
+/** a String was detected (int / float). update `pos` to point at ending */
+static void fio_json_on_string(json_parser_s *p, void *start, size_t length) {
+  fiobj_json_node_s *n = fiobj_json_doc_push(p, FIOBJ_T_STRING);
+  n->data.str.start =
+      (uint32_t)((uintptr_t)start -
+                 (uintptr_t)((fiobj_json_doc_parser_s *)p)->json);
+  n->data.str.len = (uint32_t)length;
+}
+/** a dictionary object was detected */
+static int fio_json_on_start_object(json_parser_s *p) {
+  fiobj_json_doc_parser_s *pr = (fiobj_json_doc_parser_s *)p;
+  fiobj_json_doc_push(p, FIOBJ_T_HASH);
+  fio_ary_push(&pr->stack, (void *)(uintptr_t)(pr->count - 1));
+  return 0;
+}
+/** a dictionary object closure detected */
+static void fio_json_on_end_object(json_parser_s *p) {
+  fiobj_json_doc_parser_s *pr = (fiobj_json_doc_parser_s *)p;
+  fiobj_json_node_s *n =
+      pr->nodes + (uintptr_t)fio_ary_pop(&pr->stack);
+  n->next = pr->count;
+  /* the count is the number of key-value pairs, a dangling key is ignored */
+  n->data.count >>= 1;
+}
+/** an array object was detected */
+static int fio_json_on_start_array(json_parser_s *p) {
+  fiobj_json_doc_parser_s *pr = (fiobj_json_doc_parser_s *)p;
+  fiobj_json_doc_push(p, FIOBJ_T_ARRAY);
+  fio_ary_push(&pr->stack, (void *)(uintptr_t)(pr->count - 1));
+  return 0;
+}
+/** an array closure was detected */
+static void fio_json_on_end_array(json_parser_s *p) {
+  fiobj_json_doc_parser_s *pr = (fiobj_json_doc_parser_s *)p;
+  pr->nodes[(uintptr_t)fio_ary_pop(&pr->stack)].next = pr->count;
+}
+/** the JSON parsing is complete */
+static void fio_json_on_json(json_parser_s *p) {
+  // fiobj_json_doc_parser_s *pr = (fiobj_json_doc_parser_s *)p;
+  (void)p;
+}
+/** the JSON parsing is complete */
+static void fio_json_on_error(json_parser_s *p) {
+  fiobj_json_doc_parser_s *pr = (fiobj_json_doc_parser_s *)p;
+#if DEBUG
+  fprintf(stderr, "ERROR: JSON on error called.\n");
+#endif
+  fio_ary_free(&pr->stack);
+  free(pr->nodes);
+  *pr = (fiobj_json_doc_parser_s){.nodes = NULL};
+}
+
+/* *****************************************************************************
+VTable
+***************************************************************************** */
+
+static void fiobj_json_doc_dealloc(FIOBJ o, void (*task)(FIOBJ, void *),
+                                   void *arg) {
+  free(obj2doc(o)->nodes);
+  free(obj2doc(o)->json);
+  free(FIOBJ2PTR(o));
+  (void)task;
+  (void)arg;
+}
+
+static size_t fiobj_json_doc_is_true(const FIOBJ o) {
+  return obj2doc(o)->count != 0;
+}
+
+static size_t fiobj_json_doc_iseq(const FIOBJ self, const FIOBJ other) {
+  return obj2doc(self)->len == obj2doc(other)->len &&
+         !memcmp(obj2doc(self)->json, obj2doc(other)->json,
+                 obj2doc(self)->len);
+}
+
+static fio_cstr_s fiobj_json_doc2str(const FIOBJ o) {
+  return (fio_cstr_s){.len = obj2doc(o)->len, .data = obj2doc(o)->json};
+}
+
+static intptr_t fiobj_json_doc2i(const FIOBJ o) {
+  return fiobj_json_doc_i(o, FIOBJ_JSON_DOC_ROOT);
+}
+
+static double fiobj_json_doc2f(const FIOBJ o) {
+  return fiobj_json_doc_f(o, FIOBJ_JSON_DOC_ROOT);
+}
+
+uintptr_t fiobject___noop_count(const FIOBJ o);
+
+const fiobj_object_vtable_s FIOBJECT_VTABLE_JSON = {
+    .class_name = "JSON",
+    .dealloc = fiobj_json_doc_dealloc,
+    .to_i = fiobj_json_doc2i,
+    .to_str = fiobj_json_doc2str,
+    .is_eq = fiobj_json_doc_iseq,
+    .is_true = fiobj_json_doc_is_true,
+    .to_f = fiobj_json_doc2f,
+    .count = fiobject___noop_count,
+};
+
+/* *****************************************************************************
+Lazy JSON document API
+***************************************************************************** */
+
+/**
+ * Indexes the JSON data (a single JSON value), returning a lazy JSON document.
+ *
+ * The data is copied. Returns FIOBJ_INVALID on error (i.e., malformed JSON).
+ */
+FIOBJ fiobj_json_doc_new(const void *data, size_t len) {
+  if (!data || !len || len >= UINT32_MAX)
+    return FIOBJ_INVALID;
+  char *json = malloc(len + 1);
+  REQUIRE_MEM(json);
+  memcpy(json, data, len);
+  json[len] = 0; /* the parser requires a NUL byte after the data */
+  fiobj_json_doc_parser_s p = {.json = json};
+  size_t consumed = fio_json_parse(&p.p, json, len);
+  fio_ary_free(&p.stack);
+  if (!consumed || p.p.depth || !p.count) {
+    free(p.nodes);
+    free(json);
+    return FIOBJ_INVALID;
+  }
+  fiobj_json_doc_s *doc = malloc(sizeof(*doc));
+  REQUIRE_MEM(doc);
+  *doc = (fiobj_json_doc_s){
+      .head = {.ref = 1, .type = FIOBJ_T_JSON},
+      .nodes = p.nodes,
+      .count = p.count,
+      .len = consumed,
+      .json = json,
+  };
+  return (FIOBJ)doc;
+}
+
+/** Returns the type of the node (FIOBJ_T_UNKNOWN for an invalid node). */
+fiobj_type_enum fiobj_json_doc_type(FIOBJ doc, size_t node) {
+  if (!FIOBJ_TYPE_IS(doc, FIOBJ_T_JSON) || node >= obj2doc(doc)->count)
+    return FIOBJ_T_UNKNOWN;
+  return (fiobj_type_enum)obj2doc(doc)->nodes[node].type;
+}
+
+/** Returns the number of members in an Array or a Hash node. */
+size_t fiobj_json_doc_count(FIOBJ doc, size_t node) {
+  switch (fiobj_json_doc_type(doc, node)) {
+  case FIOBJ_T_ARRAY: /* fallthrough */
+  case FIOBJ_T_HASH:
+    return obj2doc(doc)->nodes[node].data.count;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Returns the node following `node` and all it's nested nodes, which is the
+ * next sibling of `node` (if any).
+ */
+size_t fiobj_json_doc_next(FIOBJ doc, size_t node) {
+  if (fiobj_json_doc_type(doc, node) == FIOBJ_T_UNKNOWN)
+    return FIOBJ_JSON_DOC_INVALID;
+  return obj2doc(doc)->nodes[node].next;
+}
+
+/** Finds the value of a Hash member, or returns FIOBJ_JSON_DOC_INVALID. */
+size_t fiobj_json_doc_key(FIOBJ doc, size_t node, const char *key,
+                          size_t len) {
+  if (fiobj_json_doc_type(doc, node) != FIOBJ_T_HASH)
+    return FIOBJ_JSON_DOC_INVALID;
+  const fiobj_json_node_s *nodes = obj2doc(doc)->nodes;
+  const char *json = obj2doc(doc)->json;
+  size_t count = nodes[node].data.count;
+  size_t pos = node + 1;
+  char buf[256];
+  while (count) {
+    const fiobj_json_node_s *k = nodes + pos;
+    const size_t value = pos + 1;
+    const char *name = json + k->data.str.start;
+    /* escaped keys are never longer than their raw data */
+    if (len <= k->data.str.len) {
+      if (k->data.str.len == len && !memcmp(name, key, len))
+        return value;
+      if (memchr(name, '\\', k->data.str.len)) {
+        char *tmp = (k->data.str.len <= sizeof(buf))
+                        ? buf
+                        : malloc(k->data.str.len);
+        REQUIRE_MEM(tmp);
+        size_t tlen = fio_json_unescape_str(tmp, name, k->data.str.len);
+        uint8_t found = (tlen == len && !memcmp(tmp, key, len));
+        if (tmp != buf)
+          free(tmp);
+        if (found)
+          return value;
+      }
+    }
+    pos = nodes[value].next;
+    --count;
+  }
+  return FIOBJ_JSON_DOC_INVALID;
+}
+
+/**
+ * Finds the value of an Array member, or returns FIOBJ_JSON_DOC_INVALID.
+ *
+ * Negative values are counted from the end of the Array.
+ */
+size_t fiobj_json_doc_index(FIOBJ doc, size_t node, intptr_t index) {
+  if (fiobj_json_doc_type(doc, node) != FIOBJ_T_ARRAY)
+    return FIOBJ_JSON_DOC_INVALID;
+  const fiobj_json_node_s *nodes = obj2doc(doc)->nodes;
+  if (index < 0)
+    index += nodes[node].data.count;
+  if (index < 0 || (size_t)index >= nodes[node].data.count)
+    return FIOBJ_JSON_DOC_INVALID;
+  size_t pos = node + 1;
+  while (index) {
+    pos = nodes[pos].next;
+    --index;
+  }
+  return pos;
+}
+
+/** Returns the numeral value of a Number / Float node. */
+intptr_t fiobj_json_doc_i(FIOBJ doc, size_t node) {
+  switch (fiobj_json_doc_type(doc, node)) {
+  case FIOBJ_T_NUMBER:
+    return (intptr_t)obj2doc(doc)->nodes[node].data.i;
+  case FIOBJ_T_FLOAT:
+    return (intptr_t)obj2doc(doc)->nodes[node].data.f;
+  case FIOBJ_T_TRUE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/** Returns the Float value of a Number / Float node. */
+double fiobj_json_doc_f(FIOBJ doc, size_t node) {
+  switch (fiobj_json_doc_type(doc, node)) {
+  case FIOBJ_T_NUMBER:
+    return (double)obj2doc(doc)->nodes[node].data.i;
+  case FIOBJ_T_FLOAT:
+    return obj2doc(doc)->nodes[node].data.f;
+  case FIOBJ_T_TRUE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Returns the raw (still escaped) data of a String node.
+ *
+ * Use `fio_json_unescape_str` to decode the data, which never grows.
+ */
+fio_cstr_s fiobj_json_doc_raw(FIOBJ doc, size_t node) {
+  if (fiobj_json_doc_type(doc, node) != FIOBJ_T_STRING)
+    return (fio_cstr_s){.len = 0, .data = NULL};
+  const fiobj_json_node_s *n = obj2doc(doc)->nodes + node;
+  return (fio_cstr_s){.len = n->data.str.len,
+                      .data = obj2doc(doc)->json + n->data.str.start};
+}
+
+static FIOBJ fiobj_json_doc_decode(FIOBJ doc, size_t node) {
+  const fiobj_json_node_s *n = obj2doc(doc)->nodes + node;
+  switch ((fiobj_type_enum)n->type) {
+  case FIOBJ_T_NUMBER:
+    return fiobj_num_new((intptr_t)n->data.i);
+  case FIOBJ_T_FLOAT:
+    return fiobj_float_new(n->data.f);
+  case FIOBJ_T_TRUE:
+    return fiobj_true();
+  case FIOBJ_T_FALSE:
+    return fiobj_false();
+  case FIOBJ_T_STRING: {
+    FIOBJ str = fiobj_str_buf(n->data.str.len);
+    fiobj_str_resize(
+        str, fio_json_unescape_str(fiobj_obj2cstr(str).data,
+                                   obj2doc(doc)->json + n->data.str.start,
+                                   n->data.str.len));
+    return str;
+  }
+  case FIOBJ_T_ARRAY: {
+    FIOBJ ary = fiobj_ary_new2(n->data.count);
+    for (size_t i = node + 1; i < n->next; i = obj2doc(doc)->nodes[i].next)
+      fiobj_ary_push(ary, fiobj_json_doc_decode(doc, i));
+    return ary;
+  }
+  case FIOBJ_T_HASH: {
+    FIOBJ hash = fiobj_hash_new2(n->data.count);
+    size_t pos = node + 1;
+    for (size_t i = 0; i < n->data.count; ++i) {
+      FIOBJ key = fiobj_json_doc_decode(doc, pos);
+      pos = obj2doc(doc)->nodes[pos].next;
+      fiobj_hash_set(hash, key, fiobj_json_doc_decode(doc, pos));
+      fiobj_free(key);
+      pos = obj2doc(doc)->nodes[pos].next;
+    }
+    return hash;
+  }
+  default:
+    return fiobj_null();
+  }
+}
+
+/**
+ * Decodes the node (including any nested nodes) into a new object.
+ *
+ * Remember to `fiobj_free`.
+ */
+FIOBJ fiobj_json_doc_value(FIOBJ doc, size_t node) {
+  if (fiobj_json_doc_type(doc, node) == FIOBJ_T_UNKNOWN)
+    return FIOBJ_INVALID;
+  return fiobj_json_doc_decode(doc, node);
+}
+
+/* *****************************************************************************
+Test
+***************************************************************************** */
+
+#if DEBUG
+void fiobj_test_json_doc(void) {
+  fprintf(stderr, "=== Testing lazy JSON documents\n");
+#define TEST_ASSERT(cond, ...)                                                 \
+  if (!(cond)) {                                                               \
+    fprintf(stderr, "* " __VA_ARGS__);                                         \
+    fprintf(stderr, "Testing failed.\n");                                      \
+    exit(-1);                                                                  \
+  }
+  char json_str[] = "{\"array\":[1,2,3,\"boom\"],\"my\":{\"secret\":42},"
+                    "\"true\":true,\"float\":-2.2,\"\\u0061\":\"escaped\","
+                    "\"string\":\"I \\\"wrote\\\" this.\"}";
+  FIOBJ doc = fiobj_json_doc_new(json_str, sizeof(json_str) - 1);
+  TEST_ASSERT(FIOBJ_TYPE_IS(doc, FIOBJ_T_JSON), "JSON document failed!\n");
+  TEST_ASSERT(fiobj_json_doc_count(doc, FIOBJ_JSON_DOC_ROOT) == 6,
+              "JSON document count error (%zu)\n",
+              fiobj_json_doc_count(doc, FIOBJ_JSON_DOC_ROOT));
+  size_t node = fiobj_json_doc_key(doc, FIOBJ_JSON_DOC_ROOT, "my", 2);
+  node = fiobj_json_doc_key(doc, node, "secret", 6);
+  TEST_ASSERT(fiobj_json_doc_i(doc, node) == 42,
+              "JSON document nested key error\n");
+  node = fiobj_json_doc_key(doc, FIOBJ_JSON_DOC_ROOT, "array", 5);
+  node = fiobj_json_doc_index(doc, node, -1);
+  TEST_ASSERT(fiobj_json_doc_raw(doc, node).len == 4,
+              "JSON document negative index error\n");
+  node = fiobj_json_doc_key(doc, FIOBJ_JSON_DOC_ROOT, "a", 1);
+  TEST_ASSERT(fiobj_json_doc_type(doc, node) == FIOBJ_T_STRING,
+              "JSON document escaped key error\n");
+  TEST_ASSERT(fiobj_json_doc_key(doc, FIOBJ_JSON_DOC_ROOT, "missing", 7) ==
+                  FIOBJ_JSON_DOC_INVALID,
+              "JSON document missing key error\n");
+  FIOBJ value = fiobj_json_doc_value(doc, FIOBJ_JSON_DOC_ROOT);
+  FIOBJ parsed = FIOBJ_INVALID;
+  fiobj_json2obj(&parsed, json_str, sizeof(json_str) - 1);
+  TEST_ASSERT(fiobj_iseq(value, parsed),
+              "JSON document decoding differs from parser\n");
+  fiobj_free(value);
+  fiobj_free(parsed);
+  TEST_ASSERT(fiobj_obj2cstr(doc).len == sizeof(json_str) - 1,
+              "JSON document String value error\n");
+  fiobj_free(doc);
+  TEST_ASSERT(fiobj_json_doc_new("[1,2", 4) == FIOBJ_INVALID,
+              "JSON document should fail on partial data\n");
+  fprintf(stderr, "* passed.\n");
+}
+#endif
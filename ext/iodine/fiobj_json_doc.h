@@ -0,0 +1,98 @@
+#ifndef H_FIOBJ_JSON_DOC_H
+#define H_FIOBJ_JSON_DOC_H
+
+/*
+Copyright: Boaz Segev, 2017-2018
+License: MIT
+*/
+
+/**
+ * A lazy JSON document type (`FIOBJ_T_JSON`).
+ *
+ * The raw JSON is copied and indexed once, but values are only decoded when
+ * accessed. This is useful for large payloads where only a few values are
+ * actually used.
+ *
+ * The document is addressed using node handles. The root node is
+ * `FIOBJ_JSON_DOC_ROOT`. The first child of a container (if any) is `node + 1`
+ * and the following siblings are reached using `fiobj_json_doc_next`. Hash
+ * children alternate between keys and values.
+ *
+ * The document's String value (`fiobj_obj2cstr`) is the raw JSON text, so it
+ * can be embedded as is by `fiobj_obj2json`.
+ */
+
+#include "fiobj_json.h"
+#include "fiobject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The root node of a lazy JSON document. */
+#define FIOBJ_JSON_DOC_ROOT ((size_t)0)
+/** Returned when a node couldn't be found. */
+#define FIOBJ_JSON_DOC_INVALID ((size_t)-1)
+
+/* *****************************************************************************
+Lazy JSON document API
+***************************************************************************** */
+
+/**
+ * Indexes the JSON data (a single JSON value), returning a lazy JSON document.
+ *
+ * The data is copied. Returns FIOBJ_INVALID on error (i.e., malformed JSON).
+ */
+FIOBJ fiobj_json_doc_new(const void *data, size_t len);
+
+/** Returns the type of the node (FIOBJ_T_UNKNOWN for an invalid node). */
+fiobj_type_enum fiobj_json_doc_type(FIOBJ doc, size_t node);
+
+/** Returns the number of members in an Array or a Hash node. */
+size_t fiobj_json_doc_count(FIOBJ doc, size_t node);
+
+/**
+ * Returns the node following `node` and all it's nested nodes, which is the
+ * next sibling of `node` (if any).
+ */
+size_t fiobj_json_doc_next(FIOBJ doc, size_t node);
+
+/** Finds the value of a Hash member, or returns FIOBJ_JSON_DOC_INVALID. */
+size_t fiobj_json_doc_key(FIOBJ doc, size_t node, const char *key, size_t len);
+
+/**
+ * Finds the value of an Array member, or returns FIOBJ_JSON_DOC_INVALID.
+ *
+ * Negative values are counted from the end of the Array.
+ */
+size_t fiobj_json_doc_index(FIOBJ doc, size_t node, intptr_t index);
+
+/** Returns the numeral value of a Number / Float node. */
+intptr_t fiobj_json_doc_i(FIOBJ doc, size_t node);
+
+/** Returns the Float value of a Number / Float node. */
+double fiobj_json_doc_f(FIOBJ doc, size_t node);
+
+/**
+ * Returns the raw (still escaped) data of a String node.
+ *
+ * Use `fio_json_unescape_str` to decode the data, which never grows.
+ */
+fio_cstr_s fiobj_json_doc_raw(FIOBJ doc, size_t node);
+
+/**
+ * Decodes the node (including any nested nodes) into a new object.
+ *
+ * Remember to `fiobj_free`.
+ */
+FIOBJ fiobj_json_doc_value(FIOBJ doc, size_t node);
+
+#if DEBUG
+void fiobj_test_json_doc(void);
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
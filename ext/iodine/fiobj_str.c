@@ -36,6 +36,15 @@ License: MIT
 #define PATH_MAX PAGE_SIZE
 #endif
 
+#ifndef FIOBJ_STR_EMBED_LIMIT
+/**
+ * Strings created using `fiobj_str_new` that are too long for the internal
+ * (small string) storage, but shorter than this limit, are allocated together
+ * with the object (a single allocation).
+ */
+#define FIOBJ_STR_EMBED_LIMIT 1024
+#endif
+
 /* *****************************************************************************
 String Type
 ***************************************************************************** */
@@ -44,7 +53,7 @@ typedef struct {
   fiobj_object_header_s head;
   uint64_t hash;
   uint8_t is_small;
-  uint8_t frozen;
+  uint8_t frozen; /* a bit field (see STR_FROZEN / STR_PINNED) */
   uint8_t slen;
   intptr_t len;
   uintptr_t capa;
@@ -53,11 +62,19 @@ typedef struct {
 
 #define obj2str(o) ((fiobj_str_s *)(FIOBJ2PTR(o)))
 
+/* the String can't be edited */
+#define STR_FROZEN 1
+/* the static String's data lives as long as the object (see `fiobj_str_pin`) */
+#define STR_PINNED 2
+
 #define STR_INTENAL_OFFSET ((uintptr_t)(&(((fiobj_str_s *)0)->slen) + 1))
 #define STR_INTENAL_CAPA ((uintptr_t)(sizeof(fiobj_str_s) - STR_INTENAL_OFFSET))
 #define STR_INTENAL_STR(o)                                                     \
   ((char *)((uintptr_t)FIOBJ2PTR(o) + STR_INTENAL_OFFSET))
 #define STR_INTENAL_LEN(o) (((fiobj_str_s *)FIOBJ2PTR(o))->slen)
+/* the buffer of an embedded String follows the object's memory */
+#define STR_EMBEDDED_STR(o) ((char *)(obj2str(o) + 1))
+#define STR_IS_EMBEDDED(o) (obj2str(o)->str == STR_EMBEDDED_STR(o))
 
 static inline char *fiobj_str_mem_addr(FIOBJ o) {
   if (obj2str(o)->is_small)
@@ -78,6 +95,7 @@ static inline void fiobj_str_setlen(FIOBJ o, size_t len) {
   if (obj2str(o)->is_small) {
     obj2str(o)->slen = len;
     STR_INTENAL_STR(o)[len] = 0;
+    obj2str(o)->hash = 0;
   } else {
     obj2str(o)->len = len;
     obj2str(o)->str[len] = 0;
@@ -99,7 +117,7 @@ String VTables
 static fio_cstr_s fio_str2str(const FIOBJ o) { return fiobj_str_get_cstr(o); }
 
 static void fiobj_str_dealloc(FIOBJ o, void (*task)(FIOBJ, void *), void *arg) {
-  if (obj2str(o)->is_small == 0 && obj2str(o)->capa)
+  if (obj2str(o)->is_small == 0 && obj2str(o)->capa && !STR_IS_EMBEDDED(o))
     fio_free(obj2str(o)->str);
   fio_free(FIOBJ2PTR(o));
   (void)task;
@@ -183,6 +201,26 @@ FIOBJ fiobj_str_buf(size_t capa) {
 
 /** Creates a String object. Remember to use `fiobj_free`. */
 FIOBJ fiobj_str_new(const char *str, size_t len) {
+  if (len >= STR_INTENAL_CAPA && len < FIOBJ_STR_EMBED_LIMIT) {
+    /* a single allocation for both the object and the data */
+    fiobj_str_s *s = fio_malloc(sizeof(*s) + len + 1);
+    if (!s) {
+      perror("ERROR: fiobj string couldn't allocate memory");
+      exit(errno);
+    }
+    *s = (fiobj_str_s){
+        .head =
+            {
+                .ref = 1, .type = FIOBJ_T_STRING,
+            },
+        .len = len,
+        .capa = len + 1,
+        .str = (char *)(s + 1),
+    };
+    memcpy(s->str, str, len);
+    s->str[len] = 0;
+    return ((uintptr_t)s | FIOBJECT_STRING_FLAG);
+  }
   FIOBJ s = fiobj_str_buf(len);
   char *mem = fiobj_str_mem_addr(s);
   memcpy(mem, str, len);
@@ -289,6 +327,7 @@ FIOBJ fiobj_str_tmp(void) {
   };
   tmp.len = 0;
   tmp.slen = 0;
+  tmp.hash = 0;
   return ((uintptr_t)&tmp | FIOBJECT_STRING_FLAG);
 }
 
@@ -355,10 +394,34 @@ FIOBJ fiobj_str_readfile(const char *filename, intptr_t start_at,
 #endif
 }
 
+/** Copies a static String's data to memory owned by the String object. */
+void fiobj_str_unstatic(FIOBJ str) {
+  if (!FIOBJ_TYPE_IS(str, FIOBJ_T_STRING) || obj2str(str)->is_small ||
+      obj2str(str)->capa)
+    return;
+  uint8_t frozen = obj2str(str)->frozen;
+  obj2str(str)->frozen = 0;
+  fiobj_str_capa_assert(str, obj2str(str)->len);
+  obj2str(str)->frozen = frozen;
+}
+
+/** Returns 1 if the String's data isn't owned by the String object. */
+int fiobj_str_is_static(FIOBJ str) {
+  return FIOBJ_TYPE_IS(str, FIOBJ_T_STRING) && !obj2str(str)->is_small &&
+         !obj2str(str)->capa && !STR_IS_EMBEDDED(str) &&
+         !(obj2str(str)->frozen & STR_PINNED);
+}
+
+/** Marks a static String's data as living as long as the String object. */
+void fiobj_str_pin(FIOBJ str) {
+  if (FIOBJ_TYPE_IS(str, FIOBJ_T_STRING))
+    obj2str(str)->frozen |= (STR_FROZEN | STR_PINNED);
+}
+
 /** Prevents the String object from being changed. */
 void fiobj_str_freeze(FIOBJ str) {
   if (FIOBJ_TYPE_IS(str, FIOBJ_T_STRING))
-    obj2str(str)->frozen = 1;
+    obj2str(str)->frozen |= STR_FROZEN;
 }
 
 /** Confirms the requested capacity is available and allocates as required. */
@@ -399,8 +462,8 @@ size_t fiobj_str_capa_assert(FIOBJ str, size_t size) {
   else if (size < (obj2str(str)->capa << 1))
     size = obj2str(str)->capa << 1; /* grow in steps */
 
-  if (obj2str(str)->capa == 0) {
-    /* a static string */
+  if (obj2str(str)->capa == 0 || STR_IS_EMBEDDED(str)) {
+    /* a static string or an embedded string (can't be reallocated) */
     char *mem = fio_malloc(size);
     if (!mem) {
       perror("FATAL ERROR: Couldn't allocate new String memory");
@@ -442,7 +505,8 @@ void fiobj_str_resize(FIOBJ str, size_t size) {
 /** Deallocates any unnecessary memory (if supported by OS). */
 void fiobj_str_minimize(FIOBJ str) {
   assert(FIOBJ_TYPE_IS(str, FIOBJ_T_STRING));
-  if (obj2str(str)->frozen || obj2str(str)->is_small || obj2str(str)->capa == 0)
+  if (obj2str(str)->frozen || obj2str(str)->is_small ||
+      obj2str(str)->capa == 0 || STR_IS_EMBEDDED(str))
     return;
   obj2str(str)->capa = obj2str(str)->len + 1;
   obj2str(str)->str = fio_realloc(obj2str(str)->str, obj2str(str)->capa);
@@ -483,7 +547,7 @@ size_t fiobj_str_write2(FIOBJ dest, const char *format, ...) {
   int len = vsnprintf(NULL, 0, format, argv);
   va_end(argv);
   if (len <= 0)
-    return obj2str(dest)->len;
+    return fiobj_str_getlen(dest);
   fiobj_str_resize(dest, fiobj_str_getlen(dest) + len);
   va_start(argv, format);
   fio_cstr_s s = fiobj_str_get_cstr(dest);
@@ -502,7 +566,7 @@ size_t fiobj_str_join(FIOBJ dest, FIOBJ obj) {
     return 0;
   fio_cstr_s o = fiobj_obj2cstr(obj);
   if (o.len == 0)
-    return obj2str(dest)->len;
+    return fiobj_str_getlen(dest);
   return fiobj_str_write(dest, o.data, o.len);
 }
 
@@ -525,6 +589,102 @@ uint64_t fiobj_str_hash(FIOBJ o) {
   return obj2str(o)->hash;
 }
 
+/* *****************************************************************************
+Interned Strings
+***************************************************************************** */
+
+#ifndef FIOBJ_STR_INTERN_SWEEP
+/**
+ * The minimal number of interned Strings before the table is swept, releasing
+ * any String that is only referenced by the table itself.
+ */
+#define FIOBJ_STR_INTERN_SWEEP 1024
+#endif
+
+#include "spnlock.inc"
+
+typedef struct {
+  uint64_t hash;
+  FIOBJ str;
+  fio_cstr_s data;
+} fiobj_str_intern_key_s;
+
+#if !FIO_FORCE_MALLOC
+#define FIO_HASH_REALLOC(ptr, original_size, size, valid_data_length)          \
+  fio_realloc2((ptr), (size), (valid_data_length))
+#endif
+#define FIO_HASH_KEY_TYPE fiobj_str_intern_key_s
+#define FIO_HASH_KEY_INVALID ((fiobj_str_intern_key_s){.str = FIOBJ_INVALID})
+#define FIO_HASH_KEY2UINT(k) ((k).hash)
+#define FIO_HASH_COMPARE_KEYS(k1, k2)                                          \
+  ((k1).data.len == (k2).data.len &&                                           \
+   !memcmp((k1).data.data, (k2).data.data, (k1).data.len))
+#define FIO_HASH_KEY_ISINVALID(k) ((k).str == FIOBJ_INVALID && !(k).data.data)
+#define FIO_HASH_KEY_COPY(k) (k)
+#define FIO_HASH_KEY_DESTROY(k) fiobj_free((k).str)
+
+#include "fio_hashmap.h"
+
+/* each interned String is referenced once by the table (the key) */
+static fio_hash_s fiobj_str_interned = FIO_HASH_INIT;
+static size_t fiobj_str_intern_limit = FIOBJ_STR_INTERN_SWEEP;
+static spn_lock_i fiobj_str_intern_lock = SPN_LOCK_INIT;
+
+/* releases Strings that are only referenced by the table (call within lock) */
+static void fiobj_str_intern_sweep(void) {
+  fio_hash_s live = FIO_HASH_INIT;
+  FIO_HASH_FOR_LOOP(&fiobj_str_interned, i) {
+    if (!i->obj)
+      continue;
+    if (FIOBJECT2HEAD(i->key.str)->ref > 1)
+      fio_hash_insert(&live, i->key, i->obj);
+    else
+      fiobj_free(i->key.str);
+  }
+  fio_hash_free(&fiobj_str_interned);
+  fiobj_str_interned = live;
+  fiobj_str_intern_limit = fiobj_str_interned.count << 1;
+  if (fiobj_str_intern_limit < FIOBJ_STR_INTERN_SWEEP)
+    fiobj_str_intern_limit = FIOBJ_STR_INTERN_SWEEP;
+}
+
+/**
+ * Returns a shared (frozen and pre-hashed) String object with the requested
+ * data. Remember to use `fiobj_free`.
+ */
+FIOBJ fiobj_str_intern(const char *str, size_t len) {
+  fiobj_str_intern_key_s key = {
+      .hash = fio_siphash(str, len),
+      .data = {.data = (char *)str, .len = len},
+  };
+  spn_lock(&fiobj_str_intern_lock);
+  FIOBJ s = (FIOBJ)fio_hash_find(&fiobj_str_interned, key);
+  if (!s) {
+    if (fiobj_str_interned.count >= fiobj_str_intern_limit)
+      fiobj_str_intern_sweep();
+    s = fiobj_str_new(str, len);
+    obj2str(s)->hash = key.hash;
+    obj2str(s)->frozen = STR_FROZEN;
+    key.str = s;
+    key.data = fiobj_str_get_cstr(s);
+    fio_hash_insert(&fiobj_str_interned, key, (void *)s);
+  }
+  fiobj_dup(s);
+  spn_unlock(&fiobj_str_intern_lock);
+  return s;
+}
+
+/**
+ * Releases the interned String table's references. Interned Strings that are
+ * still in use remain valid, but they will no longer be shared.
+ */
+void fiobj_str_intern_clear(void) {
+  spn_lock(&fiobj_str_intern_lock);
+  FIO_HASH_FOR_FREE(&fiobj_str_interned, i) {}
+  fiobj_str_intern_limit = FIOBJ_STR_INTERN_SWEEP;
+  spn_unlock(&fiobj_str_intern_lock);
+}
+
 /* *****************************************************************************
 Tests
 ***************************************************************************** */
@@ -579,6 +739,45 @@ void fiobj_test_string(void) {
               (unsigned long)fiobj_obj2cstr(o).len, fiobj_obj2cstr(o).data);
   fiobj_free(o);
 
+  o = fiobj_str_new("Hello", 5);
+  hash = fiobj_str_hash(o);
+  fiobj_str_write(o, " World", 6);
+  TEST_ASSERT(hash != fiobj_str_hash(o),
+              "Small String hash wasn't updated after editing.\n");
+  fiobj_free(o);
+
+  o = fiobj_str_new(
+      "hello my dear friend, I hope that your are well and happy.", 58);
+  TEST_ASSERT(STR_IS_EMBEDDED(o), "Short String data isn't embedded.\n");
+  fiobj_str_write(o, " World", 6);
+  TEST_ASSERT(!STR_IS_EMBEDDED(o), "Embedded String wasn't moved.\n");
+  STR_EQ(o, "hello my dear friend, I hope that your are well and happy."
+            " World");
+  fiobj_free(o);
+
+  o = fiobj_str_intern("content-type", 12);
+  FIOBJ o2 = fiobj_str_intern("content-type", 12);
+  TEST_ASSERT(o == o2, "Interned Strings aren't shared.\n");
+  TEST_ASSERT(obj2str(o)->frozen, "Interned String isn't frozen.\n");
+  TEST_ASSERT(fiobj_str_hash(o) == fio_siphash("content-type", 12),
+              "Interned String hash error.\n");
+  fiobj_free(o2);
+  o2 = fiobj_str_intern("content-length", 14);
+  TEST_ASSERT(o != o2, "Interned Strings collide.\n");
+  fiobj_free(o2);
+  for (size_t i = 0; i < (FIOBJ_STR_INTERN_SWEEP << 2); ++i) {
+    char buf[32];
+    fiobj_free(fiobj_str_intern(buf, (size_t)sprintf(buf, "%zu", i)));
+  }
+  TEST_ASSERT(fiobj_str_interned.count <= (FIOBJ_STR_INTERN_SWEEP << 1),
+              "Interned Strings weren't swept (%zu).\n",
+              (size_t)fiobj_str_interned.count);
+  TEST_ASSERT(o == (o2 = fiobj_str_intern("content-type", 12)),
+              "Interned String in use was swept.\n");
+  fiobj_free(o2);
+  fiobj_free(o);
+  fiobj_str_intern_clear();
+
   o = fiobj_str_static("Hello", 5);
   TEST_ASSERT(obj2str(o)->is_small,
               "Small Static should be converted to dynamic.\n");
@@ -586,11 +785,21 @@ void fiobj_test_string(void) {
 
   o = fiobj_str_static(
       "hello my dear friend, I hope that your are well and happy.", 58);
+  TEST_ASSERT(fiobj_str_is_static(o), "Static String isn't static.\n");
   fiobj_str_write(o, " World", 6);
+  TEST_ASSERT(!fiobj_str_is_static(o), "Edited String is still static.\n");
   STR_EQ(o, "hello my dear friend, I hope that your are well and happy."
             " World");
   fiobj_free(o);
 
+  o = fiobj_str_static(
+      "hello my dear friend, I hope that your are well and happy.", 58);
+  fiobj_str_pin(o);
+  TEST_ASSERT(!fiobj_str_is_static(o), "Pinned String is static.\n");
+  fiobj_str_write(o, " World", 6);
+  TEST_ASSERT(fiobj_obj2cstr(o).len == 58, "Pinned String isn't frozen.\n");
+  fiobj_free(o);
+
   o = fiobj_strprintf("%u", 42);
   TEST_ASSERT(fiobj_str_getlen(o) == 2, "fiobj_strprintf length error.\n");
   TEST_ASSERT(fiobj_obj2num(o), "fiobj_strprintf integer error.\n");
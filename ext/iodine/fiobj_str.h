@@ -38,6 +38,30 @@ FIOBJ fiobj_str_buf(size_t capa);
  */
 FIOBJ fiobj_str_static(const char *str, size_t len);
 
+/**
+ * Copies the data of a static String (see `fiobj_str_static`) to memory owned
+ * by the String object, so the static C string can be released or reused.
+ *
+ * Frozen Strings are copied as well. Other Strings are left unchanged.
+ */
+void fiobj_str_unstatic(FIOBJ str);
+
+/**
+ * Returns 1 if the String's data isn't owned by the String object (see
+ * `fiobj_str_static`), meaning the data might be released or reused while the
+ * object is still alive. Otherwise returns 0.
+ */
+int fiobj_str_is_static(FIOBJ str);
+
+/**
+ * Marks a static String's data as valid for as long as the String object is
+ * alive (i.e., the data is released only after the object), so
+ * `fiobj_str_is_static` returns 0 and the data isn't copied when handed off.
+ *
+ * The String is frozen as well.
+ */
+void fiobj_str_pin(FIOBJ str);
+
 /** Creates a copy from an existing String. Remember to use `fiobj_free`. */
 static inline __attribute__((unused)) FIOBJ fiobj_str_copy(FIOBJ src) {
   fio_cstr_s s = fiobj_obj2cstr(src);
@@ -54,6 +78,23 @@ static inline __attribute__((unused)) FIOBJ fiobj_str_copy(FIOBJ src) {
  */
 FIOBJ fiobj_str_move(char *str, size_t len, size_t capacity);
 
+/**
+ * Returns a shared String object with the requested data, creating it only if
+ * it doesn't already exist. Remember to use `fiobj_free`.
+ *
+ * Interned Strings are frozen and their hash value is pre-computed, making
+ * them ideal for repeating Hash keys (i.e., header names or JSON keys).
+ *
+ * Strings that are no longer in use are released once the table grows.
+ */
+FIOBJ fiobj_str_intern(const char *str, size_t len);
+
+/**
+ * Releases the interned String table. Interned Strings that are still in use
+ * remain valid, but they will no longer be shared.
+ */
+void fiobj_str_intern_clear(void);
+
 /**
  * Returns a thread-static temporary string. Avoid calling `fiobj_dup` or
  * `fiobj_free`.
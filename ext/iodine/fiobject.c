@@ -103,6 +103,75 @@ finish:
   return packet.counter;
 }
 
+/* *****************************************************************************
+Thread-confined objects
+***************************************************************************** */
+#include "fiobj_hash.h"
+
+typedef struct {
+  fio_ary_s stack;
+  /* set while iterating a Hash (keys are available) */
+  uint8_t is_hash;
+} fiobj_confine_s;
+
+static int fiobj_confine_task(FIOBJ o, void *c_) {
+  fiobj_confine_s *c = c_;
+  if (c->is_hash) {
+    FIOBJ key = fiobj_hash_key_in_loop();
+    if (FIOBJ_IS_ALLOCATED(key) && FIOBJECT2HEAD(key)->ref == 1)
+      FIOBJECT2HEAD(key)->ref |= FIOBJ_REF_LOCAL;
+  }
+  if (!FIOBJ_IS_ALLOCATED(o) || FIOBJECT2HEAD(o)->ref != 1)
+    return 0;
+  FIOBJECT2HEAD(o)->ref |= FIOBJ_REF_LOCAL;
+  if (FIOBJECT2VTBL(o)->each && FIOBJECT2VTBL(o)->count(o))
+    fio_ary_push(&c->stack, (void *)o);
+  return 0;
+}
+
+/**
+ * Marks an object (and any nested objects that aren't referenced elsewhere) as
+ * thread-confined, so `fiobj_dup` and `fiobj_free` avoid atomic operations.
+ */
+void fiobj_confine(FIOBJ o) {
+  fiobj_confine_s c = {.stack = FIO_ARY_INIT};
+  fiobj_confine_task(o, &c);
+  while ((o = (FIOBJ)fio_ary_pop(&c.stack))) {
+    c.is_hash = FIOBJ_TYPE_IS(o, FIOBJ_T_HASH);
+    fiobj_each1(o, 0, fiobj_confine_task, &c);
+  }
+  fio_ary_free(&c.stack);
+}
+
+static int fiobj_share_task(FIOBJ o, void *c_) {
+  fiobj_confine_s *c = c_;
+  if (c->is_hash) {
+    FIOBJ key = fiobj_hash_key_in_loop();
+    if (FIOBJ_IS_ALLOCATED(key))
+      FIOBJECT2HEAD(key)->ref &= ~FIOBJ_REF_LOCAL;
+  }
+  if (!FIOBJ_IS_ALLOCATED(o) || !(FIOBJECT2HEAD(o)->ref & FIOBJ_REF_LOCAL))
+    return 0;
+  FIOBJECT2HEAD(o)->ref ^= FIOBJ_REF_LOCAL;
+  if (FIOBJECT2VTBL(o)->each && FIOBJECT2VTBL(o)->count(o))
+    fio_ary_push(&c->stack, (void *)o);
+  return 0;
+}
+
+/**
+ * Restores atomic reference counting for a thread-confined object (and any
+ * nested objects), so it can be shared with other threads.
+ */
+void fiobj_share(FIOBJ o) {
+  fiobj_confine_s c = {.stack = FIO_ARY_INIT};
+  fiobj_share_task(o, &c);
+  while ((o = (FIOBJ)fio_ary_pop(&c.stack))) {
+    c.is_hash = FIOBJ_TYPE_IS(o, FIOBJ_T_HASH);
+    fiobj_each1(o, 0, fiobj_share_task, &c);
+  }
+  fio_ary_free(&c.stack);
+}
+
 /* *****************************************************************************
 Free complex objects (objects with nesting)
 ***************************************************************************** */
@@ -133,16 +202,18 @@ static void fiobj_dealloc_task(FIOBJ o, void *stack_) {
  */
 void fiobj_free_complex_object(FIOBJ o) {
   fio_ary_s stack = FIO_ARY_INIT;
+  /* a dead tree is released in bulk */
+  fio_free_batch_begin();
   do {
     FIOBJECT2VTBL(o)->dealloc(o, fiobj_dealloc_task, &stack);
   } while ((o = (FIOBJ)fio_ary_pop(&stack)));
+  fio_free_batch_end();
   fio_ary_free(&stack);
 }
 
 /* *****************************************************************************
 Is Equal?
 ***************************************************************************** */
-#include "fiobj_hash.h"
 
 static inline int fiobj_iseq_simple(const FIOBJ o, const FIOBJ o2) {
   if (o == o2)
@@ -322,8 +393,34 @@ void fiobj_test_core(void) {
   TEST_ASSERT(!fiobj_iseq(o, fiobj_null()),
               "Array and fiobj_null can't be equal!");
   TEST_ASSERT(fiobj_iseq(o, o2), "Arrays aren't euqal!");
-  fiobj_free(o);
   fiobj_free(o2);
+  fprintf(stderr, "* passed.\n");
+  fprintf(stderr, "=== Testing thread-confined objects\n");
+  tmp = fiobj_ary_entry(o, 0);
+  fiobj_dup(tmp);
+  fiobj_confine(o);
+  TEST_ASSERT(FIOBJECT2HEAD(o)->ref & FIOBJ_REF_LOCAL,
+              "fiobj_confine didn't mark the object.\n");
+  TEST_ASSERT(!(FIOBJECT2HEAD(tmp)->ref & FIOBJ_REF_LOCAL),
+              "fiobj_confine marked an object referenced elsewhere.\n");
+  TEST_ASSERT(fiobj_dup(o) == o && OBJREF_REM(o) == 1,
+              "thread-confined reference count error.\n");
+  fiobj_share(o);
+  TEST_ASSERT(FIOBJECT2HEAD(o)->ref == 1,
+              "fiobj_share didn't restore the object (%u).\n",
+              (unsigned int)FIOBJECT2HEAD(o)->ref);
+  o2 = fiobj_ary_new();
+  fiobj_ary_push(o2, fiobj_str_new("confined", 8));
+  fiobj_confine(o2);
+  TEST_ASSERT(FIOBJECT2HEAD(fiobj_ary_entry(o2, 0))->ref & FIOBJ_REF_LOCAL,
+              "fiobj_confine didn't mark a nested object.\n");
+  fiobj_share(o2);
+  TEST_ASSERT(FIOBJECT2HEAD(fiobj_ary_entry(o2, 0))->ref == 1,
+              "fiobj_share didn't restore a nested object.\n");
+  fiobj_confine(o2);
+  fiobj_free(o2);
+  fiobj_free(tmp);
+  fiobj_free(o);
   TEST_ASSERT(fiobj_iseq(fiobj_null(), fiobj_null()),
               "fiobj_null() not equal to self!");
   TEST_ASSERT(fiobj_iseq(fiobj_false(), fiobj_false()),
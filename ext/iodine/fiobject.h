@@ -45,6 +45,7 @@ typedef enum __attribute__((packed)) {
   FIOBJ_T_ARRAY,
   FIOBJ_T_HASH,
   FIOBJ_T_DATA,
+  FIOBJ_T_JSON,
   FIOBJ_T_UNKNOWN
 } fiobj_type_enum;
 
@@ -103,6 +104,22 @@ FIO_INLINE FIOBJ fiobj_dup(FIOBJ);
  */
 FIO_INLINE void fiobj_free(FIOBJ);
 
+/**
+ * Marks an object (and any nested objects that aren't referenced elsewhere) as
+ * thread-confined, so `fiobj_dup` and `fiobj_free` avoid atomic operations.
+ *
+ * Only objects with a single reference are marked. The caller must own that
+ * reference and the object MUST NOT be accessed by more than one thread at a
+ * time until `fiobj_share` is called.
+ */
+void fiobj_confine(FIOBJ);
+
+/**
+ * Restores atomic reference counting for a thread-confined object (and any
+ * nested objects), so it can be shared with other threads.
+ */
+void fiobj_share(FIOBJ);
+
 /**
  * Tests if an object evaluates as TRUE.
  *
@@ -284,6 +301,7 @@ FIO_INLINE size_t fiobj_type_is(FIOBJ o, fiobj_type_enum type) {
   case FIOBJ_T_FLOAT:
   case FIOBJ_T_ARRAY:
   case FIOBJ_T_DATA:
+  case FIOBJ_T_JSON:
   case FIOBJ_T_UNKNOWN:
     return FIOBJ_IS_ALLOCATED(o) &&
            ((fiobj_type_enum *)FIOBJ2PTR(o))[0] == type;
@@ -330,6 +348,7 @@ extern const fiobj_object_vtable_s FIOBJECT_VTABLE_STRING;
 extern const fiobj_object_vtable_s FIOBJECT_VTABLE_ARRAY;
 extern const fiobj_object_vtable_s FIOBJECT_VTABLE_HASH;
 extern const fiobj_object_vtable_s FIOBJECT_VTABLE_DATA;
+extern const fiobj_object_vtable_s FIOBJECT_VTABLE_JSON;
 
 #define FIOBJECT2VTBL(o) fiobj_type_vtable(o)
 #define FIOBJECT2HEAD(o) (((fiobj_object_header_s *)FIOBJ2PTR((o))))
@@ -348,6 +367,8 @@ FIO_INLINE const fiobj_object_vtable_s *fiobj_type_vtable(FIOBJ o) {
     return &FIOBJECT_VTABLE_HASH;
   case FIOBJ_T_DATA:
     return &FIOBJECT_VTABLE_DATA;
+  case FIOBJ_T_JSON:
+    return &FIOBJECT_VTABLE_JSON;
   case FIOBJ_T_NULL:
   case FIOBJ_T_TRUE:
   case FIOBJ_T_FALSE:
@@ -393,8 +414,17 @@ Atomic reference counting
 #error missing required atomic options.
 #endif
 
-#define OBJREF_ADD(o) fiobj_ref_inc(o)
-#define OBJREF_REM(o) fiobj_ref_dec(o)
+/** Marks a thread-confined reference counter (see `fiobj_confine`). */
+#define FIOBJ_REF_LOCAL ((uint32_t)1 << 31)
+
+#define OBJREF_ADD(o)                                                          \
+  ((FIOBJECT2HEAD(o)->ref & FIOBJ_REF_LOCAL)                                   \
+       ? ((++FIOBJECT2HEAD(o)->ref) ^ FIOBJ_REF_LOCAL)                         \
+       : fiobj_ref_inc(o))
+#define OBJREF_REM(o)                                                          \
+  ((FIOBJECT2HEAD(o)->ref & FIOBJ_REF_LOCAL)                                   \
+       ? ((--FIOBJECT2HEAD(o)->ref) ^ FIOBJ_REF_LOCAL)                         \
+       : fiobj_ref_dec(o))
 
 /* *****************************************************************************
 Inlined Functions
@@ -439,7 +469,7 @@ FIO_INLINE FIOBJ fiobj_dup(FIOBJ o) {
 FIO_INLINE void fiobj_free(FIOBJ o) {
   if (!FIOBJ_IS_ALLOCATED(o))
     return;
-  if (fiobj_ref_dec(o))
+  if (OBJREF_REM(o))
     return;
   if (FIOBJECT2VTBL(o)->each && FIOBJECT2VTBL(o)->count(o))
     fiobj_free_complex_object(o);
@@ -8,11 +8,14 @@ Feel free to copy, use and enjoy according to the license provided.
 #include "spnlock.inc"
 
 #include "fio_base64.h"
+#include "fio_random.h"
 #include "http1.h"
+#include "http2.h"
 #include "http_internal.h"
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -46,6 +49,8 @@ static inline int patch_clock_gettime(int clk_id, struct timespec *t) {
 Small Helpers
 ***************************************************************************** */
 static inline int hex2byte(uint8_t *dest, const uint8_t *source);
+static inline const char *http_decode_seek(const char *pos, const char *end,
+                                           uint8_t plus);
 
 static inline void add_content_length(http_s *r, uintptr_t length) {
   static uint64_t cl_hash = 0;
@@ -348,6 +353,475 @@ int http_set_cookie(http_s *h, http_cookie_args_s cookie) {
 #define http_set_cookie(http__req__, ...)                                      \
   http_set_cookie((http__req__), (http_cookie_args_s){__VA_ARGS__})
 
+/* *****************************************************************************
+Response compression
+
+Buffered bodies are compressed at once, using a per-thread zlib stream (brotli
+uses the one-shot encoder). Streamed bodies borrow an encoder from a per-process
+pool (zlib streams are reset, not reallocated) and flush it with every part.
+***************************************************************************** */
+
+/**
+ * Enables gzip response compression (requires zlib, set by `extconf.rb` when
+ * available).
+ */
+#ifndef HTTP_GZIP
+#define HTTP_GZIP 0
+#endif
+
+/**
+ * Enables brotli response compression (requires the brotli encoder, set by
+ * `extconf.rb` when available).
+ */
+#ifndef HTTP_BROTLI
+#define HTTP_BROTLI 0
+#endif
+
+/** The zlib compression level for dynamic responses. */
+#ifndef HTTP_GZIP_LEVEL
+#define HTTP_GZIP_LEVEL 6
+#endif
+
+/** The brotli quality for dynamic responses (11 is too slow for this). */
+#ifndef HTTP_BROTLI_QUALITY
+#define HTTP_BROTLI_QUALITY 5
+#endif
+
+/** The number of idle stream encoders kept for reuse (per process). */
+#ifndef HTTP_ENCODER_POOL
+#define HTTP_ENCODER_POOL 32
+#endif
+
+#if HTTP_GZIP
+#include <zlib.h>
+#endif
+#if HTTP_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#define HTTP_ENCODING_GZIP 1
+#define HTTP_ENCODING_BROTLI 2
+
+/* marks a streamed response that isn't compressed */
+#define HTTP_ENCODER_NONE ((void *)1)
+
+#if HTTP_GZIP || HTTP_BROTLI
+
+typedef struct http_encoder_s {
+  struct http_encoder_s *next;
+  uint8_t encoding;
+#if HTTP_GZIP
+  uint8_t z_ready;
+  z_stream z;
+#endif
+#if HTTP_BROTLI
+  BrotliEncoderState *br;
+#endif
+} http_encoder_s;
+
+static struct {
+  http_encoder_s *idle;
+  size_t count;
+  spn_lock_i lock;
+} http_encoder_pool = {.lock = SPN_LOCK_INIT};
+
+/* does the content type describe (compressible) text? */
+static uint8_t http_mime_is_text(fio_cstr_s t) {
+  size_t len = 0;
+  while (len < t.len && t.data[len] != ';')
+    ++len;
+  if (len >= 5 && !memcmp(t.data, "text/", 5))
+    return 1;
+  static const struct {
+    const char *name;
+    size_t len;
+  } types[] = {{"json", 4}, {"javascript", 10}, {"xml", 3}, {"svg", 3}};
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+    for (size_t pos = 0; pos + types[i].len <= len; ++pos) {
+      if (!memcmp(t.data + pos, types[i].name, types[i].len))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/* a case insensitive search for `token` in a header's value */
+static uint8_t http_hvalue_has(FIOBJ value, const char *token, size_t len) {
+  if (!value)
+    return 0;
+  if (FIOBJ_TYPE_IS(value, FIOBJ_T_ARRAY)) {
+    for (size_t i = 0; i < fiobj_ary_count(value); ++i) {
+      if (http_hvalue_has(fiobj_ary_index(value, i), token, len))
+        return 1;
+    }
+    return 0;
+  }
+  fio_cstr_s s = fiobj_obj2cstr(value);
+  for (size_t pos = 0; pos + len <= s.len; ++pos) {
+    if (!strncasecmp(s.data + pos, token, len))
+      return 1;
+  }
+  return 0;
+}
+
+/* the encodings in the request's `accept-encoding` (unless q=0) */
+static uint8_t http_encoding_accepted(http_s *r) {
+  static uint64_t ae_hash = 0;
+  if (!ae_hash)
+    ae_hash = fiobj_obj2hash(HTTP_HEADER_ACCEPT_ENCODING);
+  FIOBJ ae = fiobj_hash_get2(r->headers, ae_hash);
+  if (!ae || !FIOBJ_TYPE_IS(ae, FIOBJ_T_STRING))
+    return 0;
+  fio_cstr_s s = fiobj_obj2cstr(ae);
+  const char *pos = s.data;
+  const char *end = s.data + s.len;
+  uint8_t ret = 0;
+  while (pos < end) {
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+      ++pos;
+    const char *token = pos;
+    while (pos < end && *pos != ',' && *pos != ';' && *pos != ' ' &&
+           *pos != '\t')
+      ++pos;
+    const size_t len = pos - token;
+    uint8_t refused = 0;
+    while (pos < end && *pos != ',') {
+      if ((*pos == 'q' || *pos == 'Q') && pos + 1 < end && pos[1] == '=') {
+        /* q=0, q=0.0, etc' refuse the encoding */
+        pos += 2;
+        refused = 1;
+        while (pos < end && (*pos == '0' || *pos == '.'))
+          ++pos;
+        if (pos < end && *pos >= '1' && *pos <= '9')
+          refused = 0;
+        continue;
+      }
+      ++pos;
+    }
+    if (refused || !len)
+      continue;
+    if (len == 4 && !strncasecmp(token, "gzip", 4))
+      ret |= HTTP_ENCODING_GZIP;
+    else if (len == 2 && !strncasecmp(token, "br", 2))
+      ret |= HTTP_ENCODING_BROTLI;
+    else if (len == 1 && token[0] == '*')
+      ret |= HTTP_ENCODING_GZIP | HTTP_ENCODING_BROTLI;
+  }
+  return ret;
+}
+
+/*
+ * Selects the response's encoding (0 for none). `length` is 0 for streams.
+ *
+ * Compressible responses get a `vary: accept-encoding` header whether or not
+ * the client accepts any supported encoding.
+ */
+static uint8_t http_encoding_select(http_s *r, uintptr_t length) {
+  static uint64_t ce_hash = 0, cc_hash = 0, ct_hash = 0, cl_hash = 0;
+  if (!ce_hash) {
+    ce_hash = fiobj_obj2hash(HTTP_HEADER_CONTENT_ENCODING);
+    cc_hash = fiobj_obj2hash(HTTP_HEADER_CACHE_CONTROL);
+    ct_hash = fiobj_obj2hash(HTTP_HEADER_CONTENT_TYPE);
+    cl_hash = fiobj_obj2hash(HTTP_HEADER_CONTENT_LENGTH);
+  }
+  http_settings_s *settings = http2protocol(r)->settings;
+  if (!settings || !settings->compress || settings->is_client)
+    return 0;
+  if (length ? length < settings->compress
+             : !!fiobj_hash_get2(r->private_data.out_headers, cl_hash))
+    return 0;
+  if (r->status < 200 || r->status == 204 || r->status == 206 ||
+      r->status == 304)
+    return 0;
+  FIOBJ headers = r->private_data.out_headers;
+  FIOBJ type = fiobj_hash_get2(headers, ct_hash);
+  if (!type || FIOBJ_TYPE_IS(type, FIOBJ_T_ARRAY) ||
+      !http_mime_is_text(fiobj_obj2cstr(type)) ||
+      fiobj_hash_get2(headers, ce_hash) ||
+      http_hvalue_has(fiobj_hash_get2(headers, cc_hash), "no-transform", 12))
+    return 0;
+  if (!http_hvalue_has(fiobj_hash_get(headers, HTTP_HEADER_VARY),
+                       "accept-encoding", 15))
+    set_header_add(headers, HTTP_HEADER_VARY,
+                   fiobj_dup(HTTP_HEADER_ACCEPT_ENCODING));
+  const uint8_t accepted = http_encoding_accepted(r);
+  if (HTTP_BROTLI && (accepted & HTTP_ENCODING_BROTLI))
+    return HTTP_ENCODING_BROTLI;
+  if (HTTP_GZIP && (accepted & HTTP_ENCODING_GZIP))
+    return HTTP_ENCODING_GZIP;
+  return 0;
+}
+
+/* sets the `content-encoding` and weakens a strong `etag` */
+static void http_encoding_headers(http_s *r, uint8_t encoding) {
+  static uint64_t etag_hash = 0;
+  if (!etag_hash)
+    etag_hash = fiobj_obj2hash(HTTP_HEADER_ETAG);
+  fiobj_hash_set(r->private_data.out_headers, HTTP_HEADER_CONTENT_ENCODING,
+                 fiobj_dup(encoding == HTTP_ENCODING_BROTLI ? HTTP_HVALUE_BROTLI
+                                                           : HTTP_HVALUE_GZIP));
+  FIOBJ etag = fiobj_hash_get2(r->private_data.out_headers, etag_hash);
+  if (etag && FIOBJ_TYPE_IS(etag, FIOBJ_T_STRING)) {
+    fio_cstr_s s = fiobj_obj2cstr(etag);
+    if (s.len >= 2 && s.data[0] == 'W' && s.data[1] == '/')
+      return;
+    FIOBJ weak = fiobj_str_buf(s.len + 2);
+    fiobj_str_write(weak, "W/", 2);
+    fiobj_str_write(weak, s.data, s.len);
+    fiobj_hash_set(r->private_data.out_headers, HTTP_HEADER_ETAG, weak);
+  }
+}
+
+#if HTTP_GZIP
+/* gzip compresses a buffer. Returns FIOBJ_INVALID if it didn't get shorter. */
+static FIOBJ http_gzip_buffer(void *data, size_t len) {
+  static __thread z_stream z;
+  static __thread uint8_t z_ready;
+  if (!z_ready) {
+    /* 15 + 16 writes a gzip (rather than a zlib) header and trailer */
+    if (deflateInit2(&z, HTTP_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return FIOBJ_INVALID;
+    z_ready = 1;
+  } else
+    deflateReset(&z);
+  const size_t capa = deflateBound(&z, len);
+  FIOBJ out = fiobj_str_buf(capa);
+  z.next_in = data;
+  z.avail_in = len;
+  z.next_out = (Bytef *)fiobj_obj2cstr(out).data;
+  z.avail_out = capa;
+  if (deflate(&z, Z_FINISH) != Z_STREAM_END || capa - z.avail_out >= len) {
+    fiobj_free(out);
+    return FIOBJ_INVALID;
+  }
+  fiobj_str_resize(out, capa - z.avail_out);
+  return out;
+}
+#endif
+
+#if HTTP_BROTLI
+/* brotli compresses a buffer. Returns FIOBJ_INVALID if it didn't get shorter */
+static FIOBJ http_brotli_buffer(void *data, size_t len) {
+  size_t capa = BrotliEncoderMaxCompressedSize(len);
+  if (!capa)
+    return FIOBJ_INVALID;
+  FIOBJ out = fiobj_str_buf(capa);
+  if (!BrotliEncoderCompress(HTTP_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+                             BROTLI_MODE_TEXT, len, data, &capa,
+                             (uint8_t *)fiobj_obj2cstr(out).data) ||
+      capa >= len) {
+    fiobj_free(out);
+    return FIOBJ_INVALID;
+  }
+  fiobj_str_resize(out, capa);
+  return out;
+}
+#endif
+
+/*
+ * Compresses a response's body (setting the response headers), or returns
+ * FIOBJ_INVALID if the body should be sent as is.
+ */
+static FIOBJ http_body_encode(http_s *r, void *data, uintptr_t length) {
+  const uint8_t encoding = http_encoding_select(r, length);
+  FIOBJ out = FIOBJ_INVALID;
+  switch (encoding) {
+#if HTTP_GZIP
+  case HTTP_ENCODING_GZIP:
+    out = http_gzip_buffer(data, length);
+    break;
+#endif
+#if HTTP_BROTLI
+  case HTTP_ENCODING_BROTLI:
+    out = http_brotli_buffer(data, length);
+    break;
+#endif
+  }
+  if (!out)
+    return FIOBJ_INVALID;
+  http_encoding_headers(r, encoding);
+  /* replaces any `content-length` set by the application */
+  fiobj_hash_set(r->private_data.out_headers, HTTP_HEADER_CONTENT_LENGTH,
+                 fiobj_num_new(fiobj_obj2cstr(out).len));
+  return out;
+}
+
+/* returns a stream encoder to the pool */
+static void http_encoder_release(http_encoder_s *e) {
+#if HTTP_BROTLI
+  if (e->br)
+    BrotliEncoderDestroyInstance(e->br);
+  e->br = NULL;
+#endif
+#if HTTP_GZIP
+  if (e->z_ready)
+    deflateReset(&e->z);
+#endif
+  spn_lock(&http_encoder_pool.lock);
+  if (http_encoder_pool.count < HTTP_ENCODER_POOL) {
+    e->next = http_encoder_pool.idle;
+    http_encoder_pool.idle = e;
+    ++http_encoder_pool.count;
+    e = NULL;
+  }
+  spn_unlock(&http_encoder_pool.lock);
+  if (!e)
+    return;
+#if HTTP_GZIP
+  if (e->z_ready)
+    deflateEnd(&e->z);
+#endif
+  free(e);
+}
+
+/* borrows a stream encoder from the pool (or allocates a new one) */
+static http_encoder_s *http_encoder_new(uint8_t encoding) {
+  spn_lock(&http_encoder_pool.lock);
+  http_encoder_s *e = http_encoder_pool.idle;
+  if (e) {
+    http_encoder_pool.idle = e->next;
+    --http_encoder_pool.count;
+  }
+  spn_unlock(&http_encoder_pool.lock);
+  if (!e) {
+    e = malloc(sizeof(*e));
+    if (!e)
+      return NULL;
+    *e = (http_encoder_s){.encoding = 0};
+  }
+  e->encoding = encoding;
+  switch (encoding) {
+#if HTTP_GZIP
+  case HTTP_ENCODING_GZIP:
+    if (e->z_ready)
+      break;
+    if (deflateInit2(&e->z, HTTP_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      goto error;
+    e->z_ready = 1;
+    break;
+#endif
+#if HTTP_BROTLI
+  case HTTP_ENCODING_BROTLI:
+    /* brotli encoders can't be reset */
+    e->br = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (!e->br)
+      goto error;
+    BrotliEncoderSetParameter(e->br, BROTLI_PARAM_QUALITY, HTTP_BROTLI_QUALITY);
+    BrotliEncoderSetParameter(e->br, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+    break;
+#endif
+  }
+  return e;
+error:
+  http_encoder_release(e);
+  return NULL;
+}
+
+/* starts compressing a streamed response (if it should be compressed) */
+static void http_encoder_start(http_s *r) {
+  r->private_data.encoder = HTTP_ENCODER_NONE;
+  const uint8_t encoding = http_encoding_select(r, 0);
+  if (!encoding)
+    return;
+  http_encoder_s *e = http_encoder_new(encoding);
+  if (!e)
+    return;
+  http_encoding_headers(r, encoding);
+  r->private_data.encoder = e;
+}
+
+/* compresses and streams a part of the response (flushing the encoder) */
+static int http_encoder_write(http_s *r, void *data, uintptr_t length,
+                              uint8_t finish) {
+  http_encoder_s *e = r->private_data.encoder;
+  size_t capa = length + (length >> 3) + 64;
+  FIOBJ out = fiobj_str_buf(capa);
+  capa = fiobj_str_capa(out);
+  size_t pos = 0;
+#if HTTP_GZIP
+  if (e->encoding == HTTP_ENCODING_GZIP) {
+    e->z.next_in = data;
+    e->z.avail_in = length;
+  }
+#endif
+#if HTTP_BROTLI
+  const uint8_t *next_in = data;
+  size_t avail_in = length;
+#endif
+  for (;;) {
+    if (capa - pos < 64) {
+      fiobj_str_resize(out, pos); /* keep the data when reallocating */
+      fiobj_str_capa_assert(out, capa << 1);
+      capa = fiobj_str_capa(out);
+    }
+    uint8_t *next_out = (uint8_t *)fiobj_obj2cstr(out).data + pos;
+    size_t avail_out = capa - pos;
+#if HTTP_GZIP
+    if (e->encoding == HTTP_ENCODING_GZIP) {
+      e->z.next_out = next_out;
+      e->z.avail_out = avail_out;
+      int ret = deflate(&e->z, finish ? Z_FINISH : Z_SYNC_FLUSH);
+      if (ret == Z_STREAM_ERROR)
+        goto error;
+      pos = capa - e->z.avail_out;
+      if (finish ? ret == Z_STREAM_END : !!e->z.avail_out)
+        break;
+      continue;
+    }
+#endif
+#if HTTP_BROTLI
+    if (!BrotliEncoderCompressStream(
+            e->br, finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH,
+            &avail_in, &next_in, &avail_out, &next_out, NULL))
+      goto error;
+    pos = capa - avail_out;
+    if (!avail_in && !BrotliEncoderHasMoreOutput(e->br) &&
+        (!finish || BrotliEncoderIsFinished(e->br)))
+      break;
+#endif
+  }
+  fiobj_str_resize(out, pos);
+  int ret = ((http_vtable_s *)r->private_data.vtbl)
+                ->http_stream(r, fiobj_obj2cstr(out).data, pos);
+  fiobj_free(out);
+  return ret;
+error:
+  fiobj_free(out);
+  return -1;
+}
+
+void http_encoder_free(http_s *h) {
+  if (h->private_data.encoder != HTTP_ENCODER_NONE)
+    http_encoder_release(h->private_data.encoder);
+  h->private_data.encoder = NULL;
+}
+
+#else /* no compression */
+
+static inline FIOBJ http_body_encode(http_s *r, void *data, uintptr_t len) {
+  return FIOBJ_INVALID;
+  (void)r;
+  (void)data;
+  (void)len;
+}
+static inline void http_encoder_start(http_s *r) {
+  r->private_data.encoder = HTTP_ENCODER_NONE;
+}
+static inline int http_encoder_write(http_s *r, void *data, uintptr_t len,
+                                     uint8_t finish) {
+  return -1;
+  (void)r;
+  (void)data;
+  (void)len;
+  (void)finish;
+}
+
+void http_encoder_free(http_s *h) { h->private_data.encoder = NULL; }
+
+#endif
+
 /**
  * Sends the response headers and body.
  *
@@ -362,12 +836,47 @@ int http_send_body(http_s *r, void *data, uintptr_t length) {
     http_finish(r);
     return 0;
   }
+  FIOBJ encoded = http_body_encode(r, data, length);
+  if (encoded) {
+    int ret = http_send_body_fiobj(r, encoded);
+    fiobj_free(encoded);
+    return ret;
+  }
   add_content_length(r, length);
   // add_content_type(r);
   add_date(r);
   return ((http_vtable_s *)r->private_data.vtbl)
       ->http_send_body(r, data, length);
 }
+
+/**
+ * Sends the response headers and a FIOBJ body (without copying a String).
+ *
+ * Returns -1 on error and 0 on success.
+ *
+ * AFTER THIS FUNCTION IS CALLED, THE `http_s` OBJECT IS NO LONGER VALID.
+ */
+int http_send_body_fiobj(http_s *r, FIOBJ body) {
+  if (HTTP_INVALID_HANDLE(r))
+    return -1;
+  fio_cstr_s s = fiobj_obj2cstr(body);
+  if (!s.length) {
+    http_finish(r);
+    return 0;
+  }
+  if (!FIOBJ_TYPE_IS(body, FIOBJ_T_STRING))
+    return http_send_body(r, s.data, s.length);
+  FIOBJ encoded = http_body_encode(r, s.data, s.length);
+  if (encoded) {
+    int ret = http_send_body_fiobj(r, encoded);
+    fiobj_free(encoded);
+    return ret;
+  }
+  add_content_length(r, s.length);
+  add_date(r);
+  return ((http_vtable_s *)r->private_data.vtbl)
+      ->http_send_body_fiobj(r, body);
+}
 /**
  * Sends the response headers and the specified file (the response's body).
  *
@@ -386,6 +895,450 @@ int http_sendfile(http_s *r, int fd, uintptr_t length, uintptr_t offset) {
   return ((http_vtable_s *)r->private_data.vtbl)
       ->http_sendfile(r, fd, length, offset);
 }
+
+/* sends the response headers and a shared file (see `http_fd_open`). */
+static int http_sendfile_fd(http_s *r, http_fd_s *fd, uintptr_t length,
+                            uintptr_t offset) {
+  add_content_length(r, length);
+  add_content_type(r);
+  add_date(r);
+  return ((http_vtable_s *)r->private_data.vtbl)
+      ->http_sendfile_fd(r, fd, length, offset);
+}
+/* *****************************************************************************
+Static file cache
+***************************************************************************** */
+#include "fio_hashmap.h"
+
+/* a file's details, as collected by `http_file_info` */
+typedef struct {
+  FIOBJ path;
+  /** the file's content (FIOBJ_INVALID unless the file is small enough) */
+  FIOBJ body;
+  FIOBJ etag;
+  FIOBJ last_modified;
+  off_t size;
+  time_t mtime;
+  ino_t inode;
+  /** the last time the file was tested (using `stat`) */
+  time_t validated;
+  /** 0 == the file doesn't exist (or isn't a regular file) */
+  uint8_t exists;
+} http_file_s;
+
+#if HTTP_FILE_CACHE_LIMIT
+static fio_hash_s http_file_cache = FIO_HASH_INIT;
+static spn_lock_i http_file_cache_lock = SPN_LOCK_INIT;
+#endif
+
+static void http_file_free(http_file_s *f) {
+  fiobj_free(f->path);
+  fiobj_free(f->body);
+  fiobj_free(f->etag);
+  fiobj_free(f->last_modified);
+  *f = (http_file_s){.exists = 0};
+}
+
+static inline void http_file_dup(http_file_s *dest, http_file_s *src) {
+  *dest = *src;
+  fiobj_dup(dest->path);
+  fiobj_dup(dest->body);
+  fiobj_dup(dest->etag);
+  fiobj_dup(dest->last_modified);
+}
+
+/* tests the file's `stat`, reusing `old` (if valid) or reading the file. */
+static void http_file_load(http_file_s *f, fio_cstr_s path, http_file_s *old) {
+  struct stat st;
+  if (stat(path.data, &st) || !(S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)))
+    return;
+  if (old->exists && old->size == st.st_size && old->mtime == st.st_mtime &&
+      old->inode == st.st_ino) {
+    /* unchanged - take ownership of the old data */
+    *f = *old;
+    *old = (http_file_s){.exists = 0};
+    return;
+  }
+  f->exists = 1;
+  f->size = st.st_size;
+  f->mtime = st.st_mtime;
+  f->inode = st.st_ino;
+  /* last-modified */
+  f->last_modified = fiobj_str_buf(32);
+  fiobj_str_resize(f->last_modified,
+                   http_time2str(fiobj_obj2cstr(f->last_modified).data,
+                                 st.st_mtime));
+  /* etag */
+  uint64_t etag = (uint64_t)st.st_size;
+  etag ^= (uint64_t)st.st_mtime;
+  etag = fio_siphash(&etag, sizeof(uint64_t));
+  f->etag = fiobj_str_buf(32);
+  fiobj_str_resize(f->etag,
+                   fio_base64_encode(fiobj_obj2cstr(f->etag).data,
+                                     (void *)&etag, sizeof(uint64_t)));
+#if HTTP_FILE_CACHE_LIMIT
+  /* content */
+  if (!st.st_size || st.st_size > HTTP_FILE_CACHE_LIMIT)
+    return;
+  int fd = open(path.data, O_RDONLY);
+  if (fd == -1)
+    return;
+  FIOBJ body = fiobj_str_buf(st.st_size);
+  if (pread(fd, fiobj_obj2cstr(body).data, st.st_size, 0) == st.st_size &&
+      !fstat(fd, &st) && st.st_size == f->size && st.st_mtime == f->mtime) {
+    fiobj_str_resize(body, st.st_size);
+    fiobj_str_freeze(body);
+    f->body = body;
+  } else {
+    /* the file changed while it was read */
+    fiobj_free(body);
+  }
+  close(fd);
+#endif
+}
+
+/**
+ * Collects the details of the file at `path` (a NUL terminated String),
+ * returning -1 if the file doesn't exist.
+ *
+ * The objects in `f` are owned by the caller (see `http_file_free`).
+ */
+static int http_file_info(http_file_s *f, fio_cstr_s path) {
+  http_file_s old = {.exists = 0};
+  *f = (http_file_s){.exists = 0};
+#if HTTP_FILE_CACHE_LIMIT
+  const time_t now = facil_last_tick().tv_sec;
+  const uint64_t hash = fio_risky_hash(path.data, path.len);
+  spn_lock(&http_file_cache_lock);
+  http_file_s *c =
+      (http_file_cache.map ? fio_hash_find(&http_file_cache, hash) : NULL);
+  if (c) {
+    fio_cstr_s cpath = fiobj_obj2cstr(c->path);
+    if (cpath.len == path.len && !memcmp(cpath.data, path.data, path.len)) {
+      if (c->validated + HTTP_FILE_CACHE_VALIDATE > now) {
+        http_file_dup(f, c);
+        spn_unlock(&http_file_cache_lock);
+        return f->exists ? 0 : -1;
+      }
+      http_file_dup(&old, c);
+    }
+  }
+  spn_unlock(&http_file_cache_lock);
+#endif
+  http_file_load(f, path, &old);
+  http_file_free(&old);
+#if HTTP_FILE_CACHE_LIMIT
+  /* store a copy in the cache */
+  c = fio_malloc(sizeof(*c));
+  http_file_dup(c, f);
+  if (!c->path)
+    c->path = fiobj_str_new(path.data, path.len);
+  c->validated = now;
+  spn_lock(&http_file_cache_lock);
+  if (!http_file_cache.map)
+    fio_hash_new(&http_file_cache);
+  if (fio_hash_count(&http_file_cache) < HTTP_FILE_CACHE_COUNT ||
+      fio_hash_find(&http_file_cache, hash)) {
+    c = fio_hash_insert(&http_file_cache, hash, c);
+  }
+  spn_unlock(&http_file_cache_lock);
+  /* `c` is now the replaced entry (or the one that wasn't stored) */
+  if (c) {
+    http_file_free(c);
+    fio_free(c);
+  }
+#endif
+  return f->exists ? 0 : -1;
+}
+
+static void http_fd_cache_clear(void);
+
+/** Clears the static file cache. */
+void http_file_cache_clear(void) {
+  http_fd_cache_clear();
+#if HTTP_FILE_CACHE_LIMIT
+  spn_lock(&http_file_cache_lock);
+  fio_hash_s old = http_file_cache;
+  http_file_cache = (fio_hash_s)FIO_HASH_INIT;
+  spn_unlock(&http_file_cache_lock);
+  if (!old.map)
+    return;
+  FIO_HASH_FOR_FREE(&old, obj) {
+    if (!obj->obj)
+      continue;
+    http_file_free(obj->obj);
+    fio_free(obj->obj);
+  }
+#endif
+}
+
+/* *****************************************************************************
+Open file descriptor cache
+***************************************************************************** */
+
+#if HTTP_FD_CACHE_COUNT
+static fio_hash_s http_fd_cache = FIO_HASH_INIT;
+static fio_ls_embd_s http_fd_lru = FIO_LS_INIT(http_fd_lru);
+static spn_lock_i http_fd_lock = SPN_LOCK_INIT;
+#endif
+
+/** Releases a reference to a shared file, closing the file once unused. */
+void http_fd_release(void *fd_) {
+  http_fd_s *fd = fd_;
+  if (spn_sub(&fd->ref, 1))
+    return;
+  close(fd->fd);
+  fiobj_free(fd->path);
+  fio_free(fd);
+}
+
+/* removes a file from the cache (the cache's lock MUST be held). */
+static inline http_fd_s *http_fd_forget_unsafe(http_fd_s *fd) {
+#if HTTP_FD_CACHE_COUNT
+  fio_hash_insert(&http_fd_cache, fd->hash, NULL);
+  fio_ls_embd_remove(&fd->node);
+#endif
+  return fd;
+}
+
+/**
+ * Opens the file described by `file` (or shares a cached file descriptor),
+ * returning NULL on error. Use `http_fd_release` when done.
+ */
+static http_fd_s *http_fd_open(fio_cstr_s path, http_file_s *file) {
+  http_fd_s *fd;
+  const uint64_t hash = fio_risky_hash(path.data, path.len);
+#if HTTP_FD_CACHE_COUNT
+  http_fd_s *stale = NULL;
+  spn_lock(&http_fd_lock);
+  fd = (http_fd_cache.map ? fio_hash_find(&http_fd_cache, hash) : NULL);
+  if (fd) {
+    fio_cstr_s fpath = fiobj_obj2cstr(fd->path);
+    if (fd->inode == file->inode && fd->mtime == file->mtime &&
+        fd->size == file->size && fpath.len == path.len &&
+        !memcmp(fpath.data, path.data, path.len)) {
+      /* a cache hit, mark as the most recently used */
+      http_fd_dup(fd);
+      fio_ls_embd_remove(&fd->node);
+      fio_ls_embd_push(&http_fd_lru, &fd->node);
+      spn_unlock(&http_fd_lock);
+      return fd;
+    }
+    /* the file changed */
+    stale = http_fd_forget_unsafe(fd);
+  }
+  spn_unlock(&http_fd_lock);
+  if (stale)
+    http_fd_release(stale);
+#endif
+  int f = open(path.data, O_RDONLY);
+  if (f == -1)
+    return NULL;
+  fd = fio_malloc(sizeof(*fd));
+  *fd = (http_fd_s){
+      .fd = f,
+      .ref = 1,
+      .hash = hash,
+      .inode = file->inode,
+      .mtime = file->mtime,
+      .size = file->size,
+  };
+#if HTTP_FD_CACHE_COUNT
+  /* the cache holds a reference */
+  fd->ref = 2;
+  fd->path = fiobj_str_new(path.data, path.len);
+  http_fd_s *evicted = NULL;
+  spn_lock(&http_fd_lock);
+  if (!http_fd_cache.map)
+    fio_hash_new(&http_fd_cache);
+  stale = fio_hash_insert(&http_fd_cache, hash, fd);
+  if (stale)
+    fio_ls_embd_remove(&stale->node);
+  fio_ls_embd_push(&http_fd_lru, &fd->node);
+  if (fio_hash_count(&http_fd_cache) > HTTP_FD_CACHE_COUNT) {
+    evicted = http_fd_forget_unsafe(
+        FIO_LS_EMBD_OBJ(http_fd_s, node, http_fd_lru.prev));
+  }
+  spn_unlock(&http_fd_lock);
+  if (stale)
+    http_fd_release(stale);
+  if (evicted)
+    http_fd_release(evicted);
+#endif
+  return fd;
+}
+
+/* closes all the cached file descriptors (open responses keep theirs). */
+static void http_fd_cache_clear(void) {
+#if HTTP_FD_CACHE_COUNT
+  spn_lock(&http_fd_lock);
+  fio_hash_s old = http_fd_cache;
+  http_fd_cache = (fio_hash_s)FIO_HASH_INIT;
+  http_fd_lru = (fio_ls_embd_s)FIO_LS_INIT(http_fd_lru);
+  spn_unlock(&http_fd_lock);
+  if (!old.map)
+    return;
+  FIO_HASH_FOR_FREE(&old, obj) {
+    if (obj->obj)
+      http_fd_release(obj->obj);
+  }
+#endif
+}
+
+/**
+ * Removes the file at `path` from the static file caches (the file's content,
+ * details and open file descriptor), so it's read again by `http_sendfile2`.
+ */
+void http_file_cache_forget(const char *path, size_t path_len) {
+  if (!path) {
+    http_file_cache_clear();
+    return;
+  }
+  const uint64_t hash = fio_risky_hash(path, path_len);
+#if HTTP_FILE_CACHE_LIMIT
+  spn_lock(&http_file_cache_lock);
+  http_file_s *f = (http_file_cache.map
+                        ? fio_hash_insert(&http_file_cache, hash, NULL)
+                        : NULL);
+  spn_unlock(&http_file_cache_lock);
+  if (f) {
+    http_file_free(f);
+    fio_free(f);
+  }
+#endif
+#if HTTP_FD_CACHE_COUNT
+  spn_lock(&http_fd_lock);
+  http_fd_s *fd = (http_fd_cache.map ? fio_hash_find(&http_fd_cache, hash)
+                                     : NULL);
+  if (fd)
+    http_fd_forget_unsafe(fd);
+  spn_unlock(&http_fd_lock);
+  if (fd)
+    http_fd_release(fd);
+#endif
+  (void)hash;
+}
+
+/* *****************************************************************************
+Byte ranges (`range` requests)
+***************************************************************************** */
+
+/**
+ * Parses a `range` header value, filling `ranges` with the satisfiable byte
+ * ranges and returning their count.
+ *
+ * Returns 0 (the whole file is sent) if the header is invalid, if it requests
+ * more than HTTP_MAX_RANGES ranges or if the ranges are longer than the file.
+ */
+static size_t http_ranges_parse(http_file_part_s *ranges, fio_cstr_s range,
+                                int64_t size) {
+  if (!range.data || range.len < 7 || memcmp("bytes=", range.data, 6))
+    return 0;
+  char *pos = range.data + 6;
+  char *end = range.data + range.len;
+  size_t count = 0;
+  int64_t total = 0;
+  while (pos < end) {
+    int64_t start_at, end_at;
+    if (*pos == ' ' || *pos == ',') {
+      ++pos;
+      continue;
+    }
+    if (*pos == '-') {
+      /* suffix range - the last N bytes */
+      ++pos;
+      end_at = fio_atol(&pos);
+      if (end_at <= 0)
+        return 0;
+      start_at = (end_at < size ? size - end_at : 0);
+      end_at = size - 1;
+    } else {
+      start_at = fio_atol(&pos);
+      if (start_at < 0 || pos >= end || *pos != '-')
+        return 0;
+      ++pos;
+      end_at = size - 1;
+      if (pos < end && *pos >= '0' && *pos <= '9') {
+        end_at = fio_atol(&pos);
+        if (end_at < start_at)
+          return 0;
+        if (end_at >= size)
+          end_at = size - 1;
+      }
+    }
+    if (pos < end && *pos != ' ' && *pos != ',')
+      return 0;
+    if (start_at >= size)
+      continue; /* unsatisfiable ranges are ignored */
+    if (count == HTTP_MAX_RANGES)
+      return 0;
+    ranges[count] = (http_file_part_s){
+        .offset = start_at, .length = end_at - start_at + 1,
+    };
+    total += ranges[count].length;
+    if (total > size)
+      return 0; /* overlapping ranges, sending the file is cheaper */
+    ++count;
+  }
+  return count;
+}
+
+/* sends a multipart/byteranges response with the `parts` of the file. */
+static int http_sendfile_parts(http_s *h, http_fd_s *fd, http_file_s *file,
+                               http_file_part_s *parts, size_t count,
+                               FIOBJ mime) {
+  static const char hex[] = "0123456789abcdef";
+  char boundary[16];
+  uint64_t rnd = fio_rand64();
+  for (size_t i = 0; i < 16; ++i) {
+    boundary[i] = hex[rnd & 15];
+    rnd >>= 4;
+  }
+  http_set_header(h, HTTP_HEADER_CONTENT_TYPE,
+                  fiobj_strprintf("multipart/byteranges; boundary=%.16s",
+                                  boundary));
+  fio_cstr_s m = (mime ? fiobj_obj2cstr(mime) : (fio_cstr_s){.data = NULL});
+  uintptr_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (m.len) {
+      parts[i].head = fiobj_strprintf(
+          "\r\n--%.16s\r\ncontent-type: %.*s\r\n"
+          "content-range: bytes %lu-%lu/%lu\r\n\r\n",
+          boundary, (int)m.len, m.data, (unsigned long)parts[i].offset,
+          (unsigned long)(parts[i].offset + parts[i].length - 1),
+          (unsigned long)file->size);
+    } else {
+      parts[i].head = fiobj_strprintf(
+          "\r\n--%.16s\r\ncontent-range: bytes %lu-%lu/%lu\r\n\r\n",
+          boundary, (unsigned long)parts[i].offset,
+          (unsigned long)(parts[i].offset + parts[i].length - 1),
+          (unsigned long)file->size);
+    }
+    total += fiobj_obj2cstr(parts[i].head).len + parts[i].length;
+  }
+  FIOBJ tail = fiobj_strprintf("\r\n--%.16s--\r\n", boundary);
+  total += fiobj_obj2cstr(tail).len;
+  if (file->body) {
+    /* cached content - the body is assembled in memory */
+    FIOBJ body = fiobj_str_buf(total);
+    fio_cstr_s data = fiobj_obj2cstr(file->body);
+    for (size_t i = 0; i < count; ++i) {
+      fiobj_str_join(body, parts[i].head);
+      fiobj_str_write(body, data.data + parts[i].offset, parts[i].length);
+      fiobj_free(parts[i].head);
+    }
+    fiobj_str_join(body, tail);
+    fiobj_free(tail);
+    int ret = http_send_body_fiobj(h, body);
+    fiobj_free(body);
+    return ret;
+  }
+  add_content_length(h, total);
+  add_date(h);
+  return ((http_vtable_s *)h->private_data.vtbl)
+      ->http_sendfile_parts(h, fd, parts, count, tail);
+}
+
 /**
  * Sends the response headers and the specified file (the response's body).
  *
@@ -397,7 +1350,7 @@ int http_sendfile2(http_s *h, const char *prefix, size_t prefix_len,
                    const char *encoded, size_t encoded_len) {
   if (HTTP_INVALID_HANDLE(h))
     return -1;
-  struct stat file_data = {.st_size = 0};
+  http_file_s file_data;
   static uint64_t accept_enc_hash = 0;
   if (!accept_enc_hash)
     accept_enc_hash = fio_siphash("accept-encoding", 15);
@@ -442,7 +1395,7 @@ int http_sendfile2(http_s *h, const char *prefix, size_t prefix_len,
   }
   /* test for file existance  */
 
-  int file = -1;
+  http_fd_s *file = NULL;
   uint8_t is_gz = 0;
 
   fio_cstr_s s = fiobj_obj2cstr(filename);
@@ -457,37 +1410,27 @@ int http_sendfile2(http_s *h, const char *prefix, size_t prefix_len,
         s.data[s.len - 1] != 'z') {
       fiobj_str_write(filename, ".gz", 3);
       s = fiobj_obj2cstr(filename);
-      if (!stat(s.data, &file_data) &&
-          (S_ISREG(file_data.st_mode) || S_ISLNK(file_data.st_mode))) {
+      if (!http_file_info(&file_data, s)) {
         is_gz = 1;
         goto found_file;
       }
       fiobj_str_resize(filename, s.len - 3);
+      s = fiobj_obj2cstr(filename);
     }
   }
 no_gzip_support:
-  if (stat(s.data, &file_data) ||
-      !(S_ISREG(file_data.st_mode) || S_ISLNK(file_data.st_mode)))
+  if (http_file_info(&file_data, s))
     return -1;
 found_file:
-  /* set last-modified */
-  {
-    FIOBJ tmp = fiobj_str_buf(32);
-    fiobj_str_resize(
-        tmp, http_time2str(fiobj_obj2cstr(tmp).data, file_data.st_mtime));
-    http_set_header(h, HTTP_HEADER_LAST_MODIFIED, tmp);
-  }
+  /* set last-modified (the header keeps the object alive) */
+  FIOBJ last_modified = file_data.last_modified;
+  file_data.last_modified = FIOBJ_INVALID;
+  http_set_header(h, HTTP_HEADER_LAST_MODIFIED, last_modified);
   /* set cache-control */
   http_set_header(h, HTTP_HEADER_CACHE_CONTROL, fiobj_dup(HTTP_HVALUE_MAX_AGE));
   /* set & test etag */
-  uint64_t etag = (uint64_t)file_data.st_size;
-  etag ^= (uint64_t)file_data.st_mtime;
-  etag = fio_siphash(&etag, sizeof(uint64_t));
-  FIOBJ etag_str = fiobj_str_buf(32);
-  fiobj_str_resize(etag_str,
-                   fio_base64_encode(fiobj_obj2cstr(etag_str).data,
-                                     (void *)&etag, sizeof(uint64_t)));
-  /* set */
+  FIOBJ etag_str = file_data.etag;
+  file_data.etag = FIOBJ_INVALID;
   http_set_header(h, HTTP_HEADER_ETAG, etag_str);
   /* test */
   {
@@ -498,66 +1441,10 @@ found_file:
     if (tmp2 && fiobj_iseq(tmp2, etag_str)) {
       h->status = 304;
       http_finish(h);
+      http_file_free(&file_data);
       return 0;
     }
   }
-  /* handle range requests */
-  int64_t offset = 0;
-  int64_t length = file_data.st_size;
-  {
-    static uint64_t ifrange_hash = 0;
-    if (!ifrange_hash)
-      ifrange_hash = fio_siphash("if-range", 8);
-    FIOBJ tmp = fiobj_hash_get2(h->headers, ifrange_hash);
-    if (tmp && fiobj_iseq(tmp, etag_str)) {
-      fiobj_hash_delete2(h->headers, range_hash);
-    } else {
-      tmp = fiobj_hash_get2(h->headers, range_hash);
-      if (tmp) {
-        /* range ahead... */
-        if (FIOBJ_TYPE_IS(tmp, FIOBJ_T_ARRAY))
-          tmp = fiobj_ary_index(tmp, 0);
-        fio_cstr_s range = fiobj_obj2cstr(tmp);
-        if (!range.data || memcmp("bytes=", range.data, 6))
-          goto open_file;
-        char *pos = range.data + 6;
-        int64_t start_at = 0, end_at = 0;
-        start_at = fio_atol(&pos);
-        if (start_at >= file_data.st_size)
-          goto open_file;
-        if (start_at >= 0) {
-          pos++;
-          end_at = fio_atol(&pos);
-          if (end_at <= 0)
-            goto open_file;
-        }
-        /* we ignore multimple ranges, only responding with the first range. */
-        if (start_at < 0) {
-          if (0 - start_at < file_data.st_size) {
-            offset = file_data.st_size - start_at;
-            length = 0 - start_at;
-          }
-        } else if (end_at) {
-          offset = start_at;
-          length = end_at - start_at + 1;
-          if (length + start_at > file_data.st_size || length <= 0)
-            length = length - start_at;
-        } else {
-          offset = start_at;
-          length = length - start_at;
-        }
-        h->status = 206;
-
-        http_set_header(h, HTTP_HEADER_CONTENT_RANGE,
-                        fiobj_strprintf("bytes %lu-%lu/%lu",
-                                        (unsigned long)start_at,
-                                        (unsigned long)(start_at + length - 1),
-                                        (unsigned long)file_data.st_size));
-        http_set_header(h, HTTP_HEADER_ACCEPT_RANGES,
-                        fiobj_dup(HTTP_HVALUE_BYTES));
-      }
-    }
-  }
   /* test for an OPTIONS request or invalid methods */
   s = fiobj_obj2cstr(h->method);
   switch (s.len) {
@@ -567,6 +1454,7 @@ found_file:
                        (fio_cstr_s){.data = "GET, HEAD", .len = 9});
       h->status = 200;
       http_finish(h);
+      http_file_free(&file_data);
       return 0;
     }
     break;
@@ -576,25 +1464,66 @@ found_file:
     break;
   case 4:
     if (!strncasecmp("head", s.data, 4)) {
-      http_set_header(h, HTTP_HEADER_CONTENT_LENGTH, fiobj_num_new(length));
+      http_set_header(h, HTTP_HEADER_ACCEPT_RANGES,
+                      fiobj_dup(HTTP_HVALUE_BYTES));
+      http_set_header(h, HTTP_HEADER_CONTENT_LENGTH,
+                      fiobj_num_new(file_data.size));
       http_finish(h);
+      http_file_free(&file_data);
       return 0;
     }
     break;
   }
+  http_file_free(&file_data);
   http_send_error(h, 403);
   return 0;
 open_file:
+  http_set_header(h, HTTP_HEADER_ACCEPT_RANGES, fiobj_dup(HTTP_HVALUE_BYTES));
+  /* handle range requests (only for GET requests) */
+  http_file_part_s ranges[HTTP_MAX_RANGES];
+  size_t range_count = 0;
+  {
+    static uint64_t ifrange_hash = 0;
+    if (!ifrange_hash)
+      ifrange_hash = fio_siphash("if-range", 8);
+    FIOBJ tmp = fiobj_hash_get2(h->headers, range_hash);
+    FIOBJ if_range = fiobj_hash_get2(h->headers, ifrange_hash);
+    /* a stale `if-range` (etag or date) requests the whole file */
+    if (tmp && (!if_range || fiobj_iseq(if_range, etag_str) ||
+                fiobj_iseq(if_range, last_modified))) {
+      if (FIOBJ_TYPE_IS(tmp, FIOBJ_T_ARRAY))
+        tmp = fiobj_ary_index(tmp, 0);
+      range_count =
+          http_ranges_parse(ranges, fiobj_obj2cstr(tmp), file_data.size);
+    }
+  }
+  int64_t offset = 0;
+  int64_t length = file_data.size;
+  if (range_count) {
+    h->status = 206;
+    if (range_count == 1) {
+      offset = ranges[0].offset;
+      length = ranges[0].length;
+      http_set_header(h, HTTP_HEADER_CONTENT_RANGE,
+                      fiobj_strprintf("bytes %lu-%lu/%lu",
+                                      (unsigned long)offset,
+                                      (unsigned long)(offset + length - 1),
+                                      (unsigned long)file_data.size));
+    }
+  }
   s = fiobj_obj2cstr(filename);
-  file = open(s.data, O_RDONLY);
-  if (file == -1) {
-    fprintf(stderr, "ERROR: Couldn't open file %s!\n", s.data);
-    perror("     ");
-    http_send_error(h, 500);
-    return 0;
+  if (!file_data.body) {
+    file = http_fd_open(s, &file_data);
+    if (!file) {
+      fprintf(stderr, "ERROR: Couldn't open file %s!\n", s.data);
+      perror("     ");
+      http_file_free(&file_data);
+      http_send_error(h, 500);
+      return 0;
+    }
   }
+  FIOBJ mime = FIOBJ_INVALID;
   {
-    FIOBJ tmp = 0;
     uintptr_t pos = 0;
     if (is_gz) {
       http_set_header(h, HTTP_HEADER_CONTENT_ENCODING,
@@ -604,19 +1533,34 @@ open_file:
       while (pos && s.data[pos] != '.')
         pos--;
       pos++; /* assuming, but that's fine. */
-      tmp = http_mimetype_find(s.data + pos, s.len - pos - 3);
+      mime = http_mimetype_find(s.data + pos, s.len - pos - 3);
 
     } else {
       pos = s.len - 1;
       while (pos && s.data[pos] != '.')
         pos--;
       pos++; /* assuming, but that's fine. */
-      tmp = http_mimetype_find(s.data + pos, s.len - pos);
+      mime = http_mimetype_find(s.data + pos, s.len - pos);
     }
-    if (tmp)
-      http_set_header(h, HTTP_HEADER_CONTENT_TYPE, tmp);
   }
-  http_sendfile(h, file, length, offset);
+  if (range_count > 1) {
+    http_sendfile_parts(h, file, &file_data, ranges, range_count, mime);
+    fiobj_free(mime);
+    http_file_free(&file_data);
+    return 0;
+  }
+  if (mime)
+    http_set_header(h, HTTP_HEADER_CONTENT_TYPE, mime);
+  if (file_data.body) {
+    /* cached content - no filesystem access required */
+    if (length == file_data.size)
+      http_send_body_fiobj(h, file_data.body);
+    else
+      http_send_body(h, fiobj_obj2cstr(file_data.body).data + offset, length);
+  } else {
+    http_sendfile_fd(h, file, length, offset);
+  }
+  http_file_free(&file_data);
   return 0;
 }
 
@@ -665,10 +1609,32 @@ void http_finish(http_s *r) {
   if (!r || !r->private_data.vtbl) {
     return;
   }
+  if (r->private_data.encoder) {
+    /* ends a compressed stream */
+    if (r->private_data.encoder != HTTP_ENCODER_NONE)
+      http_encoder_write(r, NULL, 0, 1);
+    http_encoder_free(r);
+  }
   add_content_length(r, 0);
   add_date(r);
   ((http_vtable_s *)r->private_data.vtbl)->http_finish(r);
 }
+/**
+ * Streams a part of the response's body, sending the response headers with the
+ * first part.
+ *
+ * Returns -1 on error and 0 on success.
+ */
+int http_stream(http_s *r, void *data, uintptr_t length) {
+  if (HTTP_INVALID_HANDLE(r))
+    return -1;
+  add_date(r);
+  if (!r->private_data.encoder)
+    http_encoder_start(r);
+  if (length && r->private_data.encoder != HTTP_ENCODER_NONE)
+    return http_encoder_write(r, data, length, 0);
+  return ((http_vtable_s *)r->private_data.vtbl)->http_stream(r, data, length);
+}
 /**
  * Pushes a data response when supported (HTTP/2 only).
  *
@@ -785,6 +1751,7 @@ void http_pause(http_s *h, void (*task)(void *http)) {
       .uuid = p->uuid, .h = h, .udata = h->udata,
   };
   vtbl->http_on_pause(h, p);
+  http_s_share(h);
   defer(http_pause_wrapper, http, (void *)((uintptr_t)task));
 }
 
@@ -880,27 +1847,48 @@ http_settings_s *http_settings_new(http_settings_s arg_settings) {
 
 static void http_settings_free(http_settings_s *s) {
   free((void *)s->public_folder);
+  fio_tls_free(s->tls);
   free(s);
 }
 /* *****************************************************************************
 Listening to HTTP connections
 ***************************************************************************** */
 
+/* attaches the HTTP/1.1 protocol (the default, unless ALPN selected "h2") */
+static void http_on_open_http1(intptr_t uuid, void *set) {
+  protocol_s *pr = http1_new(uuid, set, NULL, 0);
+  if (!pr)
+    sock_close(uuid);
+}
+
+/* attaches the HTTP/2 protocol (a TLS connection that selected "h2") */
+static void http_on_open_http2(intptr_t uuid, void *set) {
+  protocol_s *pr = http2_new(uuid, set, NULL, 0);
+  if (!pr)
+    sock_close(uuid);
+}
+
 static void http_on_open(intptr_t uuid, void *set) {
   static uint8_t at_capa;
-  facil_set_timeout(uuid, ((http_settings_s *)set)->timeout);
-  if (sock_uuid2fd(uuid) >= ((http_settings_s *)set)->max_clients) {
+  http_settings_s *settings = set;
+  facil_set_timeout(uuid, settings->timeout);
+  if (sock_uuid2fd(uuid) >= settings->max_clients) {
     if (!at_capa)
       fprintf(stderr, "WARNING: HTTP server at capacity\n");
     at_capa = 1;
-    http_send_error2(uuid, 503, set);
+    if (!settings->tls)
+      http_send_error2(uuid, 503, set);
     sock_close(uuid);
     return;
   }
   at_capa = 0;
-  protocol_s *pr = http1_new(uuid, set, NULL, 0);
-  if (!pr)
-    sock_close(uuid);
+  if (settings->tls) {
+    /* the protocol is attached once the handshake is complete */
+    if (fio_tls_accept(uuid, settings->tls, http_on_open_http1, set))
+      sock_close(uuid);
+    return;
+  }
+  http_on_open_http1(uuid, set);
 }
 
 static void http_on_finish(intptr_t uuid, void *set) {
@@ -932,10 +1920,18 @@ int http_listen(const char *port, const char *binding,
 
   http_settings_s *settings = http_settings_new(arg_settings);
   settings->is_client = 0;
+  if (settings->tls) {
+    fio_tls_alpn_add(settings->tls, "h2", http_on_open_http2);
+    fio_tls_alpn_add(settings->tls, "http/1.1", http_on_open_http1);
+  }
 
   return facil_listen(.port = port, .address = binding,
                       .on_finish = http_on_finish, .on_open = http_on_open,
-                      .udata = settings);
+                      .udata = settings, .reuse_port = settings->reuse_port,
+                      .reuse_port_cpu = settings->reuse_port_cpu,
+                      .defer_accept = settings->defer_accept,
+                      .fastopen = settings->fastopen,
+                      .balance = settings->balance);
 }
 /** Listens to HTTP connections at the specified `port` and `binding`. */
 #define http_listen(port, binding, ...)                                        \
@@ -957,6 +1953,25 @@ sock_peer_addr_s http_peer_addr(http_s *h) {
   return sock_peer_addr(((http_protocol_s *)h->private_data.flag)->uuid);
 }
 
+/**
+ * Get the connection's UUID (i.e., for `sock_pending` and similar use cases).
+ */
+intptr_t http2uuid(http_s *h) {
+  return ((http_protocol_s *)h->private_data.flag)->uuid;
+}
+
+/**
+ * Receives more of a streamed request body (see `stream_body`).
+ *
+ * Returns 1 if data was added to `h->body`, 0 once the whole body was received
+ * and -1 on error (`errno` is `EAGAIN` if no data is available yet).
+ */
+int http_body_fetch(http_s *h) {
+  if (HTTP_INVALID_HANDLE(h))
+    return -1;
+  return ((http_vtable_s *)h->private_data.vtbl)->http_body_fetch(h);
+}
+
 /* *****************************************************************************
 HTTP client connections
 ***************************************************************************** */
@@ -1086,56 +2101,556 @@ int http_connect(const char *address, struct http_settings_s arg_settings) {
     if (a + len == p + 1) {
       p = NULL;
     } else {
-      p++;
-      if (!len) {
-        a = "localhost";
-        len = 9;
-      }
+      p++;
+      if (!len) {
+        a = "localhost";
+        len = 9;
+      }
+    }
+  } else {
+    if (is_secure)
+      p = "443";
+    else
+      p = "80";
+  }
+
+  /* set settings */
+  if (!arg_settings.timeout)
+    arg_settings.timeout = 30;
+  http_settings_s *settings = http_settings_new(arg_settings);
+  settings->is_client = 1;
+  if (!arg_settings.ws_timeout)
+    settings->ws_timeout = 0; /* allow server to dictate timeout */
+  if (!arg_settings.timeout)
+    settings->timeout = 0; /* allow server to dictate timeout */
+  http_s *h = fio_malloc(sizeof(*h));
+  HTTP_ASSERT(h, "HTTP Client handler allocation failed");
+  http_s_new(h, 0, http1_vtable());
+  h->udata = arg_settings.udata;
+  h->status = 0;
+  h->path = path;
+  settings->udata = h;
+  http_set_header2(h, (fio_cstr_s){.data = "host", .len = 4},
+                   (fio_cstr_s){.data = a, .len = len});
+  intptr_t ret;
+  if (is_websocket) {
+    /* force HTTP/1.1 */
+    ret =
+        facil_connect(.address = a, .port = p, .on_fail = http_on_client_failed,
+                      .on_connect = http_on_open_client, .udata = settings);
+    (void)0;
+  } else {
+    /* Allow for any HTTP version */
+    ret =
+        facil_connect(.address = a, .port = p, .on_fail = http_on_client_failed,
+                      .on_connect = http_on_open_client, .udata = settings);
+    (void)0;
+  }
+  fio_free(a);
+  return ret;
+}
+#define http_connect(address, ...)                                             \
+  http_connect((address), (struct http_settings_s){__VA_ARGS__})
+
+/* *****************************************************************************
+HTTP client connection pool
+***************************************************************************** */
+
+/** The maximum number of connections the client pool opens per host. */
+#ifndef HTTP_CLIENT_POOL_LIMIT
+#define HTTP_CLIENT_POOL_LIMIT 8
+#endif
+
+/** The maximum number of requests pipelined on a pooled connection. */
+#ifndef HTTP_CLIENT_PIPELINE
+#define HTTP_CLIENT_PIPELINE 4
+#endif
+
+/**
+ * The number of seconds an idle pooled connection is kept open. The
+ * connection's timeout closes it afterwards.
+ */
+#ifndef HTTP_CLIENT_IDLE_TIMEOUT
+#define HTTP_CLIENT_IDLE_TIMEOUT 5
+#endif
+
+/** The number of seconds a pooled connection waits for a response. */
+#ifndef HTTP_CLIENT_TIMEOUT
+#define HTTP_CLIENT_TIMEOUT 30
+#endif
+
+typedef struct http_client_host_s http_client_host_s;
+
+/* a request, queued by the host or assigned to a connection */
+typedef struct {
+  fio_ls_embd_s node;
+  FIOBJ method;
+  FIOBJ path;
+  FIOBJ headers;
+  FIOBJ body;
+  void (*on_response)(http_s *response, void *udata);
+  void *udata;
+  uint8_t sent;
+  uint8_t retried;
+  /** requests that may be retried (and pipelined) */
+  uint8_t idempotent;
+} http_client_req_s;
+
+typedef enum {
+  HTTP_CLIENT_CONNECTING,
+  HTTP_CLIENT_OPEN,
+  HTTP_CLIENT_CLOSING,
+  HTTP_CLIENT_CLOSED,
+} http_client_state_e;
+
+/* a pooled connection */
+typedef struct {
+  fio_ls_embd_s node;
+  /** the assigned requests, in the order they were (or will be) sent */
+  fio_ls_embd_s requests;
+  http_client_host_s *host;
+  intptr_t uuid;
+  size_t count;
+  /** assigned requests that aren't pipelined (not idempotent or retried) */
+  size_t unsafe;
+  /** the connection itself and any pending `facil_defer` tasks */
+  size_t ref;
+  http_client_state_e state;
+  /** set once a response was received (the server reuses connections) */
+  uint8_t reused;
+  /** set while a send task is scheduled */
+  uint8_t scheduled;
+} http_client_conn_s;
+
+struct http_client_host_s {
+  /** requests waiting for a connection */
+  fio_ls_embd_s queue;
+  fio_ls_embd_s conns;
+  /** "host:port" */
+  FIOBJ name;
+  /** the `host` header value */
+  FIOBJ host;
+  /** "http://host:port", for `http_connect` */
+  FIOBJ address;
+  uint64_t hash;
+  size_t count;
+  size_t connecting;
+};
+
+/* work collected while the pool is locked */
+typedef struct {
+  http_client_conn_s *open[HTTP_CLIENT_POOL_LIMIT];
+  http_client_conn_s *send[HTTP_CLIENT_POOL_LIMIT];
+  fio_ls_embd_s failed;
+  size_t open_count;
+  size_t send_count;
+} http_client_tasks_s;
+
+static fio_hash_s http_client_hosts = FIO_HASH_INIT;
+static spn_lock_i http_client_lock = SPN_LOCK_INIT;
+
+static void http_client_req_free(http_client_req_s *r) {
+  fiobj_free(r->method);
+  fiobj_free(r->path);
+  fiobj_free(r->headers);
+  fiobj_free(r->body);
+  fio_free(r);
+}
+
+/* frees the host once it has no connections and no queued requests (locked) */
+static void http_client_host_release(http_client_host_s *host) {
+  if (host->count || fio_ls_embd_any(&host->queue))
+    return;
+  fio_hash_insert(&http_client_hosts, host->hash, NULL);
+  fiobj_free(host->name);
+  fiobj_free(host->host);
+  fiobj_free(host->address);
+  fio_free(host);
+}
+
+/* frees the connection object once it isn't referenced (locked) */
+static void http_client_conn_release(http_client_conn_s *c) {
+  if (--c->ref)
+    return;
+  fio_free(c);
+}
+
+/* moves a request from the host's queue to a connection (locked) */
+static void http_client_assign(http_client_conn_s *c, http_client_req_s *r,
+                               http_client_tasks_s *t) {
+  fio_ls_embd_remove(&r->node);
+  fio_ls_embd_unshift(&c->requests, &r->node);
+  ++c->count;
+  if (!r->idempotent || r->retried)
+    ++c->unsafe;
+  if (c->scheduled)
+    return;
+  c->scheduled = 1;
+  ++c->ref;
+  t->send[t->send_count++] = c;
+}
+
+/*
+ * Assigns queued requests to idle connections, opens new connections (up to
+ * `HTTP_CLIENT_POOL_LIMIT`) and pipelines idempotent requests once the pool is
+ * full (locked).
+ *
+ * Retried requests aren't pipelined, since the server might have closed the
+ * connection (discarding the pipelined data) for a reason.
+ */
+static void http_client_dispatch(http_client_host_s *host,
+                                 http_client_tasks_s *t) {
+  /* queued requests left for the connections being opened */
+  size_t waiting = 0;
+  fio_ls_embd_s *pos = host->queue.next;
+  while (pos != &host->queue) {
+    http_client_req_s *r = FIO_LS_EMBD_OBJ(http_client_req_s, node, pos);
+    fio_ls_embd_s *next = pos->next;
+    http_client_conn_s *c = NULL;
+    FIO_LS_EMBD_FOR(&host->conns, cpos) {
+      http_client_conn_s *tmp =
+          FIO_LS_EMBD_OBJ(http_client_conn_s, node, cpos);
+      if (tmp->state != HTTP_CLIENT_OPEN)
+        continue;
+      if (!tmp->count) {
+        c = tmp;
+        break;
+      }
+      if (r->idempotent && !r->retried && tmp->reused && !tmp->unsafe &&
+          tmp->count < HTTP_CLIENT_PIPELINE && (!c || tmp->count < c->count))
+        c = tmp;
+    }
+    if (c && !c->count) {
+      http_client_assign(c, r, t);
+    } else if (waiting < host->connecting) {
+      ++waiting;
+    } else if (host->count < HTTP_CLIENT_POOL_LIMIT) {
+      http_client_conn_s *n = fio_malloc(sizeof(*n));
+      HTTP_ASSERT(n, "HTTP client connection allocation failed");
+      *n = (http_client_conn_s){
+          .requests = FIO_LS_INIT(n->requests),
+          .host = host,
+          .uuid = -1,
+          .ref = 1,
+          .state = HTTP_CLIENT_CONNECTING,
+      };
+      fio_ls_embd_unshift(&host->conns, &n->node);
+      ++host->count;
+      ++host->connecting;
+      ++waiting;
+      t->open[t->open_count++] = n;
+    } else if (c) {
+      http_client_assign(c, r, t);
+    } else {
+      break;
+    }
+    pos = next;
+  }
+}
+
+static void http_client_on_response(http_s *h);
+static void http_client_on_upgrade(http_s *h, char *proto, size_t len);
+static void http_client_on_finish(http_settings_s *settings);
+static void http_client_send_task(intptr_t uuid, protocol_s *pr, void *c_);
+static void http_client_send_fallback(intptr_t uuid, void *c_);
+
+/* performs the work collected by `http_client_dispatch` (unlocked) */
+static void http_client_perform(http_client_tasks_s *t) {
+  for (size_t i = 0; i < t->send_count; ++i) {
+    facil_defer(.uuid = t->send[i]->uuid, .task = http_client_send_task,
+                .arg = t->send[i], .fallback = http_client_send_fallback);
+  }
+  for (size_t i = 0; i < t->open_count; ++i) {
+    /* `on_finish` is called if the connection fails (perhaps immediately) */
+    http_connect(fiobj_obj2cstr(t->open[i]->host->address).data,
+                 .on_response = http_client_on_response,
+                 .on_upgrade = http_client_on_upgrade,
+                 .on_finish = http_client_on_finish, .udata = t->open[i],
+                 .timeout = HTTP_CLIENT_TIMEOUT);
+  }
+  while (fio_ls_embd_any(&t->failed)) {
+    http_client_req_s *r =
+        FIO_LS_EMBD_OBJ(http_client_req_s, node, fio_ls_embd_pop(&t->failed));
+    r->on_response(NULL, r->udata);
+    http_client_req_free(r);
+  }
+}
+
+static int http_client_copy_header(FIOBJ value, void *h_) {
+  http_s *h = h_;
+  http_set_header(h, fiobj_dup(fiobj_hash_key_in_loop()), fiobj_dup(value));
+  return 0;
+}
+
+/* writes the connection's unsent requests (within the connection's lock) */
+static void http_client_send_task(intptr_t uuid, protocol_s *pr, void *c_) {
+  http_client_conn_s *c = c_;
+  http_client_req_s copy[HTTP_CLIENT_PIPELINE];
+  FIOBJ host_header = FIOBJ_INVALID;
+  size_t count = 0;
+  spn_lock(&http_client_lock);
+  c->scheduled = 0;
+  if (c->state == HTTP_CLIENT_OPEN) {
+    host_header = fiobj_dup(c->host->host);
+    FIO_LS_EMBD_FOR(&c->requests, pos) {
+      http_client_req_s *r = FIO_LS_EMBD_OBJ(http_client_req_s, node, pos);
+      if (r->sent)
+        continue;
+      if (count == HTTP_CLIENT_PIPELINE)
+        break;
+      r->sent = 1;
+      copy[count++] = (http_client_req_s){
+          .method = fiobj_dup(r->method),
+          .path = fiobj_dup(r->path),
+          .headers = fiobj_dup(r->headers),
+          .body = fiobj_dup(r->body),
+      };
+    }
+  }
+  http_client_conn_release(c);
+  spn_unlock(&http_client_lock);
+  if (count)
+    facil_set_timeout(uuid, HTTP_CLIENT_TIMEOUT);
+  for (size_t i = 0; i < count; ++i) {
+    http_s *h = fio_malloc(sizeof(*h));
+    HTTP_ASSERT(h, "HTTP client request allocation failed");
+    http_s_new(h, (http_protocol_s *)pr, http1_vtable());
+    h->status = 0;
+    h->method = copy[i].method;
+    h->path = copy[i].path;
+    if (copy[i].headers)
+      fiobj_each1(copy[i].headers, 0, http_client_copy_header, h);
+    if (!fiobj_hash_get2(h->private_data.out_headers,
+                         fiobj_obj2hash(HTTP_HEADER_HOST)))
+      http_set_header(h, HTTP_HEADER_HOST, fiobj_dup(host_header));
+    fiobj_free(copy[i].headers);
+    if (copy[i].body) {
+      http_send_body_fiobj(h, copy[i].body);
+      fiobj_free(copy[i].body);
+    } else {
+      http_finish(h);
+    }
+  }
+  fiobj_free(host_header);
+}
+
+static void http_client_send_fallback(intptr_t uuid, void *c_) {
+  spn_lock(&http_client_lock);
+  ((http_client_conn_s *)c_)->scheduled = 0;
+  http_client_conn_release(c_);
+  spn_unlock(&http_client_lock);
+  (void)uuid;
+}
+
+/* tests if the server will keep the connection open after the response */
+static uint8_t http_client_keep_alive(http_s *h) {
+  FIOBJ tmp =
+      fiobj_hash_get2(h->headers, fiobj_obj2hash(HTTP_HEADER_CONNECTION));
+  if (FIOBJ_TYPE_IS(tmp, FIOBJ_T_STRING)) {
+    fio_cstr_s val = fiobj_obj2cstr(tmp);
+    if (val.len && (val.data[0] | 32) == 'c')
+      return 0;
+    if (val.len && (val.data[0] | 32) == 'k')
+      return 1;
+  }
+  fio_cstr_s v = fiobj_obj2cstr(h->version);
+  return (v.len > 7 && v.data[5] == '1' && v.data[6] == '.' &&
+          v.data[7] == '1');
+}
+
+static void http_client_on_response(http_s *h) {
+  http_client_conn_s *c = h->udata;
+  http_client_tasks_s t = {.failed = FIO_LS_INIT(t.failed)};
+  if (!h->status) {
+    /* connected, `h` is an empty request handle we don't need */
+    spn_lock(&http_client_lock);
+    c->uuid = http2uuid(h);
+    c->state = HTTP_CLIENT_OPEN;
+    --c->host->connecting;
+    http_client_dispatch(c->host, &t);
+    spn_unlock(&http_client_lock);
+    http_s_destroy(h, 0);
+    fio_free(h);
+    facil_set_timeout(c->uuid, HTTP_CLIENT_IDLE_TIMEOUT);
+    http_client_perform(&t);
+    return;
+  }
+  uint8_t keep_alive = http_client_keep_alive(h);
+  http_client_req_s *r = NULL;
+  spn_lock(&http_client_lock);
+  if (fio_ls_embd_any(&c->requests) &&
+      FIO_LS_EMBD_OBJ(http_client_req_s, node, c->requests.next)->sent) {
+    r = FIO_LS_EMBD_OBJ(http_client_req_s, node,
+                        fio_ls_embd_pop(&c->requests));
+    --c->count;
+    if (!r->idempotent || r->retried)
+      --c->unsafe;
+    c->reused = 1;
+  }
+  if (!keep_alive || !r)
+    c->state = HTTP_CLIENT_CLOSING;
+  spn_unlock(&http_client_lock);
+  if (r) {
+    r->on_response(h, r->udata);
+    http_client_req_free(r);
+  }
+  uint8_t idle = 0;
+  uint8_t close = 0;
+  spn_lock(&http_client_lock);
+  if (c->state == HTTP_CLIENT_CLOSING) {
+    close = 1;
+    /* requests that the server won't answer are sent on another connection */
+    while (fio_ls_embd_any(&c->requests)) {
+      r = FIO_LS_EMBD_OBJ(http_client_req_s, node,
+                          fio_ls_embd_shift(&c->requests));
+      r->sent = 0;
+      fio_ls_embd_push(&c->host->queue, &r->node);
+    }
+    c->count = c->unsafe = 0;
+  } else {
+    idle = !c->count;
+  }
+  http_client_dispatch(c->host, &t);
+  spn_unlock(&http_client_lock);
+  if (close)
+    sock_close(c->uuid);
+  else if (idle)
+    facil_set_timeout(c->uuid, HTTP_CLIENT_IDLE_TIMEOUT);
+  http_client_perform(&t);
+}
+
+/* the response's `upgrade` header (i.e., "h2c") is only informative */
+static void http_client_on_upgrade(http_s *h, char *proto, size_t len) {
+  http_client_on_response(h);
+  (void)proto;
+  (void)len;
+}
+
+static void http_client_on_finish(http_settings_s *settings) {
+  http_client_conn_s *c = settings->udata;
+  http_client_host_s *host = c->host;
+  http_client_tasks_s t = {.failed = FIO_LS_INIT(t.failed)};
+  spn_lock(&http_client_lock);
+  fio_ls_embd_remove(&c->node);
+  --host->count;
+  uint8_t failed = (c->state == HTTP_CLIENT_CONNECTING);
+  if (failed)
+    --host->connecting;
+  c->state = HTTP_CLIENT_CLOSED;
+  /* requests that weren't answered are retried once (unless unsafe) */
+  while (fio_ls_embd_any(&c->requests)) {
+    http_client_req_s *r = FIO_LS_EMBD_OBJ(http_client_req_s, node,
+                                           fio_ls_embd_shift(&c->requests));
+    if (!r->sent || (c->reused && r->idempotent && !r->retried)) {
+      r->retried |= r->sent;
+      r->sent = 0;
+      fio_ls_embd_push(&host->queue, &r->node);
+    } else {
+      fio_ls_embd_unshift(&t.failed, &r->node);
     }
-  } else {
-    if (is_secure)
-      p = "443";
-    else
-      p = "80";
   }
+  if (failed && !host->count) {
+    /* the host is unreachable */
+    while (fio_ls_embd_any(&host->queue))
+      fio_ls_embd_unshift(&t.failed, fio_ls_embd_pop(&host->queue));
+  }
+  http_client_dispatch(host, &t);
+  http_client_host_release(host);
+  http_client_conn_release(c);
+  spn_unlock(&http_client_lock);
+  http_client_perform(&t);
+}
 
-  /* set settings */
-  if (!arg_settings.timeout)
-    arg_settings.timeout = 30;
-  http_settings_s *settings = http_settings_new(arg_settings);
-  settings->is_client = 1;
-  if (!arg_settings.ws_timeout)
-    settings->ws_timeout = 0; /* allow server to dictate timeout */
-  if (!arg_settings.timeout)
-    settings->timeout = 0; /* allow server to dictate timeout */
-  http_s *h = fio_malloc(sizeof(*h));
-  HTTP_ASSERT(h, "HTTP Client handler allocation failed");
-  http_s_new(h, 0, http1_vtable());
-  h->udata = arg_settings.udata;
-  h->status = 0;
-  h->path = path;
-  settings->udata = h;
-  http_set_header2(h, (fio_cstr_s){.data = "host", .len = 4},
-                   (fio_cstr_s){.data = a, .len = len});
-  intptr_t ret;
-  if (is_websocket) {
-    /* force HTTP/1.1 */
-    ret =
-        facil_connect(.address = a, .port = p, .on_fail = http_on_client_failed,
-                      .on_connect = http_on_open_client, .udata = settings);
-    (void)0;
-  } else {
-    /* Allow for any HTTP version */
-    ret =
-        facil_connect(.address = a, .port = p, .on_fail = http_on_client_failed,
-                      .on_connect = http_on_open_client, .udata = settings);
-    (void)0;
+/**
+ * Sends an HTTP request, reusing a pooled (keep-alive) client connection.
+ */
+#undef http_request
+int http_request(const char *url, struct http_request_args_s args) {
+  size_t len;
+  if (!args.on_response || !url || (len = strlen(url)) <= 7 ||
+      strncasecmp(url, "http://", 7)) {
+    errno = EINVAL;
+    return -1;
   }
-  fio_free(a);
-  return ret;
+  url += 7;
+  len -= 7;
+  const char *end = memchr(url, '/', len);
+  if (!end)
+    end = url + len;
+  const char *port = memchr(url, ':', end - url);
+  size_t host_len = (port ? port : end) - url;
+  size_t port_len = port ? (size_t)(end - port - 1) : 0;
+  if (!host_len || (port && (!port_len || port_len > 5))) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (port)
+    ++port;
+  else {
+    port = "80";
+    port_len = 2;
+  }
+  FIOBJ name = fiobj_str_buf(host_len + port_len + 1);
+  fiobj_str_write(name, url, host_len);
+  fiobj_str_write(name, ":", 1);
+  fiobj_str_write(name, port, port_len);
+
+  http_client_req_s *r = fio_malloc(sizeof(*r));
+  HTTP_ASSERT(r, "HTTP client request allocation failed");
+  *r = (http_client_req_s){
+      .method = args.method ? fiobj_dup(args.method) : fiobj_str_new("GET", 3),
+      .path = (*end ? fiobj_str_new(end, url + len - end)
+                    : fiobj_str_new("/", 1)),
+      .headers = fiobj_dup(args.headers),
+      .body = fiobj_dup(args.body),
+      .on_response = args.on_response,
+      .udata = args.udata,
+  };
+  {
+    fio_cstr_s m = fiobj_obj2cstr(r->method);
+    r->idempotent = (m.len == 3 && !strncasecmp(m.data, "GET", 3)) ||
+                    (m.len == 3 && !strncasecmp(m.data, "PUT", 3)) ||
+                    (m.len == 6 && !strncasecmp(m.data, "DELETE", 6)) ||
+                    (m.len == 7 && !strncasecmp(m.data, "OPTIONS", 7));
+  }
+
+  http_client_tasks_s t = {.failed = FIO_LS_INIT(t.failed)};
+  fio_cstr_s n = fiobj_obj2cstr(name);
+  uint64_t hash = fio_risky_hash(n.data, n.len);
+  spn_lock(&http_client_lock);
+  if (!http_client_hosts.map)
+    fio_hash_new(&http_client_hosts);
+  http_client_host_s *host = fio_hash_find(&http_client_hosts, hash);
+  while (host && !fiobj_iseq(host->name, name)) {
+    /* a hash collision, probe the next key */
+    host = fio_hash_find(&http_client_hosts, ++hash);
+  }
+  if (!host) {
+    host = fio_malloc(sizeof(*host));
+    HTTP_ASSERT(host, "HTTP client host allocation failed");
+    *host = (http_client_host_s){
+        .queue = FIO_LS_INIT(host->queue),
+        .conns = FIO_LS_INIT(host->conns),
+        .name = fiobj_dup(name),
+        .hash = hash,
+    };
+    host->host = (port_len == 2 && port[0] == '8' && port[1] == '0')
+                     ? fiobj_str_new(url, host_len)
+                     : fiobj_dup(name);
+    host->address = fiobj_str_buf(n.len + 7);
+    fiobj_str_write(host->address, "http://", 7);
+    fiobj_str_join(host->address, name);
+    fio_hash_insert(&http_client_hosts, hash, host);
+  }
+  fio_ls_embd_unshift(&host->queue, &r->node);
+  http_client_dispatch(host, &t);
+  spn_unlock(&http_client_lock);
+  fiobj_free(name);
+  http_client_perform(&t);
+  return 0;
 }
-#define http_connect(address, ...)                                             \
-  http_connect((address), (struct http_settings_s){__VA_ARGS__})
+#define http_request(url, ...)                                                 \
+  http_request((url), (struct http_request_args_s){__VA_ARGS__})
 
 /* *****************************************************************************
 HTTP Websocket Connect
@@ -1221,8 +2736,7 @@ static void http_sse_on_message(pubsub_message_s *msg) {
     return;
   }
   /* write directly to HTTP stream / connection */
-  fio_cstr_s m = fiobj_obj2cstr(msg->message);
-  http_sse_write(&sse->sse, .data = m);
+  http_sse_write_pubsub(&sse->sse, msg);
 
   return;
 postpone:
@@ -1353,6 +2867,36 @@ int http_sse_write(http_sse_s *sse, struct http_sse_write_args args) {
       ->vtable->http_sse_write(sse, buf);
 }
 
+/* the `pubsub_cache` type for SSE events (websockets use the values 0-7) */
+#define HTTP_SSE_PUBSUB_CACHE_TYPE ((uintptr_t)0x535345) /* "SSE" */
+
+/* encodes a pub/sub message as an SSE event (`data` only). */
+static FIOBJ http_sse_pubsub_encode(pubsub_message_s *msg, uintptr_t type) {
+  fio_cstr_s data = fiobj_obj2cstr(msg->message);
+  FIOBJ event = fiobj_str_buf(6 + data.len + 4);
+  http_sse_copy2str(event, "data: ", 6, data);
+  fiobj_str_write(event, "\r\n", 2);
+  return event;
+  (void)type;
+}
+
+/**
+ * Writes a pub/sub message to an EventSource (SSE) connection, encoding the
+ * event only once per message and sharing it between the message's recipients.
+ */
+int http_sse_write_pubsub(http_sse_s *sse, pubsub_message_s *msg) {
+  if (!sse || !fiobj_obj2cstr(msg->message).len ||
+      sock_isclosed(FIO_LS_EMBD_OBJ(http_sse_internal_s, sse, sse)->uuid))
+    return -1;
+  FIOBJ event =
+      pubsub_cache(msg, HTTP_SSE_PUBSUB_CACHE_TYPE, http_sse_pubsub_encode);
+  if (!event)
+    return http_sse_write(sse, (struct http_sse_write_args){
+                                   .data = fiobj_obj2cstr(msg->message)});
+  return FIO_LS_EMBD_OBJ(http_sse_internal_s, sse, sse)
+      ->vtable->http_sse_write(sse, fiobj_dup(event));
+}
+
 /**
  * Get the connection's UUID (for facil_defer and similar use cases).
  */
@@ -1407,8 +2951,12 @@ static inline FIOBJ http_urlstr2fiobj(char *s, size_t len) {
   return o;
 }
 
-/** converts a string into a `FIOBJ`. */
-static inline FIOBJ http_str2fiobj(char *s, size_t len, uint8_t encoded) {
+/**
+ * converts a string into a `FIOBJ`. String data is placed in the request's
+ * arena, unless `h` is NULL.
+ */
+static inline FIOBJ http_str2fiobj(http_s *h, char *s, size_t len,
+                                   uint8_t encoded) {
   switch (len) {
   case 0:
     return fiobj_str_new(NULL, 0); /* empty string */
@@ -1434,11 +2982,21 @@ static inline FIOBJ http_str2fiobj(char *s, size_t len, uint8_t encoded) {
     if (end == s + len)
       return fiobj_float_new(tmp);
   }
+  if (h)
+    return http_arena_str(h, s, len, encoded);
   if (encoded)
     return http_urlstr2fiobj(s, len);
   return fiobj_str_new(s, len);
 }
 
+/** `http_add2hash`, placing String values in the request's arena. */
+static inline int http_add2hash_arena(http_s *h, FIOBJ dest, char *name,
+                                      size_t name_len, char *value,
+                                      size_t value_len, uint8_t encoded) {
+  return http_add2hash2(dest, name, name_len,
+                        http_str2fiobj(h, value, value_len, encoded), encoded);
+}
+
 /** Parses the query part of an HTTP request/response. Uses `http_add2hash`. */
 void http_parse_query(http_s *h) {
   if (!h->query)
@@ -1453,8 +3011,8 @@ void http_parse_query(http_s *h) {
     char *cut2 = memchr(q.data, '=', (cut - q.data));
     if (cut2) {
       /* we only add named elements... */
-      http_add2hash(h->params, q.data, (size_t)(cut2 - q.data), (cut2 + 1),
-                    (size_t)(cut - (cut2 + 1)), 1);
+      http_add2hash_arena(h, h->params, q.data, (size_t)(cut2 - q.data),
+                          (cut2 + 1), (size_t)(cut - (cut2 + 1)), 1);
     }
     if (cut[0] == '&') {
       /* protecting against some ...less informed... clients */
@@ -1468,7 +3026,54 @@ void http_parse_query(http_s *h) {
   } while (q.len);
 }
 
-static inline void http_parse_cookies_cookie_str(FIOBJ dest, FIOBJ str,
+/* compares an encoded query name with a (decoded) name */
+static inline uint8_t http_query_name_eq(const char *encoded, size_t len,
+                                         const char *name, size_t name_len) {
+  if (len < name_len)
+    return 0;
+  if (http_decode_seek(encoded, encoded + len, 1) == encoded + len)
+    return len == name_len && !memcmp(encoded, name, len);
+  /* the name is shorter once decoded (each "%XX" becomes a single byte) */
+  char buffer[256];
+  if (len >= sizeof(buffer))
+    return 0;
+  ssize_t decoded = http_decode_url(buffer, encoded, len);
+  return decoded == (ssize_t)name_len && !memcmp(buffer, name, name_len);
+}
+
+/**
+ * Returns a query parameter's value without parsing the rest of the query.
+ */
+FIOBJ http_query_get(http_s *h, const char *name, size_t name_len) {
+  if (HTTP_INVALID_HANDLE(h) || !name || !name_len)
+    return FIOBJ_INVALID;
+  if (h->params) {
+    /* the query (or body) was already parsed */
+    FIOBJ found = fiobj_hash_get2(h->params, fio_siphash(name, name_len));
+    if (found)
+      return fiobj_dup(found);
+  }
+  if (!h->query)
+    return FIOBJ_INVALID;
+  fio_cstr_s q = fiobj_obj2cstr(h->query);
+  const char *end = q.data + q.len;
+  char *pos = q.data;
+  while (pos < end) {
+    char *cut = memchr(pos, '&', end - pos);
+    if (!cut)
+      cut = (char *)end;
+    char *eq = memchr(pos, '=', cut - pos);
+    if (eq && http_query_name_eq(pos, eq - pos, name, name_len))
+      return http_str2fiobj(h, eq + 1, cut - (eq + 1), 1);
+    pos = cut + 1;
+    if (pos + 3 < end && pos[0] == 'a' && pos[1] == 'm' && pos[2] == 'p' &&
+        pos[3] == ';')
+      pos += 4; /* "&amp;" */
+  }
+  return FIOBJ_INVALID;
+}
+
+static inline void http_parse_cookies_cookie_str(http_s *h, FIOBJ str,
                                                  uint8_t is_url_encoded) {
   if (!FIOBJ_TYPE_IS(str, FIOBJ_T_STRING))
     return;
@@ -1485,8 +3090,8 @@ static inline void http_parse_cookies_cookie_str(FIOBJ dest, FIOBJ str,
     char *cut2 = memchr(cut, ';', s.len - (cut - s.data));
     if (!cut2)
       cut2 = s.data + s.len;
-    http_add2hash(dest, s.data, cut - s.data, cut + 1, (cut2 - (cut + 1)),
-                  is_url_encoded);
+    http_add2hash_arena(h, h->cookies, s.data, cut - s.data, cut + 1,
+                        (cut2 - (cut + 1)), is_url_encoded);
     if ((size_t)((cut2 + 1) - s.data) > s.length)
       s.length = 0;
     else
@@ -1494,7 +3099,7 @@ static inline void http_parse_cookies_cookie_str(FIOBJ dest, FIOBJ str,
     s.data = cut2 + 1;
   }
 }
-static inline void http_parse_cookies_setcookie_str(FIOBJ dest, FIOBJ str,
+static inline void http_parse_cookies_setcookie_str(http_s *h, FIOBJ str,
                                                     uint8_t is_url_encoded) {
   if (!FIOBJ_TYPE_IS(str, FIOBJ_T_STRING))
     return;
@@ -1506,8 +3111,8 @@ static inline void http_parse_cookies_setcookie_str(FIOBJ dest, FIOBJ str,
   if (!cut2)
     cut2 = s.data + s.len;
   if (cut2 > cut)
-    http_add2hash(dest, s.data, cut - s.data, cut + 1, (cut2 - (cut + 1)),
-                  is_url_encoded);
+    http_add2hash_arena(h, h->cookies, s.data, cut - s.data, cut + 1,
+                        (cut2 - (cut + 1)), is_url_encoded);
 }
 
 /** Parses any Cookie / Set-Cookie headers, using the `http_add2hash` scheme. */
@@ -1530,12 +3135,12 @@ void http_parse_cookies(http_s *h, uint8_t is_url_encoded) {
       /* Array of Strings */
       size_t count = fiobj_ary_count(c);
       for (size_t i = 0; i < count; ++i) {
-        http_parse_cookies_cookie_str(
-            h->cookies, fiobj_ary_index(c, (int64_t)i), is_url_encoded);
+        http_parse_cookies_cookie_str(h, fiobj_ary_index(c, (int64_t)i),
+                                      is_url_encoded);
       }
     } else {
       /* single string */
-      http_parse_cookies_cookie_str(h->cookies, c, is_url_encoded);
+      http_parse_cookies_cookie_str(h, c, is_url_encoded);
     }
   }
   c = fiobj_hash_get2(h->headers, fiobj_obj2hash(HTTP_HEADER_SET_COOKIE));
@@ -1546,12 +3151,12 @@ void http_parse_cookies(http_s *h, uint8_t is_url_encoded) {
       /* Array of Strings */
       size_t count = fiobj_ary_count(c);
       for (size_t i = 0; i < count; ++i) {
-        http_parse_cookies_setcookie_str(
-            h->cookies, fiobj_ary_index(c, (int64_t)i), is_url_encoded);
+        http_parse_cookies_setcookie_str(h, fiobj_ary_index(c, (int64_t)i),
+                                         is_url_encoded);
       }
     } else {
       /* single string */
-      http_parse_cookies_setcookie_str(h->cookies, c, is_url_encoded);
+      http_parse_cookies_setcookie_str(h, c, is_url_encoded);
     }
   }
 }
@@ -1764,7 +3369,8 @@ error:
 int http_add2hash(FIOBJ dest, char *name, size_t name_len, char *value,
                   size_t value_len, uint8_t encoded) {
   return http_add2hash2(dest, name, name_len,
-                        http_str2fiobj(value, value_len, encoded), encoded);
+                        http_str2fiobj(NULL, value, value_len, encoded),
+                        encoded);
 }
 
 /* *****************************************************************************
@@ -1780,6 +3386,9 @@ typedef struct {
   size_t partial_offset;
   size_t partial_length;
   FIOBJ partial_name;
+  /* a streamed part's data (see `http_mime_stream_new`) */
+  FIOBJ partial;
+  uint8_t stream;
 } http_fio_mime_s;
 
 #define http_mime_parser2fio(parser) ((http_fio_mime_s *)(parser))
@@ -1790,27 +3399,25 @@ static void http_mime_parser_on_data(http_mime_parser_s *parser, void *name,
                                      size_t filename_len, void *mimetype,
                                      size_t mimetype_len, void *value,
                                      size_t value_len) {
+  http_s *h = http_mime_parser2fio(parser)->h;
   if (!filename) {
-    http_add2hash(http_mime_parser2fio(parser)->h->params, name, name_len,
-                  value, value_len, 0);
+    http_add2hash_arena(h, h->params, name, name_len, value, value_len, 0);
     return;
   }
   FIOBJ n = fiobj_str_new(name, name_len);
   fiobj_str_write(n, "[data]", 6);
   fio_cstr_s tmp = fiobj_obj2cstr(n);
-  http_add2hash(http_mime_parser2fio(parser)->h->params, tmp.data, tmp.len,
-                value, value_len, 0);
+  http_add2hash_arena(h, h->params, tmp.data, tmp.len, value, value_len, 0);
   fiobj_str_resize(n, name_len);
   fiobj_str_write(n, "[type]", 6);
   tmp = fiobj_obj2cstr(n);
-  http_add2hash(http_mime_parser2fio(parser)->h->params, tmp.data, tmp.len,
-                mimetype, mimetype_len, 0);
+  http_add2hash_arena(h, h->params, tmp.data, tmp.len, mimetype, mimetype_len,
+                      0);
   fiobj_str_resize(n, name_len);
   fiobj_str_write(n, "[name]", 6);
   tmp = fiobj_obj2cstr(n);
-  fprintf(stderr, "filename length %zu\n", filename_len);
-  http_add2hash(http_mime_parser2fio(parser)->h->params, tmp.data, tmp.len,
-                filename, filename_len, 0);
+  http_add2hash_arena(h, h->params, tmp.data, tmp.len, filename, filename_len,
+                      0);
   fiobj_free(n);
 }
 
@@ -1821,20 +3428,23 @@ static void http_mime_parser_on_partial_start(
   http_mime_parser2fio(parser)->partial_length = 0;
   http_mime_parser2fio(parser)->partial_offset = 0;
   http_mime_parser2fio(parser)->partial_name = fiobj_str_new(name, name_len);
+  if (http_mime_parser2fio(parser)->stream)
+    http_mime_parser2fio(parser)->partial = fiobj_data_newtmpfile();
 
   if (!filename)
     return;
 
+  http_s *h = http_mime_parser2fio(parser)->h;
   fiobj_str_write(http_mime_parser2fio(parser)->partial_name, "[type]", 6);
   fio_cstr_s tmp = fiobj_obj2cstr(http_mime_parser2fio(parser)->partial_name);
-  http_add2hash(http_mime_parser2fio(parser)->h->params, tmp.data, tmp.len,
-                mimetype, mimetype_len, 0);
+  http_add2hash_arena(h, h->params, tmp.data, tmp.len, mimetype, mimetype_len,
+                      0);
 
   fiobj_str_resize(http_mime_parser2fio(parser)->partial_name, name_len);
   fiobj_str_write(http_mime_parser2fio(parser)->partial_name, "[name]", 6);
   tmp = fiobj_obj2cstr(http_mime_parser2fio(parser)->partial_name);
-  http_add2hash(http_mime_parser2fio(parser)->h->params, tmp.data, tmp.len,
-                filename, filename_len, 0);
+  http_add2hash_arena(h, h->params, tmp.data, tmp.len, filename, filename_len,
+                      0);
 
   fiobj_str_resize(http_mime_parser2fio(parser)->partial_name, name_len);
   fiobj_str_write(http_mime_parser2fio(parser)->partial_name, "[data]", 6);
@@ -1843,6 +3453,10 @@ static void http_mime_parser_on_partial_start(
 /** Called when partial data is available. */
 static void http_mime_parser_on_partial_data(http_mime_parser_s *parser,
                                              void *value, size_t value_len) {
+  if (http_mime_parser2fio(parser)->partial) {
+    fiobj_data_write(http_mime_parser2fio(parser)->partial, value, value_len);
+    return;
+  }
   if (!http_mime_parser2fio(parser)->partial_offset)
     http_mime_parser2fio(parser)->partial_offset =
         http_mime_parser2fio(parser)->pos +
@@ -1856,11 +3470,14 @@ static void http_mime_parser_on_partial_data(http_mime_parser_s *parser,
 static void http_mime_parser_on_partial_end(http_mime_parser_s *parser) {
 
   fio_cstr_s tmp = fiobj_obj2cstr(http_mime_parser2fio(parser)->partial_name);
+  FIOBJ value = http_mime_parser2fio(parser)->partial;
+  http_mime_parser2fio(parser)->partial = FIOBJ_INVALID;
+  if (!value)
+    value = fiobj_data_slice(http_mime_parser2fio(parser)->h->body,
+                             http_mime_parser2fio(parser)->partial_offset,
+                             http_mime_parser2fio(parser)->partial_length);
   http_add2hash2(http_mime_parser2fio(parser)->h->params, tmp.data, tmp.len,
-                 fiobj_data_slice(http_mime_parser2fio(parser)->h->body,
-                                  http_mime_parser2fio(parser)->partial_offset,
-                                  http_mime_parser2fio(parser)->partial_length),
-                 0);
+                 value, 0);
   fiobj_free(http_mime_parser2fio(parser)->partial_name);
   http_mime_parser2fio(parser)->partial_name = FIOBJ_INVALID;
 }
@@ -1887,12 +3504,17 @@ static inline size_t http_mime_decode_url(char *dest, const char *encoded,
  */
 int http_parse_body(http_s *h) {
   static uint64_t content_type_hash;
-  if (!h->body)
-    return -1;
   if (!content_type_hash)
     content_type_hash = fio_siphash("content-type", 12);
   FIOBJ ct = fiobj_hash_get2(h->headers, content_type_hash);
   fio_cstr_s content_type = fiobj_obj2cstr(ct);
+  if (!h->body) {
+    /* multipart bodies might have been parsed as they arrived */
+    if (h->params && content_type.len >= 14 &&
+        !strncasecmp("multipart/form", content_type.data, 14))
+      return 0;
+    return -1;
+  }
   if (content_type.len < 16)
     return -1;
   if (content_type.len >= 33 &&
@@ -1939,6 +3561,129 @@ int http_parse_body(http_s *h) {
   return 0;
 }
 
+/* *****************************************************************************
+Streaming multipart parsing (see `stream_multipart`)
+***************************************************************************** */
+
+/**
+ * Unless the parser is within a part, the data is buffered until this many
+ * bytes are available, so a part's headers are never split (the parser can't
+ * resume within the headers).
+ */
+#ifndef HTTP_MIME_STREAM_MIN
+#define HTTP_MIME_STREAM_MIN 4096
+#endif
+
+typedef struct {
+  http_fio_mime_s mime;
+  /* the parser's boundary points to the `content-type` header's value */
+  FIOBJ content_type;
+  /* data that the parser didn't consume yet */
+  char *buf;
+  size_t len;
+  size_t capa;
+} http_mime_stream_s;
+
+void *http_mime_stream_new(http_s *h) {
+  static uint64_t content_type_hash;
+  if (!content_type_hash)
+    content_type_hash = fio_siphash("content-type", 12);
+  FIOBJ ct = fiobj_hash_get2(h->headers, content_type_hash);
+  if (!ct || !FIOBJ_TYPE_IS(ct, FIOBJ_T_STRING))
+    return NULL;
+  fio_cstr_s content_type = fiobj_obj2cstr(ct);
+  http_mime_stream_s *m = malloc(sizeof(*m));
+  if (!m)
+    return NULL;
+  *m = (http_mime_stream_s){.mime = {.h = h, .stream = 1},
+                            .content_type = fiobj_dup(ct)};
+  if (http_mime_parser_init(&m->mime.p, content_type.data, content_type.len)) {
+    fiobj_free(m->content_type);
+    free(m);
+    return NULL;
+  }
+  if (!h->params)
+    h->params = fiobj_hash_new();
+  return m;
+}
+
+/* parses as much of the data as possible, returning the consumed length. */
+static size_t http_mime_stream_parse(http_mime_stream_s *m, char *data,
+                                     size_t len, uint8_t last) {
+  size_t total = 0;
+  while (len && !m->mime.p.done && !m->mime.p.error) {
+    size_t available = len;
+    if (!m->mime.p.in_obj && len < HTTP_MIME_STREAM_MIN && !last)
+      break;
+    /* a trailing '\r' might belong to the next boundary */
+    if (m->mime.p.in_obj && !last && data[len - 1] == '\r')
+      --available;
+    size_t consumed = http_mime_parse(&m->mime.p, data, available);
+    if (!consumed)
+      break;
+    data += consumed;
+    len -= consumed;
+    total += consumed;
+  }
+  return total;
+}
+
+int http_mime_stream_write(void *stream, char *data, size_t len) {
+  http_mime_stream_s *m = stream;
+  if (m->mime.p.done)
+    return 0; /* the epilogue is ignored */
+  if (!m->len) {
+    /* parse the data where it is, keeping only the unconsumed tail */
+    size_t consumed = http_mime_stream_parse(m, data, len, 0);
+    data += consumed;
+    len -= consumed;
+  }
+  if (m->mime.p.error)
+    return -1;
+  if (!len)
+    return 0;
+  if (m->len + len > m->capa) {
+    /* the padding allows the parser to peek past the data */
+    size_t capa = ((m->len + len) << 1) + 64;
+    void *tmp = realloc(m->buf, capa);
+    if (!tmp)
+      return -1;
+    m->buf = tmp;
+    m->capa = capa - 64;
+  }
+  memcpy(m->buf + m->len, data, len);
+  m->len += len;
+  memset(m->buf + m->len, 0, 64);
+  if (m->len == len)
+    return 0; /* the new data was already offered to the parser */
+  size_t consumed = http_mime_stream_parse(m, m->buf, m->len, 0);
+  if (consumed) {
+    m->len -= consumed;
+    memmove(m->buf, m->buf + consumed, m->len);
+  }
+  return m->mime.p.error ? -1 : 0;
+}
+
+void http_mime_stream_free(void *stream) {
+  http_mime_stream_s *m = stream;
+  if (!m)
+    return;
+  fiobj_free(m->mime.partial_name);
+  fiobj_free(m->mime.partial);
+  fiobj_free(m->content_type);
+  free(m->buf);
+  free(m);
+}
+
+int http_mime_stream_finish(void *stream) {
+  http_mime_stream_s *m = stream;
+  if (m->len)
+    m->len -= http_mime_stream_parse(m, m->buf, m->len, 1);
+  int ret = (m->mime.p.done && !m->mime.p.error) ? 0 : -1;
+  http_mime_stream_free(m);
+  return ret;
+}
+
 /* *****************************************************************************
 HTTP Helper functions that could be used globally
 ***************************************************************************** */
@@ -1992,71 +3737,289 @@ FIOBJ http_req2str(http_s *h) {
   return w.dest;
 }
 
-void http_write_log(http_s *h) {
-  FIOBJ l = fiobj_str_buf(128);
+/* *****************************************************************************
+Buffered logging
+
+Each thread formats it's log lines into it's own buffer, which is written to
+`stderr` once it's full. A timer writes any buffered lines every
+HTTP_LOG_FLUSH_INTERVAL milliseconds (and at exit), so writes are batched.
+***************************************************************************** */
+
+typedef struct http_log_buffer_s {
+  struct http_log_buffer_s *next;
+  /* protects the buffered data (the timer might flush the buffer) */
+  spn_lock_i lock;
+  /* set while a thread owns the buffer */
+  volatile uint8_t active;
+  /* the owning thread's copy of the date */
+  time_t date_time;
+  size_t date_len;
+  char date[48];
+  size_t len;
+  char data[HTTP_LOG_BUFFER_SIZE];
+} http_log_buffer_s;
+
+static struct {
+  /* buffers are never freed, they are reused once their thread exits */
+  http_log_buffer_s *buffers;
+  spn_lock_i lock;
+  pthread_key_t key;
+  /* set once the flushing timer was started (per process) */
+  uint8_t timer;
+} http_log_data = {.lock = SPN_LOCK_INIT};
+
+static __thread http_log_buffer_s *http_log_local;
+static pthread_once_t http_log_once = PTHREAD_ONCE_INIT;
+
+static void http_log_write(const char *data, size_t len) {
+  while (len) {
+    ssize_t written = write(STDERR_FILENO, data, len);
+    if (written <= 0) {
+      if (written < 0 && errno == EINTR)
+        continue;
+      return;
+    }
+    data += written;
+    len -= written;
+  }
+}
+
+/* writes the buffered lines, the buffer must be locked */
+static inline void http_log_flush_unsafe(http_log_buffer_s *buf) {
+  http_log_write(buf->data, buf->len);
+  buf->len = 0;
+}
+
+static void http_log_flush_all(void) {
+  spn_lock(&http_log_data.lock);
+  http_log_buffer_s *buf = http_log_data.buffers;
+  spn_unlock(&http_log_data.lock);
+  for (; buf; buf = buf->next) {
+    if (!buf->len)
+      continue;
+    spn_lock(&buf->lock);
+    http_log_flush_unsafe(buf);
+    spn_unlock(&buf->lock);
+  }
+}
+
+static void http_log_flush_task(void *arg) {
+  http_log_flush_all();
+  (void)arg;
+}
+
+/* the timer stops when the server stops, it's restarted by the next request */
+static void http_log_on_timer_finish(void *arg) {
+  http_log_data.timer = 0;
+  http_log_flush_all();
+  (void)arg;
+}
+
+static void http_log_on_thread_exit(void *buf_) {
+  http_log_buffer_s *buf = buf_;
+  spn_lock(&buf->lock);
+  http_log_flush_unsafe(buf);
+  spn_unlock(&buf->lock);
+  buf->active = 0;
+}
 
+/* the child process writes it's own lines, using it's own timer */
+static void http_log_on_fork(void) {
+  http_log_data.lock = SPN_LOCK_INIT;
+  http_log_data.timer = 0;
+  for (http_log_buffer_s *buf = http_log_data.buffers; buf; buf = buf->next) {
+    buf->lock = SPN_LOCK_INIT;
+    buf->len = 0;
+    /* other threads don't exist in the new process */
+    buf->active = (buf == http_log_local);
+  }
+}
+
+static void http_log_init(void) {
+  pthread_key_create(&http_log_data.key, http_log_on_thread_exit);
+  pthread_atfork(NULL, NULL, http_log_on_fork);
+  atexit(http_log_flush_all);
+}
+
+/* returns the calling thread's buffer (the slow path is once per thread). */
+static http_log_buffer_s *http_log_buffer(void) {
+  if (http_log_local && http_log_data.timer)
+    return http_log_local;
+  pthread_once(&http_log_once, http_log_init);
+  spn_lock(&http_log_data.lock);
+  if (!http_log_data.timer) {
+    http_log_data.timer = 1;
+    facil_run_every(HTTP_LOG_FLUSH_INTERVAL, 0, http_log_flush_task, NULL,
+                    http_log_on_timer_finish);
+  }
+  if (!http_log_local) {
+    http_log_buffer_s *buf;
+    for (buf = http_log_data.buffers; buf && buf->active; buf = buf->next)
+      ;
+    if (!buf) {
+      /* the system's allocator is used, since buffers are never freed */
+      buf = calloc(1, sizeof(*buf));
+      if (!buf) {
+        spn_unlock(&http_log_data.lock);
+        perror("FATAL ERROR: (http logging) couldn't allocate memory");
+        exit(errno);
+      }
+      buf->lock = SPN_LOCK_INIT;
+      buf->next = http_log_data.buffers;
+      http_log_data.buffers = buf;
+    }
+    buf->active = 1;
+    pthread_setspecific(http_log_data.key, buf);
+    http_log_local = buf;
+  }
+  spn_unlock(&http_log_data.lock);
+  return http_log_local;
+}
+
+/* copies a String, JSON escaping the data if requested. */
+static size_t http_log_write_str(char *dest, fio_cstr_s s, uint8_t json) {
+  if (!json) {
+    memcpy(dest, s.data, s.len);
+    return s.len;
+  }
+  static const char hex[] = "0123456789abcdef";
+  size_t len = 0;
+  for (size_t i = 0; i < s.len; ++i) {
+    uint8_t c = (uint8_t)s.data[i];
+    if (c == '"' || c == '\\') {
+      dest[len++] = '\\';
+      dest[len++] = c;
+    } else if (c < 0x20 || c == 0x7F) {
+      memcpy(dest + len, "\\u00", 4);
+      dest[len + 4] = hex[c >> 4];
+      dest[len + 5] = hex[c & 15];
+      len += 6;
+    } else {
+      dest[len++] = c;
+    }
+  }
+  return len;
+}
+
+/* formats a log line, returning it's length */
+static size_t http_log_format(char *dest, http_s *h, http_log_buffer_s *buf,
+                              uint8_t json) {
   intptr_t bytes_sent = fiobj_obj2num(fiobj_hash_get2(
       h->private_data.out_headers, fiobj_obj2hash(HTTP_HEADER_CONTENT_LENGTH)));
 
   struct timespec start, end;
   clock_gettime(CLOCK_REALTIME, &end);
   start = facil_last_tick();
+  intptr_t ms = ((end.tv_sec - start.tv_sec) * 1000) +
+                ((end.tv_nsec - start.tv_nsec) / 1000000);
 
-  fio_cstr_s buff = fiobj_obj2cstr(l);
+  if (buf->date_time != start.tv_sec || !buf->date_len) {
+    /* the date is cached per thread (avoiding a shared String and lock) */
+    buf->date_len = http_time2str(buf->date, start.tv_sec);
+    buf->date_time = start.tv_sec;
+  }
 
+  size_t len = 0;
+  if (json) {
+    memcpy(dest, "{\"ip\":\"", 7);
+    len = 7;
+  }
   // TODO Guess IP address from headers (forwarded) where possible
-  sock_peer_addr_s addrinfo =
-      sock_peer_addr(((http_protocol_s *)h->private_data.flag)->uuid);
-  if (addrinfo.addrlen) {
-    if (inet_ntop(
-            addrinfo.addr->sa_family,
-            addrinfo.addr->sa_family == AF_INET
-                ? (void *)&((struct sockaddr_in *)addrinfo.addr)->sin_addr
-                : (void *)&((struct sockaddr_in6 *)addrinfo.addr)->sin6_addr,
-            buff.data, 128)) {
-      buff.len = strlen(buff.data);
-    }
+  sock_peer_addr_s addrinfo = sock_peer_addr(http2protocol(h)->uuid);
+  if (addrinfo.addrlen &&
+      inet_ntop(addrinfo.addr->sa_family,
+                addrinfo.addr->sa_family == AF_INET
+                    ? (void *)&((struct sockaddr_in *)addrinfo.addr)->sin_addr
+                    : (void *)&((struct sockaddr_in6 *)addrinfo.addr)->sin6_addr,
+                dest + len, 128)) {
+    len += strlen(dest + len);
+  } else {
+    memcpy(dest + len, "[unknown]", 9);
+    len += 9;
   }
-  if (buff.len == 0) {
-    memcpy(buff.data, "[unknown]", 9);
-    buff.len = 9;
+
+  if (json) {
+    memcpy(dest + len, "\",\"time\":\"", 10);
+    len += 10;
+    memcpy(dest + len, buf->date, buf->date_len);
+    len += buf->date_len;
+    memcpy(dest + len, "\",\"method\":\"", 12);
+    len += 12;
+    len += http_log_write_str(dest + len, fiobj_obj2cstr(h->method), 1);
+    memcpy(dest + len, "\",\"path\":\"", 10);
+    len += 10;
+    len += http_log_write_str(dest + len, fiobj_obj2cstr(h->path), 1);
+    memcpy(dest + len, "\",\"version\":\"", 13);
+    len += 13;
+    len += http_log_write_str(dest + len, fiobj_obj2cstr(h->version), 1);
+    memcpy(dest + len, "\",\"status\":", 11);
+    len += 11;
+    len += fio_ltoa(dest + len, h->status, 10);
+    memcpy(dest + len, ",\"bytes\":", 9);
+    len += 9;
+    if (bytes_sent > 0) {
+      len += fio_ltoa(dest + len, bytes_sent, 10);
+    } else {
+      memcpy(dest + len, "null", 4);
+      len += 4;
+    }
+    memcpy(dest + len, ",\"ms\":", 6);
+    len += 6;
+    len += fio_ltoa(dest + len, ms, 10);
+    memcpy(dest + len, "}\n", 2);
+    return len + 2;
   }
-  memcpy(buff.data + buff.len, " - - [", 6);
-  buff.len += 6;
-  fiobj_str_resize(l, buff.len);
-  {
-    FIOBJ date;
-    spn_lock(&date_lock);
-    date = fiobj_dup(current_date);
-    spn_unlock(&date_lock);
-    fiobj_str_join(l, current_date);
-    fiobj_free(date);
-  }
-  fiobj_str_write(l, "] \"", 3);
-  fiobj_str_join(l, h->method);
-  fiobj_str_write(l, " ", 1);
-  fiobj_str_join(l, h->path);
-  fiobj_str_write(l, " ", 1);
-  fiobj_str_join(l, h->version);
-  fiobj_str_write(l, "\" ", 2);
+
+  memcpy(dest + len, " - - [", 6);
+  len += 6;
+  memcpy(dest + len, buf->date, buf->date_len);
+  len += buf->date_len;
+  memcpy(dest + len, "] \"", 3);
+  len += 3;
+  len += http_log_write_str(dest + len, fiobj_obj2cstr(h->method), 0);
+  dest[len++] = ' ';
+  len += http_log_write_str(dest + len, fiobj_obj2cstr(h->path), 0);
+  dest[len++] = ' ';
+  len += http_log_write_str(dest + len, fiobj_obj2cstr(h->version), 0);
+  memcpy(dest + len, "\" ", 2);
+  len += 2;
+  len += fio_ltoa(dest + len, h->status, 10);
   if (bytes_sent > 0) {
-    fiobj_str_join(l, fiobj_num_tmp(h->status));
-    fiobj_str_write(l, " ", 1);
-    fiobj_str_join(l, fiobj_num_tmp(bytes_sent));
-    fiobj_str_write(l, "b ", 2);
+    dest[len++] = ' ';
+    len += fio_ltoa(dest + len, bytes_sent, 10);
+    memcpy(dest + len, "b ", 2);
+    len += 2;
   } else {
-    fiobj_str_join(l, fiobj_num_tmp(h->status));
-    fiobj_str_write(l, " -- ", 4);
+    memcpy(dest + len, " -- ", 4);
+    len += 4;
   }
+  len += fio_ltoa(dest + len, ms, 10);
+  memcpy(dest + len, "ms\r\n", 4);
+  return len + 4;
+}
 
-  bytes_sent = ((end.tv_sec - start.tv_sec) * 1000) +
-               ((end.tv_nsec - start.tv_nsec) / 1000000);
-  fiobj_str_join(l, fiobj_num_tmp(bytes_sent));
-  fiobj_str_write(l, "ms\r\n", 4);
-
-  buff = fiobj_obj2cstr(l);
-  fwrite(buff.data, 1, buff.len, stderr);
-  fiobj_free(l);
+void http_write_log(http_s *h) {
+  uint8_t json = http2protocol(h)->settings->log == HTTP_LOG_JSON;
+  http_log_buffer_s *buf = http_log_buffer();
+  /* the longest possible line (JSON escaping might use 6 bytes per byte) */
+  size_t limit = 512 + ((fiobj_obj2cstr(h->method).len +
+                         fiobj_obj2cstr(h->path).len +
+                         fiobj_obj2cstr(h->version).len) *
+                        (json ? 6 : 1));
+  spn_lock(&buf->lock);
+  if (buf->len + limit > HTTP_LOG_BUFFER_SIZE)
+    http_log_flush_unsafe(buf);
+  if (limit > HTTP_LOG_BUFFER_SIZE) {
+    /* the line is too long to be buffered, write it directly */
+    char *line = malloc(limit);
+    if (line) {
+      http_log_write(line, http_log_format(line, h, buf, json));
+      free(line);
+    }
+  } else {
+    buf->len += http_log_format(buf->data + buf->len, h, buf, json);
+  }
+  spn_unlock(&buf->lock);
 }
 
 /**
@@ -2373,88 +4336,117 @@ static inline int hex2byte(uint8_t *dest, const uint8_t *source) {
   return 0;
 }
 
-ssize_t http_decode_url(char *dest, const char *url_data, size_t length) {
+/**
+ * When set, URL decoding skips runs of bytes that don't require decoding using
+ * SSE2 / AVX2 vectors (depending on the compiler's target flags).
+ */
+#ifndef HTTP_DECODE_SIMD
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define HTTP_DECODE_SIMD 1
+#else
+#define HTTP_DECODE_SIMD 0
+#endif
+#endif
+
+#if HTTP_DECODE_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#endif
+
+/*
+ * Returns the first '%' (or '+', when `plus` is set) between `pos` and `end`,
+ * or `end` if there's nothing to decode.
+ */
+static inline const char *http_decode_seek(const char *pos, const char *end,
+                                           uint8_t plus) {
+#if HTTP_DECODE_SIMD
+  uint32_t found;
+#if defined(__AVX2__)
+  {
+    const __m256i percent = _mm256_set1_epi8('%');
+    const __m256i space = _mm256_set1_epi8(plus ? '+' : '%');
+    while (pos + 32 <= end) {
+      const __m256i v = _mm256_loadu_si256((__m256i *)pos);
+      found = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+          _mm256_cmpeq_epi8(v, percent), _mm256_cmpeq_epi8(v, space)));
+      if (found)
+        return pos + __builtin_ctz(found);
+      pos += 32;
+    }
+  }
+#endif
+  const __m128i percent = _mm_set1_epi8('%');
+  const __m128i space = _mm_set1_epi8(plus ? '+' : '%');
+  while (pos + 16 <= end) {
+    const __m128i v = _mm_loadu_si128((__m128i *)pos);
+    found = (uint32_t)_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, percent), _mm_cmpeq_epi8(v, space)));
+    if (found)
+      return pos + __builtin_ctz(found);
+    pos += 16;
+  }
+#endif
+  while (pos < end && *pos != '%' && (!plus || *pos != '+'))
+    ++pos;
+  return pos;
+}
+
+/* decodes '%' (and '+' when `plus` is set), `dest` may be `url_data`. */
+static inline ssize_t http_decode(char *dest, const char *url_data,
+                                  size_t length, uint8_t plus) {
   char *pos = dest;
   const char *end = url_data + length;
-  while (url_data < end) {
+  for (;;) {
+    /* copy (or skip, when decoding in place) anything that isn't encoded */
+    const char *run = http_decode_seek(url_data, end, plus);
+    if (run != url_data) {
+      if (pos != url_data)
+        memmove(pos, url_data, run - url_data);
+      pos += run - url_data;
+      url_data = run;
+    }
+    if (url_data >= end)
+      break;
     if (*url_data == '+') {
       // decode space
       *(pos++) = ' ';
       ++url_data;
-    } else if (*url_data == '%') {
+    } else {
       // decode hex value
       // this is a percent encoded value.
-      if (hex2byte((uint8_t *)pos, (uint8_t *)&url_data[1]))
+      if (url_data + 2 >= end ||
+          hex2byte((uint8_t *)pos, (uint8_t *)&url_data[1]))
         return -1;
       pos++;
       url_data += 3;
-    } else
-      *(pos++) = *(url_data++);
+    }
   }
   *pos = 0;
   return pos - dest;
 }
 
+ssize_t http_decode_url(char *dest, const char *url_data, size_t length) {
+  return http_decode(dest, url_data, length, 1);
+}
+
 ssize_t http_decode_url_unsafe(char *dest, const char *url_data) {
-  char *pos = dest;
-  while (*url_data) {
-    if (*url_data == '+') {
-      // decode space
-      *(pos++) = ' ';
-      ++url_data;
-    } else if (*url_data == '%') {
-      // decode hex value
-      // this is a percent encoded value.
-      if (hex2byte((uint8_t *)pos, (uint8_t *)&url_data[1]))
-        return -1;
-      pos++;
-      url_data += 3;
-    } else
-      *(pos++) = *(url_data++);
-  }
-  *pos = 0;
-  return pos - dest;
+  return http_decode(dest, url_data, strlen(url_data), 1);
 }
 
 ssize_t http_decode_path(char *dest, const char *url_data, size_t length) {
-  char *pos = dest;
-  const char *end = url_data + length;
-  while (url_data < end) {
-    if (*url_data == '%') {
-      // decode hex value
-      // this is a percent encoded value.
-      if (hex2byte((uint8_t *)pos, (uint8_t *)&url_data[1]))
-        return -1;
-      pos++;
-      url_data += 3;
-    } else
-      *(pos++) = *(url_data++);
-  }
-  *pos = 0;
-  return pos - dest;
+  return http_decode(dest, url_data, length, 0);
 }
 
 ssize_t http_decode_path_unsafe(char *dest, const char *url_data) {
-  char *pos = dest;
-  while (*url_data) {
-    if (*url_data == '%') {
-      // decode hex value
-      // this is a percent encoded value.
-      if (hex2byte((uint8_t *)pos, (uint8_t *)&url_data[1]))
-        return -1;
-      pos++;
-      url_data += 3;
-    } else
-      *(pos++) = *(url_data++);
-  }
-  *pos = 0;
-  return pos - dest;
+  return http_decode(dest, url_data, strlen(url_data), 0);
 }
 
 /* *****************************************************************************
 Lookup Tables / functions
 ***************************************************************************** */
-#include "fio_hashmap.h"
 
 static fio_hash_s mime_types;
 
@@ -2467,7 +4459,7 @@ void http_mimetype_register(char *file_ext, size_t file_ext_len,
                             FIOBJ mime_type_str) {
   if (!mime_types.map)
     fio_hash_new(&mime_types);
-  uintptr_t hash = fio_siphash(file_ext, file_ext_len);
+  uintptr_t hash = fio_risky_hash(file_ext, file_ext_len);
   FIOBJ old = (FIOBJ)fio_hash_insert(&mime_types, hash, (void *)mime_type_str);
 #if DEBUG
   if (old) {
@@ -2487,7 +4479,7 @@ FIOBJ http_mimetype_find(char *file_ext, size_t file_ext_len) {
   if (!mime_types.map) {
     http_lib_init();
   }
-  uintptr_t hash = fio_siphash(file_ext, file_ext_len);
+  uintptr_t hash = fio_risky_hash(file_ext, file_ext_len);
   return fiobj_dup((FIOBJ)fio_hash_find(&mime_types, hash));
 }
 
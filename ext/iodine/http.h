@@ -8,6 +8,7 @@ Feel free to copy, use and enjoy according to the license provided.
 #define H_HTTP_H
 
 #include "facil.h"
+#include "fio_tls.h"
 
 #include <time.h>
 
@@ -40,6 +41,63 @@ Compile Time Settings
 #define HTTP_MAX_HEADER_LENGTH 8192
 #endif
 
+#ifndef HTTP_MAX_RANGES
+/** the maximum number of byte ranges per request (more are ignored) */
+#define HTTP_MAX_RANGES 16
+#endif
+
+#ifndef HTTP_FILE_CACHE_LIMIT
+/**
+ * Static files up to this size are kept in memory (together with their `etag`
+ * and `last-modified` values). Set to 0 to disable the static file cache.
+ */
+#define HTTP_FILE_CACHE_LIMIT (1024 * 64)
+#endif
+
+#ifndef HTTP_FILE_CACHE_COUNT
+/** the maximum number of paths (including missing files) kept in the cache */
+#define HTTP_FILE_CACHE_COUNT 512
+#endif
+
+#ifndef HTTP_FD_CACHE_COUNT
+/**
+ * The number of files kept open for static file responses (the least recently
+ * used files are closed). Set to 0 to open the file for every response.
+ */
+#define HTTP_FD_CACHE_COUNT 64
+#endif
+
+#ifndef HTTP_FILE_CACHE_VALIDATE
+/** the number of seconds before a cached file's `stat` is tested again */
+#define HTTP_FILE_CACHE_VALIDATE 1
+#endif
+
+#ifndef HTTP_ARENA_CHUNK
+/**
+ * the size of a request's arena, used for the data of the request's Strings
+ * (longer data is placed in additional chunks, released with the request)
+ */
+#define HTTP_ARENA_CHUNK 4096
+#endif
+
+#ifndef HTTP_LOG_BUFFER_SIZE
+/**
+ * Each thread buffers it's log lines, writing them to `stderr` once this many
+ * bytes were buffered (or every HTTP_LOG_FLUSH_INTERVAL milliseconds).
+ */
+#define HTTP_LOG_BUFFER_SIZE 16384
+#endif
+
+#ifndef HTTP_LOG_FLUSH_INTERVAL
+/** the interval (in milliseconds) in which buffered log lines are written */
+#define HTTP_LOG_FLUSH_INTERVAL 250
+#endif
+
+/** The `log` setting value for the common (text) log format. */
+#define HTTP_LOG_TEXT 1
+/** The `log` setting value for JSON log lines (a JSON object per line). */
+#define HTTP_LOG_JSON 2
+
 /** the `http_listen settings, see detils in the struct definition. */
 typedef struct http_settings_s http_settings_s;
 
@@ -62,6 +120,10 @@ typedef struct {
     uintptr_t flag;
     /** The response headers, if they weren't sent. Don't access directly. */
     FIOBJ out_headers;
+    /** The request's String data arena. Don't access directly. */
+    void *arena;
+    /** The response's body encoder (compression). Don't access directly. */
+    void *encoder;
   } private_data;
   /** a time merker indicating when the request was received. */
   struct timespec received_at;
@@ -180,6 +242,19 @@ int http_set_cookie(http_s *h, http_cookie_args_s);
  */
 int http_send_body(http_s *h, void *data, uintptr_t length);
 
+/**
+ * Sends the response headers and a FIOBJ body.
+ *
+ * **Note**: A String body is *referenced* rather than copied (large bodies are
+ * never copied), so it MUST NOT be edited after this call. The calling function
+ * retains ownership and should free it's own reference (using `fiobj_free`).
+ *
+ * Returns -1 on error and 0 on success.
+ *
+ * AFTER THIS FUNCTION IS CALLED, THE `http_s` OBJECT IS NO LONGER VALID.
+ */
+int http_send_body_fiobj(http_s *h, FIOBJ body);
+
 /**
  * Sends the response headers and the specified file (the response's body).
  *
@@ -208,6 +283,15 @@ int http_sendfile(http_s *h, int fd, uintptr_t length, uintptr_t offset);
 int http_sendfile2(http_s *h, const char *prefix, size_t prefix_len,
                    const char *encoded, size_t encoded_len);
 
+/**
+ * Removes the file at `path` from the static file caches (the file's content,
+ * details and open file descriptor), so it's read again by `http_sendfile2`.
+ *
+ * Files are re-validated periodically (see `HTTP_FILE_CACHE_VALIDATE`), this
+ * allows changes to be noticed immediately. A NULL `path` forgets all files.
+ */
+void http_file_cache_forget(const char *path, size_t path_len);
+
 /**
  * Sends an HTTP error response.
  *
@@ -223,13 +307,37 @@ int http_send_error(http_s *h, size_t error_code);
 /**
  * Sends the response headers for a header only response.
  *
+ * When streaming (see `http_stream`), completes the streamed response.
+ *
  * AFTER THIS FUNCTION IS CALLED, THE `http_s` OBJECT IS NO LONGER VALID.
  */
 void http_finish(http_s *h);
 
+/**
+ * Streams a part of the response's body, sending the response headers with the
+ * first part.
+ *
+ * If a `content-length` (or `transfer-encoding`) header was set, the data is
+ * sent as is. Otherwise, HTTP/1.1 chunked encoding is used (HTTP/1.0 clients
+ * are sent the data as is and the connection closes once the response is
+ * complete).
+ *
+ * **Note**: The data is *copied* to the HTTP stream and it's memory should be
+ * freed by the calling function.
+ *
+ * The streamed response MUST be completed by calling `http_finish`. Once the
+ * first part was sent, no other `http_send_*` function can be called.
+ *
+ * Returns -1 on error and 0 on success.
+ */
+int http_stream(http_s *h, void *data, uintptr_t length);
+
 /**
  * Pushes a data response when supported (HTTP/2 only).
  *
+ * The pushed resource's path (i.e. "/style.css") is taken from the
+ * `content-location` response header, which is removed from `h`.
+ *
  * Returns -1 on error and 0 on success.
  */
 int http_push_data(http_s *h, void *data, uintptr_t length, FIOBJ mime_type);
@@ -237,6 +345,9 @@ int http_push_data(http_s *h, void *data, uintptr_t length, FIOBJ mime_type);
 /**
  * Pushes a file response when supported (HTTP/2 only).
  *
+ * The `filename` is the pushed resource's path (i.e. "/style.css") and the
+ * file is served from the `public_folder` (which is required).
+ *
  * If `mime_type` is NULL, an attempt at automatic detection using `filename`
  * will be made.
  *
@@ -311,6 +422,14 @@ typedef struct http_settings_s {
   void (*on_response)(http_s *response);
   /** (optional) the callback to be performed when the HTTP service closes. */
   void (*on_finish)(struct http_settings_s *settings);
+  /**
+   * (optional) wraps the handling of pipelined requests.
+   *
+   * When a single read contains more than one request, the rest of the batch
+   * is handled by calling `task(arg)` from within this callback, so any costly
+   * preparation (i.e., acquiring a VM lock) is performed once per batch.
+   */
+  void (*on_pipeline)(void (*task)(void *), void *arg);
   /** Opaque user data. Facil.io will ignore this field, but you can use it. */
   void *udata;
   /**
@@ -340,6 +459,28 @@ typedef struct http_settings_s {
    * Defaults to ~ 50Mb.
    */
   size_t max_body_size;
+  /**
+   * Request bodies longer than this value (with a known content-length) are
+   * streamed instead of being fully received before `on_request` is called.
+   *
+   * `on_request` is called once the body starts to arrive and `h->body` holds
+   * the data received so far. More of the body is received (on demand) using
+   * `http_body_fetch`, so slow consumers slow down the client.
+   *
+   * Defaults to 0 (all bodies are fully received).
+   */
+  size_t stream_body;
+  /**
+   * Set to TRUE to parse `multipart/form-data` request bodies as they arrive,
+   * rather than storing the body and parsing it in `http_parse_body`.
+   *
+   * Parts that don't arrive at once (i.e., file uploads) are written to their
+   * own temporary files, so the body isn't stored (or read) twice. `h->body`
+   * is empty (FIOBJ_INVALID) and `h->params` holds the parsed parts once
+   * `on_request` is called. Takes precedence over `stream_body` (HTTP/1.x only,
+   * HTTP/2 bodies are parsed by `http_parse_body`).
+   */
+  uint8_t stream_multipart;
   /**
    * The maximum number of clients that are allowed to connect concurrently.
    *
@@ -353,6 +494,13 @@ typedef struct http_settings_s {
    *       sockets count towards a server's limit.
    */
   intptr_t max_clients;
+  /**
+   * A TLS context (see `fio_tls.h`) for HTTPS connections. HTTP/2 ("h2") and
+   * HTTP/1.1 are negotiated using ALPN.
+   *
+   * The context is owned (and freed) by the HTTP service.
+   */
+  fio_tls_s *tls;
   /** reserved for future use. */
   intptr_t reserved1;
   /** reserved for future use. */
@@ -382,10 +530,59 @@ typedef struct http_settings_s {
    * fails). Pongs are ignored.
    */
   uint8_t ws_timeout;
-  /** Logging flag - set to TRUE to log HTTP requests. */
+  /**
+   * Set to TRUE to accept the `permessage-deflate` Websocket extension (RFC
+   * 7692) when offered by the client.
+   *
+   * The extension is always negotiated with `server_no_context_takeover` and
+   * `client_no_context_takeover`, so no compression state is kept per
+   * connection and Pub/Sub messages are compressed once for all subscribers.
+   *
+   * Requires zlib (ignored when iodine is compiled without it).
+   */
+  uint8_t ws_deflate;
+  /**
+   * Compresses dynamic response bodies of at least this many bytes (gzip or
+   * brotli, as accepted by the client). Set to 0 (the default) to disable.
+   *
+   * Only textual content types are compressed and responses that already have a
+   * `content-encoding` (or `cache-control: no-transform`) are left untouched.
+   * Streamed responses are compressed as they're sent (flushed with every
+   * part), unless they have a `content-length`.
+   *
+   * Requires zlib and / or the brotli encoder (ignored when iodine is compiled
+   * without them).
+   */
+  uint32_t compress;
+  /**
+   * Logging flag - set to TRUE to log HTTP requests (HTTP_LOG_TEXT) or to
+   * HTTP_LOG_JSON for JSON log lines.
+   */
   uint8_t log;
   /** a read only flag set automatically to indicate the protocol's mode. */
   uint8_t is_client;
+  /**
+   * Opens a separate `SO_REUSEPORT` listening socket per worker process (see
+   * `facil_listen_args`).
+   */
+  uint8_t reuse_port;
+  /**
+   * Attaches a CPU affinity program to the `SO_REUSEPORT` socket group (see
+   * `facil_listen_args`).
+   */
+  uint8_t reuse_port_cpu;
+  /**
+   * Waits for the client's first data before accepting a connection
+   * (`TCP_DEFER_ACCEPT`, see `facil_listen_args`).
+   */
+  uint8_t defer_accept;
+  /** The TCP Fast Open queue length (see `facil_listen_args`). */
+  int16_t fastopen;
+  /**
+   * Hands new connections to less busy worker processes (see
+   * `facil_listen_args`).
+   */
+  uint16_t balance;
 } http_settings_s;
 
 /**
@@ -431,6 +628,53 @@ int http_connect(const char *address, struct http_settings_s);
 #define http_connect(address, ...)                                             \
   http_connect((address), (struct http_settings_s){__VA_ARGS__})
 
+/** The named arguments for the `http_request` function. */
+struct http_request_args_s {
+  /** The request method (a String). Defaults to "GET". */
+  FIOBJ method;
+  /** The request headers (a Hash with lower case String names), if any. */
+  FIOBJ headers;
+  /** The request body (a String), if any. */
+  FIOBJ body;
+  /**
+   * Called with the response, or with a NULL handle if the request failed
+   * (the host couldn't be reached or the connection was lost).
+   *
+   * The response handle is only valid during the callback.
+   */
+  void (*on_response)(http_s *response, void *udata);
+  /** Opaque user data passed along to the `on_response` callback. */
+  void *udata;
+};
+
+/**
+ * Sends an HTTP request, reusing a pooled (keep-alive) client connection.
+ *
+ * Connections are pooled per host and port. Each host gets up to
+ * `HTTP_CLIENT_POOL_LIMIT` connections. Once they are all busy, idempotent
+ * requests are pipelined (up to `HTTP_CLIENT_PIPELINE` requests per
+ * connection) and any other requests wait for a connection. Idle connections
+ * are closed by the connection timeout after `HTTP_CLIENT_IDLE_TIMEOUT`
+ * seconds.
+ *
+ * Idempotent requests are retried once if a reused connection was closed
+ * before they were answered.
+ *
+ * `url` should be a full "http://" URL, i.e.:
+ *
+ *           "http://www.example.com:8080/my_path?foo=bar"
+ *
+ * The objects in `args` are owned by the caller (they are copied).
+ *
+ * Note: TLS and `HEAD` requests aren't supported.
+ *
+ * Returns -1 on error (the `on_response` callback won't be called) and 0 on
+ * success.
+ */
+int http_request(const char *url, struct http_request_args_s args);
+#define http_request(url, ...)                                                 \
+  http_request((url), (struct http_request_args_s){__VA_ARGS__})
+
 /**
  * Returns the settings used to setup the connection.
  *
@@ -443,6 +687,23 @@ struct http_settings_s *http_settings(http_s *h);
  */
 sock_peer_addr_s http_peer_addr(http_s *h);
 
+/**
+ * Get the connection's UUID (i.e., for `sock_pending` and similar use cases).
+ */
+intptr_t http2uuid(http_s *h);
+
+/**
+ * Receives more of a streamed request body (see `stream_body`), appending the
+ * data to `h->body`. Data that was already read from `h->body` is discarded.
+ *
+ * Returns 1 if data was added, 0 once the whole body was received (or if the
+ * body isn't streamed) and -1 on error.
+ *
+ * If no data is available yet, -1 is returned and `errno` is set to `EAGAIN`.
+ * The caller should wait for the socket (see `http2uuid`) to become readable.
+ */
+int http_body_fetch(http_s *h);
+
 /**
  * Hijacks the socket away from the HTTP protocol and away from facil.io.
  *
@@ -493,6 +754,29 @@ typedef struct {
    * can be copied).
    */
   void (*on_message)(ws_s *ws, char *data, size_t size, uint8_t is_text);
+  /**
+   * The (optional) on_message_fragment callback streams incoming messages.
+   *
+   * When set, `on_message` is never called. Instead, message data is delivered
+   * as it arrives (frames that don't fit the connection's buffer are delivered
+   * in parts), with `first` and `last` marking the message's boundaries.
+   *
+   * Messages aren't buffered, so memory use is constant and `ws_max_msg_size`
+   * doesn't limit the message's length.
+   *
+   * The `permessage-deflate` extension isn't negotiated for these connections.
+   */
+  void (*on_message_fragment)(ws_s *ws, char *data, size_t size,
+                              uint8_t is_text, uint8_t first, uint8_t last);
+  /**
+   * The (optional) on_batch callback is called when the data read from the
+   * socket holds at least one complete frame. It must call `task(arg)`, which
+   * parses the data and calls `on_message` for each of the messages.
+   *
+   * This allows the messages read together to be handled within a single
+   * (language level) lock. It's ignored when streaming (`on_message_fragment`).
+   */
+  void (*on_batch)(ws_s *ws, void (*task)(void *), void *arg);
   /**
    * The (optional) on_open callback will be called once the websocket
    * connection is established and before is is registered with `facil`, so no
@@ -718,6 +1002,17 @@ int http_sse_write(http_sse_s *sse, struct http_sse_write_args);
 #define http_sse_write(sse, ...)                                               \
   http_sse_write((sse), (struct http_sse_write_args){__VA_ARGS__})
 
+/**
+ * Writes a pub/sub message to an EventSource (SSE) connection (as the event's
+ * `data`). Returns -1 on failure (0 on success).
+ *
+ * The event is encoded only once per message and shared between all the
+ * message's recipients, so the same buffer is sent to every SSE connection.
+ *
+ * This should only be called from within a pub/sub `on_message` callback.
+ */
+int http_sse_write_pubsub(http_sse_s *sse, pubsub_message_s *msg);
+
 /**
  * Get the connection's UUID (for facil_defer and similar use cases).
  */
@@ -773,6 +1068,19 @@ int http_parse_body(http_s *h);
  */
 void http_parse_query(http_s *h);
 
+/**
+ * Returns the (URL decoded) value of the named query parameter, or
+ * FIOBJ_INVALID if the query doesn't have a parameter by that name.
+ *
+ * Unless `http_parse_query` was already called, the query is searched without
+ * building the `params` Hash, so requests with long queries only pay for the
+ * parameters they read. Names are matched as is (nesting isn't resolved) and
+ * only the first value of a repeated name is returned.
+ *
+ * The returned object should be freed using `fiobj_free`.
+ */
+FIOBJ http_query_get(http_s *h, const char *name, size_t name_len);
+
 /** Parses any Cookie / Set-Cookie headers, using the `http_add2hash` scheme. */
 void http_parse_cookies(http_s *h, uint8_t is_url_encoded);
 
@@ -876,12 +1184,39 @@ HTTP General Helper functions that could be used globally
  */
 FIOBJ http_req2str(http_s *h);
 
+/**
+ * Copies the request data held by `o` (a String or a collection of Strings,
+ * i.e. `h->headers`) to memory owned by the String objects, so `o` can outlive
+ * the request (the request's String data is released with the request).
+ *
+ * The Strings are edited, so this MUST be called before `o` is shared with
+ * other threads (request data is thread-confined until then).
+ */
+void http_arena_detach(FIOBJ o);
+
 /**
  * Writes a log line to `stderr` about the request / response object.
  *
+ * Log lines are buffered per thread and written in batches (see
+ * HTTP_LOG_BUFFER_SIZE), so they might appear up to HTTP_LOG_FLUSH_INTERVAL
+ * milliseconds after the response was sent.
+ *
  * This function is called automatically if the `.log` setting is enabled.
  */
 void http_write_log(http_s *h);
+
+/**
+ * Marks the start of the application's request handling, so the time spent
+ * before the application handles a request (i.e., waiting for a global lock)
+ * is reported separately in the request latency statistics (see `fio_stats.h`).
+ *
+ * Call `http_stats_handler_end` once the application returns. Requests handled
+ * without these marks are reported as handler time.
+ */
+void http_stats_handler_start(void);
+
+/** Marks the end of the application's request handling, see above. */
+void http_stats_handler_end(void);
 /* *****************************************************************************
 HTTP Time related helper functions that could be used globally
 ***************************************************************************** */
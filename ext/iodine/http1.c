@@ -6,12 +6,14 @@ License: MIT
 
 #include "http1.h"
 #include "http1_parser.h"
+#include "http2.h"
 #include "http_internal.h"
 #include "websockets.h"
 
 // #include "fio_ary.h"
 #include "fio_base64.h"
 #include "fio_sha1.h"
+#include "fio_stats.h"
 #include "fiobj.h"
 
 #include <assert.h>
@@ -34,10 +36,26 @@ typedef struct http1pr_s {
   uintptr_t buf_len;
   uintptr_t max_header_size;
   uintptr_t header_size;
+  /** responses coalesced while handling pipelined requests. */
+  FIOBJ batch;
+  /** the parser's start time (0 once the request was parsed). */
+  uint64_t parse_mark;
+  /** the time spent parsing the request before more data was read. */
+  uint64_t parse_time;
   uint8_t close;
   uint8_t is_client;
   uint8_t stop;
-  uint8_t buf[];
+  /** 0 == not streaming, 1 == chunked encoding, 2 == raw (length known) */
+  uint8_t stream;
+  /**
+   * 0 == buffered body, 1 == streamed (handler pending),
+   * 2 == streamed (handler called), 3 == streamed body complete
+   */
+  uint8_t body_stream;
+  /** a multipart body parsed as it arrives (see `stream_multipart`). */
+  void *mime;
+  /** the read buffer (see `HTTP1_SHARED_READ_BUFFER`). */
+  uint8_t *buf;
 } http1pr_s;
 
 struct http_vtable_s HTTP1_VTABLE; /* initialized later on */
@@ -55,19 +73,131 @@ inline static void h1_reset(http1pr_s *p) { p->header_size = 0; }
 #define handle2pr(h) ((http1pr_s *)h->private_data.flag)
 
 static fio_cstr_s http1pr_status2str(uintptr_t status);
+static int http1_body_fetch(http_s *h);
+
+/* *****************************************************************************
+Pipelining - responses written while parsing are sent together
+***************************************************************************** */
+
+/** The maximum number of pipelined requests handled per `on_data` event. */
+#ifndef HTTP1_PIPELINE_LIMIT
+#define HTTP1_PIPELINE_LIMIT 64
+#endif
+
+/** Coalesced responses are sent once they exceed this length. */
+#ifndef HTTP1_PIPELINE_BUFFER
+#define HTTP1_PIPELINE_BUFFER 65536
+#endif
+
+/* the protocol currently parsing data on this thread (if any). */
+static __thread http1pr_s *http1_batch_pr;
+
+/* sends any coalesced responses. */
+static inline void http1_batch_flush(http1pr_s *p) {
+  if (p->batch) {
+    fiobj_send_free(p->p.uuid, p->batch);
+    p->batch = FIOBJ_INVALID;
+  }
+}
+
+/* sends a response packet (a String), coalescing it while parsing. */
+static inline void http1_send_packet(http1pr_s *p, FIOBJ packet) {
+  if (http1_batch_pr != p) {
+    fiobj_send_free(p->p.uuid, packet);
+    return;
+  }
+  if (!p->batch) {
+    p->batch = packet;
+  } else {
+    fiobj_str_join(p->batch, packet);
+    fiobj_free(packet);
+  }
+  if (fiobj_obj2cstr(p->batch).len >= HTTP1_PIPELINE_BUFFER)
+    http1_batch_flush(p);
+}
+
+/* *****************************************************************************
+Read Buffers - idle connections don't have to hold on to a read buffer
+***************************************************************************** */
+
+/**
+ * When true, connections read (and parse) data using a per-thread buffer and
+ * only keep a private copy of any unparsed data (a partial request, pipelined
+ * requests that weren't handled yet, etc'), so idle keep-alive connections
+ * don't hold on to a `HTTP_MAX_HEADER_LENGTH` buffer.
+ *
+ * When false, each connection allocates it's own read buffer.
+ */
+#ifndef HTTP1_SHARED_READ_BUFFER
+#define HTTP1_SHARED_READ_BUFFER 1
+#endif
+
+#if HTTP1_SHARED_READ_BUFFER
+/* the thread's read buffer and whether it's in use. */
+static __thread uint8_t http1_scratch[HTTP_MAX_HEADER_LENGTH];
+static __thread uint8_t http1_scratch_busy;
+
+/* sets up the read buffer (`p->buf`), holding any unparsed data. */
+static void http1_buffer_acquire(http1pr_s *p) {
+  uint8_t *buf;
+  if (!http1_scratch_busy) {
+    http1_scratch_busy = 1;
+    buf = http1_scratch;
+  } else {
+    /* nested parsing (a handler is performing other connections' tasks) */
+    buf = malloc(HTTP_MAX_HEADER_LENGTH);
+    HTTP_ASSERT(buf, "HTTP/1.1 read buffer allocation failed");
+  }
+  if (p->buf) {
+    memcpy(buf, p->buf, p->buf_len);
+    free(p->buf);
+  }
+  p->buf = buf;
+}
+
+/* releases the read buffer, keeping a private copy of any unparsed data. */
+static void http1_buffer_release(http1pr_s *p) {
+  uint8_t *buf = p->buf;
+  p->buf = NULL;
+  if (p->buf_len) {
+    p->buf = malloc(p->buf_len);
+    HTTP_ASSERT(p->buf, "HTTP/1.1 read buffer allocation failed");
+    memcpy(p->buf, buf, p->buf_len);
+  }
+  if (buf == http1_scratch)
+    http1_scratch_busy = 0;
+  else
+    free(buf);
+}
+#else
+#define http1_buffer_acquire(p) ((void)(p))
+#define http1_buffer_release(p) ((void)(p))
+#endif
 
 /* cleanup an HTTP/1.1 handler object */
 static inline void http1_after_finish(http_s *h) {
   http1pr_s *p = handle2pr(h);
   p->stop = p->stop & (~1UL);
+  if (p->body_stream == 2) {
+    /* the rest of the body wasn't read, the connection can't be reused */
+    p->close = 1;
+  }
+  p->body_stream = 0;
+  if (p->mime) {
+    /* the request ended before the body was complete */
+    http_mime_stream_free(p->mime);
+    p->mime = NULL;
+  }
   if (h != &p->request) {
     http_s_destroy(h, 0);
     fio_free(h);
   } else {
     http_s_clear(h, p->p.settings->log);
   }
-  if (p->close)
+  if (p->close) {
+    http1_batch_flush(p);
     sock_close(p->p.uuid);
+  }
 }
 
 /* *****************************************************************************
@@ -77,6 +207,7 @@ struct header_writer_s {
   FIOBJ dest;
   FIOBJ name;
   FIOBJ value;
+  FIOBJ skip; /* the date value, when written using the header template */
 };
 
 static int write_header(FIOBJ o, void *w_) {
@@ -90,19 +221,95 @@ static int write_header(FIOBJ o, void *w_) {
     fiobj_each1(o, 0, write_header, w);
     return 0;
   }
+  if (o == w->skip &&
+      (w->name == HTTP_HEADER_DATE || w->name == HTTP_HEADER_LAST_MODIFIED))
+    return 0;
   fio_cstr_s name = fiobj_obj2cstr(w->name);
   fio_cstr_s str = fiobj_obj2cstr(o);
   if (!str.data)
     return 0;
-  fiobj_str_capa_assert(w->dest,
-                        fiobj_obj2cstr(w->dest).len + name.len + str.len + 5);
-  fiobj_str_write(w->dest, name.data, name.len);
-  fiobj_str_write(w->dest, ":", 1);
-  fiobj_str_write(w->dest, str.data, str.len);
-  fiobj_str_write(w->dest, "\r\n", 2);
+  /* reserve once and copy the header line directly */
+  const size_t org_len = fiobj_obj2cstr(w->dest).len;
+  fiobj_str_capa_assert(w->dest, org_len + name.len + str.len + 3);
+  char *pos = fiobj_obj2cstr(w->dest).data + org_len;
+  memcpy(pos, name.data, name.len);
+  pos += name.len;
+  *(pos++) = ':';
+  memcpy(pos, str.data, str.len);
+  pos += str.len;
+  *(pos++) = '\r';
+  *(pos++) = '\n';
+  fiobj_str_resize(w->dest, org_len + name.len + str.len + 3);
   return 0;
 }
 
+/* *****************************************************************************
+Response header templates
+
+Most responses share the same status line, `connection` header and the
+library's `date` / `last-modified` values (which change once a second), so
+these are kept pre-rendered per thread and copied as a single block.
+***************************************************************************** */
+
+/** The maximum date value length cached by the header template. */
+#define HTTP1_TEMPLATE_DATE_LIMIT 48
+
+typedef struct {
+  uintptr_t status;
+  uint8_t connection;    /* 0 == none, 1 == keep-alive, 2 == close */
+  uint8_t last_modified; /* `last-modified` shares the `date` value */
+  uint8_t date_len;
+  uint16_t len;
+  char date[HTTP1_TEMPLATE_DATE_LIMIT];
+  char data[256];
+} http1_header_template_s;
+
+static __thread http1_header_template_s http1_header_template;
+
+#define HTTP1_TEMPLATE_WRITE(t, str, str_len)                                  \
+  do {                                                                         \
+    memcpy((t)->data + (t)->len, (str), (str_len));                            \
+    (t)->len += (str_len);                                                     \
+  } while (0)
+
+/* writes the (cached) status line, connection and date headers. */
+static void http1_write_template(FIOBJ dest, uintptr_t status,
+                                 uint8_t connection, fio_cstr_s date,
+                                 uint8_t last_modified) {
+  http1_header_template_s *t = &http1_header_template;
+  if (t->len && t->status == status && t->connection == connection &&
+      t->last_modified == last_modified && t->date_len == date.len &&
+      !memcmp(t->date, date.data, date.len))
+    goto write;
+  /* rebuild the template */
+  fio_cstr_s line = http1pr_status2str(status);
+  t->status = status;
+  t->connection = connection;
+  t->last_modified = last_modified;
+  t->date_len = date.len;
+  memcpy(t->date, date.data, date.len);
+  t->len = 0;
+  HTTP1_TEMPLATE_WRITE(t, line.data, line.len);
+  if (connection == 1)
+    HTTP1_TEMPLATE_WRITE(t, "connection:keep-alive\r\n", 23);
+  else if (connection == 2)
+    HTTP1_TEMPLATE_WRITE(t, "connection:close\r\n", 18);
+  if (date.len) {
+    HTTP1_TEMPLATE_WRITE(t, "date:", 5);
+    HTTP1_TEMPLATE_WRITE(t, date.data, date.len);
+    HTTP1_TEMPLATE_WRITE(t, "\r\n", 2);
+    if (last_modified) {
+      HTTP1_TEMPLATE_WRITE(t, "last-modified:", 14);
+      HTTP1_TEMPLATE_WRITE(t, date.data, date.len);
+      HTTP1_TEMPLATE_WRITE(t, "\r\n", 2);
+    }
+  }
+write:
+  fiobj_str_write(dest, t->data, t->len);
+}
+
+#undef HTTP1_TEMPLATE_WRITE
+
 static FIOBJ headers2str(http_s *h, uintptr_t padding) {
   if (!h->method && !!h->status_str)
     return FIOBJ_INVALID;
@@ -112,6 +319,7 @@ static FIOBJ headers2str(http_s *h, uintptr_t padding) {
     connection_hash = fio_siphash("connection", 10);
 
   struct header_writer_s w;
+  w.skip = FIOBJ_INVALID;
   {
     const uintptr_t header_length_guess =
         fiobj_hash_count(h->private_data.out_headers) * 48;
@@ -120,9 +328,9 @@ static FIOBJ headers2str(http_s *h, uintptr_t padding) {
   http1pr_s *p = handle2pr(h);
 
   if (p->is_client == 0) {
-    fio_cstr_s t = http1pr_status2str(h->status);
-    fiobj_str_write(w.dest, t.data, t.length);
+    uint8_t connection = 0;
     FIOBJ tmp = fiobj_hash_get2(h->private_data.out_headers, connection_hash);
+    fio_cstr_s t;
     if (tmp) {
       t = fiobj_obj2cstr(tmp);
       if (t.data[0] == 'c' || t.data[0] == 'C')
@@ -132,22 +340,37 @@ static FIOBJ headers2str(http_s *h, uintptr_t padding) {
       if (tmp) {
         t = fiobj_obj2cstr(tmp);
         if (!t.data || !t.len || t.data[0] == 'k' || t.data[0] == 'K')
-          fiobj_str_write(w.dest, "connection:keep-alive\r\n", 23);
+          connection = 1;
         else {
-          fiobj_str_write(w.dest, "connection:close\r\n", 18);
+          connection = 2;
           p->close = 1;
         }
       } else {
         t = fiobj_obj2cstr(h->version);
         if (!p->close && t.len > 7 && t.data && t.data[5] == '1' &&
             t.data[6] == '.' && t.data[7] == '1')
-          fiobj_str_write(w.dest, "connection:keep-alive\r\n", 23);
+          connection = 1;
         else {
-          fiobj_str_write(w.dest, "connection:close\r\n", 18);
+          connection = 2;
           p->close = 1;
         }
       }
     }
+    /* the date value is usually shared with `last-modified` */
+    fio_cstr_s date = {.data = NULL};
+    uint8_t last_modified = 0;
+    tmp = fiobj_hash_get2(h->private_data.out_headers,
+                          fiobj_obj2hash(HTTP_HEADER_DATE));
+    if (FIOBJ_TYPE_IS(tmp, FIOBJ_T_STRING) &&
+        (date = fiobj_obj2cstr(tmp)).len < HTTP1_TEMPLATE_DATE_LIMIT) {
+      w.skip = tmp;
+      last_modified =
+          (fiobj_hash_get2(h->private_data.out_headers,
+                           fiobj_obj2hash(HTTP_HEADER_LAST_MODIFIED)) == tmp);
+    } else {
+      date = (fio_cstr_s){.data = NULL};
+    }
+    http1_write_template(w.dest, h->status, connection, date, last_modified);
   } else {
     if (h->method) {
       fiobj_str_join(w.dest, h->method);
@@ -190,7 +413,31 @@ static int http1_send_body(http_s *h, void *data, uintptr_t length) {
     return -1;
   }
   fiobj_str_write(packet, data, length);
-  fiobj_send_free((handle2pr(h)->p.uuid), packet);
+  http1_send_packet(handle2pr(h), packet);
+  http1_after_finish(h);
+  return 0;
+}
+/**
+ * Bodies shorter than this are copied to the header's packet, larger bodies are
+ * sent without copying them (see `sock_write_fiobj`).
+ */
+#ifndef HTTP1_BODY_COPY_LIMIT
+#define HTTP1_BODY_COPY_LIMIT 4096
+#endif
+
+/** Should send existing headers and a String body */
+static int http1_send_body_fiobj(http_s *h, FIOBJ body) {
+  fio_cstr_s s = fiobj_obj2cstr(body);
+  if (s.length < HTTP1_BODY_COPY_LIMIT)
+    return http1_send_body(h, s.data, s.length);
+  FIOBJ packet = headers2str(h, 0);
+  if (!packet) {
+    http1_after_finish(h);
+    return -1;
+  }
+  http1_send_packet(handle2pr(h), packet);
+  http1_batch_flush(handle2pr(h));
+  sock_write_fiobj((handle2pr(h)->p.uuid), body);
   http1_after_finish(h);
   return 0;
 }
@@ -211,27 +458,172 @@ static int http1_sendfile(http_s *h, int fd, uintptr_t length,
     intptr_t i = pread(fd, s.data + s.len, length, offset);
     if (i < 0) {
       close(fd);
-      fiobj_send_free((handle2pr(h)->p.uuid), packet);
+      http1_send_packet(handle2pr(h), packet);
+      http1_batch_flush(handle2pr(h));
       sock_close((handle2pr(h)->p.uuid));
       return -1;
     }
     close(fd);
     fiobj_str_resize(packet, s.len + i);
-    fiobj_send_free((handle2pr(h)->p.uuid), packet);
+    http1_send_packet(handle2pr(h), packet);
     http1_after_finish(h);
     return 0;
   }
-  fiobj_send_free((handle2pr(h)->p.uuid), packet);
+  http1_send_packet(handle2pr(h), packet);
+  http1_batch_flush(handle2pr(h));
   sock_sendfile((handle2pr(h)->p.uuid), fd, offset, length);
   http1_after_finish(h);
   return 0;
 }
 
+/** Should send existing headers and a shared file (releasing `fd`) */
+static int http1_sendfile_fd(http_s *h, http_fd_s *fd, uintptr_t length,
+                             uintptr_t offset) {
+  FIOBJ packet = headers2str(h, 0);
+  if (!packet) {
+    http_fd_release(fd);
+    http1_after_finish(h);
+    return -1;
+  }
+  if (length < HTTP_MAX_HEADER_LENGTH) {
+    /* optimize away small files */
+    fio_cstr_s s = fiobj_obj2cstr(packet);
+    fiobj_str_capa_assert(packet, s.len + length);
+    s = fiobj_obj2cstr(packet);
+    intptr_t i = pread(fd->fd, s.data + s.len, length, offset);
+    http_fd_release(fd);
+    if (i < 0) {
+      http1_send_packet(handle2pr(h), packet);
+      http1_batch_flush(handle2pr(h));
+      sock_close((handle2pr(h)->p.uuid));
+      return -1;
+    }
+    fiobj_str_resize(packet, s.len + i);
+    http1_send_packet(handle2pr(h), packet);
+    http1_after_finish(h);
+    return 0;
+  }
+  http1_send_packet(handle2pr(h), packet);
+  http1_batch_flush(handle2pr(h));
+  sock_write2(.uuid = handle2pr(h)->p.uuid, .buffer = fd, .length = length,
+              .offset = offset, .is_pfd = 1, .dealloc = http_fd_release);
+  http1_after_finish(h);
+  return 0;
+}
+
+/** Should send existing headers and file parts (multipart/byteranges) */
+static int http1_sendfile_parts(http_s *h, http_fd_s *fd,
+                                http_file_part_s *parts, size_t count,
+                                FIOBJ tail) {
+  http1pr_s *p = handle2pr(h);
+  FIOBJ packet = headers2str(h, 0);
+  if (!packet) {
+    http_fd_release(fd);
+    for (size_t i = 0; i < count; ++i)
+      fiobj_free(parts[i].head);
+    fiobj_free(tail);
+    http1_after_finish(h);
+    return -1;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    fiobj_str_join(packet, parts[i].head);
+    fiobj_free(parts[i].head);
+    if (parts[i].length < HTTP_MAX_HEADER_LENGTH) {
+      /* optimize away small parts */
+      fio_cstr_s s = fiobj_obj2cstr(packet);
+      fiobj_str_capa_assert(packet, s.len + parts[i].length);
+      s = fiobj_obj2cstr(packet);
+      intptr_t r =
+          pread(fd->fd, s.data + s.len, parts[i].length, parts[i].offset);
+      if (r < 0)
+        r = 0;
+      fiobj_str_resize(packet, s.len + r);
+      continue;
+    }
+    http1_send_packet(p, packet);
+    http1_batch_flush(p);
+    /* every packet holds a reference to the file */
+    sock_write2(.uuid = p->p.uuid, .buffer = http_fd_dup(fd),
+                .length = parts[i].length, .offset = parts[i].offset,
+                .is_pfd = 1, .dealloc = http_fd_release);
+    packet = fiobj_str_buf(HTTP_MAX_HEADER_LENGTH);
+  }
+  http_fd_release(fd);
+  fiobj_str_join(packet, tail);
+  fiobj_free(tail);
+  http1_send_packet(p, packet);
+  http1_after_finish(h);
+  return 0;
+}
+
+/* writes a part of the body (a chunk, when using chunked encoding). */
+static void http1_stream_write(FIOBJ dest, uint8_t chunked, void *data,
+                               uintptr_t length) {
+  if (chunked) {
+    char len[24];
+    size_t i = fio_ltoa(len, length, 16);
+    len[i++] = '\r';
+    len[i++] = '\n';
+    fiobj_str_write(dest, len, i);
+  }
+  fiobj_str_write(dest, data, length);
+  if (chunked)
+    fiobj_str_write(dest, "\r\n", 2);
+}
+
+/** Should send existing headers and data and prepare for streaming */
+static int http1_stream(http_s *h, void *data, uintptr_t length) {
+  http1pr_s *p = handle2pr(h);
+  if (p->stream) {
+    if (!length)
+      return 0; /* an empty chunk would end the response */
+    FIOBJ packet = fiobj_str_buf(length + 24);
+    http1_stream_write(packet, p->stream == 1, data, length);
+    return fiobj_send_free(p->p.uuid, packet);
+  }
+  static uint64_t te_hash = 0;
+  if (!te_hash)
+    te_hash = fiobj_obj2hash(HTTP_HEADER_TRANSFER_ENCODING);
+  fio_cstr_s v = fiobj_obj2cstr(h->version);
+  if (fiobj_hash_get2(h->private_data.out_headers,
+                      fiobj_obj2hash(HTTP_HEADER_CONTENT_LENGTH)) ||
+      fiobj_hash_get2(h->private_data.out_headers, te_hash)) {
+    p->stream = 2;
+  } else if (p->is_client || (v.len > 7 && v.data[5] == '1' &&
+                              v.data[6] == '.' && v.data[7] == '1')) {
+    http_set_header(h, HTTP_HEADER_TRANSFER_ENCODING,
+                    fiobj_dup(HTTP_HVALUE_CHUNKED));
+    p->stream = 1;
+  } else {
+    /* HTTP/1.0 - the end of the response is marked by closing the connection */
+    http_set_header(h, HTTP_HEADER_CONNECTION, fiobj_dup(HTTP_HVALUE_CLOSE));
+    p->stream = 2;
+  }
+  FIOBJ packet = headers2str(h, length + 24);
+  if (!packet) {
+    p->stream = 0;
+    return -1;
+  }
+  if (length)
+    http1_stream_write(packet, p->stream == 1, data, length);
+  http1_send_packet(p, packet);
+  http1_batch_flush(p);
+  return 0;
+}
+
 /** Should send existing headers or complete streaming */
 static void htt1p_finish(http_s *h) {
+  http1pr_s *p = handle2pr(h);
+  if (p->stream) {
+    if (p->stream == 1)
+      fiobj_send_free(p->p.uuid, fiobj_str_new("0\r\n\r\n", 5));
+    p->stream = 0;
+    http1_after_finish(h);
+    return;
+  }
   FIOBJ packet = headers2str(h, 0);
   if (packet)
-    fiobj_send_free((handle2pr(h)->p.uuid), packet);
+    http1_send_packet(handle2pr(h), packet);
   else {
     // fprintf(stderr, "WARNING: invalid call to `htt1p_finish`\n");
   }
@@ -307,7 +699,7 @@ static void http1_websocket_client_on_upgrade(http_s *h, char *proto,
   http_finish(args->http);
   p->stop = 1;
   websocket_attach(uuid, set, args, p->parser.state.next,
-                   p->buf_len - (intptr_t)(p->parser.state.next - p->buf));
+                   p->buf_len - (intptr_t)(p->parser.state.next - p->buf), 0);
   fio_free(args);
   (void)proto;
   (void)len;
@@ -363,14 +755,26 @@ static int http1_http2websocket_server(websocket_settings_s *args) {
   http_set_header(args->http, HTTP_HEADER_UPGRADE,
                   fiobj_dup(HTTP_HVALUE_WEBSOCKET));
   http_set_header(args->http, HTTP_HEADER_WS_SEC_KEY, tmp);
-  args->http->status = 101;
   http1pr_s *pr = handle2pr(args->http);
   const intptr_t uuid = handle2pr(args->http)->p.uuid;
   http_settings_s *set = handle2pr(args->http)->p.settings;
+  uint8_t deflate = 0;
+  if (set->ws_deflate && !args->on_message_fragment) {
+    tmp = fiobj_hash_get2(args->http->headers,
+                          fiobj_obj2hash(HTTP_HEADER_WS_EXTENSIONS));
+    if (tmp && websocket_deflate_accept(tmp)) {
+      http_set_header(args->http, HTTP_HEADER_WS_EXTENSIONS,
+                      fiobj_dup(HTTP_HVALUE_WS_DEFLATE));
+      deflate = 1;
+    }
+  }
+  args->http->status = 101;
   http_finish(args->http);
   pr->stop = 1;
+  http1_batch_flush(pr); /* the response must preceed any Websocket data */
   websocket_attach(uuid, set, args, pr->parser.state.next,
-                   pr->buf_len - (intptr_t)(pr->parser.state.next - pr->buf));
+                   pr->buf_len - (intptr_t)(pr->parser.state.next - pr->buf),
+                   deflate);
   return 0;
 bad_request:
   http_send_error(args->http, 400);
@@ -484,7 +888,9 @@ static int http1_upgrade2sse(http_s *h, http_sse_s *sse) {
   http_set_header(h, HTTP_HEADER_CONTENT_ENCODING,
                   fiobj_str_new("identity", 8));
   handle2pr(h)->stop = 1;
+  http1pr_s *pr = handle2pr(h);
   htt1p_finish(h); /* avoid the enforced content length in http_finish */
+  http1_batch_flush(pr); /* the response must preceed any SSE data */
 
   /* switch protocol to SSE */
   http1_sse_protocol_s *sse_pr = malloc(sizeof(*sse_pr));
@@ -546,7 +952,12 @@ Virtual Table Decleration
 
 struct http_vtable_s HTTP1_VTABLE = {
     .http_send_body = http1_send_body,
+    .http_send_body_fiobj = http1_send_body_fiobj,
     .http_sendfile = http1_sendfile,
+    .http_sendfile_fd = http1_sendfile_fd,
+    .http_sendfile_parts = http1_sendfile_parts,
+    .http_stream = http1_stream,
+    .http_body_fetch = http1_body_fetch,
     .http_finish = htt1p_finish,
     .http_push_data = http1_push_data,
     .http_push_file = http1_push_file,
@@ -565,9 +976,103 @@ void *http1_vtable(void) { return (void *)&HTTP1_VTABLE; }
 Parser Callbacks
 ***************************************************************************** */
 
+/* *****************************************************************************
+HTTP/2 Upgrading (h2c)
+***************************************************************************** */
+
+/**
+ * Switches the connection to HTTP/2 when the request is an `Upgrade: h2c`
+ * request (RFC 7540, 3.2). The request is handled by the HTTP/2 protocol.
+ *
+ * Returns -1 if the connection wasn't upgraded.
+ */
+static int http1_upgrade2h2c(http1pr_s *p) {
+  static uint64_t settings_hash = 0;
+  if (!settings_hash)
+    settings_hash = fio_siphash("http2-settings", 14);
+  if (p->is_client)
+    return -1;
+  FIOBJ tmp = fiobj_hash_get2(p->request.headers,
+                              fiobj_obj2hash(HTTP_HEADER_UPGRADE));
+  if (!FIOBJ_TYPE_IS(tmp, FIOBJ_T_STRING))
+    return -1;
+  fio_cstr_s val = fiobj_obj2cstr(tmp);
+  if (val.len != 3 || (val.data[0] | 32) != 'h' || val.data[1] != '2' ||
+      (val.data[2] | 32) != 'c')
+    return -1;
+  tmp = fiobj_hash_get2(p->request.headers, settings_hash);
+  if (!FIOBJ_TYPE_IS(tmp, FIOBJ_T_STRING))
+    return -1;
+  /* the HTTP2-Settings header is base64url encoded (without padding) */
+  val = fiobj_obj2cstr(tmp);
+  char *h2settings = fio_malloc(val.len + 4);
+  HTTP_ASSERT(h2settings, "HTTP/1.1 allocation failed");
+  size_t len = 0;
+  for (; len < val.len; ++len) {
+    switch (val.data[len]) {
+    case '-':
+      h2settings[len] = '+';
+      break;
+    case '_':
+      h2settings[len] = '/';
+      break;
+    default:
+      h2settings[len] = val.data[len];
+    }
+  }
+  while (len & 3)
+    h2settings[len++] = '=';
+  len = len ? fio_base64_decode(NULL, h2settings, (int)len) : 0;
+
+  static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                  "connection:upgrade\r\n"
+                                  "upgrade:h2c\r\n\r\n";
+  http1_send_packet(p, fiobj_str_new(switching, sizeof(switching) - 1));
+  http1_batch_flush(p);
+  p->stop = 1;
+  /* the request's data is moved to the HTTP/2 protocol */
+  if (!http2_upgrade(p->p.uuid, p->p.settings, &p->request, h2settings, len,
+                     p->parser.state.next,
+                     p->buf_len - (intptr_t)(p->parser.state.next - p->buf))) {
+    http1_pr2handle(p).status = 0;
+    http_s_destroy(&p->request, 0);
+    sock_close(p->p.uuid);
+  }
+  http_s_new(&p->request, &p->p, &HTTP1_VTABLE);
+  fio_free(h2settings);
+  return 0;
+}
+
+/* records the time spent parsing the request. */
+static inline void http1_stats_parsed(http1pr_s *p) {
+  if (p->parse_mark)
+    p->parse_time += fio_stats_now() - p->parse_mark;
+  fio_stats_record(FIO_STATS_HTTP_PARSE, p->parse_time);
+  p->parse_mark = p->parse_time = 0;
+}
+
 /** called when a request was received. */
 static int http1_on_request(http1_parser_s *parser) {
   http1pr_s *p = parser2http(parser);
+  if (p->body_stream == 2) {
+    /* the handler is already running, the streamed body is complete */
+    p->body_stream = 3;
+    h1_reset(p);
+    return 0;
+  }
+  p->body_stream = 0;
+  if (p->mime) {
+    int failed = http_mime_stream_finish(p->mime);
+    p->mime = NULL;
+    if (failed) {
+      http_send_error(&http1_pr2handle(p), 400);
+      h1_reset(p);
+      return 0;
+    }
+  }
+  http1_stats_parsed(p);
+  if (!http1_upgrade2h2c(p))
+    return 0;
   http_on_request_handler______internal(&http1_pr2handle(p), p->p.settings);
   if (p->request.method && !p->stop)
     http_finish(&p->request);
@@ -605,14 +1110,16 @@ static int http1_on_status(http1_parser_s *parser, size_t status,
 
 /** called when a request path (excluding query) is parsed. */
 static int http1_on_path(http1_parser_s *parser, char *path, size_t len) {
-  http1_pr2handle(parser2http(parser)).path = fiobj_str_new(path, len);
+  http1_pr2handle(parser2http(parser)).path =
+      http_arena_str(&http1_pr2handle(parser2http(parser)), path, len, 0);
   parser2http(parser)->header_size += len;
   return 0;
 }
 
 /** called when a request path (excluding query) is parsed. */
 static int http1_on_query(http1_parser_s *parser, char *query, size_t len) {
-  http1_pr2handle(parser2http(parser)).query = fiobj_str_new(query, len);
+  http1_pr2handle(parser2http(parser)).query =
+      http_arena_str(&http1_pr2handle(parser2http(parser)), query, len, 0);
   parser2http(parser)->header_size += len;
   return 0;
 }
@@ -649,8 +1156,15 @@ static int http1_on_header(http1_parser_s *parser, char *name, size_t name_len,
     http_send_error(&http1_pr2handle(parser2http(parser)), 413);
     return -1;
   }
-  sym = fiobj_str_new(name, name_len);
-  obj = fiobj_str_new(data, data_len);
+  obj = http_arena_str(&http1_pr2handle(parser2http(parser)), data, data_len,
+                       0);
+  sym = http_header_name_find(name, name_len);
+  if (sym) {
+    /* common header names are shared (and already hashed) */
+    set_header_add(http1_pr2handle(parser2http(parser)).headers, sym, obj);
+    return 0;
+  }
+  sym = fiobj_str_intern(name, name_len);
   set_header_add(http1_pr2handle(parser2http(parser)).headers, sym, obj);
   fiobj_free(sym);
   return 0;
@@ -666,13 +1180,33 @@ static int http1_on_body_chunk(http1_parser_s *parser, char *data,
     return -1; /* test every time, in case of chunked data */
   }
   if (!parser->state.read) {
-    if (parser->state.content_length > 0 &&
-        parser->state.content_length <= HTTP_MAX_HEADER_LENGTH) {
+    if (parser2http(parser)->p.settings->stream_multipart &&
+        !parser2http(parser)->is_client &&
+        (parser2http(parser)->mime =
+             http_mime_stream_new(&http1_pr2handle(parser2http(parser))))) {
+      /* the parts are placed in `params`, the body isn't stored */
+    } else if (parser->state.content_length > 0 &&
+               parser->state.content_length <= HTTP_MAX_HEADER_LENGTH) {
       http1_pr2handle(parser2http(parser)).body = fiobj_data_newstr();
+    } else if (parser->state.content_length > 0 &&
+               parser2http(parser)->p.settings->stream_body &&
+               (size_t)parser->state.content_length >
+                   parser2http(parser)->p.settings->stream_body &&
+               !parser2http(parser)->is_client) {
+      /* the handler is called once the parser returns */
+      http1_pr2handle(parser2http(parser)).body = fiobj_data_newstr();
+      parser2http(parser)->body_stream = 1;
     } else {
       http1_pr2handle(parser2http(parser)).body = fiobj_data_newtmpfile();
     }
   }
+  if (parser2http(parser)->mime) {
+    if (http_mime_stream_write(parser2http(parser)->mime, data, data_len)) {
+      http_send_error(&http1_pr2handle(parser2http(parser)), 400);
+      return -1;
+    }
+    return 0;
+  }
   fiobj_data_write(http1_pr2handle(parser2http(parser)).body, data, data_len);
   return 0;
 }
@@ -696,28 +1230,80 @@ Connection Callbacks
  */
 static const char *HTTP1_SERVICE_STR = "http1_protocol_facil_io";
 
+typedef struct {
+  http1pr_s *p;
+  size_t org_len;
+  int pipeline_limit;
+} http1_consume_s;
+
+/* runs the parser on the data and returns the number of bytes consumed. */
+static inline size_t http1_parse(http1pr_s *p, uint8_t *data, size_t len) {
+  return http1_fio_parser(
+      .parser = &p->parser, .buffer = data, .length = len,
+      .on_request = http1_on_request, .on_response = http1_on_response,
+      .on_method = http1_on_method, .on_status = http1_on_status,
+      .on_path = http1_on_path, .on_query = http1_on_query,
+      .on_http_version = http1_on_http_version, .on_header = http1_on_header,
+      .on_body_chunk = http1_on_body_chunk, .on_error = http1_on_error);
+}
+
+/* calls the handler for a request with a streamed body (see `stream_body`). */
+static void http1_on_streamed_request(http1_consume_s *c) {
+  http1pr_s *p = c->p;
+  /* the parser consumed all the data, so `http1_body_fetch` can use `buf` */
+  c->org_len = p->buf_len = 0;
+  p->body_stream = 2;
+  http1_stats_parsed(p);
+  http_on_request_handler______internal(&p->request, p->p.settings);
+  if (p->request.method && !p->stop)
+    http_finish(&p->request);
+  h1_reset(p);
+  /* pipelined data read by `http1_body_fetch` starts at the buffer's head */
+  c->org_len = p->buf_len;
+}
+
+/* parses a single request (or response). Returns 1 if more might follow. */
+static inline int http1_consume_one(http1_consume_s *c) {
+  http1pr_s *p = c->p;
+  p->parse_mark = fio_stats_now();
+  ssize_t i = http1_parse(p, p->buf + (c->org_len - p->buf_len), p->buf_len);
+  if (p->parse_mark) {
+    /* the request is incomplete (or streamed), parsing continues later */
+    p->parse_time += fio_stats_now() - p->parse_mark;
+    p->parse_mark = 0;
+  }
+  p->buf_len -= i;
+  --c->pipeline_limit;
+  if (p->body_stream == 1)
+    http1_on_streamed_request(c);
+  return (i && p->buf_len && c->pipeline_limit && !p->stop);
+}
+
+/* parses the rest of a pipelined batch. */
+static void http1_consume_pipeline(void *c_) {
+  http1_consume_s *c = c_;
+  while (http1_consume_one(c))
+    ;
+}
+
 static inline void http1_consume_data(intptr_t uuid, http1pr_s *p) {
-  ssize_t i = 0;
-  size_t org_len = p->buf_len;
-  int pipeline_limit = 8;
-  do {
-    i = http1_fio_parser(.parser = &p->parser,
-                         .buffer = p->buf + (org_len - p->buf_len),
-                         .length = p->buf_len, .on_request = http1_on_request,
-                         .on_response = http1_on_response,
-                         .on_method = http1_on_method,
-                         .on_status = http1_on_status, .on_path = http1_on_path,
-                         .on_query = http1_on_query,
-                         .on_http_version = http1_on_http_version,
-                         .on_header = http1_on_header,
-                         .on_body_chunk = http1_on_body_chunk,
-                         .on_error = http1_on_error);
-    p->buf_len -= i;
-    --pipeline_limit;
-  } while (i && p->buf_len && pipeline_limit && !p->stop);
-
-  if (p->buf_len && org_len != p->buf_len) {
-    memmove(p->buf, p->buf + (org_len - p->buf_len), p->buf_len);
+  http1_consume_s c = {
+      .p = p, .org_len = p->buf_len, .pipeline_limit = HTTP1_PIPELINE_LIMIT,
+  };
+  /* handlers might perform other connections' tasks (nested parsing) */
+  http1pr_s *const prev = http1_batch_pr;
+  http1_batch_pr = p;
+  if (http1_consume_one(&c)) {
+    if (p->p.settings->on_pipeline)
+      p->p.settings->on_pipeline(http1_consume_pipeline, &c);
+    else
+      http1_consume_pipeline(&c);
+  }
+  http1_batch_pr = prev;
+  http1_batch_flush(p);
+
+  if (p->buf_len && c.org_len != p->buf_len) {
+    memmove(p->buf, p->buf + (c.org_len - p->buf_len), p->buf_len);
   }
 
   if (p->buf_len == HTTP_MAX_HEADER_LENGTH) {
@@ -730,11 +1316,39 @@ static inline void http1_consume_data(intptr_t uuid, http1pr_s *p) {
     }
   }
 
-  if (!pipeline_limit) {
+  if (!c.pipeline_limit) {
     facil_force_event(uuid, FIO_EVENT_ON_DATA);
   }
 }
 
+/** receives more of a streamed request body (see `stream_body`). */
+static int http1_body_fetch(http_s *h) {
+  http1pr_s *p = handle2pr(h);
+  if (h != &p->request || p->body_stream != 2)
+    return 0;
+  fiobj_data_discard(h->body);
+  intptr_t len = fiobj_data_len(h->body);
+  ssize_t i = sock_read(p->p.uuid, p->buf, HTTP_MAX_HEADER_LENGTH);
+  if (i < 0)
+    return -1;
+  if (i == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  p->buf_len = i;
+  i = http1_parse(p, p->buf, p->buf_len);
+  p->buf_len -= i;
+  if (p->buf_len) /* pipelined data follows the body */
+    memmove(p->buf, p->buf + i, p->buf_len);
+  if (!sock_isvalid(p->p.uuid)) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if (fiobj_data_len(h->body) > len)
+    return 1;
+  return p->body_stream == 2 ? (errno = EAGAIN, -1) : 0;
+}
+
 /** called when a data is available, but will not run concurrently */
 static void http1_on_data(intptr_t uuid, protocol_s *protocol) {
   http1pr_s *p = (http1pr_s *)protocol;
@@ -743,6 +1357,7 @@ static void http1_on_data(intptr_t uuid, protocol_s *protocol) {
     return;
   }
   ssize_t i = 0;
+  http1_buffer_acquire(p);
   if (HTTP_MAX_HEADER_LENGTH - p->buf_len)
     i = sock_read(uuid, p->buf + p->buf_len,
                   HTTP_MAX_HEADER_LENGTH - p->buf_len);
@@ -750,6 +1365,7 @@ static void http1_on_data(intptr_t uuid, protocol_s *protocol) {
     p->buf_len += i;
   }
   http1_consume_data(uuid, p);
+  http1_buffer_release(p);
 }
 
 /** called when the connection was closed, but will not run concurrently */
@@ -763,23 +1379,27 @@ static void http1_on_data_first_time(intptr_t uuid, protocol_s *protocol) {
   http1pr_s *p = (http1pr_s *)protocol;
   ssize_t i;
 
+  http1_buffer_acquire(p);
   i = sock_read(uuid, p->buf + p->buf_len, HTTP_MAX_HEADER_LENGTH - p->buf_len);
 
   if (i <= 0)
-    return;
+    goto finish;
   p->buf_len += i;
 
   /* ensure future reads skip this first time HTTP/2.0 test */
   p->p.protocol.on_data = http1_on_data;
   if (i >= 24 && !memcmp(p->buf, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24)) {
-    fprintf(stderr,
-            "ERROR: unsupported HTTP/2 attempeted using prior knowledge.\n");
-    sock_close(uuid);
-    return;
+    /* HTTP/2 using prior knowledge - the HTTP/1.1 protocol is replaced */
+    if (p->is_client || !http2_new(uuid, p->p.settings, p->buf, p->buf_len))
+      sock_close(uuid);
+    p->buf_len = 0; /* the data belongs to the HTTP/2 protocol */
+    goto finish;
   }
 
   /* Finish handling the same way as the normal `on_data` */
   http1_consume_data(uuid, p);
+finish:
+  http1_buffer_release(p);
 }
 
 /* *****************************************************************************
@@ -793,7 +1413,8 @@ protocol_s *http1_new(uintptr_t uuid, http_settings_s *settings,
                       void *unread_data, size_t unread_length) {
   if (unread_data && unread_length > HTTP_MAX_HEADER_LENGTH)
     return NULL;
-  http1pr_s *p = malloc(sizeof(*p) + HTTP_MAX_HEADER_LENGTH);
+  http1pr_s *p = malloc(sizeof(*p) +
+                       (HTTP1_SHARED_READ_BUFFER ? 0 : HTTP_MAX_HEADER_LENGTH));
   HTTP_ASSERT(p, "HTTP/1.1 protocol allocation failed");
   *p = (http1pr_s){
       .p.protocol =
@@ -806,10 +1427,15 @@ protocol_s *http1_new(uintptr_t uuid, http_settings_s *settings,
       .p.settings = settings,
       .max_header_size = settings->max_header_size,
       .is_client = settings->is_client,
+      .buf = (HTTP1_SHARED_READ_BUFFER ? NULL : (uint8_t *)(p + 1)),
   };
   http_s_new(&p->request, &p->p, &HTTP1_VTABLE);
   facil_attach(uuid, &p->p.protocol);
-  if (unread_data && unread_length <= HTTP_MAX_HEADER_LENGTH) {
+  if (unread_data && unread_length && unread_length <= HTTP_MAX_HEADER_LENGTH) {
+#if HTTP1_SHARED_READ_BUFFER
+    p->buf = malloc(unread_length);
+    HTTP_ASSERT(p->buf, "HTTP/1.1 read buffer allocation failed");
+#endif
     memcpy(p->buf, unread_data, unread_length);
     p->buf_len = unread_length;
     facil_force_event(uuid, FIO_EVENT_ON_DATA);
@@ -820,8 +1446,13 @@ protocol_s *http1_new(uintptr_t uuid, http_settings_s *settings,
 /** Manually destroys the HTTP1 protocol object. */
 void http1_destroy(protocol_s *pr) {
   http1pr_s *p = (http1pr_s *)pr;
+  fiobj_free(p->batch);
+  http_mime_stream_free(p->mime);
   http1_pr2handle(p).status = 0;
   http_s_destroy(&http1_pr2handle(p), 0);
+#if HTTP1_SHARED_READ_BUFFER
+  free(p->buf);
+#endif
   free(p);
 }
 
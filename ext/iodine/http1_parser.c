@@ -21,6 +21,26 @@ Seeking for characters in a string
 #define ALLOW_UNALIGNED_MEMORY_ACCESS 0
 #endif
 
+#ifndef HTTP1_PARSER_SIMD
+/**
+ * When set, the parser seeks tokens and converts header names to lowercase
+ * using SSE2 / AVX2 vectors (depending on the compiler's target flags).
+ */
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define HTTP1_PARSER_SIMD 1
+#else
+#define HTTP1_PARSER_SIMD 0
+#endif
+#endif
+
+#if HTTP1_PARSER_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#endif
+
 #if FIO_MEMCHAR
 
 /**
@@ -86,6 +106,69 @@ finish:
   return 0;
 }
 
+#elif HTTP1_PARSER_SIMD
+
+/* returns a bit mask of the `ch` bytes in the 16 bytes starting at `pos`. */
+#define HTTP1_SIMD_MATCH16(pos, wanted)                                        \
+  ((uint32_t)_mm_movemask_epi8(                                                \
+      _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(pos)), (wanted))))
+
+/**
+ * A vectorized version of the `memchr` based `seek2ch`, with the same
+ * semantics (a match on the first byte isn't considered a match).
+ *
+ * Header lines and request line tokens are short, so avoiding the function
+ * call and testing a whole line in one or two vector compares is faster than
+ * calling `memchr` for each token.
+ */
+inline static uint8_t seek2ch(uint8_t **pos, uint8_t *const limit, uint8_t ch) {
+  if (*pos >= limit || **pos == ch) {
+    return 0;
+  }
+  uint8_t *tmp = *pos;
+  uint32_t found;
+#if defined(__AVX2__)
+  const __m256i wanted32 = _mm256_set1_epi8((char)ch);
+  while (tmp + 32 <= limit) {
+    found = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_loadu_si256((__m256i *)tmp), wanted32));
+    if (found)
+      goto found;
+    tmp += 32;
+  }
+#endif
+  const __m128i wanted = _mm_set1_epi8((char)ch);
+  while (tmp + 16 <= limit) {
+    found = HTTP1_SIMD_MATCH16(tmp, wanted);
+    if (found)
+      goto found;
+    tmp += 16;
+  }
+  if (tmp < limit && limit - *pos >= 16) {
+    /* overlap the last vector with the bytes already tested */
+    found = HTTP1_SIMD_MATCH16(limit - 16, wanted) >> (16 - (limit - tmp));
+    if (found)
+      goto found;
+    tmp = limit;
+  }
+  while (tmp < limit) {
+    if (*tmp == ch) {
+      found = 1;
+      goto found;
+    }
+    ++tmp;
+  }
+  *pos = limit;
+  return 0;
+found:
+  tmp += __builtin_ctz(found);
+  *pos = tmp;
+#if HTTP1_PARSER_CONVERT_EOL2NUL
+  *tmp = 0;
+#endif
+  return 1;
+}
+
 #else
 
 /* a helper that seeks any char, converts it to NUL and returns 1 if found. */
@@ -122,6 +205,56 @@ inline static uint8_t seek2eol(uint8_t **pos, uint8_t *const limit) {
   return 1;
 }
 
+/* *****************************************************************************
+Header name conversion
+***************************************************************************** */
+
+#if HTTP_HEADERS_LOWERCASE
+/**
+ * Converts an ASCII header name to lowercase, in place.
+ *
+ * `readable` marks the end of the line (the vectors may read past the name,
+ * but bytes after the name are written back unchanged).
+ */
+inline static void header_name2lower(uint8_t *pos, uint8_t *const limit,
+                                     uint8_t *const readable) {
+#if HTTP1_PARSER_SIMD
+  /* (signed) bytes above 'A' - 1 and below 'Z' + 1 get the lowercase bit */
+  const __m128i before_a = _mm_set1_epi8('A' - 1);
+  const __m128i after_z = _mm_set1_epi8('Z' + 1);
+  const __m128i lower_bit = _mm_set1_epi8(32);
+  __m128i v, upper;
+  while (pos + 16 <= limit) {
+    v = _mm_loadu_si128((__m128i *)pos);
+    upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+                          _mm_cmplt_epi8(v, after_z));
+    _mm_storeu_si128((__m128i *)pos,
+                     _mm_or_si128(v, _mm_and_si128(upper, lower_bit)));
+    pos += 16;
+  }
+  if (pos < limit && pos + 16 <= readable) {
+    /* names are usually short - limit the last vector to the name's length */
+    const __m128i index = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+                                        12, 13, 14, 15);
+    v = _mm_loadu_si128((__m128i *)pos);
+    upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+                          _mm_cmplt_epi8(v, after_z));
+    upper = _mm_and_si128(
+        upper, _mm_cmplt_epi8(index, _mm_set1_epi8((char)(limit - pos))));
+    _mm_storeu_si128((__m128i *)pos,
+                     _mm_or_si128(v, _mm_and_si128(upper, lower_bit)));
+    return;
+  }
+#endif
+  while (pos < limit) {
+    if (*pos >= 'A' && *pos <= 'Z')
+      *pos |= 32;
+    ++pos;
+  }
+  (void)readable;
+}
+#endif
+
 /* *****************************************************************************
 HTTP/1.1 parsre stages
 ***************************************************************************** */
@@ -213,9 +346,7 @@ inline static int consume_header(struct http1_fio_parser_args_s *args,
   if (!seek2ch(&end_name, end, ':'))
     return -1;
 #if HTTP_HEADERS_LOWERCASE
-  for (uint8_t *t = start; t < end_name; t++) {
-    *t = tolower(*t);
-  }
+  header_name2lower(start, end_name, end);
 #endif
   uint8_t *start_value = end_name + 1;
   if (start_value[0] == ' ') {
@@ -242,20 +373,31 @@ inline static int consume_header(struct http1_fio_parser_args_s *args,
     args->parser->state.reserved |= 32;
   }
 #else
-  if ((end_name - start) == 14 &&
-      HEADER_NAME_IS_EQ((char *)start, "content-length", 14)) {
-    /* handle the special `content-length` header */
-    args->parser->state.content_length = atol((char *)start_value);
-  } else if ((end_name - start) == 17 &&
-             HEADER_NAME_IS_EQ((char *)start, "transfer-encoding", 17) &&
-             memcmp(start_value, "chunked", 7)) {
-    /* handle the special `transfer-encoding: chunked` header */
-    args->parser->state.reserved |= 64;
-  } else if ((end_name - start) == 7 &&
-             HEADER_NAME_IS_EQ((char *)start, "trailer", 7)) {
-    /* chunked data with trailer... */
-    args->parser->state.reserved |= 64;
-    args->parser->state.reserved |= 32;
+  /* most headers are filtered by their length and first letter */
+  switch (end_name - start) {
+  case 14:
+    if ((start[0] | 32) == 'c' &&
+        HEADER_NAME_IS_EQ((char *)start, "content-length", 14)) {
+      /* handle the special `content-length` header */
+      args->parser->state.content_length = atol((char *)start_value);
+    }
+    break;
+  case 17:
+    if ((start[0] | 32) == 't' &&
+        HEADER_NAME_IS_EQ((char *)start, "transfer-encoding", 17) &&
+        end - start_value >= 7 && !memcmp(start_value, "chunked", 7)) {
+      /* handle the special `transfer-encoding: chunked` header */
+      args->parser->state.reserved |= 64;
+    }
+    break;
+  case 7:
+    if ((start[0] | 32) == 't' &&
+        HEADER_NAME_IS_EQ((char *)start, "trailer", 7)) {
+      /* chunked data with trailer... */
+      args->parser->state.reserved |= 64;
+      args->parser->state.reserved |= 32;
+    }
+    break;
   }
 #endif
   /* perform callback */
@@ -292,19 +434,15 @@ inline static int consume_body_chunked(struct http1_fio_parser_args_s *args,
   uint8_t *end = *start;
   while (*start < stop) {
     if (args->parser->state.content_length == 0) {
-      size_t eol_len;
-      /* consume seperator */
+      /* consume seperator (an empty EOL is possible in mid stream) */
       while (*start < stop && (**start == '\n' || **start == '\r'))
         ++(*start);
+      end = *start;
       /* collect chunked length */
-      if (!(eol_len = seek2eol(&end, stop))) {
+      if (!seek2eol(&end, stop)) {
         /* requires length data to continue */
         return 0;
       }
-      /* an empty EOL is possible in mid stream processing */
-      if (*start + eol_len > end && (*start = end) && !seek2eol(&end, stop)) {
-        return 0;
-      }
       args->parser->state.content_length = 0 - strtol((char *)*start, NULL, 16);
       *start = end = end + 1;
       if (args->parser->state.content_length == 0) {
@@ -381,7 +519,8 @@ re_eval:
   /* request / response line */
   case 0:
     /* clear out any leadinng white space */
-    while (*start == '\r' || *start == '\n' || *start == ' ' || *start == 0) {
+    while (start < stop && (*start == '\r' || *start == '\n' ||
+                            *start == ' ' || *start == 0)) {
       start++;
     }
     end = start;
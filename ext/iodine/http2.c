@@ -0,0 +1,1678 @@
+/*
+Copyright: Boaz Segev, 2017-2018
+License: MIT
+*/
+#include "spnlock.inc"
+
+#include "http2.h"
+#include "http2_hpack.h"
+#include "http_internal.h"
+
+#include "fio_hashmap.h"
+#include "fiobj.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+/* Don't use `#define FIO_OVERRIDE_MALLOC 1`
+ * because protocol objects can have long life spans and fio_malloc is optimized
+ * for short life spans.
+ */
+#include "fio_mem.h"
+
+/* *****************************************************************************
+Protocol Constants (RFC 7540)
+***************************************************************************** */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24
+
+/* frame types */
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+/* frame flags */
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+/* error codes */
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+/* settings */
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+/** The largest frame we accept (we never raise SETTINGS_MAX_FRAME_SIZE). */
+#define H2_FRAME_LIMIT 16384
+/** The initial window size, until changed by SETTINGS. */
+#define H2_WINDOW_DEFAULT 65535
+/** The largest legal flow control window. */
+#define H2_WINDOW_LIMIT 0x7fffffff
+/** The read buffer - fits the largest frame we accept. */
+#define H2_READ_BUFFER (H2_FRAME_LIMIT + 9)
+
+/* *****************************************************************************
+The HTTP/2 Protocol Object
+***************************************************************************** */
+
+/** a part of a stream's response body, waiting for the flow control window */
+typedef struct {
+  fio_ls_embd_s node;
+  /** a String to send (FIOBJ_INVALID when sending a file) */
+  FIOBJ str;
+  http_fd_s *fd;
+  uintptr_t offset;
+  uintptr_t length;
+} h2_part_s;
+
+/* stream state flags */
+#define H2S_REMOTE_CLOSED 1 /* the peer ended the stream (request complete) */
+#define H2S_HEADERS_SENT 2  /* the response headers were sent */
+#define H2S_FINISHED 4      /* the response is complete (the handle is done) */
+#define H2S_END_SENT 8      /* END_STREAM was sent */
+#define H2S_CLOSED 16       /* the stream is closed (or was reset) */
+#define H2S_BLOCKED 32      /* the stream is listed in the `blocked` list */
+#define H2S_DISCARD 64      /* the request's body is ignored (early response) */
+
+typedef struct {
+  /** the request / response handle - MUST be first */
+  http_s h;
+  uint32_t id;
+  uint32_t flags;
+  /** handle references (a running handler or a paused handle, see `hold`) */
+  uint32_t hold;
+  /** received DATA not yet acknowledged using WINDOW_UPDATE */
+  uint32_t consumed;
+  /** the peer's flow control window (the amount of DATA we may send) */
+  int64_t window;
+  /** the request body's length (so far) */
+  size_t body_len;
+  /** queued `h2_part_s` response data */
+  fio_ls_embd_s queue;
+  /** a node in the connection's `blocked` list */
+  fio_ls_embd_s node;
+} h2s_s;
+
+typedef struct {
+  http_protocol_s p;
+  /** the HPACK decoding context */
+  hpack_table_s hpack;
+  /** active streams (by stream identifier) */
+  fio_hash_s streams;
+  /** streams with queued data, waiting for the window (or the socket) */
+  fio_ls_embd_s blocked;
+  /** frames waiting to be sent */
+  FIOBJ out;
+  /** a header block waiting for CONTINUATION frames */
+  FIOBJ block;
+  /** a request upgraded from HTTP/1.1 (stream 1), waiting to be handled */
+  h2s_s *upgraded;
+  /** the peer's connection flow control window */
+  int64_t window;
+  /** received DATA not yet acknowledged using WINDOW_UPDATE */
+  uint32_t consumed;
+  uint32_t block_sid;
+  uint32_t last_sid;
+  uint32_t push_sid;
+  /** client initiated streams that are still open */
+  uint32_t opened;
+  /** pushed streams that are still open */
+  uint32_t pushed;
+  struct {
+    uint32_t window;
+    uint32_t frame_size;
+    uint32_t max_streams;
+    uint8_t push;
+  } peer;
+  uint8_t block_flags;
+  /** set until the client's connection preface is received */
+  uint8_t preface;
+  /** set while frames are parsed (frames are sent together afterwards) */
+  uint8_t parsing;
+  /** set once a GOAWAY frame was received */
+  uint8_t goaway;
+  /** set once the connection is closing */
+  uint8_t stop;
+  uintptr_t buf_len;
+  uint8_t buf[];
+} h2pr_s;
+
+struct http_vtable_s HTTP2_VTABLE; /* initialized later on */
+
+/* *****************************************************************************
+Internal Helpers
+***************************************************************************** */
+
+#define handle2pr(h) ((h2pr_s *)(h)->private_data.flag)
+#define handle2stream(h) ((h2s_s *)(h))
+
+static inline uint32_t h2_u32read(const uint8_t *src) {
+  return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+         ((uint32_t)src[2] << 8) | (uint32_t)src[3];
+}
+
+static inline void h2_u32write(uint8_t *dest, uint32_t i) {
+  dest[0] = (uint8_t)(i >> 24);
+  dest[1] = (uint8_t)(i >> 16);
+  dest[2] = (uint8_t)(i >> 8);
+  dest[3] = (uint8_t)i;
+}
+
+/* *****************************************************************************
+Writing Frames
+***************************************************************************** */
+
+/* adds a frame to the output buffer, returning a pointer to its payload. */
+static uint8_t *h2_frame_reserve(h2pr_s *pr, uint8_t type, uint8_t flags,
+                                 uint32_t sid, size_t len) {
+  if (!pr->out)
+    pr->out = fiobj_str_buf(len + 9);
+  fio_cstr_s s = fiobj_obj2cstr(pr->out);
+  fiobj_str_capa_assert(pr->out, s.len + len + 9);
+  s = fiobj_obj2cstr(pr->out);
+  uint8_t *pos = (uint8_t *)s.data + s.len;
+  pos[0] = (uint8_t)(len >> 16);
+  pos[1] = (uint8_t)(len >> 8);
+  pos[2] = (uint8_t)len;
+  pos[3] = type;
+  pos[4] = flags;
+  h2_u32write(pos + 5, sid & 0x7fffffff);
+  fiobj_str_resize(pr->out, s.len + len + 9);
+  return pos + 9;
+}
+
+/* removes the last frame (with a `len` long payload) from the output buffer. */
+static inline void h2_frame_cancel(h2pr_s *pr, size_t len) {
+  fiobj_str_resize(pr->out, fiobj_obj2cstr(pr->out).len - (len + 9));
+}
+
+/* adds a frame to the output buffer. */
+static inline void h2_frame(h2pr_s *pr, uint8_t type, uint8_t flags,
+                            uint32_t sid, const void *data, size_t len) {
+  uint8_t *pos = h2_frame_reserve(pr, type, flags, sid, len);
+  if (len)
+    memcpy(pos, data, len);
+}
+
+/* sends any frames waiting in the output buffer. */
+static inline void h2_flush(h2pr_s *pr) {
+  if (!pr->out)
+    return;
+  fiobj_send_free(pr->p.uuid, pr->out);
+  pr->out = FIOBJ_INVALID;
+}
+
+/* sends the output buffer, unless frames are being parsed (more might follow).
+ */
+static inline void h2_flush_maybe(h2pr_s *pr) {
+  if (!pr->out)
+    return;
+  if (!pr->parsing || fiobj_obj2cstr(pr->out).len >= HTTP2_WRITE_BUFFER)
+    h2_flush(pr);
+}
+
+/* writes a frame with a 32 bit payload (RST_STREAM / WINDOW_UPDATE). */
+static inline void h2_frame_u32(h2pr_s *pr, uint8_t type, uint32_t sid,
+                                uint32_t i) {
+  h2_u32write(h2_frame_reserve(pr, type, 0, sid, 4), i);
+}
+
+/* sends a GOAWAY frame and closes the connection. */
+static void h2_goaway(h2pr_s *pr, uint32_t error) {
+  if (pr->stop)
+    return;
+  uint8_t *pos = h2_frame_reserve(pr, H2_GOAWAY, 0, 0, 8);
+  h2_u32write(pos, pr->last_sid);
+  h2_u32write(pos + 4, error);
+  h2_flush(pr);
+  pr->stop = 1;
+  sock_close(pr->p.uuid);
+}
+
+/* writes a header block using as many frames as required. */
+static void h2_send_block(h2pr_s *pr, uint8_t type, uint8_t flags, uint32_t sid,
+                          FIOBJ block, const uint8_t *prefix,
+                          size_t prefix_len) {
+  fio_cstr_s s = fiobj_obj2cstr(block);
+  size_t len = pr->peer.frame_size - prefix_len;
+  if (len >= s.len) {
+    len = s.len;
+    flags |= H2_FLAG_END_HEADERS;
+  }
+  uint8_t *pos = h2_frame_reserve(pr, type, flags, sid, len + prefix_len);
+  if (prefix_len)
+    memcpy(pos, prefix, prefix_len);
+  memcpy(pos + prefix_len, s.data, len);
+  while (len < s.len) {
+    size_t part = s.len - len;
+    flags = 0;
+    if (part > pr->peer.frame_size)
+      part = pr->peer.frame_size;
+    else
+      flags = H2_FLAG_END_HEADERS;
+    h2_frame(pr, H2_CONTINUATION, flags, sid, s.data + len, part);
+    len += part;
+  }
+}
+
+/* *****************************************************************************
+Encoding Headers
+***************************************************************************** */
+
+/* adds a header field to a header block */
+static inline void h2_block_add(FIOBJ block, const char *name, size_t name_len,
+                                const char *value, size_t value_len) {
+  fio_cstr_s s = fiobj_obj2cstr(block);
+  fiobj_str_capa_assert(block, s.len + name_len + value_len + 12);
+  s = fiobj_obj2cstr(block);
+  s.len += hpack_encode((uint8_t *)s.data + s.len, name, name_len, value,
+                        value_len);
+  fiobj_str_resize(block, s.len);
+}
+
+struct h2_header_writer_s {
+  FIOBJ dest;
+  FIOBJ name;
+};
+
+static int h2_write_header(FIOBJ o, void *w_) {
+  struct h2_header_writer_s *w = w_;
+  if (!o)
+    return 0;
+  if (fiobj_hash_key_in_loop()) {
+    w->name = fiobj_hash_key_in_loop();
+  }
+  if (FIOBJ_TYPE_IS(o, FIOBJ_T_ARRAY)) {
+    fiobj_each1(o, 0, h2_write_header, w);
+    return 0;
+  }
+  fio_cstr_s name = fiobj_obj2cstr(w->name);
+  fio_cstr_s str = fiobj_obj2cstr(o);
+  if (!str.data || !name.len)
+    return 0;
+  /* connection specific headers are forbidden in HTTP/2 */
+  switch (name.len) {
+  case 7:
+    if (!memcmp(name.data, "upgrade", 7))
+      return 0;
+    break;
+  case 10:
+    if (!memcmp(name.data, "connection", 10) ||
+        !memcmp(name.data, "keep-alive", 10))
+      return 0;
+    break;
+  case 16:
+    if (!memcmp(name.data, "proxy-connection", 16))
+      return 0;
+    break;
+  case 17:
+    if (!memcmp(name.data, "transfer-encoding", 17))
+      return 0;
+    break;
+  }
+  /* header names MUST be lower case */
+  for (size_t i = 0; i < name.len; ++i) {
+    if (name.data[i] >= 'A' && name.data[i] <= 'Z') {
+      FIOBJ tmp = fiobj_str_new(name.data, name.len);
+      fio_cstr_s t = fiobj_obj2cstr(tmp);
+      for (; i < t.len; ++i) {
+        if (t.data[i] >= 'A' && t.data[i] <= 'Z')
+          t.data[i] |= 32;
+      }
+      h2_block_add(w->dest, t.data, t.len, str.data, str.len);
+      fiobj_free(tmp);
+      return 0;
+    }
+  }
+  h2_block_add(w->dest, name.data, name.len, str.data, str.len);
+  return 0;
+}
+
+/* encodes the response headers (including the `:status` pseudo header). */
+static FIOBJ h2_headers2block(http_s *h) {
+  struct h2_header_writer_s w = {
+      .dest = fiobj_str_buf(fiobj_hash_count(h->private_data.out_headers) * 48 +
+                            16),
+  };
+  char status[16];
+  size_t len = fio_ltoa(status, h->status, 10);
+  h2_block_add(w.dest, ":status", 7, status, len);
+  fiobj_each1(h->private_data.out_headers, 0, h2_write_header, &w);
+  return w.dest;
+}
+
+/* *****************************************************************************
+Streams
+***************************************************************************** */
+
+static h2s_s *h2_stream_new(h2pr_s *pr, uint32_t id) {
+  h2s_s *s = fio_malloc(sizeof(*s));
+  HTTP_ASSERT(s, "HTTP/2 stream allocation failed");
+  *s = (h2s_s){
+      .id = id,
+      .window = pr->peer.window,
+      .queue = FIO_LS_INIT(s->queue),
+      .node = FIO_LS_INIT(s->node),
+  };
+  http_s_new(&s->h, &pr->p, &HTTP2_VTABLE);
+  s->h.version = fiobj_str_new("HTTP/2.0", 8);
+  fio_hash_insert(&pr->streams, id, s);
+  if (id & 1)
+    ++pr->opened;
+  else
+    ++pr->pushed;
+  return s;
+}
+
+static inline void h2_part_free(h2_part_s *part) {
+  fiobj_free(part->str);
+  if (part->fd)
+    http_fd_release(part->fd);
+  fio_free(part);
+}
+
+/* frees the stream's data (without removing it from the connection). */
+static void h2_stream_dealloc(h2s_s *s) {
+  fio_ls_embd_s *node;
+  while ((node = fio_ls_embd_shift(&s->queue)))
+    h2_part_free(FIO_LS_EMBD_OBJ(h2_part_s, node, node));
+  s->h.status = 0;
+  http_s_destroy(&s->h, 0);
+  fio_free(s);
+}
+
+/* frees the stream once it's closed and the handle is no longer in use. */
+static inline void h2_stream_free(h2pr_s *pr, h2s_s *s) {
+  if (!(s->flags & H2S_CLOSED) || s->hold)
+    return;
+  fio_hash_insert(&pr->streams, s->id, NULL);
+  h2_stream_dealloc(s);
+}
+
+/* closes a stream, the stream will be freed once the handle is done. */
+static void h2_stream_close(h2pr_s *pr, h2s_s *s) {
+  if (s->flags & H2S_CLOSED)
+    return;
+  if ((s->flags & (H2S_END_SENT | H2S_REMOTE_CLOSED)) == H2S_END_SENT) {
+    /* the response is complete, the rest of the request isn't required */
+    h2_frame_u32(pr, H2_RST_STREAM, s->id, H2_NO_ERROR);
+  }
+  s->flags |= H2S_CLOSED;
+  if (s->id & 1)
+    --pr->opened;
+  else
+    --pr->pushed;
+  if (s->flags & H2S_BLOCKED) {
+    fio_ls_embd_remove(&s->node);
+    s->flags ^= H2S_BLOCKED;
+  }
+  fio_ls_embd_s *node;
+  while ((node = fio_ls_embd_shift(&s->queue)))
+    h2_part_free(FIO_LS_EMBD_OBJ(h2_part_s, node, node));
+  h2_stream_free(pr, s);
+}
+
+/* resets a stream (sending a RST_STREAM frame). */
+static void h2_stream_reset(h2pr_s *pr, h2s_s *s, uint32_t error) {
+  if (s->flags & H2S_CLOSED)
+    return;
+  h2_frame_u32(pr, H2_RST_STREAM, s->id, error);
+  s->flags |= H2S_REMOTE_CLOSED;
+  h2_stream_close(pr, s);
+}
+
+/* releases a handle reference (see `hold`), the stream might be freed. */
+static inline void h2_stream_release(h2pr_s *pr, h2s_s *s) {
+  --s->hold;
+  h2_stream_free(pr, s);
+}
+
+/* adds data to the stream's queue (the stream MUST NOT be closed). */
+static void h2_stream_queue(h2s_s *s, FIOBJ str, http_fd_s *fd,
+                            uintptr_t offset, uintptr_t length) {
+  if (!length) {
+    fiobj_free(str);
+    if (fd)
+      http_fd_release(fd);
+    return;
+  }
+  h2_part_s *part = fio_malloc(sizeof(*part));
+  HTTP_ASSERT(part, "HTTP/2 allocation failed");
+  *part = (h2_part_s){
+      .str = str, .fd = fd, .offset = offset, .length = length,
+  };
+  fio_ls_embd_push(&s->queue, &part->node);
+}
+
+/**
+ * Sends the stream's queued data using DATA frames, as permitted by the flow
+ * control windows. The stream might be freed.
+ */
+static void h2_stream_drain(h2pr_s *pr, h2s_s *s) {
+  if (s->flags & H2S_CLOSED)
+    return;
+  while (fio_ls_embd_any(&s->queue)) {
+    if (pr->window <= 0 || s->window <= 0)
+      goto blocked;
+    if (pr->out && fiobj_obj2cstr(pr->out).len >= HTTP2_WRITE_BUFFER) {
+      /* wait for the socket before reading (or copying) any more data */
+      if (sock_pending(pr->p.uuid))
+        goto blocked;
+      h2_flush(pr);
+    }
+    h2_part_s *part = FIO_LS_EMBD_OBJ(h2_part_s, node, s->queue.prev);
+    uintptr_t len = part->length;
+    if (len > (uintptr_t)pr->window)
+      len = (uintptr_t)pr->window;
+    if (len > (uintptr_t)s->window)
+      len = (uintptr_t)s->window;
+    if (len > pr->peer.frame_size)
+      len = pr->peer.frame_size;
+    uint8_t flags = 0;
+    if (len == part->length && s->queue.next == s->queue.prev &&
+        (s->flags & H2S_FINISHED))
+      flags = H2_FLAG_END_STREAM;
+    uint8_t *pos = h2_frame_reserve(pr, H2_DATA, flags, s->id, len);
+    if (part->fd) {
+      ssize_t i = pread(part->fd->fd, pos, len, part->offset);
+      if (i != (ssize_t)len) {
+        h2_frame_cancel(pr, len);
+        h2_stream_reset(pr, s, H2_INTERNAL_ERROR);
+        return;
+      }
+    } else {
+      memcpy(pos, fiobj_obj2cstr(part->str).data + part->offset, len);
+    }
+    part->offset += len;
+    part->length -= len;
+    pr->window -= len;
+    s->window -= len;
+    if (!part->length)
+      h2_part_free(FIO_LS_EMBD_OBJ(h2_part_s, node,
+                                   fio_ls_embd_shift(&s->queue)));
+    if (flags) {
+      s->flags |= H2S_END_SENT;
+      h2_stream_close(pr, s);
+      return;
+    }
+  }
+  if (s->flags & H2S_BLOCKED) {
+    fio_ls_embd_remove(&s->node);
+    s->flags ^= H2S_BLOCKED;
+  }
+  if ((s->flags & (H2S_FINISHED | H2S_END_SENT)) == H2S_FINISHED) {
+    /* the response ended after its data was sent */
+    h2_frame(pr, H2_DATA, H2_FLAG_END_STREAM, s->id, NULL, 0);
+    s->flags |= H2S_END_SENT;
+    h2_stream_close(pr, s);
+  }
+  return;
+blocked:
+  if (!(s->flags & H2S_BLOCKED)) {
+    fio_ls_embd_push(&pr->blocked, &s->node);
+    s->flags |= H2S_BLOCKED;
+  }
+}
+
+/* sends any data waiting for the flow control windows (or the socket). */
+static void h2_drain_blocked(h2pr_s *pr) {
+  fio_ls_embd_s *node = pr->blocked.prev;
+  while (node != &pr->blocked && pr->window > 0 && !pr->stop) {
+    fio_ls_embd_s *next = node->prev;
+    h2_stream_drain(pr, FIO_LS_EMBD_OBJ(h2s_s, node, node));
+    node = next;
+  }
+}
+
+/* sends the response headers (once). */
+static void h2_stream_headers(h2pr_s *pr, h2s_s *s, uint8_t end_stream) {
+  if (s->flags & H2S_HEADERS_SENT)
+    return;
+  s->flags |= H2S_HEADERS_SENT;
+  FIOBJ block = h2_headers2block(&s->h);
+  h2_send_block(pr, H2_HEADERS, (end_stream ? H2_FLAG_END_STREAM : 0), s->id,
+                block, NULL, 0);
+  fiobj_free(block);
+  if (end_stream)
+    s->flags |= H2S_END_SENT;
+}
+
+/**
+ * Completes the response, sending any queued data and END_STREAM. The handle
+ * is invalid afterwards and the stream might be freed.
+ */
+static void h2_stream_finish(h2pr_s *pr, h2s_s *s) {
+  s->flags |= H2S_FINISHED;
+  http_s_destroy(&s->h, pr->p.settings->log);
+  if (s->flags & H2S_END_SENT)
+    h2_stream_close(pr, s);
+  else
+    h2_stream_drain(pr, s);
+  h2_flush_maybe(pr);
+}
+
+/* *****************************************************************************
+HTTP Request / Response (Virtual) Functions
+***************************************************************************** */
+
+/* sends the response headers and a body (a String or a file) */
+static int h2_respond(http_s *h, FIOBJ str, http_fd_s *fd, uintptr_t offset,
+                      uintptr_t length) {
+  h2pr_s *pr = handle2pr(h);
+  h2s_s *s = handle2stream(h);
+  if (s->flags & H2S_CLOSED) {
+    fiobj_free(str);
+    if (fd)
+      http_fd_release(fd);
+    h2_stream_finish(pr, s);
+    return -1;
+  }
+  h2_stream_headers(pr, s, !length);
+  h2_stream_queue(s, str, fd, offset, length);
+  h2_stream_finish(pr, s);
+  return 0;
+}
+
+/** Should send existing headers and data */
+static int http2_send_body(http_s *h, void *data, uintptr_t length) {
+  return h2_respond(h, (length ? fiobj_str_new(data, length) : FIOBJ_INVALID),
+                    NULL, 0, length);
+}
+
+/** Should send existing headers and a String body (without copying it) */
+static int http2_send_body_fiobj(http_s *h, FIOBJ body) {
+  return h2_respond(h, fiobj_dup(body), NULL, 0, fiobj_obj2cstr(body).len);
+}
+
+/** Should send existing headers and file */
+static int http2_sendfile(http_s *h, int fd, uintptr_t length,
+                          uintptr_t offset) {
+  /* an unshared file, closed once the data was sent */
+  http_fd_s *file = fio_malloc(sizeof(*file));
+  HTTP_ASSERT(file, "HTTP/2 allocation failed");
+  *file = (http_fd_s){.fd = fd, .ref = 1};
+  return h2_respond(h, FIOBJ_INVALID, file, offset, length);
+}
+
+/** Should send existing headers and a shared file (releasing `fd`) */
+static int http2_sendfile_fd(http_s *h, http_fd_s *fd, uintptr_t length,
+                             uintptr_t offset) {
+  return h2_respond(h, FIOBJ_INVALID, fd, offset, length);
+}
+
+/** Should send existing headers and file parts (multipart/byteranges) */
+static int http2_sendfile_parts(http_s *h, http_fd_s *fd,
+                                http_file_part_s *parts, size_t count,
+                                FIOBJ tail) {
+  h2pr_s *pr = handle2pr(h);
+  h2s_s *s = handle2stream(h);
+  if (s->flags & H2S_CLOSED) {
+    for (size_t i = 0; i < count; ++i)
+      fiobj_free(parts[i].head);
+    fiobj_free(tail);
+    http_fd_release(fd);
+    h2_stream_finish(pr, s);
+    return -1;
+  }
+  h2_stream_headers(pr, s, 0);
+  for (size_t i = 0; i < count; ++i) {
+    h2_stream_queue(s, parts[i].head, NULL, 0,
+                    fiobj_obj2cstr(parts[i].head).len);
+    /* every part holds a reference to the file */
+    h2_stream_queue(s, FIOBJ_INVALID, http_fd_dup(fd), parts[i].offset,
+                    parts[i].length);
+  }
+  h2_stream_queue(s, tail, NULL, 0, fiobj_obj2cstr(tail).len);
+  http_fd_release(fd);
+  h2_stream_finish(pr, s);
+  return 0;
+}
+
+/** Should send existing headers and data and prepare for streaming */
+static int http2_stream(http_s *h, void *data, uintptr_t length) {
+  h2pr_s *pr = handle2pr(h);
+  h2s_s *s = handle2stream(h);
+  if (s->flags & H2S_CLOSED)
+    return -1;
+  h2_stream_headers(pr, s, 0);
+  if (length) {
+    h2_stream_queue(s, fiobj_str_new(data, length), NULL, 0, length);
+    h2_stream_drain(pr, s);
+  }
+  h2_flush(pr);
+  return 0;
+}
+
+/** Should send existing headers or complete streaming */
+static void http2_finish(http_s *h) {
+  h2pr_s *pr = handle2pr(h);
+  h2s_s *s = handle2stream(h);
+  if (!(s->flags & (H2S_HEADERS_SENT | H2S_CLOSED)))
+    h2_stream_headers(pr, s, 1);
+  h2_stream_finish(pr, s);
+}
+
+/** Receives more of a streamed request body - bodies are always buffered. */
+static int http2_body_fetch(http_s *h) {
+  return 0;
+  (void)h;
+}
+
+/* *****************************************************************************
+Server Push
+***************************************************************************** */
+
+/* promises a (GET) response for `path`, returning the promised stream. */
+static h2s_s *h2_push_promise(http_s *h, FIOBJ path) {
+  h2pr_s *pr = handle2pr(h);
+  h2s_s *parent = handle2stream(h);
+  fio_cstr_s p = fiobj_obj2cstr(path);
+  if (!pr->peer.push || pr->goaway || pr->stop || !(parent->id & 1) ||
+      (parent->flags & (H2S_END_SENT | H2S_CLOSED)) ||
+      pr->pushed >= pr->peer.max_streams || pr->push_sid >= 0x7ffffffd ||
+      !p.len || p.data[0] != '/')
+    return NULL;
+  pr->push_sid += 2;
+  h2s_s *s = h2_stream_new(pr, pr->push_sid);
+  s->flags = H2S_REMOTE_CLOSED;
+  s->h.method = fiobj_str_new("GET", 3);
+  char *query = memchr(p.data, '?', p.len);
+  if (query) {
+    s->h.path = fiobj_str_new(p.data, query - p.data);
+    s->h.query = fiobj_str_new(query + 1, p.len - 1 - (query - p.data));
+  } else {
+    s->h.path = fiobj_str_new(p.data, p.len);
+  }
+  s->h.udata = h->udata;
+  FIOBJ host = fiobj_hash_get2(h->headers, fiobj_obj2hash(HTTP_HEADER_HOST));
+  if (FIOBJ_TYPE_IS(host, FIOBJ_T_STRING))
+    /* copied, since the request's data is released before the push stream's */
+    fiobj_hash_set(s->h.headers, HTTP_HEADER_HOST, fiobj_str_copy(host));
+  else
+    host = FIOBJ_INVALID;
+  /* send the PUSH_PROMISE frame on the parent stream */
+  FIOBJ block = fiobj_str_buf(p.len + 64);
+  h2_block_add(block, ":method", 7, "GET", 3);
+  if (fio_tls_is_tls(pr->p.uuid))
+    h2_block_add(block, ":scheme", 7, "https", 5);
+  else
+    h2_block_add(block, ":scheme", 7, "http", 4);
+  if (host) {
+    fio_cstr_s t = fiobj_obj2cstr(host);
+    h2_block_add(block, ":authority", 10, t.data, t.len);
+  }
+  h2_block_add(block, ":path", 5, p.data, p.len);
+  uint8_t promised[4];
+  h2_u32write(promised, s->id);
+  h2_send_block(pr, H2_PUSH_PROMISE, 0, parent->id, block, promised, 4);
+  fiobj_free(block);
+  return s;
+}
+
+/**
+ * Push for data.
+ *
+ * The pushed resource's path is taken (and removed) from the handle's
+ * `content-location` response header.
+ */
+static int http2_push_data(http_s *h, void *data, uintptr_t length,
+                           FIOBJ mime_type) {
+  static uint64_t location_hash = 0;
+  if (!location_hash)
+    location_hash = fio_siphash("content-location", 16);
+  if (HTTP_INVALID_HANDLE(h))
+    return -1;
+  FIOBJ path = fiobj_hash_get2(h->private_data.out_headers, location_hash);
+  if (!FIOBJ_TYPE_IS(path, FIOBJ_T_STRING))
+    return -1;
+  h2s_s *s = h2_push_promise(h, path);
+  fiobj_hash_delete2(h->private_data.out_headers, location_hash);
+  if (!s)
+    return -1;
+  if (mime_type)
+    http_set_header(&s->h, HTTP_HEADER_CONTENT_TYPE, fiobj_dup(mime_type));
+  http_send_body(&s->h, data, length);
+  return 0;
+}
+
+/**
+ * Push for files.
+ *
+ * The `filename` is the path of a file in the public folder (and the pushed
+ * resource's path).
+ */
+static int http2_push_file(http_s *h, FIOBJ filename, FIOBJ mime_type) {
+  http_settings_s *settings = handle2pr(h)->p.settings;
+  if (!settings->public_folder)
+    return -1;
+  h2s_s *s = h2_push_promise(h, filename);
+  if (!s)
+    return -1;
+  if (mime_type)
+    http_set_header(&s->h, HTTP_HEADER_CONTENT_TYPE, fiobj_dup(mime_type));
+  fio_cstr_s path = fiobj_obj2cstr(s->h.path);
+  if (http_sendfile2(&s->h, settings->public_folder,
+                     settings->public_folder_length, path.data, path.len))
+    http_send_error(&s->h, 404);
+  return 0;
+}
+
+/* *****************************************************************************
+Pausing, Hijacking and Upgrading
+***************************************************************************** */
+
+/**
+ * Called befor a pause task - the stream is kept until the handle is resumed.
+ */
+static void http2_on_pause(http_s *h, http_protocol_s *pr) {
+  ++handle2stream(h)->hold;
+  (void)pr;
+}
+
+/**
+ * called after the resume task had completed.
+ */
+static void http2_on_resume(http_s *h, http_protocol_s *pr) {
+  h2_stream_release((h2pr_s *)pr, handle2stream(h));
+  h2_flush_maybe((h2pr_s *)pr);
+}
+
+/** The connection is shared by all the streams, so it can't be hijacked. */
+static intptr_t http2_hijack(http_s *h, fio_cstr_s *leftover) {
+  if (leftover)
+    *leftover = (fio_cstr_s){.len = 0, .data = NULL};
+  return -1;
+  (void)h;
+}
+
+/** Websockets over HTTP/2 (RFC 8441) are unsupported. */
+static int http2_http2websocket(websocket_settings_s *args) {
+  http_send_error(args->http, 400);
+  if (args->on_close)
+    args->on_close(0, args->udata);
+  return -1;
+}
+
+#undef http_upgrade2sse
+/** EventSource (SSE) over HTTP/2 is unsupported. */
+static int http2_upgrade2sse(http_s *h, http_sse_s *sse) {
+  http_send_error(h, 400);
+  if (sse->on_close)
+    sse->on_close(sse);
+  return -1;
+}
+
+#undef http_sse_write
+static int http2_sse_write(http_sse_s *sse, FIOBJ str) {
+  fiobj_free(str);
+  return -1;
+  (void)sse;
+}
+
+static int http2_sse_close(http_sse_s *sse) {
+  return -1;
+  (void)sse;
+}
+
+/* *****************************************************************************
+Virtual Table Decleration
+***************************************************************************** */
+
+struct http_vtable_s HTTP2_VTABLE = {
+    .http_send_body = http2_send_body,
+    .http_send_body_fiobj = http2_send_body_fiobj,
+    .http_sendfile = http2_sendfile,
+    .http_sendfile_fd = http2_sendfile_fd,
+    .http_sendfile_parts = http2_sendfile_parts,
+    .http_stream = http2_stream,
+    .http_body_fetch = http2_body_fetch,
+    .http_finish = http2_finish,
+    .http_push_data = http2_push_data,
+    .http_push_file = http2_push_file,
+    .http_on_pause = http2_on_pause,
+    .http_on_resume = http2_on_resume,
+    .http_hijack = http2_hijack,
+    .http2websocket = http2_http2websocket,
+    .http_upgrade2sse = http2_upgrade2sse,
+    .http_sse_write = http2_sse_write,
+    .http_sse_close = http2_sse_close,
+};
+
+void *http2_vtable(void) { return (void *)&HTTP2_VTABLE; }
+
+/* *****************************************************************************
+Handling Requests
+***************************************************************************** */
+
+/* calls the request handler, finishing the response unless it was paused. */
+static void h2_on_request(h2pr_s *pr, h2s_s *s) {
+  ++s->hold;
+  http_on_request_handler______internal(&s->h, pr->p.settings);
+  if (!(s->flags & H2S_FINISHED) && s->hold == 1)
+    http_finish(&s->h);
+  h2_stream_release(pr, s);
+}
+
+/* responds with an error before the request was handled. */
+static void h2_on_request_error(h2pr_s *pr, h2s_s *s, size_t error) {
+  s->flags |= H2S_DISCARD;
+  ++s->hold;
+  http_send_error(&s->h, error);
+  h2_stream_release(pr, s);
+}
+
+/* the state of a header block being decoded */
+typedef struct {
+  h2pr_s *pr;
+  http_s *h;
+  size_t size;
+  uint8_t regular;
+  uint8_t malformed;
+  uint8_t too_large;
+} h2_decoder_s;
+
+/* collects a decoded request header */
+static void h2_on_header(void *d_, char *name, size_t name_len, char *value,
+                         size_t value_len) {
+  h2_decoder_s *d = d_;
+  http_s *h = d->h;
+  d->size += name_len + value_len;
+  if (d->size >= d->pr->p.settings->max_header_size ||
+      fiobj_hash_count(h->headers) > HTTP_MAX_HEADER_COUNT) {
+    d->too_large = 1;
+    return;
+  }
+  if (name_len && name[0] == ':') {
+    /* pseudo headers MUST preceed regular headers */
+    if (d->regular) {
+      d->malformed = 1;
+      return;
+    }
+    if (name_len == 7 && !memcmp(name, ":method", 7) && !h->method) {
+      h->method = fiobj_str_new(value, value_len);
+    } else if (name_len == 5 && !memcmp(name, ":path", 5) && !h->path) {
+      char *query = memchr(value, '?', value_len);
+      if (query) {
+        h->path = http_arena_str(h, value, query - value, 0);
+        h->query = http_arena_str(h, query + 1,
+                                  value_len - 1 - (query - value), 0);
+      } else {
+        h->path = http_arena_str(h, value, value_len, 0);
+      }
+    } else if (name_len == 10 && !memcmp(name, ":authority", 10)) {
+      set_header_add(h->headers, HTTP_HEADER_HOST,
+                     fiobj_str_new(value, value_len));
+    } else if (!(name_len == 7 && !memcmp(name, ":scheme", 7))) {
+      d->malformed = 1;
+    }
+    return;
+  }
+  d->regular = 1;
+  FIOBJ sym = http_header_name_find(name, name_len);
+  if (sym == HTTP_HEADER_COOKIE) {
+    /* cookies might be split into separate fields (RFC 7540, 8.1.2.5) */
+    FIOBJ old = fiobj_hash_get2(h->headers, fiobj_obj2hash(sym));
+    if (FIOBJ_TYPE_IS(old, FIOBJ_T_STRING)) {
+      fiobj_str_write(old, "; ", 2);
+      fiobj_str_write(old, value, value_len);
+      return;
+    }
+  }
+  if (sym) {
+    /* common header names are shared (and already hashed) */
+    set_header_add(h->headers, sym, http_arena_str(h, value, value_len, 0));
+    return;
+  }
+  sym = fiobj_str_intern(name, name_len);
+  set_header_add(h->headers, sym, http_arena_str(h, value, value_len, 0));
+  fiobj_free(sym);
+}
+
+/* ignores a decoded header (the header block is decoded for HPACK's state) */
+static void h2_on_header_ignore(void *d, char *name, size_t name_len,
+                                char *value, size_t value_len) {
+  (void)d;
+  (void)name;
+  (void)name_len;
+  (void)value;
+  (void)value_len;
+}
+
+/* handles a complete header block */
+static void h2_on_headers(h2pr_s *pr, uint32_t sid, uint8_t flags,
+                          uint8_t *data, size_t len) {
+  h2s_s *s = fio_hash_find(&pr->streams, sid);
+  if (s || !(sid & 1) || sid <= pr->last_sid) {
+    /* trailers, or an error */
+    if (hpack_decode(&pr->hpack, data, len, h2_on_header_ignore, NULL)) {
+      h2_goaway(pr, H2_COMPRESSION_ERROR);
+      return;
+    }
+    if (!s) {
+      if (!(sid & 1) || sid > pr->last_sid)
+        h2_goaway(pr, H2_PROTOCOL_ERROR);
+      else
+        h2_frame_u32(pr, H2_RST_STREAM, sid, H2_STREAM_CLOSED);
+      return;
+    }
+    if ((s->flags & (H2S_REMOTE_CLOSED | H2S_CLOSED)) ||
+        !(flags & H2_FLAG_END_STREAM)) {
+      h2_stream_reset(pr, s, H2_PROTOCOL_ERROR);
+      return;
+    }
+    s->flags |= H2S_REMOTE_CLOSED;
+    if (!(s->flags & H2S_DISCARD))
+      h2_on_request(pr, s);
+    return;
+  }
+  pr->last_sid = sid;
+  if (pr->goaway || pr->opened >= HTTP2_MAX_STREAMS) {
+    if (hpack_decode(&pr->hpack, data, len, h2_on_header_ignore, NULL))
+      h2_goaway(pr, H2_COMPRESSION_ERROR);
+    else
+      h2_frame_u32(pr, H2_RST_STREAM, sid, H2_REFUSED_STREAM);
+    return;
+  }
+  s = h2_stream_new(pr, sid);
+  h2_decoder_s d = {.pr = pr, .h = &s->h};
+  if (hpack_decode(&pr->hpack, data, len, h2_on_header, &d)) {
+    h2_goaway(pr, H2_COMPRESSION_ERROR);
+    return;
+  }
+  if (flags & H2_FLAG_END_STREAM)
+    s->flags |= H2S_REMOTE_CLOSED;
+  if (d.malformed || !s->h.method || !s->h.path) {
+    h2_stream_reset(pr, s, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (d.too_large) {
+    if (pr->p.settings->log)
+      fprintf(stderr, "WARNING: (http security alert) header flood detected.\n");
+    h2_on_request_error(pr, s, 413);
+    return;
+  }
+  if (flags & H2_FLAG_END_STREAM)
+    h2_on_request(pr, s);
+}
+
+/* handles a DATA frame's payload */
+static void h2_on_body(h2pr_s *pr, h2s_s *s, uint8_t flags, uint8_t *data,
+                       size_t len) {
+  if (!(s->flags & H2S_DISCARD)) {
+    s->body_len += len;
+    if (s->body_len > pr->p.settings->max_body_size) {
+      h2_on_request_error(pr, s, 413);
+      return;
+    }
+    if (!s->h.body) {
+      FIOBJ tmp = fiobj_hash_get2(s->h.headers,
+                                  fiobj_obj2hash(HTTP_HEADER_CONTENT_LENGTH));
+      if (FIOBJ_TYPE_IS(tmp, FIOBJ_T_STRING) &&
+          fiobj_obj2num(tmp) <= HTTP_MAX_HEADER_LENGTH)
+        s->h.body = fiobj_data_newstr();
+      else
+        s->h.body = fiobj_data_newtmpfile();
+    }
+    fiobj_data_write(s->h.body, data, len);
+  }
+  if (!(flags & H2_FLAG_END_STREAM))
+    return;
+  s->flags |= H2S_REMOTE_CLOSED;
+  if (!(s->flags & H2S_DISCARD))
+    h2_on_request(pr, s);
+}
+
+/* *****************************************************************************
+Parsing Frames
+***************************************************************************** */
+
+/* acknowledges received DATA, allowing the peer to send more. */
+static void h2_consume_window(h2pr_s *pr, h2s_s *s, uint32_t len) {
+  pr->consumed += len;
+  if (pr->consumed >= (HTTP2_WINDOW_SIZE >> 1)) {
+    h2_frame_u32(pr, H2_WINDOW_UPDATE, 0, pr->consumed);
+    pr->consumed = 0;
+  }
+  if (!s)
+    return;
+  s->consumed += len;
+  if (s->consumed >= (HTTP2_WINDOW_SIZE >> 1)) {
+    h2_frame_u32(pr, H2_WINDOW_UPDATE, s->id, s->consumed);
+    s->consumed = 0;
+  }
+}
+
+/* applies the peer's SETTINGS. Returns an error code (or H2_NO_ERROR). */
+static uint32_t h2_on_settings(h2pr_s *pr, uint8_t *data, size_t len) {
+  for (; len >= 6; data += 6, len -= 6) {
+    const uint16_t id = ((uint16_t)data[0] << 8) | data[1];
+    const uint32_t value = h2_u32read(data + 2);
+    switch (id) {
+    case H2_SETTINGS_ENABLE_PUSH:
+      if (value > 1)
+        return H2_PROTOCOL_ERROR;
+      pr->peer.push = (uint8_t)value;
+      break;
+    case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+      pr->peer.max_streams = value;
+      break;
+    case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+      if (value > H2_WINDOW_LIMIT)
+        return H2_FLOW_CONTROL_ERROR;
+      /* the change applies to all the existing streams */
+      FIO_HASH_FOR_LOOP(&pr->streams, i) {
+        if (i->obj)
+          ((h2s_s *)i->obj)->window += (int64_t)value - pr->peer.window;
+      }
+      pr->peer.window = value;
+      break;
+    case H2_SETTINGS_MAX_FRAME_SIZE:
+      if (value < H2_FRAME_LIMIT || value > 16777215)
+        return H2_PROTOCOL_ERROR;
+      pr->peer.frame_size = value;
+      break;
+    }
+  }
+  return H2_NO_ERROR;
+}
+
+/* handles a single frame */
+static void h2_on_frame(h2pr_s *pr, uint8_t type, uint8_t flags, uint32_t sid,
+                        uint8_t *data, size_t len) {
+  h2s_s *s;
+  if (pr->block && type != H2_CONTINUATION) {
+    h2_goaway(pr, H2_PROTOCOL_ERROR);
+    return;
+  }
+  switch (type) {
+  case H2_DATA: {
+    const uint32_t frame_len = (uint32_t)len;
+    if (!sid)
+      goto protocol_error;
+    if (flags & H2_FLAG_PADDED) {
+      if (!len || data[0] >= len)
+        goto protocol_error;
+      len -= 1 + data[0];
+      ++data;
+    }
+    s = fio_hash_find(&pr->streams, sid);
+    if (!s || (s->flags & (H2S_REMOTE_CLOSED | H2S_CLOSED))) {
+      if (sid > pr->last_sid)
+        goto protocol_error;
+      h2_consume_window(pr, NULL, frame_len);
+      if (!s || !(s->flags & H2S_CLOSED))
+        h2_frame_u32(pr, H2_RST_STREAM, sid, H2_STREAM_CLOSED);
+      return;
+    }
+    h2_consume_window(pr, ((flags & H2_FLAG_END_STREAM) ? NULL : s),
+                      frame_len);
+    h2_on_body(pr, s, flags, data, len);
+    return;
+  }
+  case H2_HEADERS:
+    if (!sid)
+      goto protocol_error;
+    if (flags & H2_FLAG_PADDED) {
+      if (!len || data[0] >= len)
+        goto protocol_error;
+      len -= 1 + data[0];
+      ++data;
+    }
+    if (flags & H2_FLAG_PRIORITY) {
+      if (len < 5)
+        goto protocol_error;
+      data += 5;
+      len -= 5;
+    }
+    if (!(flags & H2_FLAG_END_HEADERS)) {
+      pr->block = fiobj_str_new((char *)data, len);
+      pr->block_sid = sid;
+      pr->block_flags = flags;
+      return;
+    }
+    h2_on_headers(pr, sid, flags, data, len);
+    return;
+  case H2_CONTINUATION: {
+    if (!pr->block || sid != pr->block_sid)
+      goto protocol_error;
+    fiobj_str_write(pr->block, (char *)data, len);
+    fio_cstr_s block = fiobj_obj2cstr(pr->block);
+    if (block.len > (pr->p.settings->max_header_size << 1) + H2_FRAME_LIMIT) {
+      h2_goaway(pr, H2_ENHANCE_YOUR_CALM);
+      return;
+    }
+    if (!(flags & H2_FLAG_END_HEADERS))
+      return;
+    FIOBJ tmp = pr->block;
+    pr->block = FIOBJ_INVALID;
+    h2_on_headers(pr, sid, pr->block_flags, (uint8_t *)block.data, block.len);
+    fiobj_free(tmp);
+    return;
+  }
+  case H2_PRIORITY:
+    /* priorities are advisory - responses are sent as soon as possible */
+    if (!sid)
+      goto protocol_error;
+    return;
+  case H2_RST_STREAM:
+    if (!sid)
+      goto protocol_error;
+    if (len != 4)
+      goto frame_size_error;
+    s = fio_hash_find(&pr->streams, sid);
+    if (s) {
+      s->flags |= H2S_REMOTE_CLOSED;
+      h2_stream_close(pr, s);
+    }
+    return;
+  case H2_SETTINGS: {
+    if (sid)
+      goto protocol_error;
+    if (flags & H2_FLAG_ACK) {
+      if (len)
+        goto frame_size_error;
+      return;
+    }
+    if (len % 6)
+      goto frame_size_error;
+    uint32_t error = h2_on_settings(pr, data, len);
+    if (error) {
+      h2_goaway(pr, error);
+      return;
+    }
+    h2_frame(pr, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+    return;
+  }
+  case H2_PUSH_PROMISE:
+    /* clients can't push */
+    goto protocol_error;
+  case H2_PING:
+    if (sid)
+      goto protocol_error;
+    if (len != 8)
+      goto frame_size_error;
+    if (!(flags & H2_FLAG_ACK))
+      h2_frame(pr, H2_PING, H2_FLAG_ACK, 0, data, 8);
+    return;
+  case H2_GOAWAY:
+    if (sid)
+      goto protocol_error;
+    /* existing streams are completed, new streams are refused */
+    pr->goaway = 1;
+    return;
+  case H2_WINDOW_UPDATE: {
+    if (len != 4)
+      goto frame_size_error;
+    const uint32_t increment = h2_u32read(data) & 0x7fffffff;
+    if (!sid) {
+      if (!increment)
+        goto protocol_error;
+      pr->window += increment;
+      if (pr->window > H2_WINDOW_LIMIT)
+        h2_goaway(pr, H2_FLOW_CONTROL_ERROR);
+      return;
+    }
+    s = fio_hash_find(&pr->streams, sid);
+    if (!s || (s->flags & H2S_CLOSED))
+      return;
+    if (!increment) {
+      h2_stream_reset(pr, s, H2_PROTOCOL_ERROR);
+      return;
+    }
+    s->window += increment;
+    if (s->window > H2_WINDOW_LIMIT)
+      h2_stream_reset(pr, s, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  default:
+    /* unknown frame types MUST be ignored */
+    return;
+  }
+protocol_error:
+  h2_goaway(pr, H2_PROTOCOL_ERROR);
+  return;
+frame_size_error:
+  h2_goaway(pr, H2_FRAME_SIZE_ERROR);
+}
+
+/* parses any complete frames in the buffer. */
+static void h2_consume_data(h2pr_s *pr) {
+  uint8_t *pos = pr->buf;
+  uint8_t *end = pr->buf + pr->buf_len;
+  pr->parsing = 1;
+  if (pr->preface) {
+    size_t len = end - pos;
+    if (len > H2_PREFACE_LENGTH)
+      len = H2_PREFACE_LENGTH;
+    if (memcmp(pos, H2_PREFACE, len)) {
+      pr->stop = 1;
+      sock_close(pr->p.uuid);
+      goto finish;
+    }
+    if (len < H2_PREFACE_LENGTH)
+      goto finish;
+    pos += H2_PREFACE_LENGTH;
+    pr->preface = 0;
+  }
+  while (end - pos >= 9 && !pr->stop) {
+    const uint32_t len =
+        ((uint32_t)pos[0] << 16) | ((uint32_t)pos[1] << 8) | pos[2];
+    if (len > H2_FRAME_LIMIT) {
+      h2_goaway(pr, H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if ((size_t)(end - pos) < len + 9)
+      break;
+    h2_on_frame(pr, pos[3], pos[4], h2_u32read(pos + 5) & 0x7fffffff, pos + 9,
+                len);
+    pos += len + 9;
+  }
+finish:
+  pr->parsing = 0;
+  pr->buf_len = end - pos;
+  if (pr->buf_len && pos != pr->buf)
+    memmove(pr->buf, pos, pr->buf_len);
+}
+
+/* *****************************************************************************
+Connection Callbacks
+***************************************************************************** */
+
+/**
+ * A string to identify the protocol's service (i.e. "http").
+ *
+ * The string should be a global constant, only a pointer comparison will be
+ * used (not `strcmp`).
+ */
+static const char *HTTP2_SERVICE_STR = "http2_protocol_facil_io";
+
+/** called when a data is available, but will not run concurrently */
+static void http2_on_data(intptr_t uuid, protocol_s *protocol) {
+  h2pr_s *pr = (h2pr_s *)protocol;
+  if (pr->stop)
+    return;
+  if (pr->upgraded) {
+    /* the request that was upgraded from HTTP/1.1 */
+    h2s_s *s = pr->upgraded;
+    pr->upgraded = NULL;
+    pr->parsing = 1;
+    h2_on_request(pr, s);
+    pr->parsing = 0;
+  }
+  ssize_t i = 0;
+  if (H2_READ_BUFFER - pr->buf_len)
+    i = sock_read(uuid, pr->buf + pr->buf_len, H2_READ_BUFFER - pr->buf_len);
+  if (i > 0) {
+    pr->buf_len += i;
+    h2_consume_data(pr);
+  }
+  if (pr->stop)
+    return;
+  h2_drain_blocked(pr);
+  h2_flush(pr);
+  if (pr->goaway && !pr->opened && !pr->pushed) {
+    pr->stop = 1;
+    sock_close(uuid);
+  }
+}
+
+/** called when the socket's buffer was flushed (more data could be sent) */
+static void http2_on_ready(intptr_t uuid, protocol_s *protocol) {
+  h2pr_s *pr = (h2pr_s *)protocol;
+  if (fio_ls_embd_any(&pr->blocked))
+    facil_force_event(uuid, FIO_EVENT_ON_DATA);
+}
+
+/** called when the server is shutting down */
+static void http2_on_shutdown(intptr_t uuid, protocol_s *protocol) {
+  uint8_t goaway[17] = {0, 0, 8, H2_GOAWAY};
+  h2_u32write(goaway + 9, ((h2pr_s *)protocol)->last_sid);
+  sock_write(uuid, goaway, 17);
+}
+
+/** called when the connection was closed, but will not run concurrently */
+static void http2_on_close(intptr_t uuid, protocol_s *protocol) {
+  http2_destroy(protocol);
+  (void)uuid;
+}
+
+/* sends the server's connection preface (SETTINGS) */
+static void h2_send_preface(h2pr_s *pr) {
+  uint8_t *pos = h2_frame_reserve(pr, H2_SETTINGS, 0, 0, 18);
+  pos[0] = 0;
+  pos[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  h2_u32write(pos + 2, HTTP2_MAX_STREAMS);
+  pos[6] = 0;
+  pos[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+  h2_u32write(pos + 8, HTTP2_WINDOW_SIZE);
+  pos[12] = 0;
+  pos[13] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+  h2_u32write(pos + 14, (uint32_t)pr->p.settings->max_header_size);
+  if (HTTP2_WINDOW_SIZE > H2_WINDOW_DEFAULT)
+    h2_frame_u32(pr, H2_WINDOW_UPDATE, 0,
+                 HTTP2_WINDOW_SIZE - H2_WINDOW_DEFAULT);
+}
+
+/* allocates and initializes the protocol object */
+static h2pr_s *h2_protocol_new(uintptr_t uuid, http_settings_s *settings,
+                               void *unread_data, size_t unread_length) {
+  if (unread_data && unread_length > H2_READ_BUFFER)
+    return NULL;
+  h2pr_s *pr = malloc(sizeof(*pr) + H2_READ_BUFFER);
+  HTTP_ASSERT(pr, "HTTP/2 protocol allocation failed");
+  *pr = (h2pr_s){
+      .p.protocol =
+          {
+              .service = HTTP2_SERVICE_STR,
+              .on_data = http2_on_data,
+              .on_ready = http2_on_ready,
+              .on_shutdown = http2_on_shutdown,
+              .on_close = http2_on_close,
+          },
+      .p.uuid = uuid,
+      .p.settings = settings,
+      .blocked = FIO_LS_INIT(pr->blocked),
+      .window = H2_WINDOW_DEFAULT,
+      .peer =
+          {
+              .window = H2_WINDOW_DEFAULT,
+              .frame_size = H2_FRAME_LIMIT,
+              .max_streams = HTTP2_MAX_STREAMS,
+              .push = 1,
+          },
+      .preface = 1,
+  };
+  hpack_table_init(&pr->hpack, HPACK_TABLE_SIZE);
+  fio_hash_new(&pr->streams);
+  if (unread_data && unread_length) {
+    memcpy(pr->buf, unread_data, unread_length);
+    pr->buf_len = unread_length;
+  }
+  h2_send_preface(pr);
+  return pr;
+}
+
+/* *****************************************************************************
+Public API
+***************************************************************************** */
+
+/** Creates an HTTP/2 protocol object and handles any unread data in the buffer
+ * (if any). */
+protocol_s *http2_new(uintptr_t uuid, http_settings_s *settings,
+                      void *unread_data, size_t unread_length) {
+  h2pr_s *pr = h2_protocol_new(uuid, settings, unread_data, unread_length);
+  if (!pr)
+    return NULL;
+  h2_flush(pr);
+  facil_attach(uuid, &pr->p.protocol);
+  if (pr->buf_len)
+    facil_force_event(uuid, FIO_EVENT_ON_DATA);
+  return &pr->p.protocol;
+}
+
+/** Switches an HTTP/1.1 connection to HTTP/2 (`Upgrade: h2c`). */
+protocol_s *http2_upgrade(uintptr_t uuid, http_settings_s *settings,
+                          http_s *request, void *h2settings,
+                          size_t h2settings_len, void *unread_data,
+                          size_t unread_length) {
+  h2pr_s *pr = h2_protocol_new(uuid, settings, unread_data, unread_length);
+  if (!pr)
+    return NULL;
+  if (h2settings_len % 6 || h2_on_settings(pr, h2settings, h2settings_len)) {
+    http2_destroy(&pr->p.protocol);
+    return NULL;
+  }
+  /* the request becomes stream 1 (half closed) */
+  h2s_s *s = h2_stream_new(pr, 1);
+  http_s_destroy(&s->h, 0);
+  s->h = *request;
+  s->h.private_data.vtbl = &HTTP2_VTABLE;
+  s->h.private_data.flag = (uintptr_t)&pr->p;
+  s->flags = H2S_REMOTE_CLOSED;
+  pr->last_sid = 1;
+  pr->upgraded = s;
+  h2_flush(pr);
+  facil_attach(uuid, &pr->p.protocol);
+  facil_force_event(uuid, FIO_EVENT_ON_DATA);
+  return &pr->p.protocol;
+}
+
+/** Manually destroys the HTTP/2 protocol object. */
+void http2_destroy(protocol_s *protocol) {
+  h2pr_s *pr = (h2pr_s *)protocol;
+  FIO_HASH_FOR_FREE(&pr->streams, i) {
+    if (i->obj)
+      h2_stream_dealloc(i->obj);
+  }
+  hpack_table_destroy(&pr->hpack);
+  fiobj_free(pr->out);
+  fiobj_free(pr->block);
+  free(pr);
+}
+
+/* *****************************************************************************
+Testing
+***************************************************************************** */
+
+#ifdef DEBUG
+#include <sys/socket.h>
+
+#define TEST_ASSERT(cond, ...)                                                 \
+  if (!(cond)) {                                                               \
+    fprintf(stderr, "* " __VA_ARGS__);                                         \
+    fprintf(stderr, "Testing failed.\n");                                      \
+    exit(-1);                                                                  \
+  }
+
+static size_t http2_test_requests;
+static intptr_t http2_test_body_len;
+static char http2_test_path[32];
+
+static void http2_test_on_request(http_s *h) {
+  fio_cstr_s path = fiobj_obj2cstr(h->path);
+  ++http2_test_requests;
+  http2_test_body_len = (h->body ? fiobj_data_len(h->body) : 0);
+  if (path.len >= sizeof(http2_test_path))
+    path.len = sizeof(http2_test_path) - 1;
+  memcpy(http2_test_path, path.data, path.len);
+  http2_test_path[path.len] = 0;
+  http_send_body(h, "ok", 2);
+}
+
+/* writes a frame header, returning the position of the frame's payload */
+static uint8_t *http2_test_frame(uint8_t *pos, size_t len, uint8_t type,
+                                 uint8_t flags, uint32_t sid) {
+  pos[0] = (uint8_t)(len >> 16);
+  pos[1] = (uint8_t)(len >> 8);
+  pos[2] = (uint8_t)len;
+  pos[3] = type;
+  pos[4] = flags;
+  h2_u32write(pos + 5, sid);
+  return pos + 9;
+}
+
+/*
+ * parses the frames in `data`, testing the number of requests that were handled
+ * and the GOAWAY error code (-1 when the connection should remain open).
+ */
+static void http2_test_frames(const char *name, uint8_t *data, size_t len,
+                              size_t max_header_size, size_t requests,
+                              int64_t goaway) {
+  http_settings_s settings = {
+      .on_request = http2_test_on_request,
+      .max_header_size = max_header_size,
+      .max_body_size = 1024,
+  };
+  int sv[2];
+  TEST_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv),
+              "HTTP/2 %s: socketpair failed\n", name);
+  intptr_t uuid = sock_open(sv[0]);
+  h2pr_s *pr = h2_protocol_new(uuid, &settings, NULL, 0);
+  pr->preface = 0;
+  http2_test_requests = 0;
+  http2_test_body_len = 0;
+  http2_test_path[0] = 0;
+  /* the read buffer fits a single frame, so the data is parsed in parts */
+  while (len && !pr->stop) {
+    size_t part = H2_READ_BUFFER - pr->buf_len;
+    if (part > len)
+      part = len;
+    memcpy(pr->buf + pr->buf_len, data, part);
+    pr->buf_len += part;
+    data += part;
+    len -= part;
+    h2_consume_data(pr);
+  }
+  h2_flush(pr);
+  sock_flush_strong(uuid);
+  /* find the GOAWAY frame (if any) sent to the peer */
+  int64_t error = -1;
+  static uint8_t out[H2_READ_BUFFER * 4];
+  size_t out_len = 0;
+  ssize_t i;
+  while (out_len < sizeof(out) &&
+         (i = recv(sv[1], out + out_len, sizeof(out) - out_len,
+                   MSG_DONTWAIT)) > 0)
+    out_len += i;
+  for (size_t pos = 0; pos + 9 <= out_len;) {
+    size_t frame_len = ((size_t)out[pos] << 16) | ((size_t)out[pos + 1] << 8) |
+                       out[pos + 2];
+    if (out[pos + 3] == H2_GOAWAY && pos + 17 <= out_len)
+      error = h2_u32read(out + pos + 13);
+    pos += frame_len + 9;
+  }
+  TEST_ASSERT(http2_test_requests == requests,
+              "HTTP/2 %s: %zu requests handled (expected %zu)\n", name,
+              http2_test_requests, requests);
+  TEST_ASSERT(error == goaway,
+              "HTTP/2 %s: GOAWAY error %ld (expected %ld)\n", name,
+              (long)error, (long)goaway);
+  http2_destroy(&pr->p.protocol);
+  sock_force_close(uuid);
+  close(sv[1]);
+}
+
+void http2_test(void) {
+  fprintf(stderr, "=== Testing HTTP/2 frames\n");
+  /* the request's header block */
+  uint8_t block[128];
+  size_t block_len = 0;
+  block_len += hpack_encode(block + block_len, ":method", 7, "GET", 3);
+  block_len += hpack_encode(block + block_len, ":scheme", 7, "https", 5);
+  block_len += hpack_encode(block + block_len, ":path", 5, "/test", 5);
+  block_len += hpack_encode(block + block_len, ":authority", 10, "x", 1);
+  uint8_t buf[H2_READ_BUFFER * 3];
+  uint8_t *pos;
+  size_t len;
+  /* a header block split across CONTINUATION frames (mid-string) */
+  pos = http2_test_frame(buf, 3, H2_HEADERS, H2_FLAG_END_STREAM, 1);
+  memcpy(pos, block, 3);
+  pos = http2_test_frame(pos + 3, block_len - 5, H2_CONTINUATION, 0, 1);
+  memcpy(pos, block + 3, block_len - 5);
+  pos = http2_test_frame(pos + block_len - 5, 2, H2_CONTINUATION,
+                         H2_FLAG_END_HEADERS, 1);
+  memcpy(pos, block + block_len - 2, 2);
+  len = (pos + 2) - buf;
+  http2_test_frames("CONTINUATION", buf, len, 8192, 1, -1);
+  TEST_ASSERT(!strcmp(http2_test_path, "/test"),
+              "HTTP/2 CONTINUATION: wrong path (%s)\n", http2_test_path);
+  /* CONTINUATION for another stream */
+  buf[9 + 3 + 8] = 3; /* the first CONTINUATION frame's stream id */
+  http2_test_frames("CONTINUATION (stream)", buf, len, 8192, 0,
+                    H2_PROTOCOL_ERROR);
+  /* a different frame while waiting for CONTINUATION */
+  pos = http2_test_frame(buf, 3, H2_HEADERS, H2_FLAG_END_STREAM, 1);
+  memcpy(pos, block, 3);
+  pos = http2_test_frame(pos + 3, 8, H2_PING, 0, 0);
+  memset(pos, 0, 8);
+  http2_test_frames("CONTINUATION (interrupted)", buf, (pos + 8) - buf, 8192,
+                    0, H2_PROTOCOL_ERROR);
+  /* CONTINUATION without HEADERS */
+  pos = http2_test_frame(buf, block_len, H2_CONTINUATION, H2_FLAG_END_HEADERS,
+                         1);
+  memcpy(pos, block, block_len);
+  http2_test_frames("CONTINUATION (no HEADERS)", buf, 9 + block_len, 8192, 0,
+                    H2_PROTOCOL_ERROR);
+  /* CONTINUATION frames that never end (header block limit) */
+  pos = http2_test_frame(buf, H2_FRAME_LIMIT, H2_HEADERS, 0, 1);
+  memset(pos, 0, H2_FRAME_LIMIT);
+  pos = http2_test_frame(pos + H2_FRAME_LIMIT, H2_FRAME_LIMIT, H2_CONTINUATION,
+                         0, 1);
+  memset(pos, 0, H2_FRAME_LIMIT);
+  http2_test_frames("CONTINUATION (flood)", buf, (H2_FRAME_LIMIT + 9) * 2,
+                    1024, 0, H2_ENHANCE_YOUR_CALM);
+  /* a padded header block with a priority */
+  pos = http2_test_frame(buf, 1 + 5 + block_len + 4, H2_HEADERS,
+                         H2_FLAG_END_STREAM | H2_FLAG_END_HEADERS |
+                             H2_FLAG_PADDED | H2_FLAG_PRIORITY,
+                         1);
+  pos[0] = 4;
+  memset(pos + 1, 0, 5);
+  memcpy(pos + 6, block, block_len);
+  memset(pos + 6 + block_len, 0, 4);
+  http2_test_frames("HEADERS (padded)", buf, 9 + 1 + 5 + block_len + 4, 8192, 1,
+                    -1);
+  /* padding that's as long as the payload */
+  pos = http2_test_frame(buf, 5, H2_HEADERS,
+                         H2_FLAG_END_STREAM | H2_FLAG_END_HEADERS |
+                             H2_FLAG_PADDED,
+                         1);
+  memcpy(pos, "\x05\x00\x00\x00\x00", 5);
+  http2_test_frames("HEADERS (padding length)", buf, 9 + 5, 8192, 0,
+                    H2_PROTOCOL_ERROR);
+  /* a padded frame without a padding length */
+  http2_test_frame(buf, 0, H2_HEADERS,
+                   H2_FLAG_END_STREAM | H2_FLAG_END_HEADERS | H2_FLAG_PADDED,
+                   1);
+  http2_test_frames("HEADERS (no padding length)", buf, 9, 8192, 0,
+                    H2_PROTOCOL_ERROR);
+  /* padding that leaves no room for the priority */
+  pos = http2_test_frame(buf, 6, H2_HEADERS,
+                         H2_FLAG_END_STREAM | H2_FLAG_END_HEADERS |
+                             H2_FLAG_PADDED | H2_FLAG_PRIORITY,
+                         1);
+  memcpy(pos, "\x01\x00\x00\x00\x00\x00", 6);
+  http2_test_frames("HEADERS (padded priority)", buf, 9 + 6, 8192, 0,
+                    H2_PROTOCOL_ERROR);
+  /* a padded request body */
+  pos = http2_test_frame(buf, block_len, H2_HEADERS, H2_FLAG_END_HEADERS, 1);
+  memcpy(pos, block, block_len);
+  pos = http2_test_frame(pos + block_len, 5, H2_DATA,
+                         H2_FLAG_END_STREAM | H2_FLAG_PADDED, 1);
+  memcpy(pos, "\x02hi\x00\x00", 5);
+  http2_test_frames("DATA (padded)", buf, (pos + 5) - buf, 8192, 1, -1);
+  TEST_ASSERT(http2_test_body_len == 2,
+              "HTTP/2 DATA (padded): wrong body length (%ld)\n",
+              (long)http2_test_body_len);
+  /* DATA padding that's as long as the payload */
+  memcpy(pos, "\x05hi\x00\x00", 5);
+  http2_test_frames("DATA (padding length)", buf, (pos + 5) - buf, 8192, 0,
+                    H2_PROTOCOL_ERROR);
+  fprintf(stderr, "* HTTP/2 frames passed.\n");
+}
+
+#undef TEST_ASSERT
+#endif
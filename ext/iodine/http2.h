@@ -0,0 +1,67 @@
+/*
+Copyright: Boaz Segev, 2017-2018
+License: MIT
+*/
+#ifndef H_HTTP2_H
+#define H_HTTP2_H
+
+#include "http.h"
+
+#ifndef HTTP2_MAX_STREAMS
+/**
+ * The maximum number of concurrent streams (requests) a client may open on a
+ * single connection (SETTINGS_MAX_CONCURRENT_STREAMS).
+ */
+#define HTTP2_MAX_STREAMS 128
+#endif
+
+#ifndef HTTP2_WINDOW_SIZE
+/**
+ * The flow control window offered to clients for each stream and for the
+ * connection as a whole (limits the request data a client may send ahead).
+ */
+#define HTTP2_WINDOW_SIZE (1024 * 1024)
+#endif
+
+#ifndef HTTP2_WRITE_BUFFER
+/**
+ * Outgoing frames are collected (and sent together) up to this length. Queued
+ * response data (i.e. files) is framed only once the socket's buffer drained.
+ */
+#define HTTP2_WRITE_BUFFER (64 * 1024)
+#endif
+
+/**
+ * Creates an HTTP/2 protocol object and handles any unread data in the buffer
+ * (if any).
+ *
+ * The unread data (if any) MUST start with the client's connection preface
+ * (prior knowledge, or a TLS connection that negotiated "h2" using ALPN).
+ */
+protocol_s *http2_new(uintptr_t uuid, http_settings_s *settings,
+                      void *unread_data, size_t unread_length);
+
+/**
+ * Switches an HTTP/1.1 connection to HTTP/2 once the `101 Switching Protocols`
+ * response to an `Upgrade: h2c` request was sent.
+ *
+ * The `request` (its data is moved to the new protocol) becomes stream 1 and
+ * `h2settings` is the decoded `HTTP2-Settings` header (a SETTINGS payload).
+ */
+protocol_s *http2_upgrade(uintptr_t uuid, http_settings_s *settings,
+                          http_s *request, void *h2settings,
+                          size_t h2settings_len, void *unread_data,
+                          size_t unread_length);
+
+/** Manually destroys the HTTP/2 protocol object. */
+void http2_destroy(protocol_s *);
+
+/** returns the HTTP/2 protocol's VTable. */
+void *http2_vtable(void);
+
+#ifdef DEBUG
+/** Tests the HTTP/2 frame parser (padding and CONTINUATION frames). */
+void http2_test(void);
+#endif
+
+#endif
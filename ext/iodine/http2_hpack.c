@@ -0,0 +1,673 @@
+/*
+Copyright: Boaz Segev, 2017-2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#include "http2_hpack.h"
+
+#include <string.h>
+
+/* *****************************************************************************
+The static table (RFC 7541, Appendix A)
+***************************************************************************** */
+
+typedef struct {
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+} hpack_static_s;
+
+#define HPACK_STATIC(name, value)                                              \
+  { (name), sizeof(name) - 1, (value), sizeof(value) - 1 }
+
+/* the static table, `hpack_static[0]` is unused (indexes start at 1). */
+static const hpack_static_s hpack_static[] = {
+    HPACK_STATIC("", ""),
+    HPACK_STATIC(":authority", ""),
+    HPACK_STATIC(":method", "GET"),
+    HPACK_STATIC(":method", "POST"),
+    HPACK_STATIC(":path", "/"),
+    HPACK_STATIC(":path", "/index.html"),
+    HPACK_STATIC(":scheme", "http"),
+    HPACK_STATIC(":scheme", "https"),
+    HPACK_STATIC(":status", "200"),
+    HPACK_STATIC(":status", "204"),
+    HPACK_STATIC(":status", "206"),
+    HPACK_STATIC(":status", "304"),
+    HPACK_STATIC(":status", "400"),
+    HPACK_STATIC(":status", "404"),
+    HPACK_STATIC(":status", "500"),
+    HPACK_STATIC("accept-charset", ""),
+    HPACK_STATIC("accept-encoding", "gzip, deflate"),
+    HPACK_STATIC("accept-language", ""),
+    HPACK_STATIC("accept-ranges", ""),
+    HPACK_STATIC("accept", ""),
+    HPACK_STATIC("access-control-allow-origin", ""),
+    HPACK_STATIC("age", ""),
+    HPACK_STATIC("allow", ""),
+    HPACK_STATIC("authorization", ""),
+    HPACK_STATIC("cache-control", ""),
+    HPACK_STATIC("content-disposition", ""),
+    HPACK_STATIC("content-encoding", ""),
+    HPACK_STATIC("content-language", ""),
+    HPACK_STATIC("content-length", ""),
+    HPACK_STATIC("content-location", ""),
+    HPACK_STATIC("content-range", ""),
+    HPACK_STATIC("content-type", ""),
+    HPACK_STATIC("cookie", ""),
+    HPACK_STATIC("date", ""),
+    HPACK_STATIC("etag", ""),
+    HPACK_STATIC("expect", ""),
+    HPACK_STATIC("expires", ""),
+    HPACK_STATIC("from", ""),
+    HPACK_STATIC("host", ""),
+    HPACK_STATIC("if-match", ""),
+    HPACK_STATIC("if-modified-since", ""),
+    HPACK_STATIC("if-none-match", ""),
+    HPACK_STATIC("if-range", ""),
+    HPACK_STATIC("if-unmodified-since", ""),
+    HPACK_STATIC("last-modified", ""),
+    HPACK_STATIC("link", ""),
+    HPACK_STATIC("location", ""),
+    HPACK_STATIC("max-forwards", ""),
+    HPACK_STATIC("proxy-authenticate", ""),
+    HPACK_STATIC("proxy-authorization", ""),
+    HPACK_STATIC("range", ""),
+    HPACK_STATIC("referer", ""),
+    HPACK_STATIC("refresh", ""),
+    HPACK_STATIC("retry-after", ""),
+    HPACK_STATIC("server", ""),
+    HPACK_STATIC("set-cookie", ""),
+    HPACK_STATIC("strict-transport-security", ""),
+    HPACK_STATIC("transfer-encoding", ""),
+    HPACK_STATIC("user-agent", ""),
+    HPACK_STATIC("vary", ""),
+    HPACK_STATIC("via", ""),
+    HPACK_STATIC("www-authenticate", ""),
+};
+
+#undef HPACK_STATIC
+
+#define HPACK_STATIC_COUNT (sizeof(hpack_static) / sizeof(hpack_static[0]) - 1)
+
+/* *****************************************************************************
+Huffman decoding (RFC 7541, Appendix B)
+
+The Huffman code is canonical, so codes of the same length are sequential and
+a code can be decoded by testing it against the range of each length.
+***************************************************************************** */
+
+/* symbols ordered by their code (codes of the same length are sequential) */
+static const uint16_t hpack_huffman_syms[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46,
+    47, 51, 52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102,
+    103, 104, 108, 109, 110, 112, 114, 117, 58, 66, 67, 68, 69, 70,
+    71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84,
+    85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42,
+    44, 59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92, 195, 208,
+    128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154,
+    156, 160, 163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190,
+    196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140, 141, 143, 147,
+    149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171, 206,
+    215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+    210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214,
+    221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18,
+    19, 20, 21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+/* the first code of each length */
+static const uint32_t hpack_huffman_first[31] = {
+    0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+    0x14, 0x5c, 0xf8, 0x0, 0x3f8, 0x7fa,
+    0xffa, 0x1ff8, 0x3ffc, 0x7ffc, 0x0, 0x0,
+    0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8,
+    0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0,
+    0x3ffffffc,
+};
+/* the number of codes of each length */
+static const uint16_t hpack_huffman_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+/* the position of the first code of each length in `hpack_huffman_syms` */
+static const uint16_t hpack_huffman_offset[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92,
+    0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253,
+};
+
+/* decodes a Huffman encoded string, returning its length (or -1 on error). */
+static ssize_t hpack_huffman_decode(char *dest, uint8_t *data, size_t len) {
+  char *const start = dest;
+  uint32_t code = 0;
+  uint8_t bits = 0;
+  for (size_t i = 0; i < len; ++i) {
+    for (int b = 7; b >= 0; --b) {
+      code = (code << 1) | ((data[i] >> b) & 1);
+      ++bits;
+      if (code - hpack_huffman_first[bits] < hpack_huffman_count[bits]) {
+        uint16_t sym = hpack_huffman_syms[hpack_huffman_offset[bits] + code -
+                                          hpack_huffman_first[bits]];
+        if (sym == 256)
+          return -1; /* EOS is an error */
+        *(dest++) = (char)sym;
+        code = 0;
+        bits = 0;
+      } else if (bits == 30) {
+        return -1;
+      }
+    }
+  }
+  /* padding MUST be shorter than 8 bits and match the EOS prefix (all ones) */
+  if (bits > 7 || code != ((1U << bits) - 1))
+    return -1;
+  return dest - start;
+}
+
+/* *****************************************************************************
+Primitive types (RFC 7541, section 5)
+***************************************************************************** */
+
+/* decodes an integer, returning -1 on error. */
+static inline int64_t hpack_int_decode(uint8_t **pos, uint8_t *end,
+                                       uint8_t prefix) {
+  if (*pos >= end)
+    return -1;
+  const uint8_t mask = (uint8_t)((1U << prefix) - 1);
+  int64_t i = **pos & mask;
+  ++(*pos);
+  if (i < mask)
+    return i;
+  uint8_t shift = 0;
+  while (*pos < end) {
+    uint8_t c = **pos;
+    ++(*pos);
+    i += (int64_t)(c & 127) << shift;
+    if (!(c & 128))
+      return i;
+    shift += 7;
+    if (shift > 28)
+      return -1; /* we never need values this big */
+  }
+  return -1;
+}
+
+size_t hpack_int_encode(uint8_t *dest, uint64_t i, uint8_t prefix,
+                        uint8_t flags) {
+  const uint8_t mask = (uint8_t)((1U << prefix) - 1);
+  if (i < mask) {
+    dest[0] = flags | (uint8_t)i;
+    return 1;
+  }
+  size_t len = 1;
+  dest[0] = flags | mask;
+  i -= mask;
+  while (i >= 128) {
+    dest[len++] = (uint8_t)((i & 127) | 128);
+    i >>= 7;
+  }
+  dest[len++] = (uint8_t)i;
+  return len;
+}
+
+/* decodes a string, pointing `str` to the raw data or to the decoded data. */
+static inline ssize_t hpack_str_decode(hpack_table_s *t, size_t *buf_pos,
+                                       char **str, uint8_t **pos,
+                                       uint8_t *end) {
+  if (*pos >= end)
+    return -1;
+  const uint8_t huffman = (**pos & 128);
+  int64_t len = hpack_int_decode(pos, end, 7);
+  if (len < 0 || len > end - *pos)
+    return -1;
+  uint8_t *data = *pos;
+  *pos += len;
+  if (!huffman) {
+    *str = (char *)data;
+    return len;
+  }
+  /* the buffer was allocated for the whole block (see `hpack_decode`) */
+  ssize_t i = hpack_huffman_decode(t->buf + *buf_pos, data, len);
+  if (i < 0)
+    return -1;
+  *str = t->buf + *buf_pos;
+  *buf_pos += i;
+  return i;
+}
+
+/* *****************************************************************************
+The dynamic table (RFC 7541, section 4)
+***************************************************************************** */
+
+void hpack_table_init(hpack_table_s *t, size_t limit) {
+  *t = (hpack_table_s){
+      .entries = malloc(sizeof(*t->entries) * ((limit >> 5) + 1)),
+      .max_size = limit,
+      .limit = limit,
+  };
+}
+
+void hpack_table_destroy(hpack_table_s *t) {
+  for (size_t i = 0; i < t->count; ++i)
+    free(t->entries[i]);
+  free(t->entries);
+  free(t->buf);
+  *t = (hpack_table_s){.entries = NULL};
+}
+
+/* evicts the oldest entries until the table fits `size` */
+static void hpack_table_evict(hpack_table_s *t, size_t size) {
+  size_t i = 0;
+  while (i < t->count && t->size > size) {
+    t->size -= t->entries[i]->name_len + t->entries[i]->value_len + 32;
+    free(t->entries[i]);
+    ++i;
+  }
+  if (!i)
+    return;
+  t->count -= i;
+  memmove(t->entries, t->entries + i, t->count * sizeof(*t->entries));
+}
+
+/* adds an entry (or frees it, if it's too big). Returns -1 if not added. */
+static int hpack_table_add(hpack_table_s *t, hpack_entry_s *e) {
+  const size_t size = e->name_len + e->value_len + 32;
+  if (size > t->max_size) {
+    /* adding an entry that's too big empties the table */
+    hpack_table_evict(t, 0);
+    return -1;
+  }
+  hpack_table_evict(t, t->max_size - size);
+  t->entries[t->count++] = e;
+  t->size += size;
+  return 0;
+}
+
+/* finds an entry by index (static or dynamic). Returns -1 on error. */
+static inline int hpack_table_get(hpack_table_s *t, size_t index, char **name,
+                                  size_t *name_len, char **value,
+                                  size_t *value_len) {
+  if (!index)
+    return -1;
+  if (index <= HPACK_STATIC_COUNT) {
+    *name = (char *)hpack_static[index].name;
+    *name_len = hpack_static[index].name_len;
+    *value = (char *)hpack_static[index].value;
+    *value_len = hpack_static[index].value_len;
+    return 0;
+  }
+  index -= HPACK_STATIC_COUNT + 1;
+  if (index >= t->count)
+    return -1;
+  hpack_entry_s *e = t->entries[t->count - 1 - index];
+  *name = e->data;
+  *name_len = e->name_len;
+  *value = e->data + e->name_len;
+  *value_len = e->value_len;
+  return 0;
+}
+
+/* *****************************************************************************
+Decoding
+***************************************************************************** */
+
+int hpack_decode(hpack_table_s *t, uint8_t *data, size_t len,
+                 void (*on_header)(void *udata, char *name, size_t name_len,
+                                   char *value, size_t value_len),
+                 void *udata) {
+  uint8_t *pos = data;
+  uint8_t *const end = data + len;
+  /* Huffman decoding grows strings by up to 8/5 */
+  const size_t capa = ((len * 8) / 5) + 16;
+  if (t->buf_capa < capa) {
+    char *tmp = realloc(t->buf, capa);
+    if (!tmp)
+      return -1;
+    t->buf = tmp;
+    t->buf_capa = capa;
+  }
+  while (pos < end) {
+    char *name, *value;
+    size_t name_len, value_len;
+    size_t buf_pos = 0;
+    ssize_t i;
+    if (*pos & 128) {
+      /* indexed header field */
+      int64_t index = hpack_int_decode(&pos, end, 7);
+      if (index < 0 || hpack_table_get(t, (size_t)index, &name, &name_len,
+                                       &value, &value_len))
+        return -1;
+      on_header(udata, name, name_len, value, value_len);
+      continue;
+    }
+    if ((*pos & 224) == 32) {
+      /* dynamic table size update */
+      int64_t size = hpack_int_decode(&pos, end, 5);
+      if (size < 0 || (size_t)size > t->limit)
+        return -1;
+      t->max_size = (size_t)size;
+      hpack_table_evict(t, t->max_size);
+      continue;
+    }
+    /* a literal (0x40 == incremental indexing, otherwise 4 bit prefix) */
+    const uint8_t indexing = ((*pos & 192) == 64);
+    int64_t index = hpack_int_decode(&pos, end, (indexing ? 6 : 4));
+    if (index < 0)
+      return -1;
+    if (index) {
+      if (hpack_table_get(t, (size_t)index, &name, &name_len, &value,
+                          &value_len))
+        return -1;
+    } else {
+      i = hpack_str_decode(t, &buf_pos, &name, &pos, end);
+      if (i < 0)
+        return -1;
+      name_len = (size_t)i;
+    }
+    i = hpack_str_decode(t, &buf_pos, &value, &pos, end);
+    if (i < 0)
+      return -1;
+    value_len = (size_t)i;
+    if (!indexing) {
+      on_header(udata, name, name_len, value, value_len);
+      continue;
+    }
+    /* copy before adding, as eviction might free an indexed name */
+    hpack_entry_s *e = malloc(sizeof(*e) + name_len + value_len);
+    if (!e)
+      return -1;
+    e->name_len = (uint32_t)name_len;
+    e->value_len = (uint32_t)value_len;
+    memcpy(e->data, name, name_len);
+    memcpy(e->data + name_len, value, value_len);
+    on_header(udata, e->data, name_len, e->data + name_len, value_len);
+    if (hpack_table_add(t, e))
+      free(e);
+  }
+  return 0;
+}
+
+/* *****************************************************************************
+Encoding
+***************************************************************************** */
+
+/* writes a string literal (no Huffman encoding) */
+static inline size_t hpack_str_encode(uint8_t *dest, const char *str,
+                                      size_t len) {
+  size_t i = hpack_int_encode(dest, len, 7, 0);
+  memcpy(dest + i, str, len);
+  return i + len;
+}
+
+size_t hpack_encode(uint8_t *dest, const char *name, size_t name_len,
+                    const char *value, size_t value_len) {
+  size_t index = 0;
+  for (size_t i = 1; i <= HPACK_STATIC_COUNT; ++i) {
+    if (hpack_static[i].name_len != name_len ||
+        memcmp(hpack_static[i].name, name, name_len))
+      continue;
+    if (!index)
+      index = i;
+    if (hpack_static[i].value_len == value_len && value_len &&
+        !memcmp(hpack_static[i].value, value, value_len)) {
+      /* indexed header field */
+      return hpack_int_encode(dest, i, 7, 128);
+    }
+  }
+  /* literal header field without indexing */
+  size_t len = hpack_int_encode(dest, index, 4, 0);
+  if (!index)
+    len += hpack_str_encode(dest + len, name, name_len);
+  len += hpack_str_encode(dest + len, value, value_len);
+  return len;
+}
+
+/* *****************************************************************************
+Testing
+***************************************************************************** */
+
+#ifdef DEBUG
+#include <stdio.h>
+
+#define TEST_ASSERT(cond, ...)                                                 \
+  if (!(cond)) {                                                               \
+    fprintf(stderr, "* " __VA_ARGS__);                                         \
+    fprintf(stderr, "Testing failed.\n");                                      \
+    exit(-1);                                                                  \
+  }
+
+/* collects the decoded headers as "name: value\n" lines */
+typedef struct {
+  char buf[512];
+  size_t len;
+} hpack_test_headers_s;
+
+static void hpack_test_on_header(void *udata, char *name, size_t name_len,
+                                 char *value, size_t value_len) {
+  hpack_test_headers_s *h = udata;
+  if (h->len + name_len + value_len + 3 >= sizeof(h->buf))
+    return;
+  memcpy(h->buf + h->len, name, name_len);
+  h->len += name_len;
+  memcpy(h->buf + h->len, ": ", 2);
+  h->len += 2;
+  memcpy(h->buf + h->len, value, value_len);
+  h->len += value_len;
+  h->buf[h->len++] = '\n';
+  h->buf[h->len] = 0;
+}
+
+/* decodes a header block, testing the headers and the table's state */
+static void hpack_test_block(hpack_table_s *t, const char *name,
+                             uint8_t *data, size_t len, const char *expected,
+                             size_t count, size_t size, const char *newest) {
+  hpack_test_headers_s h = {.len = 0};
+  TEST_ASSERT(!hpack_decode(t, data, len, hpack_test_on_header, &h),
+              "HPACK %s: decoding failed\n", name);
+  TEST_ASSERT(!strcmp(h.buf, expected),
+              "HPACK %s: headers mismatch:\n%s\nexpected:\n%s\n", name, h.buf,
+              expected);
+  TEST_ASSERT(t->count == count && t->size == size,
+              "HPACK %s: table state error (%zu entries, %zu bytes)\n", name,
+              t->count, t->size);
+  if (newest) {
+    hpack_entry_s *e = t->entries[t->count - 1];
+    TEST_ASSERT(e->name_len + e->value_len + 1 == strlen(newest) &&
+                    !memcmp(e->data, newest, e->name_len) &&
+                    !memcmp(e->data + e->name_len, newest + e->name_len + 1,
+                            e->value_len),
+                "HPACK %s: newest table entry should be %s\n", name, newest);
+  }
+}
+
+/* decoding a (broken) header block MUST fail */
+static void hpack_test_error(const char *name, uint8_t *data, size_t len) {
+  hpack_table_s t;
+  hpack_test_headers_s h = {.len = 0};
+  hpack_table_init(&t, HPACK_TABLE_SIZE);
+  TEST_ASSERT(hpack_decode(&t, data, len, hpack_test_on_header, &h) == -1,
+              "HPACK %s: error not detected\n", name);
+  hpack_table_destroy(&t);
+}
+
+void hpack_test(void) {
+  fprintf(stderr, "=== Testing HPACK\n");
+  /* RFC 7541, Appendix C.1 (integer representation) */
+  {
+    struct {
+      uint64_t i;
+      uint8_t prefix;
+      uint8_t len;
+      uint8_t data[6];
+    } ints[] = {
+        {10, 5, 1, {10}},
+        {1337, 5, 3, {31, 154, 10}},
+        {42, 8, 1, {42}},
+        /* edges: the prefix's limit and the continuation byte limits */
+        {30, 5, 1, {30}},
+        {31, 5, 2, {31, 0}},
+        {31 + 127, 5, 2, {31, 127}},
+        {31 + 128, 5, 3, {31, 128, 1}},
+        {126, 7, 1, {126}},
+        {127, 7, 2, {127, 0}},
+        {(1UL << 28) - 1 + 31, 5, 5, {31, 255, 255, 255, 127}},
+    };
+    for (size_t n = 0; n < sizeof(ints) / sizeof(ints[0]); ++n) {
+      uint8_t buf[16];
+      size_t len = hpack_int_encode(buf, ints[n].i, ints[n].prefix, 0);
+      TEST_ASSERT(len == ints[n].len && !memcmp(buf, ints[n].data, len),
+                  "HPACK integer %lu (%u bit prefix) encoding error\n",
+                  (unsigned long)ints[n].i, ints[n].prefix);
+      /* the decoder ignores the flags (the bits above the prefix) */
+      if (ints[n].prefix < 8)
+        buf[0] |= (uint8_t)(0xFF << ints[n].prefix);
+      uint8_t *pos = buf;
+      TEST_ASSERT(hpack_int_decode(&pos, buf + len, ints[n].prefix) ==
+                          (int64_t)ints[n].i &&
+                      pos == buf + len,
+                  "HPACK integer %lu (%u bit prefix) decoding error\n",
+                  (unsigned long)ints[n].i, ints[n].prefix);
+    }
+    /* truncated integers and values that are too big */
+    uint8_t truncated[] = {31, 154};
+    uint8_t *pos = truncated;
+    TEST_ASSERT(hpack_int_decode(&pos, truncated + 2, 5) == -1,
+                "HPACK truncated integer not detected\n");
+    uint8_t big[] = {31, 255, 255, 255, 255, 255, 1};
+    pos = big;
+    TEST_ASSERT(hpack_int_decode(&pos, big + sizeof(big), 5) == -1,
+                "HPACK integer overflow not detected\n");
+    pos = big;
+    TEST_ASSERT(hpack_int_decode(&pos, big, 5) == -1,
+                "HPACK empty integer not detected\n");
+  }
+  /* RFC 7541, Appendix C.3 (requests without Huffman coding) */
+  {
+    hpack_table_s t;
+    hpack_table_init(&t, HPACK_TABLE_SIZE);
+    uint8_t c31[] = {0x82, 0x86, 0x84, 0x41, 0x0f, 0x77, 0x77, 0x77,
+                     0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,
+                     0x2e, 0x63, 0x6f, 0x6d};
+    hpack_test_block(&t, "C.3.1", c31, sizeof(c31),
+                     ":method: GET\n:scheme: http\n:path: /\n"
+                     ":authority: www.example.com\n",
+                     1, 57, ":authority:www.example.com");
+    uint8_t c32[] = {0x82, 0x86, 0x84, 0xbe, 0x58, 0x08, 0x6e,
+                     0x6f, 0x2d, 0x63, 0x61, 0x63, 0x68, 0x65};
+    hpack_test_block(&t, "C.3.2", c32, sizeof(c32),
+                     ":method: GET\n:scheme: http\n:path: /\n"
+                     ":authority: www.example.com\ncache-control: no-cache\n",
+                     2, 110, "cache-control:no-cache");
+    uint8_t c33[] = {0x82, 0x87, 0x85, 0xbf, 0x40, 0x0a, 0x63, 0x75,
+                     0x73, 0x74, 0x6f, 0x6d, 0x2d, 0x6b, 0x65, 0x79,
+                     0x0c, 0x63, 0x75, 0x73, 0x74, 0x6f, 0x6d, 0x2d,
+                     0x76, 0x61, 0x6c, 0x75, 0x65};
+    hpack_test_block(&t, "C.3.3", c33, sizeof(c33),
+                     ":method: GET\n:scheme: https\n:path: /index.html\n"
+                     ":authority: www.example.com\ncustom-key: custom-value\n",
+                     3, 164, "custom-key:custom-value");
+    hpack_table_destroy(&t);
+  }
+  /* RFC 7541, Appendix C.4 (requests with Huffman coding) */
+  {
+    hpack_table_s t;
+    hpack_table_init(&t, HPACK_TABLE_SIZE);
+    uint8_t c41[] = {0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2,
+                     0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4,
+                     0xff};
+    hpack_test_block(&t, "C.4.1", c41, sizeof(c41),
+                     ":method: GET\n:scheme: http\n:path: /\n"
+                     ":authority: www.example.com\n",
+                     1, 57, ":authority:www.example.com");
+    uint8_t c42[] = {0x82, 0x86, 0x84, 0xbe, 0x58, 0x86,
+                     0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf};
+    hpack_test_block(&t, "C.4.2", c42, sizeof(c42),
+                     ":method: GET\n:scheme: http\n:path: /\n"
+                     ":authority: www.example.com\ncache-control: no-cache\n",
+                     2, 110, "cache-control:no-cache");
+    uint8_t c43[] = {0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8,
+                     0x49, 0xe9, 0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25,
+                     0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf};
+    hpack_test_block(&t, "C.4.3", c43, sizeof(c43),
+                     ":method: GET\n:scheme: https\n:path: /index.html\n"
+                     ":authority: www.example.com\ncustom-key: custom-value\n",
+                     3, 164, "custom-key:custom-value");
+    /* a size update evicts the oldest entries (57, 53 and 54 bytes) */
+    uint8_t update[] = {0x3f, 0x1d}; /* 31 + 29 = 60 */
+    hpack_test_block(&t, "size update", update, sizeof(update), "", 1, 54,
+                     "custom-key:custom-value");
+    /* ... and an entry that's too big for the table empties it */
+    uint8_t big[] = {0x40, 0x01, 0x61, 0x7f, 0x00}; /* "a" => 127 x "b" */
+    uint8_t block[sizeof(big) + 127];
+    memcpy(block, big, sizeof(big));
+    memset(block + sizeof(big), 'b', 127);
+    hpack_test_headers_s h = {.len = 0};
+    TEST_ASSERT(!hpack_decode(&t, block, sizeof(block), hpack_test_on_header,
+                              &h) &&
+                    !t.count && !t.size,
+                "HPACK oversized entry should empty the table\n");
+    hpack_table_destroy(&t);
+  }
+  /* Huffman coding errors (RFC 7541, section 5.2) */
+  {
+    /* "a" is 00011, padded with ones */
+    uint8_t valid[] = {0x00, 0x81, 0x1f, 0x81, 0x1f};
+    hpack_test_headers_s h = {.len = 0};
+    hpack_table_s t;
+    hpack_table_init(&t, HPACK_TABLE_SIZE);
+    TEST_ASSERT(!hpack_decode(&t, valid, sizeof(valid), hpack_test_on_header,
+                              &h) &&
+                    !strcmp(h.buf, "a: a\n"),
+                "HPACK Huffman padding rejected (%s)\n", h.buf);
+    hpack_table_destroy(&t);
+    /* padding that isn't the EOS prefix (zeros) */
+    uint8_t zeros[] = {0x00, 0x81, 0x18, 0x81, 0x1f};
+    hpack_test_error("Huffman zero padding", zeros, sizeof(zeros));
+    /* padding that's longer than 7 bits */
+    uint8_t longer[] = {0x00, 0x82, 0x1f, 0xff, 0x81, 0x1f};
+    hpack_test_error("Huffman long padding", longer, sizeof(longer));
+    /* an encoded EOS symbol (30 bits of ones) */
+    uint8_t eos[] = {0x00, 0x84, 0xff, 0xff, 0xff, 0xff, 0x81, 0x1f};
+    hpack_test_error("Huffman EOS", eos, sizeof(eos));
+  }
+  /* other errors */
+  {
+    uint8_t index0[] = {0x80};
+    hpack_test_error("index 0", index0, sizeof(index0));
+    uint8_t index62[] = {0xbe}; /* the dynamic table is empty */
+    hpack_test_error("missing dynamic index", index62, sizeof(index62));
+    uint8_t update[] = {0x3f, 0xe2, 0x1f}; /* 4097 */
+    hpack_test_error("size update over the limit", update, sizeof(update));
+    uint8_t truncated[] = {0x00, 0x05, 0x61, 0x61};
+    hpack_test_error("truncated string", truncated, sizeof(truncated));
+    uint8_t no_value[] = {0x00, 0x01, 0x61};
+    hpack_test_error("missing value", no_value, sizeof(no_value));
+  }
+  /* encoding (the decoder should restore the headers) */
+  {
+    uint8_t buf[256];
+    size_t len = 0;
+    len += hpack_encode(buf + len, ":status", 7, "200", 3);
+    TEST_ASSERT(len == 1 && buf[0] == 0x88,
+                "HPACK static table matches should be indexed\n");
+    len += hpack_encode(buf + len, ":status", 7, "302", 3);
+    len += hpack_encode(buf + len, "content-type", 12, "text/html", 9);
+    len += hpack_encode(buf + len, "x-custom", 8, "", 0);
+    hpack_table_s t;
+    hpack_table_init(&t, HPACK_TABLE_SIZE);
+    hpack_test_block(&t, "encoding", buf, len,
+                     ":status: 200\n:status: 302\ncontent-type: text/html\n"
+                     "x-custom: \n",
+                     0, 0, NULL);
+    hpack_table_destroy(&t);
+  }
+  fprintf(stderr, "* HPACK passed.\n");
+}
+
+#undef TEST_ASSERT
+#endif
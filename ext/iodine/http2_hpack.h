@@ -0,0 +1,94 @@
+#ifndef H_HTTP2_HPACK_H
+/*
+Copyright: Boaz Segev, 2017-2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+
+/**
+An HPACK (RFC 7541) header compression implementation for the HTTP/2 protocol.
+
+The decoder supports the complete specification (the static and dynamic tables
+and Huffman encoded strings).
+
+The encoder doesn't use the dynamic table and never Huffman encodes strings. It
+indexes static table matches and writes any other header as a literal (this is
+always valid, regardless of the peer's table size).
+*/
+#define H_HTTP2_HPACK_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#ifndef HPACK_TABLE_SIZE
+/** The (default) HPACK dynamic table size limit (SETTINGS_HEADER_TABLE_SIZE) */
+#define HPACK_TABLE_SIZE 4096
+#endif
+
+/** A dynamic table entry, holding the name followed by the value. */
+typedef struct hpack_entry_s {
+  uint32_t name_len;
+  uint32_t value_len;
+  char data[];
+} hpack_entry_s;
+
+/** The HPACK decoding context (the dynamic table). */
+typedef struct {
+  /** the entries, ordered from the oldest to the newest */
+  hpack_entry_s **entries;
+  size_t count;
+  /** the table's size, as calculated by RFC 7541 (each entry adds 32 bytes) */
+  size_t size;
+  /** the size limit, as set by the encoder's size updates */
+  size_t max_size;
+  /** the size limit set by the protocol (SETTINGS_HEADER_TABLE_SIZE) */
+  size_t limit;
+  /** a buffer for decoded Huffman strings */
+  char *buf;
+  size_t buf_capa;
+} hpack_table_s;
+
+/** Initializes the dynamic table with the protocol's table size limit. */
+void hpack_table_init(hpack_table_s *t, size_t limit);
+
+/** Frees the dynamic table's resources. */
+void hpack_table_destroy(hpack_table_s *t);
+
+/**
+ * Decodes a complete header block, calling `on_header` for every header field.
+ *
+ * The `name` and `value` strings are only valid during the callback.
+ *
+ * Returns 0 on success or -1 on a compression error (the connection MUST be
+ * closed, as the dynamic table can't be trusted).
+ */
+int hpack_decode(hpack_table_s *t, uint8_t *data, size_t len,
+                 void (*on_header)(void *udata, char *name, size_t name_len,
+                                   char *value, size_t value_len),
+                 void *udata);
+
+/**
+ * Encodes a header field, returning the number of bytes written to `dest`.
+ *
+ * `dest` MUST have at least `name_len + value_len + 12` bytes available.
+ *
+ * The `name` MUST be lower case.
+ */
+size_t hpack_encode(uint8_t *dest, const char *name, size_t name_len,
+                    const char *value, size_t value_len);
+
+/**
+ * Encodes an integer with an `prefix` bit prefix, setting the first byte's
+ * remaining (high) bits to `flags`. Returns the number of bytes written.
+ */
+size_t hpack_int_encode(uint8_t *dest, uint64_t i, uint8_t prefix,
+                        uint8_t flags);
+
+#ifdef DEBUG
+/** Tests the HPACK implementation (including the RFC 7541 examples). */
+void hpack_test(void);
+#endif
+
+#endif
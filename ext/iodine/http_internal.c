@@ -7,6 +7,8 @@ Feel free to copy, use and enjoy according to the license provided.
 #include "http_internal.h"
 
 #include "fio_mem.h"
+#include "fio_stats.h"
+#include "fio_trace.h"
 
 #include "http1.h"
 
@@ -15,9 +17,9 @@ Internal Request / Response Handlers
 ***************************************************************************** */
 
 static uint64_t http_upgrade_hash = 0;
-/** Use this function to handle HTTP requests.*/
-void http_on_request_handler______internal(http_s *h,
-                                           http_settings_s *settings) {
+
+/* handles a request (see `http_on_request_handler______internal`) */
+static void http_handle_request(http_s *h, http_settings_s *settings) {
   if (!http_upgrade_hash)
     http_upgrade_hash = fio_siphash("upgrade", 7);
   h->udata = settings->udata;
@@ -37,8 +39,12 @@ void http_on_request_handler______internal(http_s *h,
   }
 
   FIOBJ t = fiobj_hash_get2(h->headers, http_upgrade_hash);
-  if (t)
-    goto upgrade;
+  if (t) {
+    fio_cstr_s val = fiobj_obj2cstr(t);
+    /* an HTTP/2 upgrade that wasn't performed is ignored (RFC 7540, 3.2) */
+    if (val.len < 2 || val.data[0] != 'h' || val.data[1] != '2')
+      goto upgrade;
+  }
 
   if (fiobj_iseq(
           fiobj_hash_get2(h->headers, fiobj_obj2hash(HTTP_HEADER_ACCEPT)),
@@ -58,12 +64,9 @@ void http_on_request_handler______internal(http_s *h,
 upgrade:
   if (1) {
     fiobj_dup(t); /* allow upgrade name access after http_finish */
+    fiobj_str_unstatic(t); /* the request's arena is reset by http_finish */
     fio_cstr_s val = fiobj_obj2cstr(t);
-    if (val.data[0] == 'h' && val.data[1] == '2') {
-      http_send_error(h, 400);
-    } else {
-      settings->on_upgrade(h, val.data, val.len);
-    }
+    settings->on_upgrade(h, val.data, val.len);
     fiobj_free(t);
     return;
   }
@@ -72,6 +75,53 @@ eventsource:
   return;
 }
 
+/* *****************************************************************************
+Request latency statistics
+***************************************************************************** */
+
+typedef struct {
+  /* the beginning of the current phase */
+  uint64_t mark;
+  /* 0 == no handler marks, 1 == handler running, 2 == handler returned */
+  uint8_t state;
+} http_stats_timing_s;
+
+/* requests are handled synchronously, but they might nest (pipelining) */
+static __thread http_stats_timing_s http_stats_timing;
+
+void http_stats_handler_start(void) {
+  FIO_TRACE_MARK(handler__start, FIO_TRACE_HANDLER_START);
+  uint64_t now = fio_stats_now();
+  fio_stats_record(FIO_STATS_HTTP_QUEUE, now - http_stats_timing.mark);
+  http_stats_timing = (http_stats_timing_s){.mark = now, .state = 1};
+}
+
+void http_stats_handler_end(void) {
+  FIO_TRACE_MARK(handler__end, FIO_TRACE_HANDLER_END);
+  if (http_stats_timing.state != 1)
+    return;
+  uint64_t now = fio_stats_now();
+  fio_stats_record(FIO_STATS_HTTP_HANDLER, now - http_stats_timing.mark);
+  http_stats_timing = (http_stats_timing_s){.mark = now, .state = 2};
+}
+
+/** Use this function to handle HTTP requests.*/
+void http_on_request_handler______internal(http_s *h,
+                                           http_settings_s *settings) {
+  http_stats_timing_s prev = http_stats_timing;
+  uint64_t start = fio_stats_now();
+  http_stats_timing = (http_stats_timing_s){.mark = start};
+  http_handle_request(h, settings);
+  uint64_t now = fio_stats_now();
+  if (http_stats_timing.state == 2)
+    fio_stats_record(FIO_STATS_HTTP_FLUSH, now - http_stats_timing.mark);
+  else if (!http_stats_timing.state)
+    fio_stats_record(FIO_STATS_HTTP_HANDLER, now - http_stats_timing.mark);
+  /* a nested request's time isn't a part of the outer request's phase */
+  prev.mark += now - start;
+  http_stats_timing = prev;
+}
+
 void http_on_response_handler______internal(http_s *h,
                                             http_settings_s *settings) {
   if (!http_upgrade_hash)
@@ -103,12 +153,120 @@ int http_send_error2(size_t error, intptr_t uuid, http_settings_s *settings) {
   return ret;
 }
 
+/* *****************************************************************************
+Request arena
+***************************************************************************** */
+
+/* a String in the arena (the arena holds a reference to the String object) */
+typedef struct http_arena_str_s {
+  struct http_arena_str_s *next;
+  FIOBJ str;
+  char data[];
+} http_arena_str_s;
+
+/* an arena chunk - the first chunk is the arena */
+typedef struct http_arena_s {
+  /* the arena's Strings (set only for the first chunk) */
+  http_arena_str_s *strings;
+  /* additional chunks (released by `http_arena_reset`) */
+  struct http_arena_s *more;
+  size_t pos;
+  size_t capa;
+  char mem[];
+} http_arena_s;
+
+/* returns a chunk with at least `size` bytes available */
+static http_arena_s *http_arena_reserve(http_s *h, size_t size) {
+  http_arena_s *arena = h->private_data.arena;
+  if (!arena) {
+    /* the arena lives as long as the connection, use the system's allocator */
+    arena = malloc(sizeof(*arena) + HTTP_ARENA_CHUNK);
+    HTTP_ASSERT(arena, "request arena allocation failed");
+    *arena = (http_arena_s){.capa = HTTP_ARENA_CHUNK};
+    h->private_data.arena = arena;
+  }
+  if (arena->capa - arena->pos >= size)
+    return arena;
+  if (arena->more && arena->more->capa - arena->more->pos >= size)
+    return arena->more;
+  size_t capa = size > HTTP_ARENA_CHUNK ? size : HTTP_ARENA_CHUNK;
+  http_arena_s *chunk = malloc(sizeof(*chunk) + capa);
+  HTTP_ASSERT(chunk, "request arena allocation failed");
+  *chunk = (http_arena_s){.more = arena->more, .capa = capa};
+  arena->more = chunk;
+  return chunk;
+}
+
+FIOBJ http_arena_str(http_s *h, const char *data, size_t len, uint8_t decode) {
+  /* keep records pointer aligned */
+  const size_t size = (sizeof(http_arena_str_s) + len + 1 + 15) & (~(size_t)15);
+  http_arena_s *chunk = http_arena_reserve(h, size);
+  http_arena_str_s *s = (http_arena_str_s *)(chunk->mem + chunk->pos);
+  if (decode) {
+    ssize_t tmp = http_decode_url(s->data, data, len);
+    len = tmp < 0 ? 0 : (size_t)tmp;
+    s->data[len] = 0;
+  } else {
+    memcpy(s->data, data, len);
+    s->data[len] = 0;
+  }
+  FIOBJ str = fiobj_str_static(s->data, len);
+  /* request data stays with the connection (see `http_s_share`) */
+  fiobj_confine(str);
+  if (fiobj_obj2cstr(str).data != s->data) {
+    /* short Strings are copied into the String object */
+    return str;
+  }
+  chunk->pos += size;
+  http_arena_s *arena = h->private_data.arena;
+  s->str = fiobj_dup(str);
+  s->next = arena->strings;
+  arena->strings = s;
+  return str;
+}
+
+void http_arena_reset(void *arena_) {
+  http_arena_s *arena = arena_;
+  if (!arena)
+    return;
+  /* Strings are never edited here, since other threads might access them */
+  for (http_arena_str_s *s = arena->strings; s; s = s->next)
+    fiobj_free(s->str);
+  while (arena->more) {
+    http_arena_s *chunk = arena->more;
+    arena->more = chunk->more;
+    free(chunk);
+  }
+  arena->strings = NULL;
+  arena->pos = 0;
+}
+
+static int http_arena_detach_task(FIOBJ o, void *ignr) {
+  fiobj_str_unstatic(o);
+  return 0;
+  (void)ignr;
+}
+
+void http_arena_detach(FIOBJ o) {
+  fiobj_each2(o, http_arena_detach_task, NULL);
+}
+
+void http_arena_free(void *arena) {
+  if (!arena)
+    return;
+  http_arena_reset(arena);
+  free(arena);
+}
+
 /* *****************************************************************************
 Library initialization
 ***************************************************************************** */
 
 FIOBJ HTTP_HEADER_ACCEPT;
 FIOBJ HTTP_HEADER_ACCEPT_RANGES;
+FIOBJ HTTP_HEADER_ACCEPT_ENCODING;
+FIOBJ HTTP_HEADER_ACCEPT_LANGUAGE;
+FIOBJ HTTP_HEADER_AUTHORIZATION;
 FIOBJ HTTP_HEADER_CACHE_CONTROL;
 FIOBJ HTTP_HEADER_CONNECTION;
 FIOBJ HTTP_HEADER_CONTENT_ENCODING;
@@ -119,13 +277,26 @@ FIOBJ HTTP_HEADER_COOKIE;
 FIOBJ HTTP_HEADER_DATE;
 FIOBJ HTTP_HEADER_ETAG;
 FIOBJ HTTP_HEADER_HOST;
+FIOBJ HTTP_HEADER_IF_MODIFIED_SINCE;
+FIOBJ HTTP_HEADER_IF_NONE_MATCH;
 FIOBJ HTTP_HEADER_LAST_MODIFIED;
 FIOBJ HTTP_HEADER_ORIGIN;
+FIOBJ HTTP_HEADER_PRAGMA;
+FIOBJ HTTP_HEADER_RANGE;
+FIOBJ HTTP_HEADER_REFERER;
 FIOBJ HTTP_HEADER_SET_COOKIE;
+FIOBJ HTTP_HEADER_TRANSFER_ENCODING;
 FIOBJ HTTP_HEADER_UPGRADE;
+FIOBJ HTTP_HEADER_UPGRADE_INSECURE_REQUESTS;
+FIOBJ HTTP_HEADER_USER_AGENT;
+FIOBJ HTTP_HEADER_VARY;
+FIOBJ HTTP_HEADER_X_FORWARDED_FOR;
 FIOBJ HTTP_HEADER_WS_SEC_CLIENT_KEY;
 FIOBJ HTTP_HEADER_WS_SEC_KEY;
+FIOBJ HTTP_HEADER_WS_EXTENSIONS;
+FIOBJ HTTP_HVALUE_BROTLI;
 FIOBJ HTTP_HVALUE_BYTES;
+FIOBJ HTTP_HVALUE_CHUNKED;
 FIOBJ HTTP_HVALUE_CLOSE;
 FIOBJ HTTP_HVALUE_CONTENT_TYPE_DEFAULT;
 FIOBJ HTTP_HVALUE_GZIP;
@@ -136,15 +307,78 @@ FIOBJ HTTP_HVALUE_WEBSOCKET;
 FIOBJ HTTP_HVALUE_WS_SEC_VERSION;
 FIOBJ HTTP_HVALUE_WS_UPGRADE;
 FIOBJ HTTP_HVALUE_WS_VERSION;
+FIOBJ HTTP_HVALUE_WS_DEFLATE;
 FIOBJ HTTP_HVALUE_SSE_MIME;
 
+/* *****************************************************************************
+Known request header names
+***************************************************************************** */
+
+/*
+ * A perfect hash for the names in the table below - adding a name requires
+ * a collision free slot (DEBUG builds test this during `http_lib_init`).
+ */
+#define HTTP_KNOWN_HEADER_SLOT(name, len)                                      \
+  (((len)*8 + (uint8_t)(name)[0] - (uint8_t)(name)[(len)-1]) & 63)
+
+static const struct {
+  const char *name;
+  size_t len;
+  FIOBJ *obj;
+} http_known_headers[64] = {
+    [0] = {"sec-websocket-extensions", 24, &HTTP_HEADER_WS_EXTENSIONS},
+    [2] = {"sec-websocket-key", 17, &HTTP_HEADER_WS_SEC_CLIENT_KEY},
+    [5] = {"connection", 10, &HTTP_HEADER_CONNECTION},
+    [8] = {"upgrade", 7, &HTTP_HEADER_UPGRADE},
+    [10] = {"upgrade-insecure-requests", 25,
+            &HTTP_HEADER_UPGRADE_INSECURE_REQUESTS},
+    [12] = {"if-modified-since", 17, &HTTP_HEADER_IF_MODIFIED_SINCE},
+    [17] = {"user-agent", 10, &HTTP_HEADER_USER_AGENT},
+    [20] = {"host", 4, &HTTP_HEADER_HOST},
+    [21] = {"transfer-encoding", 17, &HTTP_HEADER_TRANSFER_ENCODING},
+    [27] = {"authorization", 13, &HTTP_HEADER_AUTHORIZATION},
+    [29] = {"accept", 6, &HTTP_HEADER_ACCEPT},
+    [30] = {"content-type", 12, &HTTP_HEADER_CONTENT_TYPE},
+    [31] = {"cache-control", 13, &HTTP_HEADER_CACHE_CONTROL},
+    [41] = {"if-none-match", 13, &HTTP_HEADER_IF_NONE_MATCH},
+    [43] = {"content-length", 14, &HTTP_HEADER_CONTENT_LENGTH},
+    [45] = {"sec-websocket-version", 21, &HTTP_HVALUE_WS_SEC_VERSION},
+    [46] = {"cookie", 6, &HTTP_HEADER_COOKIE},
+    [49] = {"origin", 6, &HTTP_HEADER_ORIGIN},
+    [50] = {"accept-encoding", 15, &HTTP_HEADER_ACCEPT_ENCODING},
+    [52] = {"accept-language", 15, &HTTP_HEADER_ACCEPT_LANGUAGE},
+    [53] = {"range", 5, &HTTP_HEADER_RANGE},
+    [56] = {"referer", 7, &HTTP_HEADER_REFERER},
+    [62] = {"x-forwarded-for", 15, &HTTP_HEADER_X_FORWARDED_FOR},
+    [63] = {"pragma", 6, &HTTP_HEADER_PRAGMA},
+};
+
+FIOBJ http_header_name_find(const char *name, size_t len) {
+  if (!len)
+    return FIOBJ_INVALID;
+  const size_t slot = HTTP_KNOWN_HEADER_SLOT(name, len);
+  if (http_known_headers[slot].len != len ||
+      memcmp(http_known_headers[slot].name, name, len))
+    return FIOBJ_INVALID;
+  return *http_known_headers[slot].obj;
+}
+
+/* *****************************************************************************
+Library cleanup and initialization
+***************************************************************************** */
+
 void http_lib_cleanup(void) {
   http_mimetype_clear();
+  http_file_cache_clear();
+  fiobj_str_intern_clear();
 #define HTTPLIB_RESET(x)                                                       \
   fiobj_free(x);                                                               \
   x = FIOBJ_INVALID;
   HTTPLIB_RESET(HTTP_HEADER_ACCEPT);
   HTTPLIB_RESET(HTTP_HEADER_ACCEPT_RANGES);
+  HTTPLIB_RESET(HTTP_HEADER_ACCEPT_ENCODING);
+  HTTPLIB_RESET(HTTP_HEADER_ACCEPT_LANGUAGE);
+  HTTPLIB_RESET(HTTP_HEADER_AUTHORIZATION);
   HTTPLIB_RESET(HTTP_HEADER_CACHE_CONTROL);
   HTTPLIB_RESET(HTTP_HEADER_CONNECTION);
   HTTPLIB_RESET(HTTP_HEADER_CONTENT_ENCODING);
@@ -155,6 +389,16 @@ void http_lib_cleanup(void) {
   HTTPLIB_RESET(HTTP_HEADER_DATE);
   HTTPLIB_RESET(HTTP_HEADER_ETAG);
   HTTPLIB_RESET(HTTP_HEADER_HOST);
+  HTTPLIB_RESET(HTTP_HEADER_IF_MODIFIED_SINCE);
+  HTTPLIB_RESET(HTTP_HEADER_IF_NONE_MATCH);
+  HTTPLIB_RESET(HTTP_HEADER_PRAGMA);
+  HTTPLIB_RESET(HTTP_HEADER_RANGE);
+  HTTPLIB_RESET(HTTP_HEADER_REFERER);
+  HTTPLIB_RESET(HTTP_HEADER_TRANSFER_ENCODING);
+  HTTPLIB_RESET(HTTP_HEADER_UPGRADE_INSECURE_REQUESTS);
+  HTTPLIB_RESET(HTTP_HEADER_USER_AGENT);
+  HTTPLIB_RESET(HTTP_HEADER_VARY);
+  HTTPLIB_RESET(HTTP_HEADER_X_FORWARDED_FOR);
   HTTPLIB_RESET(HTTP_HVALUE_SSE_MIME);
   HTTPLIB_RESET(HTTP_HEADER_LAST_MODIFIED);
   HTTPLIB_RESET(HTTP_HEADER_ORIGIN);
@@ -162,7 +406,10 @@ void http_lib_cleanup(void) {
   HTTPLIB_RESET(HTTP_HEADER_UPGRADE);
   HTTPLIB_RESET(HTTP_HEADER_WS_SEC_CLIENT_KEY);
   HTTPLIB_RESET(HTTP_HEADER_WS_SEC_KEY);
+  HTTPLIB_RESET(HTTP_HEADER_WS_EXTENSIONS);
+  HTTPLIB_RESET(HTTP_HVALUE_BROTLI);
   HTTPLIB_RESET(HTTP_HVALUE_BYTES);
+  HTTPLIB_RESET(HTTP_HVALUE_CHUNKED);
   HTTPLIB_RESET(HTTP_HVALUE_CLOSE);
   HTTPLIB_RESET(HTTP_HVALUE_CONTENT_TYPE_DEFAULT);
   HTTPLIB_RESET(HTTP_HVALUE_GZIP);
@@ -173,6 +420,7 @@ void http_lib_cleanup(void) {
   HTTPLIB_RESET(HTTP_HVALUE_WS_SEC_VERSION);
   HTTPLIB_RESET(HTTP_HVALUE_WS_UPGRADE);
   HTTPLIB_RESET(HTTP_HVALUE_WS_VERSION);
+  HTTPLIB_RESET(HTTP_HVALUE_WS_DEFLATE);
 
 #undef HTTPLIB_RESET
 }
@@ -182,6 +430,9 @@ void http_lib_init(void) {
     return;
   HTTP_HEADER_ACCEPT = fiobj_str_new("accept", 6);
   HTTP_HEADER_ACCEPT_RANGES = fiobj_str_new("accept-ranges", 13);
+  HTTP_HEADER_ACCEPT_ENCODING = fiobj_str_new("accept-encoding", 15);
+  HTTP_HEADER_ACCEPT_LANGUAGE = fiobj_str_new("accept-language", 15);
+  HTTP_HEADER_AUTHORIZATION = fiobj_str_new("authorization", 13);
   HTTP_HEADER_CACHE_CONTROL = fiobj_str_new("cache-control", 13);
   HTTP_HEADER_CONNECTION = fiobj_str_new("connection", 10);
   HTTP_HEADER_CONTENT_ENCODING = fiobj_str_new("content-encoding", 16);
@@ -192,13 +443,27 @@ void http_lib_init(void) {
   HTTP_HEADER_DATE = fiobj_str_new("date", 4);
   HTTP_HEADER_ETAG = fiobj_str_new("etag", 4);
   HTTP_HEADER_HOST = fiobj_str_new("host", 4);
+  HTTP_HEADER_IF_MODIFIED_SINCE = fiobj_str_new("if-modified-since", 17);
+  HTTP_HEADER_IF_NONE_MATCH = fiobj_str_new("if-none-match", 13);
   HTTP_HEADER_LAST_MODIFIED = fiobj_str_new("last-modified", 13);
   HTTP_HEADER_ORIGIN = fiobj_str_new("origin", 6);
+  HTTP_HEADER_PRAGMA = fiobj_str_new("pragma", 6);
+  HTTP_HEADER_RANGE = fiobj_str_new("range", 5);
+  HTTP_HEADER_REFERER = fiobj_str_new("referer", 7);
   HTTP_HEADER_SET_COOKIE = fiobj_str_new("set-cookie", 10);
+  HTTP_HEADER_TRANSFER_ENCODING = fiobj_str_new("transfer-encoding", 17);
   HTTP_HEADER_UPGRADE = fiobj_str_new("upgrade", 7);
+  HTTP_HEADER_UPGRADE_INSECURE_REQUESTS =
+      fiobj_str_new("upgrade-insecure-requests", 25);
+  HTTP_HEADER_USER_AGENT = fiobj_str_new("user-agent", 10);
+  HTTP_HEADER_VARY = fiobj_str_new("vary", 4);
+  HTTP_HEADER_X_FORWARDED_FOR = fiobj_str_new("x-forwarded-for", 15);
   HTTP_HEADER_WS_SEC_CLIENT_KEY = fiobj_str_new("sec-websocket-key", 17);
   HTTP_HEADER_WS_SEC_KEY = fiobj_str_new("sec-websocket-accept", 20);
+  HTTP_HEADER_WS_EXTENSIONS = fiobj_str_new("sec-websocket-extensions", 24);
+  HTTP_HVALUE_BROTLI = fiobj_str_new("br", 2);
   HTTP_HVALUE_BYTES = fiobj_str_new("bytes", 5);
+  HTTP_HVALUE_CHUNKED = fiobj_str_new("chunked", 7);
   HTTP_HVALUE_CLOSE = fiobj_str_new("close", 5);
   HTTP_HVALUE_CONTENT_TYPE_DEFAULT =
       fiobj_str_new("application/octet-stream", 24);
@@ -211,8 +476,16 @@ void http_lib_init(void) {
   HTTP_HVALUE_WS_SEC_VERSION = fiobj_str_new("sec-websocket-version", 21);
   HTTP_HVALUE_WS_UPGRADE = fiobj_str_new("Upgrade", 7);
   HTTP_HVALUE_WS_VERSION = fiobj_str_new("13", 2);
+  HTTP_HVALUE_WS_DEFLATE = fiobj_str_new(
+      "permessage-deflate; server_no_context_takeover; "
+      "client_no_context_takeover",
+      74);
 
+  fiobj_obj2hash(HTTP_HEADER_ACCEPT);
   fiobj_obj2hash(HTTP_HEADER_ACCEPT_RANGES);
+  fiobj_obj2hash(HTTP_HEADER_ACCEPT_ENCODING);
+  fiobj_obj2hash(HTTP_HEADER_ACCEPT_LANGUAGE);
+  fiobj_obj2hash(HTTP_HEADER_AUTHORIZATION);
   fiobj_obj2hash(HTTP_HEADER_CACHE_CONTROL);
   fiobj_obj2hash(HTTP_HEADER_CONNECTION);
   fiobj_obj2hash(HTTP_HEADER_CONTENT_ENCODING);
@@ -223,13 +496,26 @@ void http_lib_init(void) {
   fiobj_obj2hash(HTTP_HEADER_DATE);
   fiobj_obj2hash(HTTP_HEADER_ETAG);
   fiobj_obj2hash(HTTP_HEADER_HOST);
+  fiobj_obj2hash(HTTP_HEADER_IF_MODIFIED_SINCE);
+  fiobj_obj2hash(HTTP_HEADER_IF_NONE_MATCH);
   fiobj_obj2hash(HTTP_HEADER_LAST_MODIFIED);
   fiobj_obj2hash(HTTP_HEADER_ORIGIN);
+  fiobj_obj2hash(HTTP_HEADER_PRAGMA);
+  fiobj_obj2hash(HTTP_HEADER_RANGE);
+  fiobj_obj2hash(HTTP_HEADER_REFERER);
   fiobj_obj2hash(HTTP_HEADER_SET_COOKIE);
+  fiobj_obj2hash(HTTP_HEADER_TRANSFER_ENCODING);
   fiobj_obj2hash(HTTP_HEADER_UPGRADE);
+  fiobj_obj2hash(HTTP_HEADER_UPGRADE_INSECURE_REQUESTS);
+  fiobj_obj2hash(HTTP_HEADER_USER_AGENT);
+  fiobj_obj2hash(HTTP_HEADER_VARY);
+  fiobj_obj2hash(HTTP_HEADER_X_FORWARDED_FOR);
   fiobj_obj2hash(HTTP_HEADER_WS_SEC_CLIENT_KEY);
   fiobj_obj2hash(HTTP_HEADER_WS_SEC_KEY);
+  fiobj_obj2hash(HTTP_HEADER_WS_EXTENSIONS);
+  fiobj_obj2hash(HTTP_HVALUE_BROTLI);
   fiobj_obj2hash(HTTP_HVALUE_BYTES);
+  fiobj_obj2hash(HTTP_HVALUE_CHUNKED);
   fiobj_obj2hash(HTTP_HVALUE_CLOSE);
   fiobj_obj2hash(HTTP_HVALUE_CONTENT_TYPE_DEFAULT);
   fiobj_obj2hash(HTTP_HVALUE_GZIP);
@@ -241,6 +527,20 @@ void http_lib_init(void) {
   fiobj_obj2hash(HTTP_HVALUE_WS_SEC_VERSION);
   fiobj_obj2hash(HTTP_HVALUE_WS_UPGRADE);
   fiobj_obj2hash(HTTP_HVALUE_WS_VERSION);
+  fiobj_obj2hash(HTTP_HVALUE_WS_DEFLATE);
+
+#ifdef DEBUG
+  for (size_t i = 0; i < 64; ++i) {
+    if (!http_known_headers[i].len)
+      continue;
+    fio_cstr_s s = fiobj_obj2cstr(*http_known_headers[i].obj);
+    HTTP_ASSERT((HTTP_KNOWN_HEADER_SLOT(http_known_headers[i].name,
+                                        http_known_headers[i].len) == i &&
+                 s.len == http_known_headers[i].len &&
+                 !memcmp(s.data, http_known_headers[i].name, s.len)),
+                "known header table error (wrong slot or name).")
+  }
+#endif
 
 #define REGISTER_MIME(ext, type)                                               \
   http_mimetype_register(ext, sizeof(ext) - 1,                                 \
@@ -1256,3 +1556,84 @@ void http_lib_init(void) {
   REGISTER_MIME("zmm", "application/vnd.handheld-entertainment+xml");
 #undef REGISTER_MIME
 }
+
+/* *****************************************************************************
+Testing
+***************************************************************************** */
+
+#ifdef DEBUG
+#include "fiobj4sock.h"
+
+#include <sys/socket.h>
+
+#define TEST_ASSERT(cond, ...)                                                 \
+  if (!(cond)) {                                                               \
+    fprintf(stderr, "* " __VA_ARGS__);                                         \
+    fprintf(stderr, "Testing failed.\n");                                      \
+    exit(-1);                                                                  \
+  }
+
+void http_arena_test(void) {
+  fprintf(stderr, "=== Testing the request arena\n");
+  char data[256];
+  char out[sizeof(data) * 2 + 8];
+  http_s h = {.private_data.arena = NULL};
+  int sv[2];
+  TEST_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv),
+              "arena: socketpair failed\n");
+  intptr_t uuid = sock_open(sv[0]);
+  facil_attach(uuid, NULL); /* the connection's state is reset on close */
+  /* queue request data and keep a header value past the request */
+  memset(data, 'a', sizeof(data));
+  FIOBJ str = http_arena_str(&h, data, sizeof(data), 0);
+  TEST_ASSERT(fiobj_str_is_static(str), "arena: String data wasn't placed\n");
+  sock_write_fiobj(uuid, str);
+  sock_write_fiobj_head(uuid, "head", 4, str);
+  fiobj_free(str);
+  FIOBJ headers = fiobj_hash_new();
+  FIOBJ name = fiobj_str_new("host", 4);
+  memset(data, 'b', sizeof(data));
+  fiobj_hash_set(headers, name,
+                 http_arena_str(&h, data, sizeof(data), 0));
+  http_arena_detach(headers);
+  TEST_ASSERT(!fiobj_str_is_static(fiobj_hash_get(headers, name)),
+              "arena: detached String is still static\n");
+  /* the next request overwrites the arena's memory */
+  http_arena_reset(h.private_data.arena);
+  memset(data, 'z', sizeof(data));
+  FIOBJ tmp = http_arena_str(&h, data, sizeof(data), 0);
+  FIOBJ tmp2 = http_arena_str(&h, data, sizeof(data), 0);
+  sock_flush_strong(uuid);
+  size_t out_len = 0;
+  ssize_t i;
+  while (out_len < sizeof(out) &&
+         (i = recv(sv[1], out + out_len, sizeof(out) - out_len,
+                   MSG_DONTWAIT)) > 0)
+    out_len += i;
+  TEST_ASSERT(out_len == sizeof(data) * 2 + 4,
+              "arena: %zu bytes sent (expected %zu)\n", out_len,
+              sizeof(data) * 2 + 4);
+  for (size_t pos = 0; pos < out_len; ++pos) {
+    char expected = (pos >= sizeof(data) && pos < sizeof(data) + 4)
+                        ? "head"[pos - sizeof(data)]
+                        : 'a';
+    TEST_ASSERT(out[pos] == expected,
+                "arena: sent data was overwritten at %zu ('%c')\n", pos,
+                out[pos]);
+  }
+  fio_cstr_s val = fiobj_obj2cstr(fiobj_hash_get(headers, name));
+  TEST_ASSERT(val.len == sizeof(data) && val.data[0] == 'b' &&
+                  val.data[val.len - 1] == 'b',
+              "arena: detached String was overwritten\n");
+  fiobj_free(headers);
+  fiobj_free(name);
+  fiobj_free(tmp);
+  fiobj_free(tmp2);
+  http_arena_free(h.private_data.arena);
+  sock_force_close(uuid);
+  close(sv[1]);
+  fprintf(stderr, "* Request arena test passed.\n");
+}
+
+#undef TEST_ASSERT
+#endif
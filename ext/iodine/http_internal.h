@@ -25,12 +25,42 @@ Types
 typedef struct http_protocol_s http_protocol_s;
 typedef struct http_vtable_s http_vtable_s;
 
+/** a part of a multipart/byteranges response */
+typedef struct {
+  /** the part's boundary and headers */
+  FIOBJ head;
+  uintptr_t offset;
+  uintptr_t length;
+} http_file_part_s;
+
+/** a reference counted file descriptor, shared by concurrent responses */
+typedef struct {
+  /** the file descriptor - MUST be first (`is_pfd` packets point to it) */
+  int fd;
+  volatile uintptr_t ref;
+  uint64_t hash;
+  FIOBJ path;
+  ino_t inode;
+  time_t mtime;
+  off_t size;
+  fio_ls_embd_s node;
+} http_fd_s;
+
 struct http_vtable_s {
   /** Should send existing headers and data */
   int (*const http_send_body)(http_s *h, void *data, uintptr_t length);
+  /** Should send existing headers and a String body (without copying it) */
+  int (*const http_send_body_fiobj)(http_s *h, FIOBJ body);
   /** Should send existing headers and file */
   int (*const http_sendfile)(http_s *h, int fd, uintptr_t length,
                              uintptr_t offset);
+  /** Should send existing headers and a shared file (releasing `fd`) */
+  int (*const http_sendfile_fd)(http_s *h, http_fd_s *fd, uintptr_t length,
+                                uintptr_t offset);
+  /** Should send existing headers and file parts (MUST free the FIOBJs) */
+  int (*const http_sendfile_parts)(http_s *h, http_fd_s *fd,
+                                   http_file_part_s *parts, size_t count,
+                                   FIOBJ tail);
   /** Should send existing headers and data and prepare for streaming */
   int (*const http_stream)(http_s *h, void *data, uintptr_t length);
   /** Should send existing headers or complete streaming */
@@ -50,6 +80,9 @@ struct http_vtable_s {
   /** hijacks the socket aaway from the protocol. */
   intptr_t (*http_hijack)(http_s *h, fio_cstr_s *leftover);
 
+  /** Receives more of a streamed request body. */
+  int (*http_body_fetch)(http_s *h);
+
   /** Upgrades an HTTP connection to an EventSource (SSE) connection. */
   int (*http_upgrade2sse)(http_s *h, http_sse_s *sse);
   /** Writes data to an EventSource (SSE) connection. MUST free the FIOBJ. */
@@ -71,9 +104,25 @@ Constants that shouldn't be accessed by the users (`fiobj_dup` required).
 ***************************************************************************** */
 
 extern FIOBJ HTTP_HEADER_ACCEPT_RANGES;
+extern FIOBJ HTTP_HEADER_ACCEPT_ENCODING;
+extern FIOBJ HTTP_HEADER_ACCEPT_LANGUAGE;
+extern FIOBJ HTTP_HEADER_AUTHORIZATION;
+extern FIOBJ HTTP_HEADER_IF_MODIFIED_SINCE;
+extern FIOBJ HTTP_HEADER_IF_NONE_MATCH;
+extern FIOBJ HTTP_HEADER_PRAGMA;
+extern FIOBJ HTTP_HEADER_RANGE;
+extern FIOBJ HTTP_HEADER_REFERER;
+extern FIOBJ HTTP_HEADER_TRANSFER_ENCODING;
+extern FIOBJ HTTP_HEADER_UPGRADE_INSECURE_REQUESTS;
+extern FIOBJ HTTP_HEADER_USER_AGENT;
+extern FIOBJ HTTP_HEADER_VARY;
+extern FIOBJ HTTP_HEADER_X_FORWARDED_FOR;
 extern FIOBJ HTTP_HEADER_WS_SEC_CLIENT_KEY;
 extern FIOBJ HTTP_HEADER_WS_SEC_KEY;
+extern FIOBJ HTTP_HEADER_WS_EXTENSIONS;
+extern FIOBJ HTTP_HVALUE_BROTLI;
 extern FIOBJ HTTP_HVALUE_BYTES;
+extern FIOBJ HTTP_HVALUE_CHUNKED;
 extern FIOBJ HTTP_HVALUE_CLOSE;
 extern FIOBJ HTTP_HVALUE_CONTENT_TYPE_DEFAULT;
 extern FIOBJ HTTP_HVALUE_GZIP;
@@ -85,11 +134,85 @@ extern FIOBJ HTTP_HVALUE_WEBSOCKET;
 extern FIOBJ HTTP_HVALUE_WS_SEC_VERSION;
 extern FIOBJ HTTP_HVALUE_WS_UPGRADE;
 extern FIOBJ HTTP_HVALUE_WS_VERSION;
+extern FIOBJ HTTP_HVALUE_WS_DEFLATE;
+
+/**
+ * Returns the shared header name object for commonly used (lowercase) request
+ * header names, or FIOBJ_INVALID if the name isn't a known header.
+ *
+ * The object is owned by the library (`fiobj_dup` is required for keeping it).
+ */
+FIOBJ http_header_name_find(const char *name, size_t len);
+
+/**
+ * Clears the static file cache and the open file descriptor cache (see
+ * `HTTP_FILE_CACHE_LIMIT` and `HTTP_FD_CACHE_COUNT`).
+ */
+void http_file_cache_clear(void);
+
+/** Releases a reference to a shared file, closing the file once unused. */
+void http_fd_release(void *fd);
+
+/** Adds a reference to a shared file. */
+static inline http_fd_s *http_fd_dup(http_fd_s *fd) {
+  spn_add(&fd->ref, 1);
+  return fd;
+}
+
+/* *****************************************************************************
+Request arena (String data that lives as long as the request)
+***************************************************************************** */
+
+/**
+ * Returns a String object holding a copy of `data`, where the copy is placed in
+ * the request's arena (the arena is allocated on first use).
+ *
+ * If `decode` is set, the data is URL decoded while being copied.
+ *
+ * The String is owned by the caller (remember `fiobj_free`). The String's data
+ * is released when the request is cleared, so Strings that might outlive the
+ * request are copied when they are handed off (see `http_arena_detach`).
+ * `sock_write_fiobj` and `pubsub_publish` copy such (static) Strings.
+ */
+FIOBJ http_arena_str(http_s *h, const char *data, size_t len, uint8_t decode);
+
+/** Releases the arena's data, keeping the arena's first chunk for reuse. */
+void http_arena_reset(void *arena);
+
+/** Releases the arena's data and the arena itself. */
+void http_arena_free(void *arena);
+
+#ifdef DEBUG
+/** Tests that request data stays valid when it's sent after the arena reset. */
+void http_arena_test(void);
+#endif
+
+/* *****************************************************************************
+Streaming multipart parsing (see `stream_multipart`)
+***************************************************************************** */
+
+/**
+ * Starts parsing a `multipart/form-data` body as it arrives, placing the parts
+ * in `h->params`. Returns NULL if the request's body isn't multipart.
+ */
+void *http_mime_stream_new(http_s *h);
+
+/** Parses more of the body. Returns -1 on error. */
+int http_mime_stream_write(void *stream, char *data, size_t len);
+
+/** Parses any remaining data and frees the parser. -1 if the body is broken. */
+int http_mime_stream_finish(void *stream);
+
+/** Frees the parser (i.e., when the request was abandoned). */
+void http_mime_stream_free(void *stream);
 
 /* *****************************************************************************
 HTTP request/response object management
 ***************************************************************************** */
 
+/** Releases a streamed response's body encoder (see `http_settings_s`). */
+void http_encoder_free(http_s *h);
+
 static inline void http_s_new(http_s *h, http_protocol_s *owner,
                               http_vtable_s *vtbl) {
   *h = (http_s){
@@ -105,6 +228,23 @@ static inline void http_s_new(http_s *h, http_protocol_s *owner,
   };
 }
 
+/**
+ * Restores atomic reference counting for the handle's objects (request data is
+ * thread-confined, see `http_arena_str`) before the handle is shared.
+ */
+static inline void http_s_share(http_s *h) {
+  fiobj_share(h->method);
+  fiobj_share(h->status_str);
+  fiobj_share(h->private_data.out_headers);
+  fiobj_share(h->headers);
+  fiobj_share(h->version);
+  fiobj_share(h->query);
+  fiobj_share(h->path);
+  fiobj_share(h->cookies);
+  fiobj_share(h->body);
+  fiobj_share(h->params);
+}
+
 static inline void http_s_destroy(http_s *h, uint8_t log) {
   if (log && h->status && !h->status_str) {
     http_write_log(h);
@@ -119,6 +259,9 @@ static inline void http_s_destroy(http_s *h, uint8_t log) {
   fiobj_free(h->cookies);
   fiobj_free(h->body);
   fiobj_free(h->params);
+  http_arena_free(h->private_data.arena);
+  if (h->private_data.encoder)
+    http_encoder_free(h);
 
   *h = (http_s){
       .private_data.vtbl = h->private_data.vtbl,
@@ -127,8 +270,13 @@ static inline void http_s_destroy(http_s *h, uint8_t log) {
 }
 
 static inline void http_s_clear(http_s *h, uint8_t log) {
+  /* the arena is kept for the next request */
+  void *arena = h->private_data.arena;
+  h->private_data.arena = NULL;
   http_s_destroy(h, log);
+  http_arena_reset(arena);
   http_s_new(h, (http_protocol_s *)h->private_data.flag, h->private_data.vtbl);
+  h->private_data.arena = arena;
 }
 
 /** tests handle validity */
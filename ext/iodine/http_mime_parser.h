@@ -151,8 +151,9 @@ consume_partial:
         http_mime_parser_on_partial_data(parser, start, (size_t)(end - start));
       goto end_of_data;
     } else if (end + 4 + parser->boundary_len >= stop) {
-      end -= 2;
-      if (end[0] == '\r')
+      /* might be a boundary, keep the line's end for the next round */
+      end -= 1;
+      if (end > start && end[-1] == '\r')
         --end;
       pos = end;
       if (end - start)
@@ -291,11 +292,14 @@ consume_partial:
       if (header_count++ > 4)
         goto error;
     }
-    if (!name) {
-      if (start + 4 >= stop)
-        goto end_of_data;
-      goto error;
+    if (start + 4 >= stop) {
+      /* the headers might continue after the end of the data */
+      if (first_run && name)
+        goto error;
+      goto end_of_data;
     }
+    if (!name)
+      goto error;
 
     /* advance to end of boundry */
     ++start;
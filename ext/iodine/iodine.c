@@ -3,6 +3,9 @@
 #include <ruby/version.h>
 
 #include "facil.h"
+#include "fio_mem.h"
+#include "fio_stats.h"
+#include "fio_trace.h"
 /* *****************************************************************************
 OS specific patches
 ***************************************************************************** */
@@ -68,7 +71,8 @@ static void iodine_on_idle(void) {
   spn_lock(&iodine_on_idle_lock);
   while (fio_ls_any(&iodine_on_idle_list)) {
     VALUE block = (VALUE)fio_ls_shift(&iodine_on_idle_list);
-    defer(iodine_perform_deferred, (void *)block, NULL);
+    defer_priority(DEFER_PRIORITY_BACKGROUND, iodine_perform_deferred,
+                   (void *)block, NULL);
     IodineStore.remove(block);
   }
   spn_unlock(&iodine_on_idle_lock);
@@ -81,12 +85,16 @@ Running Iodine
 typedef struct {
   int16_t threads;
   int16_t workers;
+  int16_t threads_max;
+  uint8_t affinity;
+  uint8_t numa;
 } iodine_start_params_s;
 
 static void *iodine_run_outside_GVL(void *params_) {
   iodine_start_params_s *params = params_;
   facil_run(.threads = params->threads, .processes = params->workers,
-            .on_idle = iodine_on_idle, .on_finish = iodine_defer_on_finish);
+            .threads_max = params->threads_max, .on_idle = iodine_on_idle, .on_finish = iodine_defer_on_finish,
+            .affinity = params->affinity, .numa = params->numa);
   return NULL;
 }
 
@@ -118,8 +126,25 @@ static VALUE iodine_threads_get(VALUE self) {
  * i.e., -2 == half the number of detected CPU cores.
  *
  * Zero values promise nothing (iodine will decide what to do with them).
+ *
+ * A Range (i.e., `2..16`) starts each worker process with the minimal number
+ * of threads, adding threads (up to the maximum) while events wait in the
+ * queue for too long and retiring threads once they're idle for a while.
  */
 static VALUE iodine_threads_set(VALUE self, VALUE val) {
+  if (rb_obj_is_kind_of(val, rb_cRange)) {
+    VALUE min, max;
+    int exclusive;
+    rb_range_values(val, &min, &max, &exclusive);
+    Check_Type(min, T_FIXNUM);
+    Check_Type(max, T_FIXNUM);
+    if (FIX2LONG(min) < 1 || FIX2LONG(max) - exclusive < FIX2LONG(min) ||
+        FIX2LONG(max) >= (1 << 12)) {
+      rb_raise(rb_eRangeError, "requsted thread range is out of range.");
+    }
+    rb_ivar_set(self, rb_intern2("@threads", 8), val);
+    return val;
+  }
   Check_Type(val, T_FIXNUM);
   if (NUM2SSIZET(val) >= (1 << 12)) {
     rb_raise(rb_eRangeError, "requsted thread count is out of range.");
@@ -162,18 +187,347 @@ static VALUE iodine_workers_set(VALUE self, VALUE val) {
   return val;
 }
 
+/**
+ * Returns the CPU affinity mode that will be used when {Iodine.start} is called
+ * (see {Iodine.affinity=}). Defaults to `false`.
+ */
+static VALUE iodine_affinity_get(VALUE self) {
+  VALUE i = rb_ivar_get(self, rb_intern2("@affinity", 9));
+  if (i == Qnil)
+    i = Qfalse;
+  return i;
+}
+
+/**
+ * Sets the CPU affinity mode that will be used when {Iodine.start} is called
+ * (Linux only):
+ *
+ * false:: threads and worker processes can run on any CPU core (the default).
+ * true:: each worker thread is bound to a single CPU core.
+ * :numa:: same as `true`, and the worker processes are spread across the NUMA
+ *         nodes, with each worker bound to it's node's cores and memory.
+ */
+static VALUE iodine_affinity_set(VALUE self, VALUE val) {
+  if (val == Qnil)
+    val = Qfalse;
+  if (val != Qfalse && val != Qtrue &&
+      val != rb_id2sym(rb_intern2("numa", 4))) {
+    rb_raise(rb_eArgError, "affinity should be true, false or :numa.");
+  }
+  rb_ivar_set(self, rb_intern2("@affinity", 9), val);
+  return val;
+}
+
+/**
+ * Returns `false` if the root process won't prepare its memory before forking
+ * the worker processes (see {Iodine.warmup=}). Defaults to `true`.
+ */
+static VALUE iodine_warmup_get(VALUE self) {
+  return (rb_ivar_get(self, rb_intern2("@warmup", 7)) == Qfalse) ? Qfalse
+                                                                   : Qtrue;
+}
+
+/**
+ * Sets whether the root process prepares its memory before forking the first
+ * worker process (cluster mode only).
+ *
+ * When `true` (the default), iodine's global tables are frozen and the heap is
+ * compacted (using `Process.warmup` on Ruby 3.3 and `GC.compact` on earlier
+ * versions), so the workers share the root's memory pages for longer (copy on
+ * write) and worker memory grows more slowly.
+ *
+ * Set to `false` if the application uses C extensions that don't support GC
+ * compaction.
+ */
+static VALUE iodine_warmup_set(VALUE self, VALUE val) {
+  rb_ivar_set(self, rb_intern2("@warmup", 7),
+              (val == Qnil || val == Qfalse) ? Qfalse : Qtrue);
+  return val;
+}
+
+/**
+ * Returns a Hash with the memory allocator's statistics (for the calling
+ * process):
+ *
+ * arenas:: the number of per-CPU arenas.
+ * block_size:: the size of each memory block, in bytes.
+ * blocks:: the number of memory blocks held by the allocator.
+ * blocks_pooled:: blocks that are unused (pooled for future allocations).
+ * blocks_trimmed:: pooled blocks who's memory was returned to the system.
+ * big_allocations:: the number of big allocations (made directly using `mmap`).
+ * big_bytes:: the memory used by big allocations, in bytes.
+ *
+ * Blocks are recycled only once all of their allocations were freed, so used
+ * blocks (`blocks - blocks_pooled`) might be fragmented.
+ *
+ * Idle pooled blocks are returned to the system periodically.
+ */
+static VALUE iodine_memory_stats(VALUE self) {
+  fio_mem_stats_s stats = fio_mem_stats();
+  VALUE h = rb_hash_new();
+#define IODINE_MEM_STAT(name)                                                  \
+  rb_hash_aset(h, ID2SYM(rb_intern(#name)), SIZET2NUM(stats.name))
+  IODINE_MEM_STAT(arenas);
+  IODINE_MEM_STAT(block_size);
+  IODINE_MEM_STAT(blocks);
+  IODINE_MEM_STAT(blocks_pooled);
+  IODINE_MEM_STAT(blocks_trimmed);
+  IODINE_MEM_STAT(big_allocations);
+  IODINE_MEM_STAT(big_bytes);
+#undef IODINE_MEM_STAT
+  return h;
+  (void)self;
+}
+
+/* the names of the statistics' counters and histograms (`fio_stats.h`) */
+static const char *iodine_stats_counters[FIO_STATS_COUNTERS] = {
+    [FIO_STATS_BYTES_IN] = "bytes_in",
+    [FIO_STATS_BYTES_OUT] = "bytes_out",
+    [FIO_STATS_PUBLISHED] = "published",
+    [FIO_STATS_DELIVERED] = "delivered",
+    [FIO_STATS_DROPPED] = "dropped",
+    [FIO_STATS_TRUNCATED] = "truncated",
+};
+static const char *iodine_stats_histograms[FIO_STATS_HISTOGRAMS] = {
+    [FIO_STATS_HTTP_PARSE] = "http_parse",
+    [FIO_STATS_HTTP_QUEUE] = "http_queue",
+    [FIO_STATS_HTTP_HANDLER] = "http_handler",
+    [FIO_STATS_HTTP_FLUSH] = "http_flush",
+};
+static const double iodine_stats_quantiles[] = {0.5, 0.9, 0.99};
+
+/**
+ * Returns a Hash with the server's statistics, for the whole cluster (the
+ * worker processes share their statistics every second):
+ *
+ * processes:: the number of processes included in the statistics.
+ * connections:: the number of open connections.
+ * defer_queue:: the number of tasks waiting in the event queue(s).
+ * bytes_in:: the number of bytes read from the network.
+ * bytes_out:: the number of bytes written to the network.
+ * published:: the number of pub/sub messages published.
+ * delivered:: the number of pub/sub messages delivered to subscribers.
+ * dropped:: the number of pub/sub messages discarded for slow subscribers.
+ * truncated:: the number of UDP datagrams discarded for being too long.
+ *
+ * The following latency Hashes are also included (values are in seconds):
+ *
+ * http_parse:: parsing HTTP requests.
+ * http_queue:: from parsing until the application starts handling the request.
+ * http_handler:: the application (the Rack `call`).
+ * http_flush:: from the application's return until the response was sent.
+ *
+ * Each latency Hash includes the `count`, `sum`, `p50`, `p90`, `p99` and `max`
+ * values. Latency percentiles are accurate up to ~12.5%.
+ *
+ * Counters are never reset, so rates should be calculated by the monitoring
+ * system (i.e., requests per second).
+ */
+static VALUE iodine_stats(VALUE self) {
+  fio_stats_s *stats = malloc(sizeof(*stats));
+  if (!stats)
+    rb_raise(rb_eNoMemError, "couldn't allocate memory for the statistics.");
+  fio_stats_cluster(stats);
+  VALUE h = rb_hash_new();
+  rb_hash_aset(h, ID2SYM(rb_intern("processes")), ULL2NUM(stats->processes));
+  rb_hash_aset(h, ID2SYM(rb_intern("connections")),
+               ULL2NUM(stats->connections));
+  rb_hash_aset(h, ID2SYM(rb_intern("defer_queue")),
+               ULL2NUM(stats->defer_queue));
+  for (size_t i = 0; i < FIO_STATS_COUNTERS; ++i)
+    rb_hash_aset(h, ID2SYM(rb_intern(iodine_stats_counters[i])),
+                 ULL2NUM(stats->counters[i]));
+  for (size_t i = 0; i < FIO_STATS_HISTOGRAMS; ++i) {
+    VALUE lat = rb_hash_new();
+    rb_hash_aset(lat, ID2SYM(rb_intern("count")),
+                 ULL2NUM(fio_stats_count(stats->histograms[i])));
+    rb_hash_aset(lat, ID2SYM(rb_intern("sum")),
+                 DBL2NUM(stats->sums[i] / 1e9));
+    rb_hash_aset(
+        lat, ID2SYM(rb_intern("p50")),
+        DBL2NUM(fio_stats_percentile(stats->histograms[i], 0.5) / 1e9));
+    rb_hash_aset(
+        lat, ID2SYM(rb_intern("p90")),
+        DBL2NUM(fio_stats_percentile(stats->histograms[i], 0.9) / 1e9));
+    rb_hash_aset(
+        lat, ID2SYM(rb_intern("p99")),
+        DBL2NUM(fio_stats_percentile(stats->histograms[i], 0.99) / 1e9));
+    rb_hash_aset(lat, ID2SYM(rb_intern("max")),
+                 DBL2NUM(fio_stats_percentile(stats->histograms[i], 1) / 1e9));
+    rb_hash_aset(h, ID2SYM(rb_intern(iodine_stats_histograms[i])), lat);
+  }
+  free(stats);
+  return h;
+  (void)self;
+}
+
+/**
+ * Returns the server's statistics (see {Iodine.stats}) as a String, using the
+ * Prometheus text exposition format (metrics are prefixed with `iodine_`).
+ *
+ * Iodine doesn't serve the metrics on it's own. Mount a route (i.e.,
+ * `/metrics`) that returns this String with the `text/plain; version=0.0.4`
+ * content type.
+ */
+static VALUE iodine_stats_prometheus(VALUE self) {
+  fio_stats_s *stats = malloc(sizeof(*stats));
+  if (!stats)
+    rb_raise(rb_eNoMemError, "couldn't allocate memory for the statistics.");
+  fio_stats_cluster(stats);
+  VALUE str = rb_str_buf_new(4096);
+#define IODINE_GAUGE(name)                                                     \
+  rb_str_catf(str, "# TYPE iodine_" #name " gauge\niodine_" #name " %llu\n",  \
+              (unsigned long long)stats->name)
+  IODINE_GAUGE(processes);
+  IODINE_GAUGE(connections);
+  IODINE_GAUGE(defer_queue);
+#undef IODINE_GAUGE
+  for (size_t i = 0; i < FIO_STATS_COUNTERS; ++i)
+    rb_str_catf(str,
+                "# TYPE iodine_%s_total counter\niodine_%s_total %llu\n",
+                iodine_stats_counters[i], iodine_stats_counters[i],
+                (unsigned long long)stats->counters[i]);
+  for (size_t i = 0; i < FIO_STATS_HISTOGRAMS; ++i) {
+    const char *name = iodine_stats_histograms[i];
+    rb_str_catf(str, "# TYPE iodine_%s_seconds summary\n", name);
+    for (size_t q = 0;
+         q < sizeof(iodine_stats_quantiles) / sizeof(iodine_stats_quantiles[0]);
+         ++q)
+      rb_str_catf(str, "iodine_%s_seconds{quantile=\"%g\"} %.9f\n", name,
+                  iodine_stats_quantiles[q],
+                  fio_stats_percentile(stats->histograms[i],
+                                       iodine_stats_quantiles[q]) /
+                      1e9);
+    rb_str_catf(str,
+                "iodine_%s_seconds_sum %.9f\niodine_%s_seconds_count %llu\n",
+                name, stats->sums[i] / 1e9, name,
+                (unsigned long long)fio_stats_count(stats->histograms[i]));
+  }
+  free(stats);
+  return str;
+  (void)self;
+}
+
+/* *****************************************************************************
+Tracing
+***************************************************************************** */
+
+static VALUE iodine_trace_block = Qnil;
+
+/* the names of the timeline events (`fio_trace.h`) */
+static const char *iodine_trace_events[FIO_TRACE_EVENTS] = {
+    [FIO_TRACE_SCHEDULED] = "scheduled",
+    [FIO_TRACE_ON_DATA_START] = "on_data_start",
+    [FIO_TRACE_ON_DATA_END] = "on_data_end",
+    [FIO_TRACE_GVL_WAIT] = "gvl_wait",
+    [FIO_TRACE_GVL_ENTER] = "gvl_enter",
+    [FIO_TRACE_GVL_EXIT] = "gvl_exit",
+    [FIO_TRACE_HANDLER_START] = "handler_start",
+    [FIO_TRACE_HANDLER_END] = "handler_end",
+    [FIO_TRACE_FLUSHED] = "flushed",
+};
+
+static void *iodine_trace_perform_in_GVL(void *tl_) {
+  fio_trace_timeline_s *tl = tl_;
+  if (iodine_trace_block == Qnil || !tl->count)
+    return NULL;
+  VALUE timeline = rb_ary_new_capa(tl->count);
+  for (size_t i = 0; i < tl->count; ++i) {
+    VALUE event = rb_ary_new_capa(2);
+    rb_ary_push(event,
+                ID2SYM(rb_intern(iodine_trace_events[tl->events[i].event])));
+    rb_ary_push(event, DBL2NUM((int64_t)(tl->events[i].time -
+                                         tl->events[0].time) /
+                               1e9));
+    rb_ary_push(timeline, event);
+  }
+  IodineCaller.call2(iodine_trace_block, call_id, 1, &timeline);
+  return NULL;
+}
+
+static void iodine_trace_perform(void *tl, void *ignr) {
+  IodineCaller.enterGVL(iodine_trace_perform_in_GVL, tl);
+  free(tl);
+  (void)ignr;
+}
+
+/* timelines are passed to Ruby by a task, so the GVL isn't held up */
+static void iodine_trace_on_timeline(fio_trace_timeline_s *tl) {
+  fio_trace_timeline_s *copy = malloc(sizeof(*copy));
+  if (!copy)
+    return;
+  *copy = *tl;
+  defer(iodine_trace_perform, copy, NULL);
+}
+
+/**
+ * Samples request timelines, attributing latency to the event queue, the GVL,
+ * the application or the network.
+ *
+ * Every `every` event (per worker thread, 100 by default) is sampled. Once the
+ * response was sent, the block is called with an Array of `[event, seconds]`
+ * pairs, where the time is relative to the first event.
+ *
+ *      Iodine.trace(1000) {|timeline| puts timeline.inspect }
+ *
+ * The events are:
+ *
+ * scheduled:: the reactor cycle in which the IO event was queued (the time
+ *             until `on_data_start` is the time spent waiting in the queue).
+ * on_data_start:: the connection's data started being handled.
+ * on_data_end:: the connection's data was handled.
+ * gvl_wait:: the thread started waiting for the GVL.
+ * gvl_enter:: the thread acquired the GVL.
+ * gvl_exit:: the thread released the GVL.
+ * handler_start:: the application started handling a request.
+ * handler_end:: the application finished handling a request.
+ * flushed:: all the response data was sent.
+ *
+ * Call without a block to stop sampling.
+ *
+ * The same trace points are available as USDT probes (when iodine was compiled
+ * with `sys/sdt.h` available), under the `iodine` provider.
+ */
+static VALUE iodine_trace(int argc, VALUE *argv, VALUE self) {
+  VALUE every, block;
+  rb_scan_args(argc, argv, "01&", &every, &block);
+  size_t count = 100;
+  if (every != Qnil) {
+    Check_Type(every, T_FIXNUM);
+    if (FIX2LONG(every) <= 0)
+      rb_raise(rb_eRangeError, "sampling rate must be a positive number.");
+    count = FIX2ULONG(every);
+  }
+  if (iodine_trace_block != Qnil)
+    IodineStore.remove(iodine_trace_block);
+  iodine_trace_block = block;
+  if (block == Qnil) {
+    fio_trace_sample(0, NULL);
+    return self;
+  }
+  IodineStore.add(block);
+  fio_trace_sample(count, iodine_trace_on_timeline);
+  return self;
+}
+
 /** Prints the Iodine startup message */
 static void iodine_print_startup_message(iodine_start_params_s params) {
   VALUE iodine_version = rb_const_get(IodineModule, rb_intern("VERSION"));
   VALUE ruby_version = rb_const_get(IodineModule, rb_intern("RUBY_VERSION"));
+  char threads[16];
   facil_expected_concurrency(&params.threads, &params.workers);
+  if (params.threads_max > params.threads)
+    snprintf(threads, sizeof(threads), "%d-%d", params.threads,
+             params.threads_max);
+  else
+    snprintf(threads, sizeof(threads), "%d", params.threads);
   fprintf(stderr,
           "\nStarting up Iodine:\n"
           " * Ruby v.%s\n * Iodine v.%s\n"
-          " * %d Workers X %d Threads per worker.\n"
+          " * %d Workers X %s Threads per worker.\n"
           "\n",
           StringValueCStr(ruby_version), StringValueCStr(iodine_version),
-          params.workers, params.threads);
+          params.workers, threads);
   (void)params;
 }
 
@@ -198,8 +552,20 @@ static VALUE iodine_start(VALUE self) {
   }
   VALUE threads_rb = iodine_threads_get(self);
   VALUE workers_rb = iodine_workers_get(self);
+  VALUE affinity_rb = iodine_affinity_get(self);
+  int16_t threads_max = 0;
+  if (rb_obj_is_kind_of(threads_rb, rb_cRange)) {
+    VALUE max;
+    int exclusive;
+    rb_range_values(threads_rb, &threads_rb, &max, &exclusive);
+    threads_max = (int16_t)(FIX2LONG(max) - exclusive);
+  }
   iodine_start_params_s params = {
-      .threads = NUM2SHORT(threads_rb), .workers = NUM2SHORT(workers_rb),
+      .threads = NUM2SHORT(threads_rb),
+      .workers = NUM2SHORT(workers_rb),
+      .threads_max = threads_max,
+      .affinity = (affinity_rb != Qfalse),
+      .numa = (affinity_rb != Qfalse && affinity_rb != Qtrue),
   };
   iodine_print_startup_message(params);
   IodineCaller.leaveGVL(iodine_run_outside_GVL, &params);
@@ -229,8 +595,18 @@ void Init_iodine(void) {
   rb_define_module_function(IodineModule, "threads=", iodine_threads_set, 1);
   rb_define_module_function(IodineModule, "workers", iodine_workers_get, 0);
   rb_define_module_function(IodineModule, "workers=", iodine_workers_set, 1);
+  rb_define_module_function(IodineModule, "affinity", iodine_affinity_get, 0);
+  rb_define_module_function(IodineModule, "affinity=", iodine_affinity_set, 1);
+  rb_define_module_function(IodineModule, "warmup", iodine_warmup_get, 0);
+  rb_define_module_function(IodineModule, "warmup=", iodine_warmup_set, 1);
   rb_define_module_function(IodineModule, "start", iodine_start, 0);
   rb_define_module_function(IodineModule, "on_idle", iodine_sched_on_idle, 0);
+  rb_define_module_function(IodineModule, "memory_stats", iodine_memory_stats,
+                            0);
+  rb_define_module_function(IodineModule, "stats", iodine_stats, 0);
+  rb_define_module_function(IodineModule, "stats_prometheus",
+                            iodine_stats_prometheus, 0);
+  rb_define_module_function(IodineModule, "trace", iodine_trace, -1);
 
   // initialize Object storage for GC protection
   iodine_storage_init();
@@ -254,6 +630,9 @@ void Init_iodine(void) {
   iodine_init_helpers();
   IodineRackIO.init();
 
+  // initialize the Fiber scheduler
+  IodineScheduler.init();
+
   // initialize Pub/Sub extension (for Engines)
   iodine_pubsub_init();
 }
@@ -11,6 +11,7 @@
 #include "iodine_json.h"
 #include "iodine_pubsub.h"
 #include "iodine_rack_io.h"
+#include "iodine_scheduler.h"
 #include "iodine_store.h"
 #include "iodine_tcp.h"
 
@@ -1,5 +1,7 @@
 #include "iodine_caller.h"
 
+#include "fio_trace.h"
+
 #include <ruby/thread.h>
 
 static __thread volatile uint8_t iodine_GVL_state;
@@ -64,15 +66,30 @@ static void *iodine_protect_ruby_call(void *task_) {
 API
 ***************************************************************************** */
 
+/* marks the time the GVL was acquired (see `fio_trace.h`) */
+typedef struct {
+  void *(*func)(void *);
+  void *arg;
+} iodine_GVL_task_s;
+
+static void *iodine_GVL_entered(void *task_) {
+  iodine_GVL_task_s *task = task_;
+  FIO_TRACE_MARK(gvl__enter, FIO_TRACE_GVL_ENTER);
+  return task->func(task->arg);
+}
+
 /** Calls a C function within the GVL. */
 static void *iodine_enterGVL(void *(*func)(void *), void *arg) {
   if (iodine_GVL_state) {
     return func(arg);
   }
   void *rv = NULL;
+  iodine_GVL_task_s task = {.func = func, .arg = arg};
+  FIO_TRACE_MARK(gvl__wait, FIO_TRACE_GVL_WAIT);
   iodine_GVL_state = 1;
-  rv = rb_thread_call_with_gvl(func, arg);
+  rv = rb_thread_call_with_gvl(iodine_GVL_entered, &task);
   iodine_GVL_state = 0;
+  FIO_TRACE_MARK(gvl__exit, FIO_TRACE_GVL_EXIT);
   return rv;
 }
 
@@ -82,9 +99,11 @@ static void *iodine_leaveGVL(void *(*func)(void *), void *arg) {
     return func(arg);
   }
   void *rv = NULL;
+  FIO_TRACE_MARK(gvl__exit, FIO_TRACE_GVL_EXIT);
   iodine_GVL_state = 0;
   rv = rb_thread_call_without_gvl(func, arg, NULL, NULL);
   iodine_GVL_state = 1;
+  FIO_TRACE_MARK(gvl__enter, FIO_TRACE_GVL_ENTER);
   return rv;
 }
 
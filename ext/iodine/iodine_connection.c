@@ -10,6 +10,8 @@
 
 #include <ruby/io.h>
 
+#include <poll.h>
+
 /* *****************************************************************************
 Constants in use
 ***************************************************************************** */
@@ -27,8 +29,16 @@ static ID engine_id;
 static ID message_id;
 static ID on_open_id;
 static ID on_message_id;
+static ID on_message_fragment_id;
+static ID on_messages_id;
 static ID on_drained_id;
 static ID ping_id;
+static ID high_id;
+static ID low_id;
+static ID policy_id;
+static ID delivery_id;
+static ID limit_id;
+static ID since_id;
 static ID on_shutdown_id;
 static ID on_close_id;
 static VALUE ConnectionKlass;
@@ -36,6 +46,12 @@ static rb_encoding *IodineUTF8Encoding;
 static VALUE WebSocketSymbol;
 static VALUE SSESymbol;
 static VALUE RAWSymbol;
+static VALUE DropSymbol;
+static VALUE BlockSymbol;
+static VALUE CloseSymbol;
+static VALUE LatestSymbol;
+static VALUE DropOldestSymbol;
+static VALUE DisconnectSymbol;
 
 /* *****************************************************************************
 Pub/Sub storage
@@ -59,9 +75,12 @@ static inline VALUE iodine_sub_unsubscribe(fio_hash_s *store, FIOBJ channel) {
   }
   return Qfalse;
 }
-static inline void iodine_sub_add(fio_hash_s *store, pubsub_sub_pt sub) {
-  FIOBJ channel = pubsub_sub_channel(sub); /* used for memory optimization */
-  sub = fio_hash_insert(store, channel, sub);
+/* `name` defaults to the subscription's channel (group subscriptions) */
+static inline void iodine_sub_add(fio_hash_s *store, FIOBJ name,
+                                  pubsub_sub_pt sub) {
+  if (!name)
+    name = pubsub_sub_channel(sub); /* used for memory optimization */
+  sub = fio_hash_insert(store, name, sub);
   if (sub) {
     pubsub_unsubscribe(sub);
   }
@@ -77,6 +96,29 @@ static inline void iodine_sub_clear_all(fio_hash_s *store) {
 static spn_lock_i sub_lock = SPN_LOCK_INIT;
 static fio_hash_s sub_global = FIO_HASH_INIT;
 
+/* *****************************************************************************
+Backpressure settings
+***************************************************************************** */
+
+/** What `write` does once a connection's queue passes the high watermark. */
+typedef enum {
+  IODINE_BACKPRESSURE_DROP,
+  IODINE_BACKPRESSURE_BLOCK,
+  IODINE_BACKPRESSURE_CLOSE,
+} iodine_backpressure_policy_e;
+
+typedef struct {
+  /** the high watermark, in bytes (0 == unlimited). */
+  size_t high;
+  /** the low watermark, in bytes. */
+  size_t low;
+  /** the policy (see `iodine_backpressure_policy_e`). */
+  uint8_t policy;
+} iodine_backpressure_s;
+
+/* the settings for new connections */
+static iodine_backpressure_s iodine_backpressure_default;
+
 /* *****************************************************************************
 C <=> Ruby Data allocation
 ***************************************************************************** */
@@ -86,7 +128,12 @@ typedef struct {
   size_t ref;
   fio_hash_s subscriptions;
   spn_lock_i lock;
+  iodine_backpressure_s backpressure;
+  /* set once the high watermark was reached, until the low watermark is. */
+  volatile uint8_t throttled;
   uint8_t answers_on_message;
+  uint8_t answers_on_message_fragment;
+  uint8_t answers_on_messages;
   uint8_t answers_on_drained;
   uint8_t answers_ping;
   /* these are one-shot, but the CPU cache might have the data, so set it */
@@ -164,6 +211,187 @@ iodine_connection_validate_data(VALUE self) {
   return c;
 }
 
+/* *****************************************************************************
+Backpressure
+***************************************************************************** */
+
+/**
+ * Returns 1 if writing `len` bytes would exceed the connection's high
+ * watermark (or if the low watermark wasn't reached since it was exceeded).
+ *
+ * An empty queue always accepts data.
+ */
+static inline uint8_t iodine_connection_throttle(iodine_connection_data_s *c,
+                                                 size_t len) {
+  if (!c->backpressure.high)
+    return 0;
+  size_t pending = sock_pending_bytes(c->info.uuid);
+  if (c->throttled) {
+    if (pending > c->backpressure.low)
+      return 1;
+    c->throttled = 0;
+  }
+  if (!pending || pending + len <= c->backpressure.high)
+    return 0;
+  c->throttled = 1;
+  return 1;
+}
+
+typedef struct {
+  intptr_t uuid;
+  size_t low;
+} iodine_connection_wait_s;
+
+/* flushes the connection until the low watermark is reached (no GVL). */
+static void *iodine_connection_wait_drained(void *arg_) {
+  iodine_connection_wait_s *arg = arg_;
+  struct pollfd pfd = {.fd = sock_uuid2fd(arg->uuid), .events = POLLOUT};
+  while (sock_pending_bytes(arg->uuid) > arg->low && facil_is_running()) {
+    if (sock_flush(arg->uuid) == -1)
+      break;
+    if (sock_pending_bytes(arg->uuid) <= arg->low)
+      break;
+    poll(&pfd, 1, 100);
+  }
+  return NULL;
+}
+
+/**
+ * Applies the connection's backpressure policy, returning 0 if `len` bytes
+ * can be written (the GVL is released while waiting).
+ */
+static uint8_t iodine_connection_backpressure(iodine_connection_data_s *c,
+                                              size_t len) {
+  if (!iodine_connection_throttle(c, len))
+    return 0;
+  switch ((iodine_backpressure_policy_e)c->backpressure.policy) {
+  case IODINE_BACKPRESSURE_BLOCK: {
+    iodine_connection_wait_s arg = {.uuid = c->info.uuid,
+                                    .low = c->backpressure.low};
+    IodineCaller.leaveGVL(iodine_connection_wait_drained, &arg);
+    if (sock_isclosed(arg.uuid) ||
+        sock_pending_bytes(arg.uuid) > c->backpressure.low)
+      return 1;
+    c->throttled = 0;
+    return 0;
+  }
+  case IODINE_BACKPRESSURE_CLOSE:
+    sock_force_close(c->info.uuid);
+    return 1;
+  case IODINE_BACKPRESSURE_DROP: /* fallthrough */
+  default:
+    return 1;
+  }
+}
+
+/* reads the `high`, `low` and `policy` options from a Ruby Hash. */
+static iodine_backpressure_s iodine_backpressure_parse(VALUE opt) {
+  Check_Type(opt, T_HASH);
+  iodine_backpressure_s ret = {.policy = IODINE_BACKPRESSURE_DROP};
+  VALUE tmp = rb_hash_aref(opt, ID2SYM(high_id));
+  if (tmp != Qnil) {
+    Check_Type(tmp, T_FIXNUM);
+    if (FIX2LONG(tmp) < 0)
+      rb_raise(rb_eRangeError, "high watermark can't be negative.");
+    ret.high = FIX2ULONG(tmp);
+  }
+  ret.low = ret.high >> 1;
+  tmp = rb_hash_aref(opt, ID2SYM(low_id));
+  if (tmp != Qnil) {
+    Check_Type(tmp, T_FIXNUM);
+    if (FIX2LONG(tmp) < 0 || FIX2ULONG(tmp) > ret.high)
+      rb_raise(rb_eRangeError,
+               "low watermark must be between 0 and the high watermark.");
+    ret.low = FIX2ULONG(tmp);
+  }
+  tmp = rb_hash_aref(opt, ID2SYM(policy_id));
+  if (tmp == BlockSymbol) {
+    ret.policy = IODINE_BACKPRESSURE_BLOCK;
+  } else if (tmp == CloseSymbol) {
+    ret.policy = IODINE_BACKPRESSURE_CLOSE;
+  } else if (tmp != Qnil && tmp != DropSymbol) {
+    rb_raise(rb_eArgError, "backpressure policy should be :drop, :block or "
+                           ":close.");
+  }
+  return ret;
+}
+
+/* converts the settings to a Ruby Hash. */
+static VALUE iodine_backpressure2hash(iodine_backpressure_s *bp) {
+  VALUE h = rb_hash_new();
+  rb_hash_aset(h, ID2SYM(high_id), SIZET2NUM(bp->high));
+  rb_hash_aset(h, ID2SYM(low_id), SIZET2NUM(bp->low));
+  rb_hash_aset(h, ID2SYM(policy_id),
+               (bp->policy == IODINE_BACKPRESSURE_BLOCK
+                    ? BlockSymbol
+                    : bp->policy == IODINE_BACKPRESSURE_CLOSE ? CloseSymbol
+                                                             : DropSymbol));
+  return h;
+}
+
+/**
+ * Sets the write backpressure limits for the connection, i.e.:
+ *
+ *      client.backpressure = {high: 4_194_304, low: 1_048_576, policy: :drop}
+ *
+ * Once more than `high` bytes are waiting to be sent, `write` follows the
+ * `policy` until the queue drops to `low` bytes (defaults to `high / 2`):
+ *
+ * * `:drop` - `write` returns `false` and the data is discarded.
+ *
+ * * `:block` - `write` flushes the connection (releasing the GVL) until `low`
+ *              is reached. `false` is returned if the connection was closed.
+ *
+ * * `:close` - the connection is closed immediately and `write` returns
+ *              `false`.
+ *
+ * Pub/Sub messages forwarded directly to the client (subscriptions without a
+ * block) are skipped while the connection is over the limit (or close the
+ * connection, when the policy is `:close`).
+ *
+ * A `high` value of 0 (the default) disables the limit. An empty queue always
+ * accepts a `write`, regardless of the data's size.
+ *
+ * See {Iodine::Connection.backpressure=} for the default settings.
+ */
+static VALUE iodine_connection_backpressure_set(VALUE self, VALUE opt) {
+  iodine_backpressure_s bp = iodine_backpressure_parse(opt);
+  iodine_connection_data_s *c = iodine_connection_validate_data(self);
+  if (c) {
+    c->backpressure = bp;
+    c->throttled = 0;
+  }
+  return opt;
+}
+
+/** Returns the connection's write backpressure settings (a Hash). */
+static VALUE iodine_connection_backpressure_get(VALUE self) {
+  iodine_connection_data_s *c = iodine_connection_validate_data(self);
+  if (!c)
+    return Qnil;
+  return iodine_backpressure2hash(&c->backpressure);
+}
+
+/**
+ * Sets the default write backpressure limits for new connections, i.e.:
+ *
+ *      Iodine::Connection.backpressure = {high: 4_194_304, policy: :drop}
+ *
+ * See {Iodine::Connection#backpressure=} for details.
+ */
+static VALUE iodine_connection_backpressure_default_set(VALUE self,
+                                                        VALUE opt) {
+  iodine_backpressure_default = iodine_backpressure_parse(opt);
+  return opt;
+  (void)self;
+}
+
+/** Returns the default write backpressure settings (a Hash). */
+static VALUE iodine_connection_backpressure_default_get(VALUE self) {
+  return iodine_backpressure2hash(&iodine_backpressure_default);
+  (void)self;
+}
+
 /* *****************************************************************************
 Ruby Connection Methods - write, close open? pending
 ***************************************************************************** */
@@ -176,6 +404,9 @@ Ruby Connection Methods - write, close open? pending
  *
  * Use {pending} to test how many `write` operations are pending completion
  * (`on_drained(client)` will be called when they complete).
+ *
+ * Returns `false` if the data was refused by the connection's backpressure
+ * policy (see {backpressure=}).
  */
 static VALUE iodine_connection_write(VALUE self, VALUE data) {
   iodine_connection_data_s *c = iodine_connection_validate_data(self);
@@ -184,6 +415,9 @@ static VALUE iodine_connection_write(VALUE self, VALUE data) {
     return Qnil;
     // rb_raise(rb_eIOError, "Connection closed or invalid.");
   }
+  Check_Type(data, T_STRING);
+  if (iodine_connection_backpressure(c, RSTRING_LEN(data)))
+    return Qfalse;
   switch (c->info.type) {
   case IODINE_CONNECTION_WEBSOCKET:
     /* WebSockets*/
@@ -336,15 +570,28 @@ Pub/Sub Callbacks (internal implementation)
 ***************************************************************************** */
 
 /* calls the Ruby block assigned to a pubsub event (within the GVL). */
+/* tests if a handler's `call` accepts the message's sequence number */
+static int iodine_on_pubsub_takes_seq(VALUE handler) {
+  int arity = (rb_obj_is_proc(handler) ? rb_proc_arity(handler)
+                                       : rb_obj_method_arity(handler, call_id));
+  return (arity == 3 || (arity < 0 && arity >= -4));
+}
+
 static void *iodine_on_pubsub_call_block(void *msg_) {
   pubsub_message_s *msg = msg_;
   fio_cstr_s tmp;
-  VALUE args[2];
+  VALUE args[3];
+  int argc = 2;
   tmp = fiobj_obj2cstr(msg->channel);
   args[0] = rb_str_new(tmp.data, tmp.len);
   tmp = fiobj_obj2cstr(msg->message);
   args[1] = rb_str_new(tmp.data, tmp.len);
-  IodineCaller.call2((VALUE)msg->udata2, call_id, 2, args);
+  /* channels with a history pass the sequence number (see `since`) */
+  if (msg->seq && iodine_on_pubsub_takes_seq((VALUE)msg->udata2)) {
+    args[2] = ULL2NUM(msg->seq);
+    argc = 3;
+  }
+  IodineCaller.call2((VALUE)msg->udata2, call_id, argc, args);
   return NULL;
 }
 
@@ -358,14 +605,18 @@ static void iodine_on_pubsub(pubsub_message_s *msg) {
     if (data->info.handler == Qnil || data->info.uuid == -1 ||
         sock_isclosed(data->info.uuid))
       return;
-    switch (data->info.type) {
-    case IODINE_CONNECTION_WEBSOCKET: {
-      fio_cstr_s str = fiobj_obj2cstr(msg->message);
-      websocket_write(data->info.arg, str.data, str.len, (block == Qnil));
+    /* skip slow consumers (can't block the pub/sub delivery) */
+    if (iodine_connection_throttle(data, fiobj_obj2cstr(msg->message).len)) {
+      if (data->backpressure.policy == IODINE_BACKPRESSURE_CLOSE)
+        sock_force_close(data->info.uuid);
       return;
     }
+    switch (data->info.type) {
+    case IODINE_CONNECTION_WEBSOCKET:
+      websocket_write_pubsub(data->info.arg, msg, (block == Qnil));
+      return;
     case IODINE_CONNECTION_SSE:
-      http_sse_write(data->info.arg, .data = fiobj_obj2cstr(msg->message));
+      http_sse_write_pubsub(data->info.arg, msg);
       return;
     default:
       fiobj_send_free(data->info.uuid, fiobj_dup(msg->message));
@@ -401,15 +652,20 @@ Ruby Connection Methods - Pub/Sub
 
 typedef struct {
   VALUE channel;
+  VALUE channels;
   VALUE block;
+  size_t limit;
+  uint64_t since;
   uint8_t binary;
   uint8_t pattern;
+  uint8_t delivery;
+  uint8_t replay;
 } iodine_sub_args_s;
 
 /** Tests the `subscribe` Ruby arguments */
 static iodine_sub_args_s iodine_subscribe_args(int argc, VALUE *argv) {
 
-  iodine_sub_args_s ret = {.channel = Qnil, .block = Qnil};
+  iodine_sub_args_s ret = {.channel = Qnil, .channels = Qnil, .block = Qnil};
   VALUE rb_opt = 0;
 
   switch (argc) {
@@ -445,6 +701,22 @@ static iodine_sub_args_s iodine_subscribe_args(int argc, VALUE *argv) {
     return ret;
   }
 
+  if (TYPE(ret.channel) == T_ARRAY) {
+    /* a group subscription */
+    if (!RARRAY_LEN(ret.channel))
+      rb_raise(rb_eArgError, "at least one channel is required.");
+    VALUE channels = rb_ary_new_capa(RARRAY_LEN(ret.channel));
+    for (long i = 0; i < RARRAY_LEN(ret.channel); ++i) {
+      VALUE tmp = RARRAY_AREF(ret.channel, i);
+      if (TYPE(tmp) == T_SYMBOL)
+        tmp = rb_sym2str(tmp);
+      Check_Type(tmp, T_STRING);
+      rb_ary_push(channels, tmp);
+    }
+    ret.channels = channels;
+    ret.channel = rb_ary_join(channels, rb_str_new(",", 1));
+  }
+
   if (TYPE(ret.channel) == T_SYMBOL)
     ret.channel = rb_sym2str(ret.channel);
   Check_Type(ret.channel, T_STRING);
@@ -456,6 +728,34 @@ static iodine_sub_args_s iodine_subscribe_args(int argc, VALUE *argv) {
     if (rb_hash_aref(rb_opt, match_id) == redis_id) {
       ret.pattern = 1;
     }
+    VALUE tmp = rb_hash_aref(rb_opt, ID2SYM(delivery_id));
+    if (tmp == LatestSymbol) {
+      ret.delivery = PUBSUB_DELIVER_LATEST;
+    } else if (tmp == DropOldestSymbol) {
+      ret.delivery = PUBSUB_DELIVER_DROP_OLDEST;
+    } else if (tmp == DisconnectSymbol) {
+      ret.delivery = PUBSUB_DELIVER_DISCONNECT;
+    } else if (tmp != Qnil) {
+      rb_raise(rb_eArgError, "delivery should be :latest, :drop_oldest or "
+                             ":disconnect.");
+    }
+    tmp = rb_hash_aref(rb_opt, ID2SYM(limit_id));
+    if (tmp != Qnil) {
+      Check_Type(tmp, T_FIXNUM);
+      if (FIX2LONG(tmp) <= 0)
+        rb_raise(rb_eRangeError, "limit must be a positive number.");
+      ret.limit = FIX2ULONG(tmp);
+    }
+    tmp = rb_hash_aref(rb_opt, ID2SYM(since_id));
+    if (tmp != Qnil) {
+      if (ret.pattern || ret.channels != Qnil)
+        rb_raise(rb_eArgError, "since requires a single channel (no :match).");
+      Check_Type(tmp, T_FIXNUM);
+      if (FIX2LONG(tmp) < 0)
+        rb_raise(rb_eRangeError, "since can't be a negative number.");
+      ret.since = FIX2ULONG(tmp);
+      ret.replay = 1;
+    }
     ret.block = rb_hash_aref(rb_opt, handler_id);
     if (ret.block != Qnil) {
       IodineStore.add(ret.block);
@@ -485,7 +785,13 @@ to call the method:
       MyProc = Proc.new {|source, msg| p msg }
       subscribe to: "my_stream", match: :redis, handler: MyProc
 
-The first argument must be either a String or a Hash.
+The first argument must be either a String, an Array or a Hash.
+
+When an Array of channels is used (either as the first argument or the `:to` option), all the channels share a single subscription (a group subscription), which is cheaper than subscribing to each channel separately:
+
+      subscribe(["room:1", "room:2", "lobby"]) {|source, msg| p msg }
+
+The group subscription is named after the channel names, joined with a comma (`"room:1,room:2,lobby"`), and all the options apply to the whole group (i.e., a `:delivery` policy limits the messages held for the group, not per channel).
 
 The second, optional, argument must be a Hash (if given).
 
@@ -499,6 +805,16 @@ The options Hash supports the following possible keys (other keys are ignored, a
 
 :handler :: Any object that answers `#call(source, msg)` where source is the stream / channel name.
 
+:delivery :: (only for connections) how messages are delivered once the client's outgoing data backs up. Valid values are: `:latest` (only the latest message is kept), `:drop_oldest` (up to `:limit` messages are kept, discarding the oldest) and `:disconnect` (the connection is closed once more than `:limit` messages are waiting). By default, all messages are delivered.
+
+:limit :: (with `:delivery`) the maximum number of messages waiting for a backed up client. Defaults to 256.
+
+:since :: (only for channels with a history, see {Iodine::PubSub.history}) the sequence number of the last message the client received. Any later messages still in the history are delivered before new messages, so a reconnecting client can catch up. Use `0` to receive the whole history. Not supported for `:match` or group subscriptions.
+
+Handlers receive a third argument, the message's sequence number, if the channel keeps a history and the handler accepts it:
+
+      subscribe("chat", since: last_seen) {|source, msg, seq| write "#{seq}:#{msg}" }
+
 Note: if an existing subscription with the same name exists, it will be replaced by this new subscription.
 
 Returns the name of the subscription, which matches the name be used in {unsubscribe} (or nil on failure).
@@ -532,27 +848,59 @@ static VALUE iodine_pubsub_subscribe(int argc, VALUE *argv, VALUE self) {
 
   FIOBJ channel =
       fiobj_str_new(RSTRING_PTR(args.channel), RSTRING_LEN(args.channel));
-  pubsub_sub_pt sub =
-      pubsub_subscribe(.channel = channel, .on_message = iodine_on_pubsub,
-                       .on_unsubscribe = iodine_on_unsubscribe, .udata1 = c,
-                       .udata2 = (void *)args.block,
-                       .use_pattern = args.pattern);
-  fiobj_free(channel);
+  pubsub_sub_pt sub;
+  if (args.channels == Qnil) {
+    sub = pubsub_subscribe(
+            .channel = channel, .on_message = iodine_on_pubsub,
+            .on_unsubscribe = iodine_on_unsubscribe, .udata1 = c,
+            .udata2 = (void *)args.block, .use_pattern = args.pattern,
+            .replay = args.replay, .since = args.since,
+            .delivery = (c ? (pubsub_delivery_e)args.delivery
+                           : PUBSUB_DELIVER_ALL),
+            .uuid = (c ? c->info.uuid : -1), .limit = args.limit);
+  } else {
+    /* a single subscription for all the channels */
+    size_t count = (size_t)RARRAY_LEN(args.channels);
+    FIOBJ *channels = malloc(sizeof(*channels) * count);
+    if (!channels) {
+      perror("FATAL ERROR: (iodine) couldn't allocate memory");
+      exit(errno);
+    }
+    for (size_t i = 0; i < count; ++i) {
+      VALUE tmp = RARRAY_AREF(args.channels, i);
+      channels[i] = fiobj_str_new(RSTRING_PTR(tmp), RSTRING_LEN(tmp));
+    }
+    sub = pubsub_subscribe_group(
+            .channels = channels, .count = count,
+            .on_message = iodine_on_pubsub,
+            .on_unsubscribe = iodine_on_unsubscribe, .udata1 = c,
+            .udata2 = (void *)args.block, .use_pattern = args.pattern,
+            .delivery = (c ? (pubsub_delivery_e)args.delivery
+                           : PUBSUB_DELIVER_ALL),
+            .uuid = (c ? c->info.uuid : -1), .limit = args.limit);
+    for (size_t i = 0; i < count; ++i)
+      fiobj_free(channels[i]);
+    free(channels);
+  }
+  /* group subscriptions are named after the joined channel names */
+  FIOBJ name = (args.channels == Qnil ? FIOBJ_INVALID : channel);
   if (c) {
     spn_lock(&c->lock);
     if (c->info.uuid == -1) {
       pubsub_unsubscribe(sub);
       spn_unlock(&c->lock);
+      fiobj_free(channel);
       return Qnil;
     } else {
-      iodine_sub_add(&c->subscriptions, sub);
+      iodine_sub_add(&c->subscriptions, name, sub);
     }
     spn_unlock(&c->lock);
   } else {
     spn_lock(&sub_lock);
-    iodine_sub_add(&sub_global, sub);
+    iodine_sub_add(&sub_global, name, sub);
     spn_unlock(&sub_lock);
   }
+  fiobj_free(channel);
   return args.channel;
 }
 
@@ -565,6 +913,12 @@ The method accepts a single arguments, the name used for the subscription. i.e.:
       subscribe("my_stream") {|source, msg| p msg }
       unsubscribe("my_stream")
 
+Group subscriptions can be canceled using the same Array of channels (or the
+name returned by {subscribe}):
+
+      subscribe(["room:1", "room:2"])
+      unsubscribe(["room:1", "room:2"])
+
 Returns `true` if the subscription was found.
 
 Returns `false` if the subscription didn't exist.
@@ -572,6 +926,8 @@ Returns `false` if the subscription didn't exist.
 static VALUE iodine_pubsub_unsubscribe(VALUE self, VALUE name) {
   // clang-format on
   iodine_connection_data_s *c = NULL;
+  if (TYPE(name) == T_ARRAY)
+    name = rb_ary_join(name, rb_str_new(",", 1));
   FIOBJ channel = fiobj_str_new(RSTRING_PTR(name), RSTRING_LEN(name));
   VALUE ret;
   if (TYPE(self) == T_MODULE) {
@@ -581,11 +937,12 @@ static VALUE iodine_pubsub_unsubscribe(VALUE self, VALUE name) {
   } else {
     c = iodine_connection_validate_data(self);
     if (!c) {
-      return Qnil; /* cannot subscribe a closed connection. */
+      fiobj_free(channel);
+      return Qnil; /* cannot unsubscribe a closed connection. */
     }
-    spn_lock(&sub_lock);
-    ret = iodine_sub_unsubscribe(&sub_global, channel);
-    spn_unlock(&sub_lock);
+    spn_lock(&c->lock);
+    ret = iodine_sub_unsubscribe(&c->subscriptions, channel);
+    spn_unlock(&c->lock);
   }
   fiobj_free(channel);
   return ret;
@@ -673,6 +1030,81 @@ static VALUE iodine_pubsub_publish(int argc, VALUE *argv, VALUE self) {
   (void)self;
 }
 
+// clang-format off
+/**
+Publishes a number of messages at once, where each message is an Array with a
+channel and a message:
+
+      Iodine.publish_many [["game:1", state1], ["game:2", state2]]
+
+The method accepts an optional `engine` argument (see {Iodine.publish}):
+
+      Iodine.publish_many(messages, my_pubsub_engine)
+
+The batch is handled by the engine at once (i.e., the default engine sends the
+whole batch to the other processes using a single IPC write and the Redis
+engine pipelines the batch's `PUBLISH` commands), which is faster than calling
+{Iodine.publish} for each message.
+
+Returns the number of messages published (for the default engine, the number of
+messages with subscribers in the current process).
+*/
+static VALUE iodine_pubsub_publish_many(int argc, VALUE *argv, VALUE self) {
+  // clang-format on
+  VALUE rb_msgs, rb_engine = Qnil;
+  const pubsub_engine_s *engine = NULL;
+  rb_scan_args(argc, argv, "11", &rb_msgs, &rb_engine);
+  Check_Type(rb_msgs, T_ARRAY);
+  size_t count = (size_t)RARRAY_LEN(rb_msgs);
+  if (!count)
+    return INT2FIX(0);
+  /* validate first, so nothing is leaked when an exception is raised */
+  for (size_t i = 0; i < count; ++i) {
+    VALUE pair = RARRAY_AREF(rb_msgs, i);
+    Check_Type(pair, T_ARRAY);
+    if (RARRAY_LEN(pair) != 2)
+      rb_raise(rb_eArgError,
+               "each message should be a [channel, message] pair.");
+    VALUE rb_ch = RARRAY_AREF(pair, 0);
+    if (TYPE(rb_ch) != T_SYMBOL)
+      Check_Type(rb_ch, T_STRING);
+    Check_Type(RARRAY_AREF(pair, 1), T_STRING);
+  }
+
+  if (rb_engine == Qfalse) {
+    engine = PUBSUB_PROCESS_ENGINE;
+  } else if (rb_engine != Qnil) {
+    // collect engine object
+    iodine_pubsub_s *e = iodine_pubsub_CData(rb_engine);
+    if (e) {
+      engine = e->engine;
+    }
+  }
+
+  FIOBJ *ch = malloc(sizeof(*ch) * count * 2);
+  if (!ch) {
+    perror("FATAL ERROR: (iodine) couldn't allocate memory");
+    exit(errno);
+  }
+  FIOBJ *msg = ch + count;
+  for (size_t i = 0; i < count; ++i) {
+    VALUE pair = RARRAY_AREF(rb_msgs, i);
+    VALUE rb_ch = RARRAY_AREF(pair, 0);
+    VALUE rb_msg = RARRAY_AREF(pair, 1);
+    if (TYPE(rb_ch) == T_SYMBOL)
+      rb_ch = rb_sym2str(rb_ch);
+    ch[i] = fiobj_str_new(RSTRING_PTR(rb_ch), RSTRING_LEN(rb_ch));
+    msg[i] = fiobj_str_new(RSTRING_PTR(rb_msg), RSTRING_LEN(rb_msg));
+  }
+
+  int ret = pubsub_publish_batch(engine, ch, msg, count);
+  for (size_t i = 0; i < count * 2; ++i)
+    fiobj_free(ch[i]);
+  free(ch);
+  return INT2FIX(ret < 0 ? 0 : ret);
+  (void)self;
+}
+
 /* *****************************************************************************
 Published C functions
 ***************************************************************************** */
@@ -697,11 +1129,15 @@ VALUE iodine_connection_new(iodine_connection_s args) {
       .ref = 1,
       .answers_on_open = (rb_respond_to(args.handler, on_open_id) != 0),
       .answers_on_message = (rb_respond_to(args.handler, on_message_id) != 0),
+      .answers_on_message_fragment =
+          (rb_respond_to(args.handler, on_message_fragment_id) != 0),
+      .answers_on_messages = (rb_respond_to(args.handler, on_messages_id) != 0),
       .answers_ping = (rb_respond_to(args.handler, ping_id) != 0),
       .answers_on_drained = (rb_respond_to(args.handler, on_drained_id) != 0),
       .answers_on_shutdown = (rb_respond_to(args.handler, on_shutdown_id) != 0),
       .answers_on_close = (rb_respond_to(args.handler, on_close_id) != 0),
       .lock = SPN_LOCK_INIT,
+      .backpressure = iodine_backpressure_default,
   };
   return connection;
 }
@@ -736,6 +1172,11 @@ void iodine_connection_fire_event(VALUE connection,
       IodineCaller.call2(data->info.handler, on_message_id, 2, args);
     }
     break;
+  case IODINE_CONNECTION_ON_MESSAGES:
+    if (data->answers_on_messages) {
+      IodineCaller.call2(data->info.handler, on_messages_id, 2, args);
+    }
+    break;
   case IODINE_CONNECTION_ON_DRAINED:
     if (data->answers_on_drained) {
       IodineCaller.call2(data->info.handler, on_drained_id, 1, args);
@@ -770,6 +1211,29 @@ void iodine_connection_fire_event(VALUE connection,
   }
 }
 
+/** Returns 1 if the connection's handler streams messages (see below). */
+uint8_t iodine_connection_streams(VALUE connection) {
+  iodine_connection_data_s *data = iodine_connection_validate_data(connection);
+  return data ? data->answers_on_message_fragment : 0;
+}
+
+/** Returns 1 if the connection's handler answers `on_messages`. */
+uint8_t iodine_connection_batches(VALUE connection) {
+  iodine_connection_data_s *data = iodine_connection_validate_data(connection);
+  return data ? data->answers_on_messages : 0;
+}
+
+/** Fires the `on_message_fragment(client, data, first, last)` event. */
+void iodine_connection_fire_fragment(VALUE connection, VALUE data,
+                                     uint8_t first, uint8_t last) {
+  iodine_connection_data_s *c = iodine_connection_validate_data(connection);
+  if (!c || !c->answers_on_message_fragment || c->info.handler == Qnil)
+    return;
+  VALUE args[4] = {connection, data, (first ? Qtrue : Qfalse),
+                   (last ? Qtrue : Qfalse)};
+  IodineCaller.call2(c->info.handler, on_message_fragment_id, 4, args);
+}
+
 void iodine_connection_init(void) {
   // set used constants
   IodineUTF8Encoding = rb_enc_find("UTF-8");
@@ -788,10 +1252,18 @@ void iodine_connection_init(void) {
   message_id = rb_intern2("message", 7);
   on_open_id = rb_intern("on_open");
   on_message_id = rb_intern("on_message");
+  on_message_fragment_id = rb_intern("on_message_fragment");
+  on_messages_id = rb_intern("on_messages");
   on_drained_id = rb_intern("on_drained");
   on_shutdown_id = rb_intern("on_shutdown");
   on_close_id = rb_intern("on_close");
   ping_id = rb_intern("ping");
+  high_id = rb_intern("high");
+  low_id = rb_intern("low");
+  policy_id = rb_intern("policy");
+  delivery_id = rb_intern("delivery");
+  limit_id = rb_intern("limit");
+  since_id = rb_intern("since");
 
   // globalize ID objects
   if (1) {
@@ -806,10 +1278,18 @@ void iodine_connection_init(void) {
     IodineStore.add(ID2SYM(message_id));
     IodineStore.add(ID2SYM(on_open_id));
     IodineStore.add(ID2SYM(on_message_id));
+    IodineStore.add(ID2SYM(on_message_fragment_id));
+    IodineStore.add(ID2SYM(on_messages_id));
     IodineStore.add(ID2SYM(on_drained_id));
     IodineStore.add(ID2SYM(on_shutdown_id));
     IodineStore.add(ID2SYM(on_close_id));
     IodineStore.add(ID2SYM(ping_id));
+    IodineStore.add(ID2SYM(high_id));
+    IodineStore.add(ID2SYM(low_id));
+    IodineStore.add(ID2SYM(policy_id));
+    IodineStore.add(ID2SYM(delivery_id));
+    IodineStore.add(ID2SYM(limit_id));
+    IodineStore.add(ID2SYM(since_id));
   }
 
   // should these be globalized?
@@ -819,6 +1299,18 @@ void iodine_connection_init(void) {
   IodineStore.add(WebSocketSymbol);
   IodineStore.add(SSESymbol);
   IodineStore.add(RAWSymbol);
+  DropSymbol = ID2SYM(rb_intern("drop"));
+  BlockSymbol = ID2SYM(rb_intern("block"));
+  CloseSymbol = ID2SYM(rb_intern("close"));
+  IodineStore.add(DropSymbol);
+  IodineStore.add(BlockSymbol);
+  IodineStore.add(CloseSymbol);
+  LatestSymbol = ID2SYM(rb_intern("latest"));
+  DropOldestSymbol = ID2SYM(rb_intern("drop_oldest"));
+  DisconnectSymbol = ID2SYM(rb_intern("disconnect"));
+  IodineStore.add(LatestSymbol);
+  IodineStore.add(DropOldestSymbol);
+  IodineStore.add(DisconnectSymbol);
 
   // define the Connection Class and it's methods
   ConnectionKlass =
@@ -835,6 +1327,14 @@ void iodine_connection_init(void) {
   rb_define_method(ConnectionKlass, "timeout=", iodine_connection_timeout_set,
                    1);
   rb_define_method(ConnectionKlass, "env", iodine_connection_env, 0);
+  rb_define_method(ConnectionKlass, "backpressure",
+                   iodine_connection_backpressure_get, 0);
+  rb_define_method(ConnectionKlass, "backpressure=",
+                   iodine_connection_backpressure_set, 1);
+  rb_define_singleton_method(ConnectionKlass, "backpressure",
+                             iodine_connection_backpressure_default_get, 0);
+  rb_define_singleton_method(ConnectionKlass, "backpressure=",
+                             iodine_connection_backpressure_default_set, 1);
 
   rb_define_method(ConnectionKlass, "subscribe", iodine_pubsub_subscribe, -1);
   rb_define_method(ConnectionKlass, "unsubscribe", iodine_pubsub_unsubscribe,
@@ -847,4 +1347,6 @@ void iodine_connection_init(void) {
   rb_define_module_function(IodineModule, "unsubscribe",
                             iodine_pubsub_unsubscribe, 1);
   rb_define_module_function(IodineModule, "publish", iodine_pubsub_publish, -1);
+  rb_define_module_function(IodineModule, "publish_many",
+                            iodine_pubsub_publish_many, -1);
 }
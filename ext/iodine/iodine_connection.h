@@ -27,6 +27,7 @@ VALUE iodine_connection_new(iodine_connection_s args);
 typedef enum {
   IODINE_CONNECTION_ON_OPEN,
   IODINE_CONNECTION_ON_MESSAGE,
+  IODINE_CONNECTION_ON_MESSAGES,
   IODINE_CONNECTION_ON_DRAINED,
   IODINE_CONNECTION_PING,
   IODINE_CONNECTION_ON_SHUTDOWN,
@@ -34,12 +35,29 @@ typedef enum {
 } iodine_connection_event_type_e;
 
 /**
- * Fires a connection object's event. `data` is only for the on_message event.
+ * Fires a connection object's event. `data` is only for the on_message event
+ * (and the on_messages event, where it's an Array of messages).
  */
 void iodine_connection_fire_event(VALUE connection,
                                   iodine_connection_event_type_e ev,
                                   VALUE data);
 
+/**
+ * Returns 1 if the connection's handler answers `on_message_fragment` (streams
+ * Websocket messages rather than buffering them).
+ */
+uint8_t iodine_connection_streams(VALUE connection);
+
+/**
+ * Returns 1 if the connection's handler answers `on_messages` (receives the
+ * Websocket messages read together as an Array, rather than `on_message`).
+ */
+uint8_t iodine_connection_batches(VALUE connection);
+
+/** Fires the `on_message_fragment` event (streamed Websocket messages). */
+void iodine_connection_fire_fragment(VALUE connection, VALUE data,
+                                     uint8_t first, uint8_t last);
+
 /** Initializes the Connection Ruby class. */
 void iodine_connection_init(void);
 
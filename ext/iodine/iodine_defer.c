@@ -6,6 +6,7 @@
 // clang-format on
 
 #include "facil.h"
+#include "fio_mem.h"
 #include <spnlock.inc>
 
 #include <pthread.h>
@@ -83,15 +84,59 @@ static void *create_ruby_thread_gvl(void *args) {
   return (void *)IodineStore.add(rb_thread_create(defer_thread_inGVL, args));
 }
 
+/* *****************************************************************************
+Ractor worker threads (experimental)
+***************************************************************************** */
+
+/* when set, worker threads are started within their own Ractor */
+static uint8_t iodine_ractor_threads = 0;
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+
+/* the Ractor's block, receives the thread's arguments as an Integer */
+static VALUE defer_ractor_inGVL(VALUE self, VALUE args) {
+  return defer_thread_inGVL((void *)NUM2SIZET(args));
+  (void)self;
+}
+
+/* Within the GVL, creates a Ractor (running a single thread) */
+static void *create_ruby_ractor_gvl(void *args) {
+  VALUE ractor = rb_const_get(rb_cObject, rb_intern2("Ractor", 6));
+  VALUE block = rb_obj_method(IodineBaseModule, ID2SYM(rb_intern("ractor")));
+  block = rb_funcall(block, rb_intern("to_proc"), 0);
+  VALUE arg = SIZET2NUM((size_t)args);
+  return (void *)IodineStore.add(
+      rb_funcall_with_block(ractor, rb_intern2("new", 3), 1, &arg, block));
+}
+
+int iodine_defer_use_ractors(void) {
+  iodine_ractor_threads = 1;
+  return 0;
+}
+
+#else
+
+int iodine_defer_use_ractors(void) { return -1; }
+
+#define create_ruby_ractor_gvl create_ruby_thread_gvl
+
+#endif /* HAVE_RB_EXT_RACTOR_SAFE */
+
 /* Runs the before / after fork callbacks (if `before` is true, before runs) */
 static void iodine_perform_fork_callbacks(uint8_t before);
 
+/* Prepares the root process's memory for forking (see `Iodine.warmup`) */
+static void iodine_prefork_warmup(void);
+
 static void *fork_using_ruby(void *ignr) {
   // stop IO thread and call before_fork callbacks
   if (sock_io_pthread) {
     iodine_join_io_thread();
   }
   iodine_perform_fork_callbacks(1);
+  iodine_prefork_warmup();
+  // new allocations shouldn't dirty the pages shared with the workers
+  fio_malloc_before_fork();
   // fork
   const VALUE ProcessClass = rb_const_get(rb_cObject, rb_intern2("Process", 7));
   const VALUE rb_pid = IodineCaller.call(ProcessClass, rb_intern2("fork", 4));
@@ -121,7 +166,10 @@ void *defer_new_thread(void *(*thread_func)(void *), void *arg) {
       .thread_func = thread_func, .arg = arg, .lock = SPN_LOCK_INIT,
   };
   spn_lock(&data.lock);
-  void *thr = IodineCaller.enterGVL(create_ruby_thread_gvl, &data);
+  void *thr = IodineCaller.enterGVL(iodine_ractor_threads
+                                        ? create_ruby_ractor_gvl
+                                        : create_ruby_thread_gvl,
+                                    &data);
   if (!thr || thr == (void *)Qnil || thr == (void *)Qfalse) {
     thr = NULL;
   } else {
@@ -137,7 +185,9 @@ OVERRIDE THIS to replace the default pthread implementation.
 int defer_join_thread(void *thr) {
   if (!thr || (VALUE)thr == Qfalse || (VALUE)thr == Qnil)
     return -1;
-  IodineCaller.call((VALUE)thr, rb_intern("join"));
+  /* a Ractor's thread is joined by taking the Ractor's result */
+  IodineCaller.call((VALUE)thr,
+                    iodine_ractor_threads ? rb_intern("take") : rb_intern("join"));
   IodineStore.remove((VALUE)thr);
   return 0;
 }
@@ -185,11 +235,15 @@ Defer API
  *
  * Code blocks that where scheduled to run before Iodine enters cluster mode
  * will run on all child processes.
+ *
+ * These tasks are performed with a lower priority than network events, so a
+ * long queue of background tasks doesn't delay new requests or responses.
  */
 static VALUE iodine_defer_run(VALUE self) {
   rb_need_block();
   VALUE block = IodineStore.add(rb_block_proc());
-  defer(iodine_defer_performe_once, (void *)block, NULL);
+  defer_priority(DEFER_PRIORITY_BACKGROUND, iodine_defer_performe_once,
+                 (void *)block, NULL);
   return block;
   (void)self;
 }
@@ -342,6 +396,31 @@ static void iodine_perform_fork_callbacks(uint8_t before) {
   spn_unlock(lock);
 }
 
+/*
+ * Runs once, in the root process, before the first worker is forked: freezes
+ * iodine's global tables and compacts the heap (`Process.warmup` or
+ * `GC.compact`), so the workers share the root's memory pages for longer.
+ */
+static void iodine_prefork_warmup(void) {
+  static uint8_t performed = 0;
+  if (performed || facil_parent_pid() != getpid())
+    return;
+  performed = 1;
+  if (rb_ivar_get(IodineModule, rb_intern2("@warmup", 7)) == Qfalse)
+    return;
+  iodine_http_before_fork();
+  VALUE process = rb_const_get(rb_cObject, rb_intern2("Process", 7));
+  if (rb_respond_to(process, rb_intern2("warmup", 6))) {
+    /* Ruby 3.3: GC, compaction, promoting objects to the old generation... */
+    IodineCaller.call(process, rb_intern2("warmup", 6));
+    return;
+  }
+  VALUE gc = rb_const_get(rb_cObject, rb_intern2("GC", 2));
+  IodineCaller.call(gc, rb_intern2("start", 5));
+  if (rb_respond_to(gc, rb_intern2("compact", 7)))
+    IodineCaller.call(gc, rb_intern2("compact", 7));
+}
+
 /* Performs any cleanup before worker dies */
 void iodine_defer_on_finish(void) {
   iodine_join_io_thread();
@@ -387,5 +466,11 @@ void iodine_defer_initialize(void) {
                             0);
   rb_define_module_function(IodineModule, "on_shutdown", iodine_on_shutdown_add,
                             0);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  /* the Ractor worker's entry point is the only Ractor safe method here */
+  rb_ext_ractor_safe(true);
+  rb_define_module_function(IodineBaseModule, "ractor", defer_ractor_inGVL, 1);
+  rb_ext_ractor_safe(false);
+#endif
   defer(iodine_start_io_thread, NULL, NULL);
 }
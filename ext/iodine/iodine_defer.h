@@ -3,5 +3,10 @@
 
 void iodine_defer_initialize(void);
 void iodine_defer_on_finish(void);
+/**
+ * Worker threads will be started within their own Ractor, so Ruby code runs
+ * concurrently. Returns -1 if Ractors aren't supported.
+ */
+int iodine_defer_use_ractors(void);
 
 #endif
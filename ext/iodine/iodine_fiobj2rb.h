@@ -38,6 +38,7 @@ static inline VALUE fiobj2rb(FIOBJ o, uint8_t str2sym) {
     rb = rb_float_new(fiobj_obj2float(o));
     break;
   case FIOBJ_T_DATA:    /* fallthrough */
+  case FIOBJ_T_JSON:    /* fallthrough */
   case FIOBJ_T_UNKNOWN: /* fallthrough */
   case FIOBJ_T_STRING: {
     fio_cstr_s tmp = fiobj_obj2cstr(o);
@@ -7,14 +7,19 @@ Feel free to copy, use and enjoy according to the license provided.
 #include "iodine.h"
 
 #include "evio.h"
+#include "fio_hashmap.h"
+#include "fio_llist.h"
 #include "fio_mem.h"
 #include "http.h"
+#include "iodine_fiobj2rb.h"
+#include "spnlock.inc"
 #include <ruby/encoding.h>
 #include <ruby/io.h>
 // #include "iodine_websockets.h"
 
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -23,9 +28,22 @@ Feel free to copy, use and enjoy according to the license provided.
 Available Globals
 ***************************************************************************** */
 
+/* native routes, matched before the `app` is called (see `routes`) */
+typedef struct iodine_http_routes_s iodine_http_routes_s;
+
+/* the `udata` of HTTP services (and requests) */
 typedef struct {
   VALUE app;
-  VALUE env;
+  /* the response cache is enabled for the service */
+  uint8_t cache;
+  /* request headers that are part of the cache key (an Array or invalid) */
+  FIOBJ vary;
+  /* requests are handled by non-blocking Fibers (see `fiber`) */
+  uint8_t fiber;
+  /* a frozen Hash of WebSocket paths and their handlers (see `upgrade`) */
+  VALUE upgrade;
+  /* native routes (or NULL) */
+  iodine_http_routes_s *routes;
 } iodine_http_settings_s;
 
 /* these three are used also by iodin_rack_io.c */
@@ -49,11 +67,15 @@ static ID iodine_call_proc_id;
 static VALUE env_template_no_upgrade;
 static VALUE env_template_websockets;
 static VALUE env_template_sse;
+static void env_template_thaw(void);
 
 static rb_encoding *IodineUTF8Encoding;
 static rb_encoding *IodineBinaryEncoding;
 
 static uint8_t support_xsendfile = 0;
+static uint8_t support_lazy_env = 0;
+/* the number of ready tasks performed while the GVL is held (0 == off) */
+static size_t iodine_gvl_batch = 0;
 
 /** Used by {listen2http} to set missing arguments. */
 static VALUE iodine_default_args;
@@ -93,6 +115,24 @@ rack_declare(XSENDFILE_TYPE);        // for X-Sendfile support
 rack_declare(XSENDFILE_TYPE_HEADER); // for X-Sendfile support
 rack_declare(CONTENT_LENGTH_HEADER); // for X-Sendfile support
 
+/* a request handled by a Fiber that parked (see the `fiber` option) */
+typedef struct {
+  VALUE app;
+  VALUE env;
+  VALUE rack_io;
+  VALUE rbresponse;
+  /* keeps `rack.input` valid, even if the connection closes */
+  FIOBJ body;
+  iodine_http_settings_s *settings;
+  /* the paused request (see `http_pause`) */
+  void *http;
+  spn_lock_i lock;
+  /* the Fiber completed */
+  uint8_t done;
+  /* the Fiber hijacked the connection, there's no response to send */
+  uint8_t hijacked;
+} iodine_http_fiber_s;
+
 /* used internally to handle requests */
 typedef struct {
   http_s *h;
@@ -103,12 +143,20 @@ typedef struct {
     IODINE_HTTP_XSENDFILE,
     IODINE_HTTP_EMPTY,
     IODINE_HTTP_ERROR,
+    IODINE_HTTP_STREAM,
+    IODINE_HTTP_PAUSED,
   } type;
   enum iodine_upgrade_type_enum {
     IODINE_UPGRADE_NONE = 0,
     IODINE_UPGRADE_WEBSOCKET,
     IODINE_UPGRADE_SSE,
   } upgrade;
+  /* the response cache key, while the response should be stored */
+  FIOBJ cache_key;
+  /* the request's Fiber parked (`IODINE_HTTP_PAUSED`) */
+  iodine_http_fiber_s *fiber;
+  /* a Rack application selected by the service's `routes` (or 0) */
+  VALUE app;
 } iodine_http_request_handle_s;
 
 /* *****************************************************************************
@@ -119,18 +167,58 @@ typedef struct {
   char *data;
   size_t size;
   uint8_t is_text;
+  uint8_t first;
+  uint8_t last;
   VALUE io;
 } iodine_msg2ruby_s;
 
+/* the messages read together, collected for `on_messages` (see `on_batch`) */
+typedef struct {
+  VALUE io;
+  VALUE messages;
+  void (*task)(void *);
+  void *arg;
+} iodine_ws_batch_s;
+
+static __thread iodine_ws_batch_s *iodine_ws_batch;
+
 static void *iodine_ws_fire_message(void *msg_) {
   iodine_msg2ruby_s *msg = msg_;
   VALUE data = rb_enc_str_new(
       msg->data, msg->size,
       (msg->is_text ? rb_utf8_encoding() : rb_ascii8bit_encoding()));
+  if (iodine_ws_batch && iodine_ws_batch->io == msg->io &&
+      iodine_ws_batch->messages) {
+    rb_ary_push(iodine_ws_batch->messages, data);
+    return NULL;
+  }
   iodine_connection_fire_event(msg->io, IODINE_CONNECTION_ON_MESSAGE, data);
   return NULL;
 }
 
+static void *iodine_ws_batch_in_GVL(void *batch_) {
+  iodine_ws_batch_s *batch = batch_;
+  if (iodine_connection_batches(batch->io))
+    batch->messages = rb_ary_new();
+  iodine_ws_batch_s *prev = iodine_ws_batch;
+  iodine_ws_batch = batch;
+  batch->task(batch->arg);
+  iodine_ws_batch = prev;
+  if (batch->messages && RARRAY_LEN(batch->messages))
+    iodine_connection_fire_event(batch->io, IODINE_CONNECTION_ON_MESSAGES,
+                                 batch->messages);
+  RB_GC_GUARD(batch->messages);
+  return NULL;
+}
+
+/* messages read together are handled within a single GVL section. */
+static void iodine_ws_on_batch(ws_s *ws, void (*task)(void *), void *arg) {
+  iodine_ws_batch_s batch = {
+      .io = (VALUE)websocket_udata(ws), .task = task, .arg = arg,
+  };
+  IodineCaller.enterGVL(iodine_ws_batch_in_GVL, &batch);
+}
+
 static void iodine_ws_on_message(ws_s *ws, char *data, size_t size,
                                  uint8_t is_text) {
   iodine_msg2ruby_s msg = {
@@ -141,6 +229,28 @@ static void iodine_ws_on_message(ws_s *ws, char *data, size_t size,
   };
   IodineCaller.enterGVL(iodine_ws_fire_message, &msg);
 }
+static void *iodine_ws_fire_fragment(void *msg_) {
+  iodine_msg2ruby_s *msg = msg_;
+  VALUE data = rb_enc_str_new(
+      msg->data, msg->size,
+      (msg->is_text ? rb_utf8_encoding() : rb_ascii8bit_encoding()));
+  iodine_connection_fire_fragment(msg->io, data, msg->first, msg->last);
+  return NULL;
+}
+
+static void iodine_ws_on_message_fragment(ws_s *ws, char *data, size_t size,
+                                          uint8_t is_text, uint8_t first,
+                                          uint8_t last) {
+  iodine_msg2ruby_s msg = {
+      .data = data,
+      .size = size,
+      .is_text = is_text,
+      .first = first,
+      .last = last,
+      .io = (VALUE)websocket_udata(ws),
+  };
+  IodineCaller.enterGVL(iodine_ws_fire_fragment, &msg);
+}
 /**
  * The (optional) on_open callback will be called once the websocket
  * connection is established and before is is registered with `facil`, so no
@@ -196,6 +306,10 @@ static void iodine_ws_attach(http_s *h, VALUE handler, VALUE env) {
     return;
 
   http_upgrade2ws(.http = h, .on_message = iodine_ws_on_message,
+                  .on_message_fragment = (iodine_connection_streams(io)
+                                              ? iodine_ws_on_message_fragment
+                                              : NULL),
+                  .on_batch = iodine_ws_on_batch,
                   .on_open = iodine_ws_on_open, .on_ready = iodine_ws_on_ready,
                   .on_shutdown = iodine_ws_on_shutdown,
                   .on_close = iodine_ws_on_close, .udata = (void *)io);
@@ -247,11 +361,56 @@ Copying data from the C request to the Rack's ENV
 
 #define to_upper(c) (((c) >= 'a' && (c) <= 'z') ? ((c) & ~32) : (c))
 
-int iodine_copy2env_task(FIOBJ o, void *env_) {
-  VALUE env = (VALUE)env_;
-  FIOBJ name = fiobj_hash_key_in_loop();
+/* converts a header value (a String or an Array of Strings) to Ruby */
+static VALUE iodine_header2rb(FIOBJ o) {
+  fio_cstr_s tmp;
+  if (FIOBJ_TYPE_IS(o, FIOBJ_T_STRING)) {
+    tmp = fiobj_obj2cstr(o);
+    return rb_enc_str_new(tmp.data, tmp.len, IodineBinaryEncoding);
+  }
+  /* it's an array */
+  VALUE ary = rb_ary_new();
+  size_t count = fiobj_ary_count(o);
+  for (size_t i = 0; i < count; ++i) {
+    tmp = fiobj_obj2cstr(fiobj_ary_index(o, i));
+    rb_ary_push(ary, rb_enc_str_new(tmp.data, tmp.len, IodineBinaryEncoding));
+  }
+  return ary;
+}
+
+/* *****************************************************************************
+Shared (frozen) `HTTP_*` names for the Rack `env`
+***************************************************************************** */
+
+#ifndef IODINE_ENV_NAME_LIMIT
+/**
+ * The maximum number of header names kept by the `env` name table (limits the
+ * memory used when clients send random header names).
+ */
+#define IODINE_ENV_NAME_LIMIT 512
+#endif
+
+/* header name hash => frozen `HTTP_*` Ruby String (shared by all Ractors) */
+static fio_hash_s iodine_env_names = FIO_HASH_INIT;
+static spn_lock_i iodine_env_names_lock = SPN_LOCK_INIT;
+
+/* returns a frozen `HTTP_*` String for the header name, shared when possible */
+static VALUE iodine_env_name(FIOBJ name) {
   fio_cstr_s tmp = fiobj_obj2cstr(name);
-  VALUE hname = (VALUE)0;
+  const uint64_t hash = fiobj_obj2hash(name);
+  spn_lock(&iodine_env_names_lock);
+  VALUE hname = (VALUE)fio_hash_find(&iodine_env_names, hash);
+  spn_unlock(&iodine_env_names_lock);
+  if (hname && (size_t)RSTRING_LEN(hname) == tmp.len + 5) {
+    /* test for hash collisions */
+    const char *pos = RSTRING_PTR(hname) + 5;
+    size_t i = 0;
+    while (i < tmp.len &&
+           pos[i] == ((tmp.data[i] == '-') ? '_' : to_upper(tmp.data[i])))
+      ++i;
+    if (i == tmp.len)
+      return hname;
+  }
   if (tmp.len > 59) {
     char *buf = fio_malloc(tmp.len + 5);
     memcpy(buf, "HTTP_", 5);
@@ -268,23 +427,100 @@ int iodine_copy2env_task(FIOBJ o, void *env_) {
     }
     hname = rb_enc_str_new(buf, tmp.len + 5, IodineBinaryEncoding);
   }
+  /* frozen String keys aren't copied by `rb_hash_aset` */
+  rb_obj_freeze(hname);
+  /* no Ruby allocations while locked (a GC could wait for a spinning thread) */
+  spn_lock(&iodine_env_names_lock);
+  if (fio_hash_count(&iodine_env_names) < IODINE_ENV_NAME_LIMIT &&
+      !fio_hash_find(&iodine_env_names, hash)) {
+    IodineStore.add(hname);
+    fio_hash_insert(&iodine_env_names, hash, (void *)hname);
+  }
+  spn_unlock(&iodine_env_names_lock);
+  return hname;
+}
 
-  if (FIOBJ_TYPE_IS(o, FIOBJ_T_STRING)) {
-    tmp = fiobj_obj2cstr(o);
-    rb_hash_aset(env, hname,
-                 rb_enc_str_new(tmp.data, tmp.len, IodineBinaryEncoding));
+int iodine_copy2env_task(FIOBJ o, void *env_) {
+  VALUE env = (VALUE)env_;
+  VALUE hname = iodine_env_name(fiobj_hash_key_in_loop());
+  rb_hash_aset(env, hname, iodine_header2rb(o));
+  return 0;
+}
 
-  } else {
-    /* it's an array */
-    VALUE ary = rb_ary_new();
-    rb_hash_aset(env, hname, ary);
-    size_t count = fiobj_ary_count(o);
-    for (size_t i = 0; i < count; ++i) {
-      tmp = fiobj_obj2cstr(fiobj_ary_index(o, i));
-      rb_ary_push(ary, rb_enc_str_new(tmp.data, tmp.len, IodineBinaryEncoding));
-    }
+/* *****************************************************************************
+Lazy ENV headers - the request headers are copied to the `env` when accessed
+***************************************************************************** */
+
+static ID iodine_lazy_headers_id;
+
+static void iodine_lazy_headers_free(void *headers) {
+  fiobj_free((FIOBJ)headers);
+}
+
+static size_t iodine_lazy_headers_size(const void *headers) {
+  return sizeof(FIOBJ);
+  (void)headers;
+}
+
+static const rb_data_type_t iodine_lazy_headers_type = {
+    .wrap_struct_name = "IodineLazyHeaders",
+    .function =
+        {
+            .dfree = iodine_lazy_headers_free,
+            .dsize = iodine_lazy_headers_size,
+        },
+    .data = NULL,
+};
+
+/*
+ * keeps the request's headers with the `env`, copying the header values out of
+ * the request's arena first (since the `env` might outlive the request).
+ */
+static void iodine_lazy_headers_set(VALUE env, http_s *h) {
+  http_arena_detach(h->headers);
+  fiobj_share(h->headers); /* released by the GC, maybe by another thread */
+  rb_ivar_set(env, iodine_lazy_headers_id,
+              TypedData_Wrap_Struct(0, &iodine_lazy_headers_type,
+                                    (void *)fiobj_dup(h->headers)));
+}
+
+/**
+ * The `env` Hash's `default_proc` (when `lazy_env` is set): converts the Rack
+ * `HTTP_*` name to a header name, copies the header to the `env` and returns
+ * it.
+ *
+ * Note: the headers are kept alive with the `env`, so access is valid even
+ * after the response was sent.
+ */
+static VALUE iodine_lazy_env_fault(RB_BLOCK_CALL_FUNC_ARGLIST(yielded, udata)) {
+  if (argc < 2 || !RB_TYPE_P(argv[1], T_STRING))
+    return Qnil;
+  VALUE env = argv[0];
+  VALUE key = argv[1];
+  const char *name = RSTRING_PTR(key);
+  size_t len = RSTRING_LEN(key);
+  if (len <= 5 || len > 133 || memcmp(name, "HTTP_", 5))
+    return Qnil;
+  VALUE wrapper = rb_attr_get(env, iodine_lazy_headers_id);
+  if (!RB_TYPE_P(wrapper, T_DATA))
+    return Qnil;
+  FIOBJ headers = (FIOBJ)RTYPEDDATA_DATA(wrapper);
+  /* HTTP_USER_AGENT => user-agent */
+  char buf[128];
+  name += 5;
+  len -= 5;
+  for (size_t i = 0; i < len; ++i) {
+    buf[i] = (name[i] == '_') ? '-' : (name[i] | 32);
   }
-  return 0;
+  FIOBJ o = fiobj_hash_get2(headers, fio_siphash(buf, len));
+  if (!o)
+    return Qnil;
+  VALUE value = iodine_header2rb(o);
+  rb_hash_aset(env, key, value);
+  return value;
+  (void)yielded;
+  (void)udata;
+  (void)blockarg;
 }
 static inline VALUE copy2env(iodine_http_request_handle_s *handle) {
   VALUE env;
@@ -440,10 +676,16 @@ static inline VALUE copy2env(iodine_http_request_handle_s *handle) {
           }
         }
       }
-    } else {
+    } else if (fio_tls_is_tls(http2uuid(h))) {
+      rb_hash_aset(env, R_URL_SCHEME, HTTPS_SCHEME);
     }
   }
 
+  if (support_lazy_env) {
+    /* remaining headers are copied when accessed (iodine_lazy_env_fault) */
+    iodine_lazy_headers_set(env, h);
+    return env;
+  }
   /* add all remianing headers */
   fiobj_each1(h->headers, 0, iodine_copy2env_task, (void *)env);
   return env;
@@ -499,8 +741,44 @@ static int for_each_header_data(VALUE key, VALUE val, VALUE h_) {
   return ST_CONTINUE;
 }
 
-// writes the body to the response object
-static VALUE for_each_body_string(VALUE str, VALUE body_) {
+#ifndef IODINE_STREAM_BUFFER
+/**
+ * Bodies (enumerated using `each`) are buffered up to this length. Longer
+ * bodies are streamed (using chunked encoding unless a length was provided).
+ */
+#define IODINE_STREAM_BUFFER 65536
+#endif
+
+#ifndef IODINE_STREAM_PENDING
+/**
+ * A streaming response waits (without the GVL) for the client once this number
+ * of writes is pending, performing other tasks meanwhile.
+ */
+#define IODINE_STREAM_PENDING 16
+#endif
+
+/* waits for a streamed response to drain - performed without the GVL */
+static void *iodine_stream_drain(void *uuid_) {
+  intptr_t uuid = (intptr_t)uuid_;
+  while (sock_pending(uuid) > (IODINE_STREAM_PENDING >> 1)) {
+    sock_flush(uuid);
+    if (!sock_isvalid(uuid))
+      break;
+    /* nested calls (another response draining) perform nothing */
+    if (!defer_perform_batch(IODINE_STREAM_PENDING)) {
+      struct pollfd pfd = {.fd = sock_uuid2fd(uuid), .events = POLLOUT};
+      poll(&pfd, 1, 10);
+    }
+  }
+  return NULL;
+}
+
+/* thrown to stop the body's enumeration once the client is gone */
+static VALUE iodine_stream_tag;
+
+// writes the body to the response object (or streams it)
+static VALUE for_each_body_string(RB_BLOCK_CALL_FUNC_ARGLIST(str, handle_)) {
+  iodine_http_request_handle_s *handle = (void *)NUM2SIZET(handle_);
   // fprintf(stderr, "For_each - body\n");
   // write body
   if (TYPE(str) != T_STRING) {
@@ -508,12 +786,37 @@ static VALUE for_each_body_string(VALUE str, VALUE body_) {
                     "response body was not a String\n");
     return Qfalse;
   }
-  if (RSTRING_LEN(str) && RSTRING_PTR(str)) {
-    fiobj_str_write((FIOBJ)body_, RSTRING_PTR(str), RSTRING_LEN(str));
+  if (!RSTRING_LEN(str) || !RSTRING_PTR(str))
+    return Qtrue;
+  if (handle->type != IODINE_HTTP_STREAM) {
+    fiobj_str_write(handle->body, RSTRING_PTR(str), RSTRING_LEN(str));
+    fio_cstr_s buffered = fiobj_obj2cstr(handle->body);
+    if (buffered.len < IODINE_STREAM_BUFFER)
+      return Qtrue;
+    /* too long to buffer, start streaming */
+    handle->type = IODINE_HTTP_STREAM;
+    int failed = http_stream(handle->h, buffered.data, buffered.len);
+    fiobj_free(handle->body);
+    handle->body = FIOBJ_INVALID;
+    if (failed)
+      rb_throw_obj(iodine_stream_tag, Qnil);
+  } else if (http_stream(handle->h, RSTRING_PTR(str), RSTRING_LEN(str))) {
+    rb_throw_obj(iodine_stream_tag, Qnil); /* the client is gone */
   }
+  intptr_t uuid = http2uuid(handle->h);
+  if (sock_pending(uuid) >= IODINE_STREAM_PENDING)
+    IodineCaller.leaveGVL(iodine_stream_drain, (void *)uuid);
   return Qtrue;
 }
 
+/* enumerates the body within `catch` (see `iodine_stream_tag`) */
+static VALUE iodine_body_each(RB_BLOCK_CALL_FUNC_ARGLIST(tag, block)) {
+  VALUE body = rb_ary_entry(block, 0);
+  return rb_funcall_with_block(body, each_method_id, 0, NULL,
+                               rb_ary_entry(block, 1));
+  (void)tag;
+}
+
 static inline int ruby2c_response_send(iodine_http_request_handle_s *handle,
                                        VALUE rbresponse, VALUE env) {
   (void)(env);
@@ -545,8 +848,15 @@ static inline int ruby2c_response_send(iodine_http_request_handle_s *handle,
     // fprintf(stderr, "Review body as for-each ...\n");
     handle->body = fiobj_str_buf(1);
     handle->type = IODINE_HTTP_SENDBODY;
-    rb_block_call(body, each_method_id, 0, NULL, for_each_body_string,
-                  (VALUE)handle->body);
+    /*
+     * A Proc (rather than `rb_block_call`) keeps the block's function alive
+     * while the GC runs within the enumeration (Ruby 3.3 could collect it).
+     */
+    VALUE block = rb_ary_new_from_args(
+        2, body, rb_proc_new(for_each_body_string, SIZET2NUM((size_t)handle)));
+    IodineStore.add(block);
+    rb_catch_obj(iodine_stream_tag, iodine_body_each, block);
+    IodineStore.remove(block);
     // we need to call `close` in case the object is an IO / BodyProxy
     if (rb_respond_to(body, close_method_id))
       IodineCaller.call(body, close_method_id);
@@ -622,23 +932,19 @@ upgraded:
 Handling HTTP requests
 ***************************************************************************** */
 
-static inline void *iodine_handle_request_in_GVL(void *handle_) {
-  iodine_http_request_handle_s *handle = handle_;
-  VALUE rbresponse = 0;
-  VALUE env = 0;
-  http_s *h = handle->h;
-  if (!h->udata)
-    goto err_not_found;
+/* calls the application within the request's Fiber. */
+static VALUE iodine_http_fiber_call(VALUE f_) {
+  iodine_http_fiber_s *f = (iodine_http_fiber_s *)f_;
+  return IodineCaller.call2(f->app, iodine_call_proc_id, 1, &f->env);
+}
 
-  // create / register env variable
-  env = copy2env(handle);
-  // create rack.io
-  VALUE tmp = IodineRackIO.create(h, env);
-  // pass env variable to handler
-  rbresponse =
-      IodineCaller.call2((VALUE)h->udata, iodine_call_proc_id, 1, &env);
-  // close rack.io
-  IodineRackIO.close(tmp);
+static void iodine_http_fiber_on_done(VALUE rbresponse, void *f_);
+
+/* reviews the application's response, preparing the `handle` action. */
+static void *iodine_handle_response_in_GVL(iodine_http_request_handle_s *handle,
+                                           VALUE env, VALUE rbresponse) {
+  http_s *h = handle->h;
+  VALUE tmp;
   // test handler's return value
   if (rbresponse == 0 || rbresponse == Qnil)
     goto internal_error;
@@ -700,27 +1006,73 @@ external_done:
   handle->type = IODINE_HTTP_NONE;
   return NULL;
 
-err_not_found:
+internal_error:
   IodineStore.remove(rbresponse);
   IodineStore.remove(env);
-  h->status = 404;
+  h->status = 500;
   handle->type = IODINE_HTTP_ERROR;
   return NULL;
+}
 
-internal_error:
-  IodineStore.remove(rbresponse);
+static inline void *iodine_handle_request_in_GVL(void *handle_) {
+  iodine_http_request_handle_s *handle = handle_;
+  VALUE rbresponse = 0;
+  VALUE env = 0;
+  http_s *h = handle->h;
+  iodine_http_settings_s *settings = h->udata;
+  VALUE app = handle->app ? handle->app : (settings ? settings->app : 0);
+  if (!app)
+    goto err_not_found;
+
+  // create / register env variable
+  env = copy2env(handle);
+  // create rack.io
+  VALUE tmp = IodineRackIO.create(h, env);
+  // pass env variable to handler
+  http_stats_handler_start();
+  if (settings->fiber && handle->upgrade == IODINE_UPGRADE_NONE) {
+    iodine_http_fiber_s *f = fio_malloc(sizeof(*f));
+    *f = (iodine_http_fiber_s){
+        .app = app, .env = env, .rack_io = tmp, .settings = settings,
+    };
+    rbresponse = IodineScheduler.run(iodine_http_fiber_call, (VALUE)f,
+                                     iodine_http_fiber_on_done, f);
+    if (rbresponse == Qundef) {
+      /* the Fiber parked, the response is sent once it completes */
+      http_stats_handler_end();
+      f->body = fiobj_dup(h->body);
+      if (IodineRackIO.detach(tmp)) {
+        f->hijacked = 1;
+        handle->type = IODINE_HTTP_NONE;
+        return NULL;
+      }
+      handle->fiber = f;
+      handle->type = IODINE_HTTP_PAUSED;
+      return NULL;
+    }
+    fio_free(f);
+  } else {
+    rbresponse = IodineCaller.call2(app, iodine_call_proc_id, 1, &env);
+  }
+  http_stats_handler_end();
+  // close rack.io
+  IodineRackIO.close(tmp);
+  return iodine_handle_response_in_GVL(handle, env, rbresponse);
+
+err_not_found:
   IodineStore.remove(env);
-  h->status = 500;
+  h->status = 404;
   handle->type = IODINE_HTTP_ERROR;
   return NULL;
 }
 
+static void iodine_http_fiber_on_pause(void *http);
+
 static inline void
 iodine_perform_handle_action(iodine_http_request_handle_s handle) {
   switch (handle.type) {
   case IODINE_HTTP_SENDBODY: {
-    fio_cstr_s data = fiobj_obj2cstr(handle.body);
-    http_send_body(handle.h, data.data, data.len);
+    http_send_body_fiobj(handle.h, handle.body);
     fiobj_free(handle.body);
     break;
   }
@@ -743,6 +1095,10 @@ iodine_perform_handle_action(iodine_http_request_handle_s handle) {
     http_finish(handle.h);
     fiobj_free(handle.body);
     break;
+  case IODINE_HTTP_STREAM:
+    /* the body was streamed, complete the response */
+    http_finish(handle.h);
+    break;
   case IODINE_HTTP_NONE:
     /* nothing to do - this had to be performed within the Ruby GIL :-( */
     break;
@@ -750,17 +1106,960 @@ iodine_perform_handle_action(iodine_http_request_handle_s handle) {
     http_send_error(handle.h, handle.h->status);
     fiobj_free(handle.body);
     break;
+  case IODINE_HTTP_PAUSED:
+    /* the request's Fiber parked, the paused request's `udata` is the Fiber */
+    handle.h->udata = handle.fiber;
+    http_pause(handle.h, iodine_http_fiber_on_pause);
+    break;
+  }
+}
+
+/* *****************************************************************************
+Requests handled by Fibers that parked (see the `fiber` option)
+***************************************************************************** */
+
+/* sends the response once the Fiber completed (connection is locked). */
+static void *iodine_http_fiber_respond_in_GVL(void *handle_) {
+  iodine_http_request_handle_s *handle = handle_;
+  iodine_http_fiber_s *f = handle->fiber;
+  IodineRackIO.close(f->rack_io);
+  iodine_handle_response_in_GVL(handle, f->env, f->rbresponse);
+  IodineStore.remove(f->rbresponse);
+  return NULL;
+}
+
+static void iodine_http_fiber_respond(http_s *h) {
+  iodine_http_fiber_s *f = h->udata;
+  iodine_http_request_handle_s handle = (iodine_http_request_handle_s){
+      .h = h, .upgrade = IODINE_UPGRADE_NONE, .fiber = f,
+  };
+  h->udata = f->settings;
+  IodineCaller.enterGVL(iodine_http_fiber_respond_in_GVL, &handle);
+  iodine_perform_handle_action(handle);
+  fiobj_free(f->body);
+  fio_free(f);
+}
+
+/* discards the response (the connection was lost or hijacked). */
+static void *iodine_http_fiber_discard_in_GVL(void *f_) {
+  iodine_http_fiber_s *f = f_;
+  VALUE body;
+  // we need to call `close` in case the object is an IO / BodyProxy
+  if (TYPE(f->rbresponse) == T_ARRAY &&
+      (body = rb_ary_entry(f->rbresponse, 2)) != Qnil &&
+      rb_respond_to(body, close_method_id))
+    IodineCaller.call(body, close_method_id);
+  IodineStore.remove(f->rbresponse);
+  IodineStore.remove(f->env);
+  return NULL;
+}
+
+static void iodine_http_fiber_discard(void *f_) {
+  iodine_http_fiber_s *f = f_;
+  IodineCaller.enterGVL(iodine_http_fiber_discard_in_GVL, f);
+  fiobj_free(f->body);
+  fio_free(f);
+}
+
+/* resumes the paused request if the Fiber completed. */
+static void iodine_http_fiber_on_pause(void *http) {
+  iodine_http_fiber_s *f = http_paused_udata_get(http);
+  spn_lock(&f->lock);
+  f->http = http;
+  uint8_t done = f->done;
+  spn_unlock(&f->lock);
+  if (done)
+    http_resume(http, iodine_http_fiber_respond, iodine_http_fiber_discard);
+}
+
+/* called (within the GVL) once the parked Fiber completed. */
+static void iodine_http_fiber_on_done(VALUE rbresponse, void *f_) {
+  iodine_http_fiber_s *f = f_;
+  f->rbresponse = rbresponse;
+  IodineStore.add(rbresponse);
+  if (f->hijacked) {
+    iodine_http_fiber_discard(f);
+    return;
+  }
+  spn_lock(&f->lock);
+  f->done = 1;
+  void *http = f->http;
+  spn_unlock(&f->lock);
+  if (http)
+    http_resume(http, iodine_http_fiber_respond, iodine_http_fiber_discard);
+}
+/* *****************************************************************************
+Response cache
+***************************************************************************** */
+
+#ifndef IODINE_HTTP_CACHE_LIMIT
+/** The largest response body stored by the response cache (see `cache`). */
+#define IODINE_HTTP_CACHE_LIMIT (1024 * 256)
+#endif
+
+#ifndef IODINE_HTTP_CACHE_COUNT
+/** The maximum number of responses stored by the response cache (per worker). */
+#define IODINE_HTTP_CACHE_COUNT 1024
+#endif
+
+/* a cached response (or a pending one, while the first request is handled) */
+typedef struct {
+  FIOBJ key;
+  FIOBJ headers;
+  FIOBJ body;
+  uintptr_t status;
+  time_t stored;
+  time_t expires;
+  /* paused requests (opaque `http_pause` handles) waiting for the response */
+  fio_ls_s waiting;
+  uint8_t pending;
+} iodine_cache_s;
+
+/* the `udata` of a request waiting for a pending response */
+typedef struct {
+  iodine_http_settings_s *settings;
+  FIOBJ key;
+  uint64_t hash;
+} iodine_cache_waiter_s;
+
+static fio_hash_s iodine_cache = FIO_HASH_INIT;
+static spn_lock_i iodine_cache_lock = SPN_LOCK_INIT;
+
+static FIOBJ IODINE_CACHE_AGE;
+static FIOBJ IODINE_CACHE_AUTHORIZATION;
+
+static void iodine_cache_free(iodine_cache_s *c) {
+  fiobj_free(c->key);
+  fiobj_free(c->headers);
+  fiobj_free(c->body);
+  fio_free(c);
+}
+
+/* returns the request's cache key (a String) or FIOBJ_INVALID. */
+static FIOBJ iodine_cache_key(http_s *h, iodine_http_settings_s *s) {
+  fio_cstr_s method = fiobj_obj2cstr(h->method);
+  if (method.len != 3 || memcmp(method.data, "GET", 3) ||
+      fiobj_hash_get2(h->headers, fiobj_obj2hash(IODINE_CACHE_AUTHORIZATION)))
+    return FIOBJ_INVALID;
+  FIOBJ key = fiobj_str_buf(128);
+  fiobj_str_join(key, h->path);
+  if (h->query) {
+    fiobj_str_write(key, "?", 1);
+    fiobj_str_join(key, h->query);
+  }
+  fiobj_str_write(key, "\n", 1);
+  fiobj_str_join(key, fiobj_hash_get2(h->headers,
+                                      fiobj_obj2hash(HTTP_HEADER_HOST)));
+  size_t count = (s->vary ? fiobj_ary_count(s->vary) : 0);
+  for (size_t i = 0; i < count; ++i) {
+    FIOBJ name = fiobj_ary_index(s->vary, i);
+    FIOBJ value = fiobj_hash_get2(h->headers, fiobj_obj2hash(name));
+    fiobj_str_write(key, "\n", 1);
+    if (FIOBJ_TYPE_IS(value, FIOBJ_T_ARRAY)) {
+      for (size_t j = 0; j < fiobj_ary_count(value); ++j) {
+        fiobj_str_join(key, fiobj_ary_index(value, j));
+        fiobj_str_write(key, ",", 1);
+      }
+    } else if (value) {
+      fiobj_str_join(key, value);
+    }
+  }
+  return key;
+}
+
+/* finds the key's entry (the lock must be held), ignoring hash collisions. */
+static iodine_cache_s *iodine_cache_find(FIOBJ key, uint64_t hash) {
+  iodine_cache_s *c =
+      (iodine_cache.map ? fio_hash_find(&iodine_cache, hash) : NULL);
+  if (c && !fiobj_iseq(c->key, key))
+    return NULL;
+  return c;
+}
+
+/* removes expired entries, making room for new ones (the lock must be held). */
+static void iodine_cache_evict(time_t now) {
+  FIO_HASH_FOR_LOOP(&iodine_cache, pos) {
+    iodine_cache_s *c = pos->obj;
+    if (!c || c->pending || c->expires > now)
+      continue;
+    fio_hash_insert(&iodine_cache, pos->key, NULL);
+    iodine_cache_free(c);
+  }
+  fio_hash_compact(&iodine_cache);
+}
+
+/* copies a header to the response (header Arrays are copied item by item). */
+static int iodine_cache_copy_header(FIOBJ value, void *h_) {
+  http_s *h = h_;
+  FIOBJ name = fiobj_hash_key_in_loop();
+  if (FIOBJ_TYPE_IS(value, FIOBJ_T_ARRAY)) {
+    for (size_t i = 0; i < fiobj_ary_count(value); ++i)
+      http_set_header(h, name, fiobj_dup(fiobj_ary_index(value, i)));
+  } else {
+    http_set_header(h, name, fiobj_dup(value));
+  }
+  return 0;
+}
+
+/* copies a response header to the cached response's headers */
+static int iodine_cache_store_header(FIOBJ value, void *headers_) {
+  FIOBJ headers = (FIOBJ)headers_;
+  FIOBJ name = fiobj_hash_key_in_loop();
+  if (FIOBJ_TYPE_IS(value, FIOBJ_T_ARRAY)) {
+    FIOBJ copy = fiobj_ary_new2(fiobj_ary_count(value));
+    for (size_t i = 0; i < fiobj_ary_count(value); ++i)
+      fiobj_ary_push(copy, fiobj_dup(fiobj_ary_index(value, i)));
+    fiobj_hash_set(headers, name, copy);
+  } else {
+    fiobj_hash_set(headers, name, fiobj_dup(value));
+  }
+  return 0;
+}
+
+/* sends a cached response (the lock must be held). */
+static void iodine_cache_send(http_s *h, iodine_cache_s *c, time_t now) {
+  h->status = c->status;
+  fiobj_each1(c->headers, 0, iodine_cache_copy_header, h);
+  http_set_header(h, IODINE_CACHE_AGE, fiobj_num_new(now - c->stored));
+  FIOBJ body = fiobj_dup(c->body);
+  spn_unlock(&iodine_cache_lock);
+  if (body) {
+    http_send_body_fiobj(h, body);
+    fiobj_free(body);
+  } else {
+    http_finish(h);
+  }
+}
+
+static void on_rack_request_uncached(http_s *h);
+
+/* a paused request is resumed, once a pending response was stored */
+static void iodine_cache_on_resume(http_s *h) { on_rack_request_uncached(h); }
+
+/* resumes a paused request (or calls its `fallback` if the client is gone). */
+static void iodine_cache_resume(void *http) {
+  iodine_cache_waiter_s *w = http_paused_udata_get(http);
+  http_paused_udata_set(http, w->settings);
+  fiobj_free(w->key);
+  fio_free(w);
+  http_resume(http, iodine_cache_on_resume, NULL);
+}
+
+/* the request was paused - wait for the pending response (if still pending) */
+static void iodine_cache_wait(void *http) {
+  iodine_cache_waiter_s *w = http_paused_udata_get(http);
+  spn_lock(&iodine_cache_lock);
+  iodine_cache_s *c = iodine_cache_find(w->key, w->hash);
+  if (c && c->pending) {
+    fio_ls_push(&c->waiting, http);
+    http = NULL;
+  }
+  spn_unlock(&iodine_cache_lock);
+  if (http)
+    iodine_cache_resume(http);
+}
+
+/*
+ * Serves the request from the cache when possible (returns 1 when the request
+ * was handled or paused).
+ *
+ * Otherwise, when the response might be cached, sets `handle->cache_key` and
+ * marks the entry as pending, so concurrent requests for the same key wait for
+ * the response instead of calling the application (`coalesce`).
+ */
+static int iodine_cache_lookup(iodine_http_request_handle_s *handle,
+                               uint8_t coalesce) {
+  http_s *h = handle->h;
+  iodine_http_settings_s *s = h->udata;
+  if (!s || !s->cache || !(handle->app || s->app))
+    return 0;
+  FIOBJ key = iodine_cache_key(h, s);
+  if (!key)
+    return 0;
+  const uint64_t hash = fiobj_obj2hash(key);
+  const time_t now = facil_last_tick().tv_sec;
+  spn_lock(&iodine_cache_lock);
+  iodine_cache_s *c = iodine_cache_find(key, hash);
+  if (c && !c->pending && c->expires > now) {
+    fiobj_free(key);
+    iodine_cache_send(h, c, now); /* releases the lock */
+    return 1;
+  }
+  if (c && c->pending) {
+    spn_unlock(&iodine_cache_lock);
+    if (!coalesce) {
+      fiobj_free(key);
+      return 0;
+    }
+    iodine_cache_waiter_s *w = fio_malloc(sizeof(*w));
+    *w = (iodine_cache_waiter_s){.settings = s, .key = key, .hash = hash};
+    h->udata = w;
+    http_pause(h, iodine_cache_wait);
+    return 1;
+  }
+  if (!coalesce) {
+    spn_unlock(&iodine_cache_lock);
+    fiobj_free(key);
+    return 0;
+  }
+  if (c) {
+    /* expired, refresh the entry */
+    fiobj_free(c->headers);
+    fiobj_free(c->body);
+    c->headers = c->body = FIOBJ_INVALID;
+    c->pending = 1;
+  } else {
+    if (!iodine_cache.map)
+      fio_hash_new(&iodine_cache);
+    if (fio_hash_count(&iodine_cache) >= IODINE_HTTP_CACHE_COUNT)
+      iodine_cache_evict(now);
+    if (fio_hash_count(&iodine_cache) >= IODINE_HTTP_CACHE_COUNT ||
+        fio_hash_find(&iodine_cache, hash)) {
+      /* the cache is full (or a hash collision) */
+      spn_unlock(&iodine_cache_lock);
+      fiobj_free(key);
+      return 0;
+    }
+    c = fio_malloc(sizeof(*c));
+    *c = (iodine_cache_s){.key = fiobj_dup(key), .pending = 1};
+    c->waiting = (fio_ls_s)FIO_LS_INIT(c->waiting);
+    fio_hash_insert(&iodine_cache, hash, c);
+  }
+  spn_unlock(&iodine_cache_lock);
+  handle->cache_key = key;
+  return 0;
+}
+
+/*
+ * Returns the number of seconds the response can be stored for (0 if the
+ * response can't be cached), according to it's `cache-control` header.
+ */
+static time_t iodine_cache_ttl(iodine_http_request_handle_s *handle) {
+  http_s *h = handle->h;
+  if (h->status != 200 || (handle->type != IODINE_HTTP_SENDBODY &&
+                           handle->type != IODINE_HTTP_EMPTY))
+    return 0;
+  if (handle->body &&
+      fiobj_obj2cstr(handle->body).len > IODINE_HTTP_CACHE_LIMIT)
+    return 0;
+  FIOBJ headers = h->private_data.out_headers;
+  if (fiobj_hash_get2(headers, fiobj_obj2hash(HTTP_HEADER_SET_COOKIE)))
+    return 0;
+  FIOBJ cc =
+      fiobj_hash_get2(headers, fiobj_obj2hash(HTTP_HEADER_CACHE_CONTROL));
+  if (!cc || !FIOBJ_TYPE_IS(cc, FIOBJ_T_STRING))
+    return 0;
+  fio_cstr_s str = fiobj_obj2cstr(cc);
+  time_t max_age = 0;
+  time_t s_maxage = -1;
+  char *pos = str.data;
+  char *end = str.data + str.len;
+  while (pos < end) {
+    while (pos < end && (*pos == ' ' || *pos == ','))
+      ++pos;
+    char *directive = pos;
+    while (pos < end && *pos != ',' && *pos != '=' && *pos != ' ')
+      ++pos;
+    size_t len = pos - directive;
+    if ((len == 7 && !strncasecmp(directive, "private", 7)) ||
+        (len == 8 && !strncasecmp(directive, "no-store", 8)) ||
+        (len == 8 && !strncasecmp(directive, "no-cache", 8)))
+      return 0;
+    if (pos < end && *pos == '=') {
+      ++pos;
+      char *value = pos;
+      time_t num = (time_t)fio_atol(&value);
+      if (len == 7 && !strncasecmp(directive, "max-age", 7))
+        max_age = num;
+      else if (len == 8 && !strncasecmp(directive, "s-maxage", 8))
+        s_maxage = num;
+      pos = value;
+      while (pos < end && *pos != ',')
+        ++pos;
+    }
+  }
+  /* `s-maxage` (shared caches) overrides `max-age` */
+  if (s_maxage >= 0)
+    max_age = s_maxage;
+  return (max_age > 0 ? max_age : 0);
+}
+
+/*
+ * Stores the response (if it can be cached) for requests that marked a pending
+ * cache entry, and resumes any requests waiting for the response.
+ */
+static void iodine_cache_store(iodine_http_request_handle_s *handle) {
+  FIOBJ key = handle->cache_key;
+  if (!key)
+    return;
+  handle->cache_key = FIOBJ_INVALID;
+  const uint64_t hash = fiobj_obj2hash(key);
+  const time_t now = facil_last_tick().tv_sec;
+  const time_t ttl = iodine_cache_ttl(handle);
+  FIOBJ headers = FIOBJ_INVALID;
+  FIOBJ body = FIOBJ_INVALID;
+  if (ttl) {
+    headers = fiobj_hash_new();
+    fiobj_each1(handle->h->private_data.out_headers, 0,
+                iodine_cache_store_header, (void *)headers);
+    if (handle->body) {
+      body = fiobj_str_copy(handle->body);
+      fiobj_str_freeze(body);
+    }
+  }
+  fio_ls_s waiting = FIO_LS_INIT(waiting);
+  spn_lock(&iodine_cache_lock);
+  iodine_cache_s *c = iodine_cache_find(key, hash);
+  if (c && c->pending) {
+    /* collect the waiting requests */
+    while (fio_ls_any(&c->waiting))
+      fio_ls_push(&waiting, fio_ls_shift(&c->waiting));
+    if (ttl) {
+      c->headers = headers;
+      c->body = body;
+      c->status = handle->h->status;
+      c->stored = now;
+      c->expires = now + ttl;
+      c->pending = 0;
+      headers = body = FIOBJ_INVALID;
+    } else {
+      fio_hash_insert(&iodine_cache, hash, NULL);
+      iodine_cache_free(c);
+    }
+  }
+  spn_unlock(&iodine_cache_lock);
+  fiobj_free(headers);
+  fiobj_free(body);
+  fiobj_free(key);
+  while (fio_ls_any(&waiting))
+    iodine_cache_resume(fio_ls_shift(&waiting));
+}
+
+/**
+Clears the HTTP response cache (see the `cache` option of {listen2http}).
+
+The cache is per process, so this only effects the calling process (i.e., call
+this from a pub/sub subscription to clear the cache of all the workers).
+*/
+static VALUE iodine_http_cache_clear(VALUE self) {
+  spn_lock(&iodine_cache_lock);
+  FIO_HASH_FOR_LOOP(&iodine_cache, pos) {
+    iodine_cache_s *c = pos->obj;
+    /* pending entries are released once their response is ready */
+    if (!c || c->pending)
+      continue;
+    fio_hash_insert(&iodine_cache, pos->key, NULL);
+    iodine_cache_free(c);
+  }
+  fio_hash_compact(&iodine_cache);
+  spn_unlock(&iodine_cache_lock);
+  return self;
+}
+
+/* *****************************************************************************
+Native routes
+***************************************************************************** */
+
+/* a native route (see the `routes` option of {listen2http}) */
+typedef struct {
+  /* the route's path (without the trailing `*` of prefix routes) */
+  FIOBJ path;
+  /* a String: the response body, or the `file` / `public` folder path */
+  FIOBJ data;
+  /* the response headers (a Hash) */
+  FIOBJ headers;
+  uintptr_t status;
+  /* a Rack application (`IODINE_ROUTE_APP`) */
+  VALUE app;
+  enum iodine_route_type_enum {
+    IODINE_ROUTE_RESPONSE,
+    IODINE_ROUTE_PUBLIC,
+    IODINE_ROUTE_FILE,
+    IODINE_ROUTE_APP,
+  } type;
+  uint8_t prefix;
+} iodine_route_s;
+
+struct iodine_http_routes_s {
+  /* the exact routes, by the path's hash */
+  fio_hash_s exact;
+  size_t exact_count;
+  size_t count;
+  /* exact routes first, followed by prefix routes (longest first) */
+  iodine_route_s routes[];
+};
+
+/* returns a route's type, raising an exception if the target is invalid. */
+static enum iodine_route_type_enum iodine_route_type(VALUE target) {
+  if (RB_TYPE_P(target, T_ARRAY)) {
+    if (RARRAY_LEN(target) != 3)
+      rb_raise(rb_eArgError,
+               "route responses should be an Array of [status, headers, body]");
+    Check_Type(rb_ary_entry(target, 0), T_FIXNUM);
+    Check_Type(rb_ary_entry(target, 1), T_HASH);
+    Check_Type(rb_ary_entry(target, 2), T_STRING);
+    VALUE headers = rb_ary_entry(target, 1);
+    VALUE names = rb_funcall(headers, rb_intern("keys"), 0);
+    for (long i = 0; i < RARRAY_LEN(names); ++i) {
+      Check_Type(rb_ary_entry(names, i), T_STRING);
+      Check_Type(rb_hash_aref(headers, rb_ary_entry(names, i)), T_STRING);
+    }
+    return IODINE_ROUTE_RESPONSE;
+  }
+  if (RB_TYPE_P(target, T_HASH)) {
+    VALUE tmp = rb_hash_aref(target, ID2SYM(rb_intern("public")));
+    if (tmp != Qnil) {
+      Check_Type(tmp, T_STRING);
+      return IODINE_ROUTE_PUBLIC;
+    }
+    tmp = rb_hash_aref(target, ID2SYM(rb_intern("file")));
+    if (tmp != Qnil) {
+      Check_Type(tmp, T_STRING);
+      return IODINE_ROUTE_FILE;
+    }
+  }
+  if (!rb_respond_to(target, iodine_call_proc_id))
+    rb_raise(rb_eArgError, "route targets should be a response Array, a Hash "
+                           "with a `public` or `file` path, or an application");
+  return IODINE_ROUTE_APP;
+}
+
+/* orders exact routes first and prefix routes by length (longest first). */
+static int iodine_route_cmp(const void *a_, const void *b_) {
+  const iodine_route_s *a = a_;
+  const iodine_route_s *b = b_;
+  if (a->prefix != b->prefix)
+    return (int)a->prefix - (int)b->prefix;
+  if (!a->prefix)
+    return 0;
+  size_t a_len = fiobj_obj2cstr(a->path).len;
+  size_t b_len = fiobj_obj2cstr(b->path).len;
+  return (a_len < b_len) - (a_len > b_len);
+}
+
+/* copies a response header to the route's headers (names are lowercased). */
+static int iodine_route_header(VALUE name, VALUE value, VALUE headers_) {
+  FIOBJ headers = (FIOBJ)headers_;
+  FIOBJ n = fiobj_str_new(RSTRING_PTR(name), RSTRING_LEN(name));
+  fio_cstr_s s = fiobj_obj2cstr(n);
+  for (size_t i = 0; i < s.len; ++i)
+    s.data[i] = tolower(s.data[i]);
+  fiobj_hash_set(headers, n,
+                 fiobj_str_new(RSTRING_PTR(value), RSTRING_LEN(value)));
+  fiobj_free(n);
+  return ST_CONTINUE;
+}
+
+/* creates the routes from a Hash of paths and targets (raises on errors). */
+static iodine_http_routes_s *iodine_routes_new(VALUE routes,
+                                               uint8_t shareable) {
+  Check_Type(routes, T_HASH);
+  VALUE keys = rb_funcall(routes, rb_intern("keys"), 0);
+  const size_t count = RARRAY_LEN(keys);
+  if (!count)
+    return NULL;
+  /* validate everything before any memory is allocated */
+  VALUE paths = rb_ary_new2(count);
+  VALUE targets = rb_ary_new2(count);
+  for (size_t i = 0; i < count; ++i) {
+    VALUE key = rb_ary_entry(keys, i);
+    VALUE path = rb_obj_as_string(key);
+    if (!RSTRING_LEN(path) || RSTRING_PTR(path)[0] != '/')
+      rb_raise(rb_eArgError, "route paths should start with a `/` (%s)",
+               StringValueCStr(path));
+    VALUE target = rb_hash_aref(routes, key);
+    if (iodine_route_type(target) == IODINE_ROUTE_APP && shareable)
+      target = rb_funcall(rb_const_get(rb_cObject, rb_intern("Ractor")),
+                          rb_intern("make_shareable"), 1, target);
+    rb_ary_push(paths, path);
+    rb_ary_push(targets, target);
+  }
+  iodine_http_routes_s *r = malloc(sizeof(*r) + (sizeof(r->routes[0]) * count));
+  r->exact = (fio_hash_s)FIO_HASH_INIT;
+  r->exact_count = 0;
+  r->count = count;
+  for (size_t i = 0; i < count; ++i) {
+    VALUE path = rb_ary_entry(paths, i);
+    VALUE target = rb_ary_entry(targets, i);
+    iodine_route_s *route = r->routes + i;
+    size_t len = RSTRING_LEN(path);
+    *route = (iodine_route_s){.type = iodine_route_type(target)};
+    if (RSTRING_PTR(path)[len - 1] == '*') {
+      route->prefix = 1;
+      --len;
+      if (RSTRING_PTR(path)[len - 1] == '/')
+        --len;
+    }
+    route->path = fiobj_str_new(RSTRING_PTR(path), len);
+    switch (route->type) {
+    case IODINE_ROUTE_RESPONSE:
+      route->status = FIX2ULONG(rb_ary_entry(target, 0));
+      route->headers = fiobj_hash_new();
+      rb_hash_foreach(rb_ary_entry(target, 1), iodine_route_header,
+                      (VALUE)route->headers);
+      route->data = fiobj_str_new(RSTRING_PTR(rb_ary_entry(target, 2)),
+                                  RSTRING_LEN(rb_ary_entry(target, 2)));
+      break;
+    case IODINE_ROUTE_PUBLIC: /* fallthrough */
+    case IODINE_ROUTE_FILE: {
+      VALUE tmp = rb_hash_aref(
+          target, ID2SYM(rb_intern(route->type == IODINE_ROUTE_PUBLIC
+                                       ? "public"
+                                       : "file")));
+      route->data = fiobj_str_new(RSTRING_PTR(tmp), RSTRING_LEN(tmp));
+      break;
+    }
+    case IODINE_ROUTE_APP:
+      route->app = IodineStore.add(target);
+      break;
+    }
+  }
+  qsort(r->routes, count, sizeof(r->routes[0]), iodine_route_cmp);
+  while (r->exact_count < count && !r->routes[r->exact_count].prefix) {
+    iodine_route_s *route = r->routes + r->exact_count++;
+    fio_hash_insert(&r->exact, fiobj_obj2hash(route->path), route);
+  }
+  RB_GC_GUARD(paths);
+  RB_GC_GUARD(targets);
+  return r;
+}
+
+typedef struct {
+  VALUE routes;
+  uint8_t shareable;
+  iodine_http_routes_s *result;
+} iodine_routes_new_args_s;
+
+/* calls `iodine_routes_new` (using `rb_protect`, so errors can be cleaned up) */
+static VALUE iodine_routes_new_protected(VALUE args_) {
+  iodine_routes_new_args_s *args = (iodine_routes_new_args_s *)args_;
+  args->result = iodine_routes_new(args->routes, args->shareable);
+  return Qnil;
+}
+
+static void iodine_routes_free(iodine_http_routes_s *r) {
+  if (!r)
+    return;
+  for (size_t i = 0; i < r->count; ++i) {
+    fiobj_free(r->routes[i].path);
+    fiobj_free(r->routes[i].data);
+    fiobj_free(r->routes[i].headers);
+    if (r->routes[i].app)
+      IodineStore.remove(r->routes[i].app);
+  }
+  fio_hash_free(&r->exact);
+  free(r);
+}
+
+/* finds the request path's route (or NULL). The routes are never modified. */
+static iodine_route_s *iodine_route_find(iodine_http_routes_s *r, FIOBJ path) {
+  iodine_route_s *route = fio_hash_find(&r->exact, fiobj_obj2hash(path));
+  if (route && fiobj_iseq(route->path, path))
+    return route;
+  fio_cstr_s p = fiobj_obj2cstr(path);
+  for (size_t i = r->exact_count; i < r->count; ++i) {
+    /* "/foo*" matches "/foo" and "/foo/...", but not "/foobar" */
+    fio_cstr_s prefix = fiobj_obj2cstr(r->routes[i].path);
+    if (p.len >= prefix.len && !memcmp(p.data, prefix.data, prefix.len) &&
+        (p.len == prefix.len || p.data[prefix.len] == '/'))
+      return r->routes + i;
+  }
+  return NULL;
+}
+
+/*
+ * serves the request using the service's routes, without entering Ruby.
+ * Returns 0 if the request should be handled by an application (`handle->app`
+ * is set for routed applications).
+ */
+static int iodine_route_request(iodine_http_request_handle_s *handle) {
+  http_s *h = handle->h;
+  iodine_http_settings_s *s = h->udata;
+  if (!s || !s->routes || !h->path)
+    return 0;
+  iodine_route_s *route = iodine_route_find(s->routes, h->path);
+  if (!route)
+    return 0;
+  fio_cstr_s data = fiobj_obj2cstr(route->data);
+  switch (route->type) {
+  case IODINE_ROUTE_RESPONSE: {
+    h->status = route->status;
+    fiobj_each1(route->headers, 0, iodine_cache_copy_header, h);
+    fio_cstr_s method = fiobj_obj2cstr(h->method);
+    if (method.len == 4 && !strncasecmp("head", method.data, 4)) {
+      http_set_header(h, HTTP_HEADER_CONTENT_LENGTH, fiobj_num_new(data.len));
+      http_finish(h);
+    } else {
+      http_send_body_fiobj(h, route->data);
+    }
+    return 1;
   }
+  case IODINE_ROUTE_PUBLIC: {
+    /* the rest of the path (starting with a `/`) is tested by `sendfile2` */
+    fio_cstr_s path = fiobj_obj2cstr(h->path);
+    size_t offset = fiobj_obj2cstr(route->path).len;
+    if (path.len == offset) {
+      path.data = "/";
+      offset = 0;
+      path.len = 1;
+    }
+    if (http_sendfile2(h, data.data, data.len, path.data + offset,
+                       path.len - offset))
+      http_send_error(h, 404);
+    return 1;
+  }
+  case IODINE_ROUTE_FILE:
+    if (http_sendfile2(h, data.data, data.len, NULL, 0))
+      http_send_error(h, 404);
+    return 1;
+  case IODINE_ROUTE_APP:
+    handle->app = route->app;
+    return 0;
+  }
+  return 0;
+}
+
+/* *****************************************************************************
+HTTP client requests (`Iodine::HTTP.request`)
+***************************************************************************** */
+
+static void *iodine_http_request_in_GVL(void *args_) {
+  VALUE *args = args_;
+  VALUE block = args[3];
+  IodineCaller.call2(block, iodine_call_proc_id, 3, args);
+  IodineStore.remove(block);
+  return NULL;
+}
+
+static void *iodine_http_response2rb_in_GVL(void *args_) {
+  VALUE *args = args_;
+  http_s *h = (http_s *)args[0];
+  args[0] = ULONG2NUM(h->status);
+  args[1] = fiobj2rb_deep(h->headers, 0);
+  fio_cstr_s body = {.data = NULL};
+  if (h->body)
+    body = fiobj_obj2cstr(h->body);
+  args[2] = rb_str_new(body.data, body.len);
+  return iodine_http_request_in_GVL(args);
+}
+
+static void iodine_http_request_on_response(http_s *h, void *block) {
+  VALUE args[4] = {Qnil, Qnil, Qnil, (VALUE)block};
+  if (!h) {
+    IodineCaller.enterGVL(iodine_http_request_in_GVL, args);
+    return;
+  }
+  args[0] = (VALUE)h;
+  IodineCaller.enterGVL(iodine_http_response2rb_in_GVL, args);
+}
+
+static int iodine_http_request_header(VALUE name, VALUE value, VALUE headers) {
+  name = rb_obj_as_string(name);
+  FIOBJ n = fiobj_str_new(RSTRING_PTR(name), RSTRING_LEN(name));
+  fio_cstr_s tmp = fiobj_obj2cstr(n);
+  for (size_t i = 0; i < tmp.len; ++i)
+    tmp.data[i] = tolower(tmp.data[i]);
+  value = rb_obj_as_string(value);
+  fiobj_hash_set((FIOBJ)headers, n,
+                 fiobj_str_new(RSTRING_PTR(value), RSTRING_LEN(value)));
+  fiobj_free(n);
+  return ST_CONTINUE;
+}
+
+// clang-format off
+/**
+Sends an HTTP request without blocking, using a pooled (keep-alive) connection.
+
+    Iodine::HTTP.request("http://localhost:3000/users/1") do |status, headers, body|
+      # ...
+    end
+
+The block is called (on one of the server's threads) once the response was
+received. If the request failed (the host couldn't be reached, the connection
+was lost or timed out), the block is called with `nil` values.
+
+Connections are pooled per host and port, so requests from within a handler
+don't pay for a new TCP connection each time. Each host gets up to 8
+connections. Once they are all busy, GET, PUT, DELETE and OPTIONS requests are
+pipelined and other requests wait for a connection. Idle connections are closed
+after 5 seconds.
+
+Only `http://` URLs are supported (no TLS) and `HEAD` requests aren't supported.
+
+Accepts the following (optional) named arguments:
+
+method:: The request method (a String or Symbol). Default: `"GET"`.
+
+headers:: A Hash of request headers. Default: `nil`.
+
+body:: The request body (a String). Default: `nil`.
+
+Returns `true`.
+*/
+static VALUE iodine_http_request(int argc, VALUE *argv, VALUE self) {
+  // clang-format on
+  VALUE url, opt, block;
+  rb_scan_args(argc, argv, "11&", &url, &opt, &block);
+  Check_Type(url, T_STRING);
+  const char *address = StringValueCStr(url);
+  if (block == Qnil)
+    rb_raise(rb_eArgError, "Iodine::HTTP.request requires a block.");
+  VALUE method = Qnil, headers = Qnil, body = Qnil;
+  if (opt != Qnil) {
+    Check_Type(opt, T_HASH);
+    method = rb_hash_aref(opt, ID2SYM(rb_intern("method")));
+    headers = rb_hash_aref(opt, ID2SYM(rb_intern("headers")));
+    body = rb_hash_aref(opt, ID2SYM(rb_intern("body")));
+  }
+  if (method != Qnil) {
+    if (RB_TYPE_P(method, T_SYMBOL))
+      method = rb_sym2str(method);
+    Check_Type(method, T_STRING);
+  }
+  if (headers != Qnil)
+    Check_Type(headers, T_HASH);
+  if (body != Qnil)
+    Check_Type(body, T_STRING);
+
+  FIOBJ fmethod = FIOBJ_INVALID;
+  FIOBJ fheaders = FIOBJ_INVALID;
+  FIOBJ fbody = FIOBJ_INVALID;
+  if (method != Qnil) {
+    fmethod = fiobj_str_new(RSTRING_PTR(method), RSTRING_LEN(method));
+    fio_cstr_s tmp = fiobj_obj2cstr(fmethod);
+    for (size_t i = 0; i < tmp.len; ++i)
+      tmp.data[i] = toupper(tmp.data[i]);
+  }
+  if (headers != Qnil) {
+    fheaders = fiobj_hash_new();
+    rb_hash_foreach(headers, iodine_http_request_header, (VALUE)fheaders);
+  }
+  if (body != Qnil)
+    fbody = fiobj_str_new(RSTRING_PTR(body), RSTRING_LEN(body));
+
+  IodineStore.add(block);
+  /* the block might be called right away (i.e., if the host is unknown) */
+  uint8_t in_gvl = IodineCaller.in_GVL();
+  IodineCaller.set_GVL(1);
+  int ret = http_request(address, .method = fmethod, .headers = fheaders,
+                         .body = fbody,
+                         .on_response = iodine_http_request_on_response,
+                         .udata = (void *)block);
+  IodineCaller.set_GVL(in_gvl);
+  fiobj_free(fmethod);
+  fiobj_free(fheaders);
+  fiobj_free(fbody);
+  if (ret == -1) {
+    IodineStore.remove(block);
+    rb_raise(rb_eArgError, "Iodine::HTTP.request requires an http:// URL.");
+  }
+  return Qtrue;
+  (void)self;
+}
+
+/* *****************************************************************************
+Handling HTTP requests (the `on_request` callbacks)
+***************************************************************************** */
+
+typedef struct {
+  void (*task)(void *);
+  void *arg;
+} iodine_pipeline_s;
+
+static void *iodine_pipeline_in_GVL(void *pipeline_) {
+  iodine_pipeline_s *pipeline = pipeline_;
+  pipeline->task(pipeline->arg);
+  return NULL;
+}
+
+/* handles a batch of pipelined requests within a single GVL section. */
+static void on_rack_pipeline(void (*task)(void *), void *arg) {
+  iodine_pipeline_s pipeline = {.task = task, .arg = arg};
+  IodineCaller.enterGVL(iodine_pipeline_in_GVL, &pipeline);
+}
+
+/*
+ * handles the request and then performs any other ready tasks (i.e., requests
+ * from other connections) within the same GVL section. Their own calls to
+ * `enterGVL` are reentrant, so the GVL is acquired once per batch.
+ */
+static void *iodine_handle_batch_in_GVL(void *handle_) {
+  iodine_http_request_handle_s *handle = handle_;
+  iodine_handle_request_in_GVL(handle);
+  iodine_cache_store(handle);
+  iodine_perform_handle_action(*handle);
+  defer_perform_batch(iodine_gvl_batch);
+  return NULL;
 }
-static void on_rack_request(http_s *h) {
+
+static inline void on_rack_request_internal(http_s *h, uint8_t coalesce) {
   iodine_http_request_handle_s handle = (iodine_http_request_handle_s){
       .h = h, .upgrade = IODINE_UPGRADE_NONE,
   };
+  /* routed requests and cache hits are served without entering the GVL */
+  if (iodine_route_request(&handle) || iodine_cache_lookup(&handle, coalesce))
+    return;
+  if (iodine_gvl_batch && !IodineCaller.in_GVL()) {
+    IodineCaller.enterGVL(iodine_handle_batch_in_GVL, &handle);
+    return;
+  }
   IodineCaller.enterGVL((void *(*)(void *))iodine_handle_request_in_GVL,
                         &handle);
+  iodine_cache_store(&handle);
   iodine_perform_handle_action(handle);
 }
 
+static void on_rack_request(http_s *h) { on_rack_request_internal(h, 1); }
+
+/* requests that waited for a cached response don't wait again */
+static void on_rack_request_uncached(http_s *h) {
+  on_rack_request_internal(h, 0);
+}
+
+/* a minimal `env` for WebSocket upgrades routed by the `upgrade` option */
+static VALUE iodine_upgrade_env(http_s *h) {
+  VALUE env = rb_hash_dup(env_template_websockets);
+  fio_cstr_s tmp = fiobj_obj2cstr(h->method);
+  rb_hash_aset(env, REQUEST_METHOD,
+               rb_enc_str_new(tmp.data, tmp.len, IodineBinaryEncoding));
+  tmp = fiobj_obj2cstr(h->path);
+  rb_hash_aset(env, PATH_INFO,
+               rb_enc_str_new(tmp.data, tmp.len, IodineBinaryEncoding));
+  tmp = h->query ? fiobj_obj2cstr(h->query) : (fio_cstr_s){.len = 0};
+  rb_hash_aset(env, QUERY_STRING,
+               tmp.len ? rb_enc_str_new(tmp.data, tmp.len, IodineBinaryEncoding)
+                       : QUERY_ESTRING);
+  if (support_lazy_env)
+    iodine_lazy_headers_set(env, h);
+  return env;
+}
+
+/* accepts WebSocket upgrades for the `upgrade` paths without the `app`. */
+static void *iodine_upgrade_route_in_GVL(void *handle_) {
+  iodine_http_request_handle_s *handle = handle_;
+  http_s *h = handle->h;
+  iodine_http_settings_s *settings = h->udata;
+  fio_cstr_s path = fiobj_obj2cstr(h->path);
+  VALUE handler = rb_hash_lookup2(
+      settings->upgrade,
+      rb_enc_str_new(path.data, path.len, IodineBinaryEncoding), Qundef);
+  if (handler == Qundef)
+    return iodine_handle_request_in_GVL(handle);
+  VALUE env = iodine_upgrade_env(h);
+  if (rb_respond_to(handler, iodine_call_proc_id))
+    handler = IodineCaller.call2(handler, iodine_call_proc_id, 1, &env);
+  if (handler == Qnil || handler == Qfalse) {
+    h->status = 400;
+    handle->type = IODINE_HTTP_ERROR;
+    return NULL;
+  }
+  iodine_ws_attach(h, handler, env);
+  handle->type = IODINE_HTTP_NONE;
+  RB_GC_GUARD(env);
+  RB_GC_GUARD(handler);
+  return NULL;
+}
+
 static void on_rack_upgrade(http_s *h, char *proto, size_t len) {
   iodine_http_request_handle_s handle = (iodine_http_request_handle_s){.h = h};
   if (len == 9 && proto[1] == 'e') {
@@ -773,7 +2072,14 @@ static void on_rack_upgrade(http_s *h, char *proto, size_t len) {
   //   http_send_error(h, 400);
   //   return;
   // }
-  IodineCaller.enterGVL(iodine_handle_request_in_GVL, &handle);
+  if (iodine_route_request(&handle))
+    return;
+  iodine_http_settings_s *settings = h->udata;
+  if (handle.upgrade == IODINE_UPGRADE_WEBSOCKET && settings &&
+      settings->upgrade && !handle.app)
+    IodineCaller.enterGVL(iodine_upgrade_route_in_GVL, &handle);
+  else
+    IodineCaller.enterGVL(iodine_handle_request_in_GVL, &handle);
   iodine_perform_handle_action(handle);
   (void)proto;
   (void)len;
@@ -815,9 +2121,23 @@ finish:
 }
 
 static void free_iodine_http(http_settings_s *s) {
-  IodineStore.remove((VALUE)s->udata);
+  iodine_http_settings_s *settings = s->udata;
+  if (!settings)
+    return;
+  if (settings->app)
+    IodineStore.remove(settings->app);
+  if (settings->upgrade)
+    IodineStore.remove(settings->upgrade);
+  fiobj_free(settings->vary);
+  iodine_routes_free(settings->routes);
+  free(settings);
 }
 
+#ifndef IODINE_HTTP_COMPRESS_MIN
+/** The smallest response body compressed when `compress: true` is set. */
+#define IODINE_HTTP_COMPRESS_MIN 1024
+#endif
+
 // clang-format off
 /**
 Listens to incoming HTTP connections and handles incoming requests using the
@@ -834,16 +2154,33 @@ Accepts a single Hash argument with the following properties:
 app:: the Rack application that handles incoming requests. Default: `nil`.
 port:: the port to listen to. Default: 3000.
 address:: the address to bind to. Default: binds to all possible addresses.
-log:: enable response logging (Hijacked sockets aren't logged). Default: off.
+log:: enable response logging (Hijacked sockets aren't logged). Set to `:json` for JSON log lines. Default: off.
 public:: The root public folder for static file service. Default: none.
 timeout:: Timeout for inactive HTTP/1.x connections. Defaults: 40 seconds.
 max_body:: The maximum body size for incoming HTTP messages. Default: ~50Mib.
+stream_body:: request bodies longer than this number of bytes (with a known `Content-Length`) are streamed. The `app` is called once the body starts to arrive and `rack.input` receives the rest of the body while it's being read, so uploads aren't stored in a temporary file first and slow applications slow down the client. `rack.input` can't be rewound once it was read and a body that wasn't fully read closes the connection. Default: 0 (off).
 max_headers:: The maximum total header length for incoming HTTP messages. Default: ~64Kib.
 max_msg:: The maximum Websocket message size allowed. Default: ~250Kib.
 ping:: The Websocket `ping` interval. Default: 40 seconds.
-
-Either the `app` or the `public` properties are required. If niether exists,
-the function will fail. If both exist, Iodine will serve static files as well
+deflate:: accept the `permessage-deflate` Websocket extension (requires zlib). Default: off.
+lazy_env:: copy the request headers (the `HTTP_*` keys) to the Rack `env` only when they are accessed using `env[key]`. The headers will be missing from `env.keys`, `env.each`, `env.key?` and `env.fetch`, so this is only suitable for applications (and middleware) known to read headers using `env[key]`. Affects all HTTP services. Default: off.
+gvl_batch:: after handling a request, perform up to this number of other ready tasks (i.e., requests from other connections) before releasing the GVL, so the GVL is acquired once per batch instead of once per request. This improves throughput under load at the expense of other Ruby threads (which wait for the batch). Affects all HTTP services. Default: 0 (off).
+ractor:: (experimental, Ruby 3.0+) run each worker thread within it's own Ractor, so Ruby code runs on multiple CPU cores within a single process. The `app` is made shareable using `Ractor.make_shareable` (an exception is raised if this fails). Any Ruby code called by the worker threads (`Iodine.run` blocks, WebSocket / SSE and Pub/Sub callbacks) must be Ractor safe as well. Affects all worker threads. Default: off.
+tls_cert:: a PEM encoded certificate (chain) file, enables HTTPS (requires OpenSSL). HTTP/2 is negotiated using ALPN and the kernel's TLS offload (kTLS) is used when available. Default: none.
+tls_key:: the PEM encoded private key file. Default: the `tls_cert` file.
+tls_password:: the private key's password (for encrypted keys). Default: none.
+reuse_port:: open a separate `SO_REUSEPORT` listening socket per worker process, so connections are balanced by the kernel. Set to `:cpu` to route connections to the worker matching the receiving CPU (Linux only). Default: off.
+defer_accept:: wait (up to this number of seconds) for the client's first request before a connection is accepted (`TCP_DEFER_ACCEPT`, Linux only), so connections that never send data don't consume resources. Default: 0 (off).
+fastopen:: the TCP Fast Open queue length, allowing clients to send their first request with the connection's SYN packet (when supported). Set to `false` to disable TCP Fast Open. Default: 128.
+balance:: when a worker process has this many (or more) connections than the least busy worker, new connections are handed to that worker before the `on_open` / first request (requires `workers > 1`, ignored with `reuse_port`). Default: 0 (off).
+cache:: cache the `app`'s responses to `GET` requests (per worker process) when the response allows it (a `200` status with a `cache-control` `s-maxage` or `max-age`, that isn't `private`, `no-store` or `no-cache`, and no `set-cookie` header). Cached responses are served without calling the `app` (or entering Ruby). Concurrent requests for a response that's being prepared wait for it rather than calling the `app`. Responses are keyed by the path, query and `host` header. Set to an Array of (lowercase) header names to add their values to the key (i.e., `["accept-encoding"]`). Requests with an `authorization` header aren't cached. Default: off.
+fiber:: (Ruby 3.0+) call the `app` within a non-blocking Fiber, using {Iodine::Scheduler}. Blocking IO (i.e., database or HTTP calls), `sleep` and waiting for a `Mutex` or a `Queue` park the Fiber (the file descriptor is watched by the iodine reactor) rather than the worker thread, so a few threads can handle many slow requests. The response is sent once the Fiber completes. Hijacking (`rack.hijack`) isn't available after the Fiber parked, `stream_body` is ignored and upgrade requests (WebSockets / SSE) aren't handled by Fibers. Default: off.
+upgrade:: a Hash of paths (i.e., `"/ws"`) and WebSocket callback objects (see {Iodine::Connection}). WebSocket upgrade requests for these paths are accepted without calling the `app`, using a minimal `env` (with only the `REQUEST_METHOD`, `PATH_INFO` and `QUERY_STRING` request data, plus the headers when `lazy_env` is set). A callback object that responds to `call` is called with the `env` and should return the connection's callback object (`nil` refuses the upgrade). The path is matched exactly (without the query). Default: none.
+compress:: compress the `app`'s textual responses using brotli or gzip (as accepted by the client, requires the brotli encoder library or zlib). Set to `true` to compress bodies of 1Kib or more, or to the minimal body size (in bytes). Responses with a `content-encoding` or a `cache-control: no-transform` header are sent as is. Streamed responses are compressed unless they have a `content-length`. Cached responses (see `cache`) are stored uncompressed and compressed per request. Default: off.
+routes:: a Hash of paths and their native routes, matched (in C) before the `app` is called (and before `upgrade` paths), so these requests are handled without entering Ruby. Paths are matched exactly (without the query), unless they end with `*` (i.e., `"/assets*"` matches `"/assets"` and any path starting with `"/assets/"`, but not `"/assetsX"`). Exact paths are matched first, then the longest matching prefix. A route is either a response Array (`[status, headers, body]`, with String headers and body), a Hash with a `public` folder (the rest of the path is served from the folder) or a `file` (always served), or a Rack application that handles the route's requests instead of the `app`. Missing files are answered with a 404 error. Default: none.
+
+Either the `app`, `public`, `upgrade` or `routes` properties are required. If niether
+exists, the function will fail. If both exist, Iodine will serve static files as well
 as dynamic requests.
 
 When using the static file server, it's possible to serve `gzip` versions of
@@ -853,15 +2190,27 @@ the static files by saving a compressed version with the `gz` extension (i.e.
 `gzip` will only be served to clients tat support the `gzip` transfer
 encoding.
 
-Once HTTP/2 is supported (planned, but probably very far away), HTTP/2
-timeouts will be dynamically managed by Iodine. The `timeout` option is only
-relevant to HTTP/1.x connections.
+HTTP/2 is supported over TLS (negotiated using ALPN), as well as for clients
+with prior knowledge or using the `h2c` upgrade. The `timeout` option applies to
+idle HTTP/2 connections as well.
 */
 VALUE iodine_http_listen(VALUE self, VALUE opt) {
   // clang-format on
   uint8_t log_http = 0;
+  uint8_t ws_deflate = 0;
+  uint8_t reuse_port = 0;
+  uint8_t reuse_port_cpu = 0;
+  uint8_t defer_accept = 0;
+  int16_t fastopen = 0;
+  uint16_t balance = 0;
+  uint32_t compress = 0;
+  uint8_t cache = 0;
+  uint8_t fiber = 0;
+  uint8_t shareable = 0;
+  FIOBJ vary = FIOBJ_INVALID;
   size_t ping = 0;
   size_t max_body = 0;
+  size_t stream_body = 0;
   size_t max_headers = 0;
   size_t max_msg = 0;
   Check_Type(opt, T_HASH);
@@ -872,6 +2221,8 @@ VALUE iodine_http_listen(VALUE self, VALUE opt) {
   VALUE port = rb_hash_aref(opt, ID2SYM(rb_intern("port")));
   VALUE address = rb_hash_aref(opt, ID2SYM(rb_intern("address")));
   VALUE tout = rb_hash_aref(opt, ID2SYM(rb_intern("timeout")));
+  VALUE upgrade = rb_hash_aref(opt, ID2SYM(rb_intern("upgrade")));
+  VALUE routes = rb_hash_aref(opt, ID2SYM(rb_intern("routes")));
   if (www == Qnil) {
     www = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("public")));
   }
@@ -902,6 +2253,14 @@ VALUE iodine_http_listen(VALUE self, VALUE opt) {
     Check_Type(tmp, T_FIXNUM);
     max_body = FIX2ULONG(tmp);
   }
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("stream_body")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("stream_body")));
+  }
+  if (tmp != Qnil && tmp != Qfalse) {
+    Check_Type(tmp, T_FIXNUM);
+    stream_body = FIX2ULONG(tmp);
+  }
   tmp = rb_hash_aref(opt, ID2SYM(rb_intern("max_headers")));
   if (tmp == Qnil) {
     tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("max_headers")));
@@ -929,18 +2288,163 @@ VALUE iodine_http_listen(VALUE self, VALUE opt) {
   if (tmp == Qnil) {
     tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("log")));
   }
+  if (tmp == ID2SYM(rb_intern("json")))
+    log_http = HTTP_LOG_JSON;
+  else if (tmp != Qnil && tmp != Qfalse)
+    log_http = HTTP_LOG_TEXT;
+
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("deflate")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("deflate")));
+  }
   if (tmp != Qnil && tmp != Qfalse)
-    log_http = 1;
+    ws_deflate = 1;
+
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("lazy_env")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("lazy_env")));
+  }
+  if (tmp != Qnil && tmp != Qfalse && !support_lazy_env) {
+    VALUE fault = rb_proc_new(iodine_lazy_env_fault, Qnil);
+    env_template_thaw();
+    rb_funcall(env_template_no_upgrade, rb_intern("default_proc="), 1, fault);
+    rb_funcall(env_template_websockets, rb_intern("default_proc="), 1, fault);
+    rb_funcall(env_template_sse, rb_intern("default_proc="), 1, fault);
+    support_lazy_env = 1;
+  }
+
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("gvl_batch")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("gvl_batch")));
+  }
+  if (tmp != Qnil && tmp != Qfalse) {
+    Check_Type(tmp, T_FIXNUM);
+    iodine_gvl_batch = FIX2ULONG(tmp);
+  }
+
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("reuse_port")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("reuse_port")));
+  }
+  if (tmp != Qnil && tmp != Qfalse) {
+    reuse_port = 1;
+    if (tmp == ID2SYM(rb_intern("cpu")))
+      reuse_port_cpu = 1;
+  }
+
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("defer_accept")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("defer_accept")));
+  }
+  if (tmp != Qnil && tmp != Qfalse) {
+    Check_Type(tmp, T_FIXNUM);
+    if (FIX2LONG(tmp) < 0 || FIX2LONG(tmp) > 255)
+      rb_raise(rb_eRangeError, "defer_accept should be 0..255 seconds.");
+    defer_accept = (uint8_t)FIX2LONG(tmp);
+  }
+
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("fastopen")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("fastopen")));
+  }
+  if (tmp == Qfalse) {
+    fastopen = -1;
+  } else if (tmp != Qnil && tmp != Qtrue) {
+    Check_Type(tmp, T_FIXNUM);
+    if (FIX2LONG(tmp) <= 0 || FIX2LONG(tmp) > 32767)
+      rb_raise(rb_eRangeError, "fastopen should be 1..32767 (or false).");
+    fastopen = (int16_t)FIX2LONG(tmp);
+  }
+
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("balance")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("balance")));
+  }
+  if (tmp != Qnil && tmp != Qfalse) {
+    Check_Type(tmp, T_FIXNUM);
+    if (FIX2LONG(tmp) < 0 || FIX2LONG(tmp) > 65535)
+      rb_raise(rb_eRangeError, "balance should be 0..65535 connections.");
+    balance = (uint16_t)FIX2LONG(tmp);
+  }
 
-  if ((app == Qnil || app == Qfalse) && (www == Qnil || www == Qfalse)) {
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("compress")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("compress")));
+  }
+  if (tmp == Qtrue) {
+    compress = IODINE_HTTP_COMPRESS_MIN;
+  } else if (tmp != Qnil && tmp != Qfalse) {
+    Check_Type(tmp, T_FIXNUM);
+    if (FIX2LONG(tmp) < 0 || FIX2LONG(tmp) > UINT32_MAX)
+      rb_raise(rb_eRangeError, "compress should be a positive body size.");
+    compress = (uint32_t)FIX2LONG(tmp);
+  }
+
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("cache")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("cache")));
+  }
+  if (tmp != Qnil && tmp != Qfalse) {
+    cache = 1;
+    if (TYPE(tmp) == T_ARRAY) {
+      for (long i = 0; i < RARRAY_LEN(tmp); ++i)
+        Check_Type(rb_ary_entry(tmp, i), T_STRING);
+      vary = fiobj_ary_new2(RARRAY_LEN(tmp));
+      for (long i = 0; i < RARRAY_LEN(tmp); ++i) {
+        VALUE name = rb_ary_entry(tmp, i);
+        FIOBJ n = fiobj_str_new(RSTRING_PTR(name), RSTRING_LEN(name));
+        fio_cstr_s s = fiobj_obj2cstr(n);
+        for (size_t j = 0; j < s.len; ++j)
+          s.data[j] = tolower(s.data[j]);
+        fiobj_ary_push(vary, n);
+      }
+    }
+  }
+
+  if ((app == Qnil || app == Qfalse) && (www == Qnil || www == Qfalse) &&
+      (upgrade == Qnil || upgrade == Qfalse) &&
+      (routes == Qnil || routes == Qfalse)) {
     fprintf(stderr, "Iodine Warning: HTTP without application or public folder "
                     "(ignored).\n");
     return Qfalse;
   }
 
+  fio_tls_s *tls = NULL;
+  {
+    VALUE cert = rb_hash_aref(opt, ID2SYM(rb_intern("tls_cert")));
+    if (cert == Qnil)
+      cert = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("tls_cert")));
+    VALUE key = rb_hash_aref(opt, ID2SYM(rb_intern("tls_key")));
+    if (key == Qnil)
+      key = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("tls_key")));
+    VALUE password = rb_hash_aref(opt, ID2SYM(rb_intern("tls_password")));
+    if (password == Qnil)
+      password =
+          rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("tls_password")));
+    if (cert != Qnil && cert != Qfalse) {
+      Check_Type(cert, T_STRING);
+      if (key == Qnil || key == Qfalse)
+        key = cert; /* a single PEM file (the key and the certificate) */
+      Check_Type(key, T_STRING);
+      if (password != Qnil && password != Qfalse)
+        Check_Type(password, T_STRING);
+      else
+        password = 0;
+      tls = fio_tls_new(StringValueCStr(cert), StringValueCStr(key),
+                        (password ? StringValueCStr(password) : NULL));
+      if (!tls) {
+        fprintf(stderr, "ERROR: Failed to initialize TLS (%s) for the HTTP "
+                        "service.\n",
+                StringValueCStr(cert));
+        return Qfalse;
+      }
+    }
+  }
+
   if ((www != Qnil && www != Qfalse)) {
     Check_Type(www, T_STRING);
     IodineStore.add(www);
+    env_template_thaw();
     rb_hash_aset(env_template_no_upgrade, XSENDFILE_TYPE, XSENDFILE);
     rb_hash_aset(env_template_no_upgrade, XSENDFILE_TYPE_HEADER, XSENDFILE);
     support_xsendfile = 1;
@@ -977,18 +2481,109 @@ VALUE iodine_http_listen(VALUE self, VALUE opt) {
     IodineStore.add(port);
   }
 
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("fiber")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("fiber")));
+  }
+  if (tmp != Qnil && tmp != Qfalse) {
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+    fiber = 1;
+    /* a streamed body is read by the worker thread, while a Fiber might park */
+    stream_body = 0;
+#else
+    fprintf(stderr, "Iodine Warning: the Fiber scheduler requires Ruby 3.0 or "
+                    "later (the `fiber` option is ignored).\n");
+#endif
+  }
+
+  tmp = rb_hash_aref(opt, ID2SYM(rb_intern("ractor")));
+  if (tmp == Qnil) {
+    tmp = rb_hash_aref(iodine_default_args, ID2SYM(rb_intern("ractor")));
+  }
+  if (tmp != Qnil && tmp != Qfalse) {
+    if (iodine_defer_use_ractors()) {
+      fprintf(stderr, "Iodine Warning: Ractors require Ruby 3.0 or later "
+                      "(the `ractor` option is ignored).\n");
+    } else {
+      shareable = 1;
+    }
+    if (shareable && app != Qnil && app != Qfalse) {
+      /* raises if the application can't be shared between Ractors */
+      app = rb_funcall(rb_const_get(rb_cObject, rb_intern("Ractor")),
+                       rb_intern("make_shareable"), 1, app);
+    }
+  }
+
   if ((app != Qnil && app != Qfalse))
     IodineStore.add(app);
   else
     app = 0;
 
+  if (upgrade == Qnil || upgrade == Qfalse) {
+    upgrade = 0;
+  } else {
+    Check_Type(upgrade, T_HASH);
+    /* paths are compared to the (binary) request path */
+    VALUE paths = rb_hash_new();
+    VALUE keys = rb_funcall(upgrade, rb_intern("keys"), 0);
+    for (long i = 0; i < RARRAY_LEN(keys); ++i) {
+      VALUE key = rb_ary_entry(keys, i);
+      VALUE path = rb_obj_as_string(key);
+      rb_hash_aset(paths,
+                   rb_enc_str_new(RSTRING_PTR(path), RSTRING_LEN(path),
+                                  IodineBinaryEncoding),
+                   rb_hash_aref(upgrade, key));
+    }
+    upgrade = IodineStore.add(rb_obj_freeze(paths));
+  }
+
+  iodine_http_routes_s *native_routes = NULL;
+  if (routes != Qnil && routes != Qfalse) {
+    iodine_routes_new_args_s args = {.routes = routes, .shareable = shareable};
+    int state = 0;
+    rb_protect(iodine_routes_new_protected, (VALUE)&args, &state);
+    if (state) {
+      /* invalid routes, release what was stored before raising */
+      if (app)
+        IodineStore.remove(app);
+      if (upgrade)
+        IodineStore.remove(upgrade);
+      if (www)
+        IodineStore.remove(www);
+      if (port)
+        IodineStore.remove(port);
+      fiobj_free(vary);
+      fio_tls_free(tls);
+      rb_jump_tag(state);
+    }
+    native_routes = args.result;
+  }
+
+  iodine_http_settings_s *settings = NULL;
+  if (app || upgrade || native_routes) {
+    settings = malloc(sizeof(*settings));
+    *settings = (iodine_http_settings_s){
+        .app = app, .cache = cache, .vary = vary, .fiber = fiber,
+        .upgrade = upgrade, .routes = native_routes,
+    };
+  } else {
+    fiobj_free(vary);
+  }
+
   if (http_listen(
           StringValueCStr(port), (address ? StringValueCStr(address) : NULL),
           .on_request = on_rack_request, .on_upgrade = on_rack_upgrade,
-          .udata = (void *)app, .timeout = (tout ? FIX2INT(tout) : tout),
+          .on_pipeline = on_rack_pipeline,
+          .udata = settings, .timeout = (tout ? FIX2INT(tout) : tout),
           .ws_timeout = ping, .ws_max_msg_size = max_msg,
+          .ws_deflate = ws_deflate,
           .max_header_size = max_headers, .on_finish = free_iodine_http,
           .log = log_http, .max_body_size = max_body,
+          .stream_body = stream_body,
+          .reuse_port = reuse_port, .reuse_port_cpu = reuse_port_cpu,
+          .defer_accept = defer_accept, .fastopen = fastopen,
+          .balance = balance, .compress = compress,
+          .tls = tls,
           .public_folder = (www ? StringValueCStr(www) : NULL))) {
     fprintf(stderr,
             "ERROR: Failed to initialize a listening HTTP socket for port %s\n",
@@ -996,7 +2591,7 @@ VALUE iodine_http_listen(VALUE self, VALUE opt) {
     return Qfalse;
   }
 
-  if ((app == Qnil || app == Qfalse)) {
+  if (!app && !upgrade && !native_routes) {
     fprintf(stderr,
             "* Iodine: (no app) the HTTP service on port %s will only serve "
             "static files.\n",
@@ -1008,6 +2603,28 @@ VALUE iodine_http_listen(VALUE self, VALUE opt) {
   (void)self;
 }
 
+/* replaces frozen templates (listening after the templates were frozen) */
+static void env_template_thaw(void) {
+  VALUE *templates[] = {&env_template_no_upgrade, &env_template_websockets,
+                        &env_template_sse};
+  for (size_t i = 0; i < sizeof(templates) / sizeof(templates[0]); ++i) {
+    VALUE old = *templates[i];
+    if (!OBJ_FROZEN(old))
+      continue;
+    *templates[i] = IodineStore.add(rb_hash_dup(old));
+    IodineStore.remove(old);
+  }
+}
+
+/* frozen templates are never modified (by mistake) once workers share them */
+void iodine_http_before_fork(void) {
+  if (!env_template_no_upgrade)
+    return;
+  rb_obj_freeze(env_template_no_upgrade);
+  rb_obj_freeze(env_template_websockets);
+  rb_obj_freeze(env_template_sse);
+}
+
 static void initialize_env_template(void) {
   if (env_template_no_upgrade)
     return;
@@ -1084,6 +2701,15 @@ Initialization
 void iodine_init_http(void) {
 
   rb_define_module_function(IodineModule, "listen2http", iodine_http_listen, 1);
+  rb_define_module_function(IodineModule, "clear_http_cache",
+                            iodine_http_cache_clear, 0);
+  {
+    VALUE tmp = rb_define_module_under(IodineModule, "HTTP");
+    rb_define_module_function(tmp, "request", iodine_http_request, -1);
+  }
+
+  IODINE_CACHE_AGE = fiobj_str_new("age", 3);
+  IODINE_CACHE_AUTHORIZATION = fiobj_str_new("authorization", 13);
 
   /** Used by {listen2http} to set missing arguments. */
   iodine_default_args = rb_hash_new();
@@ -1126,9 +2752,11 @@ void iodine_init_http(void) {
   hijack_func_sym = ID2SYM(rb_intern("_hijack"));
   close_method_id = rb_intern("close");
   each_method_id = rb_intern("each");
+  iodine_stream_tag = ID2SYM(rb_intern("iodine_stream"));
   attach_method_id = rb_intern("attach_fd");
   iodine_to_s_method_id = rb_intern("to_s");
   iodine_call_proc_id = rb_intern("call");
+  iodine_lazy_headers_id = rb_intern("__iodine_lazy_headers");
 
   IodineUTF8Encoding = rb_enc_find("UTF-8");
   IodineBinaryEncoding = rb_enc_find("binary");
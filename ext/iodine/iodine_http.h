@@ -14,5 +14,7 @@ extern VALUE IODINE_R_HIJACK_IO;
 extern VALUE IODINE_R_HIJACK_CB;
 
 void iodine_init_http(void);
+/** Freezes the `env` templates (before forking, see `Iodine.warmup`). */
+void iodine_http_before_fork(void);
 
 #endif
@@ -7,6 +7,12 @@
 #include "iodine_fiobj2rb.h"
 #include "iodine_store.h"
 
+#include "ruby/encoding.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
 static VALUE max_nesting;
 static VALUE allow_nan;
 static VALUE symbolize_names;
@@ -153,6 +159,391 @@ static void fio_json_on_error(json_parser_s *p) {
   *pr = (iodine_json_parser_s){.top = 0};
 }
 
+/* *****************************************************************************
+Lazy JSON documents (Iodine::JSON::Document)
+***************************************************************************** */
+
+static VALUE iodine_json_doc_class;
+
+static void iodine_json_doc_free(void *doc) { fiobj_free((FIOBJ)doc); }
+
+static size_t iodine_json_doc_size(const void *doc) {
+  if (!doc)
+    return sizeof(FIOBJ);
+  return sizeof(FIOBJ) + fiobj_obj2cstr((FIOBJ)doc).len;
+}
+
+static const rb_data_type_t iodine_json_doc_type = {
+    .wrap_struct_name = "IodineJSONDocument",
+    .function =
+        {
+            .dfree = iodine_json_doc_free,
+            .dsize = iodine_json_doc_size,
+        },
+    .data = NULL,
+};
+
+static VALUE iodine_json_doc_alloc(VALUE klass) {
+  return TypedData_Wrap_Struct(klass, &iodine_json_doc_type, NULL);
+}
+
+static inline FIOBJ iodine_json_doc_get(VALUE self) {
+  FIOBJ doc = (FIOBJ)RTYPEDDATA_DATA(self);
+  if (!doc)
+    rb_raise(rb_eRuntimeError, "uninitialized JSON document.");
+  return doc;
+}
+
+/** Decodes a node (and it's nested nodes) into Ruby objects. */
+static VALUE iodine_json_doc2rb(FIOBJ doc, size_t node) {
+  switch (fiobj_json_doc_type(doc, node)) {
+  case FIOBJ_T_NUMBER:
+    return LONG2NUM(fiobj_json_doc_i(doc, node));
+  case FIOBJ_T_FLOAT:
+    return DBL2NUM(fiobj_json_doc_f(doc, node));
+  case FIOBJ_T_TRUE:
+    return Qtrue;
+  case FIOBJ_T_FALSE:
+    return Qfalse;
+  case FIOBJ_T_STRING: {
+    fio_cstr_s raw = fiobj_json_doc_raw(doc, node);
+    /* Ruby overhead for a rb_str_buf_new is very high. Double copy is faster. */
+    char *tmp = fio_malloc(raw.len + 1);
+    VALUE str = rb_str_new(tmp, fio_json_unescape_str(tmp, raw.data, raw.len));
+    fio_free(tmp);
+    return str;
+  }
+  case FIOBJ_T_ARRAY: {
+    size_t count = fiobj_json_doc_count(doc, node);
+    VALUE ary = rb_ary_new_capa(count);
+    for (size_t i = node + 1; count; --count) {
+      rb_ary_push(ary, iodine_json_doc2rb(doc, i));
+      i = fiobj_json_doc_next(doc, i);
+    }
+    return ary;
+  }
+  case FIOBJ_T_HASH: {
+    size_t count = fiobj_json_doc_count(doc, node);
+    VALUE hash = rb_hash_new();
+    for (size_t i = node + 1; count; --count) {
+      VALUE key = iodine_json_doc2rb(doc, i);
+      i = fiobj_json_doc_next(doc, i);
+      rb_hash_aset(hash, key, iodine_json_doc2rb(doc, i));
+      i = fiobj_json_doc_next(doc, i);
+    }
+    return hash;
+  }
+  default:
+    return Qnil;
+  }
+}
+
+/**
+Indexes the JSON String without decoding any of it's values.
+
+Values are decoded only when accessed (using {dig} or `[]`), so reading a few
+values from a large JSON payload doesn't allocate the whole object tree.
+
+Raises an EncodingError if the JSON is malformed.
+*/
+static VALUE iodine_json_doc_initialize(VALUE self, VALUE str) {
+  Check_Type(str, T_STRING);
+  FIOBJ doc = fiobj_json_doc_new(RSTRING_PTR(str), RSTRING_LEN(str));
+  if (!doc)
+    rb_raise(rb_eEncodingError, "Malformed JSON format.");
+  fiobj_free((FIOBJ)RTYPEDDATA_DATA(self));
+  RTYPEDDATA_DATA(self) = (void *)doc;
+  return self;
+}
+
+/**
+Returns the value at the requested path, or `nil` if the path doesn't exist.
+
+String or Symbol path segments select Hash members and Integer path segments
+select Array members (negative values count from the end of the Array).
+Without any arguments, the whole document is decoded.
+
+      doc = Iodine::JSON::Document.new('{"a":[{"b":1}]}')
+      doc.dig("a", 0, "b") # => 1
+      doc.dig(:a, -1)      # => {"b"=>1}
+*/
+static VALUE iodine_json_doc_dig(int argc, VALUE *argv, VALUE self) {
+  FIOBJ doc = iodine_json_doc_get(self);
+  size_t node = FIOBJ_JSON_DOC_ROOT;
+  for (int i = 0; i < argc; ++i) {
+    VALUE key = argv[i];
+    switch (TYPE(key)) {
+    case T_SYMBOL:
+      key = rb_sym2str(key);
+    /* fallthrough */
+    case T_STRING:
+      node = fiobj_json_doc_key(doc, node, RSTRING_PTR(key), RSTRING_LEN(key));
+      break;
+    case T_FIXNUM:
+      node = fiobj_json_doc_index(doc, node, FIX2LONG(key));
+      break;
+    default:
+      rb_raise(rb_eTypeError, "JSON path must be a String, Symbol or Integer.");
+    }
+    if (node == FIOBJ_JSON_DOC_INVALID)
+      return Qnil;
+  }
+  return iodine_json_doc2rb(doc, node);
+}
+
+/** Returns the value of a single member, see {dig}. */
+static VALUE iodine_json_doc_aref(VALUE self, VALUE key) {
+  return iodine_json_doc_dig(1, &key, self);
+}
+
+/** Returns the raw JSON String. */
+static VALUE iodine_json_doc_to_s(VALUE self) {
+  fio_cstr_s raw = fiobj_obj2cstr(iodine_json_doc_get(self));
+  VALUE str = rb_str_new(raw.data, raw.len);
+  rb_enc_associate(str, rb_utf8_encoding());
+  return str;
+}
+
+/* *****************************************************************************
+JSON Generation (Ruby objects are written directly, no FIOBJ round-trip)
+***************************************************************************** */
+
+#ifndef IODINE_JSON_MAX_NESTING
+/** The maximum nesting depth allowed when generating JSON. */
+#define IODINE_JSON_MAX_NESTING 512
+#endif
+
+typedef struct {
+  VALUE dest;
+  char *buf;
+  size_t len;
+  size_t capa;
+  size_t depth;
+} iodine_json_writer_s;
+
+/** Makes sure there's room for at least `len` more bytes. */
+static inline void iodine_json_require(iodine_json_writer_s *w, size_t len) {
+  if (w->len + len <= w->capa)
+    return;
+  rb_str_set_len(w->dest, w->len);
+  rb_str_modify_expand(w->dest, len + (w->capa >> 1));
+  w->buf = RSTRING_PTR(w->dest);
+  w->capa = rb_str_capacity(w->dest);
+}
+
+static inline void iodine_json_write(iodine_json_writer_s *w, const char *data,
+                                     size_t len) {
+  iodine_json_require(w, len);
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+}
+
+/** Writes a JSON escaped version of the String (or Symbol name). */
+static void iodine_json_write_str(iodine_json_writer_s *w, const char *src,
+                                  size_t len) {
+  /* worst case: every byte becomes `\u00XX` */
+  iodine_json_require(w, (len * 6) + 2);
+  char *restrict writer = w->buf;
+  size_t end = w->len;
+  writer[end++] = '"';
+  while (len) {
+#if FIO_JSON_SSE2
+    /* copy 16 bytes at a time, until a byte must be escaped */
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(31);
+    while (len >= 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)src);
+      __m128i hit = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash)),
+          _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+      int mask = _mm_movemask_epi8(hit);
+      if (mask) {
+        size_t offset = __builtin_ctz(mask);
+        memcpy(writer + end, src, offset);
+        end += offset;
+        src += offset;
+        len -= offset;
+        goto escape;
+      }
+      _mm_storeu_si128((__m128i *)(writer + end), v);
+      end += 16;
+      src += 16;
+      len -= 16;
+    }
+#endif
+    while (len && (uint8_t)src[0] >= 32 && src[0] != '"' && src[0] != '\\') {
+      writer[end++] = *(src++);
+      --len;
+    }
+    if (!len)
+      break;
+#if FIO_JSON_SSE2
+  escape:
+#endif
+    writer[end++] = '\\';
+    switch (src[0]) {
+    case '\b':
+      writer[end++] = 'b';
+      break;
+    case '\f':
+      writer[end++] = 'f';
+      break;
+    case '\n':
+      writer[end++] = 'n';
+      break;
+    case '\r':
+      writer[end++] = 'r';
+      break;
+    case '\t':
+      writer[end++] = 't';
+      break;
+    case '"':
+    case '\\':
+      writer[end++] = src[0];
+      break;
+    default:
+      /* MUST escape all control values less than 32 */
+      writer[end++] = 'u';
+      writer[end++] = '0';
+      writer[end++] = '0';
+      writer[end++] = hex_chars[((uint8_t)src[0]) >> 4];
+      writer[end++] = hex_chars[src[0] & 15];
+      break;
+    }
+    ++src;
+    --len;
+  }
+  writer[end++] = '"';
+  w->len = end;
+}
+
+/** Writes the shortest representation that reads back as the same double. */
+static void iodine_json_write_float(iodine_json_writer_s *w, double f) {
+  if (isnan(f)) {
+    iodine_json_write(w, "NaN", 3);
+    return;
+  }
+  if (isinf(f)) {
+    if (f > 0)
+      iodine_json_write(w, "Infinity", 8);
+    else
+      iodine_json_write(w, "-Infinity", 9);
+    return;
+  }
+  iodine_json_require(w, 32);
+  char *dest = w->buf + w->len;
+  /* `fio_ftoa` keeps only 6 significant digits, which isn't round-trip safe */
+  int written = 0;
+  for (int precision = 15; precision <= 17; ++precision) {
+    written = snprintf(dest, 32, "%.*g", precision, f);
+    if (strtod(dest, NULL) == f)
+      break;
+  }
+  uint8_t need_zero = 1;
+  for (int i = 0; i < written; ++i) {
+    if (dest[i] == ',') // locale issues?
+      dest[i] = '.';
+    if (dest[i] == '.' || dest[i] == 'e')
+      need_zero = 0;
+  }
+  if (need_zero) {
+    dest[written++] = '.';
+    dest[written++] = '0';
+  }
+  w->len += written;
+}
+
+static void iodine_json_write_obj(iodine_json_writer_s *w, VALUE o);
+
+static int iodine_json_write_pair(VALUE key, VALUE value, VALUE w_) {
+  iodine_json_writer_s *w = (iodine_json_writer_s *)w_;
+  if (w->buf[w->len - 1] != '{')
+    iodine_json_write(w, ",", 1);
+  switch (TYPE(key)) {
+  case T_STRING:
+    iodine_json_write_str(w, RSTRING_PTR(key), RSTRING_LEN(key));
+    break;
+  case T_SYMBOL:
+    key = rb_sym2str(key);
+    iodine_json_write_str(w, RSTRING_PTR(key), RSTRING_LEN(key));
+    break;
+  default:
+    key = rb_obj_as_string(key);
+    iodine_json_write_str(w, RSTRING_PTR(key), RSTRING_LEN(key));
+    break;
+  }
+  iodine_json_write(w, ":", 1);
+  iodine_json_write_obj(w, value);
+  return ST_CONTINUE;
+}
+
+static void iodine_json_write_obj(iodine_json_writer_s *w, VALUE o) {
+  switch (TYPE(o)) {
+  case T_NIL:
+    iodine_json_write(w, "null", 4);
+    break;
+  case T_TRUE:
+    iodine_json_write(w, "true", 4);
+    break;
+  case T_FALSE:
+    iodine_json_write(w, "false", 5);
+    break;
+  case T_FIXNUM:
+    iodine_json_require(w, 22); /* includes the NUL written by `fio_ltoa` */
+    w->len += fio_ltoa(w->buf + w->len, FIX2LONG(o), 10);
+    break;
+  case T_FLOAT:
+    iodine_json_write_float(w, RFLOAT_VALUE(o));
+    break;
+  case T_BIGNUM:
+    o = rb_big2str(o, 10);
+    iodine_json_write(w, RSTRING_PTR(o), RSTRING_LEN(o));
+    break;
+  case T_STRING:
+    iodine_json_write_str(w, RSTRING_PTR(o), RSTRING_LEN(o));
+    break;
+  case T_SYMBOL:
+    o = rb_sym2str(o);
+    iodine_json_write_str(w, RSTRING_PTR(o), RSTRING_LEN(o));
+    break;
+  case T_ARRAY:
+    if (++w->depth > IODINE_JSON_MAX_NESTING)
+      rb_raise(rb_eArgError, "JSON nesting too deep (circular reference?).");
+    iodine_json_write(w, "[", 1);
+    for (long i = 0; i < RARRAY_LEN(o); ++i) {
+      if (i)
+        iodine_json_write(w, ",", 1);
+      iodine_json_write_obj(w, RARRAY_AREF(o, i));
+    }
+    iodine_json_write(w, "]", 1);
+    --w->depth;
+    break;
+  case T_HASH:
+    if (++w->depth > IODINE_JSON_MAX_NESTING)
+      rb_raise(rb_eArgError, "JSON nesting too deep (circular reference?).");
+    iodine_json_write(w, "{", 1);
+    rb_hash_foreach(o, iodine_json_write_pair, (VALUE)w);
+    iodine_json_write(w, "}", 1);
+    --w->depth;
+    break;
+  case T_DATA:
+    if (rb_typeddata_is_kind_of(o, &iodine_json_doc_type) &&
+        RTYPEDDATA_DATA(o)) {
+      /* lazy documents are embedded as is */
+      fio_cstr_s raw = fiobj_obj2cstr((FIOBJ)RTYPEDDATA_DATA(o));
+      iodine_json_write(w, raw.data, raw.len);
+      break;
+    }
+  /* fallthrough */
+  default:
+    /* anything else is written as its String representation */
+    o = rb_obj_as_string(o);
+    iodine_json_write_str(w, RSTRING_PTR(o), RSTRING_LEN(o));
+    break;
+  }
+}
+
 /* *****************************************************************************
 Iodine JSON Implementation
 ***************************************************************************** */
@@ -253,6 +644,26 @@ static VALUE iodine_json_parse_bang(int argc, VALUE *argv, VALUE self) {
   (void)self;
 }
 
+/**
+Formats a Ruby object (Hash, Array, String, Symbol, Numeric, `true`, `false`
+or `nil`) as a JSON String.
+
+Objects are written directly into the new String, without any intermediate
+representation. Any other object is written as its `to_s` String.
+
+NaN and Infinity are written as-is (they're accepted by {Iodine::JSON.parse}).
+*/
+static VALUE iodine_json_stringify(VALUE self, VALUE obj) {
+  iodine_json_writer_s w = {.dest = rb_str_buf_new(1024)};
+  w.buf = RSTRING_PTR(w.dest);
+  w.capa = rb_str_capacity(w.dest);
+  iodine_json_write_obj(&w, obj);
+  rb_str_set_len(w.dest, w.len);
+  rb_enc_associate(w.dest, rb_utf8_encoding());
+  return w.dest;
+  (void)self;
+}
+
 void iodine_init_json(void) {
   /**
   Iodine::JSON offers a fast(er) JSON parser that is also lenient and supports
@@ -301,4 +712,23 @@ void iodine_init_json(void) {
   array_class = ID2SYM(rb_intern("array_class"));
   rb_define_module_function(tmp, "parse", iodine_json_parse, -1);
   rb_define_module_function(tmp, "parse!", iodine_json_parse_bang, -1);
+  rb_define_module_function(tmp, "stringify", iodine_json_stringify, 1);
+  rb_define_module_function(tmp, "dump", iodine_json_stringify, 1);
+
+  /**
+  Iodine::JSON::Document is a lazy JSON document. The JSON String is indexed
+  once, but values are only decoded when accessed:
+
+      doc = Iodine::JSON::Document.new(payload)
+      doc.dig("repository", "owner", "login")
+      doc["action"]
+
+  */
+  iodine_json_doc_class = rb_define_class_under(tmp, "Document", rb_cObject);
+  rb_define_alloc_func(iodine_json_doc_class, iodine_json_doc_alloc);
+  rb_define_method(iodine_json_doc_class, "initialize",
+                   iodine_json_doc_initialize, 1);
+  rb_define_method(iodine_json_doc_class, "dig", iodine_json_doc_dig, -1);
+  rb_define_method(iodine_json_doc_class, "[]", iodine_json_doc_aref, 1);
+  rb_define_method(iodine_json_doc_class, "to_s", iodine_json_doc_to_s, 0);
 }
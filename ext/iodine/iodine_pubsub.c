@@ -24,6 +24,8 @@ static ID publish_id;
 static ID default_id;
 static ID redis_id;
 static ID call_id;
+static ID limit_id;
+static ID age_id;
 
 /**
 The {Iodine::PubSub::Engine} class is the parent for all engines to inherit
@@ -371,6 +373,60 @@ static VALUE iodine_pubsub_reset(VALUE self, VALUE engine) {
   (void)self;
 }
 
+/**
+Keeps the latest messages published to a channel, so reconnecting clients can
+catch up without a round trip to a database or Redis (see the `:since` option
+of {Iodine::Connection#subscribe}).
+
+    Iodine::PubSub.history("chat", limit: 256, age: 60)
+
+The options hash accepts:
+
+:limit:: the number of messages kept. `0` (the default) discards the history.
+:age:: the maximum message age, in seconds. Default: 0 (no age limit).
+
+Messages are numbered (starting at 1) in the order they were published. The
+history is kept by each process, so it should be set before {Iodine.start} for
+all the worker processes to keep it (the sequence numbers aren't shared between
+workers). Pattern subscriptions don't affect the history.
+
+Returns `true`.
+*/
+static VALUE iodine_pubsub_history(int argc, VALUE *argv, VALUE self) {
+  if (argc < 1 || argc > 2) {
+    rb_raise(rb_eArgError, "Iodine::PubSub.history(channel, opt={}) requires "
+                           "1 or 2 arguments.");
+  }
+  VALUE channel = argv[0];
+  size_t limit = 0;
+  size_t age = 0;
+  if (TYPE(channel) == T_SYMBOL)
+    channel = rb_sym2str(channel);
+  Check_Type(channel, T_STRING);
+  if (argc == 2) {
+    Check_Type(argv[1], T_HASH);
+    VALUE tmp = rb_hash_aref(argv[1], ID2SYM(limit_id));
+    if (tmp != Qnil) {
+      Check_Type(tmp, T_FIXNUM);
+      if (FIX2LONG(tmp) < 0)
+        rb_raise(rb_eRangeError, "limit can't be a negative number.");
+      limit = FIX2ULONG(tmp);
+    }
+    tmp = rb_hash_aref(argv[1], ID2SYM(age_id));
+    if (tmp != Qnil) {
+      Check_Type(tmp, T_FIXNUM);
+      if (FIX2LONG(tmp) < 0)
+        rb_raise(rb_eRangeError, "age can't be a negative number.");
+      age = FIX2ULONG(tmp) * 1000;
+    }
+  }
+  FIOBJ ch = fiobj_str_new(RSTRING_PTR(channel), RSTRING_LEN(channel));
+  pubsub_history(ch, limit, age);
+  fiobj_free(ch);
+  return Qtrue;
+  (void)self;
+}
+
 /* *****************************************************************************
 Redis Engine
 ***************************************************************************** */
@@ -650,6 +706,8 @@ void iodine_pubsub_init(void) {
   default_id = rb_intern2("default_engine", 14);
   redis_id = rb_intern2("redis", 5);
   call_id = rb_intern2("call", 4);
+  limit_id = rb_intern2("limit", 5);
+  age_id = rb_intern2("age", 3);
 
   /* Define the PubSub module and it's methods */
 
@@ -662,6 +720,8 @@ void iodine_pubsub_init(void) {
   rb_define_module_function(PubSubModule, "dettach", iodine_pubsub_detach, 1);
   rb_define_module_function(PubSubModule, "detach", iodine_pubsub_detach, 1);
   rb_define_module_function(PubSubModule, "reset", iodine_pubsub_reset, 1);
+  rb_define_module_function(PubSubModule, "history", iodine_pubsub_history,
+                            -1);
 
   /* Define the Engine class and it's methods */
 
@@ -8,8 +8,12 @@ Feel free to copy, use and enjoy according to the license provided.
 
 #include "iodine.h"
 
+#include "defer.h"
+
 #include <ruby/encoding.h>
 #include <ruby/io.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef _GNU_SOURCE
@@ -44,6 +48,9 @@ rewindable object if the underlying input stream is not rewindable.
 
 close must never be called on the input stream.
 
+Streamed bodies (see the `stream_body` listening option) are received while the
+data is read, so `rewind` is only meaningful before the body was read.
+
 */
 
 /* *****************************************************************************
@@ -88,6 +95,48 @@ static VALUE rio_rewind(VALUE self) {
   fiobj_data_seek(io, 0);
   return INT2NUM(0);
 }
+typedef struct {
+  intptr_t uuid;
+  time_t timeout;
+} rio_wait_s;
+
+/* waits (without the GVL) for a streamed body's socket to become readable. */
+static void *rio_wait(void *args_) {
+  rio_wait_s *args = args_;
+  struct pollfd pfd = {.fd = sock_uuid2fd(args->uuid), .events = POLLIN};
+  while (sock_isvalid(args->uuid) && time(NULL) < args->timeout) {
+    /* nested calls (another request waiting) perform nothing. Tasks might be
+     * rescheduled indefinitely (e.g., this connection's events), so the socket
+     * is polled either way. */
+    int busy = defer_perform_batch(16);
+    if (poll(&pfd, 1, busy ? 0 : 10) > 0)
+      return (void *)1;
+  }
+  return NULL;
+}
+
+/* receives more of a streamed body (see `http_body_fetch`). 0 == EOF. */
+static int rio_fetch(VALUE self) {
+  http_s *h = get_handle(self);
+  if (!h)
+    return 0;
+  for (;;) {
+    int ret = http_body_fetch(h);
+    if (ret >= 0)
+      return ret;
+    if (errno != EAGAIN)
+      break;
+    rio_wait_s args = {
+        .uuid = http2uuid(h),
+        .timeout = time(NULL) + http_settings(h)->timeout,
+    };
+    if (!IodineCaller.leaveGVL(rio_wait, &args))
+      break;
+  }
+  rb_raise(rb_eIOError, "the request body is incomplete (connection lost?)");
+  return 0;
+}
+
 /**
 Gets returns a line. this is okay for small lines,
 but shouldn't really be used.
@@ -98,14 +147,21 @@ static VALUE rio_gets(VALUE self) {
   FIOBJ io = get_data(self);
   if (!FIOBJ_TYPE_IS(io, FIOBJ_T_DATA))
     return Qnil;
-  fio_cstr_s line = fiobj_data_gets(io);
-  if (line.len) {
-    VALUE buffer = rb_str_new(line.data, line.len);
-    // make sure the buffer is binary encoded.
-    rb_enc_associate(buffer, IodineBinaryEncoding);
-    return buffer;
-  }
-  return Qnil;
+  VALUE buffer = Qnil;
+  do {
+    fio_cstr_s line = fiobj_data_gets(io);
+    if (!line.len)
+      continue;
+    if (buffer == Qnil) {
+      // make sure the buffer is binary encoded.
+      buffer = rb_enc_str_new(line.data, line.len, IodineBinaryEncoding);
+    } else {
+      rb_str_cat(buffer, line.data, line.len);
+    }
+    if (line.data[line.len - 1] == '\n')
+      break;
+  } while (rio_fetch(self));
+  return buffer;
 }
 
 // Reads data from the IO, according to the Rack specifications for `#read`.
@@ -132,27 +188,33 @@ static VALUE rio_read(int argc, VALUE *argv, VALUE self) {
       return rb_str_buf_new(0);
     ret_nil = 1;
   }
-  // return if we're at the EOF.
-  fio_cstr_s buf = fiobj_data_read(io, len);
-  if (buf.len) {
-    // create the buffer if we don't have one.
-    if (buffer == Qnil) {
-      // make sure the buffer is binary encoded.
-      buffer = rb_enc_str_new(buf.data, buf.len, IodineBinaryEncoding);
-    } else {
-      // make sure the buffer is binary encoded.
-      rb_enc_associate(buffer, IodineBinaryEncoding);
-      if (rb_str_capacity(buffer) < (size_t)buf.len)
-        rb_str_resize(buffer, buf.len);
-      memcpy(RSTRING_PTR(buffer), buf.data, buf.len);
-      rb_str_set_len(buffer, buf.len);
-    }
-    return buffer;
+  // read directly into the Ruby String (no intermediate buffer).
+  if (buffer == Qnil) {
+    buffer = rb_str_buf_new(0);
+  } else {
+    rb_str_modify(buffer);
+    rb_str_set_len(buffer, 0);
   }
-  if (ret_nil)
+  // make sure the buffer is binary encoded.
+  rb_enc_associate(buffer, IodineBinaryEncoding);
+  ssize_t total = 0;
+  do {
+    ssize_t available = fiobj_data_len(io) - fiobj_data_pos(io);
+    if (len && available > len - total)
+      available = len - total;
+    if (available <= 0)
+      continue;
+    if (rb_str_capacity(buffer) < (size_t)(total + available))
+      rb_str_modify_expand(buffer, (total > available ? total : available));
+    available =
+        fiobj_data_read2buf(io, RSTRING_PTR(buffer) + total, available);
+    if (available > 0)
+      total += available;
+    rb_str_set_len(buffer, total);
+  } while ((!len || total < len) && rio_fetch(self));
+  if (!total && ret_nil)
     return Qnil;
-  else
-    return rb_str_buf_new(0);
+  return buffer;
 }
 
 // Does nothing - this is controlled by the server.
@@ -229,6 +291,13 @@ static void close_rack_io(VALUE rack_io) {
   set_handle(rack_io, NULL); /* this disables hijacking. */
 }
 
+static int detach_rack_io(VALUE rack_io) {
+  if (!get_handle(rack_io))
+    return -1;
+  set_handle(rack_io, NULL);
+  return 0;
+}
+
 // initialize library
 static void init_rack_io(void) {
   IodineUTF8Encoding = rb_enc_find("UTF-8");
@@ -247,18 +316,26 @@ static void init_rack_io(void) {
   IodineStore.add(R_INPUT);
 
   TCPSOCKET_CLASS = rb_const_get(rb_cObject, rb_intern("TCPSocket"));
-  // IO methods
-
+  // IO methods (Ractor safe, the IO is only accessed by the request's thread)
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe(true);
+#endif
   rb_define_method(rRackIO, "rewind", rio_rewind, 0);
   rb_define_method(rRackIO, "gets", rio_gets, 0);
   rb_define_method(rRackIO, "read", rio_read, -1);
   rb_define_method(rRackIO, "close", rio_close, 0);
   rb_define_method(rRackIO, "each", rio_each, 0);
   rb_define_method(rRackIO, "_hijack", rio_get_io, -1);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe(false);
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////////////
 // the API interface
 struct IodineRackIO IodineRackIO = {
-    .create = new_rack_io, .close = close_rack_io, .init = init_rack_io,
+    .create = new_rack_io,
+    .close = close_rack_io,
+    .detach = detach_rack_io,
+    .init = init_rack_io,
 };
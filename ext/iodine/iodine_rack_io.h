@@ -14,6 +14,11 @@ Feel free to copy, use and enjoy according to the license provided.
 extern struct IodineRackIO {
   VALUE (*create)(http_s *h, VALUE env);
   void (*close)(VALUE rack_io);
+  /**
+   * Disables hijacking while the body remains readable (the `http_s` handle
+   * becomes invalid). Returns -1 if the connection was already hijacked.
+   */
+  int (*detach)(VALUE rack_io);
   void (*init)(void);
 } IodineRackIO;
 
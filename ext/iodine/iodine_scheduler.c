@@ -0,0 +1,514 @@
+/*
+Copyright: Boaz segev, 2016-2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#include "iodine.h"
+
+#include "defer.h"
+#include "evio.h"
+#include "facil.h"
+#include "fio_mem.h"
+#include <spnlock.inc>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+/* *****************************************************************************
+Iodine::Scheduler - a Fiber scheduler using the facil.io reactor
+
+A non-blocking Fiber that waits for IO (or sleeps, or waits for a Mutex) is
+parked: the file descriptor is duplicated and attached to the reactor (or a
+timer is set) and the Fiber yields back to the worker thread. Once the event
+occurs, a task pinned to the same worker thread resumes the Fiber.
+***************************************************************************** */
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+
+#include <ruby/fiber/scheduler.h>
+#include <ruby/io.h>
+
+static VALUE IodineSchedulerClass;
+static VALUE iodine_fiber_class;
+/* `{blocking: false}` (`rb_fiber_new` creates blocking fibers) */
+static VALUE iodine_scheduler_nonblocking;
+/* yielded by parked fibers, so the worker thread knows the fiber parked */
+static VALUE iodine_scheduler_parked;
+/* fibers waiting for `unblock` (Fiber => waiter) */
+static VALUE iodine_scheduler_blocked;
+static ID fileno_id;
+static ID resume_id;
+static ID call_id;
+static ID new_id;
+
+static const char *IODINE_WAITER_SERVICE = "iodine fiber waiter";
+
+typedef struct {
+  /* watches a duplicated file descriptor (see `io_wait`) */
+  protocol_s protocol;
+  VALUE fiber;
+  VALUE thread;
+  /* the worker thread's `defer_pinned` key (-1 == blocking wait) */
+  intptr_t key;
+  intptr_t uuid;
+  size_t ref;
+  spn_lock_i done;
+  enum iodine_waiter_type_e {
+    IODINE_WAIT_IO,
+    IODINE_WAIT_SLEEP,
+    IODINE_WAIT_BLOCK,
+  } type;
+  /* the IO events waited for */
+  int events;
+  /* the ready IO events / 1 if unblocked (0 == timeout) */
+  int result;
+} iodine_waiter_s;
+
+/* used by `run`, for the request's Fiber */
+typedef struct {
+  VALUE (*func)(VALUE arg);
+  VALUE arg;
+  void (*on_done)(VALUE result, void *udata);
+  void *udata;
+  uint8_t parked;
+} iodine_fiber_task_s;
+
+/* *****************************************************************************
+Waiters
+***************************************************************************** */
+
+static void iodine_waiter_resume(void *w_, void *ignr);
+
+/* creates a waiter for the current Fiber (within the GVL). */
+static iodine_waiter_s *iodine_waiter_new(enum iodine_waiter_type_e type,
+                                          intptr_t key) {
+  iodine_waiter_s *w = fio_malloc(sizeof(*w));
+  *w = (iodine_waiter_s){
+      .fiber = rb_fiber_current(),
+      .thread = rb_thread_current(),
+      .key = key,
+      .uuid = -1,
+      .ref = 1,
+      .type = type,
+  };
+  IodineStore.add(w->fiber);
+  return w;
+}
+
+static void iodine_waiter_free(iodine_waiter_s *w) {
+  if (spn_sub(&w->ref, 1))
+    return;
+  fio_free(w);
+}
+
+/* wakes the Fiber (only the first call has any effect). Any thread. */
+static void iodine_waiter_wake(iodine_waiter_s *w, int result) {
+  if (spn_trylock(&w->done))
+    return;
+  w->result = result;
+  if (w->uuid != -1 && sock_isvalid(w->uuid)) {
+    /* the original fd is still open, so epoll won't forget the duplicate */
+    evio_remove(sock_uuid2fd(w->uuid));
+    sock_force_close(w->uuid);
+  }
+  if (w->key < 0)
+    return;
+  defer_pinned((size_t)w->key, iodine_waiter_resume, w, NULL);
+}
+
+static VALUE iodine_waiter_result(iodine_waiter_s *w) {
+  switch (w->type) {
+  case IODINE_WAIT_IO:
+    return (w->result ? INT2NUM(w->result) : Qfalse);
+  case IODINE_WAIT_BLOCK:
+    return (w->result ? Qtrue : Qfalse);
+  case IODINE_WAIT_SLEEP:
+    break;
+  }
+  return Qnil;
+}
+
+/* removes a blocked Fiber from the `unblock` registry (within the GVL). */
+static void iodine_waiter_unregister(iodine_waiter_s *w) {
+  if (w->type != IODINE_WAIT_BLOCK)
+    return;
+  VALUE tmp = rb_hash_lookup2(iodine_scheduler_blocked, w->fiber, Qnil);
+  if (tmp != Qnil && (iodine_waiter_s *)FIX2LONG(tmp) == w)
+    rb_hash_delete(iodine_scheduler_blocked, w->fiber);
+}
+
+static void *iodine_waiter_resume_in_GVL(void *w_) {
+  iodine_waiter_s *w = w_;
+  iodine_waiter_unregister(w);
+  /* fibers can't move between threads (only when the thread pool stops) */
+  if (rb_thread_current() == w->thread) {
+    VALUE result = iodine_waiter_result(w);
+    IodineCaller.call2(w->fiber, resume_id, 1, &result);
+  }
+  IodineStore.remove(w->fiber);
+  iodine_waiter_free(w);
+  return NULL;
+}
+
+static void iodine_waiter_resume(void *w_, void *ignr) {
+  IodineCaller.enterGVL(iodine_waiter_resume_in_GVL, w_);
+  (void)ignr;
+}
+
+static void *iodine_waiter_nap(void *ignr) {
+  struct timespec tm = {.tv_nsec = 1000000};
+  nanosleep(&tm, NULL);
+  return ignr;
+}
+
+/*
+ * parks the current Fiber until the waiter wakes it, returning the result.
+ *
+ * When this isn't a worker thread, the thread itself waits (for up to `naps`
+ * milliseconds).
+ */
+static VALUE iodine_waiter_park(iodine_waiter_s *w, size_t naps) {
+  if (w->key >= 0)
+    return rb_fiber_yield(1, &iodine_scheduler_parked);
+  while (!w->done) {
+    if (!naps--) {
+      iodine_waiter_wake(w, 0);
+      break;
+    }
+    IodineCaller.leaveGVL(iodine_waiter_nap, NULL);
+  }
+  iodine_waiter_unregister(w);
+  VALUE result = iodine_waiter_result(w);
+  IodineStore.remove(w->fiber);
+  iodine_waiter_free(w);
+  return result;
+}
+
+static void iodine_waiter_on_timer(void *w_) { iodine_waiter_wake(w_, 0); }
+static void iodine_waiter_on_timer_done(void *w_) { iodine_waiter_free(w_); }
+
+/* wakes the Fiber once `timeout` (seconds, `nil` == never) had passed. */
+static void iodine_waiter_timeout(iodine_waiter_s *w, VALUE timeout) {
+  if (timeout == Qnil)
+    return;
+  double ms = NUM2DBL(timeout) * 1000;
+  spn_add(&w->ref, 1);
+  facil_run_every((ms >= 1 ? (size_t)ms : 1), 1, iodine_waiter_on_timer, w,
+                  iodine_waiter_on_timer_done);
+}
+
+static void iodine_waiter_on_data(intptr_t uuid, protocol_s *pr) {
+  iodine_waiter_s *w = (iodine_waiter_s *)pr;
+  iodine_waiter_wake(w, w->events & (RUBY_IO_READABLE | RUBY_IO_PRIORITY));
+  (void)uuid;
+}
+
+static void iodine_waiter_on_ready(intptr_t uuid, protocol_s *pr) {
+  iodine_waiter_s *w = (iodine_waiter_s *)pr;
+  if (w->events & RUBY_IO_WRITABLE)
+    iodine_waiter_wake(w, RUBY_IO_WRITABLE);
+  (void)uuid;
+}
+
+static void iodine_waiter_ping(intptr_t uuid, protocol_s *pr) {
+  /* the Fiber sets it's own timeout */
+  facil_set_timeout(uuid, 0);
+  (void)pr;
+}
+
+static void iodine_waiter_on_close(intptr_t uuid, protocol_s *pr) {
+  iodine_waiter_s *w = (iodine_waiter_s *)pr;
+  /* closed by the server (shutdown), let the Fiber try the IO */
+  iodine_waiter_wake(w, w->events);
+  iodine_waiter_free(w);
+  (void)uuid;
+}
+
+/* *****************************************************************************
+Blocking fallbacks (not a worker thread)
+***************************************************************************** */
+
+typedef struct {
+  struct pollfd pfd;
+  int timeout;
+} iodine_poll_s;
+
+static void *iodine_scheduler_poll(void *args_) {
+  iodine_poll_s *args = args_;
+  int ret;
+  do {
+    ret = poll(&args->pfd, 1, args->timeout);
+  } while (ret == -1 && errno == EINTR);
+  return (void *)(intptr_t)ret;
+}
+
+static VALUE iodine_scheduler_io_wait_blocking(int fd, int events,
+                                               VALUE timeout) {
+  iodine_poll_s args = {
+      .pfd = {.fd = fd},
+      .timeout = (timeout == Qnil ? -1 : (int)(NUM2DBL(timeout) * 1000)),
+  };
+  if (events & (RUBY_IO_READABLE | RUBY_IO_PRIORITY))
+    args.pfd.events |= POLLIN;
+  if (events & RUBY_IO_WRITABLE)
+    args.pfd.events |= POLLOUT;
+  if (!IodineCaller.leaveGVL(iodine_scheduler_poll, &args))
+    return Qfalse;
+  int ready = 0;
+  if (args.pfd.revents & (POLLIN | POLLHUP | POLLERR))
+    ready |= events & (RUBY_IO_READABLE | RUBY_IO_PRIORITY);
+  if (args.pfd.revents & (POLLOUT | POLLHUP | POLLERR))
+    ready |= events & RUBY_IO_WRITABLE;
+  return INT2NUM(ready ? ready : events);
+}
+
+static void *iodine_scheduler_nanosleep(void *tm_) {
+  struct timespec *tm = tm_;
+  while (nanosleep(tm, tm) == -1 && errno == EINTR)
+    ;
+  return NULL;
+}
+
+/* *****************************************************************************
+Scheduler hooks (Ruby API)
+***************************************************************************** */
+
+/**
+Waits for the IO object to become readable / writable (see
+`Fiber::Scheduler#io_wait`).
+*/
+static VALUE iodine_scheduler_io_wait(VALUE self, VALUE io, VALUE events,
+                                      VALUE timeout) {
+  int fd = NUM2INT(rb_funcall2(io, fileno_id, 0, NULL));
+  int ev = NUM2INT(events);
+  intptr_t key = defer_pinned_self();
+  if (key < 0)
+    return iodine_scheduler_io_wait_blocking(fd, ev, timeout);
+  /* the duplicate is owned (and closed) by the reactor */
+  int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (dup_fd == -1)
+    return iodine_scheduler_io_wait_blocking(fd, ev, timeout);
+  intptr_t uuid = sock_open(dup_fd);
+  if (uuid == -1) {
+    close(dup_fd);
+    return iodine_scheduler_io_wait_blocking(fd, ev, timeout);
+  }
+  iodine_waiter_s *w = iodine_waiter_new(IODINE_WAIT_IO, key);
+  w->events = ev;
+  w->uuid = uuid;
+  w->protocol = (protocol_s){
+      .service = IODINE_WAITER_SERVICE,
+      .on_data = iodine_waiter_on_data,
+      .on_ready = iodine_waiter_on_ready,
+      .ping = iodine_waiter_ping,
+      .on_close = iodine_waiter_on_close,
+  };
+  /* `on_close` is always called, even if `facil_attach` fails */
+  spn_add(&w->ref, 1);
+  iodine_waiter_timeout(w, timeout);
+  facil_attach(uuid, &w->protocol);
+  return iodine_waiter_park(w, 0);
+  (void)self;
+}
+
+/**
+Sleeps for the duration (in seconds) or forever (see
+`Fiber::Scheduler#kernel_sleep`).
+*/
+static VALUE iodine_scheduler_kernel_sleep(int argc, VALUE *argv, VALUE self) {
+  VALUE duration = (argc ? argv[0] : Qnil);
+  intptr_t key = defer_pinned_self();
+  if (key < 0) {
+    double secs = (duration == Qnil ? 0 : NUM2DBL(duration));
+    struct timespec tm = {.tv_sec = (time_t)secs,
+                          .tv_nsec = (long)((secs - (time_t)secs) * 1e9)};
+    if (duration == Qnil)
+      tm.tv_sec = INT32_MAX;
+    IodineCaller.leaveGVL(iodine_scheduler_nanosleep, &tm);
+    return Qnil;
+  }
+  iodine_waiter_s *w = iodine_waiter_new(IODINE_WAIT_SLEEP, key);
+  if (duration != Qnil && NUM2DBL(duration) <= 0)
+    iodine_waiter_wake(w, 0); /* `sleep 0` lets other tasks run */
+  else
+    iodine_waiter_timeout(w, duration);
+  return iodine_waiter_park(w, 0);
+  (void)self;
+}
+
+/**
+Blocks the current Fiber until {#unblock} is called or the (optional) timeout
+had passed (see `Fiber::Scheduler#block`).
+*/
+static VALUE iodine_scheduler_block(int argc, VALUE *argv, VALUE self) {
+  rb_check_arity(argc, 1, 2);
+  VALUE timeout = (argc == 2 ? argv[1] : Qnil);
+  iodine_waiter_s *w =
+      iodine_waiter_new(IODINE_WAIT_BLOCK, defer_pinned_self());
+  rb_hash_aset(iodine_scheduler_blocked, w->fiber, LONG2FIX((intptr_t)w));
+  size_t naps = (size_t)-1;
+  if (w->key >= 0)
+    iodine_waiter_timeout(w, timeout);
+  else if (timeout != Qnil)
+    naps = (size_t)(NUM2DBL(timeout) * 1000);
+  return iodine_waiter_park(w, naps);
+  (void)self;
+}
+
+/**
+Wakes up a Fiber that was blocked using {#block}. Might be called from any
+thread (see `Fiber::Scheduler#unblock`).
+*/
+static VALUE iodine_scheduler_unblock(VALUE self, VALUE blocker,
+                                      VALUE fiber) {
+  VALUE tmp = rb_hash_delete(iodine_scheduler_blocked, fiber);
+  if (tmp != Qnil)
+    iodine_waiter_wake((iodine_waiter_s *)FIX2LONG(tmp), 1);
+  return Qnil;
+  (void)self;
+  (void)blocker;
+}
+
+/* creates a non-blocking Fiber that calls the `proc`. */
+static VALUE iodine_scheduler_fiber_new(VALUE proc) {
+  return rb_funcall_with_block_kw(iodine_fiber_class, new_id, 1,
+                                  &iodine_scheduler_nonblocking, proc,
+                                  RB_PASS_KEYWORDS);
+}
+
+static VALUE iodine_scheduler_schedule_body(RB_BLOCK_CALL_FUNC_ARGLIST(arg,
+                                                                       blk)) {
+  return IodineCaller.call(blk, call_id);
+  (void)arg;
+}
+
+/**
+Runs the block in a new non-blocking Fiber (see `Fiber.schedule`).
+*/
+static VALUE iodine_scheduler_fiber(int argc, VALUE *argv, VALUE self) {
+  rb_need_block();
+  /* exceptions are reported, they can't propagate to the resuming task */
+  VALUE fiber = iodine_scheduler_fiber_new(
+      rb_proc_new(iodine_scheduler_schedule_body, rb_block_proc()));
+  rb_fiber_resume(fiber, 0, NULL);
+  return fiber;
+  (void)argc;
+  (void)argv;
+  (void)self;
+}
+
+/** Does nothing - parked fibers are resumed by the worker threads. */
+static VALUE iodine_scheduler_close(VALUE self) {
+  return Qnil;
+  (void)self;
+}
+
+/* *****************************************************************************
+C API
+***************************************************************************** */
+
+/* returns the thread's iodine scheduler (setting it if missing) or Qnil. */
+static VALUE iodine_scheduler_current(void) {
+  if (defer_pinned_self() < 0)
+    return Qnil;
+  VALUE scheduler = rb_fiber_scheduler_get();
+  if (scheduler == Qnil) {
+    scheduler = rb_obj_alloc(IodineSchedulerClass);
+    rb_fiber_scheduler_set(scheduler);
+  } else if (!rb_obj_is_kind_of(scheduler, IodineSchedulerClass)) {
+    return Qnil;
+  }
+  return scheduler;
+}
+
+static VALUE iodine_scheduler_task_body(RB_BLOCK_CALL_FUNC_ARGLIST(arg,
+                                                                   task_)) {
+  iodine_fiber_task_s *task = (iodine_fiber_task_s *)FIX2LONG(task_);
+  VALUE result = task->func(task->arg);
+  if (task->parked) {
+    task->on_done(result, task->udata);
+    fio_free(task);
+  }
+  return result;
+  (void)arg;
+}
+
+static VALUE iodine_scheduler_run(VALUE (*func)(VALUE arg), VALUE arg,
+                                  void (*on_done)(VALUE result, void *udata),
+                                  void *udata) {
+  if (iodine_scheduler_current() == Qnil)
+    return func(arg);
+  iodine_fiber_task_s *task = fio_malloc(sizeof(*task));
+  *task = (iodine_fiber_task_s){
+      .func = func, .arg = arg, .on_done = on_done, .udata = udata,
+  };
+  VALUE fiber = iodine_scheduler_fiber_new(
+      rb_proc_new(iodine_scheduler_task_body, LONG2FIX((intptr_t)task)));
+  VALUE result = rb_fiber_resume(fiber, 0, NULL);
+  if (result == iodine_scheduler_parked && rb_fiber_alive_p(fiber) == Qtrue) {
+    /* the fiber calls `on_done` */
+    task->parked = 1;
+    return Qundef;
+  }
+  fio_free(task);
+  return result;
+}
+
+static void iodine_scheduler_init(void) {
+  fileno_id = rb_intern("fileno");
+  resume_id = rb_intern("resume");
+  call_id = rb_intern("call");
+  new_id = rb_intern("new");
+  iodine_fiber_class = rb_const_get(rb_cObject, rb_intern("Fiber"));
+  iodine_scheduler_nonblocking = rb_hash_new();
+  rb_hash_aset(iodine_scheduler_nonblocking, ID2SYM(rb_intern("blocking")),
+               Qfalse);
+  rb_obj_freeze(iodine_scheduler_nonblocking);
+  IodineStore.add(iodine_scheduler_nonblocking);
+  iodine_scheduler_parked = rb_obj_freeze(rb_obj_alloc(rb_cObject));
+  IodineStore.add(iodine_scheduler_parked);
+  iodine_scheduler_blocked = rb_hash_new();
+  IodineStore.add(iodine_scheduler_blocked);
+
+  /**
+  A `Fiber::Scheduler` that parks blocking fibers using the iodine reactor.
+
+  It's used by the worker threads when the HTTP `fiber` option is set (see
+  {Iodine.listen}) and it's only effective for iodine's worker threads.
+  */
+  IodineSchedulerClass =
+      rb_define_class_under(IodineModule, "Scheduler", rb_cObject);
+  rb_define_method(IodineSchedulerClass, "io_wait", iodine_scheduler_io_wait,
+                   3);
+  rb_define_method(IodineSchedulerClass, "kernel_sleep",
+                   iodine_scheduler_kernel_sleep, -1);
+  rb_define_method(IodineSchedulerClass, "block", iodine_scheduler_block, -1);
+  rb_define_method(IodineSchedulerClass, "unblock", iodine_scheduler_unblock,
+                   2);
+  rb_define_method(IodineSchedulerClass, "fiber", iodine_scheduler_fiber, -1);
+  rb_define_method(IodineSchedulerClass, "close", iodine_scheduler_close, 0);
+}
+
+#else /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+/* Ruby < 3.0 has no Fiber scheduler, the function is called directly. */
+static VALUE iodine_scheduler_run(VALUE (*func)(VALUE arg), VALUE arg,
+                                  void (*on_done)(VALUE result, void *udata),
+                                  void *udata) {
+  return func(arg);
+  (void)on_done;
+  (void)udata;
+}
+
+static void iodine_scheduler_init(void) {}
+
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+////////////////////////////////////////////////////////////////////////////
+// the API interface
+struct IodineScheduler_s IodineScheduler = {
+    .run = iodine_scheduler_run, .init = iodine_scheduler_init,
+};
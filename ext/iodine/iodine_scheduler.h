@@ -0,0 +1,30 @@
+#ifndef H_IODINE_SCHEDULER_H
+#define H_IODINE_SCHEDULER_H
+/*
+Copyright: Boaz segev, 2016-2018
+License: MIT
+
+Feel free to copy, use and enjoy according to the license provided.
+*/
+#include "ruby.h"
+
+extern struct IodineScheduler_s {
+  /**
+   * Calls `func(arg)` (within the GVL) using a non-blocking Fiber, so blocking
+   * IO (and `sleep`, `Mutex#lock`, etc') parks the fiber rather than the worker
+   * thread. `func` must not raise exceptions.
+   *
+   * Returns the function's result, or `Qundef` if the fiber parked. In which
+   * case, `on_done(result, udata)` is called (within the GVL, by the same
+   * thread) once the fiber completes.
+   *
+   * When a Fiber can't be used (i.e., this isn't a worker thread or the thread
+   * uses a different Fiber scheduler), `func` is called directly.
+   */
+  VALUE (*run)(VALUE (*func)(VALUE arg), VALUE arg,
+               void (*on_done)(VALUE result, void *udata), void *udata);
+  /** Initializes the `Iodine::Scheduler` class. */
+  void (*init)(void);
+} IodineScheduler;
+
+#endif
@@ -4,13 +4,30 @@
 #include "iodine_store.h"
 #include "spnlock.inc"
 
-spn_lock_i lock = SPN_LOCK_INIT;
-fio_hash_s storage = FIO_HASH_INIT;
-
 #ifndef IODINE_DEBUG
 #define IODINE_DEBUG 0
 #endif
 
+#ifndef IODINE_STORE_SHARDS
+/**
+ * The number of storage shards (a power of 2), each with it's own lock, so
+ * concurrent connections, timers and subscriptions rarely wait for each other.
+ */
+#define IODINE_STORE_SHARDS 32
+#endif
+
+typedef struct {
+  spn_lock_i lock;
+  fio_hash_s storage;
+} storage_shard_s;
+
+static storage_shard_s shards[IODINE_STORE_SHARDS];
+
+/* objects are (at least) 8 byte aligned, the lower bits are always zero */
+#define STORAGE_SHARD(obj)                                                     \
+  (shards + ((((uintptr_t)(obj) >> 4) ^ ((uintptr_t)(obj) >> 12)) &           \
+             (IODINE_STORE_SHARDS - 1)))
+
 /* *****************************************************************************
 API
 ***************************************************************************** */
@@ -19,50 +36,64 @@ API
 static VALUE storage_add(VALUE obj) {
   if (obj == Qnil || obj == Qtrue || obj == Qfalse)
     return obj;
-  spn_lock(&lock);
-  uintptr_t val = (uintptr_t)fio_hash_insert(&storage, obj, (void *)1);
+  storage_shard_s *shard = STORAGE_SHARD(obj);
+  spn_lock(&shard->lock);
+  uintptr_t val = (uintptr_t)fio_hash_insert(&shard->storage, obj, (void *)1);
   if (val) {
-    fio_hash_insert(&storage, obj, (void *)(val + 1));
+    fio_hash_insert(&shard->storage, obj, (void *)(val + 1));
   }
-  spn_unlock(&lock);
+  spn_unlock(&shard->lock);
   return obj;
 }
 /** Removes an object from the storage (or decreases it's reference count). */
 static VALUE storage_remove(VALUE obj) {
-  if (obj == Qnil || obj == Qtrue || obj == Qfalse || storage.map == NULL ||
-      storage.count == 0)
+  if (obj == Qnil || obj == Qtrue || obj == Qfalse)
+    return obj;
+  storage_shard_s *shard = STORAGE_SHARD(obj);
+  if (shard->storage.map == NULL || shard->storage.count == 0)
     return obj;
-  spn_lock(&lock);
-  uintptr_t val = (uintptr_t)fio_hash_insert(&storage, obj, NULL);
+  spn_lock(&shard->lock);
+  uintptr_t val = (uintptr_t)fio_hash_insert(&shard->storage, obj, NULL);
   if (val > 1) {
-    fio_hash_insert(&storage, obj, (void *)(val - 1));
+    fio_hash_insert(&shard->storage, obj, (void *)(val - 1));
   }
-  if ((storage.count << 1) <= storage.pos &&
-      (storage.pos << 1) > storage.capa) {
-    fio_hash_compact(&storage);
+  if ((shard->storage.count << 1) <= shard->storage.pos &&
+      (shard->storage.pos << 1) > shard->storage.capa) {
+    fio_hash_compact(&shard->storage);
   }
-  spn_unlock(&lock);
+  spn_unlock(&shard->lock);
   return obj;
 }
 /** Should be called after forking to reset locks */
-static void storage_after_fork(void) { lock = SPN_LOCK_INIT; }
+static void storage_after_fork(void) {
+  for (size_t i = 0; i < IODINE_STORE_SHARDS; ++i)
+    shards[i].lock = SPN_LOCK_INIT;
+}
 
 /** Prints debugging information to the console. */
 static void storage_print(void) {
   fprintf(stderr, "Ruby <=> C Memory storage stats (pid: %d):\n", getpid());
-  spn_lock(&lock);
   uintptr_t index = 0;
-  FIO_HASH_FOR_LOOP(&storage, pos) {
-    if (pos->obj) {
-      fprintf(stderr, "[%" PRIuPTR "] => %" PRIuPTR " X obj %p type %d\n",
-              index++, (uintptr_t)pos->obj, (void *)pos->key, TYPE(pos->key));
+  uintptr_t capa = 0;
+  uintptr_t count = 0;
+  for (size_t i = 0; i < IODINE_STORE_SHARDS; ++i) {
+    spn_lock(&shards[i].lock);
+    FIO_HASH_FOR_LOOP(&shards[i].storage, pos) {
+      if (pos->obj) {
+        fprintf(stderr, "[%" PRIuPTR "] => %" PRIuPTR " X obj %p type %d\n",
+                index++, (uintptr_t)pos->obj, (void *)pos->key,
+                TYPE(pos->key));
+      }
     }
+    capa += shards[i].storage.capa;
+    count += shards[i].storage.count;
+    spn_unlock(&shards[i].lock);
   }
   fprintf(stderr, "Total of %" PRIuPTR " objects protected form GC\n", index);
   fprintf(stderr,
-          "Storage uses %" PRIuPTR " Hash bins for %" PRIuPTR " objects\n",
-          storage.capa, storage.count);
-  spn_unlock(&lock);
+          "Storage uses %" PRIuPTR " Hash bins for %" PRIuPTR
+          " objects (%d shards)\n",
+          capa, count, IODINE_STORE_SHARDS);
 }
 
 /**
@@ -83,14 +114,16 @@ static void storage_mark(void *ignore) {
 #if IODINE_DEBUG
   storage_print();
 #endif
-  spn_lock(&lock);
-  // fio_hash_compact(&storage);
-  FIO_HASH_FOR_LOOP(&storage, pos) {
-    if (pos->obj) {
-      rb_gc_mark((VALUE)pos->key);
+  /* each shard is locked only while it's objects are marked */
+  for (size_t i = 0; i < IODINE_STORE_SHARDS; ++i) {
+    spn_lock(&shards[i].lock);
+    FIO_HASH_FOR_LOOP(&shards[i].storage, pos) {
+      if (pos->obj) {
+        rb_gc_mark((VALUE)pos->key);
+      }
     }
+    spn_unlock(&shards[i].lock);
   }
-  spn_unlock(&lock);
 }
 
 /* clear the registry (end of lifetime) */
@@ -99,10 +132,12 @@ static void storage_clear(void *ignore) {
 #if IODINE_DEBUG == 1
   fprintf(stderr, "* INFO: Ruby<=>C Storage cleared.\n");
 #endif
-  spn_lock(&lock);
-  fio_hash_free(&storage);
-  storage = (fio_hash_s)FIO_HASH_INIT;
-  spn_unlock(&lock);
+  for (size_t i = 0; i < IODINE_STORE_SHARDS; ++i) {
+    spn_lock(&shards[i].lock);
+    fio_hash_free(&shards[i].storage);
+    shards[i].storage = (fio_hash_s)FIO_HASH_INIT;
+    spn_unlock(&shards[i].lock);
+  }
 }
 
 /*
@@ -128,11 +163,14 @@ struct IodineStorage_s IodineStore = {
 
 /** Initializes the storage unit for first use. */
 void iodine_storage_init(void) {
-  fio_hash_new2(&storage, 512);
+  for (size_t i = 0; i < IODINE_STORE_SHARDS; ++i) {
+    shards[i].lock = SPN_LOCK_INIT;
+    fio_hash_new2(&shards[i].storage, 16);
+  }
   VALUE tmp =
       rb_define_class_under(rb_cObject, "IodineObjectStorage", rb_cData);
   VALUE storage_obj =
-      TypedData_Wrap_Struct(tmp, &storage_type_struct, &storage);
+      TypedData_Wrap_Struct(tmp, &storage_type_struct, shards);
   // rb_global_variable(&storage_obj);
   rb_ivar_set(IodineModule, rb_intern2("storage", 7), storage_obj);
   rb_define_module_function(IodineBaseModule, "db_print_protected_objects",
@@ -2,6 +2,9 @@
 #include <ruby/encoding.h>
 #include <ruby/io.h>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
 #include "evio.h"
 #include "facil.h"
 
@@ -16,22 +19,80 @@ static VALUE port_id;
 static VALUE address_id;
 static VALUE handler_id;
 static VALUE timeout_id;
+static VALUE read_size_id;
+static VALUE reuse_buffer_id;
+static VALUE framing_id;
+static VALUE max_frame_id;
+static VALUE balance_id;
+static VALUE udp_id;
+static VALUE line_sym;
+static VALUE u32_len_sym;
+static VALUE varint_sym;
 
 /* *****************************************************************************
 Raw TCP/IP Protocol
 ***************************************************************************** */
 
+/** The default (and minimal) number of bytes read by each `on_data` event. */
 #define IODINE_MAX_READ 8192
+/** The largest `read_size` a connection can use. */
+#define IODINE_MAX_READ_LIMIT (1UL << 20)
+
+/** The default limit for a frame's length (see `iodine_framing_e`). */
+#define IODINE_MAX_FRAME (1UL << 20)
+
+/** Message framing (splitting the incoming data into messages). */
+typedef enum {
+  /** data is delivered as it arrives (possibly fragmented). */
+  IODINE_FRAMING_NONE,
+  /** newline delimited messages (the EOL marker isn't delivered). */
+  IODINE_FRAMING_LINE,
+  /** messages prefixed by a 32 bit (big endian) length. */
+  IODINE_FRAMING_U32,
+  /** messages prefixed by a varint (Protocol Buffers style) length. */
+  IODINE_FRAMING_VARINT,
+} iodine_framing_e;
+
+/* connection settings (the `listen` and `connect` options) */
+typedef struct {
+  VALUE handler;
+  size_t read_size;
+  size_t max_frame;
+  uint8_t reuse_buffer;
+  uint8_t framing;
+} iodine_tcp_settings_s;
 
 typedef struct {
   protocol_s p;
   VALUE io;
+  /** the maximum number of bytes delivered by a single `on_message`. */
+  size_t read_size;
+  /** a reusable String, valid only during `on_message` (or 0). */
+  VALUE buffer;
+  /** the read buffer, when `read_size` exceeds IODINE_MAX_READ (or NULL). */
+  char *read_buffer;
+  /** an incomplete frame (see `iodine_framing_e`). */
+  char *pending;
+  size_t pending_len;
+  size_t pending_capa;
+  /** the maximal frame length. */
+  size_t max_frame;
+  /** the framing used (see `iodine_framing_e`). */
+  uint8_t framing;
 } iodine_protocol_s;
 
+/** The number of frames delivered by each GVL entry. */
+#define IODINE_FRAMES_PER_CALL 64
+
 typedef struct {
-  VALUE io;
-  ssize_t len;
-  char buffer[IODINE_MAX_READ];
+  char *data;
+  size_t len;
+} iodine_frame_s;
+
+typedef struct {
+  iodine_protocol_s *p;
+  size_t count;
+  iodine_frame_s frames[IODINE_FRAMES_PER_CALL];
 } iodine_buffer_s;
 
 /**
@@ -39,33 +100,181 @@ typedef struct {
  */
 static const char *iodine_tcp_service = "iodine TCP/IP raw connection";
 
+/* Converts a frame to a Ruby String (the reusable String, if set). */
+static VALUE iodine_tcp_frame2str(iodine_protocol_s *p, iodine_frame_s *f) {
+  if (!p->buffer) {
+    VALUE data = rb_str_new(f->data, f->len);
+    rb_enc_associate(data, IodineBinaryEncoding);
+    return data;
+  }
+  /* the handler might have frozen (or kept) the String */
+  if (OBJ_FROZEN(p->buffer)) {
+    IodineStore.remove(p->buffer);
+    p->buffer = IodineStore.add(rb_str_buf_new(p->read_size));
+  }
+  VALUE data = p->buffer;
+  rb_str_modify(data);
+  if (rb_str_capacity(data) < f->len)
+    rb_str_modify_expand(data, f->len - RSTRING_LEN(data));
+  memcpy(RSTRING_PTR(data), f->data, f->len);
+  rb_str_set_len(data, f->len);
+  rb_enc_associate(data, IodineBinaryEncoding);
+  return data;
+}
+
 /**
- * Converts an iodine_buffer_s pointer to a Ruby string.
+ * Fires the `on_message` event for each of the frames in an iodine_buffer_s.
  */
 static void *iodine_tcp_on_data_in_GIL(void *b_) {
   iodine_buffer_s *b = b_;
   if (!b) {
     fprintf(stderr, "FATAL ERROR: (iodine->tcp/ip->on_data->GIL) WTF?!\n");
   }
-  VALUE data = IodineStore.add(rb_str_new(b->buffer, b->len));
-  rb_enc_associate(data, IodineBinaryEncoding);
-  iodine_connection_fire_event(b->io, IODINE_CONNECTION_ON_MESSAGE, data);
-  IodineStore.remove(data);
+  for (size_t i = 0; i < b->count; ++i) {
+    VALUE data = IodineStore.add(iodine_tcp_frame2str(b->p, b->frames + i));
+    iodine_connection_fire_event(b->p->io, IODINE_CONNECTION_ON_MESSAGE, data);
+    IodineStore.remove(data);
+  }
   return NULL;
-  // return (void *)IodineStore.add(rb_usascii_str_new((const char *)b->buffer,
-  // b->len));
 }
 
-/** Called when a data is available, but will not run concurrently */
+/*
+ * Finds the next frame, returning the number of bytes consumed, 0 if the frame
+ * is incomplete or -1 if the frame is invalid (or too big).
+ */
+static ssize_t iodine_tcp_frame(iodine_protocol_s *p, char *data, size_t len,
+                                iodine_frame_s *frame) {
+  switch ((iodine_framing_e)p->framing) {
+  case IODINE_FRAMING_LINE: {
+    char *eol = memchr(data, '\n', len);
+    if (!eol)
+      return (len > p->max_frame) ? -1 : 0;
+    *frame = (iodine_frame_s){.data = data, .len = (size_t)(eol - data)};
+    if (frame->len && eol[-1] == '\r')
+      --frame->len;
+    if (frame->len > p->max_frame)
+      return -1;
+    return (eol - data) + 1;
+  }
+  case IODINE_FRAMING_U32: {
+    if (len < 4)
+      return 0;
+    uint8_t *u = (uint8_t *)data;
+    size_t flen = ((size_t)u[0] << 24) | ((size_t)u[1] << 16) |
+                  ((size_t)u[2] << 8) | (size_t)u[3];
+    if (flen > p->max_frame)
+      return -1;
+    if (len < flen + 4)
+      return 0;
+    *frame = (iodine_frame_s){.data = data + 4, .len = flen};
+    return flen + 4;
+  }
+  case IODINE_FRAMING_VARINT: {
+    uint64_t flen = 0;
+    size_t i = 0;
+    for (;;) {
+      if (i == len)
+        return 0;
+      if (i == 10)
+        return -1;
+      flen |= (uint64_t)(data[i] & 0x7F) << (7 * i);
+      if (!(data[i++] & 0x80))
+        break;
+    }
+    if (flen > p->max_frame)
+      return -1;
+    if (len - i < flen)
+      return 0;
+    *frame = (iodine_frame_s){.data = data + i, .len = (size_t)flen};
+    return i + flen;
+  }
+  case IODINE_FRAMING_NONE: /* fallthrough */
+  default:
+    *frame = (iodine_frame_s){.data = data, .len = len};
+    return len;
+  }
+}
+
+/* appends data to the connection's partial frame buffer. */
+static void iodine_tcp_pending_add(iodine_protocol_s *p, char *data,
+                                   size_t len) {
+  if (p->pending_len + len > p->pending_capa) {
+    p->pending_capa = (p->pending_len + len + 4095) & (~(size_t)4095);
+    p->pending = realloc(p->pending, p->pending_capa);
+    if (!p->pending) {
+      perror("FATAL ERROR: No Memory!");
+      exit(errno);
+    }
+  }
+  memcpy(p->pending + p->pending_len, data, len);
+  p->pending_len += len;
+}
+
+/**
+ * Called when a data is available, but will not run concurrently.
+ *
+ * Reads are coalesced (up to the connection's `read_size`), so a high packet
+ * rate results in fewer (larger) `on_message` events.
+ *
+ * When framing is used, frames are found before entering the GVL, so the GVL
+ * is entered only for complete frames (and once for a number of frames).
+ */
 static void iodine_tcp_on_data(intptr_t uuid, protocol_s *protocol) {
-  iodine_buffer_s buffer;
-  buffer.len = sock_read(uuid, buffer.buffer, IODINE_MAX_READ);
-  if (buffer.len <= 0) {
+  iodine_protocol_s *p = (iodine_protocol_s *)protocol;
+  char stack_buffer[IODINE_MAX_READ];
+  char *buffer = (p->read_buffer ? p->read_buffer : stack_buffer);
+  ssize_t len = sock_read(uuid, buffer, p->read_size);
+  if (len <= 0) {
     return;
   }
-  buffer.io = ((iodine_protocol_s *)protocol)->io;
-  IodineCaller.enterGVL(iodine_tcp_on_data_in_GIL, &buffer);
-  if (buffer.len == IODINE_MAX_READ) {
+  if (p->read_buffer) {
+    /* coalesce (i.e., TLS records or data that arrived while reading) */
+    ssize_t ret;
+    while ((size_t)len < p->read_size &&
+           (ret = sock_read(uuid, buffer + len, p->read_size - len)) > 0) {
+      len += ret;
+    }
+  }
+  uint8_t more = ((size_t)len == p->read_size);
+  iodine_buffer_s frames = {.p = p};
+  char *data = buffer;
+  size_t data_len = (size_t)len;
+  size_t pos = 0;
+  ssize_t ret = 0;
+  if (p->pending_len) {
+    iodine_tcp_pending_add(p, buffer, len);
+    data = p->pending;
+    data_len = p->pending_len;
+  }
+  do {
+    frames.count = 0;
+    while (frames.count < IODINE_FRAMES_PER_CALL && pos < data_len &&
+           (ret = iodine_tcp_frame(p, data + pos, data_len - pos,
+                                   frames.frames + frames.count)) > 0) {
+      pos += ret;
+      ++frames.count;
+    }
+    if (frames.count)
+      IodineCaller.enterGVL(iodine_tcp_on_data_in_GIL, &frames);
+  } while (frames.count == IODINE_FRAMES_PER_CALL);
+  if (ret == -1) {
+    fprintf(stderr,
+            "WARNING: (iodine) invalid or oversized frame, closing connection "
+            "%p\n",
+            (void *)uuid);
+    p->pending_len = 0;
+    sock_close(uuid);
+    return;
+  }
+  /* keep the incomplete frame */
+  if (data == p->pending) {
+    p->pending_len = data_len - pos;
+    if (p->pending_len)
+      memmove(p->pending, p->pending + pos, p->pending_len);
+  } else if (pos < data_len) {
+    iodine_tcp_pending_add(p, data + pos, data_len - pos);
+  }
+  if (more) {
     facil_force_event(uuid, FIO_EVENT_ON_DATA);
   }
 }
@@ -92,6 +301,10 @@ static void iodine_tcp_on_shutdown(intptr_t uuid, protocol_s *protocol) {
 static void iodine_tcp_on_close(intptr_t uuid, protocol_s *protocol) {
   iodine_protocol_s *p = (iodine_protocol_s *)protocol;
   iodine_connection_fire_event(p->io, IODINE_CONNECTION_ON_CLOSE, Qnil);
+  if (p->buffer)
+    IodineStore.remove(p->buffer);
+  free(p->read_buffer);
+  free(p->pending);
   free(p);
   (void)uuid;
 }
@@ -103,17 +316,23 @@ static void iodine_tcp_ping(intptr_t uuid, protocol_s *protocol) {
   (void)uuid;
 }
 
+static void iodine_tcp_attach(intptr_t uuid, VALUE handler,
+                              iodine_tcp_settings_s *s);
+
 /** called when a connection opens */
 static void iodine_tcp_on_open(intptr_t uuid, void *udata) {
-  VALUE handler = IodineCaller.call((VALUE)udata, call_id);
+  iodine_tcp_settings_s *s = udata;
+  VALUE handler = IodineCaller.call(s->handler, call_id);
   IodineStore.add(handler);
-  iodine_tcp_attch_uuid(uuid, handler);
+  iodine_tcp_attach(uuid, handler, s);
   IodineStore.remove(handler);
 }
 
 /** called when the listening socket is destroyed */
 static void iodine_tcp_on_finish(intptr_t uuid, void *udata) {
-  IodineStore.remove((VALUE)udata);
+  iodine_tcp_settings_s *s = udata;
+  IodineStore.remove(s->handler);
+  free(s);
   (void)uuid;
 }
 
@@ -124,9 +343,10 @@ static void iodine_tcp_on_finish(intptr_t uuid, void *udata) {
  * Should either call `facil_attach` or close the connection.
  */
 static void iodine_tcp_on_connect(intptr_t uuid, void *udata) {
-  VALUE handler = (VALUE)udata;
-  iodine_tcp_attch_uuid(uuid, handler);
-  IodineStore.remove(handler);
+  iodine_tcp_settings_s *s = udata;
+  iodine_tcp_attach(uuid, s->handler, s);
+  IodineStore.remove(s->handler);
+  free(s);
 }
 
 /**
@@ -134,15 +354,131 @@ static void iodine_tcp_on_connect(intptr_t uuid, void *udata) {
  * is passed along.
  */
 static void iodine_tcp_on_fail(intptr_t uuid, void *udata) {
-  VALUE handler = (VALUE)udata;
+  iodine_tcp_settings_s *s = udata;
+  VALUE handler = s->handler;
   if (rb_respond_to(handler, on_closed_id)) {
     VALUE client = Qnil;
     IodineCaller.call2(handler, on_closed_id, 1, &client);
   }
   IodineStore.remove(handler);
+  free(s);
+  (void)uuid;
+}
+
+/* *****************************************************************************
+UDP sockets
+***************************************************************************** */
+
+typedef struct {
+  VALUE handler;
+  sock_datagram_s *datagrams;
+  size_t count;
+} iodine_udp_batch_s;
+
+/* formats the datagram's source as an "address:port" String (or nil). */
+static VALUE iodine_udp_peer2str(sock_datagram_s *d) {
+  char buf[INET6_ADDRSTRLEN + 16];
+  const void *addr;
+  unsigned int port;
+  size_t len = 0;
+  switch (d->addr.ss_family) {
+  case AF_INET:
+    addr = &((struct sockaddr_in *)&d->addr)->sin_addr;
+    port = ntohs(((struct sockaddr_in *)&d->addr)->sin_port);
+    break;
+  case AF_INET6:
+    addr = &((struct sockaddr_in6 *)&d->addr)->sin6_addr;
+    port = ntohs(((struct sockaddr_in6 *)&d->addr)->sin6_port);
+    buf[len++] = '[';
+    break;
+  default:
+    return Qnil;
+  }
+  if (!inet_ntop(d->addr.ss_family, addr, buf + len, INET6_ADDRSTRLEN))
+    return Qnil;
+  len += strlen(buf + len);
+  len += snprintf(buf + len, sizeof(buf) - len,
+                  (d->addr.ss_family == AF_INET6 ? "]:%u" : ":%u"), port);
+  return rb_str_new(buf, len);
+}
+
+/* calls the handler for each of the datagrams in the batch. */
+static void *iodine_udp_on_datagram_in_GIL(void *b_) {
+  iodine_udp_batch_s *b = b_;
+  for (size_t i = 0; i < b->count; ++i) {
+    VALUE argv[2];
+    argv[0] = rb_enc_str_new(b->datagrams[i].data, b->datagrams[i].len,
+                             IodineBinaryEncoding);
+    argv[1] = iodine_udp_peer2str(b->datagrams + i);
+    IodineCaller.call2(b->handler, call_id, 2, argv);
+  }
+  return NULL;
+}
+
+/** called with every batch of incoming datagrams */
+static void iodine_udp_on_datagram(intptr_t uuid, sock_datagram_s *datagrams,
+                                   size_t count, void *udata) {
+  iodine_udp_batch_s b = {
+      .handler = (VALUE)udata, .datagrams = datagrams, .count = count,
+  };
+  IodineCaller.enterGVL(iodine_udp_on_datagram_in_GIL, &b);
+  (void)uuid;
+}
+
+/** called when the UDP socket is destroyed */
+static void iodine_udp_on_finish(intptr_t uuid, void *udata) {
+  IodineStore.remove((VALUE)udata);
   (void)uuid;
 }
 
+/* reads the `read_size` and `reuse_buffer` options. */
+static iodine_tcp_settings_s *iodine_tcp_settings_new(VALUE args,
+                                                      VALUE handler) {
+  iodine_tcp_settings_s *s;
+  VALUE rb_read_size = rb_hash_aref(args, read_size_id);
+  size_t read_size = IODINE_MAX_READ;
+  if (rb_read_size != Qnil) {
+    Check_Type(rb_read_size, T_FIXNUM);
+    if (FIX2LONG(rb_read_size) < IODINE_MAX_READ ||
+        FIX2ULONG(rb_read_size) > IODINE_MAX_READ_LIMIT)
+      rb_raise(rb_eRangeError, "read_size should be between 8192 and 1Mb.");
+    read_size = FIX2ULONG(rb_read_size);
+  }
+  VALUE rb_reuse = rb_hash_aref(args, reuse_buffer_id);
+  VALUE rb_framing = rb_hash_aref(args, framing_id);
+  uint8_t framing = IODINE_FRAMING_NONE;
+  if (rb_framing == line_sym) {
+    framing = IODINE_FRAMING_LINE;
+  } else if (rb_framing == u32_len_sym) {
+    framing = IODINE_FRAMING_U32;
+  } else if (rb_framing == varint_sym) {
+    framing = IODINE_FRAMING_VARINT;
+  } else if (rb_framing != Qnil) {
+    rb_raise(rb_eArgError, "framing should be :line, :u32_len or :varint.");
+  }
+  VALUE rb_max_frame = rb_hash_aref(args, max_frame_id);
+  size_t max_frame = IODINE_MAX_FRAME;
+  if (rb_max_frame != Qnil) {
+    Check_Type(rb_max_frame, T_FIXNUM);
+    if (FIX2LONG(rb_max_frame) <= 0)
+      rb_raise(rb_eRangeError, "max_frame must be a positive number.");
+    max_frame = FIX2ULONG(rb_max_frame);
+  }
+  s = malloc(sizeof(*s));
+  if (!s) {
+    perror("FATAL ERROR: No Memory!");
+    exit(errno);
+  }
+  *s = (iodine_tcp_settings_s){
+      .handler = handler,
+      .read_size = read_size,
+      .reuse_buffer = (rb_reuse != Qnil && rb_reuse != Qfalse),
+      .framing = framing,
+      .max_frame = max_frame,
+  };
+  return s;
+}
+
 /* *****************************************************************************
 The Ruby API implementation
 ***************************************************************************** */
@@ -156,12 +492,18 @@ The method accepts a single Hash argument with the following optional keys:
 :port :: The port to listen to, deafults to 0 (using a Unix socket)
 :address :: The address to listen to, which could be a Unix Socket path as well as an IPv4 / IPv6 address. Deafults to 0.0.0.0 (or the IPv6 equivelant).
 :handler :: An object that answers the `call` method (i.e., a Proc).
+:read_size :: The maximum number of bytes passed to a single `on_message` call (8192..1048576). Defaults to 8192. Incoming data is coalesced, so a high packet rate results in fewer `on_message` calls.
+:reuse_buffer :: If `true`, `on_message` receives the same (per-connection) mutable String for every call, avoiding a String allocation per call. The String's content is only valid during the `on_message` callback (use `dup` to keep the data).
+:framing :: Splits the incoming data into messages (natively), so `on_message` receives exactly one complete message per call. Valid values are: `:line` (newline delimited, the `"\n"` or `"\r\n"` isn't included), `:u32_len` (a 4 byte, big endian, length prefix) and `:varint` (a Protocol Buffers style varint length prefix). Length prefixes aren't included in the message.
+:max_frame :: The maximum message length when using `:framing` (defaults to 1Mb). Connections sending longer (or invalid) messages are closed.
+:balance :: When a worker process has this many (or more) connections than the least busy worker, new connections are handed to that worker before `on_open` is called (requires `workers > 1`). Defaults to 0 (off).
+:udp :: If `true`, binds a UDP socket to the (required) `:port`. Incoming datagrams are received in batches and the handler is called for each datagram with the datagram's data (a binary String) and the sender's address (an `"address:port"` String), i.e. `handler.call(data, peer)`. Datagrams longer than 8Kb are truncated. The connection related options are ignored.
 
 The method also accepts an optional block.
 
 Either a block or the :handler key MUST be present.
 
-The handler Proc (or object) should return a connection callback object that supports the following callbacks (see also {Iodine::Connection}):
+Unless using `:udp`, the handler Proc (or object) should return a connection callback object that supports the following callbacks (see also {Iodine::Connection}):
 
 on_open(client) :: called after a connection was established
 on_message(client, data) :: called when incoming data is available. Data may be fragmented.
@@ -222,25 +564,49 @@ static VALUE iodine_tcp_listen(VALUE self, VALUE args) {
   VALUE rb_port = rb_hash_aref(args, port_id);
   VALUE rb_address = rb_hash_aref(args, address_id);
   VALUE rb_handler = rb_hash_aref(args, handler_id);
+  VALUE rb_balance = rb_hash_aref(args, balance_id);
+  uint16_t balance = 0;
   if (rb_handler == Qnil || rb_handler == Qfalse || rb_handler == Qtrue) {
     rb_need_block();
     rb_handler = rb_block_proc();
   }
-  IodineStore.add(rb_handler);
   if (rb_address != Qnil) {
     Check_Type(rb_address, T_STRING);
   }
   if (rb_port != Qnil) {
     Check_Type(rb_port, T_STRING);
   }
+  if (rb_hash_aref(args, udp_id) == Qtrue) {
+    if (rb_port == Qnil)
+      rb_raise(rb_eArgError, "a UDP socket requires a :port.");
+    IodineStore.add(rb_handler);
+    if (facil_listen(.port = StringValueCStr(rb_port),
+                     .address =
+                         (rb_address == Qnil ? NULL
+                                             : StringValueCStr(rb_address)),
+                     .on_datagram = iodine_udp_on_datagram,
+                     .on_finish = iodine_udp_on_finish,
+                     .udata = (void *)rb_handler) == -1) {
+      IodineStore.remove(rb_handler);
+      rb_raise(rb_eRuntimeError, "failed to bind the requested UDP address.");
+    }
+    return rb_handler;
+  }
+  if (rb_balance != Qnil && rb_balance != Qfalse) {
+    Check_Type(rb_balance, T_FIXNUM);
+    if (FIX2LONG(rb_balance) < 0 || FIX2LONG(rb_balance) > 65535)
+      rb_raise(rb_eRangeError, "balance should be 0..65535 connections.");
+    balance = (uint16_t)FIX2LONG(rb_balance);
+  }
+  iodine_tcp_settings_s *s = iodine_tcp_settings_new(args, rb_handler);
+  IodineStore.add(rb_handler);
   if (facil_listen(.port = (rb_port == Qnil ? NULL : StringValueCStr(rb_port)),
                    .address =
                        (rb_address == Qnil ? NULL
                                            : StringValueCStr(rb_address)),
                    .on_open = iodine_tcp_on_open,
-                   .on_finish = iodine_tcp_on_finish,
-                   .udata = (void *)rb_handler) == -1) {
-    IodineStore.remove(rb_handler);
+                   .on_finish = iodine_tcp_on_finish, .udata = s,
+                   .balance = balance) == -1) {
     rb_raise(rb_eRuntimeError,
              "failed to listen to requested address, unknown error.");
   }
@@ -258,6 +624,10 @@ The method accepts a single Hash argument with the following optional keys:
 :address :: The address to listen to, which could be a Unix Socket path as well as an IPv4 / IPv6 address. Deafults to 0.0.0.0 (or the IPv6 equivelant).
 :handler :: A connection callback object that supports the following same callbacks listen in the {listen} method's documentation.
 :timeout :: An integer timeout for connection establishment (doen't effect the new connection's timeout. Should be in the rand of 0..255.
+:read_size :: See {listen}.
+:reuse_buffer :: See {listen}.
+:framing :: See {listen}.
+:max_frame :: See {listen}.
 
 The method also accepts an optional block.
 
@@ -278,7 +648,6 @@ static VALUE iodine_tcp_connect(VALUE self, VALUE args) {
   if (rb_handler == Qnil || rb_handler == Qfalse || rb_handler == Qtrue) {
     rb_raise(rb_eArgError, "A callback object (:handler) must be provided.");
   }
-  IodineStore.add(rb_handler);
   if (rb_address != Qnil) {
     Check_Type(rb_address, T_STRING);
   }
@@ -289,12 +658,14 @@ static VALUE iodine_tcp_connect(VALUE self, VALUE args) {
     Check_Type(rb_timeout, T_FIXNUM);
     timeout = NUM2USHORT(rb_timeout);
   }
+  iodine_tcp_settings_s *s = iodine_tcp_settings_new(args, rb_handler);
+  IodineStore.add(rb_handler);
   facil_connect(.port = (rb_port == Qnil ? NULL : StringValueCStr(rb_port)),
                 .address =
                     (rb_address == Qnil ? NULL : StringValueCStr(rb_address)),
                 .on_connect = iodine_tcp_on_connect,
                 .on_fail = iodine_tcp_on_fail, .timeout = timeout,
-                .udata = (void *)rb_handler);
+                .udata = s);
   return rb_handler;
   (void)self;
 }
@@ -339,6 +710,15 @@ void iodine_init_tcp_connections(void) {
   address_id = IodineStore.add(rb_id2sym(rb_intern("address")));
   handler_id = IodineStore.add(rb_id2sym(rb_intern("handler")));
   timeout_id = IodineStore.add(rb_id2sym(rb_intern("timout")));
+  read_size_id = IodineStore.add(rb_id2sym(rb_intern("read_size")));
+  reuse_buffer_id = IodineStore.add(rb_id2sym(rb_intern("reuse_buffer")));
+  framing_id = IodineStore.add(rb_id2sym(rb_intern("framing")));
+  max_frame_id = IodineStore.add(rb_id2sym(rb_intern("max_frame")));
+  balance_id = IodineStore.add(rb_id2sym(rb_intern("balance")));
+  udp_id = IodineStore.add(rb_id2sym(rb_intern("udp")));
+  line_sym = IodineStore.add(rb_id2sym(rb_intern("line")));
+  u32_len_sym = IodineStore.add(rb_id2sym(rb_intern("u32_len")));
+  varint_sym = IodineStore.add(rb_id2sym(rb_intern("varint")));
   on_closed_id = rb_intern("on_closed");
 
   IodineBinaryEncoding = rb_enc_find("binary");
@@ -354,6 +734,14 @@ Allow uuid attachment
 
 /** assigns a protocol and IO object to a handler */
 void iodine_tcp_attch_uuid(intptr_t uuid, VALUE handler) {
+  iodine_tcp_settings_s s = {.read_size = IODINE_MAX_READ,
+                             .max_frame = IODINE_MAX_FRAME};
+  iodine_tcp_attach(uuid, handler, &s);
+}
+
+/* assigns a protocol and IO object to a handler, using the settings. */
+static void iodine_tcp_attach(intptr_t uuid, VALUE handler,
+                              iodine_tcp_settings_s *s) {
   if (handler == Qnil || handler == Qfalse || handler == Qtrue) {
     sock_close(uuid);
     return;
@@ -376,7 +764,19 @@ void iodine_tcp_attch_uuid(intptr_t uuid, VALUE handler) {
           },
       .io = iodine_connection_new(.type = IODINE_CONNECTION_RAW, .uuid = uuid,
                                   .arg = p, .handler = handler),
+      .read_size = s->read_size,
+      .max_frame = s->max_frame,
+      .framing = s->framing,
   };
+  if (s->reuse_buffer)
+    p->buffer = IodineStore.add(rb_str_buf_new(s->read_size));
+  if (s->read_size > IODINE_MAX_READ) {
+    p->read_buffer = malloc(s->read_size);
+    if (!p->read_buffer) {
+      perror("FATAL ERROR: No Memory!");
+      exit(errno);
+    }
+  }
   /* clear away (remember the connection object manages these concerns) */
   facil_attach(uuid, &p->p);
   iodine_connection_fire_event(p->io, IODINE_CONNECTION_ON_OPEN, Qnil);
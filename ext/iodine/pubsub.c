@@ -8,6 +8,7 @@ Feel free to copy, use and enjoy according to the license provided.
 
 #include "facil.h"
 #include "fio_llist.h"
+#include "fio_stats.h"
 #include "fiobj.h"
 #include "pubsub.h"
 
@@ -74,15 +75,23 @@ static inline int fio_hash_fiobj_keys_eq(fio_hash_key_s a, fio_hash_key_s b) {
 Channel and Client Data Structures
 ***************************************************************************** */
 
+struct client_s;
+
+/* a client's membership in a channel (a client may belong to a few channels) */
 typedef struct {
-  /* clients are nodes in a list. */
+  /* members are nodes in the channel's list. */
   fio_ls_embd_s node;
+  /* a pointer to the channel data */
+  void *parent;
+  /* the client receiving the channel's messages */
+  struct client_s *client;
+} member_s;
+
+typedef struct client_s {
   /* a reference counter (how many messages pending) */
   size_t ref;
   /* a subscription counter (protection against multiple unsubscribe calls) */
   size_t sub_count;
-  /* a pointer to the channel data */
-  void *parent;
   /** The on message callback. the `*msg` pointer is to a temporary object. */
   void (*on_message)(pubsub_message_s *msg);
   /** An optional callback for when a subscription is fully canceled. */
@@ -93,6 +102,32 @@ typedef struct {
   void *udata2;
   /** Task lock (per client-channel combination */
   spn_lock_i lock;
+  /** The delivery policy for slow connections (see `pubsub_delivery_e`). */
+  uint8_t delivery;
+  /** Set while the client is listed as a slow consumer. */
+  uint8_t slow;
+  /** The connection receiving the messages (see `delivery`). */
+  intptr_t uuid;
+  /** The maximum number of held messages. */
+  size_t limit;
+  /** The number of held messages. */
+  size_t held_count;
+  /** Messages held while the connection is slow (`msg_wrapper_s` objects). */
+  fio_ls_s held;
+  /** Messages waiting for delivery, in publishing order (see `pending_lock`). */
+  fio_ls_s pending;
+  /** Protects the `pending` list (the client's lock might be busy). */
+  spn_lock_i pending_lock;
+  /* slow consumers are nodes in a list (see `pubsub_slow_review`). */
+  fio_ls_embd_s slow_node;
+  /* group subscriptions are nodes in a list (see `pubsub_subscribe_group`). */
+  fio_ls_embd_s group_node;
+  /* set for group subscriptions. */
+  uint8_t group;
+  /* the number of channels the client belongs to. */
+  size_t count;
+  /* the client's channel memberships. */
+  member_s members[];
 } client_s;
 
 typedef struct {
@@ -104,13 +139,194 @@ typedef struct {
   unsigned use_pattern : 1;
   /** Use pattern matching for channel subscription. */
   unsigned publish2cluster : 1;
+  /** Patterns are nodes in the pattern index's list (see below). */
+  fio_ls_embd_s index_node;
+  /** The pattern index node holding the pattern (patterns only). */
+  struct pattern_node_s *index;
 } channel_s;
 
+/* *****************************************************************************
+The registry (sharded by the channel's hash)
+***************************************************************************** */
+
+/**
+ * The number of registry shards (MUST be a power of 2). Each shard holds the
+ * channels (and their clients) with the matching hash value, so subscriptions
+ * and publications to different channels rarely contend for the same lock.
+ */
+#ifndef PUBSUB_SHARDS
+#define PUBSUB_SHARDS 32
+#endif
+
+#if (PUBSUB_SHARDS & (PUBSUB_SHARDS - 1))
+#error PUBSUB_SHARDS must be a power of 2.
+#endif
+
+/*
+ * A reader / writer spinlock. Publishing only reads the registry, so a number
+ * of threads can publish concurrently. Waiting writers block new readers.
+ */
+typedef struct {
+  volatile intptr_t state; /* -1 == writing, otherwise the number of readers */
+  volatile size_t writers; /* the number of writers waiting for the lock */
+} rw_lock_s;
+
+#define RW_LOCK_INIT                                                           \
+  { .state = 0 }
+
+static inline void rw_lock_read(rw_lock_s *l) {
+  for (;;) {
+    intptr_t state = l->state;
+    if (!l->writers && state >= 0 &&
+        __sync_bool_compare_and_swap(&l->state, state, state + 1))
+      return;
+    reschedule_thread();
+  }
+}
+
+static inline void rw_unlock_read(rw_lock_s *l) {
+  __sync_sub_and_fetch(&l->state, 1);
+}
+
+static inline void rw_lock_write(rw_lock_s *l) {
+  spn_add(&l->writers, 1);
+  while (!__sync_bool_compare_and_swap(&l->state, 0, -1))
+    reschedule_thread();
+  spn_sub(&l->writers, 1);
+}
+
+static inline void rw_unlock_write(rw_lock_s *l) {
+  __sync_bool_compare_and_swap(&l->state, -1, 0);
+}
+
+typedef struct {
+  rw_lock_s lock;
+  fio_hash_s channels;
+  fio_hash_s clients;
+  /* channel histories (see `pubsub_history`), kept without subscribers */
+  fio_hash_s history;
+} shard_s;
+
+static shard_s shards[PUBSUB_SHARDS];
+
+/* the hash map's lower bits are used for it's own indexing */
+#define PUBSUB_SHARD(hash) (shards + (((hash) >> 32) & (PUBSUB_SHARDS - 1)))
+
+/* patterns are tested for every publication, so they aren't sharded. */
 static fio_hash_s patterns;
-static fio_hash_s channels;
-static fio_hash_s clients;
+static rw_lock_s patterns_lock = RW_LOCK_INIT;
+
+/* *****************************************************************************
+The pattern index (a trie of each pattern's literal prefix)
+***************************************************************************** */
+
+/*
+ * Patterns are indexed by their literal prefix (the bytes before the first
+ * '*', '?', '[' or '\\'), so a publication only tests the patterns who's
+ * prefix matches the channel's name, instead of testing every pattern.
+ *
+ * The index is protected by `patterns_lock`.
+ */
+typedef struct pattern_node_s {
+  /* patterns with a literal prefix ending at this node */
+  fio_ls_embd_s patterns;
+  struct pattern_node_s *parent;
+  /* child nodes, unsorted (most nodes have very few children) */
+  struct pattern_node_s **children;
+  uint16_t count;
+  uint16_t capa;
+  uint8_t byte;
+} pattern_node_s;
+
+static pattern_node_s patterns_index = {
+    .patterns = FIO_LS_INIT(patterns_index.patterns),
+};
+
+/** Returns the length of a pattern's literal prefix. */
+static inline size_t pubsub_pattern_prefix_len(uint8_t *pat, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    switch (pat[i]) {
+    case '*': /* fallthrough */
+    case '?': /* fallthrough */
+    case '[': /* fallthrough */
+    case '\\':
+      return i;
+    }
+  }
+  return len;
+}
+
+static inline pattern_node_s *pattern_node_child(pattern_node_s *node,
+                                                 uint8_t byte) {
+  for (size_t i = 0; i < node->count; ++i) {
+    if (node->children[i]->byte == byte)
+      return node->children[i];
+  }
+  return NULL;
+}
+
+/** Adds a pattern channel to the index (call within `patterns_lock`). */
+static void pattern_index_add(channel_s *ch) {
+  fio_cstr_s str = fiobj_obj2cstr(ch->name);
+  size_t len = pubsub_pattern_prefix_len(str.bytes, str.len);
+  pattern_node_s *node = &patterns_index;
+  for (size_t i = 0; i < len; ++i) {
+    pattern_node_s *child = pattern_node_child(node, str.bytes[i]);
+    if (!child) {
+      child = malloc(sizeof(*child));
+      if (!child) {
+        perror("FATAL ERROR: (pubsub) pattern index memory allocation error");
+        exit(errno);
+      }
+      *child = (pattern_node_s){
+          .patterns = FIO_LS_INIT(child->patterns),
+          .parent = node,
+          .byte = str.bytes[i],
+      };
+      if (node->count == node->capa) {
+        node->capa = (node->capa ? (node->capa << 1) : 2);
+        node->children =
+            realloc(node->children, sizeof(*node->children) * node->capa);
+        if (!node->children) {
+          perror("FATAL ERROR: (pubsub) pattern index memory allocation "
+                 "error");
+          exit(errno);
+        }
+      }
+      node->children[node->count++] = child;
+    }
+    node = child;
+  }
+  ch->index = node;
+  fio_ls_embd_push(&node->patterns, &ch->index_node);
+}
+
+/** Removes a pattern channel from the index (call within `patterns_lock`). */
+static void pattern_index_remove(channel_s *ch) {
+  pattern_node_s *node = ch->index;
+  fio_ls_embd_remove(&ch->index_node);
+  ch->index = NULL;
+  /* prune empty nodes */
+  while (node && node->parent && !node->count &&
+         !fio_ls_embd_any(&node->patterns)) {
+    pattern_node_s *parent = node->parent;
+    for (size_t i = 0; i < parent->count; ++i) {
+      if (parent->children[i] == node) {
+        parent->children[i] = parent->children[--parent->count];
+        break;
+      }
+    }
+    if (!parent->count) {
+      free(parent->children);
+      parent->children = NULL;
+      parent->capa = 0;
+    }
+    free(node);
+    node = parent;
+  }
+}
+
 static fio_hash_s engines;
-static spn_lock_i lock = SPN_LOCK_INIT;
 static spn_lock_i engn_lock = SPN_LOCK_INIT;
 
 /* *****************************************************************************
@@ -121,6 +337,12 @@ Channel and Client Management
 static void pubsub_on_channel_create(channel_s *ch);
 /* for engine thingy */
 static void pubsub_on_channel_destroy(channel_s *ch);
+/* queues a channel's history for a new client (see `pubsub_history`) */
+static size_t pubsub_history_replay(shard_s *shard, uint64_t channel_hash,
+                                    FIOBJ channel, client_s *cl,
+                                    uint64_t since);
+/* delivers a client's queued messages */
+static void pubsub_en_process_deferred_on_message(void *cl, void *ignr);
 
 static void pubsub_deferred_unsub(void *cl_, void *ignr) {
   client_s *cl = cl_;
@@ -152,42 +374,16 @@ static inline uint64_t client_compute_hash(client_s client) {
           ((uint64_t)client.udata2 ^ 0x646f72616e646f6dULL));
 }
 
-static client_s *pubsub_client_new(client_s client, channel_s channel) {
-  if (!client.on_message || !channel.name) {
-    fprintf(stderr,
-            "ERROR: (pubsub) subscription request failed. missing on of:\n"
-            "       1. channel name.\n"
-            "       2. massage handler.\n");
-    if (client.on_unsubscribe)
-      client.on_unsubscribe(client.udata1, client.udata2);
-    return NULL;
-  }
-  uint64_t channel_hash = fiobj_obj2hash(channel.name);
-  uint64_t client_hash = client_compute_hash(client);
-  spn_lock(&lock);
-  /* ignore if client exists. */
-  client_s *cl = fio_hash_find(
-      &clients, (fio_hash_key_s){.hash = client_hash, .obj = channel.name});
-  if (cl) {
-    cl->sub_count++;
-    spn_unlock(&lock);
-    return cl;
-  }
-  /* no client, we need a new client */
-  cl = malloc(sizeof(*cl));
-  if (!cl) {
-    perror("FATAL ERROR: (pubsub) client memory allocation error");
-    exit(errno);
-  }
-  *cl = client;
-  cl->ref = 1;
-  cl->sub_count = 1;
-
-  fio_hash_insert(
-      &clients, (fio_hash_key_s){.hash = client_hash, .obj = channel.name}, cl);
-
-  /* test for existing channel */
-  fio_hash_s *ch_hashmap = (channel.use_pattern ? &patterns : &channels);
+/*
+ * Adds a member to the channel, creating the channel if required (call within
+ * the channel's shard lock).
+ */
+static void pubsub_channel_join(shard_s *shard, uint64_t channel_hash,
+                                channel_s channel, member_s *mb) {
+  fio_hash_s *ch_hashmap =
+      (channel.use_pattern ? &patterns : &shard->channels);
+  if (channel.use_pattern)
+    rw_lock_write(&patterns_lock);
   channel_s *ch = fio_hash_find(
       ch_hashmap, (fio_hash_key_s){.hash = channel_hash, .obj = channel.name});
   if (!ch) {
@@ -206,38 +402,35 @@ static client_s *pubsub_client_new(client_s client, channel_s channel) {
     fio_hash_insert(ch_hashmap,
                     (fio_hash_key_s){.hash = channel_hash, .obj = channel.name},
                     ch);
+    if (channel.use_pattern)
+      pattern_index_add(ch);
     pubsub_on_channel_create(ch);
   } else {
     /* channel exists */
   }
-  cl->parent = ch;
-  fio_ls_embd_push(&ch->clients, &cl->node);
-  spn_unlock(&lock);
-  return cl;
+  mb->parent = ch;
+  fio_ls_embd_push(&ch->clients, &mb->node);
+  if (channel.use_pattern)
+    rw_unlock_write(&patterns_lock);
 }
 
-/** Destroys a client (and empty channels as well) */
-static int pubsub_client_destroy(client_s *client) {
-  if (!client || !client->parent)
-    return -1;
-  channel_s *ch = client->parent;
-
-  fio_hash_s *ch_hashmap = (ch->use_pattern ? &patterns : &channels);
-  uint64_t channel_hash = fiobj_obj2hash(ch->name);
-  uint64_t client_hash = client_compute_hash(*client);
-  uint8_t is_ch_any;
-  spn_lock(&lock);
-  if ((client->sub_count -= 1)) {
-    spn_unlock(&lock);
-    return 0;
-  }
-  fio_ls_embd_remove(&client->node);
-  fio_hash_insert(&clients,
-                  (fio_hash_key_s){.hash = client_hash, .obj = ch->name}, NULL);
-  is_ch_any = fio_ls_embd_any(&ch->clients);
-  if (is_ch_any) {
+/*
+ * Removes a member from its channel (call within the channel's shard lock).
+ *
+ * Returns the channel if it's empty (call `pubsub_channel_free` once the lock
+ * was released).
+ */
+static channel_s *pubsub_channel_leave(shard_s *shard, uint64_t channel_hash,
+                                       member_s *mb) {
+  channel_s *ch = mb->parent;
+  const uint8_t use_pattern = ch->use_pattern;
+  fio_hash_s *ch_hashmap = (use_pattern ? &patterns : &shard->channels);
+  if (use_pattern)
+    rw_lock_write(&patterns_lock);
+  fio_ls_embd_remove(&mb->node);
+  if (fio_ls_embd_any(&ch->clients)) {
     /* channel still has client - we should keep it */
-    (void)0;
+    ch = NULL;
   } else {
     channel_s *test = fio_hash_insert(
         ch_hashmap, (fio_hash_key_s){.hash = channel_hash, .obj = ch->name},
@@ -247,25 +440,185 @@ static int pubsub_client_destroy(client_s *client) {
               "FATAL ERROR: (pubsub) channel database corruption detected.\n");
       exit(-1);
     }
+    if (use_pattern)
+      pattern_index_remove(ch);
     if (ch_hashmap->capa > 32 && (ch_hashmap->pos >> 1) > ch_hashmap->count) {
       fio_hash_compact(ch_hashmap);
     }
   }
-  if ((clients.pos >> 1) > clients.count) {
+  if (use_pattern)
+    rw_unlock_write(&patterns_lock);
+  return ch;
+}
+
+/* frees an empty channel (see `pubsub_channel_leave`) */
+static void pubsub_channel_free(channel_s *ch) {
+  pubsub_on_channel_destroy(ch);
+  fiobj_free(ch->name);
+  free(ch);
+}
+
+/* allocates a client with `count` channel memberships */
+static client_s *pubsub_client_alloc(client_s client, size_t count) {
+  client_s *cl = malloc(sizeof(*cl) + (sizeof(member_s) * count));
+  if (!cl) {
+    perror("FATAL ERROR: (pubsub) client memory allocation error");
+    exit(errno);
+  }
+  *cl = client;
+  cl->ref = 1;
+  cl->sub_count = 1;
+  cl->held = (fio_ls_s)FIO_LS_INIT(cl->held);
+  cl->pending = (fio_ls_s)FIO_LS_INIT(cl->pending);
+  cl->pending_lock = SPN_LOCK_INIT;
+  cl->count = 0;
+  return cl;
+}
+
+static client_s *pubsub_client_new(client_s client, channel_s channel,
+                                   uint8_t replay, uint64_t since) {
+  if (!client.on_message || !channel.name) {
+    fprintf(stderr,
+            "ERROR: (pubsub) subscription request failed. missing on of:\n"
+            "       1. channel name.\n"
+            "       2. massage handler.\n");
+    if (client.on_unsubscribe)
+      client.on_unsubscribe(client.udata1, client.udata2);
+    return NULL;
+  }
+  uint64_t channel_hash = fiobj_obj2hash(channel.name);
+  uint64_t client_hash = client_compute_hash(client);
+  shard_s *shard = PUBSUB_SHARD(channel_hash);
+  rw_lock_write(&shard->lock);
+  /* ignore if client exists. */
+  client_s *cl = fio_hash_find(
+      &shard->clients,
+      (fio_hash_key_s){.hash = client_hash, .obj = channel.name});
+  if (cl) {
+    cl->sub_count++;
+    rw_unlock_write(&shard->lock);
+    return cl;
+  }
+  /* no client, we need a new client */
+  cl = pubsub_client_alloc(client, 1);
+  cl->count = 1;
+  cl->members[0].client = cl;
+
+  fio_hash_insert(&shard->clients,
+                  (fio_hash_key_s){.hash = client_hash, .obj = channel.name},
+                  cl);
+  pubsub_channel_join(shard, channel_hash, channel, cl->members);
+  /* publishing is blocked, so the replay and new messages can't overlap */
+  if (replay && !channel.use_pattern &&
+      pubsub_history_replay(shard, channel_hash, channel.name, cl, since)) {
+    spn_add(&cl->ref, 1);
+    defer(pubsub_en_process_deferred_on_message, cl, NULL);
+  }
+  rw_unlock_write(&shard->lock);
+  return cl;
+}
+
+static int pubsub_group_destroy(client_s *client);
+
+/** Destroys a client (and empty channels as well) */
+static int pubsub_client_destroy(client_s *client) {
+  if (!client || !client->count)
+    return -1;
+  if (client->group)
+    return pubsub_group_destroy(client);
+  channel_s *ch = client->members[0].parent;
+
+  uint64_t channel_hash = fiobj_obj2hash(ch->name);
+  uint64_t client_hash = client_compute_hash(*client);
+  shard_s *shard = PUBSUB_SHARD(channel_hash);
+  rw_lock_write(&shard->lock);
+  if ((client->sub_count -= 1)) {
+    rw_unlock_write(&shard->lock);
+    return 0;
+  }
+  fio_hash_insert(&shard->clients,
+                  (fio_hash_key_s){.hash = client_hash, .obj = ch->name}, NULL);
+  ch = pubsub_channel_leave(shard, channel_hash, client->members);
+  if ((shard->clients.pos >> 1) > shard->clients.count) {
     // fprintf(stderr, "INFO: (pubsub) reducing client hash map %zu",
-    //         (size_t)clients.capa);
-    fio_hash_compact(&clients);
-    // fprintf(stderr, " => %zu (%zu clients)\n", (size_t)clients.capa,
-    //         (size_t)clients.count);
+    //         (size_t)shard->clients.capa);
+    fio_hash_compact(&shard->clients);
+    // fprintf(stderr, " => %zu (%zu clients)\n",
+    //         (size_t)shard->clients.capa, (size_t)shard->clients.count);
   }
-  spn_unlock(&lock);
+  rw_unlock_write(&shard->lock);
   client_test4free(client);
-  if (is_ch_any) {
+  if (ch)
+    pubsub_channel_free(ch);
+  return 0;
+}
+
+/* *****************************************************************************
+Group subscriptions (a single client for a number of channels)
+***************************************************************************** */
+
+static fio_ls_embd_s pubsub_groups = FIO_LS_INIT(pubsub_groups);
+static spn_lock_i pubsub_groups_lock = SPN_LOCK_INIT;
+
+static client_s *pubsub_group_new(client_s client, channel_s channel,
+                                  FIOBJ *channels, size_t count) {
+  size_t valid = 0;
+  for (size_t i = 0; channels && i < count; ++i)
+    valid += (channels[i] != FIOBJ_INVALID);
+  if (!client.on_message || !valid) {
+    fprintf(stderr,
+            "ERROR: (pubsub) subscription request failed. missing on of:\n"
+            "       1. channel names.\n"
+            "       2. massage handler.\n");
+    if (client.on_unsubscribe)
+      client.on_unsubscribe(client.udata1, client.udata2);
+    return NULL;
+  }
+  client_s *cl = pubsub_client_alloc(client, count);
+  cl->group = 1;
+  for (size_t i = 0; i < count; ++i) {
+    if (!channels[i])
+      continue;
+    /* skip duplicates */
+    size_t j = 0;
+    while (j < i && !(channels[j] && fiobj_iseq(channels[j], channels[i])))
+      ++j;
+    if (j < i)
+      continue;
+    fiobj_share(channels[i]);
+    channel.name = channels[i];
+    uint64_t channel_hash = fiobj_obj2hash(channel.name);
+    shard_s *shard = PUBSUB_SHARD(channel_hash);
+    member_s *mb = cl->members + cl->count;
+    mb->client = cl;
+    rw_lock_write(&shard->lock);
+    pubsub_channel_join(shard, channel_hash, channel, mb);
+    ++cl->count;
+    rw_unlock_write(&shard->lock);
+  }
+  spn_lock(&pubsub_groups_lock);
+  fio_ls_embd_push(&pubsub_groups, &cl->group_node);
+  spn_unlock(&pubsub_groups_lock);
+  return cl;
+}
+
+static int pubsub_group_destroy(client_s *client) {
+  if (spn_sub(&client->sub_count, 1))
     return 0;
+  spn_lock(&pubsub_groups_lock);
+  fio_ls_embd_remove(&client->group_node);
+  spn_unlock(&pubsub_groups_lock);
+  for (size_t i = 0; i < client->count; ++i) {
+    member_s *mb = client->members + i;
+    uint64_t channel_hash = fiobj_obj2hash(((channel_s *)mb->parent)->name);
+    shard_s *shard = PUBSUB_SHARD(channel_hash);
+    rw_lock_write(&shard->lock);
+    channel_s *ch = pubsub_channel_leave(shard, channel_hash, mb);
+    rw_unlock_write(&shard->lock);
+    if (ch)
+      pubsub_channel_free(ch);
   }
-  pubsub_on_channel_destroy(ch);
-  fiobj_free(ch->name);
-  free(ch);
+  client_test4free(client);
   return 0;
 }
 
@@ -278,10 +631,12 @@ static inline client_s *pubsub_client_find(client_s client, channel_s channel) {
     return NULL;
   }
   uint64_t client_hash = client_compute_hash(client);
-  spn_lock(&lock);
+  shard_s *shard = PUBSUB_SHARD(fiobj_obj2hash(channel.name));
+  rw_lock_read(&shard->lock);
   client_s *cl = fio_hash_find(
-      &clients, (fio_hash_key_s){.hash = client_hash, .obj = channel.name});
-  spn_unlock(&lock);
+      &shard->clients,
+      (fio_hash_key_s){.hash = client_hash, .obj = channel.name});
+  rw_unlock_read(&shard->lock);
   return cl;
 }
 
@@ -296,6 +651,7 @@ Subscription API
  */
 #undef pubsub_subscribe
 pubsub_sub_pt pubsub_subscribe(struct pubsub_subscribe_args args) {
+  fiobj_share(args.channel);
   channel_s channel = {
       .name = args.channel,
       .clients = FIO_LS_INIT(channel.clients),
@@ -305,12 +661,43 @@ pubsub_sub_pt pubsub_subscribe(struct pubsub_subscribe_args args) {
   client_s client = {.on_message = args.on_message,
                      .on_unsubscribe = args.on_unsubscribe,
                      .udata1 = args.udata1,
-                     .udata2 = args.udata2};
-  return (pubsub_sub_pt)pubsub_client_new(client, channel);
+                     .udata2 = args.udata2,
+                     .delivery = (uint8_t)args.delivery,
+                     .uuid = args.uuid,
+                     .limit = (args.limit ? args.limit
+                                          : PUBSUB_SLOW_CONSUMER_LIMIT)};
+  return (pubsub_sub_pt)pubsub_client_new(client, channel, args.replay,
+                                          args.since);
 }
 #define pubsub_subscribe(...)                                                  \
   pubsub_subscribe((struct pubsub_subscribe_args){__VA_ARGS__})
 
+/**
+ * Subscribes to a group of channels using a single subscription.
+ *
+ * Returns a subscription pointer or NULL (failure).
+ */
+#undef pubsub_subscribe_group
+pubsub_sub_pt pubsub_subscribe_group(struct pubsub_subscribe_args args) {
+  channel_s channel = {
+      .clients = FIO_LS_INIT(channel.clients),
+      .use_pattern = args.use_pattern,
+      .publish2cluster = 1,
+  };
+  client_s client = {.on_message = args.on_message,
+                     .on_unsubscribe = args.on_unsubscribe,
+                     .udata1 = args.udata1,
+                     .udata2 = args.udata2,
+                     .delivery = (uint8_t)args.delivery,
+                     .uuid = args.uuid,
+                     .limit = (args.limit ? args.limit
+                                          : PUBSUB_SLOW_CONSUMER_LIMIT)};
+  return (pubsub_sub_pt)pubsub_group_new(client, channel, args.channels,
+                                         args.count);
+}
+#define pubsub_subscribe_group(...)                                            \
+  pubsub_subscribe_group((struct pubsub_subscribe_args){__VA_ARGS__})
+
 /**
  * This helper searches for an existing subscription.
  *
@@ -338,7 +725,7 @@ pubsub_sub_pt pubsub_find_sub(struct pubsub_subscribe_args args) {
  * To keep the handle beyond the lifetime of the subscription, use `fiobj_dup`.
  */
 FIOBJ pubsub_sub_channel(pubsub_sub_pt sub) {
-  return (((channel_s *)((client_s *)sub)->parent))->name;
+  return (((channel_s *)((client_s *)sub)->members[0].parent))->name;
 }
 
 /**
@@ -357,28 +744,106 @@ int pubsub_unsubscribe(pubsub_sub_pt subscription) {
  *
  * Returns 0 on success and -1 on failure.
  */
+/* returns the engine to use (the default engine if `engine` is NULL) */
+static inline const pubsub_engine_s *
+pubsub_engine_or_default(const pubsub_engine_s *engine) {
+  if (engine)
+    return engine;
+  engine = PUBSUB_DEFAULT_ENGINE;
+  if (!engine) {
+    engine = PUBSUB_CLUSTER_ENGINE;
+    if (!engine) {
+      fprintf(stderr,
+              "FATAL ERROR: (pubsub) engine pointer data corrupted! \n");
+      exit(-1);
+    }
+  }
+  return engine;
+}
+
+/*
+ * returns a reference to `o`, or a copy if `o` is a static String (i.e.,
+ * request data placed in an arena), since static data might be reused before
+ * the message was delivered.
+ */
+static inline FIOBJ pubsub_own(FIOBJ o) {
+  if (fiobj_str_is_static(o))
+    return fiobj_str_copy(o);
+  return fiobj_dup(o);
+}
+
 #undef pubsub_publish
 int pubsub_publish(struct pubsub_message_s m) {
   if (!m.channel || !m.message)
     return -1;
-  if (!m.engine) {
-    m.engine = PUBSUB_DEFAULT_ENGINE;
-    if (!m.engine) {
-      m.engine = PUBSUB_CLUSTER_ENGINE;
-      if (!m.engine) {
-        fprintf(stderr,
-                "FATAL ERROR: (pubsub) engine pointer data corrupted! \n");
-        exit(-1);
-      }
-    }
-  }
-  return m.engine->publish(m.engine, m.channel, m.message);
-  // We don't call `fiobj_free` because the data isn't placed into an accessible
-  // object.
+  m.engine = pubsub_engine_or_default(m.engine);
+  m.channel = pubsub_own(m.channel);
+  m.message = pubsub_own(m.message);
+  fiobj_share(m.channel);
+  fiobj_share(m.message);
+  fio_stats_add(FIO_STATS_PUBLISHED, 1);
+  int ret = m.engine->publish(m.engine, m.channel, m.message);
+  fiobj_free(m.channel);
+  fiobj_free(m.message);
+  return ret;
 }
 #define pubsub_publish(...)                                                    \
   pubsub_publish((struct pubsub_message_s){__VA_ARGS__})
 
+/**
+ * Publishes `count` messages using the same engine.
+ *
+ * Returns the number of messages published or -1 on failure.
+ */
+int pubsub_publish_batch(const pubsub_engine_s *engine, FIOBJ *channels,
+                         FIOBJ *messages, size_t count) {
+  if (!channels || !messages)
+    return -1;
+  for (size_t i = 0; i < count; ++i) {
+    if (!channels[i] || !messages[i])
+      return -1;
+  }
+  engine = pubsub_engine_or_default(engine);
+  /* static Strings are replaced by copies (see `pubsub_own`) */
+  FIOBJ *copy = NULL;
+  for (size_t i = 0; i < count; ++i) {
+    if (!fiobj_str_is_static(channels[i]) && !fiobj_str_is_static(messages[i]))
+      continue;
+    copy = malloc(sizeof(*copy) * count * 2);
+    if (!copy) {
+      perror("FATAL ERROR: (pubsub) publish memory allocation error");
+      exit(errno);
+    }
+    for (size_t j = 0; j < count; ++j) {
+      copy[j] = pubsub_own(channels[j]);
+      copy[count + j] = pubsub_own(messages[j]);
+    }
+    channels = copy;
+    messages = copy + count;
+    break;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    fiobj_share(channels[i]);
+    fiobj_share(messages[i]);
+  }
+  fio_stats_add(FIO_STATS_PUBLISHED, count);
+  int ret = 0;
+  if (engine->publish_batch) {
+    ret = engine->publish_batch(engine, channels, messages, count);
+  } else {
+    for (size_t i = 0; i < count; ++i) {
+      if (!engine->publish(engine, channels[i], messages[i]))
+        ++ret;
+    }
+  }
+  if (copy) {
+    for (size_t i = 0; i < count * 2; ++i)
+      fiobj_free(copy[i]);
+    free(copy);
+  }
+  return ret;
+}
+
 /* *****************************************************************************
 Engine handling and Management
 ***************************************************************************** */
@@ -423,17 +888,9 @@ void pubsub_engine_register(pubsub_engine_s *engine) {
       &engines,
       (fio_hash_key_s){.hash = (uintptr_t)engine, .obj = FIOBJ_INVALID},
       engine);
-  if (engine->subscribe) {
-    FIO_HASH_FOR_LOOP(&channels, i) {
-      channel_s *ch = i->obj;
-      engine->subscribe(engine, ch->name, 0);
-    }
-    FIO_HASH_FOR_LOOP(&patterns, i) {
-      channel_s *ch = i->obj;
-      engine->subscribe(engine, ch->name, 1);
-    }
-  }
   spn_unlock(&engn_lock);
+  if (engine->subscribe)
+    pubsub_engine_resubscribe(engine);
 }
 
 /** Unregisters an engine, so it could be safely destroyed. */
@@ -465,16 +922,20 @@ void pubsub_engine_deregister(pubsub_engine_s *engine) {
  * resubscriptions are under way...
  */
 void pubsub_engine_resubscribe(pubsub_engine_s *eng) {
-  spn_lock(&lock);
-  FIO_HASH_FOR_LOOP(&channels, i) {
-    channel_s *ch = i->obj;
-    eng->subscribe(eng, ch->name, 0);
+  for (size_t n = 0; n < PUBSUB_SHARDS; ++n) {
+    rw_lock_read(&shards[n].lock);
+    FIO_HASH_FOR_LOOP(&shards[n].channels, i) {
+      channel_s *ch = i->obj;
+      eng->subscribe(eng, ch->name, 0);
+    }
+    rw_unlock_read(&shards[n].lock);
   }
+  rw_lock_read(&patterns_lock);
   FIO_HASH_FOR_LOOP(&patterns, i) {
     channel_s *ch = i->obj;
     eng->subscribe(eng, ch->name, 1);
   }
-  spn_unlock(&lock);
+  rw_unlock_read(&patterns_lock);
 }
 
 /* *****************************************************************************
@@ -485,6 +946,14 @@ typedef struct {
   size_t ref;
   FIOBJ channel;
   FIOBJ msg;
+  /* the message's number in the channel's history (0 == no history) */
+  uint64_t seq;
+  /* objects derived from the message, shared by all the recipients */
+  spn_lock_i lock;
+  struct {
+    uintptr_t type;
+    FIOBJ obj;
+  } cache[FIO_PUBBSUB_MESSAGE_CACHE];
 } msg_wrapper_s;
 
 typedef struct {
@@ -492,22 +961,89 @@ typedef struct {
   pubsub_message_s msg;
 } msg_container_s;
 
+/* a slice of a channel's clients, receiving a message in a single task */
+typedef struct {
+  size_t count;
+  void *clients[PUBSUB_DELIVERY_BATCH];
+} delivery_batch_s;
+
+/* *****************************************************************************
+Message wrapper and delivery batch pools
+***************************************************************************** */
+
+/* the number of free objects kept (per type) for reuse */
+#define PUBSUB_POOL_LIMIT 256
+
+typedef struct pubsub_pool_node_s {
+  struct pubsub_pool_node_s *next;
+} pubsub_pool_node_s;
+
+typedef struct {
+  spn_lock_i lock;
+  size_t count;
+  pubsub_pool_node_s *head;
+} pubsub_pool_s;
+
+static pubsub_pool_s wrapper_pool = {.lock = SPN_LOCK_INIT};
+static pubsub_pool_s batch_pool = {.lock = SPN_LOCK_INIT};
+
+static inline void *pubsub_pool_pop(pubsub_pool_s *pool, size_t size) {
+  pubsub_pool_node_s *node;
+  spn_lock(&pool->lock);
+  node = pool->head;
+  if (node) {
+    pool->head = node->next;
+    --pool->count;
+  }
+  spn_unlock(&pool->lock);
+  if (node)
+    return node;
+  node = fio_malloc(size);
+  if (!node) {
+    perror("FATAL ERROR: (pubsub) couldn't allocate message wrapper");
+    exit(errno);
+  }
+  return node;
+}
+
+static inline void pubsub_pool_push(pubsub_pool_s *pool, void *obj) {
+  pubsub_pool_node_s *node = obj;
+  spn_lock(&pool->lock);
+  if (pool->count < PUBSUB_POOL_LIMIT) {
+    node->next = pool->head;
+    pool->head = node;
+    ++pool->count;
+    node = NULL;
+  }
+  spn_unlock(&pool->lock);
+  if (node)
+    fio_free(node);
+}
+
+static void pubsub_pool_clear(pubsub_pool_s *pool) {
+  spn_lock(&pool->lock);
+  while (pool->head) {
+    pubsub_pool_node_s *node = pool->head;
+    pool->head = node->next;
+    fio_free(node);
+  }
+  pool->count = 0;
+  spn_unlock(&pool->lock);
+}
+
 static void msg_wrapper_free(msg_wrapper_s *m) {
   if (spn_sub(&m->ref, 1))
     return;
   fiobj_free(m->channel);
   fiobj_free(m->msg);
-  fio_free(m);
+  for (size_t i = 0; i < FIO_PUBBSUB_MESSAGE_CACHE && m->cache[i].obj; ++i) {
+    fiobj_free(m->cache[i].obj);
+  }
+  pubsub_pool_push(&wrapper_pool, m);
 }
 
-/* calls a client's `on_message` callback */
-void pubsub_en_process_deferred_on_message(void *cl_, void *m_) {
-  msg_wrapper_s *m = m_;
-  client_s *cl = cl_;
-  if (spn_trylock(&cl->lock)) {
-    defer(pubsub_en_process_deferred_on_message, cl, m);
-    return;
-  }
+/* calls a client's `on_message` callback (the client must be locked). */
+static inline void pubsub_client_deliver(client_s *cl, msg_wrapper_s *m) {
   msg_container_s arg = {.wrapper = m,
                          .msg = {
                              .channel = m->channel,
@@ -515,11 +1051,359 @@ void pubsub_en_process_deferred_on_message(void *cl_, void *m_) {
                              .subscription = (pubsub_sub_pt)cl,
                              .udata1 = cl->udata1,
                              .udata2 = cl->udata2,
+                             .seq = m->seq,
                          }};
   cl->on_message(&arg.msg);
-  spn_unlock(&cl->lock);
+  fio_stats_add(FIO_STATS_DELIVERED, 1);
   msg_wrapper_free(m);
-  client_test4free(cl_);
+}
+
+/* *****************************************************************************
+Message history (see `pubsub_history`)
+***************************************************************************** */
+
+/* a channel's latest messages, oldest first (a ring buffer) */
+typedef struct {
+  spn_lock_i lock;
+  /* the last sequence number */
+  uint64_t seq;
+  /* the maximum message age in milliseconds (0 == no limit) */
+  size_t max_age;
+  /* the ring's capacity */
+  size_t limit;
+  /* the oldest message's position */
+  size_t start;
+  /* the number of messages kept */
+  size_t count;
+  struct {
+    msg_wrapper_s *m;
+    uint64_t time;
+  } ring[];
+} history_s;
+
+/* the reactor's time in milliseconds */
+static inline uint64_t pubsub_history_now(void) {
+  struct timespec t = facil_last_tick();
+  return ((uint64_t)t.tv_sec * 1000) + ((uint64_t)t.tv_nsec / 1000000);
+}
+
+/* discards the oldest message (call within the history's lock) */
+static inline void pubsub_history_shift(history_s *h) {
+  msg_wrapper_free(h->ring[h->start].m);
+  h->start = (h->start + 1) % h->limit;
+  --h->count;
+}
+
+/* discards expired messages (call within the history's lock) */
+static inline void pubsub_history_expire(history_s *h, uint64_t now) {
+  if (!h->max_age)
+    return;
+  while (h->count && h->ring[h->start].time + h->max_age < now)
+    pubsub_history_shift(h);
+}
+
+/* numbers and keeps a message (call within the history's lock) */
+static inline void pubsub_history_push(history_s *h, msg_wrapper_s *m) {
+  uint64_t now = pubsub_history_now();
+  pubsub_history_expire(h, now);
+  if (h->count == h->limit)
+    pubsub_history_shift(h);
+  size_t pos = (h->start + h->count) % h->limit;
+  m->seq = ++h->seq;
+  spn_add(&m->ref, 1);
+  h->ring[pos].m = m;
+  h->ring[pos].time = now;
+  ++h->count;
+}
+
+static void pubsub_history_free(history_s *h) {
+  while (h->count)
+    pubsub_history_shift(h);
+  free(h);
+}
+
+/*
+ * queues the messages numbered above `since` for a new client (call within
+ * the shard's write lock), returning the number of messages queued.
+ */
+static size_t pubsub_history_replay(shard_s *shard, uint64_t channel_hash,
+                                    FIOBJ channel, client_s *cl,
+                                    uint64_t since) {
+  if (!shard->history.count)
+    return 0;
+  history_s *h = fio_hash_find(
+      &shard->history, (fio_hash_key_s){.hash = channel_hash, .obj = channel});
+  if (!h)
+    return 0;
+  size_t i = 0;
+  spn_lock(&h->lock);
+  pubsub_history_expire(h, pubsub_history_now());
+  /* the sequence is continuous, so the first message is found directly */
+  if (h->count && since >= h->ring[h->start].m->seq)
+    i = (since - h->ring[h->start].m->seq) + 1;
+  const size_t count = (i < h->count ? h->count - i : 0);
+  spn_lock(&cl->pending_lock);
+  for (; i < h->count; ++i) {
+    msg_wrapper_s *m = h->ring[(h->start + i) % h->limit].m;
+    spn_add(&m->ref, 1);
+    fio_ls_unshift(&cl->pending, m);
+  }
+  spn_unlock(&cl->pending_lock);
+  spn_unlock(&h->lock);
+  return count;
+}
+
+/**
+ * Keeps the latest messages published to a channel, so clients can catch up.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int pubsub_history(FIOBJ channel, size_t limit, size_t max_age) {
+  if (!channel)
+    return -1;
+  history_s *h = NULL;
+  if (limit) {
+    h = malloc(sizeof(*h) + (sizeof(h->ring[0]) * limit));
+    if (!h) {
+      perror("FATAL ERROR: (pubsub) history memory allocation error");
+      exit(errno);
+    }
+    *h = (history_s){
+        .lock = SPN_LOCK_INIT, .max_age = max_age, .limit = limit};
+  }
+  uint64_t channel_hash = fiobj_obj2hash(channel);
+  shard_s *shard = PUBSUB_SHARD(channel_hash);
+  rw_lock_write(&shard->lock);
+  history_s *old = fio_hash_insert(
+      &shard->history, (fio_hash_key_s){.hash = channel_hash, .obj = channel},
+      h);
+  if (old && h) {
+    /* keep the sequence and the latest messages */
+    h->seq = old->seq;
+    while (old->count > limit)
+      pubsub_history_shift(old);
+    while (old->count) {
+      h->ring[h->count++] = old->ring[old->start];
+      old->start = (old->start + 1) % old->limit;
+      --old->count;
+    }
+  }
+  if (!h && (shard->history.pos >> 1) > shard->history.count)
+    fio_hash_compact(&shard->history);
+  rw_unlock_write(&shard->lock);
+  if (old)
+    pubsub_history_free(old);
+  return 0;
+}
+
+/* *****************************************************************************
+Slow consumers (see `pubsub_delivery_e`)
+***************************************************************************** */
+
+static fio_ls_embd_s pubsub_slow = FIO_LS_INIT(pubsub_slow);
+static spn_lock_i pubsub_slow_lock = SPN_LOCK_INIT;
+/* set while the review timer is scheduled / set once the review was run */
+static uint8_t pubsub_slow_scheduled;
+static volatile uint8_t pubsub_slow_reviewed;
+
+static void pubsub_slow_schedule(void);
+
+/* discards a client's held messages (the client must be locked). */
+static void pubsub_client_discard_held(client_s *cl) {
+  msg_wrapper_s *m;
+  while ((m = fio_ls_pop(&cl->held))) {
+    fio_stats_add(FIO_STATS_DROPPED, 1);
+    msg_wrapper_free(m);
+  }
+  cl->held_count = 0;
+}
+
+/* holds a message for a slow consumer (the client must be locked). */
+static void pubsub_client_hold(client_s *cl, msg_wrapper_s *m) {
+  switch ((pubsub_delivery_e)cl->delivery) {
+  case PUBSUB_DELIVER_LATEST:
+    pubsub_client_discard_held(cl);
+    break;
+  case PUBSUB_DELIVER_DROP_OLDEST:
+    if (cl->held_count >= cl->limit) {
+      fio_stats_add(FIO_STATS_DROPPED, 1);
+      msg_wrapper_free(fio_ls_pop(&cl->held));
+      --cl->held_count;
+    }
+    break;
+  case PUBSUB_DELIVER_DISCONNECT:
+    if (cl->held_count >= cl->limit) {
+      pubsub_client_discard_held(cl);
+      fio_stats_add(FIO_STATS_DROPPED, 1);
+      msg_wrapper_free(m);
+      sock_force_close(cl->uuid);
+      return;
+    }
+    break;
+  case PUBSUB_DELIVER_ALL: /* fallthrough */
+  default:
+    break;
+  }
+  fio_ls_unshift(&cl->held, m);
+  ++cl->held_count;
+  if (cl->slow)
+    return;
+  /* the slow consumer list holds a reference to the client */
+  cl->slow = 1;
+  spn_add(&cl->ref, 1);
+  spn_lock(&pubsub_slow_lock);
+  fio_ls_embd_push(&pubsub_slow, &cl->slow_node);
+  spn_unlock(&pubsub_slow_lock);
+  pubsub_slow_schedule();
+}
+
+/*
+ * delivers the held messages once the connection drained, returning 0 if the
+ * client should be removed from the slow consumer list (the client must be
+ * locked).
+ */
+static uint8_t pubsub_client_review(client_s *cl) {
+  if (!cl->sub_count || !sock_isvalid(cl->uuid)) {
+    pubsub_client_discard_held(cl);
+    return 0;
+  }
+  while (cl->held_count &&
+         sock_pending_bytes(cl->uuid) < PUBSUB_SLOW_CONSUMER_BYTES) {
+    --cl->held_count;
+    pubsub_client_deliver(cl, fio_ls_pop(&cl->held));
+  }
+  return cl->held_count != 0;
+}
+
+/* delivers (or holds) a message (the client must be locked). */
+static inline void pubsub_client_receive(client_s *cl, msg_wrapper_s *m) {
+  /* held messages are delivered first, preserving the order */
+  if (cl->delivery != PUBSUB_DELIVER_ALL &&
+      ((cl->held_count && pubsub_client_review(cl)) ||
+       sock_pending_bytes(cl->uuid) >= PUBSUB_SLOW_CONSUMER_BYTES))
+    pubsub_client_hold(cl, m);
+  else
+    pubsub_client_deliver(cl, m);
+}
+
+/* returns the oldest message that arrived while the client was locked */
+static inline msg_wrapper_s *pubsub_client_pending(client_s *cl) {
+  spn_lock(&cl->pending_lock);
+  msg_wrapper_s *m = fio_ls_pop(&cl->pending);
+  spn_unlock(&cl->pending_lock);
+  return m;
+}
+
+/* receives the pending messages and unlocks the client. */
+static void pubsub_client_unlock(client_s *cl) {
+  msg_wrapper_s *m;
+  int any;
+  do {
+    while ((m = pubsub_client_pending(cl)))
+      pubsub_client_receive(cl, m);
+    spn_unlock(&cl->lock);
+    /* messages added before the lock was released are still ours */
+    spn_lock(&cl->pending_lock);
+    any = fio_ls_any(&cl->pending);
+    spn_unlock(&cl->pending_lock);
+  } while (any && !spn_trylock(&cl->lock));
+}
+
+/* tests the slow consumers, delivering held messages. */
+static void pubsub_slow_review(void *ignr) {
+  fio_ls_embd_s list = FIO_LS_INIT(list);
+  pubsub_slow_reviewed = 1;
+  /* messages are delivered outside the list's lock */
+  spn_lock(&pubsub_slow_lock);
+  while (fio_ls_embd_any(&pubsub_slow))
+    fio_ls_embd_push(&list, fio_ls_embd_pop(&pubsub_slow));
+  spn_unlock(&pubsub_slow_lock);
+  while (fio_ls_embd_any(&list)) {
+    client_s *cl =
+        FIO_LS_EMBD_OBJ(client_s, slow_node, fio_ls_embd_pop(&list));
+    if (!spn_trylock(&cl->lock)) {
+      if (!pubsub_client_review(cl)) {
+        cl->slow = 0;
+        pubsub_client_unlock(cl);
+        client_test4free(cl);
+        continue;
+      }
+      pubsub_client_unlock(cl);
+    }
+    spn_lock(&pubsub_slow_lock);
+    fio_ls_embd_push(&pubsub_slow, &cl->slow_node);
+    spn_unlock(&pubsub_slow_lock);
+  }
+  (void)ignr;
+}
+
+/* reschedules the review while there are slow consumers. */
+static void pubsub_slow_on_finish(void *ignr) {
+  uint8_t any;
+  spn_lock(&pubsub_slow_lock);
+  pubsub_slow_scheduled = 0;
+  any = fio_ls_embd_any(&pubsub_slow);
+  spn_unlock(&pubsub_slow_lock);
+  /* don't retry if the timer failed (it never ran) or the server stopped */
+  if (any && pubsub_slow_reviewed && facil_is_running())
+    pubsub_slow_schedule();
+  (void)ignr;
+}
+
+static void pubsub_slow_schedule(void) {
+  spn_lock(&pubsub_slow_lock);
+  if (pubsub_slow_scheduled) {
+    spn_unlock(&pubsub_slow_lock);
+    return;
+  }
+  pubsub_slow_scheduled = 1;
+  pubsub_slow_reviewed = 0;
+  spn_unlock(&pubsub_slow_lock);
+  facil_run_every(PUBSUB_SLOW_CONSUMER_INTERVAL, 1, pubsub_slow_review, NULL,
+                  pubsub_slow_on_finish);
+}
+
+/* releases all the held messages (cleanup). */
+static void pubsub_slow_clear(void) {
+  spn_lock(&pubsub_slow_lock);
+  while (fio_ls_embd_any(&pubsub_slow)) {
+    client_s *cl =
+        FIO_LS_EMBD_OBJ(client_s, slow_node, fio_ls_embd_pop(&pubsub_slow));
+    pubsub_client_discard_held(cl);
+    cl->slow = 0;
+    spn_unlock(&pubsub_slow_lock);
+    client_test4free(cl);
+    spn_lock(&pubsub_slow_lock);
+  }
+  pubsub_slow_scheduled = 0;
+  spn_unlock(&pubsub_slow_lock);
+}
+
+/* *****************************************************************************
+Message delivery
+***************************************************************************** */
+
+/*
+ * delivers a client's pending messages (the message was queued by
+ * `pubsub_en_process_schedule`). If the client is busy, the thread holding the
+ * client's lock delivers the message.
+ */
+static inline void pubsub_en_process_drain(client_s *cl) {
+  if (!spn_trylock(&cl->lock))
+    pubsub_client_unlock(cl);
+  client_test4free(cl);
+}
+
+/* retries a message (see `pubsub_defer`) once the client isn't busy */
+static void pubsub_en_process_deferred_retry(void *cl_, void *m_) {
+  client_s *cl = cl_;
+  if (spn_trylock(&cl->lock)) {
+    defer(pubsub_en_process_deferred_retry, cl, m_);
+    return;
+  }
+  pubsub_client_receive(cl, m_);
+  pubsub_client_unlock(cl);
+  client_test4free(cl);
 }
 
 /* Must subscribe channel. Failures are ignored. */
@@ -537,58 +1421,198 @@ void pubsub_en_process_unsubscribe(const pubsub_engine_s *eng, FIOBJ channel,
   (void)channel;
   (void)use_pattern;
 }
-/** Should return 0 on success and -1 on failure. */
-int pubsub_en_process_publish(const pubsub_engine_s *eng, FIOBJ channel,
-                              FIOBJ msg) {
-  uint64_t channel_hash = fiobj_obj2hash(channel);
-  msg_wrapper_s *m = fio_malloc(sizeof(*m));
-  int ret = -1;
-  if (!m) {
-    perror("FATAL ERROR: (pubsub) couldn't allocate message wrapper");
-    exit(errno);
-  }
+/* wraps a message, so it can be shared by all the clients */
+static inline msg_wrapper_s *pubsub_en_process_wrap(FIOBJ channel, FIOBJ msg) {
+  msg_wrapper_s *m = pubsub_pool_pop(&wrapper_pool, sizeof(*m));
   *m = (msg_wrapper_s){
       .ref = 1, .channel = fiobj_dup(channel), .msg = fiobj_dup(msg)};
-  spn_lock(&lock);
-  {
-    /* test for direct match */
-    channel_s *ch = fio_hash_find(
-        &channels, (fio_hash_key_s){.hash = channel_hash, .obj = channel});
-    if (ch) {
-      ret = 0;
-      FIO_LS_EMBD_FOR(&ch->clients, cl_) {
-        client_s *cl = FIO_LS_EMBD_OBJ(client_s, node, cl_);
-        spn_add(&m->ref, 1);
-        spn_add(&cl->ref, 1);
-        defer(pubsub_en_process_deferred_on_message, cl, m);
-      }
+  return m;
+}
+
+/* delivers a message to a slice of a channel's clients */
+static void pubsub_en_process_deferred_batch(void *b_, void *ignr) {
+  delivery_batch_s *b = b_;
+  for (size_t i = 0; i < b->count; ++i)
+    pubsub_en_process_drain(b->clients[i]);
+  pubsub_pool_push(&batch_pool, b);
+  (void)ignr;
+}
+
+/* delivers a message to a single client */
+static void pubsub_en_process_deferred_on_message(void *cl, void *ignr) {
+  pubsub_en_process_drain(cl);
+  (void)ignr;
+}
+
+/* schedules delivery to a slice of clients (each holds a client reference) */
+static inline void pubsub_en_process_dispatch(delivery_batch_s *b) {
+  if (b->count == 1) {
+    defer(pubsub_en_process_deferred_on_message, b->clients[0], NULL);
+    pubsub_pool_push(&batch_pool, b);
+    return;
+  }
+  defer(pubsub_en_process_deferred_batch, b, NULL);
+}
+
+/*
+ * schedules delivery to a channel's clients.
+ *
+ * The message is queued by each client while the channel is locked, so
+ * concurrently running slices can't reorder a client's messages.
+ */
+static inline void pubsub_en_process_schedule(channel_s *ch, msg_wrapper_s *m) {
+  delivery_batch_s *b = NULL;
+  FIO_LS_EMBD_FOR(&ch->clients, mb) {
+    client_s *cl = FIO_LS_EMBD_OBJ(member_s, node, mb)->client;
+    if (!b) {
+      b = pubsub_pool_pop(&batch_pool, sizeof(*b));
+      b->count = 0;
     }
+    spn_add(&m->ref, 1);
+    spn_lock(&cl->pending_lock);
+    fio_ls_unshift(&cl->pending, m);
+    spn_unlock(&cl->pending_lock);
+    spn_add(&cl->ref, 1);
+    b->clients[b->count++] = cl;
+    if (b->count == PUBSUB_DELIVERY_BATCH) {
+      pubsub_en_process_dispatch(b);
+      b = NULL;
+    }
+  }
+  if (b)
+    pubsub_en_process_dispatch(b);
+}
+
+/*
+ * tests for a direct match (call within the shard's lock), numbering the
+ * message if the channel keeps a history.
+ */
+static inline int pubsub_en_process_match(uint64_t channel_hash,
+                                          msg_wrapper_s *m) {
+  shard_s *shard = PUBSUB_SHARD(channel_hash);
+  const fio_hash_key_s key = {.hash = channel_hash, .obj = m->channel};
+  channel_s *ch = fio_hash_find(&shard->channels, key);
+  history_s *h =
+      (shard->history.count ? fio_hash_find(&shard->history, key) : NULL);
+  if (!h) {
+    if (!ch)
+      return -1;
+    pubsub_en_process_schedule(ch, m);
+    return 0;
   }
-  /* test for pattern match */
-  fio_cstr_s ch_str = fiobj_obj2cstr(channel);
-  FIO_HASH_FOR_LOOP(&patterns, ch_) {
-    channel_s *ch = (channel_s *)ch_->obj;
-    fio_cstr_s tmp = fiobj_obj2cstr(ch->name);
-    if (pubsub_glob_match(ch_str.bytes, ch_str.len, tmp.bytes, tmp.len)) {
-      ret = 0;
-      FIO_LS_EMBD_FOR(&ch->clients, cl_) {
-        client_s *cl = FIO_LS_EMBD_OBJ(client_s, node, cl_);
-        spn_add(&m->ref, 1);
-        spn_add(&cl->ref, 1);
-        defer(pubsub_en_process_deferred_on_message, cl, m);
+  /* the history's lock keeps the delivery order and the sequence in sync */
+  spn_lock(&h->lock);
+  pubsub_history_push(h, m);
+  if (ch)
+    pubsub_en_process_schedule(ch, m);
+  spn_unlock(&h->lock);
+  return (ch ? 0 : -1);
+}
+
+/*
+ * tests for a pattern match, only testing patterns who's literal prefix
+ * matches (call within `patterns_lock`).
+ */
+static inline int pubsub_en_process_match_patterns(msg_wrapper_s *m) {
+  int ret = -1;
+  fio_cstr_s ch_str = fiobj_obj2cstr(m->channel);
+  pattern_node_s *node = &patterns_index;
+  size_t depth = 0;
+  while (node) {
+    FIO_LS_EMBD_FOR(&node->patterns, pos) {
+      channel_s *ch = FIO_LS_EMBD_OBJ(channel_s, index_node, pos);
+      fio_cstr_s tmp = fiobj_obj2cstr(ch->name);
+      /* the prefix was matched by the index */
+      if (pubsub_glob_match(ch_str.bytes + depth, ch_str.len - depth,
+                            tmp.bytes + depth, tmp.len - depth)) {
+        ret = 0;
+        pubsub_en_process_schedule(ch, m);
       }
     }
+    if (depth == ch_str.len)
+      break;
+    node = pattern_node_child(node, ch_str.bytes[depth++]);
   }
-  spn_unlock(&lock);
+  return ret;
+}
+
+/** Should return 0 on success and -1 on failure. */
+int pubsub_en_process_publish(const pubsub_engine_s *eng, FIOBJ channel,
+                              FIOBJ msg) {
+  uint64_t channel_hash = fiobj_obj2hash(channel);
+  msg_wrapper_s *m = pubsub_en_process_wrap(channel, msg);
+  shard_s *shard = PUBSUB_SHARD(channel_hash);
+  rw_lock_read(&shard->lock);
+  int ret = pubsub_en_process_match(channel_hash, m);
+  rw_unlock_read(&shard->lock);
+  rw_lock_read(&patterns_lock);
+  if (!pubsub_en_process_match_patterns(m))
+    ret = 0;
+  rw_unlock_read(&patterns_lock);
   msg_wrapper_free(m);
   return ret;
   (void)eng;
 }
 
+/* the number of messages handled together by a batch publication */
+#define PUBSUB_PUBLISH_BATCH_ROUND 64
+
+/**
+ * Publishes a batch of messages.
+ *
+ * A shard's lock is held for consecutive messages to the same shard (i.e., the
+ * same channel) and the patterns are tested for the whole round while holding
+ * `patterns_lock` once. Each client receives the messages in order.
+ */
+int pubsub_en_process_publish_batch(const pubsub_engine_s *eng,
+                                    FIOBJ *channels, FIOBJ *msgs,
+                                    size_t count) {
+  msg_wrapper_s *m[PUBSUB_PUBLISH_BATCH_ROUND];
+  uint8_t published[PUBSUB_PUBLISH_BATCH_ROUND];
+  int ret = 0;
+  while (count) {
+    size_t round = count;
+    if (round > PUBSUB_PUBLISH_BATCH_ROUND)
+      round = PUBSUB_PUBLISH_BATCH_ROUND;
+    /* shard locks are always acquired before `patterns_lock` */
+    shard_s *locked = NULL;
+    for (size_t i = 0; i < round; ++i) {
+      uint64_t channel_hash = fiobj_obj2hash(channels[i]);
+      shard_s *shard = PUBSUB_SHARD(channel_hash);
+      m[i] = pubsub_en_process_wrap(channels[i], msgs[i]);
+      if (shard != locked) {
+        if (locked)
+          rw_unlock_read(&locked->lock);
+        rw_lock_read(&shard->lock);
+        locked = shard;
+      }
+      published[i] = !pubsub_en_process_match(channel_hash, m[i]);
+    }
+    if (locked)
+      rw_unlock_read(&locked->lock);
+    rw_lock_read(&patterns_lock);
+    for (size_t i = 0; i < round; ++i) {
+      if (!pubsub_en_process_match_patterns(m[i]))
+        published[i] = 1;
+    }
+    rw_unlock_read(&patterns_lock);
+    for (size_t i = 0; i < round; ++i) {
+      ret += published[i];
+      msg_wrapper_free(m[i]);
+    }
+    channels += round;
+    msgs += round;
+    count -= round;
+  }
+  return ret;
+  (void)eng;
+}
+
 const pubsub_engine_s PUBSUB_PROCESS_ENGINE_S = {
     .subscribe = pubsub_en_process_subscribe,
     .unsubscribe = pubsub_en_process_unsubscribe,
     .publish = pubsub_en_process_publish,
+    .publish_batch = pubsub_en_process_publish_batch,
 };
 
 const pubsub_engine_s *PUBSUB_PROCESS_ENGINE = &PUBSUB_PROCESS_ENGINE_S;
@@ -612,10 +1636,34 @@ void pubsub_defer(pubsub_message_s *msg) {
   msg_container_s *arg = FIO_LS_EMBD_OBJ(msg_container_s, msg, msg);
   spn_add(&arg->wrapper->ref, 1);
   spn_add(&((client_s *)arg->msg.subscription)->ref, 1);
-  defer(pubsub_en_process_deferred_on_message, arg->msg.subscription,
+  defer(pubsub_en_process_deferred_retry, arg->msg.subscription,
         arg->wrapper);
 }
 
+/**
+ * Returns an object derived from the message, calling `encode` only once per
+ * message.
+ */
+FIOBJ pubsub_cache(pubsub_message_s *msg, uintptr_t type,
+                   FIOBJ (*encode)(pubsub_message_s *msg, uintptr_t type)) {
+  msg_wrapper_s *m = FIO_LS_EMBD_OBJ(msg_container_s, msg, msg)->wrapper;
+  FIOBJ ret = FIOBJ_INVALID;
+  spn_lock(&m->lock);
+  for (size_t i = 0; i < FIO_PUBBSUB_MESSAGE_CACHE; ++i) {
+    if (!m->cache[i].obj) {
+      ret = m->cache[i].obj = encode(msg, type);
+      m->cache[i].type = type;
+      break;
+    }
+    if (m->cache[i].type == type) {
+      ret = m->cache[i].obj;
+      break;
+    }
+  }
+  spn_unlock(&m->lock);
+  return ret;
+}
+
 /* *****************************************************************************
 Cluster Engine
 ***************************************************************************** */
@@ -652,10 +1700,24 @@ int pubsub_en_cluster_publish(const pubsub_engine_s *eng, FIOBJ channel,
   (void)eng;
 }
 
+/** Returns the number of messages published by this process. */
+int pubsub_en_cluster_publish_batch(const pubsub_engine_s *eng,
+                                    FIOBJ *channels, FIOBJ *msgs,
+                                    size_t count) {
+  if (facil_is_running()) {
+    facil_cluster_send_batch(PUBSUB_FACIL_CLUSTER_CHANNEL_FILTER, channels,
+                             msgs, count);
+  }
+  return pubsub_en_process_publish_batch(PUBSUB_PROCESS_ENGINE, channels, msgs,
+                                         count);
+  (void)eng;
+}
+
 const pubsub_engine_s PUBSUB_CLUSTER_ENGINE_S = {
     .subscribe = pubsub_en_cluster_subscribe,
     .unsubscribe = pubsub_en_cluster_unsubscribe,
     .publish = pubsub_en_cluster_publish,
+    .publish_batch = pubsub_en_cluster_publish_batch,
 };
 
 pubsub_engine_s const *PUBSUB_CLUSTER_ENGINE = &PUBSUB_CLUSTER_ENGINE_S;
@@ -677,7 +1739,7 @@ static void pubsub_cluster_subscribe2channel(void *ch, void *flag) {
       .publish2cluster = 0,
   };
   client_s client = {.on_message = pubsub_cluster_on_message_noop};
-  pubsub_client_new(client, channel);
+  pubsub_client_new(client, channel, 0, 0);
 }
 
 /* deregisters from the channel if required */
@@ -730,18 +1792,41 @@ void pubsub_cluster_init(void) {
                             pubsub_cluster_facil_message);
 }
 
+/* resets all the registry locks (the forking thread might have held them). */
+static void pubsub_reset_locks(void) {
+  for (size_t n = 0; n < PUBSUB_SHARDS; ++n) {
+    shards[n].lock = (rw_lock_s)RW_LOCK_INIT;
+  }
+  patterns_lock = (rw_lock_s)RW_LOCK_INIT;
+}
+
 void pubsub_cluster_on_fork_start(void) {
-  lock = SPN_LOCK_INIT;
-  FIO_HASH_FOR_LOOP(&clients, pos) {
-    if (pos->obj) {
-      client_s *c = pos->obj;
-      c->lock = SPN_LOCK_INIT;
+  pubsub_reset_locks();
+  for (size_t n = 0; n < PUBSUB_SHARDS; ++n) {
+    FIO_HASH_FOR_LOOP(&shards[n].clients, pos) {
+      if (pos->obj) {
+        client_s *c = pos->obj;
+        c->lock = SPN_LOCK_INIT;
+        c->pending_lock = SPN_LOCK_INIT;
+      }
+    }
+    FIO_HASH_FOR_LOOP(&shards[n].history, pos) {
+      if (pos->obj)
+        ((history_s *)pos->obj)->lock = SPN_LOCK_INIT;
     }
   }
+  pubsub_groups_lock = SPN_LOCK_INIT;
+  FIO_LS_EMBD_FOR(&pubsub_groups, pos) {
+    FIO_LS_EMBD_OBJ(client_s, group_node, pos)->lock = SPN_LOCK_INIT;
+    FIO_LS_EMBD_OBJ(client_s, group_node, pos)->pending_lock = SPN_LOCK_INIT;
+  }
 }
 
 void pubsub_cluster_on_fork_end(void) {
-  lock = SPN_LOCK_INIT;
+  pubsub_reset_locks();
+  /* the review timer belongs to the parent process */
+  pubsub_slow_lock = SPN_LOCK_INIT;
+  pubsub_slow_scheduled = 0;
   FIO_HASH_FOR_LOOP(&engines, pos) {
     if (pos->obj) {
       pubsub_engine_s *e = pos->obj;
@@ -752,18 +1837,32 @@ void pubsub_cluster_on_fork_end(void) {
 }
 
 void pubsub_cluster_cleanup(void) {
-  while (clients.count) {
-    pubsub_client_destroy(fio_hash_last(&clients, NULL));
+  pubsub_slow_clear();
+  pubsub_pool_clear(&wrapper_pool);
+  pubsub_pool_clear(&batch_pool);
+  while (fio_ls_embd_any(&pubsub_groups)) {
+    pubsub_group_destroy(
+        FIO_LS_EMBD_OBJ(client_s, group_node, pubsub_groups.next));
+  }
+  for (size_t n = 0; n < PUBSUB_SHARDS; ++n) {
+    while (shards[n].clients.count) {
+      pubsub_client_destroy(fio_hash_last(&shards[n].clients, NULL));
+    }
+    FIO_HASH_FOR_FREE(&shards[n].clients, pos) {}
+    FIO_HASH_FOR_FREE(&shards[n].history, pos) {
+      if (pos->obj)
+        pubsub_history_free(pos->obj);
+    }
+    fio_hash_free(&shards[n].channels);
+    shards[n].clients = (fio_hash_s)FIO_HASH_INIT;
+    shards[n].channels = (fio_hash_s)FIO_HASH_INIT;
+    shards[n].history = (fio_hash_s)FIO_HASH_INIT;
   }
-  FIO_HASH_FOR_FREE(&clients, pos) {}
   fio_hash_free(&engines);
-  fio_hash_free(&channels);
   fio_hash_free(&patterns);
-  clients = (fio_hash_s)FIO_HASH_INIT;
   engines = (fio_hash_s)FIO_HASH_INIT;
-  channels = (fio_hash_s)FIO_HASH_INIT;
   patterns = (fio_hash_s)FIO_HASH_INIT;
-  lock = SPN_LOCK_INIT;
+  pubsub_reset_locks();
 }
 
 /* *****************************************************************************
@@ -31,9 +31,66 @@ extern "C" {
 #define FIO_PUBBSUB_MAX_CHANNEL_LEN 1024
 #endif
 
+/** The number of derived objects a message can cache (see `pubsub_cache`). */
+#ifndef FIO_PUBBSUB_MESSAGE_CACHE
+#define FIO_PUBBSUB_MESSAGE_CACHE 4
+#endif
+
+/**
+ * The number of bytes waiting in a connection's outgoing queue that marks the
+ * connection as a slow consumer (see `pubsub_delivery_e`).
+ */
+#ifndef PUBSUB_SLOW_CONSUMER_BYTES
+#define PUBSUB_SLOW_CONSUMER_BYTES 65536
+#endif
+
+/** The default number of messages held for a slow consumer. */
+#ifndef PUBSUB_SLOW_CONSUMER_LIMIT
+#define PUBSUB_SLOW_CONSUMER_LIMIT 256
+#endif
+
+/**
+ * The interval (in milliseconds) at which slow consumers are tested, so held
+ * messages can be delivered.
+ */
+#ifndef PUBSUB_SLOW_CONSUMER_INTERVAL
+#define PUBSUB_SLOW_CONSUMER_INTERVAL 10
+#endif
+
+/**
+ * The number of clients that receive a message within a single deferred task.
+ * Large channels are split into slices of this size, so the delivery is still
+ * spread across the worker threads.
+ */
+#ifndef PUBSUB_DELIVERY_BATCH
+#define PUBSUB_DELIVERY_BATCH 64
+#endif
+
 /** An opaque pointer used to identify a subscription. */
 typedef struct pubsub_sub_s *pubsub_sub_pt;
 
+/**
+ * Delivery policies for subscriptions forwarding messages to a connection
+ * (the `uuid` subscription argument).
+ *
+ * Once the connection's outgoing queue exceeds `PUBSUB_SLOW_CONSUMER_BYTES`,
+ * messages are held (rather than delivered) until the queue drains, at which
+ * point the held messages are delivered in order.
+ */
+typedef enum {
+  /** every message is delivered (no messages are held). */
+  PUBSUB_DELIVER_ALL = 0,
+  /**
+   * only the latest message is held (conflation), older held messages are
+   * discarded.
+   */
+  PUBSUB_DELIVER_LATEST,
+  /** up to `limit` messages are held, discarding the oldest messages. */
+  PUBSUB_DELIVER_DROP_OLDEST,
+  /** up to `limit` messages are held, after which the connection is closed. */
+  PUBSUB_DELIVER_DISCONNECT,
+} pubsub_delivery_e;
+
 /** A pub/sub engine data structure. See details later on. */
 typedef struct pubsub_engine_s pubsub_engine_s;
 
@@ -68,9 +125,17 @@ typedef struct pubsub_message_s {
   void *udata1;
   /** Client opaque data pointer (from the `subscribe`) function call. */
   void *udata2;
+  /**
+   * The message's sequence number within the channel's history, or 0 if the
+   * channel keeps no history (see `pubsub_history`). Ignored when publishing.
+   */
+  uint64_t seq;
 } pubsub_message_s;
 
-/** The arguments used for `pubsub_subscribe` or `pubsub_find_sub`. */
+/**
+ * The arguments used for `pubsub_subscribe`, `pubsub_subscribe_group` or
+ * `pubsub_find_sub`.
+ */
 struct pubsub_subscribe_args {
   /** The channel namr used for the subscription. */
   FIOBJ channel;
@@ -84,6 +149,29 @@ struct pubsub_subscribe_args {
   void *udata2;
   /** Use pattern matching for channel subscription. */
   unsigned use_pattern : 1;
+  /**
+   * Replays the channel's history (messages numbered above `since`) before
+   * any new messages are delivered (see `pubsub_history`). Ignored for
+   * patterns and group subscriptions.
+   */
+  unsigned replay : 1;
+  /** The last sequence number the client received (see `replay`). */
+  uint64_t since;
+  /** The delivery policy for slow connections (requires `uuid`). */
+  pubsub_delivery_e delivery;
+  /** The connection receiving the messages (see `delivery`). */
+  intptr_t uuid;
+  /**
+   * The maximum number of messages held for a slow connection (see
+   * `delivery`). Defaults to PUBSUB_SLOW_CONSUMER_LIMIT.
+   */
+  size_t limit;
+  /**
+   * The channels used for a group subscription (see `pubsub_subscribe_group`).
+   */
+  FIOBJ *channels;
+  /** The number of channels in `channels`. */
+  size_t count;
 };
 
 /**
@@ -95,6 +183,27 @@ pubsub_sub_pt pubsub_subscribe(struct pubsub_subscribe_args);
 #define pubsub_subscribe(...)                                                  \
   pubsub_subscribe((struct pubsub_subscribe_args){__VA_ARGS__})
 
+/**
+ * Subscribes to a group of channels (`channels` and `count`) using a single
+ * subscription, so all the channels share the same client record, callbacks
+ * and delivery policy (the `channel` argument is ignored).
+ *
+ * This is cheaper than subscribing to each channel separately when a
+ * connection subscribes to a large number of channels, as only a single
+ * allocation is made and a single `pubsub_unsubscribe` call cancels the whole
+ * group.
+ *
+ * Duplicate channel names are ignored. Group subscriptions aren't merged with
+ * other subscriptions and can't be found using `pubsub_find_sub`.
+ *
+ * `pubsub_sub_channel` returns the group's first channel.
+ *
+ * Returns a subscription pointer or NULL (failure).
+ */
+pubsub_sub_pt pubsub_subscribe_group(struct pubsub_subscribe_args);
+#define pubsub_subscribe_group(...)                                            \
+  pubsub_subscribe_group((struct pubsub_subscribe_args){__VA_ARGS__})
+
 /**
  * This helper searches for an existing subscription.
  *
@@ -139,6 +248,43 @@ int pubsub_publish(struct pubsub_message_s);
 #define pubsub_publish(...)                                                    \
   pubsub_publish((struct pubsub_message_s){__VA_ARGS__})
 
+/**
+ * Publishes `count` messages, where `messages[i]` is published to
+ * `channels[i]`, using the same engine (NULL for the default engine).
+ *
+ * Engines that support batching (see `pubsub_engine_s`) handle the whole batch
+ * at once (i.e., the cluster engine sends the batch to the other processes
+ * using a single lock acquisition). Otherwise, the messages are published one
+ * at a time.
+ *
+ * Returns the number of messages published (for the process engine, the number
+ * of messages with known subscriptions) or -1 on failure (i.e., a missing
+ * channel or message, in which case nothing is published).
+ *
+ * NOTE: Memory ownership is retained by the calling function.
+ */
+int pubsub_publish_batch(const pubsub_engine_s *engine, FIOBJ *channels,
+                         FIOBJ *messages, size_t count);
+
+/**
+ * Keeps the latest `limit` messages published to `channel` (an exact channel
+ * name, not a pattern) that are no older than `max_age` milliseconds (0 for no
+ * age limit), so reconnecting clients can catch up using the `replay` and
+ * `since` subscription arguments.
+ *
+ * The messages are numbered in the order they were published (see
+ * `pubsub_message_s.seq`), starting at 1. Changing the limits keeps the
+ * sequence and the latest messages. A `limit` of 0 discards the history (and
+ * resets the sequence).
+ *
+ * The history is kept by each process, so sequence numbers aren't shared
+ * between the processes of a cluster. Set the history before forking for all
+ * the worker processes to keep it.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int pubsub_history(FIOBJ channel, size_t limit, size_t max_age);
+
 /**
  * defers message hadling if it can't be performed (i.e., resource is busy) or
  * should be fragmented (allowing large tasks to be broken down).
@@ -156,6 +302,24 @@ int pubsub_publish(struct pubsub_message_s);
  */
 void pubsub_defer(pubsub_message_s *msg);
 
+/**
+ * Returns an object derived from the message (i.e., an encoded network frame),
+ * calling `encode` only once per message, so the result can be shared by all
+ * the message's recipients.
+ *
+ * Different encodings of the same message should use a different `type`.
+ *
+ * The object belongs to the message and MUST NOT be freed or edited. Use
+ * `fiobj_dup` to hold on to it beyond the `on_message` callback.
+ *
+ * Returns FIOBJ_INVALID if the message can't cache any more objects (or if
+ * `encode` returned FIOBJ_INVALID).
+ *
+ * This should only be called from within the `on_message` callback.
+ */
+FIOBJ pubsub_cache(pubsub_message_s *msg, uintptr_t type,
+                   FIOBJ (*encode)(pubsub_message_s *msg, uintptr_t type));
+
 /**
  * Pub/Sub services (engines) MUST provide the listed function pointers.
  *
@@ -185,6 +349,16 @@ struct pubsub_engine_s {
                       uint8_t use_pattern);
   /** Should return 0 on success and -1 on failure. */
   int (*publish)(const pubsub_engine_s *eng, FIOBJ channel, FIOBJ msg);
+  /**
+   * Optional. Publishes `count` messages (see `pubsub_publish_batch`).
+   *
+   * Should return the number of messages published (i.e., the number of times
+   * `publish` would have returned 0).
+   *
+   * When missing, `publish` is called for each message.
+   */
+  int (*publish_batch)(const pubsub_engine_s *eng, FIOBJ *channels,
+                       FIOBJ *msgs, size_t count);
   /**
    * facil.io will call this callback whenever starting, or restarting, the
    * reactor.
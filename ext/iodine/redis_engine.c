@@ -12,13 +12,31 @@ Feel free to copy, use and enjoy according to the license provided.
 #include "resp_parser.h"
 
 #define REDIS_READ_BUFFER 8192
+
+#ifndef REDIS_CLUSTER_NODES_LIMIT
+/** The maximum number of nodes (shards) a Redis Cluster engine will track. */
+#define REDIS_CLUSTER_NODES_LIMIT 64
+#endif
+
+#if REDIS_CLUSTER_NODES_LIMIT > 255
+#error REDIS_CLUSTER_NODES_LIMIT must fit in a byte.
+#endif
+
+/** Redis Cluster's hash slot count. */
+#define REDIS_CLUSTER_SLOTS 16384
 /* *****************************************************************************
 The Redis Engine and Callbacks Object
 ***************************************************************************** */
 
+struct redis_cluster_s;
+
 typedef struct {
   uintptr_t id_protection;
   pubsub_engine_s en;
+  /* (cluster mode) subscribes only the channels owned by this node */
+  pubsub_engine_s shard;
+  /* (cluster mode) the slot map, shared by the nodes */
+  struct redis_cluster_s *cluster;
   struct redis_engine_internal_s {
     protocol_s protocol;
     uintptr_t uuid;
@@ -28,8 +46,20 @@ typedef struct {
     FIOBJ ary;
     uintptr_t ary_count;
     uintptr_t buf_pos;
+    /* subscription replies are collected without an Array (see below) */
+    FIOBJ elements[4];
+    uintptr_t el_count;
+    uintptr_t str_pos;
+    uint8_t str_mode;
+    uint8_t in_array;
+    uint8_t kind_len;
+    uint8_t kind[13];
   } pub_data, sub_data;
   fio_ls_embd_s callbacks;
+  /* the newest command written to the publishing connection (if any) */
+  fio_ls_embd_s *last_sent;
+  /* the number of commands written and waiting for a reply */
+  size_t sent;
   spn_lock_i lock;
   char *address;
   char *port;
@@ -38,7 +68,8 @@ typedef struct {
   size_t auth_len;
   size_t ref;
   uint8_t ping_int;
-  uint8_t sent;
+  uint8_t binary;
+  uint8_t scheduled;
   uint8_t flag;
   uint8_t buf[];
 } redis_engine_s;
@@ -54,6 +85,26 @@ typedef struct {
 /** converst from a `pubsub_engine_s` to a `redis_engine_s`. */
 #define en2redis(e) FIO_LS_EMBD_OBJ(redis_engine_s, en, (e))
 
+/** converst from the `shard` engine to a `redis_engine_s`. */
+#define shard2redis(e) FIO_LS_EMBD_OBJ(redis_engine_s, shard, (e))
+
+/*
+ * Redis Cluster routing data.
+ *
+ * `nodes[0]` is the engine created by the user (the seed node). Other nodes are
+ * discovered by following `MOVED` redirections and they share the seed's
+ * settings. `slots` maps each hash slot to the index of the owning node.
+ */
+typedef struct redis_cluster_s {
+  redis_engine_s *nodes[REDIS_CLUSTER_NODES_LIMIT];
+  size_t count;
+  spn_lock_i lock;
+  uint8_t ping_int;
+  size_t auth_len;
+  char *auth;
+  uint8_t slots[REDIS_CLUSTER_SLOTS];
+} redis_cluster_s;
+
 /** converst from a `protocol_s` to a `redis_engine_s`. */
 #define prot2redis(prot)                                                       \
   ((FIO_LS_EMBD_OBJ(struct redis_engine_internal_s, protocol, (prot))->is_pub) \
@@ -69,17 +120,33 @@ typedef struct {
        ? FIO_LS_EMBD_OBJ(redis_engine_s, pub_data.parser, (prsr))              \
        : FIO_LS_EMBD_OBJ(redis_engine_s, sub_data.parser, (prsr)))
 
+/** frees any partially parsed reply. */
+static inline void redis_internal_reset(struct redis_engine_internal_s *i) {
+  fiobj_free(i->ary ? i->ary : i->str);
+  i->ary = i->str = FIOBJ_INVALID;
+  for (size_t n = 0; n < 4; ++n) {
+    fiobj_free(i->elements[n]);
+    i->elements[n] = FIOBJ_INVALID;
+  }
+  i->el_count = 0;
+  i->in_array = 0;
+}
+
 /** cleans up and frees the engine data. */
 static inline void redis_free(redis_engine_s *r) {
   if (spn_sub(&r->ref, 1))
     return;
-  fiobj_free(r->pub_data.ary ? r->pub_data.ary : r->pub_data.str);
-  fiobj_free(r->sub_data.ary ? r->sub_data.ary : r->sub_data.str);
+  redis_internal_reset(&r->pub_data);
+  redis_internal_reset(&r->sub_data);
   fiobj_free(r->last_ch);
   while (fio_ls_embd_any(&r->callbacks)) {
     free(FIO_LS_EMBD_OBJ(redis_commands_s, node,
                          fio_ls_embd_pop(&r->callbacks)));
   }
+  if (r->cluster && r->cluster->nodes[0] == r) {
+    free(r->cluster->auth);
+    free(r->cluster);
+  }
   free(r);
 }
 
@@ -105,25 +172,33 @@ static void redis_perform_callback(void *e, void *cmd_) {
   free(cmd);
 }
 
-/* send the necxt command in the queue */
+/*
+ * Sends all the commands waiting in the queue (pipelining).
+ *
+ * Commands are kept in the queue until a reply arrives, so they can be resent
+ * if the connection is lost. The oldest command is at the tail of the list.
+ */
 static void redis_send_cmd_queue(void *r_, void *ignr) {
   redis_engine_s *r = r_;
-  if (!r->pub_data.uuid)
-    return;
   spn_lock(&r->lock);
-  if (r->sent == 0 && fio_ls_embd_any(&r->callbacks)) {
-    redis_commands_s *cmd =
-        FIO_LS_EMBD_OBJ(redis_commands_s, node, r->callbacks.prev);
-    intptr_t uuid = r->pub_data.uuid;
-    r->sent = 1;
+  r->scheduled = 0;
+  intptr_t uuid = r->pub_data.uuid;
+  if (!uuid) {
     spn_unlock(&r->lock);
+    return;
+  }
+  fio_ls_embd_s *pos = (r->last_sent ? r->last_sent : &r->callbacks)->prev;
+  /* the lock is held while writing, so the command order is preserved */
+  while (pos != &r->callbacks) {
+    redis_commands_s *cmd = FIO_LS_EMBD_OBJ(redis_commands_s, node, pos);
     // fprintf(stderr, "Sending: %s\n", cmd->cmd);
     sock_write2(.uuid = uuid, .buffer = cmd->cmd, .length = cmd->cmd_len,
                 .dealloc = SOCK_DEALLOC_NOOP);
-  } else {
-    r->sent = 0;
-    spn_unlock(&r->lock);
+    r->last_sent = pos;
+    ++r->sent;
+    pos = pos->prev;
   }
+  spn_unlock(&r->lock);
   (void)ignr;
 }
 
@@ -131,21 +206,41 @@ static void redis_attach_cmd(redis_engine_s *r, redis_commands_s *cmd) {
   uint8_t schedule = 0;
   spn_lock(&r->lock);
   fio_ls_embd_push(&r->callbacks, &cmd->node);
-  if (r->sent == 0) {
+  if (r->scheduled == 0) {
+    r->scheduled = 1;
     schedule = 1;
   }
   spn_unlock(&r->lock);
   if (schedule) {
+    /* commands attached during this cycle will be sent together. */
     defer(redis_send_cmd_queue, r, NULL);
   }
 }
 
-static void redis_cmd_reply(redis_engine_s *r, FIOBJ reply) {
+/* attaches a list of commands, so they're sent together and in order */
+static void redis_attach_cmds(redis_engine_s *r, fio_ls_embd_s *cmds) {
   uint8_t schedule = 0;
+  fio_ls_embd_s *node;
   spn_lock(&r->lock);
-  r->sent = 0;
-  fio_ls_embd_s *node = fio_ls_embd_shift(&r->callbacks);
-  schedule = fio_ls_embd_any(&r->callbacks);
+  while ((node = fio_ls_embd_shift(cmds)))
+    fio_ls_embd_push(&r->callbacks, node);
+  if (r->scheduled == 0) {
+    r->scheduled = 1;
+    schedule = 1;
+  }
+  spn_unlock(&r->lock);
+  if (schedule)
+    defer(redis_send_cmd_queue, r, NULL);
+}
+
+static void redis_cmd_reply(redis_engine_s *r, FIOBJ reply) {
+  fio_ls_embd_s *node = NULL;
+  spn_lock(&r->lock);
+  if (r->sent) {
+    node = fio_ls_embd_shift(&r->callbacks);
+    if (--r->sent == 0)
+      r->last_sent = NULL;
+  }
   spn_unlock(&r->lock);
   if (!node) {
     /* TODO: possible ping? from server?! not likely... */
@@ -154,8 +249,6 @@ static void redis_cmd_reply(redis_engine_s *r, FIOBJ reply) {
     return;
   }
   node->next = (void *)fiobj_dup(reply);
-  if (schedule)
-    defer(redis_send_cmd_queue, r, NULL);
   defer(redis_perform_callback, &r->en,
         FIO_LS_EMBD_OBJ(redis_commands_s, node, node));
 }
@@ -189,21 +282,19 @@ static void redis_on_pub_connect(intptr_t uuid, void *pr) {
     return;
   }
 
+  /* unanswered commands are resent using the new connection */
+  spn_lock(&r->lock);
+  r->sent = 0;
+  r->last_sent = NULL;
   if (r->auth) {
     redis_commands_s *cmd = malloc(sizeof(*cmd) + r->auth_len);
     *cmd =
         (redis_commands_s){.cmd_len = r->auth_len, .callback = redis_on_auth};
     memcpy(cmd->cmd, r->auth, r->auth_len);
-    spn_lock(&r->lock);
     fio_ls_embd_unshift(&r->callbacks, &cmd->node);
-    r->sent = 1;
-    spn_unlock(&r->lock);
-    sock_write2(.uuid = uuid, .buffer = cmd->cmd, .length = cmd->cmd_len,
-                .dealloc = SOCK_DEALLOC_NOOP);
-  } else {
-    r->sent = 0;
-    defer(redis_send_cmd_queue, r, NULL);
   }
+  spn_unlock(&r->lock);
+  redis_send_cmd_queue(r, NULL);
   fprintf(stderr, "INFO: (redis %d) publishing connection established.\n",
           (int)getpid());
 }
@@ -222,7 +313,8 @@ static void redis_on_sub_connect(intptr_t uuid, void *pr) {
   if (r->auth)
     sock_write2(.uuid = uuid, .buffer = r->auth, .length = r->auth_len,
                 .dealloc = SOCK_DEALLOC_NOOP);
-  pubsub_engine_resubscribe(&r->en);
+  /* in cluster mode, only the channels owned by this node are resubscribed */
+  pubsub_engine_resubscribe(r->cluster ? &r->shard : &r->en);
   if (!r->pub_data.uuid) {
     spn_add(&r->ref, 1);
     redis_on_pub_connect_fail(uuid, pr);
@@ -305,10 +397,12 @@ static void redis_on_data(intptr_t uuid, protocol_s *pr) {
 
 static void redis_pub_on_close(intptr_t uuid, protocol_s *pr) {
   redis_engine_s *r = prot2redis(pr);
-  fiobj_free(r->pub_data.ary ? r->pub_data.ary : r->pub_data.str);
-  r->pub_data.ary = r->pub_data.str = FIOBJ_INVALID;
+  redis_internal_reset(&r->pub_data);
+  spn_lock(&r->lock);
   r->pub_data.uuid = 0;
   r->sent = 0;
+  r->last_sent = NULL;
+  spn_unlock(&r->lock);
   if (r->flag && facil_is_running()) {
     fprintf(stderr,
             "WARNING: (redis %d) lost publishing connection to database\n",
@@ -321,8 +415,7 @@ static void redis_pub_on_close(intptr_t uuid, protocol_s *pr) {
 
 static void redis_sub_on_close(intptr_t uuid, protocol_s *pr) {
   redis_engine_s *r = prot2redis(pr);
-  fiobj_free(r->sub_data.ary ? r->sub_data.ary : r->sub_data.str);
-  r->sub_data.ary = r->sub_data.str = FIOBJ_INVALID;
+  redis_internal_reset(&r->sub_data);
   r->sub_data.uuid = 0;
   if (r->flag && facil_is_running() && facil_parent_pid() == getpid()) {
     fprintf(stderr,
@@ -364,63 +457,104 @@ static void redis_pub_ping(intptr_t uuid, protocol_s *pr) {
 Engine Callbacks
 ***************************************************************************** */
 
-static void redis_on_subscribe(const pubsub_engine_s *eng, FIOBJ channel,
-                               uint8_t use_pattern) {
-  redis_engine_s *r = en2redis(eng);
-  if (r->sub_data.uuid) {
-    fio_cstr_s ch_str = fiobj_obj2cstr(channel);
-    FIOBJ cmd = fiobj_str_buf(96 + ch_str.len);
+/* writes a (P|S)(UN)SUBSCRIBE command to the node's subscription connection */
+static void redis_send_subscription(redis_engine_s *r, FIOBJ channel,
+                                    uint8_t use_pattern, uint8_t subscribe) {
+  if (!r->sub_data.uuid)
+    return;
+  fio_cstr_s ch_str = fiobj_obj2cstr(channel);
+  FIOBJ cmd = fiobj_str_buf(96 + ch_str.len);
+  if (subscribe) {
     if (use_pattern)
       fiobj_str_write(cmd, "*2\r\n$10\r\nPSUBSCRIBE\r\n$", 22);
+    else if (r->cluster)
+      fiobj_str_write(cmd, "*2\r\n$10\r\nSSUBSCRIBE\r\n$", 22);
     else
       fiobj_str_write(cmd, "*2\r\n$9\r\nSUBSCRIBE\r\n$", 20);
-    fiobj_str_join(cmd, fiobj_num_tmp(ch_str.len));
-    fiobj_str_write(cmd, "\r\n", 2);
-    fiobj_str_write(cmd, ch_str.data, ch_str.len);
-    fiobj_str_write(cmd, "\r\n", 2);
-    // {
-    //   fio_cstr_s s = fiobj_obj2cstr(cmd);
-    //   fprintf(stderr, "%s\n", s.data);
-    // }
-    fiobj_send_free(r->sub_data.uuid, cmd);
-  }
-}
-static void redis_on_unsubscribe(const pubsub_engine_s *eng, FIOBJ channel,
-                                 uint8_t use_pattern) {
-  redis_engine_s *r = en2redis(eng);
-  if (r->sub_data.uuid) {
-    fio_cstr_s ch_str = fiobj_obj2cstr(channel);
-    FIOBJ cmd = fiobj_str_buf(96 + ch_str.len);
+  } else {
     if (use_pattern)
       fiobj_str_write(cmd, "*2\r\n$12\r\nPUNSUBSCRIBE\r\n$", 24);
+    else if (r->cluster)
+      fiobj_str_write(cmd, "*2\r\n$12\r\nSUNSUBSCRIBE\r\n$", 24);
     else
       fiobj_str_write(cmd, "*2\r\n$11\r\nUNSUBSCRIBE\r\n$", 23);
-    fiobj_str_join(cmd, fiobj_num_tmp(ch_str.len));
-    fiobj_str_write(cmd, "\r\n", 2);
-    fiobj_str_write(cmd, ch_str.data, ch_str.len);
-    fiobj_str_write(cmd, "\r\n", 2);
-    // {
-    //   fio_cstr_s s = fiobj_obj2cstr(cmd);
-    //   fprintf(stderr, "%s\n", s.data);
-    // }
-    fiobj_send_free(r->sub_data.uuid, cmd);
   }
+  fiobj_str_join(cmd, fiobj_num_tmp(ch_str.len));
+  fiobj_str_write(cmd, "\r\n", 2);
+  fiobj_str_write(cmd, ch_str.data, ch_str.len);
+  fiobj_str_write(cmd, "\r\n", 2);
+  // {
+  //   fio_cstr_s s = fiobj_obj2cstr(cmd);
+  //   fprintf(stderr, "%s\n", s.data);
+  // }
+  fiobj_send_free(r->sub_data.uuid, cmd);
 }
-static int redis_on_publish(const pubsub_engine_s *eng, FIOBJ channel,
-                            FIOBJ msg) {
+
+/*
+ * Returns the node that should handle the channel.
+ *
+ * Patterns can't be sharded, so they are handled by the seed node (and they
+ * only match messages published using a non-sharded `PUBLISH`).
+ */
+static inline redis_engine_s *redis_route(redis_engine_s *r, FIOBJ channel,
+                                          uint8_t use_pattern) {
+  if (!r->cluster)
+    return r;
+  if (use_pattern)
+    return r->cluster->nodes[0];
+  return r->cluster
+      ->nodes[r->cluster->slots[redis_engine_slot(channel)]];
+}
+
+static void redis_on_subscribe(const pubsub_engine_s *eng, FIOBJ channel,
+                               uint8_t use_pattern) {
   redis_engine_s *r = en2redis(eng);
-  if (FIOBJ_TYPE(msg) == FIOBJ_T_ARRAY || FIOBJ_TYPE(msg) == FIOBJ_T_HASH)
-    msg = fiobj_obj2json(msg, 0);
-  else
-    msg = fiobj_dup(msg);
+  redis_send_subscription(redis_route(r, channel, use_pattern), channel,
+                          use_pattern, 1);
+}
+static void redis_on_unsubscribe(const pubsub_engine_s *eng, FIOBJ channel,
+                                 uint8_t use_pattern) {
+  redis_engine_s *r = en2redis(eng);
+  redis_send_subscription(redis_route(r, channel, use_pattern), channel,
+                          use_pattern, 0);
+}
+
+/* limits a resubscription to a single slot (redirections), or -1 for all */
+static __thread int32_t redis_resubscribe_slot = -1;
+
+/* used for resubscribing a single node (cluster mode) */
+static void redis_on_shard_subscribe(const pubsub_engine_s *eng, FIOBJ channel,
+                                     uint8_t use_pattern) {
+  redis_engine_s *r = shard2redis(eng);
+  if (redis_resubscribe_slot >= 0 &&
+      (use_pattern || redis_engine_slot(channel) != redis_resubscribe_slot))
+    return;
+  if (redis_route(r, channel, use_pattern) == r)
+    redis_send_subscription(r, channel, use_pattern, 1);
+}
+static void redis_on_shard_unsubscribe(const pubsub_engine_s *eng,
+                                       FIOBJ channel, uint8_t use_pattern) {
+  redis_engine_s *r = shard2redis(eng);
+  if (redis_route(r, channel, use_pattern) == r)
+    redis_send_subscription(r, channel, use_pattern, 0);
+}
 
+/* formats a PUBLISH (or SPUBLISH) command */
+static redis_commands_s *redis_publish_cmd(FIOBJ channel, FIOBJ msg,
+                                           uint8_t sharded) {
   fio_cstr_s msg_str = fiobj_obj2cstr(msg);
   fio_cstr_s ch_str = fiobj_obj2cstr(channel);
 
   redis_commands_s *cmd = malloc(sizeof(*cmd) + ch_str.len + msg_str.len + 96);
   *cmd = (redis_commands_s){.cmd_len = 0};
-  memcpy(cmd->cmd, "*3\r\n$7\r\nPUBLISH\r\n$", 18);
-  char *buf = (char *)cmd->cmd + 18;
+  char *buf = (char *)cmd->cmd;
+  if (sharded) {
+    memcpy(buf, "*3\r\n$8\r\nSPUBLISH\r\n$", 19);
+    buf += 19;
+  } else {
+    memcpy(buf, "*3\r\n$7\r\nPUBLISH\r\n$", 18);
+    buf += 18;
+  }
   buf += fio_ltoa((void *)buf, ch_str.len, 10);
   *buf++ = '\r';
   *buf++ = '\n';
@@ -429,7 +563,6 @@ static int redis_on_publish(const pubsub_engine_s *eng, FIOBJ channel,
   *buf++ = '\r';
   *buf++ = '\n';
   *buf++ = '$';
-  msg_str = fiobj_obj2cstr(msg);
   buf += fio_ltoa(buf, msg_str.len, 10);
   *buf++ = '\r';
   *buf++ = '\n';
@@ -440,16 +573,112 @@ static int redis_on_publish(const pubsub_engine_s *eng, FIOBJ channel,
   *buf = 0;
   // fprintf(stderr, "%s\n", cmd->cmd);
   cmd->cmd_len = (uintptr_t)buf - (uintptr_t)(cmd + 1);
+  return cmd;
+}
+
+/* sharded publications are kept until a reply arrives (MOVED redirection) */
+typedef struct {
+  FIOBJ channel;
+  FIOBJ msg;
+  size_t redirections;
+} redis_spublish_s;
+
+static void redis_cluster_moved(redis_engine_s *r, fio_cstr_s err);
+
+static void redis_on_spublish_reply(pubsub_engine_s *e, FIOBJ reply,
+                                    void *udata) {
+  redis_spublish_s *pub = udata;
+  redis_engine_s *r = en2redis(e);
+  if (FIOBJ_TYPE_IS(reply, FIOBJ_T_STRING) && r->flag) {
+    fio_cstr_s s = fiobj_obj2cstr(reply);
+    if (s.len > 6 && !memcmp(s.data, "MOVED ", 6) &&
+        pub->redirections < REDIS_CLUSTER_NODES_LIMIT) {
+      redis_cluster_moved(r, s);
+      redis_engine_s *owner = redis_route(r, pub->channel, 0);
+      if (owner != r) {
+        ++pub->redirections;
+        redis_commands_s *cmd = redis_publish_cmd(pub->channel, pub->msg, 1);
+        cmd->callback = redis_on_spublish_reply;
+        cmd->udata = pub;
+        redis_attach_cmd(owner, cmd);
+        return;
+      }
+    }
+    fprintf(stderr, "WARNING: (redis) SPUBLISH failed: %.*s\n", (int)s.len,
+            s.data);
+  }
+  fiobj_free(pub->channel);
+  fiobj_free(pub->msg);
+  free(pub);
+}
+
+static int redis_on_publish(const pubsub_engine_s *eng, FIOBJ channel,
+                            FIOBJ msg) {
+  redis_engine_s *r = en2redis(eng);
+  if (FIOBJ_TYPE(msg) == FIOBJ_T_ARRAY || FIOBJ_TYPE(msg) == FIOBJ_T_HASH)
+    msg = r->binary ? fiobj_obj2bin(msg) : fiobj_obj2json(msg, 0);
+  else
+    msg = fiobj_dup(msg);
+
+  redis_commands_s *cmd = redis_publish_cmd(channel, msg, r->cluster != NULL);
+  if (r->cluster) {
+    redis_spublish_s *pub = malloc(sizeof(*pub));
+    if (!pub) {
+      perror("FATAL ERROR: (redis) couldn't allocate memory");
+      exit(errno);
+    }
+    *pub = (redis_spublish_s){.channel = fiobj_dup(channel),
+                              .msg = fiobj_dup(msg)};
+    cmd->callback = redis_on_spublish_reply;
+    cmd->udata = pub;
+    r = redis_route(r, channel, 0);
+  }
   redis_attach_cmd(r, cmd);
   fiobj_free(msg);
   return 0;
 }
+static int redis_on_publish_batch(const pubsub_engine_s *eng, FIOBJ *channels,
+                                  FIOBJ *msgs, size_t count) {
+  redis_engine_s *r = en2redis(eng);
+  if (r->cluster) {
+    /* each channel might be routed to a different node */
+    for (size_t i = 0; i < count; ++i)
+      redis_on_publish(eng, channels[i], msgs[i]);
+    return (int)count;
+  }
+  fio_ls_embd_s cmds = FIO_LS_INIT(cmds);
+  for (size_t i = 0; i < count; ++i) {
+    FIOBJ msg = msgs[i];
+    if (FIOBJ_TYPE(msg) == FIOBJ_T_ARRAY || FIOBJ_TYPE(msg) == FIOBJ_T_HASH)
+      msg = r->binary ? fiobj_obj2bin(msg) : fiobj_obj2json(msg, 0);
+    else
+      msg = fiobj_dup(msg);
+    redis_commands_s *cmd = redis_publish_cmd(channels[i], msg, 0);
+    fio_ls_embd_push(&cmds, &cmd->node);
+    fiobj_free(msg);
+  }
+  redis_attach_cmds(r, &cmds);
+  return (int)count;
+}
+
+static int redis_on_shard_publish(const pubsub_engine_s *eng, FIOBJ channel,
+                                  FIOBJ msg) {
+  return redis_on_publish(&shard2redis(eng)->en, channel, msg);
+}
+
 /* *****************************************************************************
 Object Creation
 ***************************************************************************** */
 
 static void redis_on_startup(const pubsub_engine_s *r_) {
   redis_engine_s *r = en2redis(r_);
+  if (r->cluster && r->cluster->nodes[0] == r) {
+    /* the seed node starts the rest of the (unregistered) cluster nodes */
+    r->cluster->lock = SPN_LOCK_INIT;
+    for (size_t i = 1; i < r->cluster->count; ++i) {
+      redis_on_startup(&r->cluster->nodes[i]->en);
+    }
+  }
   /* start adding one connection, so add one reference. */
   spn_add(&r->ref, 1);
   if (facil_parent_pid() == getpid()) {
@@ -462,10 +691,8 @@ static void redis_on_startup(const pubsub_engine_s *r_) {
   }
 }
 
-#undef redis_engine_create
-pubsub_engine_s *redis_engine_create(struct redis_engine_create_args args) {
-  if (!args.address)
-    return NULL;
+/* allocates and initializes an engine (without registering it) */
+static redis_engine_s *redis_engine_new(struct redis_engine_create_args args) {
   if (!args.port)
     args.port = "6379";
   size_t port_len = 0;
@@ -483,6 +710,7 @@ pubsub_engine_s *redis_engine_create(struct redis_engine_create_args args) {
       .id_protection = 15,
       .flag = 1,
       .ping_int = args.ping_interval,
+      .binary = args.binary,
       .callbacks = FIO_LS_INIT(r->callbacks),
       .port = (char *)r->buf + (REDIS_READ_BUFFER + REDIS_READ_BUFFER),
       .address = (char *)r->buf + (REDIS_READ_BUFFER + REDIS_READ_BUFFER) +
@@ -495,8 +723,15 @@ pubsub_engine_s *redis_engine_create(struct redis_engine_create_args args) {
               .subscribe = redis_on_subscribe,
               .unsubscribe = redis_on_unsubscribe,
               .publish = redis_on_publish,
+              .publish_batch = redis_on_publish_batch,
               .on_startup = redis_on_startup,
           },
+      .shard =
+          {
+              .subscribe = redis_on_shard_subscribe,
+              .unsubscribe = redis_on_shard_unsubscribe,
+              .publish = redis_on_shard_publish,
+          },
       .pub_data =
           {
               .is_pub = 1,
@@ -538,6 +773,37 @@ pubsub_engine_s *redis_engine_create(struct redis_engine_create_args args) {
   } else {
     r->auth = NULL;
   }
+  return r;
+}
+
+#undef redis_engine_create
+pubsub_engine_s *redis_engine_create(struct redis_engine_create_args args) {
+  if (!args.address)
+    return NULL;
+  if (args.auth && !args.auth_len)
+    args.auth_len = strlen(args.auth);
+  redis_engine_s *r = redis_engine_new(args);
+  if (args.cluster) {
+    redis_cluster_s *c = malloc(sizeof(*c));
+    if (!c) {
+      perror("FATAL ERROR: (redis) couldn't allocate memory");
+      exit(errno);
+    }
+    /* until redirected, all the slots are assumed to belong to the seed */
+    *c = (redis_cluster_s){
+        .nodes = {r},
+        .count = 1,
+        .lock = SPN_LOCK_INIT,
+        .ping_int = args.ping_interval,
+    };
+    if (args.auth) {
+      c->auth = malloc(args.auth_len + 1);
+      memcpy(c->auth, args.auth, args.auth_len);
+      c->auth[args.auth_len] = 0;
+      c->auth_len = args.auth_len;
+    }
+    r->cluster = c;
+  }
   pubsub_engine_register(&r->en);
   if (facil_is_running())
     redis_on_startup(&r->en);
@@ -558,6 +824,17 @@ void redis_engine_destroy(pubsub_engine_s *e) {
     exit(-1);
   }
   pubsub_engine_deregister(&r->en);
+  if (r->cluster) {
+    for (size_t i = 1; i < r->cluster->count; ++i) {
+      redis_engine_s *node = r->cluster->nodes[i];
+      node->flag = 0;
+      if (node->pub_data.uuid)
+        sock_close(node->pub_data.uuid);
+      if (node->sub_data.uuid)
+        sock_close(node->sub_data.uuid);
+      redis_free(node);
+    }
+  }
   r->flag = 0;
   if (r->pub_data.uuid)
     sock_close(r->pub_data.uuid);
@@ -566,6 +843,124 @@ void redis_engine_destroy(pubsub_engine_s *e) {
   redis_free(r);
 }
 
+/* *****************************************************************************
+Redis Cluster support (hash slots and MOVED redirections)
+***************************************************************************** */
+
+/** The CRC16 (XMODEM) variation used by Redis Cluster. */
+static uint16_t redis_crc16(const uint8_t *buf, size_t len) {
+  uint16_t crc = 0;
+  while (len--) {
+    crc ^= (uint16_t)(*buf++) << 8;
+    for (int i = 0; i < 8; ++i)
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+  }
+  return crc;
+}
+
+/**
+ * Returns the Redis Cluster hash slot for the channel name.
+ *
+ * Hash tags are supported, so "{user.1}.inbox" and "{user.1}.outbox" share the
+ * same slot.
+ */
+uint16_t redis_engine_slot(FIOBJ channel) {
+  fio_cstr_s s = fiobj_obj2cstr(channel);
+  uint8_t *start = memchr(s.bytes, '{', s.len);
+  if (start) {
+    size_t rem = s.len - (size_t)(start - s.bytes) - 1;
+    uint8_t *end = memchr(start + 1, '}', rem);
+    if (end && end > start + 1)
+      return redis_crc16(start + 1, (size_t)(end - start - 1)) &
+             (REDIS_CLUSTER_SLOTS - 1);
+  }
+  return redis_crc16(s.bytes, s.len) & (REDIS_CLUSTER_SLOTS - 1);
+}
+
+/* finds (or creates) the cluster node for an address. Returns its index. */
+static int redis_cluster_node(redis_cluster_s *c, char *address,
+                              char *port) {
+  redis_engine_s *node = NULL;
+  int index = -1;
+  spn_lock(&c->lock);
+  for (size_t i = 0; i < c->count; ++i) {
+    if (!strcmp(c->nodes[i]->address, address) &&
+        !strcmp(c->nodes[i]->port, port)) {
+      index = (int)i;
+      goto finish;
+    }
+  }
+  if (c->count == REDIS_CLUSTER_NODES_LIMIT) {
+    fprintf(stderr,
+            "WARNING: (redis) cluster node limit reached, can't add %s:%s\n",
+            address, port);
+    goto finish;
+  }
+  node = redis_engine_new((struct redis_engine_create_args){
+      .address = address,
+      .port = port,
+      .auth = c->auth,
+      .auth_len = c->auth_len,
+      .ping_interval = c->ping_int,
+      .binary = c->nodes[0]->binary,
+  });
+  node->cluster = c;
+  index = (int)c->count;
+  c->nodes[c->count++] = node;
+finish:
+  spn_unlock(&c->lock);
+  if (node && facil_is_running())
+    redis_on_startup(&node->en);
+  return index;
+}
+
+/*
+ * Handles a "MOVED <slot> <host>:<port>" error, updating the slot map.
+ *
+ * The new owner resubscribes the slot's channels.
+ */
+static void redis_cluster_moved(redis_engine_s *r, fio_cstr_s err) {
+  redis_cluster_s *c = r->cluster;
+  if (!c || !r->flag)
+    return;
+  char *pos = (char *)err.data + 6;
+  char *end = (char *)err.data + err.len;
+  size_t slot = 0;
+  while (pos < end && *pos >= '0' && *pos <= '9')
+    slot = (slot * 10) + (*pos++ - '0');
+  if (pos >= end || *pos != ' ' || slot >= REDIS_CLUSTER_SLOTS)
+    goto error;
+  ++pos;
+  char *colon = end;
+  while (colon > pos && colon[-1] != ':')
+    --colon;
+  if (colon == pos || colon == end || (size_t)(colon - pos) > 255 ||
+      (end - colon) > 15)
+    goto error;
+  char address[256];
+  char port[16];
+  if (colon - 1 == pos) {
+    /* an empty host name means the host of the node sending the error */
+    strcpy(address, r->address);
+  } else {
+    memcpy(address, pos, (size_t)(colon - 1 - pos));
+    address[colon - 1 - pos] = 0;
+  }
+  memcpy(port, colon, (size_t)(end - colon));
+  port[end - colon] = 0;
+  int index = redis_cluster_node(c, address, port);
+  if (index < 0 || c->slots[slot] == index)
+    return;
+  c->slots[slot] = (uint8_t)index;
+  redis_resubscribe_slot = (int32_t)slot;
+  pubsub_engine_resubscribe(&c->nodes[index]->shard);
+  redis_resubscribe_slot = -1;
+  return;
+error:
+  fprintf(stderr, "WARNING: (redis) couldn't parse redirection: %.*s\n",
+          (int)err.len, err.data);
+}
+
 /**
  * Sends a Redis command through the engine's connection.
  *
@@ -690,44 +1085,80 @@ static int resp_on_parser_error(resp_parser_s *parser) {
   return -1;
 }
 
+/*
+ * Subscription connections receive mostly "message" arrays. These arrays are
+ * collected without allocating an Array object or a String for the message
+ * type, and the channel name reuses the previous channel's String when they
+ * match. Only the (unmatched) channel and message payload are allocated.
+ */
+
+enum {
+  REDIS_STR_NORMAL = 0,
+  REDIS_STR_KIND,
+  REDIS_STR_COMPARE,
+  REDIS_STR_DROP,
+};
+
+/** tests for in place parsing of subscription arrays. */
+#define redis_in_place(i) (!(i)->is_pub && (i)->in_array)
+
+/* the array index of the channel name in subscription replies */
+static inline uintptr_t
+redis_sub_channel_index(struct redis_engine_internal_s *i) {
+  return (i->kind_len == 8 && i->kind[0] == 'p') ? 2 : 1;
+}
+
+/* routes a completed subscription array */
+static void redis_on_sub_array(redis_engine_s *r,
+                               struct redis_engine_internal_s *i) {
+  FIOBJ ch = i->elements[redis_sub_channel_index(i)];
+  if (i->kind_len == 7 ||
+      (i->kind_len == 8 && i->kind[0] == 's')) { /* "message" / "smessage" */
+    FIOBJ msg = i->elements[2];
+    if (!ch || !msg)
+      return;
+    if (ch != r->last_ch) {
+      fiobj_free(r->last_ch);
+      r->last_ch = fiobj_dup(ch);
+    }
+    pubsub_publish(.channel = ch, .message = msg,
+                   .engine = PUBSUB_CLUSTER_ENGINE);
+  } else if (i->kind_len == 8) { /* "pmessage" */
+    FIOBJ msg = i->elements[3];
+    if (!ch || !msg)
+      return;
+    if (ch != r->last_ch && !fiobj_iseq(r->last_ch, ch))
+      pubsub_publish(.channel = ch, .message = msg,
+                     .engine = PUBSUB_CLUSTER_ENGINE);
+  }
+}
+
 /** a local static callback, called when the RESP message is complete. */
 static int resp_on_message(resp_parser_s *parser) {
   struct redis_engine_internal_s *i =
       FIO_LS_EMBD_OBJ(struct redis_engine_internal_s, parser, parser);
+  if (redis_in_place(i)) {
+    redis_on_sub_array(parser2redis(parser), i);
+    redis_internal_reset(i);
+    return 0;
+  }
   FIOBJ msg = i->ary ? i->ary : i->str;
   if (i->is_pub) {
     /* publishing / command parser */
     redis_cmd_reply(FIO_LS_EMBD_OBJ(redis_engine_s, pub_data, i), msg);
   } else {
-    /* subscriotion parser */
-    if (FIOBJ_TYPE(msg) != FIOBJ_T_ARRAY) {
-      if (FIOBJ_TYPE(msg) != FIOBJ_T_STRING || fiobj_obj2cstr(msg).len != 4 ||
-          fiobj_obj2cstr(msg).data[0] != 'P') {
-        fprintf(stderr, "WARNING: (redis) unexpected data format in "
-                        "subscription stream:\n");
-        fio_cstr_s tmp = fiobj_obj2cstr(msg);
-        fprintf(stderr, "     %s\n", tmp.data);
-      }
-    } else {
-      // FIOBJ *ary = fiobj_ary2ptr(msg);
-      // for (size_t i = 0; i < fiobj_ary_count(msg); ++i) {
-      //   fio_cstr_s tmp = fiobj_obj2cstr(ary[i]);
-      //   fprintf(stderr, "(%lu) %s\n", (unsigned long)i, tmp.data);
-      // }
-      fio_cstr_s tmp = fiobj_obj2cstr(fiobj_ary_index(msg, 0));
-      redis_engine_s *r = parser2redis(parser);
-      if (tmp.len == 7) { /* "message"  */
-        fiobj_free(r->last_ch);
-        r->last_ch = fiobj_dup(fiobj_ary_index(msg, 1));
-        pubsub_publish(.channel = r->last_ch,
-                       .message = fiobj_ary_index(msg, 2),
-                       .engine = PUBSUB_CLUSTER_ENGINE);
-      } else if (tmp.len == 8) { /* "pmessage" */
-        if (!fiobj_iseq(r->last_ch, fiobj_ary_index(msg, 2)))
-          pubsub_publish(.channel = fiobj_ary_index(msg, 2),
-                         .message = fiobj_ary_index(msg, 3),
-                         .engine = PUBSUB_CLUSTER_ENGINE);
-      }
+    /* subscriotion parser (arrays are handled in place) */
+    if (FIOBJ_TYPE(msg) == FIOBJ_T_STRING && fiobj_obj2cstr(msg).len > 6 &&
+        !memcmp(fiobj_obj2cstr(msg).data, "MOVED ", 6)) {
+      /* (cluster mode) a subscription was sent to the wrong node */
+      redis_cluster_moved(parser2redis(parser), fiobj_obj2cstr(msg));
+    } else if (FIOBJ_TYPE(msg) != FIOBJ_T_STRING ||
+               fiobj_obj2cstr(msg).len != 4 ||
+               fiobj_obj2cstr(msg).data[0] != 'P') {
+      fprintf(stderr, "WARNING: (redis) unexpected data format in "
+                      "subscription stream:\n");
+      fio_cstr_s tmp = fiobj_obj2cstr(msg);
+      fprintf(stderr, "     %s\n", tmp.data);
     }
   }
   /* cleanup */
@@ -739,6 +1170,14 @@ static int resp_on_message(resp_parser_s *parser) {
 
 /** a local helper to add parsed objects to the data store. */
 static inline void resp_add_obj(struct redis_engine_internal_s *dest, FIOBJ o) {
+  if (redis_in_place(dest)) {
+    if (dest->el_count && dest->el_count < 4)
+      dest->elements[dest->el_count] = o;
+    else
+      fiobj_free(o);
+    ++dest->el_count;
+    return;
+  }
   if (dest->ary) {
     if (!dest->ary_count)
       fprintf(stderr,
@@ -782,6 +1221,23 @@ static int resp_on_null(resp_parser_s *parser) {
 static int resp_on_start_string(resp_parser_s *parser, size_t str_len) {
   struct redis_engine_internal_s *data =
       FIO_LS_EMBD_OBJ(struct redis_engine_internal_s, parser, parser);
+  if (redis_in_place(data)) {
+    redis_engine_s *r = parser2redis(parser);
+    data->str_pos = 0;
+    if (data->el_count == 0) {
+      data->str_mode = REDIS_STR_KIND;
+      data->kind_len = 0;
+    } else if (data->el_count >= 4) {
+      data->str_mode = REDIS_STR_DROP;
+    } else if (data->el_count == redis_sub_channel_index(data) &&
+               r->last_ch && fiobj_obj2cstr(r->last_ch).len == str_len) {
+      data->str_mode = REDIS_STR_COMPARE;
+    } else {
+      data->str_mode = REDIS_STR_NORMAL;
+      data->elements[data->el_count] = fiobj_str_buf(str_len);
+    }
+    return 0;
+  }
   resp_add_obj(data, fiobj_str_buf(str_len));
   return 0;
 }
@@ -789,15 +1245,52 @@ static int resp_on_start_string(resp_parser_s *parser, size_t str_len) {
 static int resp_on_string_chunk(resp_parser_s *parser, void *data, size_t len) {
   struct redis_engine_internal_s *i =
       FIO_LS_EMBD_OBJ(struct redis_engine_internal_s, parser, parser);
-  fiobj_str_write(i->str, data, len);
+  if (!redis_in_place(i)) {
+    fiobj_str_write(i->str, data, len);
+    return 0;
+  }
+  switch (i->str_mode) {
+  case REDIS_STR_KIND:
+    if (i->kind_len + len > sizeof(i->kind)) {
+      /* not a type we route */
+      i->kind_len = sizeof(i->kind);
+      break;
+    }
+    memcpy(i->kind + i->kind_len, data, len);
+    i->kind_len += len;
+    break;
+  case REDIS_STR_COMPARE: {
+    fio_cstr_s last = fiobj_obj2cstr(parser2redis(parser)->last_ch);
+    if (!memcmp(last.data + i->str_pos, data, len)) {
+      i->str_pos += len;
+      break;
+    }
+    /* a different channel, copy the matching part and keep going */
+    FIOBJ str = fiobj_str_buf(last.len);
+    fiobj_str_write(str, last.data, i->str_pos);
+    fiobj_str_write(str, data, len);
+    i->elements[i->el_count] = str;
+    i->str_mode = REDIS_STR_NORMAL;
+  } break;
+  case REDIS_STR_NORMAL:
+    fiobj_str_write(i->elements[i->el_count], data, len);
+    break;
+  }
   return 0;
 }
 /** a local static callback, called when a String object had finished
  * streaming.
  */
 static int resp_on_end_string(resp_parser_s *parser) {
+  struct redis_engine_internal_s *i =
+      FIO_LS_EMBD_OBJ(struct redis_engine_internal_s, parser, parser);
+  if (redis_in_place(i)) {
+    if (i->str_mode == REDIS_STR_COMPARE)
+      i->elements[i->el_count] = fiobj_dup(parser2redis(parser)->last_ch);
+    i->str_mode = REDIS_STR_NORMAL;
+    ++i->el_count;
+  }
   return 0;
-  (void)parser;
 }
 
 /** a local static callback, called an error message is received. */
@@ -824,6 +1317,17 @@ static int resp_on_err_msg(resp_parser_s *parser, void *data, size_t len) {
 static int resp_on_start_array(resp_parser_s *parser, size_t array_len) {
   struct redis_engine_internal_s *i =
       FIO_LS_EMBD_OBJ(struct redis_engine_internal_s, parser, parser);
+  if (!i->is_pub) {
+    if (i->in_array) {
+      fprintf(stderr, "ERROR: (redis) RESP protocol violation "
+                      "(array within array).\n");
+      return -1;
+    }
+    i->in_array = 1;
+    i->el_count = 0;
+    i->kind_len = 0;
+    return 0;
+  }
   if (i->ary) {
     /* this is an error ... */
     fprintf(stderr, "ERROR: (redis) RESP protocol violation "
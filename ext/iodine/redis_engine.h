@@ -27,6 +27,22 @@ struct redis_engine_create_args {
   size_t auth_len;
   /** A `ping` will be sent every `ping_interval` interval or inactivity. */
   uint8_t ping_interval;
+  /**
+   * Redis Cluster mode (sharded Pub/Sub).
+   *
+   * Channels are routed by their hash slot, using `SSUBSCRIBE` and `SPUBLISH`.
+   * The `address` is used as a seed node. Other nodes are discovered by
+   * following `MOVED` redirections, each with it's own connections.
+   */
+  uint8_t cluster;
+  /**
+   * Publishes structured messages (Arrays and Hashes) using the binary
+   * MessagePack format (see `fiobj_obj2bin`) rather than JSON.
+   *
+   * Set this only when all the subscribers (including non facil.io clients)
+   * expect MessagePack data.
+   */
+  uint8_t binary;
 };
 
 /**
@@ -73,6 +89,14 @@ intptr_t redis_engine_send(pubsub_engine_s *engine, FIOBJ command, FIOBJ data,
  */
 void redis_engine_destroy(pubsub_engine_s *engine);
 
+/**
+ * Returns the Redis Cluster hash slot (0-16383) for the channel name.
+ *
+ * Hash tags are supported, so "{user.1}.inbox" and "{user.1}.outbox" share the
+ * same slot.
+ */
+uint16_t redis_engine_slot(FIOBJ channel);
+
 /* support C++ */
 #ifdef __cplusplus
 }
@@ -229,7 +229,7 @@ static size_t resp_parse(resp_parser_s *parser, const void *buffer,
       --parser->obj_countdown;
       break;
     case '-':
-      resp_on_err_msg(parser, pos,
+      resp_on_err_msg(parser, pos + 1,
                       (size_t)((uintptr_t)eol - (uintptr_t)pos - 2));
       --parser->obj_countdown;
       break;
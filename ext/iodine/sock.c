@@ -8,6 +8,7 @@ Feel free to copy, use and enjoy according to the license provided.
 #define _GNU_SOURCE
 #endif
 
+#include "fio_stats.h"
 #include "sock.h"
 #include "spnlock.inc"
 /* *****************************************************************************
@@ -24,10 +25,12 @@ Includes and state
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include "fio_mem.h"
@@ -76,6 +79,16 @@ int defer(void (*func)(void *, void *), void *arg, void *arg2) {
   return 0;
 }
 
+/* the `defer` library's most urgent priority class (see `defer_priority`) */
+#define SOCK_DEFER_URGENT 0
+
+#pragma weak defer_priority
+int defer_priority(int priority, void (*func)(void *, void *), void *arg,
+                   void *arg2) {
+  (void)priority;
+  return defer(func, arg, arg2);
+}
+
 #pragma weak sock_flush_defer
 void sock_flush_defer(void *arg, void *ignored) {
   sock_flush((intptr_t)arg);
@@ -238,10 +251,16 @@ struct fd_data_s {
   packet_s **packet_last;
   /** The number of pending packets that are in the queue. */
   size_t packet_count;
+  /** The number of (memory) bytes waiting in the queue. */
+  size_t packet_bytes;
   /** RW hooks. */
   sock_rw_hook_s *rw_hooks;
   /** RW udata. */
   void *rw_udata;
+};
+
+/* rarely accessed data, kept apart so `fd_data_s` stays small */
+struct fd_addr_s {
   /** Peer/listenning address. */
   struct sockaddr_in6 addrinfo;
   /** address length. */
@@ -251,12 +270,14 @@ struct fd_data_s {
 static struct sock_data_store_s {
   size_t capacity;
   struct fd_data_s *fds;
+  struct fd_addr_s *addrs;
 } sock_data_store;
 
 #define fd2uuid(fd)                                                            \
   (((uintptr_t)(fd) << 8) | (sock_data_store.fds[(fd)].counter & 0xFF))
 #define fdinfo(fd) sock_data_store.fds[(fd)]
 #define uuidinfo(fd) sock_data_store.fds[sock_uuid2fd((fd))]
+#define fdaddr(fd) sock_data_store.addrs[(fd)]
 
 #define lock_fd(fd) spn_lock(&sock_data_store.fds[(fd)].lock)
 #define unlock_fd(fd) spn_unlock(&sock_data_store.fds[(fd)].lock)
@@ -281,7 +302,9 @@ static inline void sock_packet_rotate_unsafe(uintptr_t fd) {
 
 static void clear_sock_lib(void) {
   free(sock_data_store.fds);
+  free(sock_data_store.addrs);
   sock_data_store.fds = NULL;
+  sock_data_store.addrs = NULL;
   sock_data_store.capacity = 0;
 }
 
@@ -296,7 +319,24 @@ static inline int initialize_sock_lib(size_t capacity) {
   if (!new_collection)
     return -1;
   sock_data_store.fds = new_collection;
+  struct fd_addr_s *new_addrs =
+      realloc(sock_data_store.addrs, sizeof(*new_addrs) * capacity);
+  if (!new_addrs)
+    return -1;
+  sock_data_store.addrs = new_addrs;
+#if FIO_MEM_HUGE_PAGES && defined(MADV_HUGEPAGE)
+  {
+    /* the table is accessed at random, advise huge pages (whole pages only) */
+    const uintptr_t start =
+        ((uintptr_t)new_collection + 4095) & (~(uintptr_t)4095);
+    const uintptr_t end =
+        (uintptr_t)(new_collection + capacity) & (~(uintptr_t)4095);
+    if (end > start)
+      madvise((void *)start, end - start, MADV_HUGEPAGE);
+  }
+#endif
   for (size_t i = sock_data_store.capacity; i < capacity; i++) {
+    fdaddr(i).addrlen = 0;
     fdinfo(i) = (struct fd_data_s){
         .open = 0,
         .lock = SPN_LOCK_INIT,
@@ -349,6 +389,7 @@ clear:
       .counter = fdinfo(fd).counter + 1,
       .packet_last = &sock_data_store.fds[fd].packet,
   };
+  fdaddr(fd).addrlen = 0;
   spn_unlock(&(fdinfo(fd).lock));
   while (old_data.packet) {
     packet = old_data.packet;
@@ -375,11 +416,58 @@ reinitialize:
 Writing - from memory
 ***************************************************************************** */
 
+/**
+ * The maximum number of consecutive memory packets gathered into a single
+ * `writev` call (when the default read/write hooks are used).
+ */
+#ifndef SOCK_WRITEV_MAX
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define SOCK_WRITEV_MAX IOV_MAX
+#else
+#define SOCK_WRITEV_MAX 1024
+#endif
+#endif
+
+static int sock_write_buffer(int fd, struct packet_s *packet);
+
+/* gathers consecutive memory packets into a single `writev` system call. */
+static int sock_writev_buffers(int fd, struct packet_s *packet) {
+  struct iovec iov[SOCK_WRITEV_MAX];
+  int count = 0;
+  do {
+    iov[count].iov_base = (uint8_t *)packet->buffer + packet->offset;
+    iov[count].iov_len = packet->length;
+    ++count;
+    packet = packet->next;
+  } while (packet && packet->write_func == sock_write_buffer &&
+           count < SOCK_WRITEV_MAX);
+  ssize_t written = writev(fd, iov, count);
+  if (written <= 0)
+    return (int)written;
+  fio_stats_add(FIO_STATS_BYTES_OUT, written);
+  fdinfo(fd).packet_bytes -= written;
+  ssize_t left = written;
+  while (left && (size_t)left >= fdinfo(fd).packet->length) {
+    left -= fdinfo(fd).packet->length;
+    sock_packet_rotate_unsafe(fd);
+  }
+  if (left) {
+    fdinfo(fd).packet->length -= left;
+    fdinfo(fd).packet->offset += left;
+  }
+  return written > INT_MAX ? INT_MAX : (int)written;
+}
+
 static int sock_write_buffer(int fd, struct packet_s *packet) {
+  if (fdinfo(fd).rw_hooks == &SOCK_DEFAULT_HOOKS && packet->next &&
+      packet->next->write_func == sock_write_buffer)
+    return sock_writev_buffers(fd, packet);
   int written = fdinfo(fd).rw_hooks->write(
       fd2uuid(fd), fdinfo(fd).rw_udata,
       ((uint8_t *)packet->buffer + packet->offset), packet->length);
   if (written > 0) {
+    fio_stats_add(FIO_STATS_BYTES_OUT, written);
+    fdinfo(fd).packet_bytes -= written;
     packet->length -= written;
     packet->offset += written;
     if (!packet->length)
@@ -419,6 +507,8 @@ static int sock_write_from_fd(int fd, struct packet_s *packet) {
       goto read_error;
     sent = fdinfo(fd).rw_hooks->write(fd2uuid(fd), fdinfo(fd).rw_udata, buff,
                                       asked);
+    if (sent > 0)
+      fio_stats_add(FIO_STATS_BYTES_OUT, sent);
   } while (sent == asked && packet->length);
   if (sent >= 0) {
     packet->offset += sent;
@@ -448,6 +538,7 @@ static int sock_sendfile_from_fd(int fd, struct packet_s *packet) {
   sent = sendfile64(fd, packet->fd, &packet->offset, packet->length);
   if (sent < 0)
     return -1;
+  fio_stats_add(FIO_STATS_BYTES_OUT, sent);
   packet->length -= sent;
   if (!packet->length)
     sock_packet_rotate_unsafe(fd);
@@ -470,6 +561,7 @@ static int sock_sendfile_from_fd(int fd, struct packet_s *packet) {
 #endif
     if (ret < 0)
       goto error;
+    fio_stats_add(FIO_STATS_BYTES_OUT, act_sent);
     packet->length -= act_sent;
     packet->offset += act_sent;
   }
@@ -636,7 +728,8 @@ client data for "broadcasting" or when an old client task is preparing a
 response in the background while a disconnection and a new connection occur on
 the same `fd`).
 */
-intptr_t sock_listen(const char *address, const char *port) {
+static intptr_t sock_listen_internal(const char *address, const char *port,
+                                     uint8_t reuse_port, uint8_t listen_now) {
   int srvfd;
   if (!port || *port == 0 || (port[0] == '0' && port[1] == 0)) {
     /* Unix socket */
@@ -709,6 +802,23 @@ intptr_t sock_listen(const char *address, const char *port) {
       int optval = 1;
       setsockopt(srvfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
     }
+    // share the address with other sockets (i.e., one per worker process)
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+      int optval = 1;
+      if (setsockopt(srvfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                     sizeof(optval)) == -1) {
+        freeaddrinfo(servinfo);
+        close(srvfd);
+        return -1;
+      }
+#else
+      freeaddrinfo(servinfo);
+      close(srvfd);
+      errno = ENOTSUP;
+      return -1;
+#endif
+    }
     // bind the address to the socket
     {
       int bound = 0;
@@ -735,7 +845,7 @@ intptr_t sock_listen(const char *address, const char *port) {
     freeaddrinfo(servinfo);
   }
   // listen in
-  if (listen(srvfd, SOMAXCONN) < 0) {
+  if (listen_now && listen(srvfd, SOMAXCONN) < 0) {
     // perror("couldn't start listening");
     close(srvfd);
     return -1;
@@ -745,6 +855,105 @@ intptr_t sock_listen(const char *address, const char *port) {
   return fd2uuid(srvfd);
 }
 
+/**
+ * Opens a listening non-blocking socket. Return's the socket's UUID.
+ */
+intptr_t sock_listen(const char *address, const char *port) {
+  return sock_listen_internal(address, port, 0, 1);
+}
+
+/**
+ * Opens a non-blocking TCP/IP socket with `SO_REUSEPORT` enabled, allowing a
+ * number of sockets (i.e., one per worker process) to share the same address.
+ */
+intptr_t sock_listen_reuseport(const char *address, const char *port,
+                               uint8_t listen_now) {
+  if (!port || *port == 0 || (port[0] == '0' && port[1] == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  return sock_listen_internal(address, port, 1, listen_now);
+}
+
+/**
+ * Opens a non-blocking UDP socket bound to `address` and `port`.
+ */
+intptr_t sock_listen_udp(const char *address, const char *port) {
+  if (!port || *port == 0 || (port[0] == '0' && port[1] == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct addrinfo hints = {0};
+  struct addrinfo *servinfo;
+  hints.ai_family = AF_UNSPEC;    // don't care IPv4 or IPv6
+  hints.ai_socktype = SOCK_DGRAM; // UDP datagram sockets
+  hints.ai_flags = AI_PASSIVE;    // fill in my IP for me
+  if (getaddrinfo(address, port, &hints, &servinfo))
+    return -1;
+  int srvfd = -1;
+  for (struct addrinfo *p = servinfo; p != NULL; p = p->ai_next) {
+    srvfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (srvfd == -1)
+      continue;
+    int optval = 1;
+    setsockopt(srvfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (sock_set_non_block(srvfd) == 0 &&
+        !bind(srvfd, p->ai_addr, p->ai_addrlen))
+      break;
+    close(srvfd);
+    srvfd = -1;
+  }
+  freeaddrinfo(servinfo);
+  if (srvfd == -1)
+    return -1;
+  // datagrams that don't fit the kernel's buffer are dropped.
+  {
+    int optval = 0;
+    socklen_t size = (socklen_t)sizeof(optval);
+    if (!getsockopt(srvfd, SOL_SOCKET, SO_RCVBUF, &optval, &size) &&
+        optval < 1048576) {
+      optval = 1048576;
+      setsockopt(srvfd, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
+    }
+  }
+  if (clear_fd(srvfd, 1))
+    return -1;
+  return fd2uuid(srvfd);
+}
+
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+#include <linux/filter.h>
+/**
+ * Attaches a classic BPF program to an `SO_REUSEPORT` socket group, routing
+ * new connections to the socket whose index matches the CPU handling the
+ * connection. The group's size isn't known when the program is attached, so
+ * out of range CPUs are left to the kernel's hash selection.
+ */
+int sock_reuseport_cpu_affinity(intptr_t uuid) {
+  if (!sock_isvalid(uuid)) {
+    errno = EBADF;
+    return -1;
+  }
+  struct sock_filter code[] = {
+      /* A = raw_smp_processor_id() */
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+      /* return A */
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog = {
+      .len = sizeof(code) / sizeof(code[0]), .filter = code,
+  };
+  return setsockopt(sock_uuid2fd(uuid), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                    &prog, sizeof(prog));
+}
+#else
+int sock_reuseport_cpu_affinity(intptr_t uuid) {
+  (void)uuid;
+  errno = ENOTSUP;
+  return -1;
+}
+#endif
+
 /**
 `sock_accept` accepts a new socket connection from the listening socket
 `server_fd`, allowing the use of `sock_` functions with this new file
@@ -796,8 +1005,8 @@ intptr_t sock_accept(intptr_t srv_uuid) {
   }
   if (clear_fd(client, 1))
     return -1;
-  fdinfo(client).addrinfo = addrinfo;
-  fdinfo(client).addrlen = addrlen;
+  fdaddr(client).addrinfo = addrinfo;
+  fdaddr(client).addrlen = addrlen;
   return fd2uuid(client);
 }
 
@@ -904,8 +1113,8 @@ intptr_t sock_connect(char *address, char *port) {
     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
     if (clear_fd(fd, 1))
       return -1;
-    memcpy(&fdinfo(fd).addrinfo, addrinfo->ai_addr, addrinfo->ai_addrlen);
-    fdinfo(fd).addrlen = addrinfo->ai_addrlen;
+    memcpy(&fdaddr(fd).addrinfo, addrinfo->ai_addr, addrinfo->ai_addrlen);
+    fdaddr(fd).addrlen = addrinfo->ai_addrlen;
     freeaddrinfo(addrinfo);
   }
   return fd2uuid(fd);
@@ -956,11 +1165,11 @@ int sock_hijack(intptr_t uuid) {
 
 /** Returns the information available about the socket's peer address. */
 sock_peer_addr_s sock_peer_addr(intptr_t uuid) {
-  if (validate_uuid(uuid) || !fdinfo(sock_uuid2fd(uuid)).addrlen)
+  if (validate_uuid(uuid) || !fdaddr(sock_uuid2fd(uuid)).addrlen)
     return (sock_peer_addr_s){.addr = NULL};
   return (sock_peer_addr_s){
-      .addrlen = uuidinfo(uuid).addrlen,
-      .addr = (struct sockaddr *)&uuidinfo(uuid).addrinfo,
+      .addrlen = fdaddr(sock_uuid2fd(uuid)).addrlen,
+      .addr = (struct sockaddr *)&fdaddr(sock_uuid2fd(uuid)).addrinfo,
   };
 }
 
@@ -1035,6 +1244,7 @@ ssize_t sock_read(intptr_t uuid, void *buf, size_t count) {
 retry_int:
   ret = rw->read(uuid, udata, buf, count);
   if (ret > 0) {
+    fio_stats_add(FIO_STATS_BYTES_IN, ret);
     sock_touch(uuid);
     return ret;
   }
@@ -1049,33 +1259,174 @@ retry_int:
   return -1;
 }
 
-/**
-`sock_write2_fn` is the actual function behind the macro `sock_write2`.
+/* *****************************************************************************
+Datagrams
 */
-ssize_t sock_write2_fn(sock_write_info_s options) {
-  int fd = sock_uuid2fd(options.uuid);
 
-  /* this extra work can be avoided if an error is already known to occur...
-   * but the extra complexity and branching isn't worth it, considering the
-   * common case should be that there's no expected error.
-   *
-   * It also important to point out that errors should handle deallocation,
-   * simplifying client-side error handling logic (this is a framework wide
-   * design choice where callbacks are passed).
-   */
+/* the number of datagrams handled by a single `recvmmsg` / `sendmmsg` call */
+#define SOCK_MMSG_BATCH 32
+
+/**
+ * Receives up to `count` datagrams using `recvmmsg` (where available).
+ */
+ssize_t sock_recv_datagrams(intptr_t uuid, sock_datagram_s *datagrams,
+                            size_t count) {
+  if (validate_uuid(uuid) || !fdinfo(sock_uuid2fd(uuid)).open) {
+    errno = EBADF;
+    return -1;
+  }
+  const int fd = sock_uuid2fd(uuid);
+  size_t received = 0;
+  size_t bytes = 0;
+  int old_errno = errno;
+  while (received < count) {
+#if defined(__linux__)
+    struct mmsghdr msgs[SOCK_MMSG_BATCH];
+    struct iovec iov[SOCK_MMSG_BATCH];
+    size_t batch = count - received;
+    if (batch > SOCK_MMSG_BATCH)
+      batch = SOCK_MMSG_BATCH;
+    for (size_t i = 0; i < batch; ++i) {
+      sock_datagram_s *d = datagrams + received + i;
+      iov[i] = (struct iovec){.iov_base = d->data, .iov_len = d->len};
+      msgs[i] = (struct mmsghdr){
+          .msg_hdr =
+              {
+                  .msg_name = &d->addr,
+                  .msg_namelen = sizeof(d->addr),
+                  .msg_iov = iov + i,
+                  .msg_iovlen = 1,
+              },
+      };
+    }
+    int ret = recvmmsg(fd, msgs, batch, MSG_DONTWAIT, NULL);
+    if (ret <= 0)
+      goto finish;
+    for (int i = 0; i < ret; ++i) {
+      sock_datagram_s *d = datagrams + received + i;
+      d->len = msgs[i].msg_len;
+      d->addrlen = msgs[i].msg_hdr.msg_namelen;
+      d->truncated = ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0);
+      bytes += d->len;
+    }
+    received += ret;
+    if ((size_t)ret < batch)
+      break;
+#else
+    sock_datagram_s *d = datagrams + received;
+    struct iovec iov = {.iov_base = d->data, .iov_len = d->len};
+    struct msghdr msg = {
+        .msg_name = &d->addr,
+        .msg_namelen = sizeof(d->addr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    ssize_t ret = recvmsg(fd, &msg, 0);
+    if (ret < 0)
+      goto finish;
+    d->len = ret;
+    d->addrlen = msg.msg_namelen;
+    d->truncated = ((msg.msg_flags & MSG_TRUNC) != 0);
+    bytes += ret;
+    ++received;
+#endif
+  }
+  goto done;
+finish:
+  if (errno == EINTR && !received)
+    return sock_recv_datagrams(uuid, datagrams, count);
+  if (!received && errno != EWOULDBLOCK && errno != EAGAIN)
+    return -1;
+done:
+  errno = old_errno;
+  fio_stats_add(FIO_STATS_BYTES_IN, bytes);
+  return received;
+}
+
+/**
+ * Sends up to `count` datagrams using `sendmmsg` (where available).
+ */
+ssize_t sock_send_datagrams(intptr_t uuid, sock_datagram_s *datagrams,
+                            size_t count) {
+  if (validate_uuid(uuid) || !fdinfo(sock_uuid2fd(uuid)).open) {
+    errno = EBADF;
+    return -1;
+  }
+  const int fd = sock_uuid2fd(uuid);
+  size_t sent = 0;
+  size_t bytes = 0;
+  int old_errno = errno;
+  while (sent < count) {
+#if defined(__linux__)
+    struct mmsghdr msgs[SOCK_MMSG_BATCH];
+    struct iovec iov[SOCK_MMSG_BATCH];
+    size_t batch = count - sent;
+    if (batch > SOCK_MMSG_BATCH)
+      batch = SOCK_MMSG_BATCH;
+    for (size_t i = 0; i < batch; ++i) {
+      sock_datagram_s *d = datagrams + sent + i;
+      iov[i] = (struct iovec){.iov_base = d->data, .iov_len = d->len};
+      msgs[i] = (struct mmsghdr){
+          .msg_hdr =
+              {
+                  .msg_name = &d->addr,
+                  .msg_namelen = d->addrlen,
+                  .msg_iov = iov + i,
+                  .msg_iovlen = 1,
+              },
+      };
+    }
+    int ret = sendmmsg(fd, msgs, batch, MSG_DONTWAIT);
+    if (ret <= 0)
+      goto finish;
+    for (int i = 0; i < ret; ++i)
+      bytes += msgs[i].msg_len;
+    sent += ret;
+    if ((size_t)ret < batch)
+      break;
+#else
+    sock_datagram_s *d = datagrams + sent;
+    ssize_t ret = sendto(fd, d->data, d->len, 0, (struct sockaddr *)&d->addr,
+                         d->addrlen);
+    if (ret < 0)
+      goto finish;
+    bytes += ret;
+    ++sent;
+#endif
+  }
+  goto done;
+finish:
+  if (errno == EINTR && !sent)
+    return sock_send_datagrams(uuid, datagrams, count);
+  if (!sent && errno != EWOULDBLOCK && errno != EAGAIN)
+    return -1;
+done:
+  errno = old_errno;
+  fio_stats_add(FIO_STATS_BYTES_OUT, bytes);
+  return sent;
+}
+
+#undef SOCK_MMSG_BATCH
+
+/* creates a packet using the `sock_write2` options. */
+static inline packet_s *sock_packet_from_options(int fd,
+                                                 sock_write_info_s options) {
   packet_s *packet = sock_packet_new();
   packet->length = options.length;
   packet->offset = options.offset;
   packet->buffer = (void *)options.buffer;
+  packet->next = NULL;
   if (options.is_fd) {
-    packet->write_func = (fdinfo(fd).rw_hooks == &SOCK_DEFAULT_HOOKS)
+    packet->write_func = (fdinfo(fd).rw_hooks == &SOCK_DEFAULT_HOOKS ||
+                          fdinfo(fd).rw_hooks->sendfile)
                              ? sock_sendfile_from_fd
                              : sock_write_from_fd;
     packet->free_func =
         (options.dealloc ? options.dealloc
                          : (void (*)(void *))sock_perform_close_fd);
   } else if (options.is_pfd) {
-    packet->write_func = (fdinfo(fd).rw_hooks == &SOCK_DEFAULT_HOOKS)
+    packet->write_func = (fdinfo(fd).rw_hooks == &SOCK_DEFAULT_HOOKS ||
+                          fdinfo(fd).rw_hooks->sendfile)
                              ? sock_sendfile_from_pfd
                              : sock_write_from_pfd;
     packet->free_func =
@@ -1084,44 +1435,123 @@ ssize_t sock_write2_fn(sock_write_info_s options) {
     packet->write_func = sock_write_buffer;
     packet->free_func = (options.dealloc ? options.dealloc : free);
   }
+  return packet;
+}
 
-  /* place packet in queue */
-
-  if (validate_uuid(options.uuid) || !options.buffer)
+/*
+ * places a chain of packets (linked from `first` to `last`) in the queue.
+ *
+ * On error, the packets are freed.
+ */
+static inline ssize_t sock_packet_enqueue(intptr_t uuid, packet_s *first,
+                                          packet_s *last, size_t count,
+                                          uint8_t urgent) {
+  int fd = sock_uuid2fd(uuid);
+  size_t bytes = 0;
+  if (validate_uuid(uuid))
     goto error;
+  for (packet_s *pos = first;; pos = pos->next) {
+    if (pos->write_func == sock_write_buffer)
+      bytes += pos->length;
+    if (pos == last)
+      break;
+  }
   lock_fd(fd);
   if (!fdinfo(fd).open || fdinfo(fd).close) {
     unlock_fd(fd);
     goto error;
   }
-  packet->next = NULL;
+  last->next = NULL;
   if (fdinfo(fd).packet == NULL) {
-    fdinfo(fd).packet_last = &packet->next;
-    fdinfo(fd).packet = packet;
-  } else if (options.urgent == 0) {
-    *fdinfo(fd).packet_last = packet;
-    fdinfo(fd).packet_last = &packet->next;
+    fdinfo(fd).packet_last = &last->next;
+    fdinfo(fd).packet = first;
+  } else if (urgent == 0) {
+    *fdinfo(fd).packet_last = first;
+    fdinfo(fd).packet_last = &last->next;
   } else {
     packet_s **pos = &fdinfo(fd).packet;
     if (*pos)
       pos = &(*pos)->next;
-    packet->next = *pos;
-    *pos = packet;
-    if (!packet->next) {
-      fdinfo(fd).packet_last = &packet->next;
+    last->next = *pos;
+    *pos = first;
+    if (!last->next) {
+      fdinfo(fd).packet_last = &last->next;
     }
   }
-  ++fdinfo(fd).packet_count;
+  fdinfo(fd).packet_count += count;
+  fdinfo(fd).packet_bytes += bytes;
   unlock_fd(fd);
-  sock_touch(options.uuid);
-  defer(sock_flush_defer, (void *)options.uuid, NULL);
+  sock_touch(uuid);
+  defer_priority(SOCK_DEFER_URGENT, sock_flush_defer, (void *)uuid, NULL);
   return 0;
 
 error:
-  sock_packet_free(packet);
+  while (first) {
+    packet_s *tmp = first;
+    first = (first == last) ? NULL : first->next;
+    sock_packet_free(tmp);
+  }
   errno = EBADF;
   return -1;
 }
+
+/**
+`sock_write2_fn` is the actual function behind the macro `sock_write2`.
+*/
+ssize_t sock_write2_fn(sock_write_info_s options) {
+  int fd = sock_uuid2fd(options.uuid);
+
+  /* this extra work can be avoided if an error is already known to occur...
+   * but the extra complexity and branching isn't worth it, considering the
+   * common case should be that there's no expected error.
+   *
+   * It also important to point out that errors should handle deallocation,
+   * simplifying client-side error handling logic (this is a framework wide
+   * design choice where callbacks are passed).
+   */
+  packet_s *packet = sock_packet_from_options(fd, options);
+
+  /* place packet in queue */
+  if (!options.buffer) {
+    sock_packet_free(packet);
+    errno = EBADF;
+    return -1;
+  }
+  return sock_packet_enqueue(options.uuid, packet, packet, 1, options.urgent);
+}
+
+/**
+`sock_write2_head_fn` is the actual function behind the macro
+`sock_write2_head`.
+*/
+ssize_t sock_write2_head_fn(const void *head, size_t head_len,
+                            sock_write_info_s options) {
+  if (!head || !head_len)
+    return sock_write2_fn(options);
+  int fd = sock_uuid2fd(options.uuid);
+  packet_s *packet = sock_packet_from_options(fd, options);
+  if (!options.buffer) {
+    sock_packet_free(packet);
+    errno = EBADF;
+    return -1;
+  }
+  packet_s *head_packet = sock_packet_new();
+  *head_packet = (packet_s){
+      .next = packet,
+      .write_func = sock_write_buffer,
+      .free_func = free,
+      .buffer = malloc(head_len),
+      .length = head_len,
+  };
+  if (!head_packet->buffer) {
+    sock_packet_free(head_packet);
+    sock_packet_free(packet);
+    return -1;
+  }
+  memcpy(head_packet->buffer, head, head_len);
+  return sock_packet_enqueue(options.uuid, head_packet, packet, 2,
+                             options.urgent);
+}
 #define sock_write2(...) sock_write2_fn((sock_write_info_s){__VA_ARGS__})
 
 /**
@@ -1268,6 +1698,16 @@ size_t sock_pending(intptr_t uuid) {
   return (uuidinfo(uuid).packet_count + uuidinfo(uuid).close);
 }
 
+/**
+ * Returns the number of bytes waiting in the socket's queue (data sent from
+ * files isn't counted).
+ */
+size_t sock_pending_bytes(intptr_t uuid) {
+  if (validate_uuid(uuid) || !uuidinfo(uuid).open)
+    return 0;
+  return uuidinfo(uuid).packet_bytes;
+}
+
 /* *****************************************************************************
 TLC - Transport Layer Callback.
 
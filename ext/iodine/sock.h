@@ -36,12 +36,12 @@ Feel free to copy, use and enjoy according to the license provided.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #if defined(__FreeBSD__)
 #include <netinet/in.h>
-#include <sys/socket.h>
 #endif
 
 // clang-format off
@@ -126,6 +126,46 @@ The main sock API.
  */
 intptr_t sock_listen(const char *address, const char *port);
 
+/**
+ * Opens a non-blocking TCP/IP socket with `SO_REUSEPORT` enabled, allowing a
+ * number of sockets (i.e., one per worker process) to share the same address
+ * and port, while the kernel balances new connections between them.
+ *
+ * If `listen_now` is 0, the socket is bound to the address but isn't listening,
+ * reserving the address without being assigned any connections.
+ *
+ * A `port` is required (Unix Sockets aren't supported).
+ *
+ * Returns -1 on error. Returns a valid socket UUID.
+ */
+intptr_t sock_listen_reuseport(const char *address, const char *port,
+                               uint8_t listen_now);
+
+/**
+ * Opens a non-blocking UDP socket bound to `address` and `port` (a `port` is
+ * required). Return's the socket's UUID.
+ *
+ * Datagram sockets don't accept connections, use `sock_recv_datagrams` and
+ * `sock_send_datagrams` (the `sock_read` / `sock_write` functions shouldn't be
+ * used with the socket).
+ *
+ * Returns -1 on error.
+ */
+intptr_t sock_listen_udp(const char *address, const char *port);
+
+/**
+ * Attaches a CPU affinity program (`SO_ATTACH_REUSEPORT_CBPF`) to the
+ * `SO_REUSEPORT` group of the listening socket. New connections will be routed
+ * to the socket whose index in the group matches `cpu`, the CPU that received
+ * the connection. When `cpu` is out of range (the group has fewer sockets than
+ * the system has CPUs), the kernel falls back to its default hash selection.
+ *
+ * This is only effective when each listening process is bound to a CPU.
+ *
+ * Returns -1 on error (i.e., `ENOTSUP` on non-Linux systems).
+ */
+int sock_reuseport_cpu_affinity(intptr_t uuid);
+
 /**
 * `sock_accept` accepts a new socket connection from the listening socket
 * `server_fd`, allowing the use of `sock_` functions with this new file
@@ -288,6 +328,43 @@ void sock_on_close(intptr_t uuid);
  */
 ssize_t sock_read(intptr_t uuid, void *buf, size_t count);
 
+/** A single datagram (see `sock_recv_datagrams` and `sock_send_datagrams`). */
+typedef struct {
+  /** The datagram's payload (a buffer owned by the caller). */
+  void *data;
+  /**
+   * The payload's length. When receiving, this is the buffer's capacity and is
+   * updated to the number of bytes received (longer datagrams are truncated).
+   */
+  size_t len;
+  /** The peer's address (filled in when receiving). */
+  struct sockaddr_storage addr;
+  /** The length of the peer's address. */
+  socklen_t addrlen;
+  /** Set when receiving, if the datagram was longer than the buffer. */
+  uint8_t truncated;
+} sock_datagram_s;
+
+/**
+ * Receives up to `count` datagrams from a datagram socket (see
+ * `sock_listen_udp`), using a single `recvmmsg` system call where available.
+ *
+ * Returns the number of datagrams received (0 when no datagrams are waiting) or
+ * -1 on error. The socket isn't closed on error.
+ */
+ssize_t sock_recv_datagrams(intptr_t uuid, sock_datagram_s *datagrams,
+                            size_t count);
+
+/**
+ * Sends up to `count` datagrams, each to it's own address (`addr`), using a
+ * single `sendmmsg` system call where available.
+ *
+ * Datagrams aren't buffered. Returns the number of datagrams sent, which might
+ * be less than `count` when the kernel's buffer is full, or -1 on error.
+ */
+ssize_t sock_send_datagrams(intptr_t uuid, sock_datagram_s *datagrams,
+                            size_t count);
+
 typedef struct {
   /** The fsocket uuid for sending data. */
   intptr_t uuid;
@@ -360,6 +437,26 @@ ssize_t sock_write2_fn(sock_write_info_s options);
  * transferred to the socket's user level buffer.
  */
 #define sock_write2(...) sock_write2_fn((sock_write_info_s){__VA_ARGS__})
+
+/**
+ * `sock_write2_head_fn` is the actual function behind the macro
+ * `sock_write2_head`.
+ */
+ssize_t sock_write2_head_fn(const void *head, size_t head_len,
+                            sock_write_info_s options);
+
+/**
+ * `sock_write2_head` is similar to `sock_write2`, except `head_len` bytes are
+ * copied from `head` and sent before the data.
+ *
+ * No other data will be sent between the copied `head` and the data. This
+ * allows a protocol to prefix a short header (i.e., a frame header) to a
+ * buffer it doesn't own, without copying the buffer.
+ *
+ * On error, -1 will be returned. Otherwise returns 0.
+ */
+#define sock_write2_head(head, head_len, ...)                                  \
+  sock_write2_head_fn((head), (head_len), (sock_write_info_s){__VA_ARGS__})
 /**
  * `sock_write` copies `legnth` data from the buffer and schedules the data to
  * be sent over the socket.
@@ -471,6 +568,14 @@ sock_has_pending(intptr_t uuid);
  */
 size_t sock_pending(intptr_t uuid);
 
+/**
+ * Returns the number of bytes waiting in the socket's queue (data sent from
+ * files isn't counted).
+ *
+ * This can be used to limit the memory consumed by slow clients.
+ */
+size_t sock_pending_bytes(intptr_t uuid);
+
 /**
  * This weak function can be overwritten when using the `defer` library.
  * However, the function MUST call {sock_flush} at some point.
@@ -531,6 +636,12 @@ typedef struct sock_rw_hook_s {
    * deadlock might occur.
    * */
   void (*on_close)(intptr_t uuid, struct sock_rw_hook_s *rw_hook, void *udata);
+  /**
+   * Set when data written directly to the file descriptor is handled the same
+   * as data passed to the `write` hook (i.e., kernel TLS offload), so files are
+   * sent using `sendfile` rather than being read and passed to `write`.
+   */
+  uint8_t sendfile;
 } sock_rw_hook_s;
 
 /* *****************************************************************************
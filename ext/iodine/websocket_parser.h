@@ -21,6 +21,15 @@ must be implemented by the including file (the callbacks).
 #if DEBUG
 #include <stdio.h>
 #endif
+
+/* SIMD masking is selected at build time, using the compiler's target flags */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 /* *****************************************************************************
 API - Message Wrapping
 ***************************************************************************** */
@@ -181,6 +190,40 @@ void websocket_xmask(void *msg, uint64_t len, uint32_t mask) {
       len -= 4;
       msg = (void *)((uintptr_t)msg + 4);
     }
+#if defined(__AVX2__)
+    /* XOR by 32 byte blocks (the mask is already rotated to `msg`) */
+    if (len >= 32) {
+      const __m256i vmask = _mm256_set1_epi32((int)mask);
+      do {
+        __m256i *pos = (__m256i *)msg;
+        _mm256_storeu_si256(pos,
+                            _mm256_xor_si256(_mm256_loadu_si256(pos), vmask));
+        len -= 32;
+        msg = (void *)((uintptr_t)msg + 32);
+      } while (len >= 32);
+    }
+#elif defined(__SSE2__)
+    /* XOR by 16 byte blocks (the mask is already rotated to `msg`) */
+    if (len >= 16) {
+      const __m128i vmask = _mm_set1_epi32((int)mask);
+      do {
+        __m128i *pos = (__m128i *)msg;
+        _mm_storeu_si128(pos, _mm_xor_si128(_mm_loadu_si128(pos), vmask));
+        len -= 16;
+        msg = (void *)((uintptr_t)msg + 16);
+      } while (len >= 16);
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    /* XOR by 16 byte blocks (the mask is already rotated to `msg`) */
+    if (len >= 16) {
+      const uint8x16_t vmask = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+      do {
+        vst1q_u8((uint8_t *)msg, veorq_u8(vld1q_u8((uint8_t *)msg), vmask));
+        len -= 16;
+        msg = (void *)((uintptr_t)msg + 16);
+      } while (len >= 16);
+    }
+#endif
     /* intrinsic / XOR by 8 byte block, memory aligned */
     const uint64_t xmask = (((uint64_t)mask) << 32) | mask;
     while (len >= 8) {
@@ -27,6 +27,18 @@ Feel free to copy, use and enjoy according to the license provided.
 
 #include "websocket_parser.h"
 
+/**
+ * Enables the `permessage-deflate` extension (requires zlib, set by
+ * `extconf.rb` when available).
+ */
+#ifndef WS_DEFLATE
+#define WS_DEFLATE 0
+#endif
+
+#if WS_DEFLATE
+#include <zlib.h>
+#endif
+
 #if !defined(__BIG_ENDIAN__) && !defined(__LITTLE_ENDIAN__)
 #include <endian.h>
 #if !defined(__BIG_ENDIAN__) && !defined(__LITTLE_ENDIAN__) &&                 \
@@ -58,6 +70,16 @@ void free_ws_buffer(ws_s *owner, struct buffer_s);
 /** Sets the initial buffer size. (4Kb)*/
 #define WS_INITIAL_BUFFER_SIZE 4096UL
 
+/**
+ * When true, the buffer of a Websocket connection is only allocated when an
+ * incoming frame doesn't fit in a stack buffer (`WS_INITIAL_BUFFER_SIZE`) and
+ * it's released after a full ping interval (the `ws_timeout`) without incoming
+ * data, so idle connections don't hold on to their buffer.
+ */
+#ifndef WS_IDLE_COMPACT
+#define WS_IDLE_COMPACT 1
+#endif
+
 /*******************************************************************************
 Buffer management - simple implementation...
 Since Websocket connections have a long life expectancy, optimizing this part of
@@ -111,6 +133,9 @@ struct ws_s {
   intptr_t fd;
   /** callbacks */
   void (*on_message)(ws_s *ws, char *data, size_t size, uint8_t is_text);
+  void (*on_message_fragment)(ws_s *ws, char *data, size_t size,
+                              uint8_t is_text, uint8_t first, uint8_t last);
+  void (*on_batch)(ws_s *ws, void (*task)(void *), void *arg);
   void (*on_shutdown)(ws_s *ws);
   void (*on_ready)(ws_s *ws);
   void (*on_open)(ws_s *ws);
@@ -131,6 +156,18 @@ struct ws_s {
   uint8_t is_text;
   /** websocket connection type. */
   uint8_t is_client;
+  /** `permessage-deflate` was negotiated for the connection. */
+  uint8_t deflate;
+  /** the current (incoming) message is compressed. */
+  uint8_t is_deflated;
+  /** streaming: the unread payload of a (partially delivered) frame. */
+  uint64_t stream_left;
+  /** streaming: the frame's mask, rotated to the next unread byte. */
+  uint32_t stream_mask;
+  /** streaming: the next part is the first part of the message. */
+  uint8_t stream_first;
+  /** streaming: the frame ends the message. */
+  uint8_t stream_fin;
 };
 
 /**
@@ -152,12 +189,208 @@ static inline void clear_subscriptions(ws_s *ws) {
 Callbacks - Required functions for websocket_parser.h
 ***************************************************************************** */
 
+/* *****************************************************************************
+permessage-deflate (RFC 7692)
+
+Both directions use "no context takeover", so a single (per thread) zlib
+stream is reset for every message and nothing is kept per connection.
+***************************************************************************** */
+
+/** Messages shorter than this are sent uncompressed. */
+#ifndef WS_DEFLATE_MIN_SIZE
+#define WS_DEFLATE_MIN_SIZE 256
+#endif
+
+#if WS_DEFLATE
+/** The zlib compression level for outgoing messages. */
+#ifndef WS_DEFLATE_LEVEL
+#define WS_DEFLATE_LEVEL Z_DEFAULT_COMPRESSION
+#endif
+
+/* compresses a message. Returns FIOBJ_INVALID if it didn't get any shorter. */
+static FIOBJ websocket_deflate(void *data, size_t len) {
+  static __thread z_stream z;
+  static __thread uint8_t z_ready;
+  if (!z_ready) {
+    if (deflateInit2(&z, WS_DEFLATE_LEVEL, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return FIOBJ_INVALID;
+    z_ready = 1;
+  } else
+    deflateReset(&z);
+  const size_t capa = deflateBound(&z, len) + 16;
+  FIOBJ out = fiobj_str_buf(capa);
+  z.next_in = data;
+  z.avail_in = len;
+  z.next_out = (Bytef *)fiobj_obj2cstr(out).data;
+  z.avail_out = capa;
+  if (deflate(&z, Z_SYNC_FLUSH) != Z_OK || z.avail_in || !z.avail_out)
+    goto no_gain;
+  /* the flush ends with an empty block (00 00 ff ff), which isn't sent */
+  len = capa - z.avail_out;
+  if (len < 4 || len - 4 >= (size_t)z.total_in)
+    goto no_gain;
+  fiobj_str_resize(out, len - 4);
+  return out;
+no_gain:
+  fiobj_free(out);
+  return FIOBJ_INVALID;
+}
+
+/* decompresses a message, limited to `limit` bytes. FIOBJ_INVALID on error. */
+static FIOBJ websocket_inflate(void *data, size_t len, size_t limit) {
+  static __thread z_stream z;
+  static __thread uint8_t z_ready;
+  static uint8_t tail[4] = {0, 0, 0xff, 0xff};
+  if (!z_ready) {
+    if (inflateInit2(&z, -15) != Z_OK)
+      return FIOBJ_INVALID;
+    z_ready = 1;
+  } else
+    inflateReset(&z);
+  FIOBJ out = fiobj_str_buf((len << 2) + 64 < limit ? (len << 2) + 64 : limit);
+  size_t pos = 0;
+  z.next_in = data;
+  z.avail_in = len;
+  for (int i = 0; i < 2; ++i) {
+    if (i) {
+      /* restore the empty block removed by the sender */
+      z.next_in = tail;
+      z.avail_in = 4;
+    }
+    do {
+      size_t capa = fiobj_str_capa(out);
+      if (pos == capa) {
+        if (capa >= limit)
+          goto error;
+        fiobj_str_resize(out, pos); /* keep the data when reallocating */
+        fiobj_str_capa_assert(out, capa << 1);
+        capa = fiobj_str_capa(out);
+      }
+      z.next_out = (Bytef *)fiobj_obj2cstr(out).data + pos;
+      z.avail_out = capa - pos;
+      int r = inflate(&z, Z_SYNC_FLUSH);
+      pos = capa - z.avail_out;
+      if (r == Z_STREAM_END)
+        goto done;
+      if (r == Z_BUF_ERROR && !z.avail_in)
+        break; /* no more output for this input */
+      if (r != Z_OK)
+        goto error;
+    } while (z.avail_in || !z.avail_out);
+  }
+done:
+  if (pos > limit)
+    goto error;
+  fiobj_str_resize(out, pos);
+  return out;
+error:
+  fiobj_free(out);
+  return FIOBJ_INVALID;
+}
+#endif
+
+uint8_t websocket_deflate_accept(FIOBJ extensions) {
+#if WS_DEFLATE
+  if (FIOBJ_TYPE_IS(extensions, FIOBJ_T_ARRAY)) {
+    /* repeated headers */
+    size_t count = fiobj_ary_count(extensions);
+    for (size_t i = 0; i < count; ++i) {
+      if (websocket_deflate_accept(fiobj_ary_index(extensions, i)))
+        return 1;
+    }
+    return 0;
+  }
+  fio_cstr_s s = fiobj_obj2cstr(extensions);
+  size_t pos = 0;
+  while (pos < s.len) {
+    /* each offer: permessage-deflate [; param[=value]]* [,] */
+    uint8_t accept = 1;
+    size_t token = 0;
+    while (pos < s.len && s.data[pos] != ',') {
+      while (pos < s.len && (s.data[pos] == ' ' || s.data[pos] == '\t' ||
+                             s.data[pos] == ';'))
+        ++pos;
+      size_t start = pos;
+      while (pos < s.len && s.data[pos] != ';' && s.data[pos] != ',' &&
+             s.data[pos] != ' ' && s.data[pos] != '\t')
+        ++pos;
+      size_t len = pos - start;
+      const char *name = s.data + start;
+      if (!len)
+        continue;
+      if (!token++) {
+        if (len != 18 || strncasecmp(name, "permessage-deflate", 18))
+          accept = 0;
+      } else if ((len == 26 &&
+                  !strncasecmp(name, "server_no_context_takeover", 26)) ||
+                 (len == 26 &&
+                  !strncasecmp(name, "client_no_context_takeover", 26)) ||
+                 (len >= 22 &&
+                  !strncasecmp(name, "client_max_window_bits", 22) &&
+                  (len == 22 || name[22] == '='))) {
+        /* we can always work with these */
+      } else if (len == 25 &&
+                 !strncasecmp(name, "server_max_window_bits=15", 25)) {
+        /* our window is 15 bits */
+      } else {
+        /* unknown parameter or a smaller server window */
+        accept = 0;
+      }
+    }
+    if (accept && token)
+      return 1;
+    ++pos;
+  }
+#endif
+  (void)extensions;
+  return 0;
+}
+
+/* passes a complete message to the `on_message` callback. */
+static void websocket_deliver(ws_s *ws, void *msg, size_t len, uint8_t text) {
+#if WS_DEFLATE
+  if (ws->is_deflated) {
+    FIOBJ inflated = websocket_inflate(msg, len, ws->max_msg_size);
+    if (!inflated) {
+      websocket_close(ws);
+      return;
+    }
+    fio_cstr_s s = fiobj_obj2cstr(inflated);
+    ws->on_message(ws, (char *)s.data, s.len, text);
+    fiobj_free(inflated);
+    return;
+  }
+#endif
+  ws->on_message(ws, msg, len, text);
+}
+
 static void websocket_on_unwrapped(void *ws_p, void *msg, uint64_t len,
                                    char first, char last, char text,
                                    unsigned char rsv) {
   ws_s *ws = ws_p;
+  if (ws->on_message_fragment) {
+    /* streaming, nothing is buffered */
+    if (first)
+      ws->is_text = (uint8_t)text;
+    if ((rsv >> 2) & 1) {
+      websocket_on_protocol_error(ws);
+      return;
+    }
+    ws->on_message_fragment(ws, msg, len, ws->is_text, (uint8_t)first,
+                            (uint8_t)last);
+    return;
+  }
+  if (first) {
+    /* RSV1 marks a compressed message (only valid when negotiated) */
+    ws->is_deflated = (rsv >> 2) & 1;
+    if (ws->is_deflated && !ws->deflate) {
+      websocket_on_protocol_error(ws);
+      return;
+    }
+  }
   if (last && first) {
-    ws->on_message(ws, msg, len, (uint8_t)text);
+    websocket_deliver(ws, msg, len, (uint8_t)text);
     return;
   }
   if (first) {
@@ -169,10 +402,8 @@ static void websocket_on_unwrapped(void *ws_p, void *msg, uint64_t len,
   fiobj_str_write(ws->msg, msg, len);
   if (last) {
     fio_cstr_s s = fiobj_obj2cstr(ws->msg);
-    ws->on_message(ws, (char *)s.data, s.len, ws->is_text);
+    websocket_deliver(ws, (char *)s.data, s.len, ws->is_text);
   }
-
-  (void)rsv;
 }
 static void websocket_on_protocol_ping(void *ws_p, void *msg_, uint64_t len) {
   ws_s *ws = ws_p;
@@ -212,6 +443,20 @@ The Websocket Protocol implementation
 
 #define ws_protocol(fd) ((ws_s *)(server_get_protocol(fd)))
 
+#if WS_IDLE_COMPACT
+/* releases the buffer of an idle connection (runs within the task lock). */
+static void ws_compact(intptr_t fd, protocol_s *ws_, void *arg) {
+  ws_s *ws = (ws_s *)ws_;
+  if (ws->protocol.service != WEBSOCKET_ID_STR || ws->length ||
+      !ws->buffer.data)
+    return;
+  free_ws_buffer(ws, ws->buffer);
+  ws->buffer = (struct buffer_s){.data = NULL};
+  (void)fd;
+  (void)arg;
+}
+#endif
+
 static void ws_ping(intptr_t fd, protocol_s *ws) {
   (void)(ws);
   if (((ws_s *)ws)->is_client) {
@@ -221,6 +466,10 @@ static void ws_ping(intptr_t fd, protocol_s *ws) {
     sock_write2(.uuid = fd, .buffer = "\x89\x00", .length = 2,
                 .dealloc = SOCK_DEALLOC_NOOP);
   }
+#if WS_IDLE_COMPACT
+  /* pings are only sent to idle connections */
+  facil_defer(.uuid = fd, .task = ws_compact);
+#endif
 }
 
 static void on_close(intptr_t uuid, protocol_s *_ws) {
@@ -247,10 +496,157 @@ static void on_shutdown(intptr_t fd, protocol_s *ws) {
   }
 }
 
+/* *****************************************************************************
+Streaming (`on_message_fragment`)
+
+Complete frames are handled by the parser. A data frame that can't fit in the
+buffer is delivered in parts, as the data arrives.
+***************************************************************************** */
+
+/* consumes the data in the buffer while streaming. */
+static void websocket_stream_consume(ws_s *ws) {
+  uint8_t *pos = ws->buffer.data;
+  size_t left = ws->length;
+  while (left) {
+    if (ws->stream_left) {
+      /* a part of a large frame */
+      const size_t len = left < ws->stream_left ? left : ws->stream_left;
+      if (ws->stream_mask) {
+        websocket_xmask(pos, len, ws->stream_mask);
+        /* rotate the mask to the next unread byte */
+        const uint64_t comb =
+            ws->stream_mask | ((uint64_t)ws->stream_mask << 32);
+        const size_t offset = len & 3;
+        for (size_t i = 0; i < 4; ++i)
+          ((uint8_t *)(&ws->stream_mask))[i] =
+              ((uint8_t *)(&comb))[i + offset];
+      }
+      ws->stream_left -= len;
+      ws->on_message_fragment(ws, (char *)pos, len, ws->is_text,
+                              ws->stream_first,
+                              (ws->stream_fin && !ws->stream_left));
+      ws->stream_first = 0;
+      pos += len;
+      left -= len;
+      continue;
+    }
+    struct websocket_packet_info_s info = websocket_buffer_peek(pos, left);
+    if (info.head_length > left)
+      break;
+    if (info.head_length + info.packet_length <= left) {
+      /* complete frames */
+      left = websocket_consume(pos, left, ws, (~(ws->is_client) & 1));
+      continue;
+    }
+    if (info.head_length + info.packet_length <= ws->buffer.size)
+      break; /* wait for the rest of the frame */
+    const uint8_t opcode = pos[0] & 15;
+    if (opcode > 2 || ((pos[0] >> 4) & 7) ||
+        (!info.masked && !ws->is_client)) {
+      /* large control frames, compressed / reserved frames, unmasked data */
+      websocket_on_protocol_error(ws);
+      ws->length = 0;
+      return;
+    }
+    if (opcode)
+      ws->is_text = (opcode == 1);
+    ws->stream_first = (opcode != 0);
+    ws->stream_fin = (pos[0] >> 7) & 1;
+    ws->stream_left = info.packet_length;
+    ws->stream_mask = 0;
+    if (info.masked) {
+      for (size_t i = 0; i < 4; ++i)
+        ((uint8_t *)(&ws->stream_mask))[i] = pos[info.head_length - 4 + i];
+    }
+    pos += info.head_length;
+    left -= info.head_length;
+  }
+  if (left && pos != (uint8_t *)ws->buffer.data)
+    memmove(ws->buffer.data, pos, left);
+  ws->length = left;
+}
+
+static void on_data_stream(intptr_t sockfd, ws_s *ws) {
+  const ssize_t len = sock_read(sockfd, (uint8_t *)ws->buffer.data + ws->length,
+                                ws->buffer.size - ws->length);
+  if (len <= 0) {
+    return;
+  }
+  ws->length += len;
+  websocket_stream_consume(ws);
+  facil_force_event(sockfd, FIO_EVENT_ON_DATA);
+}
+
+typedef struct {
+  ws_s *ws;
+  void *data;
+  uint64_t len;
+} websocket_batch_s;
+
+/* parses the data, calling `on_message` for each complete message. */
+static void websocket_consume_batch(void *b_) {
+  websocket_batch_s *b = b_;
+  b->ws->length =
+      websocket_consume(b->data, b->len, b->ws, (~(b->ws->is_client) & 1));
+}
+
+/* consumes `len` bytes, batching complete messages (see `on_batch`) */
+static void websocket_consume_buffer(ws_s *ws, void *data, uint64_t len) {
+  websocket_batch_s b = {.ws = ws, .data = data, .len = len};
+  if (ws->on_batch) {
+    struct websocket_packet_info_s info = websocket_buffer_peek(data, len);
+    if (info.head_length + info.packet_length <= len) {
+      ws->on_batch(ws, websocket_consume_batch, &b);
+      return;
+    }
+  }
+  websocket_consume_batch(&b);
+}
+
+#if WS_IDLE_COMPACT
+/* reads using the stack, allocating a buffer only for incomplete frames. */
+static void on_data_compact(intptr_t sockfd, ws_s *ws) {
+  uint8_t tmp[WS_INITIAL_BUFFER_SIZE];
+  const ssize_t len = sock_read(sockfd, tmp, WS_INITIAL_BUFFER_SIZE);
+  if (len <= 0) {
+    return;
+  }
+  websocket_consume_buffer(ws, tmp, len);
+  if (ws->length && !ws->buffer.data) {
+    ws->buffer = create_ws_buffer(ws);
+    if (!ws->buffer.data) {
+      // no memory.
+      websocket_close(ws);
+      return;
+    }
+    memcpy(ws->buffer.data, tmp, ws->length);
+  }
+  facil_force_event(sockfd, FIO_EVENT_ON_DATA);
+}
+#endif
+
 static void on_data(intptr_t sockfd, protocol_s *ws_) {
   ws_s *const ws = (ws_s *)ws_;
   if (ws == NULL || ws->protocol.service != WEBSOCKET_ID_STR)
     return;
+#if WS_IDLE_COMPACT
+  if (!ws->buffer.data) {
+    if (!ws->on_message_fragment) {
+      on_data_compact(sockfd, ws);
+      return;
+    }
+    ws->buffer = create_ws_buffer(ws);
+    if (!ws->buffer.data) {
+      // no memory.
+      websocket_close(ws);
+      return;
+    }
+  }
+#endif
+  if (ws->on_message_fragment) {
+    on_data_stream(sockfd, ws);
+    return;
+  }
   struct websocket_packet_info_s info =
       websocket_buffer_peek(ws->buffer.data, ws->length);
   const uint64_t raw_length = info.packet_length + info.head_length;
@@ -276,8 +672,7 @@ static void on_data(intptr_t sockfd, protocol_s *ws_) {
   if (len <= 0) {
     return;
   }
-  ws->length = websocket_consume(ws->buffer.data, ws->length + len, ws,
-                                 (~(ws->is_client) & 1));
+  websocket_consume_buffer(ws, ws->buffer.data, ws->length + len);
 
   facil_force_event(sockfd, FIO_EVENT_ON_DATA);
 }
@@ -290,8 +685,10 @@ static void on_data_first(intptr_t sockfd, protocol_s *ws_) {
   ws->protocol.on_ready = on_ready;
 
   if (ws->length) {
-    ws->length = websocket_consume(ws->buffer.data, ws->length, ws,
-                                   (~(ws->is_client) & 1));
+    if (ws->on_message_fragment)
+      websocket_stream_consume(ws);
+    else
+      websocket_consume_buffer(ws, ws->buffer.data, ws->length);
   }
   evio_add_write(sock_uuid2fd(sockfd), (void *)sockfd);
 
@@ -300,7 +697,9 @@ static void on_data_first(intptr_t sockfd, protocol_s *ws_) {
 
 /* later */
 static void websocket_write_impl(intptr_t fd, void *data, size_t len, char text,
-                                 char first, char last, char client);
+                                 char first, char last, char client,
+                                 unsigned char rsv);
+static void websocket_write_fiobj(ws_s *ws, FIOBJ msg, char text);
 
 /*******************************************************************************
 Create/Destroy the websocket object
@@ -333,22 +732,27 @@ static void destroy_ws(ws_s *ws) {
 }
 
 void websocket_attach(intptr_t uuid, http_settings_s *http_settings,
-                      websocket_settings_s *args, void *data, size_t length) {
+                      websocket_settings_s *args, void *data, size_t length,
+                      uint8_t deflate) {
   ws_s *ws = new_websocket(uuid);
   if (!ws) {
     perror("FATAL ERROR: couldn't allocate Websocket protocol object");
     exit(errno);
   }
   // we have an active websocket connection - prep the connection buffer
-  ws->buffer = create_ws_buffer(ws);
+  if (!WS_IDLE_COMPACT || (data && length))
+    ws->buffer = create_ws_buffer(ws);
   // Setup ws callbacks
   ws->on_open = args->on_open;
   ws->on_close = args->on_close;
   ws->on_message = args->on_message;
+  ws->on_message_fragment = args->on_message_fragment;
+  ws->on_batch = args->on_batch;
   ws->on_ready = args->on_ready;
   ws->on_shutdown = args->on_shutdown;
   // setup any user data
   ws->udata = args->udata;
+  ws->deflate = deflate;
   if (http_settings) {
     // client mode?
     ws->is_client = http_settings->is_client;
@@ -418,27 +822,65 @@ Writing to the Websocket
 #endif
 
 static void websocket_write_impl(intptr_t fd, void *data, size_t len, char text,
-                                 char first, char last, char client) {
+                                 char first, char last, char client,
+                                 unsigned char rsv) {
   if (len <= WS_MAX_FRAME_SIZE) {
     void *buff = fio_malloc(len + 16);
     len = (client ? websocket_client_wrap(buff, data, len, (text ? 1 : 2),
-                                          first, last, 0)
+                                          first, last, rsv)
                   : websocket_server_wrap(buff, data, len, (text ? 1 : 2),
-                                          first, last, 0));
+                                          first, last, rsv));
     sock_write2(.uuid = fd, .buffer = buff, .length = len, .dealloc = fio_free);
   } else {
     /* frame fragmentation is better for large data then large frames */
     while (len > WS_MAX_FRAME_SIZE) {
-      websocket_write_impl(fd, data, WS_MAX_FRAME_SIZE, text, first, 0, client);
+      websocket_write_impl(fd, data, WS_MAX_FRAME_SIZE, text, first, 0, client,
+                           rsv);
       data = ((uint8_t *)data) + WS_MAX_FRAME_SIZE;
       first = 0;
+      rsv = 0; /* only the first frame is marked */
       len -= WS_MAX_FRAME_SIZE;
     }
-    websocket_write_impl(fd, data, len, text, first, 1, client);
+    websocket_write_impl(fd, data, len, text, first, 1, client, rsv);
   }
   return;
 }
 
+/**
+ * Messages shorter than this are copied to the frame. Longer (single frame)
+ * server messages are sent without copying them (see `sock_write_fiobj_head`).
+ */
+#ifndef WS_FRAME_COPY_LIMIT
+#define WS_FRAME_COPY_LIMIT 4096
+#endif
+
+/* writes an unfragmented, unmasked, frame header. Returns the header length. */
+static size_t websocket_server_head(uint8_t *target, size_t len, char text) {
+  target[0] = 128 | (text ? 1 : 2);
+  if (len < 126) {
+    target[1] = len;
+    return 2;
+  }
+  target[1] = 126;
+  target[2] = (len >> 8) & 0xFF;
+  target[3] = len & 0xFF;
+  return 4;
+}
+
+/* writes a String to the websocket, avoiding a copy when possible. */
+static void websocket_write_fiobj(ws_s *ws, FIOBJ msg, char text) {
+  fio_cstr_s s = fiobj_obj2cstr(msg);
+  if (ws->is_client || ws->deflate || !FIOBJ_TYPE_IS(msg, FIOBJ_T_STRING) ||
+      s.len < WS_FRAME_COPY_LIMIT || s.len > WS_MAX_FRAME_SIZE ||
+      s.len >= (1UL << 16)) {
+    websocket_write(ws, s.data, s.len, text);
+    return;
+  }
+  uint8_t head[4];
+  size_t head_len = websocket_server_head(head, s.len, text);
+  sock_write_fiobj_head(ws->fd, head, head_len, msg);
+}
+
 /* *****************************************************************************
 UTF-8 testing. This part was practically copied from:
 https://stackoverflow.com/a/22135005/4025095
@@ -493,9 +935,47 @@ static const uint8_t utf8d[] = {
     1,   1,   1,   1,   1,   1,   1,   1,   1,   1, // s7..s8
 };
 
+/* returns the length of the leading ASCII (7 bit) run, in whole blocks. */
+static inline size_t utf8_ascii_prefix(uint8_t *str, size_t len) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 32 <= len; i += 32) {
+    if (_mm256_movemask_epi8(_mm256_loadu_si256((__m256i *)(str + i))))
+      return i;
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16) {
+    if (_mm_movemask_epi8(_mm_loadu_si128((__m128i *)(str + i))))
+      return i;
+  }
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__aarch64__)
+  for (; i + 16 <= len; i += 16) {
+    if (vmaxvq_u8(vld1q_u8(str + i)) & 0x80)
+      return i;
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, str + i, 8);
+    if (word & 0x8080808080808080ULL)
+      return i;
+  }
+  return i;
+}
+
 static inline uint32_t validate_utf8(uint8_t *str, size_t len) {
   uint32_t state = 0;
   while (len) {
+    if (state == UTF8_ACCEPT && !(*str & 0x80)) {
+      /* skip ASCII runs a block at a time (the state machine stays at 0) */
+      size_t skip = utf8_ascii_prefix(str, len);
+      if (skip) {
+        str += skip;
+        len -= skip;
+        continue;
+      }
+    }
     uint32_t type = utf8d[*str];
     state = utf8d[256 + state * 16 + type];
     if (state == UTF8_REJECT)
@@ -523,6 +1003,75 @@ static void websocket_on_unsubscribe(void *u1, void *u2) {
   free(d);
 }
 
+/* returns the message's payload (a String), setting an unknown (2) `txt`. */
+static FIOBJ websocket_pubsub_payload(pubsub_message_s *msg, uint8_t *txt) {
+  if (!FIOBJ_TYPE_IS(msg->message, FIOBJ_T_STRING))
+    return fiobj_obj2json(msg->message, 0);
+  if (*txt == 2) {
+    /* unknown text state */
+    fio_cstr_s tmp = fiobj_obj2cstr(msg->message);
+    *txt = (tmp.len >= (2 << 14) ? 0
+                                 : validate_utf8((uint8_t *)tmp.data, tmp.len));
+  }
+  return fiobj_dup(msg->message);
+}
+
+/* encodes a pub/sub message as a (possibly fragmented) server frame. */
+static FIOBJ websocket_pubsub_encode(pubsub_message_s *msg, uintptr_t type) {
+  uint8_t txt = (uint8_t)(type & 3);
+  uint8_t rsv = 0;
+  FIOBJ payload = websocket_pubsub_payload(msg, &txt);
+#if WS_DEFLATE
+  /* deflated frames are shared by all the `permessage-deflate` connections */
+  if ((type & 4) && fiobj_obj2cstr(payload).len >= WS_DEFLATE_MIN_SIZE) {
+    fio_cstr_s raw = fiobj_obj2cstr(payload);
+    FIOBJ compressed = websocket_deflate(raw.data, raw.len);
+    if (compressed) {
+      fiobj_free(payload);
+      payload = compressed;
+      rsv = 4;
+    }
+  }
+#endif
+  fio_cstr_s data = fiobj_obj2cstr(payload);
+  FIOBJ frame =
+      fiobj_str_buf(data.len + (((data.len / WS_MAX_FRAME_SIZE) + 1) * 10));
+  uint8_t first = 1;
+  do {
+    size_t len = data.len > WS_MAX_FRAME_SIZE ? WS_MAX_FRAME_SIZE : data.len;
+    fio_cstr_s pos = fiobj_obj2cstr(frame);
+    pos.len += websocket_server_wrap(pos.data + pos.len, data.data, len,
+                                     (txt & 1) ? 1 : 2, first,
+                                     (len == data.len), (first ? rsv : 0));
+    fiobj_str_resize(frame, pos.len);
+    data.data += len;
+    data.len -= len;
+    first = 0;
+  } while (data.len);
+  fiobj_free(payload);
+  return frame;
+}
+
+/**
+ * Writes a pub/sub message to the websocket, encoding the frame only once per
+ * message and sharing it between the message's recipients.
+ */
+int websocket_write_pubsub(ws_s *ws, pubsub_message_s *msg, uint8_t is_text) {
+  if (!sock_isvalid(ws->fd))
+    return -1;
+  FIOBJ frame = FIOBJ_INVALID;
+  /* client frames are masked, so they can't be shared */
+  if (!ws->is_client)
+    frame = pubsub_cache(msg, is_text | (ws->deflate ? 4 : 0),
+                         websocket_pubsub_encode);
+  if (frame)
+    return (int)sock_write_fiobj(ws->fd, frame);
+  FIOBJ message = websocket_pubsub_payload(msg, &is_text);
+  websocket_write_fiobj(ws, message, is_text & 1);
+  fiobj_free(message);
+  return 0;
+}
+
 static inline void
 websocket_on_pubsub_message_direct_internal(pubsub_message_s *msg,
                                             uint8_t txt) {
@@ -534,24 +1083,8 @@ websocket_on_pubsub_message_direct_internal(pubsub_message_s *msg,
     pubsub_defer(msg);
     return;
   }
-  FIOBJ message;
-  fio_cstr_s tmp;
-  if (FIOBJ_TYPE_IS(msg->message, FIOBJ_T_STRING)) {
-    message = fiobj_dup(msg->message);
-    tmp = fiobj_obj2cstr(message);
-    if (txt == 2) {
-      /* unknown text state */
-      txt =
-          (tmp.len >= (2 << 14) ? 0
-                                : validate_utf8((uint8_t *)tmp.data, tmp.len));
-    }
-  } else {
-    message = fiobj_obj2json(msg->message, 0);
-    tmp = fiobj_obj2cstr(message);
-  }
-  websocket_write((ws_s *)pr, tmp.data, tmp.len, txt & 1);
+  websocket_write_pubsub((ws_s *)pr, msg, txt);
   facil_protocol_unlock(pr, FIO_PR_LOCK_WRITE);
-  fiobj_free(message);
 }
 
 static void websocket_on_pubsub_message_direct(pubsub_message_s *msg) {
@@ -599,18 +1132,28 @@ uintptr_t websocket_subscribe(struct websocket_subscribe_s args) {
                               .on_message = args.on_message,
                               .on_unsubscribe = args.on_unsubscribe};
 
-  pubsub_sub_pt sub = pubsub_subscribe(
-          .channel = args.channel, .use_pattern = args.use_pattern,
-          .on_unsubscribe = websocket_on_unsubscribe,
-          .on_message =
-              (args.on_message
-                   ? websocket_on_pubsub_message
-                   : args.force_binary
-                         ? websocket_on_pubsub_message_direct_bin
-                         : args.force_text
-                               ? websocket_on_pubsub_message_direct_txt
-                               : websocket_on_pubsub_message_direct),
-          .udata1 = (void *)args.ws->fd, .udata2 = d);
+  struct pubsub_subscribe_args sub_args = {
+      .channel = args.channel,
+      .use_pattern = args.use_pattern,
+      .on_unsubscribe = websocket_on_unsubscribe,
+      .on_message = (args.on_message
+                         ? websocket_on_pubsub_message
+                         : args.force_binary
+                               ? websocket_on_pubsub_message_direct_bin
+                               : args.force_text
+                                     ? websocket_on_pubsub_message_direct_txt
+                                     : websocket_on_pubsub_message_direct),
+      .udata1 = (void *)args.ws->fd,
+      .udata2 = d,
+      .delivery = args.delivery,
+      .uuid = args.ws->fd,
+      .limit = args.limit,
+      .channels = args.channels,
+      .count = args.count,
+  };
+  /* (parenthesized to avoid the named arguments macros) */
+  pubsub_sub_pt sub = (args.channels ? (pubsub_subscribe_group)(sub_args)
+                                     : (pubsub_subscribe)(sub_args));
   if (!sub) {
     free(d);
     return 0;
@@ -676,7 +1219,19 @@ void *websocket_udata_set(ws_s *ws, void *udata) {
 /** Writes data to the websocket. Returns -1 on failure (0 on success). */
 int websocket_write(ws_s *ws, void *data, size_t size, uint8_t is_text) {
   if (sock_isvalid(ws->fd)) {
-    websocket_write_impl(ws->fd, data, size, is_text, 1, 1, ws->is_client);
+#if WS_DEFLATE
+    if (ws->deflate && size >= WS_DEFLATE_MIN_SIZE) {
+      FIOBJ compressed = websocket_deflate(data, size);
+      if (compressed) {
+        fio_cstr_s s = fiobj_obj2cstr(compressed);
+        websocket_write_impl(ws->fd, s.data, s.len, is_text, 1, 1,
+                             ws->is_client, 4);
+        fiobj_free(compressed);
+        return 0;
+      }
+    }
+#endif
+    websocket_write_impl(ws->fd, data, size, is_text, 1, 1, ws->is_client, 0);
     return 0;
   }
   return -1;
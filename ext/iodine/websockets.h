@@ -8,6 +8,7 @@ Feel free to copy, use and enjoy according to the license provided.
 #define H_WEBSOCKETS_H
 
 #include "http.h"
+#include "pubsub.h"
 
 /* support C++ */
 #ifdef __cplusplus
@@ -19,9 +20,20 @@ The protocol / service identifier.
 */
 extern char *WEBSOCKET_ID_STR;
 
-/** used internally: attaches the Websocket protocol to the socket. */
+/**
+ * used internally: attaches the Websocket protocol to the socket.
+ *
+ * Set `deflate` if the `permessage-deflate` extension was negotiated.
+ */
 void websocket_attach(intptr_t uuid, http_settings_s *http_settings,
-                      websocket_settings_s *args, void *data, size_t length);
+                      websocket_settings_s *args, void *data, size_t length,
+                      uint8_t deflate);
+
+/**
+ * used internally: returns 1 if the `sec-websocket-extensions` header offers a
+ * `permessage-deflate` configuration we accept (see `ws_deflate`), else 0.
+ */
+uint8_t websocket_deflate_accept(FIOBJ extensions);
 
 /* *****************************************************************************
 Websocket information
@@ -56,6 +68,20 @@ Websocket Connection Management (write / close)
 
 /** Writes data to the websocket. Returns -1 on failure (0 on success). */
 int websocket_write(ws_s *ws, void *data, size_t size, uint8_t is_text);
+
+/**
+ * Writes a pub/sub message to the websocket. Returns -1 on failure (0 on
+ * success).
+ *
+ * The websocket frame is encoded only once per message and shared between all
+ * the message's recipients (UTF-8 validation is performed only once as well).
+ *
+ * Set `is_text` to 2 to test the message for UTF-8 validity (binary messages
+ * are sent when the test fails).
+ *
+ * This should only be called from within a pub/sub `on_message` callback.
+ */
+int websocket_write_pubsub(ws_s *ws, pubsub_message_s *msg, uint8_t is_text);
 /** Closes a websocket connection. */
 void websocket_close(ws_s *ws);
 
@@ -131,6 +157,24 @@ struct websocket_subscribe_s {
    *
    */
   unsigned force_text : 1;
+  /**
+   * How messages are delivered once the websocket's outgoing queue backs up
+   * (see `pubsub_delivery_e`): every message (the default), only the latest
+   * message, dropping the oldest messages or closing the connection.
+   */
+  pubsub_delivery_e delivery;
+  /**
+   * The maximum number of messages held while the websocket is backed up
+   * (see `delivery`). Defaults to PUBSUB_SLOW_CONSUMER_LIMIT.
+   */
+  size_t limit;
+  /**
+   * When set, subscribes to `count` channels using a single subscription (see
+   * `pubsub_subscribe_group`) and `channel` is ignored.
+   */
+  FIOBJ *channels;
+  /** The number of channels in `channels`. */
+  size_t count;
 };
 
 /**
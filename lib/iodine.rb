@@ -49,7 +49,7 @@ require 'iodine/iodine'
 #
 # Methods for TCP/IP and Unix Sockets connections include {listen} and {connect}.
 #
-# Methods for HTTP connections include {listen2http}.
+# Methods for HTTP connections include {listen2http} and {Iodine::HTTP.request} (a non-blocking HTTP client).
 #
 # Note that the HTTP server supports both TCP/IP and Unix Sockets as well as SSE / WebSockets extensions.
 #
@@ -88,6 +88,15 @@ end
 if ARGV.index('-maxbd') && ARGV[ARGV.index('-maxbd') + 1]
   Iodine::DEFAULT_HTTP_ARGS[:max_body_size] = ARGV[ARGV.index('-maxbd') + 1].to_i
 end
+if ARGV.index('-stream_body') && ARGV[ARGV.index('-stream_body') + 1]
+  Iodine::DEFAULT_HTTP_ARGS[:stream_body] = ARGV[ARGV.index('-stream_body') + 1].to_i
+end
+if ARGV.index('-tls_cert') && ARGV[ARGV.index('-tls_cert') + 1]
+  Iodine::DEFAULT_HTTP_ARGS[:tls_cert] = ARGV[ARGV.index('-tls_cert') + 1]
+end
+if ARGV.index('-tls_key') && ARGV[ARGV.index('-tls_key') + 1]
+  Iodine::DEFAULT_HTTP_ARGS[:tls_key] = ARGV[ARGV.index('-tls_key') + 1]
+end
 if ARGV.index('-maxms') && ARGV[ARGV.index('-maxms') + 1]
   Iodine::DEFAULT_HTTP_ARGS[:max_msg_size] = ARGV[ARGV.index('-maxms') + 1].to_i
 end
@@ -105,6 +114,13 @@ if ARGV.index('-tout') && ARGV[ARGV.index('-tout') + 1]
   puts "WARNNING: timeout set to 0 (ignored, timeout will be ~5 seconds)." if (Iodine::DEFAULT_HTTP_ARGS[:timeout].to_i <= 0 || Iodine::DEFAULT_HTTP_ARGS[:timeout].to_i > 255)
 end
 Iodine::DEFAULT_HTTP_ARGS[:log] = true if ARGV.index('-v')
+Iodine::DEFAULT_HTTP_ARGS[:deflate] = true if ARGV.index('-deflate')
+Iodine::DEFAULT_HTTP_ARGS[:lazy_env] = true if ARGV.index('-lazy_env')
+Iodine::DEFAULT_HTTP_ARGS[:ractor] = true if ARGV.index('-ractor')
+Iodine::DEFAULT_HTTP_ARGS[:fiber] = true if ARGV.index('-fiber')
+if ARGV.index('-gvl_batch') && ARGV[ARGV.index('-gvl_batch') + 1]
+  Iodine::DEFAULT_HTTP_ARGS[:gvl_batch] = ARGV[ARGV.index('-gvl_batch') + 1].to_i
+end
 
 if ARGV.index('-t') && ARGV[ARGV.index('-t') + 1].to_i != 0
   Iodine.threads = ARGV[ARGV.index('-t') + 1].to_i
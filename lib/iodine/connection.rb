@@ -12,6 +12,16 @@ module Iodine
   #       def on_message client, data
   #          client.is_a?(Iodine::Connection) # => true
   #       end
+  #       # (optional, WebSockets) streams incoming messages instead of `on_message`,
+  #       # `data` arrives in parts as it's received (large messages aren't buffered)
+  #       def on_message_fragment client, data, first, last
+  #          client.is_a?(Iodine::Connection) # => true
+  #       end
+  #       # (optional, WebSockets) called instead of `on_message` with an Array of
+  #       # all the messages that arrived together (one method call per batch)
+  #       def on_messages client, messages
+  #          messages.is_a?(Array) # => true
+  #       end
   #       # called when the server is shutting down, before closing the client
   #       # (it's still possible to send messages to the client)
   #       def on_shutdown client
@@ -31,6 +41,16 @@ module Iodine
   #     end
   #
   # All connection related actions can be performed using the methods provided through this class.
+  #
+  # Slow clients can be limited using write backpressure watermarks (in bytes), i.e.:
+  #
+  #     # the default for new connections
+  #     Iodine::Connection.backpressure = {high: 4_194_304, low: 1_048_576, policy: :drop}
+  #     # a specific connection
+  #     client.backpressure = {high: 65_536, policy: :block}
+  #
+  # Once `high` is exceeded, `write` returns `false` (`:drop`), blocks until `low` is reached (`:block`)
+  # or closes the connection (`:close`). Pub/Sub messages forwarded to slow clients are skipped.
 	class Connection
 	end
 end
@@ -0,0 +1,83 @@
+require 'test_helper'
+require 'timeout'
+
+# Tests the `balance:` option of `Iodine.listen2http` (connection migration).
+class BalanceTest < Minitest::Test
+  # greets with the worker's pid, then echoes messages (prefixed by the pid)
+  class Echo
+    def on_open(client)
+      client.write Process.pid.to_s
+    end
+
+    def on_message(client, data)
+      client.write "#{Process.pid}:#{data}"
+    end
+  end
+
+  PORT = IodineTestServer.start(workers: 2) do |port|
+    app = proc do |env|
+      env['rack.upgrade'] = Echo.new if env['rack.upgrade?'] == :websocket
+      [200, {}, ['not a websocket']]
+    end
+    Iodine.listen2http(app: app, port: port, balance: 1)
+  end
+  sleep 1.5 # the workers learn each other's load once they share statistics
+
+  # a minimal WebSocket client
+  class Client
+    def initialize(port)
+      @socket = TCPSocket.new('127.0.0.1', port)
+      @socket.write "GET / HTTP/1.1\r\nHost: localhost\r\n" \
+                    "Upgrade: websocket\r\nConnection: Upgrade\r\n" \
+                    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n" \
+                    "Sec-WebSocket-Version: 13\r\n\r\n"
+      status = @socket.gets
+      raise "WebSocket upgrade failed: #{status}" unless status.include?('101')
+      nil until @socket.gets == "\r\n"
+    end
+
+    def write(text)
+      mask = Random.bytes(4).bytes
+      data = text.bytes.each_with_index.map { |b, i| b ^ mask[i % 4] }
+      @socket.write [0x81, 0x80 | text.bytesize, *mask, *data].pack('C*')
+    end
+
+    def read
+      Timeout.timeout(5) do
+        _, len = @socket.read(2).unpack('CC')
+        len = @socket.read(2).unpack1('n') if len == 126
+        @socket.read(len)
+      end
+    end
+
+    def close
+      @socket.close
+    end
+  end
+
+  # opens WebSocket connections, returns [client, worker pid] pairs
+  def connect(count)
+    clients = Array.new(count) { Client.new(PORT) }
+    clients.map { |c| [c, c.read] }
+  end
+
+  def test_new_connections_go_to_the_less_busy_worker
+    # keep only the connections of one worker (the busy one)
+    connections = connect(12)
+    load = connections.map(&:last).tally
+    assert_equal 2, load.size, 'a single worker accepted all the connections'
+    idle = load.min_by(&:last).first
+    connections.each { |c, pid| c.close if pid == idle }
+    sleep 1.5 # the idle worker reports its new load
+    fresh = connect(4)
+    assert_equal [idle] * 4, fresh.map(&:last), 'connections went to the busy worker'
+    # migrated connections keep working with the worker they were handed to
+    fresh.each_with_index do |(client, pid), i|
+      client.write "ping #{i}"
+      assert_equal "#{pid}:ping #{i}", client.read
+    end
+  ensure
+    connections&.each { |c, _| c.close }
+    fresh&.each { |c, _| c.close }
+  end
+end
@@ -0,0 +1,38 @@
+require 'test_helper'
+
+# Tests the `fiber:` option of `Iodine.listen2http` (Iodine::Scheduler).
+class FiberSchedulerTest < Minitest::Test
+  # `/read` blocks until `/write` sends a byte (both on a single thread)
+  PORT = IodineTestServer.start(threads: 1) do |port|
+    reader, writer = IO.pipe
+    reader.timeout = 2 # without Fibers, `/read` would block `/write` forever
+    app = proc do |env|
+      case env['PATH_INFO']
+      when '/read' then [200, {}, [reader.read(1)]]
+      when '/write' then writer.write('x') && [200, {}, ['written']]
+      when '/sleep' then sleep(0.5) && [200, {}, ['slept']]
+      else [404, {}, ['not found']]
+      end
+    end
+    Iodine.listen2http(app: app, port: port, fiber: true)
+  end
+
+  def get(path)
+    Net::HTTP.start('127.0.0.1', PORT, read_timeout: 5) { |h| h.get(path) }
+  end
+
+  def test_blocking_read_yields_the_thread
+    reading = Thread.new { get('/read') }
+    sleep 0.2 # the reading request waits on the server's only thread
+    assert_equal 'written', get('/write').body
+    assert_equal 'x', reading.value.body
+  end
+
+  def test_sleep_yields_the_thread
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    responses = Array.new(4) { Thread.new { get('/sleep') } }.map(&:value)
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    assert_equal ['slept'] * 4, responses.map(&:body)
+    assert_operator elapsed, :<, 1.5, 'sleeping requests ran one at a time'
+  end
+end
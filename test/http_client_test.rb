@@ -0,0 +1,49 @@
+require 'test_helper'
+require 'timeout'
+
+# Tests Iodine::HTTP.request (the pooled HTTP client).
+class HTTPClientTest < Minitest::Test
+  # a keep-alive HTTP/1.1 backend, recording its connections and requests
+  BACKEND = TCPServer.new('127.0.0.1', 0)
+  CONNECTIONS = Queue.new
+  REQUESTS = Queue.new
+
+  Thread.new do
+    loop do
+      client = BACKEND.accept
+      CONNECTIONS << client
+      Thread.new do
+        while (line = client.gets)
+          nil until ["\r\n", nil].include?(client.gets) # skip the headers
+          REQUESTS << line.split(' ')[1]
+          client.write "HTTP/1.1 200 OK\r\ncontent-length: 2\r\n\r\nok"
+        end
+      end
+    end
+  end
+
+  # `/fetch` sends three sequential requests, each reporting the last response
+  PORT = IodineTestServer.start do |port|
+    backend = "http://127.0.0.1:#{BACKEND.addr[1]}"
+    app = proc do
+      Iodine::HTTP.request("#{backend}/first") do |s1, _, b1|
+        Iodine::HTTP.request("#{backend}/second?#{s1}=#{b1}") do |s2, _, b2|
+          Iodine::HTTP.request("#{backend}/third?#{s2}=#{b2}") {}
+        end
+      end
+      [202, {}, ['fetching']]
+    end
+    Iodine.listen2http(app: app, port: port)
+  end
+
+  def pop(queue)
+    Timeout.timeout(5) { queue.pop }
+  end
+
+  def test_sequential_requests_reuse_the_connection
+    assert_equal '202', Net::HTTP.get_response('127.0.0.1', '/fetch', PORT).code
+    assert_equal %w[/first /second?200=ok /third?200=ok], Array.new(3) { pop(REQUESTS) }
+    pop(CONNECTIONS)
+    assert CONNECTIONS.empty?, 'the requests used more than one connection'
+  end
+end
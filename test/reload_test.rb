@@ -0,0 +1,65 @@
+require 'test_helper'
+require 'rbconfig'
+require 'tempfile'
+
+# Tests the graceful reload (SIGUSR2). A reload re-runs the server's command
+# line, so the server is a separate script rather than a fork.
+class ReloadTest < Minitest::Test
+  SERVER = <<~RUBY
+    require 'iodine'
+    Iodine.listen2http(app: proc { [200, {}, [Process.pid.to_s]] }, port: ARGV[0])
+    Iodine.threads = 1
+    Iodine.workers = 1
+    Iodine.start
+  RUBY
+
+  def setup
+    @script = Tempfile.new(['reload_server', '.rb'])
+    @script.write SERVER
+    @script.flush
+    @port = TCPServer.open('127.0.0.1', 0) { |s| s.addr[1] }
+    err = ENV['VERBOSE'] ? $stderr : File::NULL
+    @pid = Process.spawn({ 'RUBYLIB' => $LOAD_PATH.join(File::PATH_SEPARATOR) },
+                         RbConfig.ruby, @script.path, @port.to_s,
+                         pgroup: true, out: File::NULL, err: err)
+  end
+
+  def teardown
+    [@pid, @reloaded].compact.each do |pid|
+      Process.kill(:INT, pid)
+    rescue SystemCallError
+      nil
+    end
+    Process.wait(@pid) rescue nil
+    # the new generation isn't a child process, wait until it's gone
+    100.times { Process.kill(0, @reloaded) && sleep(0.1) } if @reloaded
+  rescue Errno::ESRCH
+    nil
+  ensure
+    @script.close!
+  end
+
+  # returns the pid of the process that answered
+  def serving_pid
+    res = Net::HTTP.get_response('127.0.0.1', '/', @port)
+    assert_equal '200', res.code, "the reloading server responded: #{res.body}"
+    Integer(res.body)
+  end
+
+  def test_reload_keeps_accepting_connections
+    first = nil
+    100.times do
+      first = (serving_pid rescue nil) and break
+      sleep 0.05
+    end
+    refute_nil first, "the server didn't start"
+    Process.kill(:USR2, @pid)
+    Timeout.timeout(10) do
+      # every request is answered, by either generation
+      @reloaded = serving_pid while [nil, first].include?(@reloaded)
+    end
+    # the old generation stops once the new one runs
+    Timeout.timeout(10) { Process.wait(@pid) }
+    assert_equal @reloaded, serving_pid
+  end
+end
@@ -0,0 +1,193 @@
+require 'test_helper'
+
+# Tests the `cache:` option of `Iodine.listen2http` (the response cache).
+class ResponseCacheTest < Minitest::Test
+  # a body enumerated using `each`, long enough to be streamed
+  class StreamedBody
+    def each
+      2.times { yield 'x' * 40_000 }
+    end
+  end
+
+  CALLS = Hash.new(0)
+
+  APP = proc do |env|
+    path = env['PATH_INFO']
+    count = (CALLS["#{env['REQUEST_METHOD']} #{path}"] += 1)
+    headers = { 'cache-control' => 'max-age=60', 'x-calls' => count.to_s }
+    status = 200
+    body = ['ok']
+    case path
+    when '/expires' then headers['cache-control'] = 'max-age=1'
+    when '/s-maxage' then headers['cache-control'] = 'max-age=0, s-maxage=60'
+    when '/private' then headers['cache-control'] = 'private, max-age=60'
+    when '/no-store' then headers['cache-control'] = 'no-store, max-age=60'
+    when '/uncontrolled' then headers.delete('cache-control')
+    when '/cookie' then headers['set-cookie'] = 'id=1'
+    when '/created' then status = 201
+    when '/streamed' then body = StreamedBody.new
+    end
+    [status, headers, body]
+  end
+
+  PORT = IodineTestServer.start do |port|
+    Iodine.listen2http(app: APP, port: port, cache: ['accept-language'])
+  end
+
+  # returns the number of times the app was called (the response's `x-calls`)
+  def calls(path, method: Net::HTTP::Get, headers: {})
+    res = Net::HTTP.start('127.0.0.1', PORT) do |http|
+      http.request(method.new(path, headers))
+    end
+    res['x-calls'].to_i
+  end
+
+  def assert_cached(path, **opt)
+    first = calls(path, **opt)
+    assert_equal first, calls(path, **opt), "#{path} wasn't cached"
+  end
+
+  def refute_cached(path, **opt)
+    first = calls(path, **opt)
+    assert_equal first + 1, calls(path, **opt), "#{path} was cached"
+  end
+
+  def test_cached
+    assert_cached '/cached'
+    assert_cached '/s-maxage'
+  end
+
+  def test_key_includes_query
+    assert_equal 1, calls('/query?a')
+    assert_equal 1, calls('/query?a')
+    assert_equal 2, calls('/query?b')
+    assert_equal 1, calls('/query?a')
+  end
+
+  def test_key_includes_host_and_listed_headers
+    assert_equal 1, calls('/host', headers: { 'Host' => 'a.example' })
+    assert_equal 2, calls('/host', headers: { 'Host' => 'b.example' })
+    assert_equal 1, calls('/host', headers: { 'Host' => 'a.example' })
+    assert_equal 1, calls('/vary', headers: { 'Accept-Language' => 'en' })
+    assert_equal 2, calls('/vary', headers: { 'Accept-Language' => 'fr' })
+    assert_equal 1, calls('/vary', headers: { 'Accept-Language' => 'en' })
+  end
+
+  def test_expiry
+    assert_cached '/expires'
+    sleep 2.1
+    assert_equal 2, calls('/expires')
+  end
+
+  def test_not_cached_by_cache_control
+    refute_cached '/private'
+    refute_cached '/no-store'
+    refute_cached '/uncontrolled'
+  end
+
+  def test_not_cached_with_cookies_or_status
+    refute_cached '/cookie'
+    refute_cached '/created'
+  end
+
+  def test_streamed_body_not_cached
+    refute_cached '/streamed'
+  end
+
+  def test_non_get_not_cached
+    assert_cached '/post'
+    refute_cached '/post', method: Net::HTTP::Post
+    refute_cached '/head', method: Net::HTTP::Head
+  end
+
+  def test_authorization_not_cached
+    refute_cached '/auth', headers: { 'Authorization' => 'Basic YTpi' }
+  end
+end
+
+# Tests concurrent requests for a pending response (request coalescing).
+class ResponseCacheCoalescingTest < Minitest::Test
+  CALLS = Hash.new(0)
+  LOCK = Mutex.new
+
+  # the first call for each path is slow, so other requests wait for it
+  APP = proc do |env|
+    path = env['PATH_INFO']
+    count = LOCK.synchronize { CALLS[path] += 1 }
+    headers = { 'cache-control' => 'max-age=60', 'x-calls' => count.to_s }
+    status = 200
+    if count == 1
+      sleep 0.5
+      case path
+      when '/raise' then raise 'leader failed'
+      when '/unavailable' then status = 503
+      when '/private' then headers['cache-control'] = 'private'
+      when '/clear' then Iodine.clear_http_cache
+      end
+    end
+    [status, headers, ['ok']]
+  end
+
+  PORT = IodineTestServer.start(threads: 4) do |port|
+    Iodine.listen2http(app: APP, port: port, cache: true)
+  end
+
+  def get(path)
+    Net::HTTP.start('127.0.0.1', PORT, read_timeout: 5) do |http|
+      http.request(Net::HTTP::Get.new(path))
+    end
+  end
+
+  # requests `path` once and then `count` more times while the first request
+  # is handled. Returns the leader's response and the waiters' responses.
+  def coalesced(path, count = 3)
+    leader = Thread.new { get(path) }
+    sleep 0.2
+    waiters = Array.new(count) { Thread.new { get(path) } }
+    [leader.value, waiters.map(&:value)]
+  end
+
+  def test_waiters_receive_the_response
+    leader, waiters = coalesced('/cached')
+    assert_equal '200', leader.code
+    waiters.each do |res|
+      assert_equal ['200', '1', 'ok'], [res.code, res['x-calls'], res.body]
+    end
+  end
+
+  def test_waiters_resume_when_leader_raises
+    leader, waiters = coalesced('/raise')
+    assert_equal '500', leader.code
+    assert_equal %w[2 3 4], waiters.map { |res| res['x-calls'] }.sort
+    waiters.each { |res| assert_equal '200', res.code }
+  end
+
+  def test_waiters_resume_when_response_is_not_cacheable
+    %w[/unavailable /private].each do |path|
+      leader, waiters = coalesced(path)
+      assert_equal '1', leader['x-calls']
+      assert_equal %w[2 3 4], waiters.map { |res| res['x-calls'] }.sort
+      waiters.each { |res| assert_equal '200', res.code }
+    end
+  end
+
+  def test_waiting_client_disconnects
+    leader = Thread.new { get('/disconnect') }
+    sleep 0.2
+    gone = TCPSocket.new('127.0.0.1', PORT)
+    gone.write("GET /disconnect HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n")
+    waiter = Thread.new { get('/disconnect') }
+    sleep 0.1
+    gone.close
+    assert_equal '1', leader.value['x-calls']
+    assert_equal '1', waiter.value['x-calls']
+    assert_equal '1', get('/disconnect')['x-calls']
+  end
+
+  def test_cache_clear_while_pending
+    leader, waiters = coalesced('/clear')
+    assert_equal '1', leader['x-calls']
+    waiters.each { |res| assert_equal ['200', '1'], [res.code, res['x-calls']] }
+    assert_equal '1', get('/clear')['x-calls']
+  end
+end
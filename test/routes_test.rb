@@ -0,0 +1,96 @@
+require 'test_helper'
+require 'tempfile'
+require 'tmpdir'
+
+# Tests the `routes:` option of `Iodine.listen2http`.
+class RoutesTest < Minitest::Test
+  PUBLIC = Dir.mktmpdir('iodine_routes')
+  File.write(File.join(PUBLIC, 'index.html'), 'index')
+  File.write(File.join(PUBLIC, 'a.txt'), 'file a')
+  File.write(File.join(PUBLIC, 'data.json'), '{"file":true}')
+
+  APP = proc { |env| [200, {}, ["app #{env['PATH_INFO']}"]] }
+  API = proc { |env| [200, {}, ["api #{env['PATH_INFO']} #{env['QUERY_STRING']}"]] }
+
+  PORT = IodineTestServer.start do |port|
+    Iodine.listen2http(app: APP, port: port, routes: {
+      '/health' => [200, { 'X-Health' => 'ok' }, 'OK'],
+      '/static*' => { public: PUBLIC },
+      '/static/special' => [202, {}, 'special'],
+      '/data' => { file: File.join(PUBLIC, 'data.json') },
+      '/api/*' => API,
+      '/api/v2*' => [503, {}, 'v2 down'],
+    })
+  end
+
+  def request(path, method = Net::HTTP::Get)
+    Net::HTTP.start('127.0.0.1', PORT) { |http| http.request(method.new(path)) }
+  end
+
+  def test_canned_response
+    res = request('/health')
+    assert_equal ['200', 'OK', 'ok'], [res.code, res.body, res['X-Health']]
+    assert_equal 'OK', request('/health?x=1').body
+  end
+
+  def test_canned_response_head
+    res = request('/health', Net::HTTP::Head)
+    assert_equal ['200', '2'], [res.code, res['Content-Length']]
+    assert_nil res.body
+  end
+
+  def test_exact_route_precedes_prefix
+    res = request('/static/special')
+    assert_equal ['202', 'special'], [res.code, res.body]
+  end
+
+  def test_public_folder
+    assert_equal 'file a', request('/static/a.txt').body
+    assert_equal 'index', request('/static/').body
+    assert_equal '404', request('/static/missing').code
+  end
+
+  def test_file
+    res = request('/data')
+    assert_equal ['200', '{"file":true}'], [res.code, res.body]
+  end
+
+  def test_longest_prefix
+    assert_equal ['503', 'v2 down'], [request('/api/v2/x').code, request('/api/v2').body]
+    assert_equal 'api /api/v20 ', request('/api/v20').body
+    assert_equal 'api /api/x q=1', request('/api/x?q=1').body
+    assert_equal 'api /api ', request('/api').body
+  end
+
+  def test_prefix_matches_whole_segments
+    assert_equal 'app /apix', request('/apix').body
+    assert_equal 'app /staticfile', request('/staticfile').body
+  end
+
+  # the number of Ruby objects kept alive for the C code (see IodineStore)
+  def protected_objects
+    Tempfile.create('iodine_store') do |f|
+      err = $stderr.dup
+      $stderr.reopen(f)
+      Iodine::Base.db_print_protected_objects
+      $stderr.reopen(err)
+      f.rewind
+      f.read[/Total of (\d+) objects/, 1].to_i
+    end
+  end
+
+  def test_invalid_routes_release_the_service
+    before = protected_objects
+    assert_raises(ArgumentError) do
+      Iodine.listen2http(app: APP, port: 0, upgrade: { '/ws' => APP },
+                         routes: { 'health' => [200, {}, 'OK'] })
+    end
+    assert_equal before, protected_objects
+  end
+
+  def test_fallthrough_to_app
+    assert_equal 'app /', request('/').body
+    assert_equal 'app /other', request('/other').body
+    assert_equal 'app /healthz', request('/healthz').body
+  end
+end
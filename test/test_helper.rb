@@ -2,3 +2,36 @@ $LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
 
 require 'iodine'
 require 'minitest/autorun'
+require 'net/http'
+require 'socket'
+
+# Runs an Iodine server in a child process, so tests can make real requests.
+module IodineTestServer
+  # Forks a server (the block sets up the listening services) and waits until
+  # it accepts connections. Returns the port. The server stops after the tests.
+  def self.start(threads: 1, workers: 1, &setup)
+    port = TCPServer.open('127.0.0.1', 0) { |s| s.addr[1] }
+    pid = fork do
+      Process.setpgid(0, 0) # Iodine signals its process group when stopping
+      $stderr.reopen(File::NULL, 'w') unless ENV['VERBOSE']
+      setup.call(port.to_s)
+      Iodine.threads = threads
+      Iodine.workers = workers
+      Iodine.start
+      exit!(0)
+    end
+    Minitest.after_run do
+      Process.kill(:INT, pid)
+      Process.wait(pid)
+    end
+    100.times do
+      begin
+        TCPSocket.new('127.0.0.1', port).close
+        return port
+      rescue SystemCallError
+        sleep 0.05
+      end
+    end
+    raise "Iodine test server didn't start"
+  end
+end